@@ -25,6 +25,15 @@
 static DEFINE_SPINLOCK(blkio_list_lock);
 static LIST_HEAD(blkio_list);
 
+/*
+ * Groups are added from atomic context, so their per-cpu stats are
+ * allocated later by blkio_stats_alloc_work.
+ */
+static DEFINE_SPINLOCK(blkio_stats_alloc_lock);
+static LIST_HEAD(blkio_stats_alloc_list);
+static void blkio_stats_alloc_fn(struct work_struct *work);
+static DECLARE_WORK(blkio_stats_alloc_work, blkio_stats_alloc_fn);
+
 struct blkio_cgroup blkio_root_cgroup = { .weight = 2*BLKIO_WEIGHT_DEFAULT };
 EXPORT_SYMBOL_GPL(blkio_root_cgroup);
 
@@ -86,9 +95,78 @@ struct blkio_cgroup *cgroup_to_blkio_cgroup(struct cgroup *cgroup)
 }
 EXPORT_SYMBOL_GPL(cgroup_to_blkio_cgroup);
 
+static void blkio_stats_alloc_fn(struct work_struct *work)
+{
+	struct blkio_group_stats_cpu __percpu *stats_cpu;
+	struct blkio_group *blkg;
+
+	do {
+		stats_cpu = alloc_percpu(struct blkio_group_stats_cpu);
+		if (!stats_cpu)
+			return;
+
+		spin_lock_irq(&blkio_stats_alloc_lock);
+		blkg = NULL;
+		if (!list_empty(&blkio_stats_alloc_list))
+			blkg = list_first_entry(&blkio_stats_alloc_list,
+					struct blkio_group, alloc_node);
+		if (blkg) {
+			list_del_init(&blkg->alloc_node);
+			/* pairs with smp_read_barrier_depends() of the updaters */
+			smp_wmb();
+			blkg->stats_cpu = stats_cpu;
+			stats_cpu = NULL;
+		}
+		spin_unlock_irq(&blkio_stats_alloc_lock);
+	} while (blkg);
+
+	free_percpu(stats_cpu);
+}
+
+/*
+ * Get the local cpu stats of @blkg, with irqs disabled, or NULL if they
+ * are not allocated yet and the locked stats have to be used.
+ */
+static struct blkio_group_stats_cpu *
+blkio_get_stats_cpu(struct blkio_group *blkg, unsigned long *flags)
+{
+	struct blkio_group_stats_cpu __percpu *stats_cpu;
+
+	stats_cpu = ACCESS_ONCE(blkg->stats_cpu);
+	if (!stats_cpu)
+		return NULL;
+	smp_read_barrier_depends();
+
+	local_irq_save(*flags);
+	return this_cpu_ptr(stats_cpu);
+}
+
+/* Sum of a per-cpu stat of @blkg; may be slightly off while it is updated */
+static uint64_t blkio_read_stat_cpu(struct blkio_group *blkg,
+				    enum stat_type type,
+				    enum stat_sub_type sub_type)
+{
+	struct blkio_group_stats_cpu *stats_cpu;
+	uint64_t val = 0;
+	int cpu;
+
+	if (!blkg->stats_cpu)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		stats_cpu = per_cpu_ptr(blkg->stats_cpu, cpu);
+		if (type == BLKIO_STAT_SECTORS)
+			val += stats_cpu->sectors;
+		else
+			val += stats_cpu->stat_arr_cpu[type][sub_type];
+	}
+	return val;
+}
+
 /*
  * Add to the appropriate stat variable depending on the request type.
- * This should be called with the blkg->stats_lock held.
+ * This should be called with the blkg->stats_lock held, or on the local
+ * cpu stats with irqs disabled.
  */
 static void blkio_add_stat(uint64_t *stat, uint64_t add, bool direction,
 				bool sync)
@@ -295,9 +373,21 @@ EXPORT_SYMBOL_GPL(blkiocg_update_timeslice_used);
 void blkiocg_update_dispatch_stats(struct blkio_group *blkg,
 				uint64_t bytes, bool direction, bool sync)
 {
+	struct blkio_group_stats_cpu *stats_cpu;
 	struct blkio_group_stats *stats;
 	unsigned long flags;
 
+	stats_cpu = blkio_get_stats_cpu(blkg, &flags);
+	if (stats_cpu) {
+		stats_cpu->sectors += bytes >> 9;
+		blkio_add_stat(stats_cpu->stat_arr_cpu[BLKIO_STAT_SERVICED],
+				1, direction, sync);
+		blkio_add_stat(stats_cpu->stat_arr_cpu[BLKIO_STAT_SERVICE_BYTES],
+				bytes, direction, sync);
+		local_irq_restore(flags);
+		return;
+	}
+
 	spin_lock_irqsave(&blkg->stats_lock, flags);
 	stats = &blkg->stats;
 	stats->sectors += bytes >> 9;
@@ -312,27 +402,45 @@ EXPORT_SYMBOL_GPL(blkiocg_update_dispatch_stats);
 void blkiocg_update_completion_stats(struct blkio_group *blkg,
 	uint64_t start_time, uint64_t io_start_time, bool direction, bool sync)
 {
-	struct blkio_group_stats *stats;
+	struct blkio_group_stats_cpu *stats_cpu;
+	uint64_t (*stat_arr)[BLKIO_STAT_TOTAL];
 	unsigned long flags;
 	unsigned long long now = sched_clock();
 
-	spin_lock_irqsave(&blkg->stats_lock, flags);
-	stats = &blkg->stats;
+	stats_cpu = blkio_get_stats_cpu(blkg, &flags);
+	if (stats_cpu)
+		stat_arr = stats_cpu->stat_arr_cpu;
+	else {
+		spin_lock_irqsave(&blkg->stats_lock, flags);
+		stat_arr = blkg->stats.stat_arr;
+	}
 	if (time_after64(now, io_start_time))
-		blkio_add_stat(stats->stat_arr[BLKIO_STAT_SERVICE_TIME],
+		blkio_add_stat(stat_arr[BLKIO_STAT_SERVICE_TIME],
 				now - io_start_time, direction, sync);
 	if (time_after64(io_start_time, start_time))
-		blkio_add_stat(stats->stat_arr[BLKIO_STAT_WAIT_TIME],
+		blkio_add_stat(stat_arr[BLKIO_STAT_WAIT_TIME],
 				io_start_time - start_time, direction, sync);
-	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+	if (stats_cpu)
+		local_irq_restore(flags);
+	else
+		spin_unlock_irqrestore(&blkg->stats_lock, flags);
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_completion_stats);
 
 void blkiocg_update_io_merged_stats(struct blkio_group *blkg, bool direction,
 					bool sync)
 {
+	struct blkio_group_stats_cpu *stats_cpu;
 	unsigned long flags;
 
+	stats_cpu = blkio_get_stats_cpu(blkg, &flags);
+	if (stats_cpu) {
+		blkio_add_stat(stats_cpu->stat_arr_cpu[BLKIO_STAT_MERGED], 1,
+				direction, sync);
+		local_irq_restore(flags);
+		return;
+	}
+
 	spin_lock_irqsave(&blkg->stats_lock, flags);
 	blkio_add_stat(blkg->stats.stat_arr[BLKIO_STAT_MERGED], 1, direction,
 			sync);
@@ -351,6 +459,12 @@ void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 	blkg->blkcg_id = css_id(&blkcg->css);
 	hlist_add_head_rcu(&blkg->blkcg_node, &blkcg->blkg_list);
 	spin_unlock_irqrestore(&blkcg->lock, flags);
+
+	blkg->stats_cpu = NULL;
+	spin_lock_irqsave(&blkio_stats_alloc_lock, flags);
+	list_add_tail(&blkg->alloc_node, &blkio_stats_alloc_list);
+	spin_unlock_irqrestore(&blkio_stats_alloc_lock, flags);
+	schedule_work(&blkio_stats_alloc_work);
 	/* Need to take css reference ? */
 	cgroup_path(blkcg->css.cgroup, blkg->path, sizeof(blkg->path));
 	blkg->dev = dev;
@@ -391,6 +505,22 @@ int blkiocg_del_blkio_group(struct blkio_group *blkg)
 }
 EXPORT_SYMBOL_GPL(blkiocg_del_blkio_group);
 
+/*
+ * Free the per-cpu stats of @blkg.  Called by the policy right before it
+ * frees a group that was added with blkiocg_add_blkio_group().
+ */
+void blkiocg_free_blkio_group(struct blkio_group *blkg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&blkio_stats_alloc_lock, flags);
+	list_del_init(&blkg->alloc_node);
+	spin_unlock_irqrestore(&blkio_stats_alloc_lock, flags);
+	free_percpu(blkg->stats_cpu);
+	blkg->stats_cpu = NULL;
+}
+EXPORT_SYMBOL_GPL(blkiocg_free_blkio_group);
+
 /* called under rcu_read_lock(). */
 struct blkio_group *blkiocg_lookup_group(struct blkio_cgroup *blkcg, void *key)
 {
@@ -461,7 +591,7 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 	struct blkio_group_stats *stats;
 	struct hlist_node *n;
 	uint64_t queued[BLKIO_STAT_TOTAL];
-	int i;
+	int i, cpu;
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	bool idling, waiting, empty;
 	unsigned long long now = sched_clock();
@@ -482,6 +612,11 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 		memset(stats, 0, sizeof(struct blkio_group_stats));
 		for (i = 0; i < BLKIO_STAT_TOTAL; i++)
 			stats->stat_arr[BLKIO_STAT_QUEUED][i] = queued[i];
+		/* updates that race with the reset may be lost */
+		if (blkg->stats_cpu)
+			for_each_possible_cpu(cpu)
+				memset(per_cpu_ptr(blkg->stats_cpu, cpu), 0,
+				       sizeof(struct blkio_group_stats_cpu));
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 		if (idling) {
 			blkio_mark_blkg_idling(stats);
@@ -547,7 +682,7 @@ static uint64_t blkio_fill_stat(char *str, int chars_left, uint64_t val,
 static uint64_t blkio_get_stat(struct blkio_group *blkg,
 		struct cgroup_map_cb *cb, dev_t dev, enum stat_type type)
 {
-	uint64_t disk_total;
+	uint64_t disk_total, val[BLKIO_STAT_TOTAL];
 	char key_str[MAX_KEY_LEN];
 	enum stat_sub_type sub_type;
 
@@ -556,7 +691,8 @@ static uint64_t blkio_get_stat(struct blkio_group *blkg,
 					blkg->stats.time, cb, dev);
 	if (type == BLKIO_STAT_SECTORS)
 		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
-					blkg->stats.sectors, cb, dev);
+				blkg->stats.sectors +
+				blkio_read_stat_cpu(blkg, type, 0), cb, dev);
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	if (type == BLKIO_STAT_AVG_QUEUE_SIZE) {
 		uint64_t sum = blkg->stats.avg_queue_size_sum;
@@ -583,11 +719,14 @@ static uint64_t blkio_get_stat(struct blkio_group *blkg,
 
 	for (sub_type = BLKIO_STAT_READ; sub_type < BLKIO_STAT_TOTAL;
 			sub_type++) {
+		val[sub_type] = blkg->stats.stat_arr[type][sub_type];
+		if (type < BLKIO_STAT_QUEUED)
+			val[sub_type] += blkio_read_stat_cpu(blkg, type,
+							     sub_type);
 		blkio_get_key_name(sub_type, dev, key_str, MAX_KEY_LEN, false);
-		cb->fill(cb, key_str, blkg->stats.stat_arr[type][sub_type]);
+		cb->fill(cb, key_str, val[sub_type]);
 	}
-	disk_total = blkg->stats.stat_arr[type][BLKIO_STAT_READ] +
-			blkg->stats.stat_arr[type][BLKIO_STAT_WRITE];
+	disk_total = val[BLKIO_STAT_READ] + val[BLKIO_STAT_WRITE];
 	blkio_get_key_name(BLKIO_STAT_TOTAL, dev, key_str, MAX_KEY_LEN, false);
 	cb->fill(cb, key_str, disk_total);
 	return disk_total;
@@ -1041,6 +1180,7 @@ static int __init init_cgroup_blkio(void)
 static void __exit exit_cgroup_blkio(void)
 {
 	cgroup_unload_subsys(&blkio_subsys);
+	flush_work(&blkio_stats_alloc_work);
 }
 
 module_init(init_cgroup_blkio);
@@ -103,6 +103,15 @@ struct blkio_group_stats {
 #endif
 };
 
+/*
+ * The per-cpu part of the stats, which are updated for every request.
+ * stat_arr_cpu holds the stat types below BLKIO_STAT_QUEUED.
+ */
+struct blkio_group_stats_cpu {
+	uint64_t sectors;
+	uint64_t stat_arr_cpu[BLKIO_STAT_QUEUED][BLKIO_STAT_TOTAL];
+};
+
 struct blkio_group {
 	/* An rcu protected unique identifier for the group */
 	void *key;
@@ -116,6 +125,9 @@ struct blkio_group {
 	/* Need to serialize the stats in the case of reset/update */
 	spinlock_t stats_lock;
 	struct blkio_group_stats stats;
+	/* Allocated after the group is added, stats is used until then */
+	struct blkio_group_stats_cpu __percpu *stats_cpu;
+	struct list_head alloc_node;
 };
 
 struct blkio_policy_node {
@@ -214,6 +226,7 @@ extern struct blkio_cgroup *cgroup_to_blkio_cgroup(struct cgroup *cgroup);
 extern void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 			struct blkio_group *blkg, void *key, dev_t dev);
 extern int blkiocg_del_blkio_group(struct blkio_group *blkg);
+extern void blkiocg_free_blkio_group(struct blkio_group *blkg);
 extern struct blkio_group *blkiocg_lookup_group(struct blkio_cgroup *blkcg,
 						void *key);
 void blkiocg_update_timeslice_used(struct blkio_group *blkg,
@@ -238,6 +251,7 @@ static inline void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 
 static inline int
 blkiocg_del_blkio_group(struct blkio_group *blkg) { return 0; }
+static inline void blkiocg_free_blkio_group(struct blkio_group *blkg) {}
 
 static inline struct blkio_group *
 blkiocg_lookup_group(struct blkio_cgroup *blkcg, void *key) { return NULL; }
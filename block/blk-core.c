@@ -38,6 +38,17 @@ EXPORT_TRACEPOINT_SYMBOL_GPL(block_rq_remap);
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_bio_complete);
 
 static int __make_request(struct request_queue *q, struct bio *bio);
+static void __make_request_locked(struct request_queue *q, struct bio *bio);
+static void blk_percpu_submit_flush(struct request_queue *q);
+
+/*
+ * Per-CPU list of async write bios, that are added to the queue in batches
+ */
+struct blk_percpu_submit {
+	spinlock_t		lock;
+	struct bio_list		bios;
+	unsigned int		count;
+};
 
 /*
  * For the allocated request tables
@@ -70,7 +81,7 @@ static void drive_stat_acct(struct request *rq, int new_io)
 		part_stat_inc(cpu, part, merges[rw]);
 	else {
 		part_round_stats(cpu, part);
-		part_inc_in_flight(part, rw);
+		part_inc_in_flight(cpu, part, rw);
 	}
 
 	part_stat_unlock();
@@ -258,6 +269,13 @@ EXPORT_SYMBOL(blk_remove_plug);
  */
 void __generic_unplug_device(struct request_queue *q)
 {
+	/*
+	 * bios that are still batched on per-cpu lists are flushed to
+	 * the queue by kblockd
+	 */
+	if (atomic_read(&q->percpu_submit_pending))
+		kblockd_schedule_work(q, &q->percpu_submit_work);
+
 	if (unlikely(blk_queue_stopped(q)))
 		return;
 	if (!blk_remove_plug(q) && !blk_queue_nonrot(q))
@@ -382,6 +400,7 @@ void blk_sync_queue(struct request_queue *q)
 	del_timer_sync(&q->unplug_timer);
 	del_timer_sync(&q->timeout);
 	cancel_work_sync(&q->unplug_work);
+	cancel_work_sync(&q->percpu_submit_work);
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -449,6 +468,7 @@ void blk_cleanup_queue(struct request_queue *q)
 	 * are done before moving on. Going into this function, we should
 	 * not have processes doing IO to this device.
 	 */
+	blk_percpu_submit_flush(q);
 	blk_sync_queue(q);
 
 	del_timer_sync(&q->backing_dev_info.laptop_mode_wb_timer);
@@ -521,6 +541,7 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	setup_timer(&q->timeout, blk_rq_timed_out_timer, (unsigned long) q);
 	INIT_LIST_HEAD(&q->timeout_list);
 	INIT_WORK(&q->unplug_work, blk_unplug_work);
+	INIT_WORK(&q->percpu_submit_work, blk_percpu_submit_work);
 
 	kobject_init(&q->kobj, &blk_queue_ktype);
 
@@ -1055,15 +1076,26 @@ static inline void add_request(struct request_queue *q, struct request *req)
 static void part_round_stats_single(int cpu, struct hd_struct *part,
 				    unsigned long now)
 {
-	if (now == part->stamp)
+	unsigned long stamp = ACCESS_ONCE(part->stamp);
+	int in_flight;
+
+	if (now == stamp)
 		return;
 
-	if (part_in_flight(part)) {
+	/*
+	 * Only the cpu that moves the stamp accounts the elapsed time, so the
+	 * per-cpu in flight counters are summed at most once per jiffy and
+	 * the accounting does not depend on the queue lock.
+	 */
+	if (cmpxchg(&part->stamp, stamp, now) != stamp)
+		return;
+
+	in_flight = part_in_flight(part);
+	if (in_flight) {
 		__part_stat_add(cpu, part, time_in_queue,
-				part_in_flight(part) * (now - part->stamp));
-		__part_stat_add(cpu, part, io_ticks, (now - part->stamp));
+				in_flight * (now - stamp));
+		__part_stat_add(cpu, part, io_ticks, (now - stamp));
 	}
-	part->stamp = now;
 }
 
 /**
@@ -1175,17 +1207,221 @@ static inline bool queue_should_plug(struct request_queue *q)
 	return !(blk_queue_nonrot(q) && blk_queue_tagged(q));
 }
 
-static int __make_request(struct request_queue *q, struct bio *bio)
+/*
+ * Stable merge sort of a chain of bios by start sector
+ */
+static struct bio *blk_bio_chain_sort(struct bio *head)
 {
-	struct request *req;
-	int el_ret;
-	unsigned int bytes = bio->bi_size;
-	const unsigned short prio = bio_prio(bio);
-	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO);
-	const bool unplug = bio_rw_flagged(bio, BIO_RW_UNPLUG);
-	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
-	int rw_flags;
+	struct bio *a, *b, *slow, *fast, **tail;
+
+	if (!head || !head->bi_next)
+		return head;
+
+	/* split the chain in two halves */
+	slow = head;
+	fast = head->bi_next;
+	while (fast && fast->bi_next) {
+		slow = slow->bi_next;
+		fast = fast->bi_next->bi_next;
+	}
+	b = slow->bi_next;
+	slow->bi_next = NULL;
+	a = blk_bio_chain_sort(head);
+	b = blk_bio_chain_sort(b);
+
+	/* on equal sectors, keep the submission order */
+	tail = &head;
+	while (a && b) {
+		if (b->bi_sector < a->bi_sector) {
+			*tail = b;
+			b = b->bi_next;
+		} else {
+			*tail = a;
+			a = a->bi_next;
+		}
+		tail = &(*tail)->bi_next;
+	}
+	*tail = a ? a : b;
+	return head;
+}
+
+/*
+ * Sort the bios of a per-cpu list by sector, so that adjacent bios that were
+ * submitted out of order are back merged into the request built from the
+ * previous bio through q->last_merge, instead of each one being looked up
+ * in the elevator.  This is done before taking the queue lock.
+ */
+static void blk_percpu_submit_sort(struct bio_list *list)
+{
+	struct bio *bio;
+
+	bio = list->head = blk_bio_chain_sort(list->head);
+	while (bio->bi_next)
+		bio = bio->bi_next;
+	list->tail = bio;
+}
+
+/*
+ * Add the bios of a per-cpu list to the queue with a single queue_lock round
+ * trip (unless the queue lock is dropped to wait for a free request).
+ */
+static void blk_percpu_submit_list(struct request_queue *q,
+				   struct bio_list *list)
+{
+	struct bio *bio;
+
+	if (bio_list_empty(list))
+		return;
+
+	blk_percpu_submit_sort(list);
+	spin_lock_irq(q->queue_lock);
+	while ((bio = bio_list_pop(list)))
+		__make_request_locked(q, bio);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * Flush the bios batched on all per-cpu lists to the queue
+ */
+static void blk_percpu_submit_flush(struct request_queue *q)
+{
+	struct blk_percpu_submit *pcs;
+	struct bio_list list;
+	unsigned long flags;
+	unsigned int count;
+	int cpu;
+
+	if (!q->percpu_submit)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pcs = per_cpu_ptr(q->percpu_submit, cpu);
+		spin_lock_irqsave(&pcs->lock, flags);
+		list = pcs->bios;
+		bio_list_init(&pcs->bios);
+		count = pcs->count;
+		pcs->count = 0;
+		spin_unlock_irqrestore(&pcs->lock, flags);
+
+		if (count)
+			atomic_sub(count, &q->percpu_submit_pending);
+		blk_percpu_submit_list(q, &list);
+	}
+}
+
+void blk_percpu_submit_work(struct work_struct *work)
+{
+	struct request_queue *q =
+		container_of(work, struct request_queue, percpu_submit_work);
 
+	blk_percpu_submit_flush(q);
+	/* the flush was triggered by an unplug, so let it rip */
+	if (q->unplug_fn)
+		q->unplug_fn(q);
+}
+
+/*
+ * blk_percpu_submit_bio - batch an async write bio on a per-cpu list
+ *
+ * On non-rotational devices, async write bios are collected on a per-cpu
+ * list and added to the queue @q->percpu_submit_batch at a time, so that
+ * submitters on different cpus do not take the queue lock for every bio.
+ * The bios of a list are sorted by sector before they are added.
+ * The queue is plugged when a list becomes non empty and unplugging the
+ * queue schedules a flush of all lists, so batched bios are not delayed
+ * longer than the unplug delay.  Reads, sync writes and rotational devices
+ * go through the queue lock as usual; a barrier flushes all lists first,
+ * so the write ordering is kept.
+ *
+ * Returns 1 if @bio was consumed and 0 if it should be added to the queue.
+ */
+static int blk_percpu_submit_bio(struct request_queue *q, struct bio *bio)
+{
+	unsigned int batch = ACCESS_ONCE(q->percpu_submit_batch);
+	struct blk_percpu_submit *pcs;
+	struct bio_list list;
+	unsigned long flags;
+	unsigned int count;
+
+	if (!batch || !blk_queue_nonrot(q))
+		return 0;
+
+	if (unlikely(bio_rw_flagged(bio, BIO_RW_BARRIER))) {
+		blk_percpu_submit_flush(q);
+		return 0;
+	}
+	if (bio_data_dir(bio) != WRITE ||
+	    bio_rw_flagged(bio, BIO_RW_SYNCIO) ||
+	    bio_rw_flagged(bio, BIO_RW_UNPLUG))
+		return 0;
+
+	/* pairs with smp_wmb() in blk_queue_percpu_submit() */
+	smp_rmb();
+	bio_list_init(&list);
+	pcs = per_cpu_ptr(q->percpu_submit, get_cpu());
+	/* bios may be submitted from interrupt context */
+	spin_lock_irqsave(&pcs->lock, flags);
+	bio_list_add(&pcs->bios, bio);
+	count = ++pcs->count;
+	atomic_inc(&q->percpu_submit_pending);
+	if (count >= batch) {
+		list = pcs->bios;
+		bio_list_init(&pcs->bios);
+		pcs->count = 0;
+		atomic_sub(count, &q->percpu_submit_pending);
+	}
+	spin_unlock_irqrestore(&pcs->lock, flags);
+	put_cpu();
+
+	if (count >= batch)
+		blk_percpu_submit_list(q, &list);
+	else if (count == 1)
+		/* make sure that a non empty list is flushed on unplug */
+		blk_plug_device_unlocked(q);
+	return 1;
+}
+
+/**
+ * blk_queue_percpu_submit - set the per-cpu bio batch size of a queue
+ * @q:		the request queue
+ * @batch:	number of bios to batch per cpu (0 disables batching)
+ *
+ * Called with @q->sysfs_lock held.
+ */
+int blk_queue_percpu_submit(struct request_queue *q, unsigned int batch)
+{
+	struct blk_percpu_submit __percpu *percpu_submit;
+	int cpu;
+
+	if (batch && !q->percpu_submit) {
+		percpu_submit = alloc_percpu(struct blk_percpu_submit);
+		if (!percpu_submit)
+			return -ENOMEM;
+		for_each_possible_cpu(cpu) {
+			struct blk_percpu_submit *pcs =
+				per_cpu_ptr(percpu_submit, cpu);
+
+			spin_lock_init(&pcs->lock);
+			bio_list_init(&pcs->bios);
+			pcs->count = 0;
+		}
+		q->percpu_submit = percpu_submit;
+		/* the lists are initialized before batching is enabled */
+		smp_wmb();
+	}
+	q->percpu_submit_batch = batch;
+	if (!batch)
+		blk_percpu_submit_flush(q);
+	return 0;
+}
+
+void blk_queue_free_percpu_submit(struct request_queue *q)
+{
+	free_percpu(q->percpu_submit);
+}
+
+static int __make_request(struct request_queue *q, struct bio *bio)
+{
 	if (bio_rw_flagged(bio, BIO_RW_BARRIER) &&
 	    (q->next_ordered == QUEUE_ORDERED_NONE)) {
 		bio_endio(bio, -EOPNOTSUPP);
@@ -1198,7 +1434,30 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	 */
 	blk_queue_bounce(q, &bio);
 
+	if (blk_percpu_submit_bio(q, bio))
+		return 0;
+
 	spin_lock_irq(q->queue_lock);
+	__make_request_locked(q, bio);
+	spin_unlock_irq(q->queue_lock);
+	return 0;
+}
+
+/*
+ * Merge @bio into a queued request or add a new request for it.
+ * Called and returns with the queue lock held, which may be dropped
+ * to wait for a free request.
+ */
+static void __make_request_locked(struct request_queue *q, struct bio *bio)
+{
+	struct request *req;
+	int el_ret;
+	unsigned int bytes = bio->bi_size;
+	const unsigned short prio = bio_prio(bio);
+	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO);
+	const bool unplug = bio_rw_flagged(bio, BIO_RW_UNPLUG);
+	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+	int rw_flags;
 
 	if (unlikely(bio_rw_flagged(bio, BIO_RW_BARRIER)) || elv_queue_empty(q))
 		goto get_rq;
@@ -1292,8 +1551,10 @@ get_rq:
 	init_request_from_bio(req, bio);
 
 	spin_lock_irq(q->queue_lock);
-	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags) ||
-	    bio_flagged(bio, BIO_CPU_AFFINE))
+	if (test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags))
+		req->cpu = smp_processor_id();
+	else if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags) ||
+		 bio_flagged(bio, BIO_CPU_AFFINE))
 		req->cpu = blk_cpu_to_group(smp_processor_id());
 	if (queue_should_plug(q) && elv_queue_empty(q))
 		blk_plug_device(q);
@@ -1301,8 +1562,6 @@ get_rq:
 out:
 	if (unplug || !queue_should_plug(q))
 		__generic_unplug_device(q);
-	spin_unlock_irq(q->queue_lock);
-	return 0;
 }
 
 /*
@@ -1762,7 +2021,7 @@ static void blk_account_io_done(struct request *req)
 		part_stat_inc(cpu, part, ios[rw]);
 		part_stat_add(cpu, part, ticks[rw], duration);
 		part_round_stats(cpu, part);
-		part_dec_in_flight(part, rw);
+		part_dec_in_flight(cpu, part, rw);
 
 		part_stat_unlock();
 	}
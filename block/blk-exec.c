@@ -63,6 +63,50 @@ void blk_execute_rq_nowait(struct request_queue *q, struct gendisk *bd_disk,
 }
 EXPORT_SYMBOL_GPL(blk_execute_rq_nowait);
 
+/**
+ * blk_execute_rq_list_nowait - insert a list of requests for execution
+ * @q:		queue to insert the requests in
+ * @bd_disk:	matching gendisk
+ * @list:	requests to insert, linked by their queuelist
+ * @at_head:    insert requests at head or tail of queue
+ * @done:	I/O completion handler
+ *
+ * Description:
+ *    Like blk_execute_rq_nowait() for every request on @list, but the
+ *    requests are inserted with a single acquisition of the queue lock
+ *    and the queue is run once for all of them.  The requests keep the
+ *    order of @list, also when inserted at the head of the queue.
+ *    @list is empty on return.
+ */
+void blk_execute_rq_list_nowait(struct request_queue *q,
+				struct gendisk *bd_disk,
+				struct list_head *list, int at_head,
+				rq_end_io_fn *done)
+{
+	struct request *rq, *tmp;
+
+	WARN_ON(irqs_disabled());
+	spin_lock_irq(q->queue_lock);
+	if (at_head) {
+		list_for_each_entry_safe_reverse(rq, tmp, list, queuelist) {
+			list_del_init(&rq->queuelist);
+			rq->rq_disk = bd_disk;
+			rq->end_io = done;
+			__elv_add_request(q, rq, ELEVATOR_INSERT_FRONT, 1);
+		}
+	} else {
+		list_for_each_entry_safe(rq, tmp, list, queuelist) {
+			list_del_init(&rq->queuelist);
+			rq->rq_disk = bd_disk;
+			rq->end_io = done;
+			__elv_add_request(q, rq, ELEVATOR_INSERT_BACK, 1);
+		}
+	}
+	__generic_unplug_device(q);
+	spin_unlock_irq(q->queue_lock);
+}
+EXPORT_SYMBOL_GPL(blk_execute_rq_list_nowait);
+
 /**
  * blk_execute_rq - insert a request into queue for execution
  * @q:		queue to insert the request in
@@ -17,7 +17,21 @@
 int blk_iopoll_enabled = 1;
 EXPORT_SYMBOL(blk_iopoll_enabled);
 
-static unsigned int blk_iopoll_budget __read_mostly = 256;
+int blk_iopoll_budget __read_mostly = 256;
+
+/*
+ * Adapt the weight of every iop to the completions observed per poll,
+ * between BLK_IOPOLL_MIN_WEIGHT and the weight passed to blk_iopoll_init()
+ */
+int blk_iopoll_adaptive __read_mostly = 1;
+#define BLK_IOPOLL_MIN_WEIGHT	4
+
+/*
+ * Hybrid mode: an iop that stays in polled mode is re-polled after half
+ * the estimated time to complete its weight, instead of right away.  The
+ * delay is capped at blk_iopoll_hybrid_usecs (0 disables hybrid mode).
+ */
+int blk_iopoll_hybrid_usecs __read_mostly;
 
 static DEFINE_PER_CPU(struct list_head, blk_cpu_iopoll);
 
@@ -77,6 +91,68 @@ void blk_iopoll_complete(struct blk_iopoll *iopoll)
 }
 EXPORT_SYMBOL(blk_iopoll_complete);
 
+/*
+ * Update the completion statistics of @iop after a poll that completed
+ * @work commands out of @weight.  The driver may already have completed
+ * @iop, so these are only heuristics and racy updates are harmless.
+ */
+static void blk_iopoll_update(struct blk_iopoll *iop, int work, int weight)
+{
+	if (blk_iopoll_hybrid_usecs) {
+		u64 now = ktime_to_ns(ktime_get());
+
+		if (iop->last_poll_ns && work) {
+			u64 sample = div_u64(now - iop->last_poll_ns, work);
+
+			if (iop->ns_per_work)
+				iop->ns_per_work = (iop->ns_per_work * 7 +
+						    sample) >> 3;
+			else
+				iop->ns_per_work = sample;
+		}
+		/* only time polls that follow a poll in polled mode */
+		iop->last_poll_ns = work >= weight ? now : 0;
+	}
+
+	if (blk_iopoll_adaptive) {
+		int target;
+
+		iop->avg_work += ((work << 4) - iop->avg_work) / 8;
+		/* leave some room for bursts above the average */
+		target = (iop->avg_work >> 4) + (iop->avg_work >> 5);
+		iop->weight = clamp(target, min(BLK_IOPOLL_MIN_WEIGHT,
+						iop->weight_max),
+				    iop->weight_max);
+	} else
+		iop->weight = iop->weight_max;
+}
+
+/*
+ * Returns the hybrid mode delay in ns before @iop is polled again, or 0
+ * to poll it right away.
+ */
+static u64 blk_iopoll_hybrid_delay(struct blk_iopoll *iop)
+{
+	u64 delay, max = (u64)blk_iopoll_hybrid_usecs * NSEC_PER_USEC;
+
+	if (!max || !iop->ns_per_work)
+		return 0;
+
+	delay = min((iop->ns_per_work * iop->weight) >> 1, max);
+	/* not worth the timer overhead */
+	if (delay < NSEC_PER_USEC)
+		return 0;
+	return delay;
+}
+
+static enum hrtimer_restart blk_iopoll_timer(struct hrtimer *timer)
+{
+	struct blk_iopoll *iop = container_of(timer, struct blk_iopoll, timer);
+
+	blk_iopoll_sched(iop);
+	return HRTIMER_NORESTART;
+}
+
 static void blk_iopoll_softirq(struct softirq_action *h)
 {
 	struct list_head *list = &__get_cpu_var(blk_cpu_iopoll);
@@ -115,6 +191,8 @@ static void blk_iopoll_softirq(struct softirq_action *h)
 
 		local_irq_disable();
 
+		blk_iopoll_update(iop, work, weight);
+
 		/*
 		 * Drivers must not modify the iopoll state, if they
 		 * consume their assigned weight (or more, some drivers can't
@@ -124,9 +202,16 @@ static void blk_iopoll_softirq(struct softirq_action *h)
 		 * move the instance around on the list at-will.
 		 */
 		if (work >= weight) {
+			u64 delay = blk_iopoll_hybrid_delay(iop);
+
 			if (blk_iopoll_disable_pending(iop))
 				__blk_iopoll_complete(iop);
-			else
+			else if (delay) {
+				/* still polled, rescheduled by the timer */
+				list_del(&iop->list);
+				hrtimer_start(&iop->timer, ns_to_ktime(delay),
+					      HRTIMER_MODE_REL);
+			} else
 				list_move_tail(&iop->list, list);
 		}
 	}
@@ -184,7 +269,10 @@ void blk_iopoll_init(struct blk_iopoll *iop, int weight, blk_iopoll_fn *poll_fn)
 	memset(iop, 0, sizeof(*iop));
 	INIT_LIST_HEAD(&iop->list);
 	iop->weight = weight;
+	iop->weight_max = weight;
 	iop->poll = poll_fn;
+	hrtimer_init(&iop->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	iop->timer.function = blk_iopoll_timer;
 	set_bit(IOPOLL_F_SCHED, &iop->state);
 }
 EXPORT_SYMBOL(blk_iopoll_init);
@@ -231,3 +231,101 @@ out:
 	return ret;
 }
 EXPORT_SYMBOL(blkdev_issue_zeroout);
+
+static void zeroout_batch_end_io(struct bio *bio, int err)
+{
+	struct blk_zeroout_batch *zb = bio->bi_private;
+
+	if (err) {
+		if (err == -EOPNOTSUPP)
+			set_bit(BIO_EOPNOTSUPP, &zb->flags);
+		else
+			clear_bit(BIO_UPTODATE, &zb->flags);
+	}
+	if (atomic_dec_and_test(&zb->pending))
+		complete(&zb->done);
+	bio_put(bio);
+}
+
+/**
+ * blk_zeroout_batch_init - prepare a batch of asynchronous zeroouts
+ * @zb:		batch to initialize
+ */
+void blk_zeroout_batch_init(struct blk_zeroout_batch *zb)
+{
+	/* the bias is dropped by blk_zeroout_batch_wait() */
+	atomic_set(&zb->pending, 1);
+	zb->flags = 1 << BIO_UPTODATE;
+	init_completion(&zb->done);
+}
+EXPORT_SYMBOL(blk_zeroout_batch_init);
+
+/**
+ * blkdev_issue_zeroout_async - submit zero filled write bios to a batch
+ * @bdev:	blockdev to issue
+ * @sector:	start sector
+ * @nr_sects:	number of sectors to write
+ * @gfp_mask:	memory allocation flags (for bio_alloc)
+ * @zb:		batch the bios are accounted to
+ *
+ * Description:
+ *  Like blkdev_issue_zeroout(), but returns as soon as the bios are
+ *  submitted, so that zeroouts of many ranges can be in flight at the
+ *  same time.  The result of all bios of the batch is collected by
+ *  blk_zeroout_batch_wait(), which must be called even if this fails.
+ *  Returns -ENOMEM if not all of the range could be submitted.
+ */
+int blkdev_issue_zeroout_async(struct block_device *bdev, sector_t sector,
+			sector_t nr_sects, gfp_t gfp_mask,
+			struct blk_zeroout_batch *zb)
+{
+	struct bio *bio;
+	unsigned int sz;
+	int ret;
+
+	while (nr_sects != 0) {
+		bio = bio_alloc(gfp_mask,
+				min(nr_sects, (sector_t)BIO_MAX_PAGES));
+		if (!bio)
+			return -ENOMEM;
+
+		bio->bi_sector = sector;
+		bio->bi_bdev   = bdev;
+		bio->bi_end_io = zeroout_batch_end_io;
+		bio->bi_private = zb;
+
+		while (nr_sects != 0) {
+			sz = min((sector_t) PAGE_SIZE >> 9 , nr_sects);
+			ret = bio_add_page(bio, ZERO_PAGE(0), sz << 9, 0);
+			nr_sects -= ret >> 9;
+			sector += ret >> 9;
+			if (ret < (sz << 9))
+				break;
+		}
+		atomic_inc(&zb->pending);
+		submit_bio(WRITE, bio);
+	}
+	return 0;
+}
+EXPORT_SYMBOL(blkdev_issue_zeroout_async);
+
+/**
+ * blk_zeroout_batch_wait - wait for all zeroouts of a batch
+ * @zb:		batch to wait for
+ *
+ * Description:
+ *  Returns -EIO if any bio of the batch failed, -EOPNOTSUPP if the
+ *  device does not support the writes and 0 on success.
+ */
+int blk_zeroout_batch_wait(struct blk_zeroout_batch *zb)
+{
+	if (!atomic_dec_and_test(&zb->pending))
+		wait_for_completion(&zb->done);
+
+	if (!test_bit(BIO_UPTODATE, &zb->flags))
+		return -EIO;
+	if (test_bit(BIO_EOPNOTSUPP, &zb->flags))
+		return -EOPNOTSUPP;
+	return 0;
+}
+EXPORT_SYMBOL(blk_zeroout_batch_wait);
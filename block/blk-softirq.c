@@ -8,6 +8,8 @@
 #include <linux/blkdev.h>
 #include <linux/interrupt.h>
 #include <linux/cpu.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 
 #include "blk.h"
 
@@ -101,9 +103,73 @@ static struct notifier_block __cpuinitdata blk_cpu_notifier = {
 	.notifier_call	= blk_cpu_notify,
 };
 
+static void blk_free_comp_map(struct blk_comp_map *map)
+{
+	free_cpumask_var(map->mask);
+	kfree(map);
+}
+
+static void blk_free_comp_map_rcu(struct rcu_head *head)
+{
+	blk_free_comp_map(container_of(head, struct blk_comp_map, rcu));
+}
+
+/**
+ * blk_queue_comp_cpus - set the completion CPUs of a queue
+ * @q:		the request queue
+ * @mask:	CPUs to complete requests on (empty mask clears the map)
+ *
+ * Builds a map from every CPU to the completion CPU: a CPU in @mask maps
+ * to itself, other CPUs map to a CPU in @mask on the same NUMA node if
+ * there is one, or else to any CPU in @mask.  The map is looked up
+ * without locks on completion and replaced under RCU.
+ * Called with @q->sysfs_lock held.
+ */
+int blk_queue_comp_cpus(struct request_queue *q, const struct cpumask *mask)
+{
+	struct blk_comp_map *map = NULL, *old;
+	int cpu, ccpu;
+
+	if (!cpumask_empty(mask)) {
+		map = kzalloc(sizeof(*map) + nr_cpu_ids * sizeof(int),
+			      GFP_KERNEL);
+		if (!map)
+			return -ENOMEM;
+		if (!zalloc_cpumask_var(&map->mask, GFP_KERNEL)) {
+			kfree(map);
+			return -ENOMEM;
+		}
+		cpumask_copy(map->mask, mask);
+		for_each_possible_cpu(cpu) {
+			if (cpumask_test_cpu(cpu, mask)) {
+				map->cpu[cpu] = cpu;
+				continue;
+			}
+			ccpu = cpumask_first_and(mask,
+					cpumask_of_node(cpu_to_node(cpu)));
+			if (ccpu >= nr_cpu_ids)
+				ccpu = cpumask_first(mask);
+			map->cpu[cpu] = ccpu;
+		}
+	}
+
+	old = q->comp_map;
+	rcu_assign_pointer(q->comp_map, map);
+	if (old)
+		call_rcu(&old->rcu, blk_free_comp_map_rcu);
+	return 0;
+}
+
+void blk_queue_free_comp_map(struct request_queue *q)
+{
+	if (q->comp_map)
+		blk_free_comp_map(q->comp_map);
+}
+
 void __blk_complete_request(struct request *req)
 {
 	struct request_queue *q = req->q;
+	struct blk_comp_map *map;
 	unsigned long flags;
 	int ccpu, cpu, group_cpu;
 
@@ -121,6 +187,17 @@ void __blk_complete_request(struct request *req)
 	else
 		ccpu = cpu;
 
+	rcu_read_lock();
+	map = rcu_dereference(q->comp_map);
+	if (map) {
+		/* steer to the completion CPU of the submitting CPU */
+		ccpu = map->cpu[ccpu];
+		group_cpu = cpu;
+	} else if (test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags))
+		/* complete on the exact submitting CPU */
+		group_cpu = cpu;
+	rcu_read_unlock();
+
 	if (ccpu == cpu || ccpu == group_cpu) {
 		struct list_head *list;
 do_local:
@@ -228,8 +228,9 @@ static ssize_t queue_nomerges_store(struct request_queue *q, const char *page,
 static ssize_t queue_rq_affinity_show(struct request_queue *q, char *page)
 {
 	bool set = test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags);
+	bool force = test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags);
 
-	return queue_var_show(set, page);
+	return queue_var_show(set << force, page);
 }
 
 static ssize_t
@@ -245,11 +246,73 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 		queue_flag_set(QUEUE_FLAG_SAME_COMP, q);
 	else
 		queue_flag_clear(QUEUE_FLAG_SAME_COMP,  q);
+	if (val == 2)
+		queue_flag_set(QUEUE_FLAG_SAME_FORCE, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_SAME_FORCE, q);
 	spin_unlock_irq(q->queue_lock);
 #endif
 	return ret;
 }
 
+static ssize_t queue_completion_cpus_show(struct request_queue *q, char *page)
+{
+	ssize_t len = 0;
+
+	/* sysfs_lock serializes against map updates */
+	if (q->comp_map)
+		len = cpulist_scnprintf(page, PAGE_SIZE - 1,
+					q->comp_map->mask);
+	page[len++] = '\n';
+	page[len] = '\0';
+	return len;
+}
+
+static ssize_t
+queue_completion_cpus_store(struct request_queue *q, const char *page,
+			    size_t count)
+{
+	ssize_t ret = -EINVAL;
+#if defined(CONFIG_USE_GENERIC_SMP_HELPERS)
+	cpumask_var_t mask;
+	int err;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	err = cpulist_parse(strstrip((char *)page), mask);
+	if (!err) {
+		cpumask_and(mask, mask, cpu_possible_mask);
+		err = blk_queue_comp_cpus(q, mask);
+	}
+	free_cpumask_var(mask);
+	ret = err ? err : count;
+#endif
+	return ret;
+}
+
+static ssize_t queue_percpu_submit_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(q->percpu_submit_batch, page);
+}
+
+static ssize_t
+queue_percpu_submit_store(struct request_queue *q, const char *page,
+			  size_t count)
+{
+	unsigned long batch;
+	ssize_t ret = queue_var_store(&batch, page, count);
+	int err;
+
+	/* only request based queues go through __make_request() */
+	if (!q->request_fn || batch > BLK_PERCPU_SUBMIT_MAX)
+		return -EINVAL;
+
+	err = blk_queue_percpu_submit(q, batch);
+	if (err)
+		return err;
+	return ret;
+}
+
 static ssize_t queue_iostats_show(struct request_queue *q, char *page)
 {
 	return queue_var_show(blk_queue_io_stat(q), page);
@@ -368,6 +431,18 @@ static struct queue_sysfs_entry queue_rq_affinity_entry = {
 	.store = queue_rq_affinity_store,
 };
 
+static struct queue_sysfs_entry queue_completion_cpus_entry = {
+	.attr = {.name = "completion_cpus", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_completion_cpus_show,
+	.store = queue_completion_cpus_store,
+};
+
+static struct queue_sysfs_entry queue_percpu_submit_entry = {
+	.attr = {.name = "percpu_submit", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_percpu_submit_show,
+	.store = queue_percpu_submit_store,
+};
+
 static struct queue_sysfs_entry queue_iostats_entry = {
 	.attr = {.name = "iostats", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_iostats_show,
@@ -393,6 +468,8 @@ static struct attribute *default_attrs[] = {
 	&queue_nonrot_entry.attr,
 	&queue_nomerges_entry.attr,
 	&queue_rq_affinity_entry.attr,
+	&queue_completion_cpus_entry.attr,
+	&queue_percpu_submit_entry.attr,
 	&queue_iostats_entry.attr,
 	NULL,
 };
@@ -463,6 +540,8 @@ static void blk_release_queue(struct kobject *kobj)
 	struct request_list *rl = &q->rq;
 
 	blk_sync_queue(q);
+	blk_queue_free_percpu_submit(q);
+	blk_queue_free_comp_map(q);
 
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
@@ -25,6 +25,13 @@ void blk_delete_timer(struct request *);
 void blk_add_timer(struct request *);
 void __generic_unplug_device(struct request_queue *);
 
+/* max number of bios batched per cpu, see blk_percpu_submit_bio() */
+#define BLK_PERCPU_SUBMIT_MAX	128
+
+void blk_percpu_submit_work(struct work_struct *work);
+int blk_queue_percpu_submit(struct request_queue *q, unsigned int batch);
+void blk_queue_free_percpu_submit(struct request_queue *q);
+
 /*
  * Internal atomic flags for request handling
  */
@@ -140,6 +147,19 @@ static inline int queue_congestion_off_threshold(struct request_queue *q)
 
 #endif /* BLK_DEV_INTEGRITY */
 
+/*
+ * Per-queue completion CPU map, set with the 'completion_cpus' sysfs file.
+ * @cpu[n] is the CPU that completes requests submitted on CPU n.
+ */
+struct blk_comp_map {
+	struct rcu_head		rcu;
+	cpumask_var_t		mask;
+	int			cpu[0];
+};
+
+int blk_queue_comp_cpus(struct request_queue *q, const struct cpumask *mask);
+void blk_queue_free_comp_map(struct request_queue *q);
+
 static inline int blk_cpu_to_group(int cpu)
 {
 #ifdef CONFIG_SCHED_MC
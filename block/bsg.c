@@ -54,6 +54,7 @@ enum {
 };
 
 #define BSG_DEFAULT_CMDS	64
+#define BSG_BATCH_CMDS		16
 #define BSG_MAX_DEVS		32768
 
 #undef BSG_DEBUG
@@ -346,30 +347,45 @@ static void bsg_rq_end_io(struct request *rq, int uptodate)
 }
 
 /*
- * do final setup of a 'bc' and submit the matching 'rq' to the block
- * layer for io
+ * do final setup of a 'bc' and add the matching 'rq' to the batch @rqs
  */
-static void bsg_add_command(struct bsg_device *bd, struct request_queue *q,
-			    struct bsg_command *bc, struct request *rq)
+static void bsg_prep_command(struct bsg_device *bd, struct bsg_command *bc,
+			     struct request *rq, struct list_head *rqs)
 {
-	int at_head = (0 == (bc->hdr.flags & BSG_FLAG_Q_AT_TAIL));
-
-	/*
-	 * add bc command to busy queue and submit rq for io
-	 */
 	bc->rq = rq;
 	bc->bio = rq->bio;
 	if (rq->next_rq)
 		bc->bidi_bio = rq->next_rq->bio;
-	bc->hdr.duration = jiffies;
+	rq->end_io_data = bc;
+	list_add_tail(&rq->queuelist, rqs);
+
+	dprintk("%s: batching rq %p, bc %p\n", bd->name, rq, bc);
+}
+
+/*
+ * add the @nr commands of a batch to the busy queue and submit their
+ * requests for io with a single run of the queue
+ */
+static void bsg_add_commands(struct bsg_device *bd, struct request_queue *q,
+			     struct bsg_command **bcs, int nr,
+			     struct list_head *rqs, int at_head)
+{
+	unsigned long now = jiffies;
+	int i;
+
+	if (!nr)
+		return;
+
 	spin_lock_irq(&bd->lock);
-	list_add_tail(&bc->list, &bd->busy_list);
+	for (i = 0; i < nr; i++) {
+		bcs[i]->hdr.duration = now;
+		list_add_tail(&bcs[i]->list, &bd->busy_list);
+	}
 	spin_unlock_irq(&bd->lock);
 
-	dprintk("%s: queueing rq %p, bc %p\n", bd->name, rq, bc);
+	dprintk("%s: queueing %d rqs\n", bd->name, nr);
 
-	rq->end_io_data = bc;
-	blk_execute_rq_nowait(q, NULL, rq, at_head, bsg_rq_end_io);
+	blk_execute_rq_list_nowait(q, NULL, rqs, at_head, bsg_rq_end_io);
 }
 
 static struct bsg_command *bsg_next_done_cmd(struct bsg_device *bd)
@@ -609,20 +625,26 @@ static int __bsg_write(struct bsg_device *bd, const char __user *buf,
 		       size_t count, ssize_t *bytes_written,
 		       fmode_t has_write_perm)
 {
-	struct bsg_command *bc;
+	struct request_queue *q = bd->queue;
+	struct bsg_command *bc, *bcs[BSG_BATCH_CMDS];
 	struct request *rq;
-	int ret, nr_commands;
+	LIST_HEAD(rqs);
+	int ret, nr_commands, nr = 0, batch, at_head = 0;
 
 	if (count % sizeof(struct sg_io_v4))
 		return -EINVAL;
 
+	/*
+	 * requests of a batch are held until it is submitted, so leave
+	 * enough free requests for blk_get_request() to not wait on them
+	 */
+	batch = clamp_t(int, q->nr_requests / 4, 1, BSG_BATCH_CMDS);
+
 	nr_commands = count / sizeof(struct sg_io_v4);
 	rq = NULL;
 	bc = NULL;
 	ret = 0;
 	while (nr_commands) {
-		struct request_queue *q = bd->queue;
-
 		bc = bsg_alloc_command(bd);
 		if (IS_ERR(bc)) {
 			ret = PTR_ERR(bc);
@@ -635,6 +657,13 @@ static int __bsg_write(struct bsg_device *bd, const char __user *buf,
 			break;
 		}
 
+		/* a batch is inserted at one end of the queue */
+		if (nr && at_head != !(bc->hdr.flags & BSG_FLAG_Q_AT_TAIL)) {
+			bsg_add_commands(bd, q, bcs, nr, &rqs, at_head);
+			nr = 0;
+		}
+		at_head = !(bc->hdr.flags & BSG_FLAG_Q_AT_TAIL);
+
 		/*
 		 * get a request, fill in the blanks, and add to request queue
 		 */
@@ -645,7 +674,12 @@ static int __bsg_write(struct bsg_device *bd, const char __user *buf,
 			break;
 		}
 
-		bsg_add_command(bd, q, bc, rq);
+		bsg_prep_command(bd, bc, rq, &rqs);
+		bcs[nr++] = bc;
+		if (nr == batch) {
+			bsg_add_commands(bd, q, bcs, nr, &rqs, at_head);
+			nr = 0;
+		}
 		bc = NULL;
 		rq = NULL;
 		nr_commands--;
@@ -653,6 +687,7 @@ static int __bsg_write(struct bsg_device *bd, const char __user *buf,
 		*bytes_written += sizeof(struct sg_io_v4);
 	}
 
+	bsg_add_commands(bd, q, bcs, nr, &rqs, at_head);
 	if (bc)
 		bsg_free_command(bc);
 
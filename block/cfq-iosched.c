@@ -11,6 +11,7 @@
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/rbtree.h>
 #include <linux/ioprio.h>
 #include <linux/blktrace_api.h>
@@ -45,6 +46,20 @@ static const int cfq_hist_divisor = 4;
 
 #define CFQ_SLICE_SCALE		(5)
 #define CFQ_HW_QUEUE_MIN	(5)
+
+/*
+ * device parallelism detection: a device that completes requests more than
+ * CFQ_PARALLEL_SPEEDUP times faster at queue depth >= CFQ_HW_QUEUE_MIN than
+ * at depth 1 does not benefit from idling on a single queue.  The idle mode
+ * is re-evaluated every CFQ_IDLE_MODE_SAMPLES completions.
+ */
+#define CFQ_PARALLEL_SPEEDUP	(4)
+#define CFQ_IDLE_MODE_SAMPLES	(64)
+
+enum {
+	CFQ_IDLE_QUEUE,		/* idle on queues (default) */
+	CFQ_IDLE_GROUP,		/* idle only to keep the share of a group */
+};
 #define CFQ_SERVICE_SHIFT       12
 
 #define CFQQ_SEEK_THR		(sector_t)(8 * 100)
@@ -244,6 +259,16 @@ struct cfq_data {
 	int hw_tag_est_depth;
 	unsigned int hw_tag_samples;
 
+	/*
+	 * idle mode detection, see cfq_update_idle_mode()
+	 */
+	int idle_mode;
+	u64 interval_start_ns;		/* start of completion interval or 0 */
+	int interval_depth;		/* rq_in_driver during the interval */
+	u64 serial_ns;			/* completion interval at depth 1 */
+	u64 parallel_ns;		/* completion interval at high depth */
+	unsigned int idle_mode_samples;
+
 	/*
 	 * idle window management
 	 */
@@ -273,6 +298,7 @@ struct cfq_data {
 	unsigned int cfq_slice_idle;
 	unsigned int cfq_latency;
 	unsigned int cfq_group_isolation;
+	unsigned int cfq_idle_auto;
 
 	unsigned int cic_index;
 	struct list_head cic_list;
@@ -1051,6 +1077,7 @@ static void cfq_put_cfqg(struct cfq_group *cfqg)
 		return;
 	for_each_cfqg_st(cfqg, i, j, st)
 		BUG_ON(!RB_EMPTY_ROOT(&st->rb) || st->active != NULL);
+	cfq_blkiocg_free_blkio_group(&cfqg->blkg);
 	kfree(cfqg);
 }
 
@@ -1454,7 +1481,11 @@ static void cfq_activate_request(struct request_queue *q, struct request *rq)
 {
 	struct cfq_data *cfqd = q->elevator->elevator_data;
 
-	cfqd->rq_in_driver++;
+	/* a completion interval starts when the device becomes busy */
+	if (!cfqd->rq_in_driver++ && cfqd->cfq_idle_auto) {
+		cfqd->interval_start_ns = ktime_to_ns(ktime_get());
+		cfqd->interval_depth = 1;
+	}
 	cfq_log_cfqq(cfqd, RQ_CFQQ(rq), "activate rq, drv=%d",
 						cfqd->rq_in_driver);
 
@@ -1842,6 +1873,15 @@ static bool cfq_should_idle(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 	if (prio == IDLE_WORKLOAD)
 		return false;
 
+	/*
+	 * On a parallel device, idle only on the last sync queue of a group
+	 * while other groups are busy, so the group keeps its share.
+	 */
+	if (cfqd->idle_mode == CFQ_IDLE_GROUP)
+		return cfq_cfqq_sync(cfqq) && cfqq->cfqg->nr_cfqq == 1 &&
+			cfqd->grp_service_tree.total_weight >
+			cfqq->cfqg->weight;
+
 	/* We do for queues that were marked with idle window flag. */
 	if (cfq_cfqq_idle_window(cfqq) &&
 	   !(blk_queue_nonrot(cfqd->queue) && cfqd->hw_tag))
@@ -3328,6 +3368,60 @@ static void cfq_update_hw_tag(struct cfq_data *cfqd)
 		cfqd->hw_tag = 0;
 }
 
+static inline void cfq_update_interval(u64 *avg, u64 sample)
+{
+	if (*avg)
+		*avg = (*avg * 7 + sample) >> 3;
+	else
+		*avg = sample;
+}
+
+/*
+ * Measure the time between completions while the device is busy, at
+ * queue depth 1 and at queue depth >= CFQ_HW_QUEUE_MIN.  If the device
+ * completes requests much faster at high depth (RAID arrays, flash), it
+ * serves requests in parallel and idling on a single queue only costs
+ * throughput, so switch to idling at group level, which is still needed
+ * for blkio cgroup fairness.  Called before rq_in_driver is decremented.
+ */
+static void cfq_update_idle_mode(struct cfq_data *cfqd)
+{
+	int mode = CFQ_IDLE_QUEUE;
+	u64 now;
+
+	if (!cfqd->cfq_idle_auto) {
+		cfqd->idle_mode = CFQ_IDLE_QUEUE;
+		return;
+	}
+
+	now = ktime_to_ns(ktime_get());
+	if (cfqd->interval_start_ns && now > cfqd->interval_start_ns) {
+		u64 interval = now - cfqd->interval_start_ns;
+
+		if (cfqd->interval_depth == 1 && cfqd->rq_in_driver == 1)
+			cfq_update_interval(&cfqd->serial_ns, interval);
+		else if (cfqd->interval_depth >= CFQ_HW_QUEUE_MIN)
+			cfq_update_interval(&cfqd->parallel_ns, interval);
+	}
+	/* the depth only grows until the next completion */
+	cfqd->interval_depth = cfqd->rq_in_driver - 1;
+	cfqd->interval_start_ns = cfqd->interval_depth ? now : 0;
+
+	if (++cfqd->idle_mode_samples < CFQ_IDLE_MODE_SAMPLES)
+		return;
+	cfqd->idle_mode_samples = 0;
+
+	if (cfqd->serial_ns && cfqd->parallel_ns &&
+	    cfqd->serial_ns > CFQ_PARALLEL_SPEEDUP * cfqd->parallel_ns)
+		mode = CFQ_IDLE_GROUP;
+	if (mode != cfqd->idle_mode)
+		cfq_log(cfqd, "idle mode %s: serial %llu parallel %llu",
+			mode == CFQ_IDLE_GROUP ? "group" : "queue",
+			(unsigned long long)cfqd->serial_ns,
+			(unsigned long long)cfqd->parallel_ns);
+	cfqd->idle_mode = mode;
+}
+
 static bool cfq_should_wait_busy(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 {
 	struct cfq_io_context *cic = cfqd->active_cic;
@@ -3368,6 +3462,7 @@ static void cfq_completed_request(struct request_queue *q, struct request *rq)
 	cfq_log_cfqq(cfqd, cfqq, "complete rqnoidle %d", !!rq_noidle(rq));
 
 	cfq_update_hw_tag(cfqd);
+	cfq_update_idle_mode(cfqd);
 
 	WARN_ON(!cfqd->rq_in_driver);
 	WARN_ON(!cfqq->dispatched);
@@ -3714,7 +3809,10 @@ static void cfq_put_async_queues(struct cfq_data *cfqd)
 
 static void cfq_cfqd_free(struct rcu_head *head)
 {
-	kfree(container_of(head, struct cfq_data, rcu));
+	struct cfq_data *cfqd = container_of(head, struct cfq_data, rcu);
+
+	cfq_blkiocg_free_blkio_group(&cfqd->root_group.blkg);
+	kfree(cfqd);
 }
 
 static void cfq_exit_queue(struct elevator_queue *e)
@@ -3849,6 +3947,7 @@ static void *cfq_init_queue(struct request_queue *q)
 	cfqd->cfq_slice_idle = cfq_slice_idle;
 	cfqd->cfq_latency = 1;
 	cfqd->cfq_group_isolation = 0;
+	cfqd->cfq_idle_auto = 1;
 	cfqd->hw_tag = -1;
 	/*
 	 * we optimistically start assuming sync ops weren't delayed in last
@@ -3924,6 +4023,7 @@ SHOW_FUNCTION(cfq_slice_async_show, cfqd->cfq_slice[0], 1);
 SHOW_FUNCTION(cfq_slice_async_rq_show, cfqd->cfq_slice_async_rq, 0);
 SHOW_FUNCTION(cfq_low_latency_show, cfqd->cfq_latency, 0);
 SHOW_FUNCTION(cfq_group_isolation_show, cfqd->cfq_group_isolation, 0);
+SHOW_FUNCTION(cfq_idle_auto_show, cfqd->cfq_idle_auto, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -3957,6 +4057,7 @@ STORE_FUNCTION(cfq_slice_async_rq_store, &cfqd->cfq_slice_async_rq, 1,
 		UINT_MAX, 0);
 STORE_FUNCTION(cfq_low_latency_store, &cfqd->cfq_latency, 0, 1, 0);
 STORE_FUNCTION(cfq_group_isolation_store, &cfqd->cfq_group_isolation, 0, 1, 0);
+STORE_FUNCTION(cfq_idle_auto_store, &cfqd->cfq_idle_auto, 0, 1, 0);
 #undef STORE_FUNCTION
 
 #define CFQ_ATTR(name) \
@@ -3974,6 +4075,7 @@ static struct elv_fs_entry cfq_attrs[] = {
 	CFQ_ATTR(slice_idle),
 	CFQ_ATTR(low_latency),
 	CFQ_ATTR(group_isolation),
+	CFQ_ATTR(idle_auto),
 	__ATTR_NULL
 };
 
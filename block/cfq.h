@@ -77,6 +77,11 @@ static inline int cfq_blkiocg_del_blkio_group(struct blkio_group *blkg)
 	return blkiocg_del_blkio_group(blkg);
 }
 
+static inline void cfq_blkiocg_free_blkio_group(struct blkio_group *blkg)
+{
+	blkiocg_free_blkio_group(blkg);
+}
+
 #else /* CFQ_GROUP_IOSCHED */
 static inline void cfq_blkiocg_update_io_add_stats(struct blkio_group *blkg,
 	struct blkio_group *curr_blkg, bool direction, bool sync) {}
@@ -110,6 +115,7 @@ static inline int cfq_blkiocg_del_blkio_group(struct blkio_group *blkg)
 {
 	return 0;
 }
+static inline void cfq_blkiocg_free_blkio_group(struct blkio_group *blkg) {}
 
 #endif /* CFQ_GROUP_IOSCHED */
 #endif
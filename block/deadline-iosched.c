@@ -13,6 +13,9 @@
 #include <linux/init.h>
 #include <linux/compiler.h>
 #include <linux/rbtree.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/ktime.h>
 
 /*
  * See Documentation/block/deadline-iosched.txt
@@ -22,6 +25,15 @@ static const int write_expire = 5 * HZ; /* ditto for writes, these limits are SO
 static const int writes_starved = 2;    /* max times reads can starve a write */
 static const int fifo_batch = 16;       /* # of sequential requests treated as one
 				     by the above parameters. For throughput. */
+static const int fifo_batch_max = 256;  /* max auto tuned fifo_batch */
+
+/*
+ * fifo lists per priority class, RT, BE and IDLE
+ */
+#define DL_PRIO_RT	0
+#define DL_PRIO_BE	1
+#define DL_PRIO_IDLE	2
+#define DL_PRIO_NR	3
 
 struct deadline_data {
 	/*
@@ -32,7 +44,7 @@ struct deadline_data {
 	 * requests (deadline_rq s) are present on both sort_list and fifo_list
 	 */
 	struct rb_root sort_list[2];	
-	struct list_head fifo_list[2];
+	struct list_head fifo_list[DL_PRIO_NR][2];
 
 	/*
 	 * next in sort order. read, write or both are NULL
@@ -41,6 +53,7 @@ struct deadline_data {
 	unsigned int batching;		/* number of sequential requests made */
 	sector_t last_sector;		/* head position */
 	unsigned int starved;		/* times reads have starved writes */
+	u64 service_ns;			/* average request service time */
 
 	/*
 	 * settings that change how the i/o scheduler behaves
@@ -49,6 +62,8 @@ struct deadline_data {
 	int fifo_batch;
 	int writes_starved;
 	int front_merges;
+	int prio_aware;
+	int fifo_batch_auto;
 };
 
 static void deadline_move_request(struct deadline_data *, struct request *);
@@ -94,6 +109,58 @@ deadline_del_rq_rb(struct deadline_data *dd, struct request *rq)
 	elv_rb_del(deadline_rb_root(dd, rq), rq);
 }
 
+/*
+ * the priority class of a request is kept in elevator_private and the
+ * dispatch time (in ns, for service time measurement) in elevator_private2
+ */
+#define RQ_PRIO(rq)		((int)(long)(rq)->elevator_private)
+#define RQ_SET_PRIO(rq, prio)	((rq)->elevator_private = (void *)(long)(prio))
+#define RQ_DISPATCH_NS(rq)	((unsigned long)(rq)->elevator_private2)
+#define RQ_SET_DISPATCH_NS(rq, ns) \
+	((rq)->elevator_private2 = (void *)(unsigned long)(ns))
+
+/*
+ * priority class of a new request, from the request or the submitting task
+ */
+static int deadline_rq_prio(struct deadline_data *dd, struct request *rq)
+{
+	int class;
+
+	if (!dd->prio_aware)
+		return DL_PRIO_BE;
+
+	if (ioprio_valid(rq->ioprio))
+		class = IOPRIO_PRIO_CLASS(rq->ioprio);
+	else if (current->io_context &&
+		 ioprio_valid(current->io_context->ioprio))
+		class = IOPRIO_PRIO_CLASS(current->io_context->ioprio);
+	else
+		class = task_nice_ioclass(current);
+
+	switch (class) {
+	case IOPRIO_CLASS_RT:
+		return DL_PRIO_RT;
+	case IOPRIO_CLASS_IDLE:
+		return DL_PRIO_IDLE;
+	default:
+		return DL_PRIO_BE;
+	}
+}
+
+/*
+ * returns the highest priority class with queued requests in @ddir,
+ * or DL_PRIO_NR if there are none
+ */
+static inline int deadline_best_prio(struct deadline_data *dd, int ddir)
+{
+	int prio;
+
+	for (prio = 0; prio < DL_PRIO_NR; prio++)
+		if (!list_empty(&dd->fifo_list[prio][ddir]))
+			break;
+	return prio;
+}
+
 /*
  * add rq to rbtree and fifo
  */
@@ -102,14 +169,16 @@ deadline_add_request(struct request_queue *q, struct request *rq)
 {
 	struct deadline_data *dd = q->elevator->elevator_data;
 	const int data_dir = rq_data_dir(rq);
+	const int prio = deadline_rq_prio(dd, rq);
 
 	deadline_add_rq_rb(dd, rq);
 
 	/*
 	 * set expire time and add to fifo list
 	 */
+	RQ_SET_PRIO(rq, prio);
 	rq_set_fifo_time(rq, jiffies + dd->fifo_expire[data_dir]);
-	list_add_tail(&rq->queuelist, &dd->fifo_list[data_dir]);
+	list_add_tail(&rq->queuelist, &dd->fifo_list[prio][data_dir]);
 }
 
 /*
@@ -179,6 +248,8 @@ deadline_merged_requests(struct request_queue *q, struct request *req,
 		if (time_before(rq_fifo_time(next), rq_fifo_time(req))) {
 			list_move(&req->queuelist, &next->queuelist);
 			rq_set_fifo_time(req, rq_fifo_time(next));
+			/* req is now on the fifo list of next */
+			RQ_SET_PRIO(req, RQ_PRIO(next));
 		}
 	}
 
@@ -197,6 +268,8 @@ deadline_move_to_dispatch(struct deadline_data *dd, struct request *rq)
 	struct request_queue *q = rq->q;
 
 	deadline_remove_request(q, rq);
+	if (dd->fifo_batch_auto)
+		RQ_SET_DISPATCH_NS(rq, ktime_to_ns(ktime_get()));
 	elv_dispatch_add_tail(q, rq);
 }
 
@@ -223,11 +296,12 @@ deadline_move_request(struct deadline_data *dd, struct request *rq)
 
 /*
  * deadline_check_fifo returns 0 if there are no expired requests on the fifo,
- * 1 otherwise. Requires !list_empty(&dd->fifo_list[data_dir])
+ * 1 otherwise. Requires !list_empty(&dd->fifo_list[prio][data_dir])
  */
-static inline int deadline_check_fifo(struct deadline_data *dd, int ddir)
+static inline int deadline_check_fifo(struct deadline_data *dd, int prio,
+				      int ddir)
 {
-	struct request *rq = rq_entry_fifo(dd->fifo_list[ddir].next);
+	struct request *rq = rq_entry_fifo(dd->fifo_list[prio][ddir].next);
 
 	/*
 	 * rq is expired!
@@ -238,6 +312,31 @@ static inline int deadline_check_fifo(struct deadline_data *dd, int ddir)
 	return 0;
 }
 
+/*
+ * deadline_expired_prio returns the priority class of the request in @ddir
+ * that expired first, or DL_PRIO_NR if no request has expired.  Expired
+ * requests are served oldest first regardless of their class, so a stream
+ * of higher class requests cannot starve a lower class past its deadline.
+ */
+static int deadline_expired_prio(struct deadline_data *dd, int ddir)
+{
+	struct request *rq, *first = NULL;
+	int prio, expired = DL_PRIO_NR;
+
+	for (prio = 0; prio < DL_PRIO_NR; prio++) {
+		if (list_empty(&dd->fifo_list[prio][ddir]) ||
+		    !deadline_check_fifo(dd, prio, ddir))
+			continue;
+		rq = rq_entry_fifo(dd->fifo_list[prio][ddir].next);
+		if (!first || time_before(rq_fifo_time(rq),
+					  rq_fifo_time(first))) {
+			first = rq;
+			expired = prio;
+		}
+	}
+	return expired;
+}
+
 /*
  * deadline_dispatch_requests selects the best request according to
  * read/write expire, fifo_batch, etc
@@ -245,10 +344,12 @@ static inline int deadline_check_fifo(struct deadline_data *dd, int ddir)
 static int deadline_dispatch_requests(struct request_queue *q, int force)
 {
 	struct deadline_data *dd = q->elevator->elevator_data;
-	const int reads = !list_empty(&dd->fifo_list[READ]);
-	const int writes = !list_empty(&dd->fifo_list[WRITE]);
+	const int read_prio = deadline_best_prio(dd, READ);
+	const int write_prio = deadline_best_prio(dd, WRITE);
+	const int reads = read_prio < DL_PRIO_NR;
+	const int writes = write_prio < DL_PRIO_NR;
 	struct request *rq;
-	int data_dir;
+	int data_dir, prio;
 
 	/*
 	 * batches are currently reads XOR writes
@@ -258,8 +359,10 @@ static int deadline_dispatch_requests(struct request_queue *q, int force)
 	else
 		rq = dd->next_rq[READ];
 
-	if (rq && dd->batching < dd->fifo_batch)
-		/* we have a next request are still entitled to batch */
+	if (rq && dd->batching < dd->fifo_batch &&
+	    RQ_PRIO(rq) <= min(read_prio, write_prio))
+		/* we have a next request are still entitled to batch,
+		 * and no higher priority class is waiting */
 		goto dispatch_request;
 
 	/*
@@ -273,6 +376,14 @@ static int deadline_dispatch_requests(struct request_queue *q, int force)
 		if (writes && (dd->starved++ >= dd->writes_starved))
 			goto dispatch_writes;
 
+		/*
+		 * higher priority class writes go before reads,
+		 * unless a read has expired
+		 */
+		if (writes && write_prio < read_prio &&
+		    deadline_expired_prio(dd, READ) == DL_PRIO_NR)
+			goto dispatch_writes;
+
 		data_dir = READ;
 
 		goto dispatch_find_request;
@@ -299,13 +410,20 @@ dispatch_find_request:
 	/*
 	 * we are not running a batch, find best request for selected data_dir
 	 */
-	if (deadline_check_fifo(dd, data_dir) || !dd->next_rq[data_dir]) {
+	prio = deadline_expired_prio(dd, data_dir);
+	if (prio < DL_PRIO_NR || !dd->next_rq[data_dir] ||
+	    RQ_PRIO(dd->next_rq[data_dir]) >
+	    deadline_best_prio(dd, data_dir)) {
 		/*
 		 * A deadline has expired, the last request was in the other
-		 * direction, or we have run out of higher-sectored requests.
-		 * Start again from the request with the earliest expiry time.
+		 * direction, we have run out of higher-sectored requests or
+		 * a higher priority class is waiting.  Start again from the
+		 * request with the earliest expiry time of the expired (or
+		 * else the highest) priority class.
 		 */
-		rq = rq_entry_fifo(dd->fifo_list[data_dir].next);
+		if (prio == DL_PRIO_NR)
+			prio = deadline_best_prio(dd, data_dir);
+		rq = rq_entry_fifo(dd->fifo_list[prio][data_dir].next);
 	} else {
 		/*
 		 * The last req was the same dir and we have a next request in
@@ -330,16 +448,51 @@ static int deadline_queue_empty(struct request_queue *q)
 {
 	struct deadline_data *dd = q->elevator->elevator_data;
 
-	return list_empty(&dd->fifo_list[WRITE])
-		&& list_empty(&dd->fifo_list[READ]);
+	return deadline_best_prio(dd, WRITE) == DL_PRIO_NR
+		&& deadline_best_prio(dd, READ) == DL_PRIO_NR;
+}
+
+/*
+ * With fifo_batch_auto, fifo_batch is set so that a batch takes about
+ * 1/16 of read_expire at the average request service time, so a slow
+ * device checks deadlines (and priorities) more often than a fast one.
+ */
+static void deadline_completed_request(struct request_queue *q,
+				       struct request *rq)
+{
+	struct deadline_data *dd = q->elevator->elevator_data;
+	u64 target, sample;
+	int batch;
+
+	if (!dd->fifo_batch_auto || !RQ_DISPATCH_NS(rq))
+		return;
+
+	/* the dispatch time may be truncated to unsigned long */
+	sample = (unsigned long)(ktime_to_ns(ktime_get()) -
+				 RQ_DISPATCH_NS(rq));
+	RQ_SET_DISPATCH_NS(rq, 0);
+	if (dd->service_ns)
+		dd->service_ns = (dd->service_ns * 7 + sample) >> 3;
+	else
+		dd->service_ns = sample;
+	if (!dd->service_ns)
+		return;
+
+	target = (u64)jiffies_to_usecs(dd->fifo_expire[READ]) *
+		NSEC_PER_USEC >> 4;
+	batch = min_t(u64, div64_u64(target, dd->service_ns), fifo_batch_max);
+	dd->fifo_batch = max(batch, 1);
 }
 
 static void deadline_exit_queue(struct elevator_queue *e)
 {
 	struct deadline_data *dd = e->elevator_data;
+	int prio;
 
-	BUG_ON(!list_empty(&dd->fifo_list[READ]));
-	BUG_ON(!list_empty(&dd->fifo_list[WRITE]));
+	for (prio = 0; prio < DL_PRIO_NR; prio++) {
+		BUG_ON(!list_empty(&dd->fifo_list[prio][READ]));
+		BUG_ON(!list_empty(&dd->fifo_list[prio][WRITE]));
+	}
 
 	kfree(dd);
 }
@@ -350,13 +503,16 @@ static void deadline_exit_queue(struct elevator_queue *e)
 static void *deadline_init_queue(struct request_queue *q)
 {
 	struct deadline_data *dd;
+	int prio;
 
 	dd = kmalloc_node(sizeof(*dd), GFP_KERNEL | __GFP_ZERO, q->node);
 	if (!dd)
 		return NULL;
 
-	INIT_LIST_HEAD(&dd->fifo_list[READ]);
-	INIT_LIST_HEAD(&dd->fifo_list[WRITE]);
+	for (prio = 0; prio < DL_PRIO_NR; prio++) {
+		INIT_LIST_HEAD(&dd->fifo_list[prio][READ]);
+		INIT_LIST_HEAD(&dd->fifo_list[prio][WRITE]);
+	}
 	dd->sort_list[READ] = RB_ROOT;
 	dd->sort_list[WRITE] = RB_ROOT;
 	dd->fifo_expire[READ] = read_expire;
@@ -364,6 +520,7 @@ static void *deadline_init_queue(struct request_queue *q)
 	dd->writes_starved = writes_starved;
 	dd->front_merges = 1;
 	dd->fifo_batch = fifo_batch;
+	dd->prio_aware = 0;
 	return dd;
 }
 
@@ -400,6 +557,8 @@ SHOW_FUNCTION(deadline_write_expire_show, dd->fifo_expire[WRITE], 1);
 SHOW_FUNCTION(deadline_writes_starved_show, dd->writes_starved, 0);
 SHOW_FUNCTION(deadline_front_merges_show, dd->front_merges, 0);
 SHOW_FUNCTION(deadline_fifo_batch_show, dd->fifo_batch, 0);
+SHOW_FUNCTION(deadline_fifo_batch_auto_show, dd->fifo_batch_auto, 0);
+SHOW_FUNCTION(deadline_prio_aware_show, dd->prio_aware, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -423,6 +582,8 @@ STORE_FUNCTION(deadline_write_expire_store, &dd->fifo_expire[WRITE], 0, INT_MAX,
 STORE_FUNCTION(deadline_writes_starved_store, &dd->writes_starved, INT_MIN, INT_MAX, 0);
 STORE_FUNCTION(deadline_front_merges_store, &dd->front_merges, 0, 1, 0);
 STORE_FUNCTION(deadline_fifo_batch_store, &dd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(deadline_fifo_batch_auto_store, &dd->fifo_batch_auto, 0, 1, 0);
+STORE_FUNCTION(deadline_prio_aware_store, &dd->prio_aware, 0, 1, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -435,6 +596,8 @@ static struct elv_fs_entry deadline_attrs[] = {
 	DD_ATTR(writes_starved),
 	DD_ATTR(front_merges),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(fifo_batch_auto),
+	DD_ATTR(prio_aware),
 	__ATTR_NULL
 };
 
@@ -445,6 +608,7 @@ static struct elevator_type iosched_deadline = {
 		.elevator_merge_req_fn =	deadline_merged_requests,
 		.elevator_dispatch_fn =		deadline_dispatch_requests,
 		.elevator_add_req_fn =		deadline_add_request,
+		.elevator_completed_req_fn =	deadline_completed_request,
 		.elevator_queue_empty_fn =	deadline_queue_empty,
 		.elevator_former_req_fn =	elv_rb_former_request,
 		.elevator_latter_req_fn =	elv_rb_latter_request,
@@ -39,7 +39,7 @@ static void _drbd_start_io_acct(struct drbd_conf *mdev, struct drbd_request *req
 	cpu = part_stat_lock();
 	part_stat_inc(cpu, &mdev->vdisk->part0, ios[rw]);
 	part_stat_add(cpu, &mdev->vdisk->part0, sectors[rw], bio_sectors(bio));
-	part_inc_in_flight(&mdev->vdisk->part0, rw);
+	part_inc_in_flight(cpu, &mdev->vdisk->part0, rw);
 	part_stat_unlock();
 }
 
@@ -52,7 +52,7 @@ static void _drbd_end_io_acct(struct drbd_conf *mdev, struct drbd_request *req)
 	cpu = part_stat_lock();
 	part_stat_add(cpu, &mdev->vdisk->part0, ticks[rw], duration);
 	part_round_stats(cpu, &mdev->vdisk->part0);
-	part_dec_in_flight(&mdev->vdisk->part0, rw);
+	part_dec_in_flight(cpu, &mdev->vdisk->part0, rw);
 	part_stat_unlock();
 }
 
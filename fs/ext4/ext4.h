@@ -320,6 +320,7 @@ struct flex_groups {
 #define EXT4_EXTENTS_FL			0x00080000 /* Inode uses extents */
 #define EXT4_EA_INODE_FL	        0x00200000 /* Inode used for large EA */
 #define EXT4_EOFBLOCKS_FL		0x00400000 /* Blocks allocated beyond EOF */
+#define EXT4_SNAPFILE_FL		0x01000000 /* Snapshot file */
 #define EXT4_RESERVED_FL		0x80000000 /* reserved for ext4 lib */
 
 #define EXT4_FL_USER_VISIBLE		0x004BDFFF /* User visible flags */
@@ -377,6 +378,7 @@ enum {
 	EXT4_INODE_EXTENTS	= 19,	/* Inode uses extents */
 	EXT4_INODE_EA_INODE	= 21,	/* Inode used for large EA */
 	EXT4_INODE_EOFBLOCKS	= 22,	/* Blocks allocated beyond EOF */
+	EXT4_INODE_SNAPFILE	= 24,	/* Snapshot file */
 	EXT4_INODE_RESERVED	= 31,	/* reserved for ext4 lib */
 };
 
@@ -423,6 +425,7 @@ static inline void ext4_check_flag_values(void)
 	CHECK_FLAG_VALUE(EXTENTS);
 	CHECK_FLAG_VALUE(EA_INODE);
 	CHECK_FLAG_VALUE(EOFBLOCKS);
+	CHECK_FLAG_VALUE(SNAPFILE);
 	CHECK_FLAG_VALUE(RESERVED);
 }
 
@@ -485,6 +488,9 @@ struct ext4_new_group_data {
 	/* Convert extent to initialized after IO complete */
 #define EXT4_GET_BLOCKS_IO_CONVERT_EXT		(EXT4_GET_BLOCKS_CONVERT|\
 					 EXT4_GET_BLOCKS_CREATE_UNINIT_EXT)
+	/* Map the block in m_pblk into a snapshot file instead of
+	   allocating one */
+#define EXT4_GET_BLOCKS_SNAPSHOT_MOVE		0x0020
 
 /*
  * Flags used by ext4_free_blocks
@@ -492,6 +498,7 @@ struct ext4_new_group_data {
 #define EXT4_FREE_BLOCKS_METADATA	0x0001
 #define EXT4_FREE_BLOCKS_FORGET		0x0002
 #define EXT4_FREE_BLOCKS_VALIDATED	0x0004
+#define EXT4_FREE_BLOCKS_NO_SNAPSHOT	0x0008
 
 /*
  * ioctl commands
@@ -514,6 +521,8 @@ struct ext4_new_group_data {
  /* note ioctl 11 reserved for filesystem-independent FIEMAP ioctl */
 #define EXT4_IOC_ALLOC_DA_BLKS		_IO('f', 12)
 #define EXT4_IOC_MOVE_EXT		_IOWR('f', 15, struct move_extent)
+#define EXT4_IOC_SNAPSHOT_TAKE		_IO('f', 20)
+#define EXT4_IOC_SNAPSHOT_DELETE	_IO('f', 21)
 
 #if defined(__KERNEL__) && defined(CONFIG_COMPAT)
 /*
@@ -731,9 +740,24 @@ struct ext4_ext_cache {
 	__u32		ec_type;
 };
 
+/*
+ * an entry of the per-inode extent cache: i_ext_cache_tree holds
+ * non-overlapping extents and gaps sorted by ec_block
+ */
+struct ext4_ext_cache_entry {
+	struct rb_node		ece_node;
+	struct list_head	ece_lru;
+	struct ext4_ext_cache	ece_ex;
+};
+
 /*
  * fourth extended file system inode data in memory
  */
+/* Max. number of block ranges tracked per inode for fast commit */
+#define EXT4_FC_RANGES		4
+/* Default size of fast commit area in journal blocks */
+#define EXT4_FC_BLOCKS		256
+
 struct ext4_inode_info {
 	__le32	i_data[15];	/* unconverted */
 	__u32	i_dtime;
@@ -795,7 +819,10 @@ struct ext4_inode_info {
 	struct inode vfs_inode;
 	struct jbd2_inode jinode;
 
-	struct ext4_ext_cache i_cached_extent;
+	/* recently resolved extents and gaps */
+	struct rb_root i_ext_cache_tree;
+	struct list_head i_ext_cache_lru;
+	unsigned int i_ext_cache_count;
 	/*
 	 * File creation time. Its function is same as that of
 	 * struct timespec i_{a,c,m}time in the generic inode.
@@ -838,6 +865,18 @@ struct ext4_inode_info {
 	 */
 	tid_t i_sync_tid;
 	tid_t i_datasync_tid;
+
+	/*
+	 * Blocks allocated to the inode in transaction i_fc_tid, for fast
+	 * commit.  [i_data_sem]
+	 */
+	tid_t i_fc_tid;
+	unsigned int i_fc_nr;
+	int i_fc_ineligible;
+	struct ext4_fc_range {
+		ext4_fsblk_t pblk;
+		unsigned int len;
+	} i_fc_range[EXT4_FC_RANGES];
 };
 
 /*
@@ -883,10 +922,12 @@ struct ext4_inode_info {
 #define EXT4_MOUNT_JOURNAL_CHECKSUM	0x800000 /* Journal checksums */
 #define EXT4_MOUNT_JOURNAL_ASYNC_COMMIT	0x1000000 /* Journal Async Commit */
 #define EXT4_MOUNT_I_VERSION            0x2000000 /* i_version support */
+#define EXT4_MOUNT_MB_PREINIT		0x4000000 /* Generate buddies at mount */
 #define EXT4_MOUNT_DELALLOC		0x8000000 /* Delalloc support */
 #define EXT4_MOUNT_DATA_ERR_ABORT	0x10000000 /* Abort on file data write */
 #define EXT4_MOUNT_BLOCK_VALIDITY	0x20000000 /* Block validity checking */
 #define EXT4_MOUNT_DISCARD		0x40000000 /* Issue DISCARD requests */
+#define EXT4_MOUNT_FAST_COMMIT		0x80000000 /* Fast commits for fsync */
 
 #define clear_opt(o, opt)		o &= ~EXT4_MOUNT_##opt
 #define set_opt(o, opt)			o |= EXT4_MOUNT_##opt
@@ -1005,7 +1046,9 @@ struct ext4_super_block {
 	__u8	s_reserved_char_pad2;
 	__le16  s_reserved_pad;
 	__le64	s_kbytes_written;	/* nr of lifetime kilobytes written */
-	__u32   s_reserved[160];        /* Padding to the end of the block */
+/*180*/	__le32	s_snapshot_inum;	/* Inode number of active snapshot */
+	__le32	s_snapshot_id;		/* Sequential ID of active snapshot */
+	__u32   s_reserved[158];        /* Padding to the end of the block */
 };
 
 #ifdef __KERNEL__
@@ -1111,10 +1154,25 @@ struct ext4_sb_info {
 	unsigned int s_mb_stats;
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
+	unsigned int s_mb_order_list_tries;
+	unsigned int s_mb_prefetch;
+	unsigned int s_mb_discard_batch;
 	unsigned int s_max_writeback_mb_bump;
+	unsigned int s_extent_zeroout_len;	/* zero out small uninit extents */
 	/* where last allocation was done - for stream allocation */
 	unsigned long s_mb_last_group;
 	unsigned long s_mb_last_start;
+	/* initialized groups, indexed by bb_largest_free_order */
+	struct list_head *s_mb_largest_free_orders;
+	rwlock_t *s_mb_largest_free_orders_locks;
+	atomic_t s_mb_uninit_groups;	/* groups with NEED_INIT set */
+	struct task_struct *s_mb_preinit_task;
+	/* freed extents waiting for their discard */
+	struct list_head s_discard_list;
+	spinlock_t s_discard_lock;
+	struct mutex s_discard_mutex;
+	struct delayed_work s_discard_work;
+	struct super_block *s_sb;	/* for s_discard_work */
 
 	/* stats for buddy allocator */
 	spinlock_t s_mb_pa_lock;
@@ -1145,6 +1203,16 @@ struct ext4_sb_info {
 
 	/* workqueue for dio unwritten */
 	struct workqueue_struct *dio_unwritten_wq;
+
+	/* transaction that cannot be fast committed */
+	tid_t s_fc_ineligible_tid;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT
+	/* snapshot that blocks are copied to, see snapshot.c */
+	struct inode *s_active_snapshot;
+	int s_snapshot_broken;		/* COW stopped after an error */
+	struct mutex s_snapshot_mutex;	/* serializes take and delete */
+#endif
 };
 
 static inline struct ext4_sb_info *EXT4_SB(struct super_block *sb)
@@ -1267,6 +1335,7 @@ EXT4_INODE_BIT_FNS(state, state_flags)
 #define EXT4_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
 #define EXT4_FEATURE_RO_COMPAT_DIR_NLINK	0x0020
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE	0x0040
+#define EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT	0x0080
 
 #define EXT4_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define EXT4_FEATURE_INCOMPAT_FILETYPE		0x0002
@@ -1287,13 +1356,19 @@ EXT4_INODE_BIT_FNS(state, state_flags)
 					 EXT4_FEATURE_INCOMPAT_EXTENTS| \
 					 EXT4_FEATURE_INCOMPAT_64BIT| \
 					 EXT4_FEATURE_INCOMPAT_FLEX_BG)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#define EXT4_FEATURE_RO_COMPAT_SNAPSHOT_SUPP	EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT
+#else
+#define EXT4_FEATURE_RO_COMPAT_SNAPSHOT_SUPP	0
+#endif
 #define EXT4_FEATURE_RO_COMPAT_SUPP	(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT4_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT4_FEATURE_RO_COMPAT_GDT_CSUM| \
 					 EXT4_FEATURE_RO_COMPAT_DIR_NLINK | \
 					 EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE | \
 					 EXT4_FEATURE_RO_COMPAT_BTREE_DIR |\
-					 EXT4_FEATURE_RO_COMPAT_HUGE_FILE)
+					 EXT4_FEATURE_RO_COMPAT_HUGE_FILE |\
+					 EXT4_FEATURE_RO_COMPAT_SNAPSHOT_SUPP)
 
 /*
  * Default values for user and/or group using reserved blocks
@@ -1303,6 +1378,14 @@ EXT4_INODE_BIT_FNS(state, state_flags)
 
 #define EXT4_DEF_INODE_READAHEAD_BLKS	32
 
+/*
+ * Writes into small uninitialized extents zero out the extent instead of
+ * splitting it.  Default and max. of the extent_zeroout_len tunable (in
+ * blocks); the cap keeps the synchronous zeroout under i_data_sem short.
+ */
+#define EXT4_EXT_ZERO_LEN	7
+#define EXT4_EXT_MAX_ZERO_LEN	1024
+
 /*
  * Default mount options
  */
@@ -1523,6 +1606,13 @@ extern void ext4_htree_free_dir_info(struct dir_private_info *p);
 /* fsync.c */
 extern int ext4_sync_file(struct file *, int);
 
+/* fast_commit.c */
+extern void ext4_fc_mark_ineligible(struct super_block *sb, handle_t *handle);
+extern void ext4_fc_track_range(handle_t *handle, struct inode *inode,
+				ext4_fsblk_t pblk, unsigned int len);
+extern int ext4_fc_commit(struct inode *inode, tid_t commit_tid);
+extern int ext4_fc_replay(journal_t *journal, struct buffer_head *bh);
+
 /* hash.c */
 extern int ext4fs_dirhash(const char *name, int len, struct
 			  dx_hash_info *hinfo);
@@ -1638,6 +1728,7 @@ extern void ext4_grp_locked_error(struct super_block *, ext4_group_t,
 				const char *, const char *, ...)
 	__attribute__ ((format (printf, 4, 5)));
 extern void ext4_update_dynamic_rev(struct super_block *sb);
+extern int ext4_commit_super(struct super_block *sb, int sync);
 extern int ext4_update_compat_feature(handle_t *handle, struct super_block *sb,
 					__u32 compat);
 extern int ext4_update_rocompat_feature(handle_t *handle,
@@ -1802,7 +1893,10 @@ struct ext4_group_info {
 	ext4_grpblk_t	bb_free;	/* total free blocks */
 	ext4_grpblk_t	bb_fragments;	/* nr of freespace fragments */
 	ext4_grpblk_t	bb_largest_free_order;/* order of largest frag in BG */
+	ext4_group_t	bb_group;	/* group number of this BG */
 	struct          list_head bb_prealloc_list;
+	spinlock_t	bb_pa_lock;	/* protects bb_prealloc_list */
+	struct          list_head bb_largest_free_order_node;
 #ifdef DOUBLE_CHECK
 	void            *bb_bitmap;
 #endif
@@ -1901,6 +1995,9 @@ extern int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 extern void ext4_ext_truncate(struct inode *);
 extern void ext4_ext_init(struct super_block *);
 extern void ext4_ext_release(struct super_block *);
+extern void ext4_ext_invalidate_cache(struct inode *inode);
+extern int __init init_ext4_ext_cache(void);
+extern void exit_ext4_ext_cache(void);
 extern long ext4_fallocate(struct inode *inode, int mode, loff_t offset,
 			  loff_t len);
 extern int ext4_convert_unwritten_extents(struct inode *inode, loff_t offset,
@@ -12,10 +12,14 @@ int __ext4_journal_get_undo_access(const char *where, handle_t *handle,
 	int err = 0;
 
 	if (ext4_handle_valid(handle)) {
-		err = jbd2_journal_get_undo_access(handle, bh);
+		err = ext4_snapshot_get_write_access(handle, NULL, bh);
+		if (!err)
+			err = jbd2_journal_get_undo_access(handle, bh);
 		if (err)
 			ext4_journal_abort_handle(where, __func__, bh,
 						  handle, err);
+		else
+			ext4_snapshot_mark_cowed(handle, bh);
 	}
 	return err;
 }
@@ -26,10 +30,14 @@ int __ext4_journal_get_write_access(const char *where, handle_t *handle,
 	int err = 0;
 
 	if (ext4_handle_valid(handle)) {
-		err = jbd2_journal_get_write_access(handle, bh);
+		err = ext4_snapshot_get_write_access(handle, NULL, bh);
+		if (!err)
+			err = jbd2_journal_get_write_access(handle, bh);
 		if (err)
 			ext4_journal_abort_handle(where, __func__, bh,
 						  handle, err);
+		else
+			ext4_snapshot_mark_cowed(handle, bh);
 	}
 	return err;
 }
@@ -18,6 +18,7 @@
 #include <linux/fs.h>
 #include <linux/jbd2.h>
 #include "ext4.h"
+#include "snapshot.h"
 
 #define EXT4_JOURNAL(inode)	(EXT4_SB((inode)->i_sb)->s_journal)
 
@@ -153,6 +154,7 @@ int __ext4_handle_dirty_metadata(const char *where, handle_t *handle,
 #define ext4_handle_dirty_metadata(handle, inode, bh) \
 	__ext4_handle_dirty_metadata(__func__, (handle), (inode), (bh))
 
+handle_t *__ext4_journal_start_sb(struct super_block *sb, int nblocks);
 handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks);
 int __ext4_journal_stop(const char *where, handle_t *handle);
 
@@ -206,6 +208,16 @@ static inline handle_t *ext4_journal_start(struct inode *inode, int nblocks)
 	return ext4_journal_start_sb(inode->i_sb, nblocks);
 }
 
+/*
+ * Start a handle of the write path, which does not prevent a fast commit
+ * of the running transaction (see fast_commit.c)
+ */
+static inline handle_t *ext4_journal_start_fc(struct inode *inode,
+					      int nblocks)
+{
+	return __ext4_journal_start_sb(inode->i_sb, nblocks);
+}
+
 #define ext4_journal_stop(handle) \
 	__ext4_journal_stop(__func__, (handle))
 
@@ -223,9 +235,17 @@ static inline int ext4_journal_extend(handle_t *handle, int nblocks)
 
 static inline int ext4_journal_restart(handle_t *handle, int nblocks)
 {
-	if (ext4_handle_valid(handle))
-		return jbd2_journal_restart(handle, nblocks);
-	return 0;
+	struct super_block *sb;
+	int cow_credits, err;
+
+	if (!ext4_handle_valid(handle))
+		return 0;
+	sb = handle->h_transaction->t_journal->j_private;
+	cow_credits = ext4_snapshot_trans_blocks(sb, nblocks);
+	err = jbd2_journal_restart(handle, nblocks + cow_credits);
+	if (!err)
+		ext4_snapshot_set_credits(handle, cow_credits);
+	return err;
 }
 
 static inline int ext4_journal_blocks_per_page(struct inode *inode)
@@ -44,6 +44,8 @@
 #include "ext4_jbd2.h"
 #include "ext4_extents.h"
 
+static void ext4_ext_invalidate_cache_range(struct inode *inode,
+					    ext4_lblk_t block, __u32 len);
 
 /*
  * ext_pblock:
@@ -1842,7 +1844,132 @@ cleanup:
 		ext4_ext_drop_refs(npath);
 		kfree(npath);
 	}
-	ext4_ext_invalidate_cache(inode);
+	ext4_ext_invalidate_cache_range(inode, le32_to_cpu(newext->ee_block),
+					ext4_ext_get_actual_len(newext));
+	return err;
+}
+
+/*
+ * ext4_ext_fill_leaf:
+ * inserts the leading new extents, which belong to the leaf of @path and
+ * fit into its free entries, in one backward merge of the leaf entries.
+ * Returns the no. of inserted extents, 0 if the single extent path should
+ * be used for @newext (the leaf is full or only one extent fits) or <0 on
+ * error.
+ */
+static int ext4_ext_fill_leaf(handle_t *handle, struct inode *inode,
+			      struct ext4_ext_path *path,
+			      struct ext4_extent *newext, int count, int flag)
+{
+	int depth = ext_depth(inode);
+	struct ext4_extent_header *eh = path[depth].p_hdr;
+	struct ext4_extent *ex, *new, *first_new = NULL;
+	ext4_lblk_t next;
+	int entries, n, i, j, err;
+
+	if (unlikely(eh == NULL)) {
+		EXT4_ERROR_INODE(inode, "path[%d].p_hdr == NULL", depth);
+		return -EIO;
+	}
+	entries = le16_to_cpu(eh->eh_entries);
+	next = ext4_ext_next_leaf_block(inode, path);
+	for (n = 0; n < count && entries + n < le16_to_cpu(eh->eh_max); n++) {
+		if (le32_to_cpu(newext[n].ee_block) >= next)
+			/* belongs to the next leaf */
+			break;
+		if (n && le32_to_cpu(newext[n].ee_block) <
+		    le32_to_cpu(newext[n-1].ee_block) +
+		    ext4_ext_get_actual_len(newext + n - 1)) {
+			EXT4_ERROR_INODE(inode, "new extents not sorted");
+			return -EIO;
+		}
+	}
+	if (n < 2)
+		return 0;
+
+	err = ext4_ext_get_access(handle, inode, path + depth);
+	if (err)
+		return err;
+
+	/* merge the new extents with the leaf entries from the right */
+	ex = EXT_FIRST_EXTENT(eh);
+	i = entries - 1;
+	j = n - 1;
+	while (j >= 0) {
+		new = ex + i + j + 1;
+		if (i >= 0 && le32_to_cpu(ex[i].ee_block) >
+				le32_to_cpu(newext[j].ee_block)) {
+			*new = ex[i--];
+			continue;
+		}
+		BUG_ON(i >= 0 && ex[i].ee_block == newext[j].ee_block);
+		new->ee_block = newext[j].ee_block;
+		ext4_ext_store_pblock(new, ext_pblock(newext + j));
+		new->ee_len = newext[j].ee_len;
+		first_new = new;
+		j--;
+	}
+	le16_add_cpu(&eh->eh_entries, n);
+
+	if (!(flag & EXT4_GET_BLOCKS_PRE_IO)) {
+		/* try to merge to the left of the first new extent and right */
+		ex = first_new > EXT_FIRST_EXTENT(eh) ? first_new - 1 : first_new;
+		for (; ex < EXT_LAST_EXTENT(eh); ex++)
+			ext4_ext_try_to_merge(inode, path, ex);
+	}
+
+	if (first_new == EXT_FIRST_EXTENT(eh)) {
+		/* time to correct all indexes above */
+		path[depth].p_ext = first_new;
+		err = ext4_ext_correct_indexes(handle, inode, path);
+		if (err)
+			return err;
+	}
+	err = ext4_ext_dirty(handle, inode, path + depth);
+	if (err)
+		return err;
+
+	for (j = 0; j < n; j++)
+		ext4_ext_invalidate_cache_range(inode,
+				le32_to_cpu(newext[j].ee_block),
+				ext4_ext_get_actual_len(newext + j));
+	return n;
+}
+
+/*
+ * ext4_ext_insert_extents:
+ * inserts @count new extents, sorted by logical block and not overlapping
+ * each other or the existing extents.  The extents which fall into the same
+ * leaf are inserted together with one path walk, one leaf update and at
+ * most one index correction.  When the leaf is full, the next extent is
+ * inserted by ext4_ext_insert_extent(), which splits the leaf once and
+ * makes room for the extents that follow it.
+ */
+int ext4_ext_insert_extents(handle_t *handle, struct inode *inode,
+			    struct ext4_extent *newext, int count, int flag)
+{
+	struct ext4_ext_path *path;
+	int i = 0, n, err = 0;
+
+	while (i < count && !err) {
+		path = ext4_ext_find_extent(inode,
+				le32_to_cpu(newext[i].ee_block), NULL);
+		if (IS_ERR(path))
+			return PTR_ERR(path);
+
+		n = ext4_ext_fill_leaf(handle, inode, path, newext + i,
+				       count - i, flag);
+		if (n < 0) {
+			err = n;
+		} else if (n == 0) {
+			err = ext4_ext_insert_extent(handle, inode, path,
+						     newext + i, flag);
+			n = 1;
+		}
+		ext4_ext_drop_refs(path);
+		kfree(path);
+		i += n;
+	}
 	return err;
 }
 
@@ -1963,19 +2090,123 @@ int ext4_ext_walk_space(struct inode *inode, ext4_lblk_t block,
 	return err;
 }
 
+static struct kmem_cache *ext4_ext_cache_cachep;
+
+int __init init_ext4_ext_cache(void)
+{
+	ext4_ext_cache_cachep = KMEM_CACHE(ext4_ext_cache_entry,
+					   SLAB_RECLAIM_ACCOUNT);
+	if (ext4_ext_cache_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void exit_ext4_ext_cache(void)
+{
+	kmem_cache_destroy(ext4_ext_cache_cachep);
+}
+
+/*
+ * The extent cache keeps up to EXT4_EXT_CACHE_MAX extents and gaps the
+ * inode's tree was recently found to have, so that random lookups do not
+ * walk the tree from the root every time.  Cached extents stay valid when
+ * the tree grows (a merged extent only covers more than its cached part),
+ * so an insertion only drops the gaps it fills; everything else that
+ * changes the tree drops the whole cache.
+ *
+ * We borrow i_block_reservation_lock to protect the cache.
+ */
+static void ext4_ext_cache_erase(struct ext4_inode_info *ei,
+				 struct ext4_ext_cache_entry *ece)
+{
+	rb_erase(&ece->ece_node, &ei->i_ext_cache_tree);
+	list_del(&ece->ece_lru);
+	ei->i_ext_cache_count--;
+	kmem_cache_free(ext4_ext_cache_cachep, ece);
+}
+
+/* drop the cached entries overlapping [block, block + len) */
+static void ext4_ext_cache_remove(struct ext4_inode_info *ei,
+				  ext4_lblk_t block, __u32 len)
+{
+	struct rb_node *n = ei->i_ext_cache_tree.rb_node;
+	struct ext4_ext_cache_entry *ece, *first = NULL;
+	u64 end = (u64)block + len;
+
+	while (n) {
+		ece = rb_entry(n, struct ext4_ext_cache_entry, ece_node);
+		if ((u64)ece->ece_ex.ec_block + ece->ece_ex.ec_len > block) {
+			first = ece;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	while (first && first->ece_ex.ec_block < end) {
+		n = rb_next(&first->ece_node);
+		ext4_ext_cache_erase(ei, first);
+		first = n ? rb_entry(n, struct ext4_ext_cache_entry,
+				     ece_node) : NULL;
+	}
+}
+
+void ext4_ext_invalidate_cache(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_cache_entry *ece, *tmp;
+
+	spin_lock(&ei->i_block_reservation_lock);
+	list_for_each_entry_safe(ece, tmp, &ei->i_ext_cache_lru, ece_lru)
+		ext4_ext_cache_erase(ei, ece);
+	spin_unlock(&ei->i_block_reservation_lock);
+}
+
+static void ext4_ext_invalidate_cache_range(struct inode *inode,
+					    ext4_lblk_t block, __u32 len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+
+	spin_lock(&ei->i_block_reservation_lock);
+	ext4_ext_cache_remove(ei, block, len);
+	spin_unlock(&ei->i_block_reservation_lock);
+}
+
 static void
 ext4_ext_put_in_cache(struct inode *inode, ext4_lblk_t block,
 			__u32 len, ext4_fsblk_t start, int type)
 {
-	struct ext4_ext_cache *cex;
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_cache_entry *ece, *new;
+	struct rb_node **p, *parent = NULL;
+
 	BUG_ON(len == 0);
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	cex = &EXT4_I(inode)->i_cached_extent;
-	cex->ec_type = type;
-	cex->ec_block = block;
-	cex->ec_len = len;
-	cex->ec_start = start;
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
+	new = kmem_cache_alloc(ext4_ext_cache_cachep, GFP_NOFS);
+	if (!new)
+		return;
+	new->ece_ex.ec_type = type;
+	new->ece_ex.ec_block = block;
+	new->ece_ex.ec_len = len;
+	new->ece_ex.ec_start = start;
+
+	spin_lock(&ei->i_block_reservation_lock);
+	ext4_ext_cache_remove(ei, block, len);
+
+	p = &ei->i_ext_cache_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		ece = rb_entry(parent, struct ext4_ext_cache_entry, ece_node);
+		if (block < ece->ece_ex.ec_block)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->ece_node, parent, p);
+	rb_insert_color(&new->ece_node, &ei->i_ext_cache_tree);
+	list_add(&new->ece_lru, &ei->i_ext_cache_lru);
+
+	if (++ei->i_ext_cache_count > EXT4_EXT_CACHE_MAX)
+		ext4_ext_cache_erase(ei, list_entry(ei->i_ext_cache_lru.prev,
+					struct ext4_ext_cache_entry, ece_lru));
+	spin_unlock(&ei->i_block_reservation_lock);
 }
 
 /*
@@ -2031,32 +2262,39 @@ static int
 ext4_ext_in_cache(struct inode *inode, ext4_lblk_t block,
 			struct ext4_extent *ex)
 {
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct rb_node *n;
+	struct ext4_ext_cache_entry *ece;
 	struct ext4_ext_cache *cex;
 	int ret = EXT4_EXT_CACHE_NO;
 
-	/*
-	 * We borrow i_block_reservation_lock to protect i_cached_extent
-	 */
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	cex = &EXT4_I(inode)->i_cached_extent;
-
-	/* has cache valid data? */
-	if (cex->ec_type == EXT4_EXT_CACHE_NO)
-		goto errout;
+	spin_lock(&ei->i_block_reservation_lock);
+	n = ei->i_ext_cache_tree.rb_node;
+	while (n) {
+		ece = rb_entry(n, struct ext4_ext_cache_entry, ece_node);
+		cex = &ece->ece_ex;
+		if (block < cex->ec_block) {
+			n = n->rb_left;
+			continue;
+		}
+		if (!in_range(block, cex->ec_block, cex->ec_len)) {
+			n = n->rb_right;
+			continue;
+		}
 
-	BUG_ON(cex->ec_type != EXT4_EXT_CACHE_GAP &&
-			cex->ec_type != EXT4_EXT_CACHE_EXTENT);
-	if (in_range(block, cex->ec_block, cex->ec_len)) {
+		BUG_ON(cex->ec_type != EXT4_EXT_CACHE_GAP &&
+				cex->ec_type != EXT4_EXT_CACHE_EXTENT);
 		ex->ee_block = cpu_to_le32(cex->ec_block);
 		ext4_ext_store_pblock(ex, cex->ec_start);
 		ex->ee_len = cpu_to_le16(cex->ec_len);
 		ext_debug("%u cached by %u:%u:%llu\n",
 				block,
 				cex->ec_block, cex->ec_len, cex->ec_start);
+		list_move(&ece->ece_lru, &ei->i_ext_cache_lru);
 		ret = cex->ec_type;
+		break;
 	}
-errout:
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
+	spin_unlock(&ei->i_block_reservation_lock);
 	return ret;
 }
 
@@ -2350,6 +2588,21 @@ ext4_ext_more_to_rm(struct ext4_ext_path *path)
 	return 1;
 }
 
+/*
+ * ext4_ext_ra_children:
+ * the walk below visits the children of an index block from the last
+ * to the first one, so start reading all of them before descending into
+ * the first, instead of reading them one synchronous block at a time.
+ */
+static void ext4_ext_ra_children(struct inode *inode,
+				 struct ext4_extent_header *eh)
+{
+	struct ext4_extent_idx *ix;
+
+	for (ix = EXT_LAST_INDEX(eh); ix >= EXT_FIRST_INDEX(eh); ix--)
+		sb_breadahead(inode->i_sb, idx_pblock(ix));
+}
+
 static int ext4_ext_remove_space(struct inode *inode, ext4_lblk_t start)
 {
 	struct super_block *sb = inode->i_sb;
@@ -2407,6 +2660,8 @@ again:
 			/* this level hasn't been touched yet */
 			path[i].p_idx = EXT_LAST_INDEX(path[i].p_hdr);
 			path[i].p_block = le16_to_cpu(path[i].p_hdr->eh_entries)+1;
+			if (le16_to_cpu(path[i].p_hdr->eh_entries) > 1)
+				ext4_ext_ra_children(inode, path[i].p_hdr);
 			ext_debug("init index ptr: hdr 0x%p, num %d\n",
 				  path[i].p_hdr,
 				  le16_to_cpu(path[i].p_hdr->eh_entries));
@@ -2536,80 +2791,35 @@ void ext4_ext_release(struct super_block *sb)
 #endif
 }
 
-static void bi_complete(struct bio *bio, int error)
-{
-	complete((struct completion *)bio->bi_private);
-}
-
+/*
+ * Zero out the blocks of extent @ex on disk.  All the bios of the extent
+ * are in flight at the same time and are waited for once, before the
+ * extent is marked initialized.
+ */
 /* FIXME!! we need to try to merge to left or right after zero-out  */
 static int ext4_ext_zeroout(struct inode *inode, struct ext4_extent *ex)
 {
-	int ret;
-	struct bio *bio;
-	int blkbits, blocksize;
+	struct blk_zeroout_batch zb;
+	int blkbits = inode->i_blkbits;
 	sector_t ee_pblock;
-	struct completion event;
-	unsigned int ee_len, len, done, offset;
+	unsigned int ee_len;
+	int err, ret;
 
-
-	blkbits   = inode->i_blkbits;
-	blocksize = inode->i_sb->s_blocksize;
 	ee_len    = ext4_ext_get_actual_len(ex);
 	ee_pblock = ext_pblock(ex);
 
-	/* convert ee_pblock to 512 byte sectors */
-	ee_pblock = ee_pblock << (blkbits - 9);
-
-	while (ee_len > 0) {
-
-		if (ee_len > BIO_MAX_PAGES)
-			len = BIO_MAX_PAGES;
-		else
-			len = ee_len;
-
-		bio = bio_alloc(GFP_NOIO, len);
-		if (!bio)
-			return -ENOMEM;
-
-		bio->bi_sector = ee_pblock;
-		bio->bi_bdev   = inode->i_sb->s_bdev;
-
-		done = 0;
-		offset = 0;
-		while (done < len) {
-			ret = bio_add_page(bio, ZERO_PAGE(0),
-							blocksize, offset);
-			if (ret != blocksize) {
-				/*
-				 * We can't add any more pages because of
-				 * hardware limitations.  Start a new bio.
-				 */
-				break;
-			}
-			done++;
-			offset += blocksize;
-			if (offset >= PAGE_CACHE_SIZE)
-				offset = 0;
-		}
-
-		init_completion(&event);
-		bio->bi_private = &event;
-		bio->bi_end_io = bi_complete;
-		submit_bio(WRITE, bio);
-		wait_for_completion(&event);
-
-		if (!test_bit(BIO_UPTODATE, &bio->bi_flags)) {
-			bio_put(bio);
-			return -EIO;
-		}
-		bio_put(bio);
-		ee_len    -= done;
-		ee_pblock += done  << (blkbits - 9);
-	}
-	return 0;
+	blk_zeroout_batch_init(&zb);
+	err = blkdev_issue_zeroout_async(inode->i_sb->s_bdev,
+			ee_pblock << (blkbits - 9),
+			(sector_t)ee_len << (blkbits - 9), GFP_NOIO, &zb);
+	/* wait for the submitted bios even if not all could be submitted */
+	ret = blk_zeroout_batch_wait(&zb);
+	if (err)
+		return err;
+	/* the extent is left uninitialized by the callers on any error */
+	return ret ? -EIO : 0;
 }
 
-#define EXT4_EXT_ZERO_LEN 7
 /*
  * This function is called by ext4_ext_map_blocks() if someone tries to write
  * to an uninitialized extent. It may result in splitting the uninitialized
@@ -2636,6 +2846,7 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	int err = 0;
 	int ret = 0;
 	int may_zeroout;
+	unsigned int zero_len = EXT4_SB(inode->i_sb)->s_extent_zeroout_len;
 
 	ext_debug("ext4_ext_convert_to_initialized: inode %lu, logical"
 		"block %llu, max_blocks %u\n", inode->i_ino,
@@ -2668,8 +2879,8 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	err = ext4_ext_get_access(handle, inode, path + depth);
 	if (err)
 		goto out;
-	/* If extent has less than 2*EXT4_EXT_ZERO_LEN zerout directly */
-	if (ee_len <= 2*EXT4_EXT_ZERO_LEN && may_zeroout) {
+	/* If extent has less than 2*zero_len zerout directly */
+	if (ee_len <= 2*zero_len && may_zeroout) {
 		err =  ext4_ext_zeroout(inode, &orig_ex);
 		if (err)
 			goto fix_extent_len;
@@ -2699,8 +2910,8 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 	/* ex3: to ee_block + ee_len : uninitialised */
 	if (allocated > map->m_len) {
 		unsigned int newdepth;
-		/* If extent has less than EXT4_EXT_ZERO_LEN zerout directly */
-		if (allocated <= EXT4_EXT_ZERO_LEN && may_zeroout) {
+		/* If extent has less than zero_len zerout directly */
+		if (allocated <= zero_len && may_zeroout) {
 			/*
 			 * map->m_lblk == ee_block is handled by the zerouout
 			 * at the beginning.
@@ -2822,11 +3033,11 @@ static int ext4_ext_convert_to_initialized(handle_t *handle,
 
 		allocated = map->m_len;
 
-		/* If extent has less than EXT4_EXT_ZERO_LEN and we are trying
+		/* If extent has less than zero_len and we are trying
 		 * to insert a extent in the middle zerout directly
 		 * otherwise give the extent a chance to merge to left
 		 */
-		if (le16_to_cpu(orig_ex.ee_len) <= EXT4_EXT_ZERO_LEN &&
+		if (le16_to_cpu(orig_ex.ee_len) <= zero_len &&
 			map->m_lblk != ee_block && may_zeroout) {
 			err =  ext4_ext_zeroout(inode, &orig_ex);
 			if (err)
@@ -3540,6 +3751,7 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 	/* previous routine could use block we allocated */
 	newblock = ext_pblock(&newex);
 	allocated = ext4_ext_get_actual_len(&newex);
+	ext4_fc_track_range(handle, inode, newblock, allocated);
 	if (allocated > map->m_len)
 		allocated = map->m_len;
 	map->m_flags |= EXT4_MAP_NEW;
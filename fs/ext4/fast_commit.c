@@ -0,0 +1,317 @@
+/*
+ * linux/fs/ext4/fast_commit.c
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Fast commits for fsync.
+ *
+ * An fsync of a file that was only written to in the running transaction
+ * writes a single block to the fast commit area of the journal, with a copy
+ * of the on-disk inode and the block ranges allocated to the file in the
+ * running transaction, instead of committing the running transaction.
+ * On recovery, the fast commit blocks of the transaction that did not
+ * commit are replayed on top of the recovered log: the allocated ranges are
+ * set in the block bitmaps and the inodes are copied to the inode tables.
+ *
+ * This is only correct as long as no other change in the running
+ * transaction is needed to make sense of the replayed inode, so:
+ * - the running transaction is ineligible once it has seen any handle that
+ *   was not started by the write path with ext4_journal_start_fc(), or any
+ *   block free or orphan list change.
+ * - the file is ineligible unless all its extents are in the inode and all
+ *   the blocks allocated to it in the running transaction were tracked.
+ * Everything else falls back to a full commit.
+ */
+
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/pagemap.h>
+#include "ext4.h"
+#include "ext4_jbd2.h"
+#include "ext4_extents.h"
+
+/*
+ * Fast commit block tags, following the jbd2 fast commit header
+ */
+#define EXT4_FC_TAG_ADD_RANGE	1	/* Blocks allocated to an inode */
+#define EXT4_FC_TAG_INODE	2	/* Copy of an on-disk inode */
+
+struct ext4_fc_tag {
+	__le16	fc_tag;
+	__le16	fc_len;		/* Length of payload after the tag */
+};
+
+struct ext4_fc_add_range {
+	__le32	fc_ino;
+	__le32	fc_len;		/* Number of blocks */
+	__le32	fc_pblk_lo;
+	__le32	fc_pblk_hi;
+};
+
+struct ext4_fc_inode {
+	__le32	fc_ino;
+	__u8	fc_raw_inode[0];
+};
+
+/*
+ * ext4_fc_mark_ineligible() - fall back to full commit for this transaction
+ */
+void ext4_fc_mark_ineligible(struct super_block *sb, handle_t *handle)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	tid_t tid;
+
+	if (!ext4_handle_valid(handle))
+		return;
+	tid = handle->h_transaction->t_tid;
+	if (sbi->s_fc_ineligible_tid != tid)
+		sbi->s_fc_ineligible_tid = tid;
+}
+
+/*
+ * ext4_fc_track_range() - record blocks allocated to inode by this handle
+ * Called under i_data_sem.
+ */
+void ext4_fc_track_range(handle_t *handle, struct inode *inode,
+			 ext4_fsblk_t pblk, unsigned int len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_fc_range *r;
+	tid_t tid;
+
+	if (!ext4_handle_valid(handle))
+		return;
+	tid = handle->h_transaction->t_tid;
+	if (ei->i_fc_tid != tid) {
+		ei->i_fc_tid = tid;
+		ei->i_fc_nr = 0;
+		ei->i_fc_ineligible = 0;
+	}
+	if (ei->i_fc_nr) {
+		r = &ei->i_fc_range[ei->i_fc_nr - 1];
+		if (r->pblk + r->len == pblk) {
+			r->len += len;
+			return;
+		}
+	}
+	if (ei->i_fc_nr == EXT4_FC_RANGES) {
+		ei->i_fc_ineligible = 1;
+		return;
+	}
+	r = &ei->i_fc_range[ei->i_fc_nr++];
+	r->pblk = pblk;
+	r->len = len;
+}
+
+/*
+ * ext4_fc_commit() - make fsync of inode durable with a fast commit
+ * @commit_tid:	the transaction that holds the inode's changes
+ *
+ * Returns 0 if the fast commit was written and -EAGAIN if the transaction
+ * has to be committed instead.
+ */
+int ext4_fc_commit(struct inode *inode, tid_t commit_tid)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	journal_t *journal = sbi->s_journal;
+	unsigned int isize = EXT4_INODE_SIZE(sb);
+	struct ext4_fc_add_range *fr;
+	struct ext4_fc_inode *fi;
+	struct ext4_fc_tag *tag;
+	struct ext4_iloc iloc;
+	struct buffer_head *bh;
+	unsigned int i, nr, len;
+	char *p;
+	int err;
+
+	if (sbi->s_fc_ineligible_tid == commit_tid ||
+	    !ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+	    !list_empty(&ei->i_orphan))
+		return -EAGAIN;
+
+	err = ext4_get_inode_loc(inode, &iloc);
+	if (err)
+		return -EAGAIN;
+
+	down_read(&ei->i_data_sem);
+	nr = ei->i_fc_tid == commit_tid ? ei->i_fc_nr : 0;
+	len = sizeof(jbd2_fc_header_t) +
+		nr * (sizeof(*tag) + sizeof(*fr)) +
+		sizeof(*tag) + sizeof(*fi) + isize;
+	if ((ei->i_fc_tid == commit_tid && ei->i_fc_ineligible) ||
+	    ext_depth(inode) || len > journal->j_blocksize) {
+		up_read(&ei->i_data_sem);
+		brelse(iloc.bh);
+		return -EAGAIN;
+	}
+	bh = jbd2_fc_get_buf(journal, commit_tid);
+	if (IS_ERR(bh)) {
+		up_read(&ei->i_data_sem);
+		brelse(iloc.bh);
+		return -EAGAIN;
+	}
+
+	p = bh->b_data + sizeof(jbd2_fc_header_t);
+	for (i = 0; i < nr; i++) {
+		tag = (struct ext4_fc_tag *)p;
+		tag->fc_tag = cpu_to_le16(EXT4_FC_TAG_ADD_RANGE);
+		tag->fc_len = cpu_to_le16(sizeof(*fr));
+		fr = (struct ext4_fc_add_range *)(tag + 1);
+		fr->fc_ino = cpu_to_le32(inode->i_ino);
+		fr->fc_len = cpu_to_le32(ei->i_fc_range[i].len);
+		fr->fc_pblk_lo = cpu_to_le32((u32)ei->i_fc_range[i].pblk);
+		fr->fc_pblk_hi = cpu_to_le32(ei->i_fc_range[i].pblk >> 32);
+		p = (char *)(fr + 1);
+	}
+	tag = (struct ext4_fc_tag *)p;
+	tag->fc_tag = cpu_to_le16(EXT4_FC_TAG_INODE);
+	tag->fc_len = cpu_to_le16(sizeof(*fi) + isize);
+	fi = (struct ext4_fc_inode *)(tag + 1);
+	fi->fc_ino = cpu_to_le32(inode->i_ino);
+	memcpy(fi->fc_raw_inode, ext4_raw_inode(&iloc), isize);
+	up_read(&ei->i_data_sem);
+	brelse(iloc.bh);
+
+	/*
+	 * Blocks allocated to the file by writeback after the caller synced
+	 * the data may be referenced by the copied extents.  Write them first.
+	 */
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (!err)
+		err = jbd2_fc_write_buf(journal, bh, len);
+	else {
+		unlock_buffer(bh);
+		brelse(bh);
+	}
+	return err ? -EAGAIN : 0;
+}
+
+static int ext4_fc_replay_range(struct super_block *sb,
+				struct ext4_fc_add_range *fr)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_group_desc *gdp;
+	struct buffer_head *bitmap_bh, *gd_bh;
+	ext4_fsblk_t block;
+	ext4_group_t group;
+	ext4_grpblk_t bit;
+	unsigned long count, n, i, set;
+	__u32 free;
+
+	block = ((ext4_fsblk_t)le32_to_cpu(fr->fc_pblk_hi) << 32) |
+		le32_to_cpu(fr->fc_pblk_lo);
+	count = le32_to_cpu(fr->fc_len);
+	if (block < le32_to_cpu(sbi->s_es->s_first_data_block) ||
+	    block + count < block ||
+	    block + count > ext4_blocks_count(sbi->s_es))
+		return -EIO;
+
+	while (count) {
+		ext4_get_group_no_and_offset(sb, block, &group, &bit);
+		n = min_t(unsigned long, count, EXT4_BLOCKS_PER_GROUP(sb) - bit);
+		gdp = ext4_get_group_desc(sb, group, &gd_bh);
+		if (!gdp)
+			return -EIO;
+		bitmap_bh = ext4_read_block_bitmap(sb, group);
+		if (!bitmap_bh)
+			return -EIO;
+		for (i = 0, set = 0; i < n; i++)
+			if (!ext4_set_bit(bit + i, bitmap_bh->b_data))
+				set++;
+		free = ext4_free_blks_count(sb, gdp);
+		ext4_free_blks_set(sb, gdp, free > set ? free - set : 0);
+		gdp->bg_flags &= cpu_to_le16(~EXT4_BG_BLOCK_UNINIT);
+		gdp->bg_checksum = ext4_group_desc_csum(sbi, group, gdp);
+		if (sbi->s_log_groups_per_flex)
+			atomic_sub(set, &sbi->s_flex_groups[
+				   ext4_flex_group(sbi, group)].free_blocks);
+		mark_buffer_dirty(bitmap_bh);
+		mark_buffer_dirty(gd_bh);
+		brelse(bitmap_bh);
+		block += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static int ext4_fc_replay_inode(struct super_block *sb,
+				struct ext4_fc_inode *fi, unsigned int len)
+{
+	unsigned long ino = le32_to_cpu(fi->fc_ino);
+	unsigned int isize = EXT4_INODE_SIZE(sb);
+	struct ext4_group_desc *gdp;
+	struct buffer_head *bh;
+	unsigned long offset;
+	ext4_fsblk_t block;
+
+	if (len != sizeof(*fi) + isize || ino < EXT4_FIRST_INO(sb) ||
+	    ino > le32_to_cpu(EXT4_SB(sb)->s_es->s_inodes_count))
+		return -EIO;
+	gdp = ext4_get_group_desc(sb, (ino - 1) / EXT4_INODES_PER_GROUP(sb),
+				  NULL);
+	if (!gdp)
+		return -EIO;
+	offset = ((ino - 1) % EXT4_INODES_PER_GROUP(sb)) * isize;
+	block = ext4_inode_table(sb, gdp) + (offset >> EXT4_BLOCK_SIZE_BITS(sb));
+	bh = sb_bread(sb, block);
+	if (!bh)
+		return -EIO;
+	lock_buffer(bh);
+	memcpy(bh->b_data + (offset & (sb->s_blocksize - 1)),
+	       fi->fc_raw_inode, isize);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * ext4_fc_replay() - replay a fast commit block on recovery
+ * Called by jbd2 for each valid fast commit block of the transaction that
+ * did not commit, after the log has been replayed.
+ */
+int ext4_fc_replay(journal_t *journal, struct buffer_head *bh)
+{
+	struct super_block *sb = journal->j_private;
+	jbd2_fc_header_t *fc = (jbd2_fc_header_t *)bh->b_data;
+	char *p = bh->b_data + sizeof(*fc);
+	char *end = bh->b_data + be32_to_cpu(fc->fc_len);
+	struct ext4_fc_tag *tag;
+	unsigned int len;
+	int err = 0;
+
+	while (!err && p + sizeof(*tag) <= end) {
+		tag = (struct ext4_fc_tag *)p;
+		len = le16_to_cpu(tag->fc_len);
+		p += sizeof(*tag);
+		if (p + len > end) {
+			err = -EIO;
+			break;
+		}
+		switch (le16_to_cpu(tag->fc_tag)) {
+		case EXT4_FC_TAG_ADD_RANGE:
+			if (len != sizeof(struct ext4_fc_add_range))
+				err = -EIO;
+			else
+				err = ext4_fc_replay_range(sb,
+					(struct ext4_fc_add_range *)p);
+			break;
+		case EXT4_FC_TAG_INODE:
+			err = ext4_fc_replay_inode(sb,
+					(struct ext4_fc_inode *)p, len);
+			break;
+		default:
+			err = -EIO;
+		}
+		p += len;
+	}
+	if (err)
+		ext4_msg(sb, KERN_ERR, "corrupted fast commit block %u of "
+			 "transaction %u", be32_to_cpu(fc->fc_index),
+			 be32_to_cpu(fc->fc_header.h_sequence));
+	return err;
+}
@@ -115,6 +115,13 @@ int ext4_sync_file(struct file *file, int datasync)
 		return ext4_force_commit(inode->i_sb);
 
 	commit_tid = datasync ? ei->i_datasync_tid : ei->i_sync_tid;
+	/*
+	 * If the inode's changes are only in the running transaction and
+	 * it can be fast committed, one fast commit block makes them durable.
+	 */
+	if (test_opt(inode->i_sb, FAST_COMMIT) &&
+	    !ext4_fc_commit(inode, commit_tid))
+		return ret;
 	if (jbd2_log_start_commit(journal, commit_tid)) {
 		/*
 		 * When the journal is on a different device than the
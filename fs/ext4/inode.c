@@ -45,6 +45,7 @@
 #include "xattr.h"
 #include "acl.h"
 #include "ext4_extents.h"
+#include "snapshot.h"
 
 #include <trace/events/ext4.h>
 
@@ -579,11 +580,14 @@ static int ext4_blks_to_allocate(Indirect *branch, int k, unsigned int blks,
  *	the indirect blocks(if needed) and the first direct block,
  *	@blks:	on return it will store the total number of allocated
  *		direct blocks
+ *	@data_blk: an existing block to use as the (only) direct block
+ *		instead of allocating one, or 0
  */
 static int ext4_alloc_blocks(handle_t *handle, struct inode *inode,
 			     ext4_lblk_t iblock, ext4_fsblk_t goal,
 			     int indirect_blks, int blks,
-			     ext4_fsblk_t new_blocks[4], int *err)
+			     ext4_fsblk_t new_blocks[4], ext4_fsblk_t data_blk,
+			     int *err)
 {
 	struct ext4_allocation_request ar;
 	int target, i;
@@ -642,6 +646,11 @@ static int ext4_alloc_blocks(handle_t *handle, struct inode *inode,
 	blk_allocated = count;
 	if (!target)
 		goto allocated;
+	if (data_blk) {
+		new_blocks[index] = data_blk;
+		blk_allocated = 1;
+		goto allocated;
+	}
 	/* Now allocate data blocks */
 	memset(&ar, 0, sizeof(ar));
 	ar.inode = inode;
@@ -697,6 +706,7 @@ failed_out:
  *	@blks: number of allocated direct blocks
  *	@offsets: offsets (in the blocks) to store the pointers to next.
  *	@branch: place to store the chain in.
+ *	@data_blk: existing direct block to link instead of allocating one, or 0
  *
  *	This function allocates blocks, zeroes out all but the last one,
  *	links them into chain and (if we are synchronous) writes them to disk.
@@ -718,7 +728,8 @@ failed_out:
 static int ext4_alloc_branch(handle_t *handle, struct inode *inode,
 			     ext4_lblk_t iblock, int indirect_blks,
 			     int *blks, ext4_fsblk_t goal,
-			     ext4_lblk_t *offsets, Indirect *branch)
+			     ext4_lblk_t *offsets, Indirect *branch,
+			     ext4_fsblk_t data_blk)
 {
 	int blocksize = inode->i_sb->s_blocksize;
 	int i, n = 0;
@@ -729,7 +740,7 @@ static int ext4_alloc_branch(handle_t *handle, struct inode *inode,
 	ext4_fsblk_t current_block;
 
 	num = ext4_alloc_blocks(handle, inode, iblock, goal, indirect_blks,
-				*blks, new_blocks, &err);
+				*blks, new_blocks, data_blk, &err);
 	if (err)
 		return err;
 
@@ -795,7 +806,8 @@ failed:
 	for (i = n+1; i < indirect_blks; i++)
 		ext4_free_blocks(handle, inode, 0, new_blocks[i], 1, 0);
 
-	ext4_free_blocks(handle, inode, 0, new_blocks[i], num, 0);
+	if (!data_blk)
+		ext4_free_blocks(handle, inode, 0, new_blocks[i], num, 0);
 
 	return err;
 }
@@ -809,6 +821,8 @@ failed:
  * @where: location of missing link
  * @num:   number of indirect blocks we are adding
  * @blks:  number of direct blocks we are adding
+ * @data_blk: the direct block was not allocated by ext4_alloc_branch()
+ *	   and must not be freed on error
  *
  * This function fills the missing link and does all housekeeping needed in
  * inode (->i_blocks, etc.). In case of success we end up with the full
@@ -816,7 +830,7 @@ failed:
  */
 static int ext4_splice_branch(handle_t *handle, struct inode *inode,
 			      ext4_lblk_t block, Indirect *where, int num,
-			      int blks)
+			      int blks, ext4_fsblk_t data_blk)
 {
 	int i;
 	int err = 0;
@@ -882,8 +896,9 @@ err_out:
 		ext4_free_blocks(handle, inode, where[i].bh, 0, 1,
 				 EXT4_FREE_BLOCKS_FORGET);
 	}
-	ext4_free_blocks(handle, inode, 0, le32_to_cpu(where[num].key),
-			 blks, 0);
+	if (!data_blk)
+		ext4_free_blocks(handle, inode, 0, le32_to_cpu(where[num].key),
+				 blks, 0);
 
 	return err;
 }
@@ -906,6 +921,9 @@ err_out:
  *
  * `handle' can be NULL if create == 0.
  *
+ * With EXT4_GET_BLOCKS_SNAPSHOT_MOVE, the block in map->m_pblk is linked
+ * into the snapshot file instead of a newly allocated block.
+ *
  * return > 0, # of blocks mapped or allocated.
  * return = 0, if plain lookup failed.
  * return < 0, error case.
@@ -930,6 +948,7 @@ static int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	int depth;
 	int count = 0;
 	ext4_fsblk_t first_block = 0;
+	ext4_fsblk_t data_blk = 0;
 
 	J_ASSERT(!(ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS)));
 	J_ASSERT(handle != NULL || (flags & EXT4_GET_BLOCKS_CREATE) == 0);
@@ -975,14 +994,19 @@ static int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	 * Next look up the indirect map to count the totoal number of
 	 * direct blocks to allocate for this branch.
 	 */
-	count = ext4_blks_to_allocate(partial, indirect_blks,
-				      map->m_len, blocks_to_boundary);
+	if (flags & EXT4_GET_BLOCKS_SNAPSHOT_MOVE) {
+		data_blk = map->m_pblk;
+		count = 1;
+	} else
+		count = ext4_blks_to_allocate(partial, indirect_blks,
+					      map->m_len, blocks_to_boundary);
 	/*
 	 * Block out ext4_truncate while we alter the tree
 	 */
 	err = ext4_alloc_branch(handle, inode, map->m_lblk, indirect_blks,
 				&count, goal,
-				offsets + (partial - chain), partial);
+				offsets + (partial - chain), partial,
+				data_blk);
 
 	/*
 	 * The ext4_splice_branch call will free and forget any buffers
@@ -993,7 +1017,8 @@ static int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	 */
 	if (!err)
 		err = ext4_splice_branch(handle, inode, map->m_lblk,
-					 partial, indirect_blks, count);
+					 partial, indirect_blks, count,
+					 data_blk);
 	if (err)
 		goto cleanup;
 
@@ -1361,6 +1386,8 @@ static int _ext4_get_block(struct inode *inode, sector_t iblock,
 	}
 
 	ret = ext4_map_blocks(handle, inode, &map, flags);
+	if (!ret && !flags)
+		ret = ext4_snapshot_read_through(inode, &map);
 	if (ret > 0) {
 		map_bh(bh, inode->i_sb, map.m_pblk);
 		bh->b_state = (bh->b_state & ~EXT4_MAP_FLAGS) | map.m_flags;
@@ -1524,6 +1551,20 @@ static int do_journal_get_write_access(handle_t *handle,
 	return ext4_journal_get_write_access(handle, bh);
 }
 
+/*
+ * Copy the blocks a write is about to overwrite in place to the active
+ * snapshot.  New, delayed and unwritten blocks hold nothing to copy.
+ */
+static int do_snapshot_get_write_access(handle_t *handle,
+					struct buffer_head *bh)
+{
+	if (!buffer_mapped(bh) || buffer_new(bh) || buffer_delay(bh) ||
+	    buffer_unwritten(bh))
+		return 0;
+	return ext4_snapshot_get_write_access(handle, bh->b_page->mapping->host,
+					      bh);
+}
+
 /*
  * Truncate blocks that were not used by write. We have to truncate the
  * pagecache as well so that corresponding buffers get properly unmapped.
@@ -1559,7 +1600,7 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	to = from + len;
 
 retry:
-	handle = ext4_journal_start(inode, needed_blocks);
+	handle = ext4_journal_start_fc(inode, needed_blocks);
 	if (IS_ERR(handle)) {
 		ret = PTR_ERR(handle);
 		goto out;
@@ -1587,6 +1628,9 @@ retry:
 	if (!ret && ext4_should_journal_data(inode)) {
 		ret = walk_page_buffers(handle, page_buffers(page),
 				from, to, NULL, do_journal_get_write_access);
+	} else if (!ret && ext4_snapshot_active(inode->i_sb)) {
+		ret = walk_page_buffers(handle, page_buffers(page),
+				from, to, NULL, do_snapshot_get_write_access);
 	}
 
 	if (ret) {
@@ -3007,7 +3051,7 @@ retry:
 		needed_blocks = ext4_da_writepages_trans_blocks(inode);
 
 		/* start a new transaction*/
-		handle = ext4_journal_start(inode, needed_blocks);
+		handle = ext4_journal_start_fc(inode, needed_blocks);
 		if (IS_ERR(handle)) {
 			ret = PTR_ERR(handle);
 			ext4_msg(inode->i_sb, KERN_CRIT, "%s: jbd2_start: "
@@ -3168,7 +3212,7 @@ retry:
 	 * to journalling the i_disksize update if writes to the end
 	 * of file which has an already mapped buffer.
 	 */
-	handle = ext4_journal_start(inode, 1);
+	handle = ext4_journal_start_fc(inode, 1);
 	if (IS_ERR(handle)) {
 		ret = PTR_ERR(handle);
 		goto out;
@@ -3187,6 +3231,9 @@ retry:
 
 	ret = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata,
 				ext4_da_get_block_prep);
+	if (!ret && ext4_snapshot_active(inode->i_sb))
+		ret = walk_page_buffers(handle, page_buffers(page),
+				from, to, NULL, do_snapshot_get_write_access);
 	if (ret < 0) {
 		unlock_page(page);
 		ext4_journal_stop(handle);
@@ -4007,6 +4054,13 @@ static ssize_t ext4_direct_IO(int rw, struct kiocb *iocb,
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
 
+	/*
+	 * Direct writes would overwrite blocks before they are copied to
+	 * the active snapshot: fall back to buffered I/O.
+	 */
+	if ((rw & WRITE) && ext4_snapshot_active(inode->i_sb))
+		return 0;
+
 	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
 		return ext4_ext_direct_IO(rw, iocb, iov, offset, nr_segs);
 
@@ -4194,9 +4248,10 @@ int ext4_block_truncate_page(handle_t *handle,
 	if (ext4_should_journal_data(inode)) {
 		BUFFER_TRACE(bh, "get write access");
 		err = ext4_journal_get_write_access(handle, bh);
-		if (err)
-			goto unlock;
-	}
+	} else
+		err = ext4_snapshot_get_write_access(handle, inode, bh);
+	if (err)
+		goto unlock;
 
 	zero_user(page, offset, length);
 
@@ -4948,6 +5003,9 @@ void ext4_set_inode_flags(struct inode *inode)
 		inode->i_flags |= S_NOATIME;
 	if (flags & EXT4_DIRSYNC_FL)
 		inode->i_flags |= S_DIRSYNC;
+	/* blocks of a snapshot file are not charged to its owner */
+	if (flags & EXT4_SNAPFILE_FL)
+		inode->i_flags |= S_NOQUOTA;
 }
 
 /* Propagate flags from i_flags to EXT4_I(inode)->i_flags */
@@ -5095,6 +5153,9 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 		spin_unlock(&journal->j_state_lock);
 		ei->i_sync_tid = tid;
 		ei->i_datasync_tid = tid;
+		/* blocks allocated before the inode was read are not known */
+		ei->i_fc_tid = tid;
+		ei->i_fc_ineligible = 1;
 	}
 
 	if (EXT4_INODE_SIZE(inode->i_sb) > EXT4_GOOD_OLD_INODE_SIZE) {
@@ -5872,7 +5933,7 @@ void ext4_dirty_inode(struct inode *inode)
 {
 	handle_t *handle;
 
-	handle = ext4_journal_start(inode, 2);
+	handle = ext4_journal_start_fc(inode, 2);
 	if (IS_ERR(handle))
 		goto out;
 
@@ -5983,6 +6044,7 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	struct file *file = vma->vm_file;
 	struct inode *inode = file->f_path.dentry->d_inode;
 	struct address_space *mapping = inode->i_mapping;
+	int snapshot = ext4_snapshot_active(inode->i_sb);
 
 	/*
 	 * Get i_alloc_sem to stop truncates messing with the inode. We cannot
@@ -5996,7 +6058,8 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 		goto out_unlock;
 	}
 	ret = 0;
-	if (PageMappedToDisk(page))
+	/* with an active snapshot, write_begin copies the blocks to it */
+	if (PageMappedToDisk(page) && !snapshot)
 		goto out_unlock;
 
 	if (page->index == size >> PAGE_CACHE_SHIFT)
@@ -6011,7 +6074,7 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	 * journal_start/journal_stop which can block and take
 	 * long time
 	 */
-	if (page_has_buffers(page)) {
+	if (page_has_buffers(page) && !snapshot) {
 		if (!walk_page_buffers(NULL, page_buffers(page), 0, len, NULL,
 					ext4_bh_unmapped)) {
 			unlock_page(page);
@@ -17,6 +17,7 @@
 #include <asm/uaccess.h>
 #include "ext4_jbd2.h"
 #include "ext4.h"
+#include "snapshot.h"
 
 long ext4_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -248,6 +249,12 @@ setversion_out:
 			goto mext_out;
 		}
 
+		/* moved data would overwrite blocks the snapshot needs */
+		if (ext4_snapshot_active(inode->i_sb)) {
+			err = -EBUSY;
+			goto mext_out;
+		}
+
 		err = mnt_want_write(filp->f_path.mnt);
 		if (err)
 			goto mext_out;
@@ -300,6 +307,8 @@ mext_out:
 		int err;
 		if (!is_owner_or_cap(inode))
 			return -EACCES;
+		if (ext4_snapshot_file(inode))
+			return -EPERM;
 
 		err = mnt_want_write(filp->f_path.mnt);
 		if (err)
@@ -331,6 +340,27 @@ mext_out:
 		return err;
 	}
 
+	case EXT4_IOC_SNAPSHOT_TAKE:
+	case EXT4_IOC_SNAPSHOT_DELETE:
+	{
+		int err;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		err = mnt_want_write(filp->f_path.mnt);
+		if (err)
+			return err;
+		mutex_lock(&inode->i_mutex);
+		if (cmd == EXT4_IOC_SNAPSHOT_TAKE)
+			err = ext4_snapshot_take(inode);
+		else
+			err = ext4_snapshot_delete(inode);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write(filp->f_path.mnt);
+		return err;
+	}
+
 	default:
 		return -ENOTTY;
 	}
@@ -397,6 +427,8 @@ long ext4_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return err;
 	}
 	case EXT4_IOC_MOVE_EXT:
+	case EXT4_IOC_SNAPSHOT_TAKE:
+	case EXT4_IOC_SNAPSHOT_DELETE:
 		break;
 	default:
 		return -ENOIOCTLCMD;
@@ -22,8 +22,10 @@
  */
 
 #include "mballoc.h"
+#include "snapshot.h"
 #include <linux/debugfs.h>
 #include <linux/slab.h>
+#include <linux/list_sort.h>
 #include <trace/events/ext4.h>
 
 /*
@@ -338,11 +340,14 @@
 static struct kmem_cache *ext4_pspace_cachep;
 static struct kmem_cache *ext4_ac_cachep;
 static struct kmem_cache *ext4_free_ext_cachep;
+static struct workqueue_struct *ext4_discard_wq;
 static void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 					ext4_group_t group);
 static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 						ext4_group_t group);
 static void release_blocks_on_commit(journal_t *journal, transaction_t *txn);
+static void ext4_mb_discard_work(struct work_struct *work);
+static int ext4_mb_flush_discards(struct super_block *sb);
 
 static inline void *mb_correct_addr_and_bit(int *bit, void *addr)
 {
@@ -603,6 +608,7 @@ static int __mb_check_buddy(struct ext4_buddy *e4b, char *file,
 
 	grp = ext4_get_group_info(sb, e4b->bd_group);
 	buddy = mb_find_buddy(e4b, 0, &max);
+	spin_lock(&grp->bb_pa_lock);
 	list_for_each(cur, &grp->bb_prealloc_list) {
 		ext4_group_t groupnr;
 		struct ext4_prealloc_space *pa;
@@ -612,6 +618,7 @@ static int __mb_check_buddy(struct ext4_buddy *e4b, char *file,
 		for (i = 0; i < pa->pa_len; i++)
 			MB_CHECK_ASSERT(mb_test_bit(k + i, buddy));
 	}
+	spin_unlock(&grp->bb_pa_lock);
 	return 0;
 }
 #undef MB_CHECK_ASSERT
@@ -660,11 +667,15 @@ static void ext4_mb_mark_free_simple(struct super_block *sb,
 
 /*
  * Cache the order of the largest free extent we have available in this block
- * group.
+ * group, and keep the group on the matching s_mb_largest_free_orders list
+ * so that cr 0 and 1 can find candidate groups without walking all of them.
+ * Called with the group locked.
  */
 static void
 mb_set_largest_free_order(struct super_block *sb, struct ext4_group_info *grp)
 {
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int old = grp->bb_largest_free_order;
 	int i;
 	int bits;
 
@@ -677,6 +688,23 @@ mb_set_largest_free_order(struct super_block *sb, struct ext4_group_info *grp)
 			break;
 		}
 	}
+
+	if (old == grp->bb_largest_free_order &&
+	    !list_empty(&grp->bb_largest_free_order_node))
+		return;
+
+	if (!list_empty(&grp->bb_largest_free_order_node)) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[old]);
+		list_del_init(&grp->bb_largest_free_order_node);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[old]);
+	}
+	i = grp->bb_largest_free_order;
+	if (i >= 0) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[i]);
+		list_add_tail(&grp->bb_largest_free_order_node,
+			      &sbi->s_mb_largest_free_orders[i]);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[i]);
+	}
 }
 
 static noinline_for_stack
@@ -723,7 +751,8 @@ void ext4_mb_generate_buddy(struct super_block *sb,
 	}
 	mb_set_largest_free_order(sb, grp);
 
-	clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state));
+	if (test_and_clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state)))
+		atomic_dec(&EXT4_SB(sb)->s_mb_uninit_groups);
 
 	period = get_cycles() - period;
 	spin_lock(&EXT4_SB(sb)->s_bal_lock);
@@ -911,12 +940,15 @@ static int ext4_mb_init_cache(struct page *page, char *incore)
 			trace_ext4_mb_bitmap_load(sb, group);
 
 			/* see comments in ext4_mb_put_pa() */
+			grinfo = ext4_get_group_info(sb, group);
 			ext4_lock_group(sb, group);
+			spin_lock(&grinfo->bb_pa_lock);
 			memcpy(data, bitmap, blocksize);
 
 			/* mark all preallocated blks used in in-core bitmap */
 			ext4_mb_generate_from_pa(sb, data, group);
 			ext4_mb_generate_from_freelist(sb, data, group);
+			spin_unlock(&grinfo->bb_pa_lock);
 			ext4_unlock_group(sb, group);
 
 			/* set incore so that the buddy information can be
@@ -1860,6 +1892,33 @@ void ext4_mb_scan_aligned(struct ext4_allocation_context *ac,
 	}
 }
 
+/*
+ * Start reading the block bitmaps of the next nr groups that still need
+ * their buddy generated, so that a scan over them does not stall on one
+ * synchronous bitmap read after another.  Returns the group following
+ * the last one looked at.
+ */
+static ext4_group_t ext4_mb_prefetch(struct super_block *sb,
+				     ext4_group_t group, unsigned int nr,
+				     ext4_group_t ngroups)
+{
+	struct ext4_group_info *grp;
+	struct ext4_group_desc *desc;
+
+	while (nr-- > 0) {
+		grp = ext4_get_group_info(sb, group);
+		if (EXT4_MB_GRP_NEED_INIT(grp) && grp->bb_free) {
+			desc = ext4_get_group_desc(sb, group, NULL);
+			if (desc && !(desc->bg_flags &
+				      cpu_to_le16(EXT4_BG_BLOCK_UNINIT)))
+				sb_breadahead(sb, ext4_block_bitmap(sb, desc));
+		}
+		if (++group >= ngroups)
+			group = 0;
+	}
+	return group;
+}
+
 /* This is now called BEFORE we load the buddy bitmap. */
 static int ext4_mb_good_group(struct ext4_allocation_context *ac,
 				ext4_group_t group, int cr)
@@ -1993,10 +2052,112 @@ void ext4_mb_put_buddy_cache_lock(struct super_block *sb,
 
 }
 
+/*
+ * Load the buddy of a group that looked good and let the scan for
+ * criteria cr have a go at it.
+ */
+static int ext4_mb_scan_group(struct ext4_allocation_context *ac,
+			      ext4_group_t group, int cr)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_buddy e4b;
+	int err;
+
+	err = ext4_mb_load_buddy(sb, group, &e4b);
+	if (err)
+		return err;
+
+	ext4_lock_group(sb, group);
+
+	/*
+	 * We need to check again after locking the
+	 * block group
+	 */
+	if (!ext4_mb_good_group(ac, group, cr)) {
+		ext4_unlock_group(sb, group);
+		ext4_mb_unload_buddy(&e4b);
+		return 0;
+	}
+
+	ac->ac_groups_scanned++;
+	if (cr == 0)
+		ext4_mb_simple_scan_group(ac, &e4b);
+	else if (cr == 1 && ac->ac_g_ex.fe_len == EXT4_SB(sb)->s_stripe)
+		ext4_mb_scan_aligned(ac, &e4b);
+	else
+		ext4_mb_complex_scan_group(ac, &e4b);
+
+	ext4_unlock_group(sb, group);
+	ext4_mb_unload_buddy(&e4b);
+	return 0;
+}
+
+/*
+ * For cr 0 and 1 a group can only qualify if its largest free extent is
+ * at least as long as the request, so take candidates from the lists of
+ * groups indexed by bb_largest_free_order, smallest sufficient order
+ * first, instead of walking every group.  Returns 1 when the lists were
+ * exhausted and they cover every group, i.e. the linear scan for this cr
+ * would find nothing more; 0 when the caller still has to do it.
+ */
+static int ext4_mb_scan_order_lists(struct ext4_allocation_context *ac,
+				    ext4_group_t ngroups, int cr, int *errp)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_group_info *grp;
+	unsigned int tries = sbi->s_mb_order_list_tries;
+	int order, skip, n, found;
+	ext4_group_t group = 0;
+
+	if (!tries)
+		return 0;
+
+	if (cr == 0)
+		order = ac->ac_2order;
+	else
+		order = fls(ac->ac_g_ex.fe_len) - 1;
+
+	for (; order <= sb->s_blocksize_bits + 1; order++) {
+		skip = 0;
+		do {
+			found = 0;
+			n = 0;
+			read_lock(&sbi->s_mb_largest_free_orders_locks[order]);
+			list_for_each_entry(grp,
+					&sbi->s_mb_largest_free_orders[order],
+					bb_largest_free_order_node) {
+				if (n++ < skip)
+					continue;
+				skip++;
+				if (grp->bb_group >= ngroups ||
+				    EXT4_MB_GRP_NEED_INIT(grp) ||
+				    !ext4_mb_good_group(ac, grp->bb_group, cr))
+					continue;
+				group = grp->bb_group;
+				found = 1;
+				break;
+			}
+			read_unlock(&sbi->s_mb_largest_free_orders_locks[order]);
+			if (!found)
+				break;
+
+			*errp = ext4_mb_scan_group(ac, group, cr);
+			if (*errp || ac->ac_status != AC_STATUS_CONTINUE)
+				return 1;
+		} while (--tries);
+
+		if (!tries)
+			return 0;
+	}
+
+	return atomic_read(&sbi->s_mb_uninit_groups) == 0;
+}
+
 static noinline_for_stack int
 ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 {
-	ext4_group_t ngroups, group, i;
+	ext4_group_t ngroups, group, prefetch_grp, i;
 	int cr;
 	int err = 0;
 	int bsbits;
@@ -2061,48 +2222,36 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 repeat:
 	for (; cr < 4 && ac->ac_status == AC_STATUS_CONTINUE; cr++) {
 		ac->ac_criteria = cr;
+
+		if (cr <= 1 && ext4_mb_scan_order_lists(ac, ngroups, cr, &err)) {
+			if (err)
+				goto out;
+			continue;
+		}
+
 		/*
 		 * searching for the right group start
 		 * from the goal value specified
 		 */
 		group = ac->ac_g_ex.fe_group;
+		prefetch_grp = group;
 
 		for (i = 0; i < ngroups; group++, i++) {
 			if (group == ngroups)
 				group = 0;
 
+			if (group == prefetch_grp && sbi->s_mb_prefetch)
+				prefetch_grp = ext4_mb_prefetch(sb, group,
+						sbi->s_mb_prefetch, ngroups);
+
 			/* This now checks without needing the buddy page */
 			if (!ext4_mb_good_group(ac, group, cr))
 				continue;
 
-			err = ext4_mb_load_buddy(sb, group, &e4b);
+			err = ext4_mb_scan_group(ac, group, cr);
 			if (err)
 				goto out;
 
-			ext4_lock_group(sb, group);
-
-			/*
-			 * We need to check again after locking the
-			 * block group
-			 */
-			if (!ext4_mb_good_group(ac, group, cr)) {
-				ext4_unlock_group(sb, group);
-				ext4_mb_unload_buddy(&e4b);
-				continue;
-			}
-
-			ac->ac_groups_scanned++;
-			if (cr == 0)
-				ext4_mb_simple_scan_group(ac, &e4b);
-			else if (cr == 1 &&
-					ac->ac_g_ex.fe_len == sbi->s_stripe)
-				ext4_mb_scan_aligned(ac, &e4b);
-			else
-				ext4_mb_complex_scan_group(ac, &e4b);
-
-			ext4_unlock_group(sb, group);
-			ext4_mb_unload_buddy(&e4b);
-
 			if (ac->ac_status != AC_STATUS_CONTINUE)
 				break;
 		}
@@ -2282,6 +2431,8 @@ int ext4_mb_add_groupinfo(struct super_block *sb, ext4_group_t group,
 	}
 	set_bit(EXT4_GROUP_INFO_NEED_INIT_BIT,
 		&(meta_group_info[i]->bb_state));
+	atomic_inc(&sbi->s_mb_uninit_groups);
+	meta_group_info[i]->bb_group = group;
 
 	/*
 	 * initialize bb_free to be able to skip
@@ -2296,6 +2447,8 @@ int ext4_mb_add_groupinfo(struct super_block *sb, ext4_group_t group,
 	}
 
 	INIT_LIST_HEAD(&meta_group_info[i]->bb_prealloc_list);
+	spin_lock_init(&meta_group_info[i]->bb_pa_lock);
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_largest_free_order_node);
 	init_rwsem(&meta_group_info[i]->alloc_sem);
 	meta_group_info[i]->bb_free_root = RB_ROOT;
 	meta_group_info[i]->bb_largest_free_order = -1;  /* uninit */
@@ -2402,6 +2555,37 @@ err_freesgi:
 	return -ENOMEM;
 }
 
+/*
+ * Started at mount with -o mb_preinit: generate the buddy of every group
+ * in the background, prefetching the bitmaps ahead, so that allocations do
+ * not have to wait for ext4_mb_init_group().  Stopped by ext4_mb_release().
+ */
+static int ext4_mb_preinit_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	ext4_group_t group, prefetch_grp = 0;
+
+	for (group = 0; group < ngroups && !kthread_should_stop(); group++) {
+		if (group == prefetch_grp && sbi->s_mb_prefetch)
+			prefetch_grp = ext4_mb_prefetch(sb, group,
+						sbi->s_mb_prefetch, ngroups);
+		if (EXT4_MB_GRP_NEED_INIT(ext4_get_group_info(sb, group)))
+			ext4_mb_init_group(sb, group);
+		cond_resched();
+	}
+
+	/* kthread_stop() needs us around until it is called */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
 int ext4_mb_init(struct super_block *sb, int needs_recovery)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
@@ -2439,13 +2623,26 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 		i++;
 	} while (i <= sb->s_blocksize_bits + 1);
 
+	i = sb->s_blocksize_bits + 2;
+	sbi->s_mb_largest_free_orders =
+		kmalloc(i * sizeof(struct list_head), GFP_KERNEL);
+	sbi->s_mb_largest_free_orders_locks =
+		kmalloc(i * sizeof(rwlock_t), GFP_KERNEL);
+	if (sbi->s_mb_largest_free_orders == NULL ||
+	    sbi->s_mb_largest_free_orders_locks == NULL) {
+		ret = -ENOMEM;
+		goto out_free_orders;
+	}
+	for (j = 0; j < i; j++) {
+		INIT_LIST_HEAD(&sbi->s_mb_largest_free_orders[j]);
+		rwlock_init(&sbi->s_mb_largest_free_orders_locks[j]);
+	}
+	atomic_set(&sbi->s_mb_uninit_groups, 0);
+
 	/* init file for buddy data */
 	ret = ext4_mb_init_backend(sb);
-	if (ret != 0) {
-		kfree(sbi->s_mb_offsets);
-		kfree(sbi->s_mb_maxs);
-		return ret;
-	}
+	if (ret != 0)
+		goto out_free_orders;
 
 	spin_lock_init(&sbi->s_md_lock);
 	spin_lock_init(&sbi->s_bal_lock);
@@ -2456,11 +2653,21 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	sbi->s_mb_stream_request = MB_DEFAULT_STREAM_THRESHOLD;
 	sbi->s_mb_order2_reqs = MB_DEFAULT_ORDER2_REQS;
 	sbi->s_mb_group_prealloc = MB_DEFAULT_GROUP_PREALLOC;
+	sbi->s_mb_order_list_tries = MB_DEFAULT_ORDER_LIST_TRIES;
+	sbi->s_mb_prefetch = MB_DEFAULT_PREFETCH;
+	sbi->s_mb_discard_batch = MB_DEFAULT_DISCARD_BATCH;
+	sbi->s_sb = sb;
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	spin_lock_init(&sbi->s_discard_lock);
+	mutex_init(&sbi->s_discard_mutex);
+	INIT_DELAYED_WORK(&sbi->s_discard_work, ext4_mb_discard_work);
 
 	sbi->s_locality_groups = alloc_percpu(struct ext4_locality_group);
 	if (sbi->s_locality_groups == NULL) {
 		kfree(sbi->s_mb_offsets);
 		kfree(sbi->s_mb_maxs);
+		kfree(sbi->s_mb_largest_free_orders);
+		kfree(sbi->s_mb_largest_free_orders_locks);
 		return -ENOMEM;
 	}
 	for_each_possible_cpu(i) {
@@ -2470,6 +2677,7 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 		for (j = 0; j < PREALLOC_TB_SIZE; j++)
 			INIT_LIST_HEAD(&lg->lg_prealloc_list[j]);
 		spin_lock_init(&lg->lg_prealloc_lock);
+		lg->lg_last_pa = NULL;
 	}
 
 	if (sbi->s_proc)
@@ -2478,7 +2686,25 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 
 	if (sbi->s_journal)
 		sbi->s_journal->j_commit_callback = release_blocks_on_commit;
+
+	if (test_opt(sb, MB_PREINIT) && !(sb->s_flags & MS_RDONLY)) {
+		sbi->s_mb_preinit_task = kthread_run(ext4_mb_preinit_thread,
+						     sb, "ext4-mbinit");
+		if (IS_ERR(sbi->s_mb_preinit_task)) {
+			ext4_msg(sb, KERN_WARNING, "failed to start buddy "
+				 "pre-generation thread (%ld)",
+				 PTR_ERR(sbi->s_mb_preinit_task));
+			sbi->s_mb_preinit_task = NULL;
+		}
+	}
 	return 0;
+
+out_free_orders:
+	kfree(sbi->s_mb_offsets);
+	kfree(sbi->s_mb_maxs);
+	kfree(sbi->s_mb_largest_free_orders);
+	kfree(sbi->s_mb_largest_free_orders_locks);
+	return ret;
 }
 
 /* need to called with the ext4 group lock held */
@@ -2507,6 +2733,14 @@ int ext4_mb_release(struct super_block *sb)
 	struct ext4_group_info *grinfo;
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 
+	if (sbi->s_mb_preinit_task) {
+		kthread_stop(sbi->s_mb_preinit_task);
+		sbi->s_mb_preinit_task = NULL;
+	}
+
+	cancel_delayed_work_sync(&sbi->s_discard_work);
+	ext4_mb_flush_discards(sb);
+
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
 			grinfo = ext4_get_group_info(sb, i);
@@ -2527,6 +2761,8 @@ int ext4_mb_release(struct super_block *sb)
 	}
 	kfree(sbi->s_mb_offsets);
 	kfree(sbi->s_mb_maxs);
+	kfree(sbi->s_mb_largest_free_orders);
+	kfree(sbi->s_mb_largest_free_orders_locks);
 	if (sbi->s_buddy_cache)
 		iput(sbi->s_buddy_cache);
 	if (sbi->s_mb_stats) {
@@ -2560,54 +2796,112 @@ int ext4_mb_release(struct super_block *sb)
 	return 0;
 }
 
+static int ext4_free_data_cmp(void *priv, struct list_head *a,
+			      struct list_head *b)
+{
+	struct ext4_free_data *fa, *fb;
+
+	fa = list_entry(a, struct ext4_free_data, list);
+	fb = list_entry(b, struct ext4_free_data, list);
+	if (fa->group != fb->group)
+		return fa->group < fb->group ? -1 : 1;
+	return fa->start_blk < fb->start_blk ? -1 : 1;
+}
+
 /*
- * This function is called by the jbd2 layer once the commit has finished,
- * so we know we can free the blocks that were released with that commit.
+ * Discard the extents of one group freed by the committed transaction,
+ * merging adjacent ones so that each contiguous run gets a single
+ * request. @first and @last delimit the group's sorted entries.
  */
-static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
+static void ext4_mb_discard_freed(struct super_block *sb,
+				  struct ext4_free_data *first,
+				  struct ext4_free_data *last)
+{
+	struct ext4_free_data *entry = first;
+	ext4_grpblk_t start, count;
+	ext4_fsblk_t discard_block;
+	int ret;
+
+	while (test_opt(sb, DISCARD)) {
+		start = entry->start_blk;
+		count = entry->count;
+		while (entry != last) {
+			entry = list_entry(entry->list.next,
+					   struct ext4_free_data, list);
+			if (entry->start_blk != start + count)
+				break;
+			count += entry->count;
+		}
+
+		discard_block = start +
+			ext4_group_first_block_no(sb, first->group);
+		trace_ext4_discard_blocks(sb,
+				(unsigned long long)discard_block, count);
+		ret = sb_issue_discard(sb, discard_block, count);
+		if (ret == EOPNOTSUPP) {
+			ext4_warning(sb, "discard not supported, disabling");
+			clear_opt(EXT4_SB(sb)->s_mount_opt, DISCARD);
+		}
+		if (start + count == last->start_blk + last->count)
+			break;
+	}
+}
+
+/*
+ * Give the freed extents on @head back to the buddy.  The entries are
+ * sorted by group and block first, so that each group's buddy is loaded
+ * and locked once for all of its extents and, with @discard, adjacent
+ * extents share one discard.  Stops once @max blocks (0: no limit) have
+ * been released, leaving the rest on @head.  Returns the blocks released.
+ */
+static int ext4_mb_release_freed(struct super_block *sb,
+				 struct list_head *head, int discard,
+				 unsigned int max)
 {
-	struct super_block *sb = journal->j_private;
 	struct ext4_buddy e4b;
 	struct ext4_group_info *db;
 	int err, count = 0, count2 = 0;
-	struct ext4_free_data *entry;
+	struct ext4_free_data *entry, *first, *last;
 	struct list_head *l, *ltmp;
+	ext4_group_t group;
 
-	list_for_each_safe(l, ltmp, &txn->t_private_list) {
-		entry = list_entry(l, struct ext4_free_data, list);
-
-		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
-			 entry->count, entry->group, entry);
-
-		if (test_opt(sb, DISCARD)) {
-			int ret;
-			ext4_fsblk_t discard_block;
-
-			discard_block = entry->start_blk +
-				ext4_group_first_block_no(sb, entry->group);
-			trace_ext4_discard_blocks(sb,
-					(unsigned long long)discard_block,
-					entry->count);
-			ret = sb_issue_discard(sb, discard_block, entry->count);
-			if (ret == EOPNOTSUPP) {
-				ext4_warning(sb,
-					"discard not supported, disabling");
-				clear_opt(EXT4_SB(sb)->s_mount_opt, DISCARD);
-			}
+	list_sort(NULL, head, ext4_free_data_cmp);
+
+	while (!list_empty(head) && (!max || count < max)) {
+		first = list_entry(head->next, struct ext4_free_data, list);
+		group = first->group;
+		last = first;
+		while (last->list.next != head) {
+			entry = list_entry(last->list.next,
+					   struct ext4_free_data, list);
+			if (entry->group != group)
+				break;
+			last = entry;
 		}
 
-		err = ext4_mb_load_buddy(sb, entry->group, &e4b);
+		if (discard)
+			ext4_mb_discard_freed(sb, first, last);
+
+		err = ext4_mb_load_buddy(sb, group, &e4b);
 		/* we expect to find existing buddy because it's pinned */
 		BUG_ON(err != 0);
 
 		db = e4b.bd_info;
-		/* there are blocks to put in buddy to make them really free */
-		count += entry->count;
-		count2++;
-		ext4_lock_group(sb, entry->group);
-		/* Take it out of per group rb tree */
-		rb_erase(&entry->node, &(db->bb_free_root));
-		mb_free_blocks(NULL, &e4b, entry->start_blk, entry->count);
+		ext4_lock_group(sb, group);
+		l = &first->list;
+		do {
+			entry = list_entry(l, struct ext4_free_data, list);
+			mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
+				 entry->count, entry->group, entry);
+			/* put the blocks in buddy to make them really free */
+			count += entry->count;
+			count2++;
+			/* Take it out of per group rb tree */
+			rb_erase(&entry->node, &(db->bb_free_root));
+			mb_free_blocks(NULL, &e4b, entry->start_blk,
+				       entry->count);
+			l = l->next;
+		} while (entry != last);
 
 		if (!db->bb_free_root.rb_node) {
 			/* No more items in the per group rb tree
@@ -2616,12 +2910,94 @@ static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 			page_cache_release(e4b.bd_buddy_page);
 			page_cache_release(e4b.bd_bitmap_page);
 		}
-		ext4_unlock_group(sb, entry->group);
-		kmem_cache_free(ext4_free_ext_cachep, entry);
+		ext4_unlock_group(sb, group);
 		ext4_mb_unload_buddy(&e4b);
+
+		l = &first->list;
+		do {
+			entry = list_entry(l, struct ext4_free_data, list);
+			ltmp = l->next;
+			list_del(l);
+			kmem_cache_free(ext4_free_ext_cachep, entry);
+			l = ltmp;
+		} while (entry != last);
 	}
 
 	mb_debug(1, "freed %u blocks in %u structures\n", count, count2);
+	return count;
+}
+
+/*
+ * With -o discard, freed extents are not given back to the buddy at
+ * commit time but queued on s_discard_list, where they stay in
+ * bb_free_root so that nobody can allocate them.  ext4_mb_discard_work()
+ * later merges the queued extents of many transactions, discards them at
+ * most s_mb_discard_batch blocks per run and only then frees them, so
+ * that slow TRIM does not hold up the journal commit.
+ */
+static void ext4_mb_discard_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_discard_work.work);
+	struct super_block *sb = sbi->s_sb;
+	LIST_HEAD(list);
+
+	mutex_lock(&sbi->s_discard_mutex);
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &list);
+	spin_unlock(&sbi->s_discard_lock);
+
+	ext4_mb_release_freed(sb, &list, 1, sbi->s_mb_discard_batch);
+
+	if (!list_empty(&list)) {
+		spin_lock(&sbi->s_discard_lock);
+		list_splice(&list, &sbi->s_discard_list);
+		spin_unlock(&sbi->s_discard_lock);
+		queue_delayed_work(ext4_discard_wq, &sbi->s_discard_work,
+				   MB_DISCARD_DELAY);
+	}
+	mutex_unlock(&sbi->s_discard_mutex);
+}
+
+/*
+ * Release everything waiting on the discard queue now, without
+ * discarding it; used when we are out of space and at umount.
+ */
+static int ext4_mb_flush_discards(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	LIST_HEAD(list);
+	int freed;
+
+	mutex_lock(&sbi->s_discard_mutex);
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &list);
+	spin_unlock(&sbi->s_discard_lock);
+	freed = ext4_mb_release_freed(sb, &list, 0, 0);
+	mutex_unlock(&sbi->s_discard_mutex);
+	return freed;
+}
+
+/*
+ * This function is called by the jbd2 layer once the commit has finished,
+ * so we know we can free the blocks that were released with that commit.
+ */
+static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
+{
+	struct super_block *sb = journal->j_private;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (test_opt(sb, DISCARD)) {
+		spin_lock(&sbi->s_discard_lock);
+		list_splice_tail_init(&txn->t_private_list,
+				      &sbi->s_discard_list);
+		spin_unlock(&sbi->s_discard_lock);
+		queue_delayed_work(ext4_discard_wq, &sbi->s_discard_work,
+				   MB_DISCARD_DELAY);
+		return;
+	}
+
+	ext4_mb_release_freed(sb, &txn->t_private_list, 0, 0);
 }
 
 #ifdef CONFIG_EXT4_DEBUG
@@ -2685,6 +3061,14 @@ int __init init_ext4_mballoc(void)
 		kmem_cache_destroy(ext4_ac_cachep);
 		return -ENOMEM;
 	}
+
+	ext4_discard_wq = create_singlethread_workqueue("ext4-discard");
+	if (ext4_discard_wq == NULL) {
+		kmem_cache_destroy(ext4_pspace_cachep);
+		kmem_cache_destroy(ext4_ac_cachep);
+		kmem_cache_destroy(ext4_free_ext_cachep);
+		return -ENOMEM;
+	}
 	ext4_create_debugfs_entry();
 	return 0;
 }
@@ -2699,6 +3083,7 @@ void exit_ext4_mballoc(void)
 	kmem_cache_destroy(ext4_pspace_cachep);
 	kmem_cache_destroy(ext4_ac_cachep);
 	kmem_cache_destroy(ext4_free_ext_cachep);
+	destroy_workqueue(ext4_discard_wq);
 	ext4_remove_debugfs_entry();
 }
 
@@ -3146,6 +3531,19 @@ ext4_mb_check_group_pa(ext4_fsblk_t goal_block,
 	return pa;
 }
 
+/*
+ * index of the lg_prealloc_list bucket for a PA with free blocks
+ */
+static inline int ext4_mb_pa_order(ext4_grpblk_t free)
+{
+	int order = fls(free) - 1;
+
+	/* The max size of hash table is PREALLOC_TB_SIZE */
+	if (order > PREALLOC_TB_SIZE - 1)
+		order = PREALLOC_TB_SIZE - 1;
+	return order;
+}
+
 /*
  * search goal blocks in preallocated space
  */
@@ -3199,10 +3597,30 @@ ext4_mb_use_preallocated(struct ext4_allocation_context *ac)
 	lg = ac->ac_lg;
 	if (lg == NULL)
 		return 0;
-	order  = fls(ac->ac_o_ex.fe_len) - 1;
-	if (order > PREALLOC_TB_SIZE - 1)
-		/* The max size of hash table is PREALLOC_TB_SIZE */
-		order = PREALLOC_TB_SIZE - 1;
+
+	/*
+	 * Small files of this CPU usually keep packing into the PA the
+	 * previous allocation came from: try it before walking the lists.
+	 */
+	rcu_read_lock();
+	pa = rcu_dereference(lg->lg_last_pa);
+	if (pa) {
+		spin_lock(&pa->pa_lock);
+		if (pa->pa_deleted == 0 &&
+				pa->pa_free >= ac->ac_o_ex.fe_len) {
+			atomic_inc(&pa->pa_count);
+			cpa = pa;
+		}
+		spin_unlock(&pa->pa_lock);
+	}
+	rcu_read_unlock();
+	if (cpa) {
+		ext4_mb_use_group_pa(ac, cpa);
+		ac->ac_criteria = 20;
+		return 1;
+	}
+
+	order = ext4_mb_pa_order(ac->ac_o_ex.fe_len);
 
 	goal_block = ext4_grp_offs_to_block(ac->ac_sb, &ac->ac_g_ex);
 	/*
@@ -3259,7 +3677,7 @@ static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 /*
  * the function goes through all preallocation in this group and marks them
  * used in in-core bitmap. buddy must be generated from this bitmap
- * Need to be called with ext4 group lock held
+ * Need to be called with ext4 group lock and bb_pa_lock held
  */
 static noinline_for_stack
 void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
@@ -3276,7 +3694,7 @@ void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 
 	/* all form of preallocation discards first load group,
 	 * so the only competing code is preallocation use.
-	 * we don't need any locking here
+	 * bb_pa_lock held by the caller keeps the list stable
 	 * notice we do NOT ignore preallocations with pa_deleted
 	 * otherwise we could leave used blocks available for
 	 * allocation in buddy when concurrent ext4_mb_put_pa()
@@ -3306,6 +3724,22 @@ static void ext4_mb_pa_callback(struct rcu_head *head)
 	kmem_cache_free(ext4_pspace_cachep, pa);
 }
 
+/*
+ * pa is being freed: make sure its locality group does not keep it as
+ * lg_last_pa.  Called after pa was unlinked with list_del_rcu(), so a
+ * reader that already picked it up is still covered by RCU.
+ */
+static inline void ext4_mb_forget_lg_pa(struct ext4_prealloc_space *pa)
+{
+	struct ext4_locality_group *lg;
+
+	if (pa->pa_type != MB_GROUP_PA)
+		return;
+	lg = container_of(pa->pa_obj_lock, struct ext4_locality_group,
+			  lg_prealloc_lock);
+	cmpxchg(&lg->lg_last_pa, pa, NULL);
+}
+
 /*
  * drops a reference to preallocated space descriptor
  * if this was the last reference and the space is consumed
@@ -3313,6 +3747,7 @@ static void ext4_mb_pa_callback(struct rcu_head *head)
 static void ext4_mb_put_pa(struct ext4_allocation_context *ac,
 			struct super_block *sb, struct ext4_prealloc_space *pa)
 {
+	struct ext4_group_info *grp_info;
 	ext4_group_t grp;
 	ext4_fsblk_t grp_blk;
 
@@ -3351,15 +3786,19 @@ static void ext4_mb_put_pa(struct ext4_allocation_context *ac,
 	 *
 	 * thus, P1 initializes buddy with B available. to prevent this
 	 * we make "copy" and "mark all PAs" atomic and serialize "drop PA"
-	 * against that pair
+	 * against that pair. both sides hold bb_pa_lock, so dropping
+	 * a PA doesn't need the group lock and doesn't contend with
+	 * allocations working on the buddy
 	 */
-	ext4_lock_group(sb, grp);
+	grp_info = ext4_get_group_info(sb, grp);
+	spin_lock(&grp_info->bb_pa_lock);
 	list_del(&pa->pa_group_list);
-	ext4_unlock_group(sb, grp);
+	spin_unlock(&grp_info->bb_pa_lock);
 
 	spin_lock(pa->pa_obj_lock);
 	list_del_rcu(&pa->pa_inode_list);
 	spin_unlock(pa->pa_obj_lock);
+	ext4_mb_forget_lg_pa(pa);
 
 	call_rcu(&(pa)->u.pa_rcu, ext4_mb_pa_callback);
 }
@@ -3444,9 +3883,9 @@ ext4_mb_new_inode_pa(struct ext4_allocation_context *ac)
 	pa->pa_obj_lock = &ei->i_prealloc_lock;
 	pa->pa_inode = ac->ac_inode;
 
-	ext4_lock_group(sb, ac->ac_b_ex.fe_group);
+	spin_lock(&grp->bb_pa_lock);
 	list_add(&pa->pa_group_list, &grp->bb_prealloc_list);
-	ext4_unlock_group(sb, ac->ac_b_ex.fe_group);
+	spin_unlock(&grp->bb_pa_lock);
 
 	spin_lock(pa->pa_obj_lock);
 	list_add_rcu(&pa->pa_inode_list, &ei->i_prealloc_list);
@@ -3505,9 +3944,9 @@ ext4_mb_new_group_pa(struct ext4_allocation_context *ac)
 	pa->pa_obj_lock = &lg->lg_prealloc_lock;
 	pa->pa_inode = NULL;
 
-	ext4_lock_group(sb, ac->ac_b_ex.fe_group);
+	spin_lock(&grp->bb_pa_lock);
 	list_add(&pa->pa_group_list, &grp->bb_prealloc_list);
-	ext4_unlock_group(sb, ac->ac_b_ex.fe_group);
+	spin_unlock(&grp->bb_pa_lock);
 
 	/*
 	 * We will later add the new pa to the right bucket
@@ -3655,6 +4094,7 @@ ext4_mb_discard_group_preallocations(struct super_block *sb,
 	int err;
 	int busy = 0;
 	int free = 0;
+	int batch;
 
 	mb_debug(1, "discard preallocation for group %u\n", group);
 
@@ -3682,7 +4122,7 @@ ext4_mb_discard_group_preallocations(struct super_block *sb,
 	if (ac)
 		ac->ac_sb = sb;
 repeat:
-	ext4_lock_group(sb, group);
+	spin_lock(&grp->bb_pa_lock);
 	list_for_each_entry_safe(pa, tmp,
 				&grp->bb_prealloc_list, pa_group_list) {
 		spin_lock(&pa->pa_lock);
@@ -3711,7 +4151,7 @@ repeat:
 	/* if we still need more blocks and some PAs were used, try again */
 	if (free < needed && busy) {
 		busy = 0;
-		ext4_unlock_group(sb, group);
+		spin_unlock(&grp->bb_pa_lock);
 		/*
 		 * Yield the CPU here so that we don't get soft lockup
 		 * in non preempt case.
@@ -3720,31 +4160,51 @@ repeat:
 		goto repeat;
 	}
 
+	spin_unlock(&grp->bb_pa_lock);
+
 	/* found anything to free? */
 	if (list_empty(&list)) {
 		BUG_ON(free != 0);
 		goto out;
 	}
 
-	/* now free all selected PAs */
-	list_for_each_entry_safe(pa, tmp, &list, u.pa_tmp_list) {
-
-		/* remove from object (inode or locality group) */
+	/* remove all selected PAs from object (inode or locality group) */
+	list_for_each_entry(pa, &list, u.pa_tmp_list) {
 		spin_lock(pa->pa_obj_lock);
 		list_del_rcu(&pa->pa_inode_list);
 		spin_unlock(pa->pa_obj_lock);
+		ext4_mb_forget_lg_pa(pa);
+	}
 
+	/*
+	 * now give the space back to the buddy. the PAs are off the
+	 * group list already and the loaded buddy keeps the in-core
+	 * bitmap from being regenerated, so the group lock can be
+	 * dropped every few PAs to let allocators in
+	 */
+	batch = 0;
+	ext4_lock_group(sb, group);
+	list_for_each_entry(pa, &list, u.pa_tmp_list) {
 		if (pa->pa_type == MB_GROUP_PA)
 			ext4_mb_release_group_pa(&e4b, pa, ac);
 		else
 			ext4_mb_release_inode_pa(&e4b, bitmap_bh, pa, ac);
 
+		if (++batch >= MB_DISCARD_BATCH) {
+			batch = 0;
+			ext4_unlock_group(sb, group);
+			cond_resched();
+			ext4_lock_group(sb, group);
+		}
+	}
+	ext4_unlock_group(sb, group);
+
+	list_for_each_entry_safe(pa, tmp, &list, u.pa_tmp_list) {
 		list_del(&pa->u.pa_tmp_list);
 		call_rcu(&(pa)->u.pa_rcu, ext4_mb_pa_callback);
 	}
 
 out:
-	ext4_unlock_group(sb, group);
 	if (ac)
 		kmem_cache_free(ext4_ac_cachep, ac);
 	ext4_mb_unload_buddy(&e4b);
@@ -3855,8 +4315,11 @@ repeat:
 			continue;
 		}
 
-		ext4_lock_group(sb, group);
+		spin_lock(&e4b.bd_info->bb_pa_lock);
 		list_del(&pa->pa_group_list);
+		spin_unlock(&e4b.bd_info->bb_pa_lock);
+
+		ext4_lock_group(sb, group);
 		ext4_mb_release_inode_pa(&e4b, bitmap_bh, pa, ac);
 		ext4_unlock_group(sb, group);
 
@@ -3917,7 +4380,7 @@ static void ext4_mb_show_ac(struct ext4_allocation_context *ac)
 		struct ext4_prealloc_space *pa;
 		ext4_grpblk_t start;
 		struct list_head *cur;
-		ext4_lock_group(sb, i);
+		spin_lock(&grp->bb_pa_lock);
 		list_for_each(cur, &grp->bb_prealloc_list) {
 			pa = list_entry(cur, struct ext4_prealloc_space,
 					pa_group_list);
@@ -3928,7 +4391,7 @@ static void ext4_mb_show_ac(struct ext4_allocation_context *ac)
 			printk(KERN_ERR "PA:%u:%d:%u \n", i,
 			       start, pa->pa_len);
 		}
-		ext4_unlock_group(sb, i);
+		spin_unlock(&grp->bb_pa_lock);
 
 		if (grp->bb_free == 0)
 			continue;
@@ -4096,6 +4559,7 @@ ext4_mb_discard_lg_preallocations(struct super_block *sb,
 		spin_unlock(&pa->pa_lock);
 
 		list_del_rcu(&pa->pa_inode_list);
+		ext4_mb_forget_lg_pa(pa);
 		list_add(&pa->u.pa_tmp_list, &discard_list);
 
 		total_entries--;
@@ -4119,8 +4583,11 @@ ext4_mb_discard_lg_preallocations(struct super_block *sb,
 					group);
 			continue;
 		}
-		ext4_lock_group(sb, group);
+		spin_lock(&e4b.bd_info->bb_pa_lock);
 		list_del(&pa->pa_group_list);
+		spin_unlock(&e4b.bd_info->bb_pa_lock);
+
+		ext4_lock_group(sb, group);
 		ext4_mb_release_group_pa(&e4b, pa, ac);
 		ext4_unlock_group(sb, group);
 
@@ -4148,10 +4615,7 @@ static void ext4_mb_add_n_trim(struct ext4_allocation_context *ac)
 	struct ext4_locality_group *lg = ac->ac_lg;
 	struct ext4_prealloc_space *tmp_pa, *pa = ac->ac_pa;
 
-	order = fls(pa->pa_free) - 1;
-	if (order > PREALLOC_TB_SIZE - 1)
-		/* The max size of hash table is PREALLOC_TB_SIZE */
-		order = PREALLOC_TB_SIZE - 1;
+	order = ext4_mb_pa_order(pa->pa_free);
 	/* Add the prealloc space to lg */
 	rcu_read_lock();
 	list_for_each_entry_rcu(tmp_pa, &lg->lg_prealloc_list[order],
@@ -4214,12 +4678,23 @@ static int ext4_mb_release_context(struct ext4_allocation_context *ac)
 		 * make sure the list to which we are adding
 		 * doesn't grow big.  We need to release
 		 * alloc_semp before calling ext4_mb_add_n_trim()
+		 *
+		 * A pa that is already on the list and stays in
+		 * the same bucket is left where it is; trimming
+		 * that bucket is deferred to the next insertion.
 		 */
 		if ((pa->pa_type == MB_GROUP_PA) && likely(pa->pa_free)) {
-			spin_lock(pa->pa_obj_lock);
-			list_del_rcu(&pa->pa_inode_list);
-			spin_unlock(pa->pa_obj_lock);
-			ext4_mb_add_n_trim(ac);
+			if (list_empty(&pa->pa_inode_list)) {
+				ext4_mb_add_n_trim(ac);
+			} else if (ext4_mb_pa_order(pa->pa_free) !=
+				   ext4_mb_pa_order(pa->pa_free +
+						    ac->ac_b_ex.fe_len)) {
+				spin_lock(pa->pa_obj_lock);
+				list_del_rcu(&pa->pa_inode_list);
+				spin_unlock(pa->pa_obj_lock);
+				ext4_mb_add_n_trim(ac);
+			}
+			rcu_assign_pointer(ac->ac_lg->lg_last_pa, pa);
 		}
 		ext4_mb_put_pa(ac, ac->ac_sb, pa);
 	}
@@ -4355,6 +4830,8 @@ repeat:
 		}
 	} else {
 		freed  = ext4_mb_discard_preallocations(sb, ac->ac_o_ex.fe_len);
+		if (!freed)
+			freed = ext4_mb_flush_discards(sb);
 		if (freed)
 			goto repeat;
 		*errp = -ENOSPC;
@@ -4523,6 +5000,7 @@ void ext4_free_blocks(handle_t *handle, struct inode *inode,
 
 	ext4_debug("freeing block %llu\n", block);
 	trace_ext4_free_blocks(inode, block, count, flags);
+	ext4_fc_mark_ineligible(sb, handle);
 
 	if (flags & EXT4_FREE_BLOCKS_FORGET) {
 		struct buffer_head *tbh = bh;
@@ -4539,6 +5017,10 @@ void ext4_free_blocks(handle_t *handle, struct inode *inode,
 		}
 	}
 
+	if (!(flags & EXT4_FREE_BLOCKS_NO_SNAPSHOT) &&
+	    ext4_snapshot_free_blocks(handle, inode, block, count, flags))
+		return;
+
 	/*
 	 * We need to make sure we don't reuse the freed block until
 	 * after the transaction is committed, which we can do by
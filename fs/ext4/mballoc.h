@@ -19,6 +19,7 @@
 #include <linux/seq_file.h>
 #include <linux/blkdev.h>
 #include <linux/mutex.h>
+#include <linux/kthread.h>
 #include "ext4_jbd2.h"
 #include "ext4.h"
 
@@ -94,6 +95,34 @@ extern u8 mb_enable_debug;
  */
 #define MB_DEFAULT_GROUP_PREALLOC	512
 
+/*
+ * number of PAs released to the buddy per group lock hold
+ * when discarding group preallocations
+ */
+#define MB_DISCARD_BATCH		16
+
+/*
+ * How many groups cr 0 and 1 take from the largest free order lists
+ * before falling back to the linear group scan; 0 disables the lists.
+ * Can be tuned via /sys/fs/ext4/<partition>/mb_order_list_tries
+ */
+#define MB_DEFAULT_ORDER_LIST_TRIES	8
+
+/*
+ * How many groups ahead of the scan mballoc starts reading the block
+ * bitmaps of groups whose buddy has not been generated yet.
+ * Can be tuned via /sys/fs/ext4/<partition>/mb_prefetch
+ */
+#define MB_DEFAULT_PREFETCH		32
+
+/*
+ * With -o discard, freed blocks are discarded in the background at most
+ * this many blocks per run, one run every MB_DISCARD_DELAY.
+ * Can be tuned via /sys/fs/ext4/<partition>/mb_discard_batch
+ */
+#define MB_DEFAULT_DISCARD_BATCH	65536
+#define MB_DISCARD_DELAY		HZ
+
 
 struct ext4_free_data {
 	/* this links the free block information from group_info */
@@ -160,6 +189,8 @@ struct ext4_locality_group {
 	/* list of preallocations */
 	struct list_head	lg_prealloc_list[PREALLOC_TB_SIZE];
 	spinlock_t		lg_prealloc_lock;
+	/* PA the last allocation was served from, tried first */
+	struct ext4_prealloc_space *lg_last_pa;
 };
 
 struct ext4_allocation_context {
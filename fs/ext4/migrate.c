@@ -17,6 +17,9 @@
 #include "ext4_jbd2.h"
 #include "ext4_extents.h"
 
+/* no. of finished ranges which are added to the temp inode together */
+#define EXT4_MIGRATE_BATCH	8
+
 /*
  * The contiguous blocks details which can be
  * represented by a single extent
@@ -24,38 +27,54 @@
 struct list_blocks_struct {
 	ext4_lblk_t first_block, last_block;
 	ext4_fsblk_t first_pblock, last_pblock;
+	/* finished ranges, not yet added to temp inode */
+	struct ext4_extent exts[EXT4_MIGRATE_BATCH];
+	int nr_exts;
 };
 
-static int finish_range(handle_t *handle, struct inode *inode,
+/*
+ * Add the finished ranges to the temp inode with a single batch insert
+ */
+static int flush_ranges(handle_t *handle, struct inode *inode,
 				struct list_blocks_struct *lb)
-
 {
-	int retval = 0, needed;
-	struct ext4_extent newext;
+	int retval = 0, needed = 0, depth, i;
 	struct ext4_ext_path *path;
-	if (lb->first_pblock == 0)
+	struct ext4_extent_header *eh;
+
+	if (lb->nr_exts == 0)
 		return 0;
 
-	/* Add the extent to temp inode*/
-	newext.ee_block = cpu_to_le32(lb->first_block);
-	newext.ee_len   = cpu_to_le16(lb->last_block - lb->first_block + 1);
-	ext4_ext_store_pblock(&newext, lb->first_pblock);
-	path = ext4_ext_find_extent(inode, lb->first_block, NULL);
+	path = ext4_ext_find_extent(inode,
+			le32_to_cpu(lb->exts[0].ee_block), NULL);
 
 	if (IS_ERR(path)) {
 		retval = PTR_ERR(path);
-		path = NULL;
 		goto err_out;
 	}
 
 	/*
-	 * Calculate the credit needed to inserting this extent
+	 * Calculate the credit needed to inserting these extents
 	 * Since we are doing this in loop we may accumalate extra
 	 * credit. But below we try to not accumalate too much
 	 * of them by restarting the journal.
+	 * Unless all of them fit into the leaf, each may split it.
 	 */
-	needed = ext4_ext_calc_credits_for_single_extent(inode,
-		    lb->last_block - lb->first_block + 1, path);
+	depth = ext_depth(inode);
+	eh = path[depth].p_hdr;
+	if (le16_to_cpu(eh->eh_max) - le16_to_cpu(eh->eh_entries) <
+	    lb->nr_exts) {
+		ext4_ext_drop_refs(path);
+		kfree(path);
+		path = NULL;
+	}
+	for (i = 0; i < lb->nr_exts; i++)
+		needed += ext4_ext_calc_credits_for_single_extent(inode,
+			    ext4_ext_get_actual_len(&lb->exts[i]), path);
+	if (path) {
+		ext4_ext_drop_refs(path);
+		kfree(path);
+	}
 
 	/*
 	 * Make sure the credit we accumalated is not really high
@@ -76,16 +95,34 @@ static int finish_range(handle_t *handle, struct inode *inode,
 				goto err_out;
 		}
 	}
-	retval = ext4_ext_insert_extent(handle, inode, path, &newext, 0);
+	retval = ext4_ext_insert_extents(handle, inode, lb->exts,
+					 lb->nr_exts, 0);
 err_out:
-	if (path) {
-		ext4_ext_drop_refs(path);
-		kfree(path);
-	}
-	lb->first_pblock = 0;
+	lb->nr_exts = 0;
 	return retval;
 }
 
+static int finish_range(handle_t *handle, struct inode *inode,
+				struct list_blocks_struct *lb)
+
+{
+	struct ext4_extent *newext;
+
+	if (lb->first_pblock == 0)
+		return 0;
+
+	/* Queue the extent for temp inode*/
+	newext = &lb->exts[lb->nr_exts++];
+	newext->ee_block = cpu_to_le32(lb->first_block);
+	newext->ee_len   = cpu_to_le16(lb->last_block - lb->first_block + 1);
+	ext4_ext_store_pblock(newext, lb->first_pblock);
+	lb->first_pblock = 0;
+
+	if (lb->nr_exts < EXT4_MIGRATE_BATCH)
+		return 0;
+	return flush_ranges(handle, inode, lb);
+}
+
 static int update_extent_range(handle_t *handle, struct inode *inode,
 				ext4_fsblk_t pblock, ext4_lblk_t blk_num,
 				struct list_blocks_struct *lb)
@@ -587,6 +624,8 @@ int ext4_ext_migrate(struct inode *inode)
 	 * Build the last extent
 	 */
 	retval = finish_range(handle, tmp_inode, &lb);
+	if (!retval)
+		retval = flush_ranges(handle, tmp_inode, &lb);
 err_out:
 	if (retval)
 		/*
@@ -20,6 +20,12 @@
 #include "ext4_extents.h"
 #include "ext4.h"
 
+/*
+ * ext4_move_extents() lets go of both i_mutexes at least every this many
+ * moved blocks, so that the files stay usable while they are defragmented
+ */
+#define EXT4_MEXT_LOCK_BLOCKS	2048
+
 /**
  * get_ext_path - Find an extent path for designated logical block number.
  *
@@ -1135,6 +1141,42 @@ out:
 	return ret;
 }
 
+/**
+ * mext_inode_relock - Let other users at both files for a moment
+ *
+ * @orig_inode:		original inode
+ * @donor_inode:	donor inode
+ * @blk:		next logical block to be moved
+ * @block_end:		last logical block to be moved (in/out)
+ *
+ * Drop and retake i_mutex of both inodes, then check again that the
+ * rest of the range can be moved, trimming @block_end to the files'
+ * current sizes.  Called without i_data_sem.
+ * Return 0 on success, or a negative error value on failure.
+ */
+static int
+mext_inode_relock(struct inode *orig_inode, struct inode *donor_inode,
+		  ext4_lblk_t blk, ext4_lblk_t *block_end)
+{
+	__u64 len = *block_end - blk + 1;
+	int ret;
+
+	mext_inode_double_unlock(orig_inode, donor_inode);
+	cond_resched();
+	ret = mext_inode_double_lock(orig_inode, donor_inode);
+	if (ret < 0)
+		return ret;
+
+	if (fatal_signal_pending(current))
+		return -EINTR;
+
+	ret = mext_check_arguments(orig_inode, donor_inode, blk, blk, &len);
+	if (ret)
+		return ret;
+	*block_end = blk + len - 1;
+	return 0;
+}
+
 /**
  * ext4_move_extents - Exchange the specified range of a file
  *
@@ -1187,7 +1229,8 @@ ext4_move_extents(struct file *o_filp, struct file *d_filp,
 	struct ext4_extent *ext_prev, *ext_cur, *ext_dummy;
 	ext4_lblk_t block_start = orig_start;
 	ext4_lblk_t block_end, seq_start, add_blocks, file_end, seq_blocks = 0;
-	ext4_lblk_t rest_blocks;
+	ext4_lblk_t rest_blocks, blk;
+	__u64 unlocked_len = 0;
 	pgoff_t orig_page_offset = 0, seq_end_page;
 	int ret1, ret2, depth, last_extent = 0;
 	int blocks_per_page = PAGE_CACHE_SIZE >> orig_inode->i_blkbits;
@@ -1373,6 +1416,28 @@ ext4_move_extents(struct file *o_filp, struct file *d_filp,
 				block_len_in_page = blocks_per_page;
 			else
 				block_len_in_page = rest_blocks;
+
+			/* Do not keep the files locked for the whole range */
+			if (orig_page_offset > seq_end_page ||
+			    (*moved_len - unlocked_len < EXT4_MEXT_LOCK_BLOCKS &&
+			     !need_resched()))
+				continue;
+			unlocked_len = *moved_len;
+			blk = orig_page_offset * blocks_per_page;
+			ret1 = mext_inode_relock(orig_inode, donor_inode, blk,
+						 &block_end);
+			if (ret1 < 0)
+				break;
+			if (*moved_len + block_end - blk + 1 < len)
+				len = *moved_len + block_end - blk + 1;
+			if (blk + rest_blocks - 1 > block_end) {
+				/* The files got shorter meanwhile */
+				rest_blocks = block_end - blk + 1;
+				seq_end_page = block_end >> (PAGE_CACHE_SHIFT -
+							orig_inode->i_blkbits);
+				block_len_in_page = min_t(ext4_lblk_t,
+						rest_blocks, blocks_per_page);
+			}
 		}
 
 		double_down_write_data_sem(orig_inode, donor_inode);
@@ -1989,6 +1989,7 @@ int ext4_orphan_add(handle_t *handle, struct inode *inode)
 
 	if (!ext4_handle_valid(handle))
 		return 0;
+	ext4_fc_mark_ineligible(sb, handle);
 
 	mutex_lock(&EXT4_SB(sb)->s_orphan_lock);
 	if (!list_empty(&EXT4_I(inode)->i_orphan))
@@ -2071,6 +2072,8 @@ int ext4_orphan_del(handle_t *handle, struct inode *inode)
 	/* ext4_handle_valid() assumes a valid handle_t pointer */
 	if (handle && !ext4_handle_valid(handle))
 		return 0;
+	if (handle)
+		ext4_fc_mark_ineligible(inode->i_sb, handle);
 
 	mutex_lock(&EXT4_SB(inode->i_sb)->s_orphan_lock);
 	if (list_empty(&ei->i_orphan))
@@ -0,0 +1,612 @@
+/*
+ * linux/fs/ext4/snapshot.c
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Ext4 snapshots.
+ *
+ * A snapshot is a regular file with the EXT4_SNAPFILE_FL flag, mapped with
+ * indirect blocks, whose size is the size of the file system taken and
+ * whose block N holds what block N of the file system held at the time.
+ * Blocks that are not mapped in the snapshot file have not changed since,
+ * so reads of the snapshot file go through to the file system for them.
+ *
+ * While a snapshot is active, a block that was in use when it was taken
+ * and has not been mapped in the snapshot yet is:
+ * - copied to the snapshot before it is first changed: metadata from
+ *   ext4_journal_get_write_access(), data from write_begin, page_mkwrite
+ *   and truncate; direct writes fall back to buffered writes.
+ * - mapped into the snapshot instead of being freed, from
+ *   ext4_free_blocks().
+ * A block was in use when the snapshot was taken if it is set in the COW
+ * bitmap of its group: the snapshot copy of the group block bitmap, or the
+ * block bitmap itself until it is first changed and copied.
+ *
+ * The copy of a block is written out synchronously before the handle goes
+ * on to change the block, and its mapping is journaled in the same handle
+ * as the change, so the snapshot of the metadata survives a crash.  Data
+ * blocks are written back outside of the journal: after a crash, data
+ * overwrites of the last transactions can be seen through the snapshot.
+ *
+ * Snapshot blocks are allocated with handle->h_cowing set, which keeps the
+ * allocation from being copied itself, so the bitmaps and group descriptors
+ * of the snapshot image count some blocks of the snapshot as in use.
+ *
+ * Only one snapshot is active at a time.  It is taken with the file system
+ * frozen, so the journal is empty and the image is consistent; it can be
+ * loop mounted with "-o ro,noload".
+ */
+
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/highmem.h>
+#include <linux/quotaops.h>
+#include <linux/slab.h>
+#include "ext4.h"
+#include "ext4_jbd2.h"
+#include "snapshot.h"
+
+/*
+ * ext4_snapshot_break() - stop copying blocks to the active snapshot
+ *
+ * Called when a block could not be copied or moved to the snapshot.  The
+ * snapshot no longer matches the file system it was taken of: it is left
+ * in place for the administrator to delete, but is no longer loaded.
+ */
+static void ext4_snapshot_break(struct super_block *sb, int err)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (sbi->s_snapshot_broken)
+		return;
+	sbi->s_snapshot_broken = 1;
+	ext4_msg(sb, KERN_ERR, "snapshot (inode %lu) is broken (error %d), "
+		 "delete it", sbi->s_active_snapshot->i_ino, err);
+	sbi->s_es->s_snapshot_inum = 0;
+	ext4_commit_super(sb, 1);
+}
+
+/*
+ * ext4_snapshot_lookup() - is block @block of the file system in @snapshot?
+ *
+ * Returns 1 and the snapshot copy of the block in @copy if it is, 0 if it
+ * is not and < 0 on error.
+ */
+static int ext4_snapshot_lookup(struct inode *snapshot, ext4_fsblk_t block,
+				ext4_fsblk_t *copy)
+{
+	struct ext4_map_blocks map;
+	int ret;
+
+	map.m_lblk = block;
+	map.m_len = 1;
+	ret = ext4_map_blocks(NULL, snapshot, &map, 0);
+	if (ret <= 0)
+		return ret;
+	if (copy)
+		*copy = map.m_pblk;
+	return 1;
+}
+
+/*
+ * ext4_snapshot_test_cow_bitmap() - was @block in use when the snapshot
+ * was taken?
+ *
+ * Returns 1 if it was, 0 if it was not and < 0 on error.
+ */
+static int ext4_snapshot_test_cow_bitmap(struct inode *snapshot,
+					 ext4_fsblk_t block)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_group_desc *gdp;
+	struct buffer_head *bitmap_bh;
+	ext4_fsblk_t copy;
+	ext4_group_t group;
+	ext4_grpblk_t bit;
+	int ret;
+
+	ext4_get_group_no_and_offset(sb, block, &group, &bit);
+	gdp = ext4_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return -EIO;
+	ret = ext4_snapshot_lookup(snapshot, ext4_block_bitmap(sb, gdp), &copy);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		bitmap_bh = sb_bread(sb, copy);
+	else
+		bitmap_bh = ext4_read_block_bitmap(sb, group);
+	if (!bitmap_bh)
+		return -EIO;
+	ret = ext4_test_bit(bit, bitmap_bh->b_data) ? 1 : 0;
+	brelse(bitmap_bh);
+	return ret;
+}
+
+/*
+ * ext4_snapshot_test_cow() - does @snapshot still need @block?
+ *
+ * Returns 1 if @block was in use when the snapshot was taken and has not
+ * been copied or moved to the snapshot since, 0 if not and < 0 on error.
+ */
+static int ext4_snapshot_test_cow(struct inode *snapshot, ext4_fsblk_t block)
+{
+	struct ext4_super_block *es = EXT4_SB(snapshot->i_sb)->s_es;
+	int ret;
+
+	if (block < le32_to_cpu(es->s_first_data_block) ||
+	    block >= (snapshot->i_size >> snapshot->i_blkbits))
+		return 0;
+	ret = ext4_snapshot_lookup(snapshot, block, NULL);
+	if (ret)
+		return ret < 0 ? ret : 0;
+	return ext4_snapshot_test_cow_bitmap(snapshot, block);
+}
+
+/*
+ * ext4_snapshot_test_cowed() - was @bh already handled in this transaction?
+ */
+static int ext4_snapshot_test_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	int cowed = 0;
+
+	jbd_lock_bh_state(bh);
+	if (buffer_jbd(bh) &&
+	    bh2jh(bh)->b_cow_tid == handle->h_transaction->t_tid)
+		cowed = 1;
+	jbd_unlock_bh_state(bh);
+	return cowed;
+}
+
+/*
+ * ext4_snapshot_mark_cowed() - record that @bh needs no COW for the rest
+ * of the running transaction
+ *
+ * Called once the journal has write access to @bh: it was copied to the
+ * snapshot or did not need to be, and cannot need to be until it is freed.
+ */
+void ext4_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	struct super_block *sb;
+
+	if (!ext4_handle_valid(handle) || handle->h_cowing)
+		return;
+	sb = handle->h_transaction->t_journal->j_private;
+	if (!ext4_snapshot_active(sb))
+		return;
+	jbd_lock_bh_state(bh);
+	if (buffer_jbd(bh))
+		bh2jh(bh)->b_cow_tid = handle->h_transaction->t_tid;
+	jbd_unlock_bh_state(bh);
+}
+
+/*
+ * ext4_snapshot_map_block() - map @block of the file system in @snapshot
+ * @src: contents of the block to write to a new snapshot block, or NULL
+ *	 to map @block itself into the snapshot
+ *
+ * Returns 1 if the block was mapped, 0 if someone else mapped it first and
+ * < 0 on error.
+ */
+static int ext4_snapshot_map_block(handle_t *handle, struct inode *snapshot,
+				   ext4_fsblk_t block, const void *src)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_map_blocks map;
+	struct buffer_head *cbh;
+	int flags = EXT4_GET_BLOCKS_CREATE;
+	int credits;
+	int err;
+
+	if (handle->h_cow_credits < EXT4_SNAPSHOT_COW_TRANS_BLOCKS) {
+		err = ext4_journal_extend(handle,
+					  EXT4_SNAPSHOT_COW_TRANS_BLOCKS);
+		if (err > 0)
+			err = -ENOSPC;
+		if (err)
+			return err;
+		handle->h_cow_credits += EXT4_SNAPSHOT_COW_TRANS_BLOCKS;
+	}
+
+	map.m_lblk = block;
+	map.m_len = 1;
+	if (!src) {
+		map.m_pblk = block;
+		flags |= EXT4_GET_BLOCKS_SNAPSHOT_MOVE;
+	}
+	credits = handle->h_buffer_credits;
+	handle->h_cowing = 1;
+	err = ext4_map_blocks(handle, snapshot, &map, flags);
+	if (err > 0 && (map.m_flags & EXT4_MAP_NEW)) {
+		/* moved blocks were not charged by the allocator */
+		if (!src)
+			dquot_alloc_block_nofail(snapshot, 1);
+		err = ext4_mark_inode_dirty(handle, snapshot);
+		if (!err)
+			err = 1;
+	} else if (err > 0)
+		err = 0;
+	else if (!err)
+		err = -EIO;
+	handle->h_cowing = 0;
+	handle->h_cow_credits -= credits - handle->h_buffer_credits;
+	if (err <= 0 || !src)
+		return err;
+
+	ext4_fc_mark_ineligible(sb, handle);
+	cbh = sb_getblk(sb, map.m_pblk);
+	if (!cbh)
+		return -EIO;
+	lock_buffer(cbh);
+	memcpy(cbh->b_data, src, sb->s_blocksize);
+	set_buffer_uptodate(cbh);
+	unlock_buffer(cbh);
+	mark_buffer_dirty(cbh);
+	err = sync_dirty_buffer(cbh);
+	brelse(cbh);
+	return err ? err : 1;
+}
+
+/*
+ * ext4_snapshot_get_write_access() - copy @bh to the active snapshot
+ * before it is changed
+ * @inode: owner of @bh for data blocks, NULL for metadata
+ *
+ * Errors break the snapshot, see ext4_snapshot_break(), and let the change
+ * go on; only a journal error fails the call.
+ */
+int ext4_snapshot_get_write_access(handle_t *handle, struct inode *inode,
+				   struct buffer_head *bh)
+{
+	struct super_block *sb;
+	struct inode *snapshot;
+	char *kaddr;
+	void *src;
+	int err;
+
+	if (!ext4_handle_valid(handle) || handle->h_cowing)
+		return 0;
+	sb = handle->h_transaction->t_journal->j_private;
+	if (!ext4_snapshot_active(sb))
+		return 0;
+	snapshot = EXT4_SB(sb)->s_active_snapshot;
+	if (inode == snapshot || ext4_snapshot_test_cowed(handle, bh))
+		return 0;
+
+	err = ext4_snapshot_test_cow(snapshot, bh->b_blocknr);
+	if (err <= 0)
+		goto out;
+	if (!buffer_uptodate(bh)) {
+		ll_rw_block(READ, 1, &bh);
+		wait_on_buffer(bh);
+		err = -EIO;
+		if (!buffer_uptodate(bh))
+			goto out;
+	}
+	err = -ENOMEM;
+	src = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!src)
+		goto out;
+	kaddr = kmap_atomic(bh->b_page, KM_USER0);
+	memcpy(src, kaddr + bh_offset(bh), sb->s_blocksize);
+	kunmap_atomic(kaddr, KM_USER0);
+	err = ext4_snapshot_map_block(handle, snapshot, bh->b_blocknr, src);
+	kfree(src);
+out:
+	if (err >= 0)
+		return 0;
+	ext4_snapshot_break(sb, err);
+	return ext4_handle_is_aborted(handle) ? err : 0;
+}
+
+/*
+ * ext4_snapshot_free_blocks() - move blocks the snapshot needs to it
+ * instead of freeing them
+ *
+ * The other blocks of the range are freed with EXT4_FREE_BLOCKS_NO_SNAPSHOT.
+ * Returns 0 if ext4_free_blocks() should free the range itself, and 1 if
+ * the range was taken care of.
+ */
+int ext4_snapshot_free_blocks(handle_t *handle, struct inode *inode,
+			      ext4_fsblk_t block, unsigned long count,
+			      int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct inode *snapshot = EXT4_SB(sb)->s_active_snapshot;
+	unsigned long i, start = 0, moved = 0;
+	int err = 0;
+
+	if (!ext4_handle_valid(handle) || handle->h_cowing ||
+	    !ext4_snapshot_active(sb) || inode == snapshot)
+		return 0;
+
+	flags &= ~EXT4_FREE_BLOCKS_FORGET;
+	flags |= EXT4_FREE_BLOCKS_VALIDATED | EXT4_FREE_BLOCKS_NO_SNAPSHOT;
+	for (i = 0; i < count; i++) {
+		err = ext4_snapshot_test_cow(snapshot, block + i);
+		if (err > 0)
+			err = ext4_snapshot_map_block(handle, snapshot,
+						      block + i, NULL);
+		if (err < 0)
+			break;
+		if (!err)
+			continue;
+		if (i > start)
+			ext4_free_blocks(handle, inode, NULL, block + start,
+					 i - start, flags);
+		start = i + 1;
+		moved++;
+	}
+	if (count > start)
+		ext4_free_blocks(handle, inode, NULL, block + start,
+				 count - start, flags);
+	if (moved)
+		dquot_free_block(inode, moved);
+	if (err < 0)
+		ext4_snapshot_break(sb, err);
+	return 1;
+}
+
+/*
+ * ext4_snapshot_read_through() - map a hole of a snapshot file for read
+ *
+ * A block that is not mapped in the snapshot has not changed since the
+ * snapshot was taken and is read from the file system.
+ * Returns 1 if @map was set up, 0 otherwise.
+ */
+int ext4_snapshot_read_through(struct inode *inode,
+			       struct ext4_map_blocks *map)
+{
+	if (!ext4_snapshot_file(inode) ||
+	    map->m_lblk >= (inode->i_size >> inode->i_blkbits))
+		return 0;
+	map->m_pblk = map->m_lblk;
+	map->m_len = 1;
+	map->m_flags = EXT4_MAP_MAPPED;
+	return 1;
+}
+
+/*
+ * ext4_snapshot_reset() - turn snapshot file @inode into a regular file
+ * @truncate: also drop the blocks of the file
+ */
+static int ext4_snapshot_reset(struct inode *inode, int truncate)
+{
+	handle_t *handle;
+	int err;
+
+	handle = ext4_journal_start(inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	ext4_clear_inode_flag(inode, EXT4_INODE_SNAPFILE);
+	ext4_clear_inode_flag(inode, EXT4_INODE_IMMUTABLE);
+	ext4_set_inode_flags(inode);
+	if (truncate) {
+		i_size_write(inode, 0);
+		EXT4_I(inode)->i_disksize = 0;
+	}
+	inode->i_ctime = ext4_current_time(inode);
+	err = ext4_mark_inode_dirty(handle, inode);
+	ext4_journal_stop(handle);
+	if (truncate)
+		ext4_truncate(inode);
+	return err;
+}
+
+/*
+ * ext4_snapshot_prepare() - turn empty regular file @inode into a snapshot
+ * file, with the snapshot copy of the super block mapped in @sbh
+ */
+static int ext4_snapshot_prepare(struct inode *inode,
+				 struct buffer_head **sbh)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_map_blocks map;
+	handle_t *handle;
+	int err, err2;
+
+	handle = ext4_journal_start(inode, EXT4_DATA_TRANS_BLOCKS(sb));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	down_write(&ei->i_data_sem);
+	ext4_discard_preallocations(inode);
+	ext4_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
+	memset(ei->i_data, 0, sizeof(ei->i_data));
+	ext4_set_inode_flag(inode, EXT4_INODE_SNAPFILE);
+	ext4_set_inode_flag(inode, EXT4_INODE_IMMUTABLE);
+	ext4_set_inode_flags(inode);
+	i_size_write(inode, (loff_t)ext4_blocks_count(sbi->s_es) <<
+		     sb->s_blocksize_bits);
+	ei->i_disksize = inode->i_size;
+	up_write(&ei->i_data_sem);
+
+	/* the super block is not journaled: it is copied by hand on take */
+	map.m_lblk = sbi->s_sbh->b_blocknr;
+	map.m_len = 1;
+	err = ext4_map_blocks(handle, inode, &map, EXT4_GET_BLOCKS_CREATE);
+	if (err > 0) {
+		err = 0;
+		*sbh = sb_getblk(sb, map.m_pblk);
+		if (!*sbh)
+			err = -EIO;
+	} else if (!err)
+		err = -EIO;
+	inode->i_ctime = ext4_current_time(inode);
+	err2 = ext4_mark_inode_dirty(handle, inode);
+	if (!err)
+		err = err2;
+	err2 = ext4_journal_stop(handle);
+	if (!err)
+		err = err2;
+	return err;
+}
+
+/*
+ * ext4_snapshot_take() - take a snapshot of the file system in the empty
+ * regular file @inode
+ *
+ * Called under i_mutex of @inode.
+ */
+int ext4_snapshot_take(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	struct buffer_head *sbh = NULL;
+	int err;
+
+	if (!S_ISREG(inode->i_mode) || inode->i_size ||
+	    EXT4_I(inode)->i_reserved_data_blocks ||
+	    ext4_test_inode_flag(inode, EXT4_INODE_EOFBLOCKS) ||
+	    IS_IMMUTABLE(inode) || IS_APPEND(inode))
+		return -EINVAL;
+	if (!sbi->s_journal)
+		return -EOPNOTSUPP;
+	if (ext4_blocks_count(es) >
+	    (sbi->s_bitmap_maxbytes >> sb->s_blocksize_bits))
+		return -EFBIG;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	err = -EBUSY;
+	if (sbi->s_active_snapshot)
+		goto out_unlock;
+
+	err = ext4_snapshot_prepare(inode, &sbh);
+	if (!err)
+		err = freeze_super(sb);
+	if (err)
+		goto out_reset;
+
+	/* with the file system frozen, the journal is empty and stays so */
+	lock_buffer(sbh);
+	memcpy(sbh->b_data, sbi->s_sbh->b_data, sb->s_blocksize);
+	set_buffer_uptodate(sbh);
+	unlock_buffer(sbh);
+	mark_buffer_dirty(sbh);
+	err = sync_dirty_buffer(sbh);
+	if (!err) {
+		es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
+		le32_add_cpu(&es->s_snapshot_id, 1);
+		EXT4_SET_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT);
+		err = ext4_commit_super(sb, 1);
+		if (err)
+			es->s_snapshot_inum = 0;
+	}
+	if (!err) {
+		sbi->s_active_snapshot = igrab(inode);
+		sbi->s_snapshot_broken = 0;
+	}
+	thaw_super(sb);
+	if (!err)
+		ext4_msg(sb, KERN_INFO, "snapshot %u taken (inode %lu)",
+			 le32_to_cpu(es->s_snapshot_id), inode->i_ino);
+
+out_reset:
+	if (err)
+		ext4_snapshot_reset(inode, 1);
+out_unlock:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	brelse(sbh);
+	return err;
+}
+
+/*
+ * ext4_snapshot_delete() - turn snapshot file @inode back into a regular
+ * file, which can then be removed
+ *
+ * Called under i_mutex of @inode.
+ */
+int ext4_snapshot_delete(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	struct inode *snapshot = NULL;
+	handle_t *handle;
+	int err;
+
+	if (!ext4_snapshot_file(inode))
+		return -EINVAL;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (sbi->s_active_snapshot == inode) {
+		/* wait for running handles to be done with the snapshot */
+		jbd2_journal_lock_updates(sbi->s_journal);
+		snapshot = sbi->s_active_snapshot;
+		sbi->s_active_snapshot = NULL;
+		sbi->s_snapshot_broken = 0;
+		jbd2_journal_unlock_updates(sbi->s_journal);
+	}
+
+	handle = ext4_journal_start_sb(sb, 1);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+	err = ext4_journal_get_write_access(handle, sbi->s_sbh);
+	if (!err) {
+		if (le32_to_cpu(es->s_snapshot_inum) == inode->i_ino)
+			es->s_snapshot_inum = 0;
+		if (!es->s_snapshot_inum)
+			EXT4_CLEAR_RO_COMPAT_FEATURE(sb,
+					EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT);
+		err = ext4_handle_dirty_metadata(handle, NULL, sbi->s_sbh);
+	}
+	ext4_journal_stop(handle);
+	if (!err)
+		err = ext4_snapshot_reset(inode, 0);
+out:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	iput(snapshot);
+	return err;
+}
+
+/*
+ * ext4_snapshot_load() - load the active snapshot recorded in the super block
+ *
+ * Called on mount and on remount read-write.
+ */
+int ext4_snapshot_load(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	unsigned long ino = le32_to_cpu(es->s_snapshot_inum);
+	struct inode *inode;
+
+	if (!ino || sbi->s_active_snapshot)
+		return 0;
+	if (!sbi->s_journal) {
+		ext4_msg(sb, KERN_ERR, "snapshot requires a journal");
+		return -EINVAL;
+	}
+	inode = ext4_iget(sb, ino);
+	if (IS_ERR(inode)) {
+		ext4_msg(sb, KERN_ERR, "failed to load snapshot inode %lu",
+			 ino);
+		return PTR_ERR(inode);
+	}
+	if (!S_ISREG(inode->i_mode) || !ext4_snapshot_file(inode) ||
+	    ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+	    (inode->i_size >> sb->s_blocksize_bits) > ext4_blocks_count(es)) {
+		ext4_msg(sb, KERN_ERR, "invalid snapshot inode %lu", ino);
+		iput(inode);
+		return -EINVAL;
+	}
+	sbi->s_active_snapshot = inode;
+	sbi->s_snapshot_broken = 0;
+	return 0;
+}
+
+void ext4_snapshot_destroy(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	iput(sbi->s_active_snapshot);
+	sbi->s_active_snapshot = NULL;
+}
@@ -0,0 +1,147 @@
+/*
+ * linux/fs/ext4/snapshot.h
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Ext4 snapshot hooks, see snapshot.c.
+ */
+
+#ifndef _EXT4_SNAPSHOT_H
+#define _EXT4_SNAPSHOT_H
+
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include "ext4.h"
+
+/*
+ * Copying a block to the snapshot file maps it with up to three new
+ * indirect blocks and a new block for the copy, which changes a parent
+ * indirect block, two bitmaps, two group descriptors, the super block
+ * and the snapshot inode.  The copy itself is not journaled.
+ */
+#define EXT4_SNAPSHOT_COW_TRANS_BLOCKS	10
+
+/*
+ * Handles reserve COW credits up front for at most this many of their
+ * credits; COW beyond that extends the handle.
+ */
+#define EXT4_SNAPSHOT_MAX_TRANS_COWS	16
+
+static inline int ext4_snapshot_file(struct inode *inode)
+{
+	return ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE);
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT
+
+static inline int ext4_snapshot_active(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	return sbi->s_active_snapshot && !sbi->s_snapshot_broken;
+}
+
+/*
+ * Credits to add to a handle of @nblocks credits for the blocks it may
+ * have to copy to the active snapshot
+ */
+static inline int ext4_snapshot_trans_blocks(struct super_block *sb,
+					     int nblocks)
+{
+	journal_t *journal = EXT4_SB(sb)->s_journal;
+	int credits;
+
+	if (!ext4_snapshot_active(sb))
+		return 0;
+	credits = min(nblocks, EXT4_SNAPSHOT_MAX_TRANS_COWS) *
+		EXT4_SNAPSHOT_COW_TRANS_BLOCKS;
+	return max(0, min(credits,
+			  journal->j_max_transaction_buffers - nblocks));
+}
+
+static inline void ext4_snapshot_set_credits(handle_t *handle, int credits)
+{
+	handle->h_cow_credits = credits;
+}
+
+extern int ext4_snapshot_get_write_access(handle_t *handle,
+					  struct inode *inode,
+					  struct buffer_head *bh);
+extern void ext4_snapshot_mark_cowed(handle_t *handle,
+				     struct buffer_head *bh);
+extern int ext4_snapshot_free_blocks(handle_t *handle, struct inode *inode,
+				     ext4_fsblk_t block, unsigned long count,
+				     int flags);
+extern int ext4_snapshot_read_through(struct inode *inode,
+				      struct ext4_map_blocks *map);
+extern int ext4_snapshot_take(struct inode *inode);
+extern int ext4_snapshot_delete(struct inode *inode);
+extern int ext4_snapshot_load(struct super_block *sb);
+extern void ext4_snapshot_destroy(struct super_block *sb);
+
+#else  /* CONFIG_EXT4_FS_SNAPSHOT */
+
+static inline int ext4_snapshot_active(struct super_block *sb)
+{
+	return 0;
+}
+
+static inline int ext4_snapshot_trans_blocks(struct super_block *sb,
+					     int nblocks)
+{
+	return 0;
+}
+
+static inline void ext4_snapshot_set_credits(handle_t *handle, int credits)
+{
+}
+
+static inline int ext4_snapshot_get_write_access(handle_t *handle,
+						 struct inode *inode,
+						 struct buffer_head *bh)
+{
+	return 0;
+}
+
+static inline void ext4_snapshot_mark_cowed(handle_t *handle,
+					    struct buffer_head *bh)
+{
+}
+
+static inline int ext4_snapshot_free_blocks(handle_t *handle,
+					    struct inode *inode,
+					    ext4_fsblk_t block,
+					    unsigned long count, int flags)
+{
+	return 0;
+}
+
+static inline int ext4_snapshot_read_through(struct inode *inode,
+					     struct ext4_map_blocks *map)
+{
+	return 0;
+}
+
+static inline int ext4_snapshot_take(struct inode *inode)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int ext4_snapshot_delete(struct inode *inode)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int ext4_snapshot_load(struct super_block *sb)
+{
+	return 0;
+}
+
+static inline void ext4_snapshot_destroy(struct super_block *sb)
+{
+}
+
+#endif  /* CONFIG_EXT4_FS_SNAPSHOT */
+#endif  /* _EXT4_SNAPSHOT_H */
@@ -46,6 +46,7 @@
 #include "xattr.h"
 #include "acl.h"
 #include "mballoc.h"
+#include "snapshot.h"
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/ext4.h>
@@ -55,7 +56,6 @@ static struct kset *ext4_kset;
 
 static int ext4_load_journal(struct super_block *, struct ext4_super_block *,
 			     unsigned long journal_devnum);
-static int ext4_commit_super(struct super_block *sb, int sync);
 static void ext4_mark_recovery_complete(struct super_block *sb,
 					struct ext4_super_block *es);
 static void ext4_clear_journal_err(struct super_block *sb,
@@ -234,9 +234,11 @@ static void ext4_put_nojournal(handle_t *handle)
  * that sync() will call the filesystem's write_super callback if
  * appropriate.
  */
-handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks)
+handle_t *__ext4_journal_start_sb(struct super_block *sb, int nblocks)
 {
 	journal_t *journal;
+	handle_t *handle;
+	int cow_credits;
 
 	if (sb->s_flags & MS_RDONLY)
 		return ERR_PTR(-EROFS);
@@ -251,11 +253,24 @@ handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks)
 			ext4_abort(sb, __func__, "Detected aborted journal");
 			return ERR_PTR(-EROFS);
 		}
-		return jbd2_journal_start(journal, nblocks);
+		cow_credits = ext4_snapshot_trans_blocks(sb, nblocks);
+		handle = jbd2_journal_start(journal, nblocks + cow_credits);
+		if (!IS_ERR(handle) && handle->h_ref == 1)
+			ext4_snapshot_set_credits(handle, cow_credits);
+		return handle;
 	}
 	return ext4_get_nojournal();
 }
 
+handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks)
+{
+	handle_t *handle = __ext4_journal_start_sb(sb, nblocks);
+
+	if (!IS_ERR(handle))
+		ext4_fc_mark_ineligible(sb, handle);
+	return handle;
+}
+
 /*
  * The only special thing we need to do here is to make sure that all
  * jbd2_journal_stop calls result in the superblock being marked dirty, so
@@ -647,6 +662,7 @@ static void ext4_put_super(struct super_block *sb)
 	int i, err;
 
 	dquot_disable(sb, -1, DQUOT_USAGE_ENABLED | DQUOT_LIMITS_ENABLED);
+	ext4_snapshot_destroy(sb);
 
 	flush_workqueue(sbi->dio_unwritten_wq);
 	destroy_workqueue(sbi->dio_unwritten_wq);
@@ -743,7 +759,9 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 
 	ei->vfs_inode.i_version = 1;
 	ei->vfs_inode.i_data.writeback_index = 0;
-	memset(&ei->i_cached_extent, 0, sizeof(struct ext4_ext_cache));
+	ei->i_ext_cache_tree = RB_ROOT;
+	INIT_LIST_HEAD(&ei->i_ext_cache_lru);
+	ei->i_ext_cache_count = 0;
 	INIT_LIST_HEAD(&ei->i_prealloc_list);
 	spin_lock_init(&ei->i_prealloc_lock);
 	/*
@@ -766,6 +784,9 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 	ei->cur_aio_dio = NULL;
 	ei->i_sync_tid = 0;
 	ei->i_datasync_tid = 0;
+	ei->i_fc_tid = 0;
+	ei->i_fc_nr = 0;
+	ei->i_fc_ineligible = 1;
 
 	return &ei->vfs_inode;
 }
@@ -817,6 +838,7 @@ static void ext4_clear_inode(struct inode *inode)
 {
 	dquot_drop(inode);
 	ext4_discard_preallocations(inode);
+	ext4_ext_invalidate_cache(inode);
 	if (EXT4_JOURNAL(inode))
 		jbd2_journal_release_jbd_inode(EXT4_SB(inode->i_sb)->s_journal,
 				       &EXT4_I(inode)->jinode);
@@ -980,6 +1002,12 @@ static int ext4_show_options(struct seq_file *seq, struct vfsmount *vfs)
 	if (test_opt(sb, DISCARD))
 		seq_puts(seq, ",discard");
 
+	if (test_opt(sb, MB_PREINIT))
+		seq_puts(seq, ",mb_preinit");
+
+	if (test_opt(sb, FAST_COMMIT))
+		seq_puts(seq, ",fast_commit");
+
 	if (test_opt(sb, NOLOAD))
 		seq_puts(seq, ",norecovery");
 
@@ -1160,7 +1188,8 @@ enum {
 	Opt_block_validity, Opt_noblock_validity,
 	Opt_inode_readahead_blks, Opt_journal_ioprio,
 	Opt_dioread_nolock, Opt_dioread_lock,
-	Opt_discard, Opt_nodiscard,
+	Opt_discard, Opt_nodiscard, Opt_mb_preinit, Opt_nomb_preinit,
+	Opt_fast_commit, Opt_nofast_commit,
 };
 
 static const match_table_t tokens = {
@@ -1231,6 +1260,10 @@ static const match_table_t tokens = {
 	{Opt_dioread_lock, "dioread_lock"},
 	{Opt_discard, "discard"},
 	{Opt_nodiscard, "nodiscard"},
+	{Opt_mb_preinit, "mb_preinit"},
+	{Opt_nomb_preinit, "nomb_preinit"},
+	{Opt_fast_commit, "fast_commit"},
+	{Opt_nofast_commit, "nofast_commit"},
 	{Opt_err, NULL},
 };
 
@@ -1693,6 +1726,18 @@ set_qf_format:
 		case Opt_nodiscard:
 			clear_opt(sbi->s_mount_opt, DISCARD);
 			break;
+		case Opt_mb_preinit:
+			set_opt(sbi->s_mount_opt, MB_PREINIT);
+			break;
+		case Opt_nomb_preinit:
+			clear_opt(sbi->s_mount_opt, MB_PREINIT);
+			break;
+		case Opt_fast_commit:
+			set_opt(sbi->s_mount_opt, FAST_COMMIT);
+			break;
+		case Opt_nofast_commit:
+			clear_opt(sbi->s_mount_opt, FAST_COMMIT);
+			break;
 		case Opt_dioread_nolock:
 			set_opt(sbi->s_mount_opt, DIOREAD_NOLOCK);
 			break;
@@ -2281,6 +2326,19 @@ static ssize_t inode_readahead_blks_store(struct ext4_attr *a,
 	return count;
 }
 
+static ssize_t extent_zeroout_len_store(struct ext4_attr *a,
+					struct ext4_sb_info *sbi,
+					const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, EXT4_EXT_MAX_ZERO_LEN, &t))
+		return -EINVAL;
+
+	sbi->s_extent_zeroout_len = t;
+	return count;
+}
+
 static ssize_t sbi_ui_show(struct ext4_attr *a,
 			   struct ext4_sb_info *sbi, char *buf)
 {
@@ -2330,7 +2388,12 @@ EXT4_RW_ATTR_SBI_UI(mb_min_to_scan, s_mb_min_to_scan);
 EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_group_prealloc, s_mb_group_prealloc);
+EXT4_RW_ATTR_SBI_UI(mb_order_list_tries, s_mb_order_list_tries);
+EXT4_RW_ATTR_SBI_UI(mb_prefetch, s_mb_prefetch);
+EXT4_RW_ATTR_SBI_UI(mb_discard_batch, s_mb_discard_batch);
 EXT4_RW_ATTR_SBI_UI(max_writeback_mb_bump, s_max_writeback_mb_bump);
+EXT4_ATTR_OFFSET(extent_zeroout_len, 0644, sbi_ui_show,
+		 extent_zeroout_len_store, s_extent_zeroout_len);
 
 static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(delayed_allocation_blocks),
@@ -2344,7 +2407,11 @@ static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(mb_order2_req),
 	ATTR_LIST(mb_stream_req),
 	ATTR_LIST(mb_group_prealloc),
+	ATTR_LIST(mb_order_list_tries),
+	ATTR_LIST(mb_prefetch),
+	ATTR_LIST(mb_discard_batch),
 	ATTR_LIST(max_writeback_mb_bump),
+	ATTR_LIST(extent_zeroout_len),
 	NULL,
 };
 
@@ -2801,6 +2868,7 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_stripe = ext4_get_stripe_size(sbi);
 	sbi->s_max_writeback_mb_bump = 128;
+	sbi->s_extent_zeroout_len = EXT4_EXT_ZERO_LEN;
 
 	/*
 	 * set up enough so that it can read an inode
@@ -2819,6 +2887,9 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	INIT_LIST_HEAD(&sbi->s_orphan); /* unlinked but open files */
 	mutex_init(&sbi->s_orphan_lock);
 	mutex_init(&sbi->s_resize_lock);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT
+	mutex_init(&sbi->s_snapshot_mutex);
+#endif
 
 	sb->s_root = NULL;
 
@@ -2869,6 +2940,26 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 				JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
 	}
 
+	/*
+	 * The fast commit area can only be reserved while the log is empty,
+	 * so it is reserved here, right after recovery, and kept afterwards.
+	 */
+	if (test_opt(sb, FAST_COMMIT) && !(sb->s_flags & MS_RDONLY)) {
+		journal_t *journal = sbi->s_journal;
+		int fc_err;
+
+		fc_err = jbd2_fc_init(journal, min_t(unsigned int,
+					EXT4_FC_BLOCKS, journal->j_maxlen / 16));
+		if (fc_err) {
+			ext4_msg(sb, KERN_WARNING, "cannot reserve fast "
+				 "commit area (err %d), fast_commit "
+				 "disabled", fc_err);
+			clear_opt(sbi->s_mount_opt, FAST_COMMIT);
+		}
+	}
+	/* don't fast commit the mount time transaction */
+	sbi->s_fc_ineligible_tid = sbi->s_journal->j_transaction_sequence;
+
 	/* We have now updated the journal if required, so we can
 	 * validate the data journaling mode. */
 	switch (test_opt(sb, DATA_FLAGS)) {
@@ -3015,11 +3106,20 @@ no_journal:
 		goto failed_mount4;
 	}
 
+	/* blocks freed by the orphan cleanup below may belong to the snapshot */
+	err = ext4_snapshot_load(sb);
+	if (err && !(sb->s_flags & MS_RDONLY)) {
+		ext4_mb_release(sb);
+		ext4_ext_release(sb);
+		goto failed_mount4;
+	}
+
 	sbi->s_kobj.kset = ext4_kset;
 	init_completion(&sbi->s_kobj_unregister);
 	err = kobject_init_and_add(&sbi->s_kobj, &ext4_ktype, NULL,
 				   "%s", sb->s_id);
 	if (err) {
+		ext4_snapshot_destroy(sb);
 		ext4_mb_release(sb);
 		ext4_ext_release(sb);
 		goto failed_mount4;
@@ -3325,6 +3425,9 @@ static int ext4_load_journal(struct super_block *sb,
 		}
 	}
 
+	/* fast commits are replayed by jbd2_journal_load() */
+	journal->j_fc_replay = ext4_fc_replay;
+
 	if (!EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_RECOVER))
 		err = jbd2_journal_wipe(journal, !really_read_only);
 	if (!err)
@@ -3350,7 +3453,7 @@ static int ext4_load_journal(struct super_block *sb,
 	return 0;
 }
 
-static int ext4_commit_super(struct super_block *sb, int sync)
+int ext4_commit_super(struct super_block *sb, int sync)
 {
 	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
 	struct buffer_head *sbh = EXT4_SB(sb)->s_sbh;
@@ -3695,6 +3798,10 @@ static int ext4_remount(struct super_block *sb, int *flags, char *data)
 				goto restore_opts;
 			}
 
+			err = ext4_snapshot_load(sb);
+			if (err)
+				goto restore_opts;
+
 			/*
 			 * Mounting a RDONLY partition read-write, so reread
 			 * and store the current valid flag.  (It may have
@@ -4055,12 +4162,13 @@ static ssize_t ext4_quota_write(struct super_block *sb, int type,
 	bh = ext4_bread(handle, inode, blk, 1, &err);
 	if (!bh)
 		goto out;
-	if (journal_quota) {
+	if (journal_quota)
 		err = ext4_journal_get_write_access(handle, bh);
-		if (err) {
-			brelse(bh);
-			goto out;
-		}
+	else
+		err = ext4_snapshot_get_write_access(handle, inode, bh);
+	if (err) {
+		brelse(bh);
+		goto out;
 	}
 	lock_buffer(bh);
 	memcpy(bh->b_data+offset, data, len);
@@ -4170,9 +4278,12 @@ static int __init init_ext4_fs(void)
 	err = init_ext4_xattr();
 	if (err)
 		goto out2;
-	err = init_inodecache();
+	err = init_ext4_ext_cache();
 	if (err)
 		goto out1;
+	err = init_inodecache();
+	if (err)
+		goto out0;
 	register_as_ext2();
 	register_as_ext3();
 	err = register_filesystem(&ext4_fs_type);
@@ -4183,6 +4294,8 @@ out:
 	unregister_as_ext2();
 	unregister_as_ext3();
 	destroy_inodecache();
+out0:
+	exit_ext4_ext_cache();
 out1:
 	exit_ext4_xattr();
 out2:
@@ -4201,6 +4314,7 @@ static void __exit exit_ext4_fs(void)
 	unregister_as_ext3();
 	unregister_filesystem(&ext4_fs_type);
 	destroy_inodecache();
+	exit_ext4_ext_cache();
 	exit_ext4_xattr();
 	exit_ext4_mballoc();
 	remove_proc_entry("fs/ext4", NULL);
@@ -22,6 +22,16 @@
 #include <linux/jbd.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+#include <linux/sort.h>
+#include <linux/workqueue.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+#include <linux/rcupdate.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+#include <trace/events/jbd.h>
+#endif
 
 /*
  * Unlink a buffer from a transaction checkpoint list.
@@ -116,12 +126,20 @@ static int __try_to_free_cp_buf(struct journal_head *jh)
 void __log_wait_for_space(journal_t *journal)
 {
 	int nblocks, space_left;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	int waited = 0;
+#endif
 	assert_spin_locked(&journal->j_state_lock);
 
 	nblocks = jbd_space_needed(journal);
 	while (__log_space_left(journal) < nblocks) {
 		if (journal->j_flags & JFS_ABORT)
 			return;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+		if (!waited++)
+			trace_jbd_wait_for_space(journal, nblocks,
+						 __log_space_left(journal));
+#endif
 		spin_unlock(&journal->j_state_lock);
 		mutex_lock(&journal->j_checkpoint_mutex);
 
@@ -170,8 +188,83 @@ void __log_wait_for_space(journal_t *journal)
 		}
 		mutex_unlock(&journal->j_checkpoint_mutex);
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	if (waited)
+		trace_jbd_wait_for_space_done(journal, nblocks,
+					      __log_space_left(journal));
+#endif
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+static struct workqueue_struct *jbd_checkpoint_wq;
+
+/*
+ * Start checkpointing in the background this much before handles would
+ * have to wait for log space in __log_wait_for_space().
+ */
+static inline int log_space_low_watermark(journal_t *journal)
+{
+	return jbd_space_needed(journal) + journal->j_max_transaction_buffers;
+}
+
+/*
+ * log_kick_checkpoint: queue a background checkpoint if the free log
+ * space is below the low watermark.  Called by kjournald after a commit.
+ * kjournald can't checkpoint by itself, because a checkpoint may have to
+ * wait for the commit of a buffer's transaction.
+ */
+void log_kick_checkpoint(journal_t *journal)
+{
+	int low;
+
+	spin_lock(&journal->j_state_lock);
+	low = __log_space_left(journal) < log_space_low_watermark(journal);
+	spin_unlock(&journal->j_state_lock);
+	if (low && journal->j_checkpoint_transactions &&
+	    !is_journal_aborted(journal))
+		queue_work(jbd_checkpoint_wq, &journal->j_checkpoint_work);
+}
+
+/*
+ * Checkpoint old transactions until the free log space is back above the
+ * low watermark, so that foreground handles rarely have to.
+ */
+void journal_checkpoint_work(struct work_struct *work)
+{
+	journal_t *journal = container_of(work, journal_t, j_checkpoint_work);
+	int low;
+
+	mutex_lock(&journal->j_checkpoint_mutex);
+	for (;;) {
+		spin_lock(&journal->j_state_lock);
+		low = __log_space_left(journal) <
+			log_space_low_watermark(journal);
+		spin_unlock(&journal->j_state_lock);
+		if (!low || is_journal_aborted(journal) ||
+		    !journal->j_checkpoint_transactions)
+			break;
+		jbd_debug(1, "background checkpoint\n");
+		if (log_do_checkpoint(journal))
+			break;
+		cond_resched();
+	}
+	mutex_unlock(&journal->j_checkpoint_mutex);
+}
+
+int __init journal_init_checkpoint_wq(void)
+{
+	jbd_checkpoint_wq = create_singlethread_workqueue("jbd-checkpoint");
+	return jbd_checkpoint_wq ? 0 : -ENOMEM;
+}
+
+void journal_destroy_checkpoint_wq(void)
+{
+	if (jbd_checkpoint_wq)
+		destroy_workqueue(jbd_checkpoint_wq);
+	jbd_checkpoint_wq = NULL;
+}
+
+#endif
 /*
  * We were unable to perform jbd_trylock_bh_state() inside j_list_lock.
  * The caller must restart a list walk.  Wait for someone else to run
@@ -249,11 +342,32 @@ restart:
 
 #define NR_BATCH	64
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+static int bh_cmp_blocknr(const void *a, const void *b)
+{
+	sector_t ba = (*(struct buffer_head **)a)->b_blocknr;
+	sector_t bb = (*(struct buffer_head **)b)->b_blocknr;
+
+	return ba < bb ? -1 : ba > bb;
+}
+
+#endif
 static void
 __flush_batch(journal_t *journal, struct buffer_head **bhs, int *batch_count)
 {
 	int i;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+	/*
+	 * The checkpoint list is in journaling order, which is random on
+	 * disk.  Submit the batch in block order, so the elevator gets
+	 * mergeable requests, and let the next batch of this checkpoint
+	 * grow, up to JBD_MAX_CHKPT_BATCH.
+	 */
+	sort(bhs, *batch_count, sizeof(*bhs), bh_cmp_blocknr, NULL);
+	if (journal->j_chkpt_batch < JBD_MAX_CHKPT_BATCH)
+		journal->j_chkpt_batch <<= 1;
+#endif
 	ll_rw_block(SWRITE, *batch_count, bhs);
 	for (i = 0; i < *batch_count; i++) {
 		struct buffer_head *bh = bhs[i];
@@ -325,7 +439,11 @@ static int __process_buffer(journal_t *journal, struct journal_head *jh,
 		__buffer_relink_io(jh);
 		jbd_unlock_bh_state(bh);
 		(*batch_count)++;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+		if (*batch_count >= journal->j_chkpt_batch) {
+#else
 		if (*batch_count == NR_BATCH) {
+#endif
 			spin_unlock(&journal->j_list_lock);
 			__flush_batch(journal, bhs, batch_count);
 			ret = 1;
@@ -356,6 +474,9 @@ int log_do_checkpoint(journal_t *journal)
 	 * journal straight away.
 	 */
 	result = cleanup_journal_tail(journal);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_checkpoint(journal, result);
+#endif
 	jbd_debug(1, "cleanup_journal_tail returned %d\n", result);
 	if (result <= 0)
 		return result;
@@ -365,6 +486,9 @@ int log_do_checkpoint(journal_t *journal)
 	 * and write it.
 	 */
 	result = 0;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+	journal->j_chkpt_batch = NR_BATCH;
+#endif
 	spin_lock(&journal->j_list_lock);
 	if (!journal->j_checkpoint_transactions)
 		goto out;
@@ -379,7 +503,11 @@ restart:
 	if (journal->j_checkpoint_transactions == transaction &&
 			transaction->t_tid == this_tid) {
 		int batch_count = 0;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+		struct buffer_head **bhs = journal->j_chkpt_bhs;
+#else
 		struct buffer_head *bhs[NR_BATCH];
+#endif
 		struct journal_head *jh;
 		int retry = 0, err;
 
@@ -724,6 +852,22 @@ void __journal_insert_checkpoint(struct journal_head *jh,
  * Called with j_list_lock held.
  */
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+/*
+ * A handle start fast path may have found this transaction as the
+ * running transaction just before it was locked down for commit.  It
+ * then raises t_updates, sees the transaction is not running anymore
+ * and drops t_updates again, all under rcu_read_lock().
+ */
+static void journal_free_transaction_rcu(struct rcu_head *head)
+{
+	transaction_t *transaction = container_of(head, transaction_t, t_rcu);
+
+	J_ASSERT(atomic_read(&transaction->t_updates) == 0);
+	kfree(transaction);
+}
+
+#endif
 void __journal_drop_transaction(journal_t *journal, transaction_t *transaction)
 {
 	assert_spin_locked(&journal->j_list_lock);
@@ -740,16 +884,25 @@ void __journal_drop_transaction(journal_t *journal, transaction_t *transaction)
 	J_ASSERT(transaction->t_state == T_FINISHED);
 	J_ASSERT(transaction->t_buffers == NULL);
 	J_ASSERT(transaction->t_sync_datalist == NULL);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	J_ASSERT(list_empty(&transaction->t_inode_list));
+#endif
 	J_ASSERT(transaction->t_forget == NULL);
 	J_ASSERT(transaction->t_iobuf_list == NULL);
 	J_ASSERT(transaction->t_shadow_list == NULL);
 	J_ASSERT(transaction->t_log_list == NULL);
 	J_ASSERT(transaction->t_checkpoint_list == NULL);
 	J_ASSERT(transaction->t_checkpoint_io_list == NULL);
+#ifndef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
 	J_ASSERT(transaction->t_updates == 0);
+#endif
 	J_ASSERT(journal->j_committing_transaction != transaction);
 	J_ASSERT(journal->j_running_transaction != transaction);
 
 	jbd_debug(1, "Dropping transaction %d, all done\n", transaction->t_tid);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	call_rcu(&transaction->t_rcu, journal_free_transaction_rcu);
+#else
 	kfree(transaction);
+#endif
 }
@@ -20,6 +20,14 @@
 #include <linux/mm.h>
 #include <linux/pagemap.h>
 #include <linux/bio.h>
+#include <linux/writeback.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+#include <trace/events/jbd.h>
+#endif
 
 /*
  * Default IO end handler for temporary BJ_IO buffer_heads.
@@ -34,6 +42,146 @@ static void journal_end_buffer_io_sync(struct buffer_head *bh, int uptodate)
 	unlock_buffer(bh);
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_LOG_BIOS
+/*
+ * The buffers written by one multi-page log bio.
+ */
+struct journal_log_bio {
+	int			lb_count;
+	struct buffer_head	*lb_bh[0];
+};
+
+/*
+ * IO end handler for a multi-page log bio: complete all its buffers,
+ * the same way end_bio_bh_io_sync() completes a single buffer.
+ */
+static void journal_end_log_bio(struct bio *bio, int err)
+{
+	struct journal_log_bio *lb = bio->bi_private;
+	int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	int i;
+
+	for (i = 0; i < lb->lb_count; i++) {
+		struct buffer_head *bh = lb->lb_bh[i];
+
+		if (err == -EOPNOTSUPP)
+			set_bit(BH_Eopnotsupp, &bh->b_state);
+		if (unlikely(test_bit(BIO_QUIET, &bio->bi_flags)))
+			set_bit(BH_Quiet, &bh->b_state);
+		bh->b_end_io(bh, uptodate);
+	}
+	bio_put(bio);
+	kfree(lb);
+}
+
+/*
+ * Submit the @bufs locked log buffers in @wbuf.  Runs of buffers which
+ * are contiguous on disk are written with a single multi-page bio, so
+ * a full descriptor worth of log blocks costs a few bios instead of one
+ * bio per block.  Falls back to submit_bh() for a buffer which can't
+ * be merged with its neighbours.
+ */
+static void journal_submit_log_bufs(struct buffer_head **wbuf, int bufs,
+				    int write_op)
+{
+	int i = 0;
+
+	while (i < bufs) {
+		struct buffer_head *bh = wbuf[i];
+		struct journal_log_bio *lb = NULL;
+		struct bio *bio;
+		int n, j;
+
+		for (n = 1; i + n < bufs && n < BIO_MAX_PAGES; n++) {
+			struct buffer_head *next = wbuf[i + n];
+
+			if (next->b_bdev != bh->b_bdev ||
+			    next->b_blocknr != bh->b_blocknr + n)
+				break;
+		}
+		if (n > 1)
+			lb = kmalloc(sizeof(*lb) + n * sizeof(bh), GFP_NOFS);
+		if (!lb) {
+			submit_bh(write_op, bh);
+			i++;
+			continue;
+		}
+
+		bio = bio_alloc(GFP_NOFS, n);
+		bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+		bio->bi_bdev = bh->b_bdev;
+		for (j = 0; j < n; j++) {
+			struct buffer_head *b = wbuf[i + j];
+
+			/* the queue limits may end the bio early */
+			if (bio_add_page(bio, b->b_page, b->b_size,
+					 bh_offset(b)) != b->b_size)
+				break;
+			lb->lb_bh[j] = b;
+			/* see submit_bh() */
+			if (test_set_buffer_req(b))
+				clear_buffer_write_io_error(b);
+		}
+		if (!j) {
+			bio_put(bio);
+			kfree(lb);
+			submit_bh(write_op, bh);
+			i++;
+			continue;
+		}
+		lb->lb_count = j;
+		bio->bi_end_io = journal_end_log_bio;
+		bio->bi_private = lb;
+		submit_bio(write_op, bio);
+		i += j;
+	}
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+/*
+ * Size the commit interval of the next transactions from the fill of
+ * the transaction we just committed.  A transaction that filled half of
+ * the journal transaction limit before its timer expired, or a journal
+ * that is short on free space, halves the interval, so we don't end up
+ * with huge transactions that stall __log_wait_for_space().  A small
+ * transaction that was committed by the timer stretches the interval by
+ * a quarter, so an idle-ish file system doesn't issue tiny commits.
+ * The interval stays above 4 times the average commit time, so commits
+ * don't run back to back.  Commits forced by fsync leave it alone.
+ *
+ * Called under j_state_lock
+ */
+static void journal_adapt_commit_interval(journal_t *journal,
+					  int nr_buffers, int expired)
+{
+	unsigned long interval = journal->j_commit_interval;
+	unsigned long min_interval = max(journal->j_min_commit_interval, 1UL);
+	unsigned long commit_jiffies;
+	int max_buffers = journal->j_max_transaction_buffers;
+
+	if (!journal->j_max_commit_interval)
+		return;
+
+	if (__log_space_left(journal) < max_buffers ||
+	    (!expired && nr_buffers >= max_buffers / 2))
+		interval /= 2;
+	else if (expired && nr_buffers < max_buffers / 8)
+		interval += max(interval / 4, 1UL);
+
+	commit_jiffies = usecs_to_jiffies(div_u64(
+			4 * journal->j_average_commit_time, NSEC_PER_USEC));
+	if (min_interval < commit_jiffies)
+		min_interval = commit_jiffies;
+	interval = max(interval, min_interval);
+	interval = min(interval, journal->j_max_commit_interval);
+	if (interval != journal->j_commit_interval)
+		jbd_debug(2, "JBD: commit interval %lu -> %lu jiffies\n",
+			  journal->j_commit_interval, interval);
+	journal->j_commit_interval = interval;
+}
+
+#endif
 /*
  * When an ext3-ordered file is truncated, it is possible that many pages are
  * not successfully freed, because they are attached to a committing transaction.
@@ -105,6 +253,7 @@ static int inverted_lock(journal_t *journal, struct buffer_head *bh)
 	return 1;
 }
 
+#ifndef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
 /* Done it all: now write the commit record.  We should have
  * cleaned up our previous buffers by now, so if we are in abort
  * mode we can now just skip the rest of the journal write
@@ -136,6 +285,16 @@ static int journal_write_commit_record(journal_t *journal,
 	header->h_sequence = cpu_to_be32(commit_transaction->t_tid);
 
 	JBUFFER_TRACE(descriptor, "write commit block");
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+	/* the log blocks are already durable, so no barrier is needed */
+	if ((journal->j_flags & JFS_PMEM) &&
+	    !journal_pmem_write_bh(journal, bh)) {
+		set_buffer_uptodate(bh);
+		put_bh(bh);		/* One for getblk() */
+		journal_put_journal_head(descriptor);
+		return 0;
+	}
+#endif
 	set_buffer_dirty(bh);
 	if (journal->j_flags & JFS_BARRIER) {
 		set_buffer_ordered(bh);
@@ -170,6 +329,157 @@ static int journal_write_commit_record(journal_t *journal,
 
 	return (ret == -EIO);
 }
+#else
+/*
+ * Submit the commit record without waiting for it.  With transactional
+ * checksums, the checksum of the transaction log blocks is stored in
+ * the commit block.  With async commit, the commit block is submitted
+ * together with the log blocks, so it is not written with a barrier.
+ *
+ * Returns 1 if the journal needs to be aborted or 0 on success
+ */
+static int journal_submit_commit_record(journal_t *journal,
+					transaction_t *commit_transaction,
+					struct buffer_head **cbh,
+					__u32 crc32_sum)
+{
+	struct journal_head *descriptor;
+	struct commit_header *tmp;
+	struct buffer_head *bh;
+	int ret;
+	int barrier_done = 0;
+
+	if (is_journal_aborted(journal))
+		return 0;
+
+	descriptor = journal_get_descriptor_buffer(journal);
+	if (!descriptor)
+		return 1;
+
+	bh = jh2bh(descriptor);
+
+	tmp = (struct commit_header *)bh->b_data;
+	tmp->h_magic = cpu_to_be32(JFS_MAGIC_NUMBER);
+	tmp->h_blocktype = cpu_to_be32(JFS_COMMIT_BLOCK);
+	tmp->h_sequence = cpu_to_be32(commit_transaction->t_tid);
+
+	if (JFS_HAS_COMPAT_FEATURE(journal, JFS_FEATURE_COMPAT_CHECKSUM)) {
+		tmp->h_chksum_type 	= JFS_CRC32_CHKSUM;
+		tmp->h_chksum_size 	= JFS_CRC32_CHKSUM_SIZE;
+		tmp->h_chksum[0] 	= cpu_to_be32(crc32_sum);
+	}
+
+	JBUFFER_TRACE(descriptor, "submit commit block");
+	lock_buffer(bh);
+	clear_buffer_dirty(bh);
+	set_buffer_uptodate(bh);
+	bh->b_end_io = journal_end_buffer_io_sync;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+	/* the log blocks are already durable, so no barrier is needed */
+	if ((journal->j_flags & JFS_PMEM) &&
+	    !journal_pmem_write_bh(journal, bh)) {
+		bh->b_end_io(bh, 1);
+		*cbh = bh;
+		return 0;
+	}
+#endif
+
+	if (journal->j_flags & JFS_BARRIER &&
+	    !JFS_HAS_INCOMPAT_FEATURE(journal,
+				      JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+		set_buffer_ordered(bh);
+		barrier_done = 1;
+	}
+	ret = submit_bh(WRITE_SYNC_PLUG, bh);
+	if (barrier_done)
+		clear_buffer_ordered(bh);
+
+	/* is it possible for another commit to fail at roughly
+	 * the same time as this one?  If so, we don't want to
+	 * trust the barrier flag in the super, but instead want
+	 * to remember if we sent a barrier request
+	 */
+	if (ret == -EOPNOTSUPP && barrier_done) {
+		char b[BDEVNAME_SIZE];
+
+		printk(KERN_WARNING
+			"JBD: barrier-based sync failed on %s - "
+			"disabling barriers\n",
+			bdevname(journal->j_dev, b));
+		spin_lock(&journal->j_state_lock);
+		journal->j_flags &= ~JFS_BARRIER;
+		spin_unlock(&journal->j_state_lock);
+
+		/* And try again, without the barrier */
+		lock_buffer(bh);
+		set_buffer_uptodate(bh);
+		clear_buffer_dirty(bh);
+		ret = submit_bh(WRITE_SYNC_PLUG, bh);
+	}
+	*cbh = bh;
+	return (ret == -EIO);
+}
+
+/*
+ * This function along with journal_submit_commit_record
+ * allows to write the commit record asynchronously.
+ * Releases the commit block buffer.
+ */
+static int journal_wait_on_commit_record(journal_t *journal,
+					 struct buffer_head *bh)
+{
+	int ret = 0;
+
+retry:
+	clear_buffer_dirty(bh);
+	wait_on_buffer(bh);
+	if (buffer_eopnotsupp(bh) && (journal->j_flags & JFS_BARRIER)) {
+		char b[BDEVNAME_SIZE];
+
+		printk(KERN_WARNING
+			"JBD: wait_on_commit_record: sync failed on %s - "
+			"disabling barriers\n",
+			bdevname(journal->j_dev, b));
+		spin_lock(&journal->j_state_lock);
+		journal->j_flags &= ~JFS_BARRIER;
+		spin_unlock(&journal->j_state_lock);
+
+		lock_buffer(bh);
+		clear_buffer_dirty(bh);
+		set_buffer_uptodate(bh);
+		bh->b_end_io = journal_end_buffer_io_sync;
+
+		ret = submit_bh(WRITE_SYNC_PLUG, bh);
+		if (ret) {
+			unlock_buffer(bh);
+			goto out;
+		}
+		goto retry;
+	}
+
+	if (unlikely(!buffer_uptodate(bh)))
+		ret = -EIO;
+out:
+	put_bh(bh);		/* One for getblk() */
+	journal_put_journal_head(bh2jh(bh));
+
+	return ret;
+}
+
+static __u32 journal_checksum_data(__u32 crc32_sum, struct buffer_head *bh)
+{
+	struct page *page = bh->b_page;
+	char *addr;
+	__u32 checksum;
+
+	addr = kmap_atomic(page, KM_USER0);
+	checksum = crc32_be(crc32_sum,
+		(void *)(addr + offset_in_page(bh->b_data)), bh->b_size);
+	kunmap_atomic(addr, KM_USER0);
+
+	return checksum;
+}
+#endif
 
 static void journal_do_submit_data(struct buffer_head **wbuf, int bufs,
 				   int write_op)
@@ -183,6 +493,99 @@ static void journal_do_submit_data(struct buffer_head **wbuf, int bufs,
 	}
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+/*
+ * Submit the dirty data ranges of the inodes of the transaction.  We use
+ * generic_writepages() and not ->writepages(), because the writepages of
+ * the file system may start a transaction, which kjournald must not do.
+ */
+static int journal_submit_inode_data_buffers(journal_t *journal,
+		transaction_t *commit_transaction)
+{
+	struct jbd_inode *jinode;
+	int err, ret = 0;
+
+	spin_lock(&journal->j_list_lock);
+	list_for_each_entry(jinode, &commit_transaction->t_inode_list, i_list) {
+		struct address_space *mapping = jinode->i_vfs_inode->i_mapping;
+		struct writeback_control wbc = {
+			.sync_mode = WB_SYNC_ALL,
+			.nr_to_write = LONG_MAX,
+			.range_start = jinode->i_dirty_start,
+			.range_end = jinode->i_dirty_end - 1,
+		};
+
+		jinode->i_flags |= JI_COMMIT_RUNNING;
+		spin_unlock(&journal->j_list_lock);
+		err = generic_writepages(mapping, &wbc);
+		if (!ret)
+			ret = err;
+		spin_lock(&journal->j_list_lock);
+		J_ASSERT(jinode->i_transaction == commit_transaction);
+		jinode->i_flags &= ~JI_COMMIT_RUNNING;
+		smp_mb();
+		wake_up_bit(&jinode->i_flags, __JI_COMMIT_RUNNING);
+	}
+	spin_unlock(&journal->j_list_lock);
+	return ret;
+}
+
+/*
+ * Wait for the data of the inodes of the transaction to be written out,
+ * and move the inodes that were filed again during the commit to their
+ * next transaction.
+ */
+static int journal_finish_inode_data_buffers(journal_t *journal,
+		transaction_t *commit_transaction)
+{
+	struct jbd_inode *jinode, *next_i;
+	int err, ret = 0;
+
+	spin_lock(&journal->j_list_lock);
+	list_for_each_entry(jinode, &commit_transaction->t_inode_list, i_list) {
+		struct address_space *mapping = jinode->i_vfs_inode->i_mapping;
+		loff_t start = jinode->i_dirty_start;
+		loff_t end = jinode->i_dirty_end - 1;
+
+		jinode->i_flags |= JI_COMMIT_RUNNING;
+		spin_unlock(&journal->j_list_lock);
+		err = filemap_fdatawait_range(mapping, start, end);
+		if (err) {
+			/*
+			 * Because AS_EIO is cleared by
+			 * filemap_fdatawait_range(), set it again so
+			 * that user process can get -EIO from fsync().
+			 */
+			set_bit(AS_EIO, &mapping->flags);
+			if (!ret)
+				ret = err;
+		}
+		spin_lock(&journal->j_list_lock);
+		jinode->i_flags &= ~JI_COMMIT_RUNNING;
+		smp_mb();
+		wake_up_bit(&jinode->i_flags, __JI_COMMIT_RUNNING);
+	}
+
+	/* Now refile inode to proper lists */
+	list_for_each_entry_safe(jinode, next_i,
+				 &commit_transaction->t_inode_list, i_list) {
+		list_del(&jinode->i_list);
+		if (jinode->i_next_transaction) {
+			jinode->i_transaction = jinode->i_next_transaction;
+			jinode->i_next_transaction = NULL;
+			list_add(&jinode->i_list,
+				&jinode->i_transaction->t_inode_list);
+		} else {
+			jinode->i_transaction = NULL;
+			jinode->i_dirty_start = 0;
+			jinode->i_dirty_end = 0;
+		}
+	}
+	spin_unlock(&journal->j_list_lock);
+	return ret;
+}
+
+#endif
 /*
  *  Submit all the data buffers to disk
  */
@@ -310,6 +713,23 @@ void journal_commit_transaction(journal_t *journal)
 	unsigned int blocknr;
 	ktime_t start_time;
 	u64 commit_time;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	struct transaction_stats_s stats;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	struct buffer_head *cbh = NULL; /* For transactional checksums */
+	__u32 crc32_sum = ~0;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_EARLY_COMMIT
+	int early_commit;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+	int pmem_bufs = 0;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	int nr_buffers;
+	int expired;
+#endif
 	char *tagp = NULL;
 	journal_header_t *header;
 	journal_block_tag_t *tag = NULL;
@@ -346,9 +766,15 @@ void journal_commit_transaction(journal_t *journal)
 
 	jbd_debug(1, "JBD: starting commit of transaction %d\n",
 			commit_transaction->t_tid);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_start_commit(journal, commit_transaction);
+#endif
 
 	spin_lock(&journal->j_state_lock);
 	commit_transaction->t_state = T_LOCKED;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_commit_locking(journal, commit_transaction);
+#endif
 
 	/*
 	 * Use plugged writes here, since we want to submit several before
@@ -357,13 +783,32 @@ void journal_commit_transaction(journal_t *journal)
 	 */
 	if (commit_transaction->t_synchronous_commit)
 		write_op = WRITE_SYNC_PLUG;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	stats.run.rs_wait = commit_transaction->t_max_wait;
+	stats.run.rs_locked = jiffies;
+	stats.run.rs_running = jbd_time_diff(commit_transaction->t_start,
+					     stats.run.rs_locked);
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/* pairs with the barrier in start_this_handle_fast() */
+	smp_mb();
+#endif
 	spin_lock(&commit_transaction->t_handle_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	while (atomic_read(&commit_transaction->t_updates)) {
+#else
 	while (commit_transaction->t_updates) {
+#endif
 		DEFINE_WAIT(wait);
 
 		prepare_to_wait(&journal->j_wait_updates, &wait,
 					TASK_UNINTERRUPTIBLE);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		if (atomic_read(&commit_transaction->t_updates)) {
+#else
 		if (commit_transaction->t_updates) {
+#endif
 			spin_unlock(&commit_transaction->t_handle_lock);
 			spin_unlock(&journal->j_state_lock);
 			schedule();
@@ -372,10 +817,26 @@ void journal_commit_transaction(journal_t *journal)
 		}
 		finish_wait(&journal->j_wait_updates, &wait);
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+	/* no more handles - release the unused credits of the pool */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	atomic_sub(commit_transaction->t_cow_credits,
+		   &commit_transaction->t_outstanding_credits);
+#else
+	commit_transaction->t_outstanding_credits -=
+		commit_transaction->t_cow_credits;
+#endif
+	commit_transaction->t_cow_credits = 0;
+#endif
 	spin_unlock(&commit_transaction->t_handle_lock);
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	J_ASSERT (atomic_read(&commit_transaction->t_outstanding_credits) <=
+			journal->j_max_transaction_buffers);
+#else
 	J_ASSERT (commit_transaction->t_outstanding_credits <=
 			journal->j_max_transaction_buffers);
+#endif
 
 	/*
 	 * First thing we are allowed to do is to discard any remaining
@@ -404,7 +865,12 @@ void journal_commit_transaction(journal_t *journal)
 			struct buffer_head *bh = jh2bh(jh);
 
 			jbd_lock_bh_state(bh);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+			journal_free_frozen(journal, jh->b_committed_data,
+					    bh->b_size);
+#else
 			jbd_free(jh->b_committed_data, bh->b_size);
+#endif
 			jh->b_committed_data = NULL;
 			jbd_unlock_bh_state(bh);
 		}
@@ -427,6 +893,16 @@ void journal_commit_transaction(journal_t *journal)
 	 */
 	journal_switch_revoke_table(journal);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	stats.run.rs_flushing = jiffies;
+	stats.run.rs_locked = jbd_time_diff(stats.run.rs_locked,
+					    stats.run.rs_flushing);
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	nr_buffers = commit_transaction->t_nr_buffers;
+	expired = time_after_eq(jiffies, commit_transaction->t_expires);
+#endif
 	commit_transaction->t_state = T_FLUSH;
 	journal->j_committing_transaction = commit_transaction;
 	journal->j_running_transaction = NULL;
@@ -436,13 +912,29 @@ void journal_commit_transaction(journal_t *journal)
 	spin_unlock(&journal->j_state_lock);
 
 	jbd_debug (3, "JBD: commit phase 2\n");
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_commit_flushing(journal, commit_transaction);
+#endif
 
 	/*
 	 * Now start flushing things to disk, in the order they appear
 	 * on the transaction lists.  Data blocks go first.
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	if (journal->j_submit_data_callback)
+		journal->j_submit_data_callback(journal, commit_transaction);
+#endif
 	err = journal_submit_data_buffers(journal, commit_transaction,
 					  write_op);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	{
+		int err2 = journal_submit_inode_data_buffers(journal,
+							commit_transaction);
+
+		if (!err)
+			err = err2;
+	}
+#endif
 
 	/*
 	 * Wait for all previously submitted IO to complete.
@@ -491,6 +983,15 @@ void journal_commit_transaction(journal_t *journal)
 		cond_resched_lock(&journal->j_list_lock);
 	}
 	spin_unlock(&journal->j_list_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	{
+		int err2 = journal_finish_inode_data_buffers(journal,
+							commit_transaction);
+
+		if (!err)
+			err = err2;
+	}
+#endif
 
 	if (err) {
 		char b[BDEVNAME_SIZE];
@@ -514,6 +1015,9 @@ void journal_commit_transaction(journal_t *journal)
 	J_ASSERT (commit_transaction->t_sync_datalist == NULL);
 
 	jbd_debug (3, "JBD: commit phase 3\n");
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_commit_logging(journal, commit_transaction);
+#endif
 
 	/*
 	 * Way to go: we have now written out all of the data for a
@@ -524,8 +1028,26 @@ void journal_commit_transaction(journal_t *journal)
 	commit_transaction->t_state = T_COMMIT;
 	spin_unlock(&journal->j_state_lock);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	stats.run.rs_logging = jiffies;
+	stats.run.rs_flushing = jbd_time_diff(stats.run.rs_flushing,
+					      stats.run.rs_logging);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	stats.run.rs_blocks =
+		atomic_read(&commit_transaction->t_outstanding_credits);
+#else
+	stats.run.rs_blocks = commit_transaction->t_outstanding_credits;
+#endif
+	stats.run.rs_blocks_logged = 0;
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	J_ASSERT(commit_transaction->t_nr_buffers <=
+		 atomic_read(&commit_transaction->t_outstanding_credits));
+#else
 	J_ASSERT(commit_transaction->t_nr_buffers <=
 		 commit_transaction->t_outstanding_credits);
+#endif
 
 	descriptor = NULL;
 	bufs = 0;
@@ -605,7 +1127,11 @@ void journal_commit_transaction(journal_t *journal)
 		 * the free space in the log, but this counter is changed
 		 * by journal_next_log_block() also.
 		 */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		atomic_dec(&commit_transaction->t_outstanding_credits);
+#else
 		commit_transaction->t_outstanding_credits--;
+#endif
 
 		/* Bump b_count to prevent truncate from stumbling over
                    the shadowed buffer!  @@@ This can go if we ever get
@@ -669,13 +1195,50 @@ void journal_commit_transaction(journal_t *journal)
 start_journal_io:
 			for (i = 0; i < bufs; i++) {
 				struct buffer_head *bh = wbuf[i];
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+				/*
+				 * Compute checksum.
+				 */
+				if (JFS_HAS_COMPAT_FEATURE(journal,
+					JFS_FEATURE_COMPAT_CHECKSUM)) {
+					crc32_sum =
+					    journal_checksum_data(crc32_sum, bh);
+				}
+
+#endif
 				lock_buffer(bh);
 				clear_buffer_dirty(bh);
 				set_buffer_uptodate(bh);
 				bh->b_end_io = journal_end_buffer_io_sync;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+				/*
+				 * On failure, JFS_PMEM is cleared, so the
+				 * buffers written here are a prefix of wbuf.
+				 */
+				if ((journal->j_flags & JFS_PMEM) &&
+				    !journal_pmem_write_bh(journal, bh)) {
+					bh->b_end_io(bh, 1);
+					pmem_bufs++;
+					continue;
+				}
+#endif
+#ifndef CONFIG_NEXT3_FS_JOURNAL_LOG_BIOS
 				submit_bh(write_op, bh);
+#endif
 			}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_LOG_BIOS
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+			journal_submit_log_bufs(wbuf + pmem_bufs,
+						bufs - pmem_bufs, write_op);
+			pmem_bufs = 0;
+#else
+			journal_submit_log_bufs(wbuf, bufs, write_op);
+#endif
+#endif
 			cond_resched();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+			stats.run.rs_blocks_logged += bufs;
+#endif
 
 			/* Force a new descriptor to be generated next
                            time round the loop. */
@@ -684,6 +1247,42 @@ start_journal_io:
 		}
 	}
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	/*
+	 * Done it all: now write the commit record asynchronously.
+	 * The log blocks checksum in the commit block lets recovery
+	 * detect a commit block that reached the disk before the log.
+	 */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_EARLY_COMMIT
+	/*
+	 * A barrier commit block is not written before the log blocks
+	 * which were submitted ahead of it, so there is no need to wait
+	 * for the log IO before submitting it.  If a log block write
+	 * fails, the checksum makes recovery drop the transaction, just
+	 * like with async commit.
+	 */
+	early_commit = (journal->j_flags & JFS_BARRIER) &&
+		JFS_HAS_COMPAT_FEATURE(journal, JFS_FEATURE_COMPAT_CHECKSUM) &&
+		!JFS_HAS_INCOMPAT_FEATURE(journal,
+					  JFS_FEATURE_INCOMPAT_ASYNC_COMMIT);
+	if (early_commit) {
+		spin_lock(&journal->j_state_lock);
+		J_ASSERT(commit_transaction->t_state == T_COMMIT);
+		commit_transaction->t_state = T_COMMIT_RECORD;
+		spin_unlock(&journal->j_state_lock);
+	}
+	if (early_commit || JFS_HAS_INCOMPAT_FEATURE(journal,
+				     JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+#else
+	if (JFS_HAS_INCOMPAT_FEATURE(journal,
+				     JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+#endif
+		if (journal_submit_commit_record(journal, commit_transaction,
+						 &cbh, crc32_sum))
+			journal_abort(journal, -EIO);
+	}
+
+#endif
 	/* Lo and behold: we have just managed to send a transaction to
            the log.  Before we can commit it, wait for the IO so far to
            complete.  Control buffers being written are on the
@@ -788,16 +1387,107 @@ wait_for_iobuf:
 
 	/* All metadata is written, now write commit record and do cleanup */
 	spin_lock(&journal->j_state_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_EARLY_COMMIT
+	if (!early_commit) {
+		J_ASSERT(commit_transaction->t_state == T_COMMIT);
+		commit_transaction->t_state = T_COMMIT_RECORD;
+	}
+#else
 	J_ASSERT(commit_transaction->t_state == T_COMMIT);
 	commit_transaction->t_state = T_COMMIT_RECORD;
+#endif
 	spin_unlock(&journal->j_state_lock);
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#ifdef CONFIG_NEXT3_FS_JOURNAL_EARLY_COMMIT
+	if (!early_commit && !JFS_HAS_INCOMPAT_FEATURE(journal,
+				      JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+#else
+	if (!JFS_HAS_INCOMPAT_FEATURE(journal,
+				      JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+#endif
+		if (journal_submit_commit_record(journal, commit_transaction,
+						 &cbh, crc32_sum))
+			err = -EIO;
+	}
+	if (cbh) {
+		int ret = journal_wait_on_commit_record(journal, cbh);
+
+		if (!err)
+			err = ret;
+	}
+	/*
+	 * An async commit block was not written with a barrier, so we
+	 * flush the journal device once all the log IO is done.
+	 */
+	if (!err && !is_journal_aborted(journal) &&
+	    (journal->j_flags & JFS_BARRIER) &&
+	    JFS_HAS_INCOMPAT_FEATURE(journal,
+				     JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+		int ret = blkdev_issue_flush(journal->j_dev, GFP_KERNEL, NULL,
+					     BLKDEV_IFL_WAIT);
+
+		if (ret && ret != -EOPNOTSUPP)
+			err = ret;
+	}
+#else
 	if (journal_write_commit_record(journal, commit_transaction))
 		err = -EIO;
+#endif
 
 	if (err)
 		journal_abort(journal, err);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	commit_transaction->t_start = jiffies;
+	stats.run.rs_logging = jbd_time_diff(stats.run.rs_logging,
+					     commit_transaction->t_start);
+
+	/*
+	 * File the transaction statistics
+	 */
+	stats.ts_tid = commit_transaction->t_tid;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	stats.run.rs_handle_count =
+		atomic_read(&commit_transaction->t_handle_count);
+#else
+	stats.run.rs_handle_count = commit_transaction->t_handle_count;
+#endif
+
+	/*
+	 * Calculate overall stats
+	 */
+	spin_lock(&journal->j_history_lock);
+	journal->j_stats.ts_tid++;
+	journal->j_stats.run.rs_wait += stats.run.rs_wait;
+	journal->j_stats.run.rs_running += stats.run.rs_running;
+	journal->j_stats.run.rs_locked += stats.run.rs_locked;
+	journal->j_stats.run.rs_flushing += stats.run.rs_flushing;
+	journal->j_stats.run.rs_logging += stats.run.rs_logging;
+	journal->j_stats.run.rs_handle_count += stats.run.rs_handle_count;
+	journal->j_stats.run.rs_blocks += stats.run.rs_blocks;
+	journal->j_stats.run.rs_blocks_logged += stats.run.rs_blocks_logged;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+#ifdef CONFIG_JBD_DEBUG
+	{
+		struct transaction_cow_stats_s *cs =
+			&commit_transaction->t_cow_stats;
+		struct transaction_cow_stats_s *js = &journal->j_stats.run.rs_cow;
+
+		/* no more handles - the COW counters are stable */
+		js->cs_moved += cs->cs_moved;
+		js->cs_copied += cs->cs_copied;
+		js->cs_ok_jh += cs->cs_ok_jh;
+		js->cs_ok_bitmap += cs->cs_ok_bitmap;
+		js->cs_ok_mapped += cs->cs_ok_mapped;
+		js->cs_bitmaps += cs->cs_bitmaps;
+		js->cs_excluded += cs->cs_excluded;
+	}
+#endif
+#endif
+	spin_unlock(&journal->j_history_lock);
+
+#endif
 	/* End of a transaction!  Finally, we can do checkpoint
            processing: any buffers committed as a result of this
            transaction can be removed from any checkpoint list it was on
@@ -840,14 +1530,24 @@ restart_loop:
 		 * Otherwise, we can just throw away the frozen data now.
 		 */
 		if (jh->b_committed_data) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+			journal_free_frozen(journal, jh->b_committed_data,
+					    bh->b_size);
+#else
 			jbd_free(jh->b_committed_data, bh->b_size);
+#endif
 			jh->b_committed_data = NULL;
 			if (jh->b_frozen_data) {
 				jh->b_committed_data = jh->b_frozen_data;
 				jh->b_frozen_data = NULL;
 			}
 		} else if (jh->b_frozen_data) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+			journal_free_frozen(journal, jh->b_frozen_data,
+					    bh->b_size);
+#else
 			jbd_free(jh->b_frozen_data, bh->b_size);
+#endif
 			jh->b_frozen_data = NULL;
 		}
 
@@ -946,6 +1646,9 @@ restart_loop:
 				journal->j_average_commit_time) / 4;
 	else
 		journal->j_average_commit_time = commit_time;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	journal_adapt_commit_interval(journal, nr_buffers, expired);
+#endif
 
 	spin_unlock(&journal->j_state_lock);
 
@@ -972,6 +1675,9 @@ restart_loop:
 
 	jbd_debug(1, "JBD: commit %d complete, head %d\n",
 		  journal->j_commit_sequence, journal->j_tail_sequence);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_end_commit(journal, commit_transaction);
+#endif
 
 	wake_up(&journal->j_wait_done_commit);
 }
@@ -36,13 +36,31 @@
 #include <linux/poison.h>
 #include <linux/proc_fs.h>
 #include <linux/debugfs.h>
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#endif
+
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <asm/cacheflush.h>
+#endif
 
 #include <asm/uaccess.h>
 #include <asm/page.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+#define CREATE_TRACE_POINTS
+#include <trace/events/jbd.h>
+#endif
 
 EXPORT_SYMBOL(journal_start);
 EXPORT_SYMBOL(journal_restart);
 EXPORT_SYMBOL(journal_extend);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+EXPORT_SYMBOL(journal_draw_credits);
+EXPORT_SYMBOL(journal_fill_credits);
+#endif
 EXPORT_SYMBOL(journal_stop);
 EXPORT_SYMBOL(journal_lock_updates);
 EXPORT_SYMBOL(journal_unlock_updates);
@@ -50,6 +68,12 @@ EXPORT_SYMBOL(journal_get_write_access);
 EXPORT_SYMBOL(journal_get_create_access);
 EXPORT_SYMBOL(journal_get_undo_access);
 EXPORT_SYMBOL(journal_dirty_data);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+EXPORT_SYMBOL(journal_file_inode);
+EXPORT_SYMBOL(journal_begin_ordered_truncate);
+EXPORT_SYMBOL(journal_init_jbd_inode);
+EXPORT_SYMBOL(journal_release_jbd_inode);
+#endif
 EXPORT_SYMBOL(journal_dirty_metadata);
 EXPORT_SYMBOL(journal_release_buffer);
 EXPORT_SYMBOL(journal_forget);
@@ -65,6 +89,9 @@ EXPORT_SYMBOL(journal_update_format);
 EXPORT_SYMBOL(journal_check_used_features);
 EXPORT_SYMBOL(journal_check_available_features);
 EXPORT_SYMBOL(journal_set_features);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+EXPORT_SYMBOL(journal_clear_features);
+#endif
 EXPORT_SYMBOL(journal_create);
 EXPORT_SYMBOL(journal_load);
 EXPORT_SYMBOL(journal_destroy);
@@ -84,6 +111,12 @@ EXPORT_SYMBOL(journal_force_commit);
 
 static int journal_convert_superblock_v1(journal_t *, journal_superblock_t *);
 static void __journal_abort_soft (journal_t *journal, int errno);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+static void journal_destroy_jh_reserve(journal_t *journal);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+static void journal_destroy_frozen_pool(journal_t *journal);
+#endif
 
 /*
  * Helper function used to manage commit timeouts
@@ -148,6 +181,9 @@ loop:
 		spin_unlock(&journal->j_state_lock);
 		del_timer_sync(&journal->j_commit_timer);
 		journal_commit_transaction(journal);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+		log_kick_checkpoint(journal);
+#endif
 		spin_lock(&journal->j_state_lock);
 		goto loop;
 	}
@@ -341,12 +377,21 @@ repeat:
 		char *tmp;
 
 		jbd_unlock_bh_state(bh_in);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+		tmp = journal_alloc_frozen(journal, bh_in->b_size, GFP_NOFS);
+		jbd_lock_bh_state(bh_in);
+		if (jh_in->b_frozen_data) {
+			journal_free_frozen(journal, tmp, bh_in->b_size);
+			goto repeat;
+		}
+#else
 		tmp = jbd_alloc(bh_in->b_size, GFP_NOFS);
 		jbd_lock_bh_state(bh_in);
 		if (jh_in->b_frozen_data) {
 			jbd_free(tmp, bh_in->b_size);
 			goto repeat;
 		}
+#endif
 
 		jh_in->b_frozen_data = tmp;
 		mapped_data = kmap_atomic(new_page, KM_USER0);
@@ -429,6 +474,24 @@ int __log_space_left(journal_t *journal)
 	return left;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+/*
+ * Same as __log_space_left(), without j_state_lock, for the handle start
+ * fast path.  The free space may be stale, so this is only a hint.
+ */
+int log_space_left_nolock(journal_t *journal)
+{
+	int left = ACCESS_ONCE(journal->j_free);
+
+	left -= MIN_LOG_RESERVED_BLOCKS;
+
+	if (left <= 0)
+		return 0;
+	left -= (left >> 3);
+	return left;
+}
+#endif
+
 /*
  * Called under j_state_lock.  Returns true if a transaction commit was started.
  */
@@ -682,6 +745,166 @@ struct journal_head *journal_get_descriptor_buffer(journal_t *journal)
 	return journal_add_journal_head(bh);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+struct jbd_stats_proc_session {
+	journal_t *journal;
+	struct transaction_stats_s *stats;
+};
+
+static void *jbd_seq_info_start(struct seq_file *seq, loff_t *pos)
+{
+	return *pos ? NULL : SEQ_START_TOKEN;
+}
+
+static void *jbd_seq_info_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	return NULL;
+}
+
+static int jbd_seq_info_show(struct seq_file *seq, void *v)
+{
+	struct jbd_stats_proc_session *s = seq->private;
+	unsigned long tid = s->stats->ts_tid;
+
+	if (v != SEQ_START_TOKEN)
+		return 0;
+	seq_printf(seq, "%lu transaction, each up to %u blocks\n",
+			tid, s->journal->j_max_transaction_buffers);
+	if (tid == 0)
+		return 0;
+	seq_printf(seq, "average: \n  %ums waiting for transaction\n",
+	    jiffies_to_msecs(s->stats->run.rs_wait / tid));
+	seq_printf(seq, "  %ums running transaction\n",
+	    jiffies_to_msecs(s->stats->run.rs_running / tid));
+	seq_printf(seq, "  %ums transaction was being locked\n",
+	    jiffies_to_msecs(s->stats->run.rs_locked / tid));
+	seq_printf(seq, "  %ums flushing data (in ordered mode)\n",
+	    jiffies_to_msecs(s->stats->run.rs_flushing / tid));
+	seq_printf(seq, "  %ums logging transaction\n",
+	    jiffies_to_msecs(s->stats->run.rs_logging / tid));
+	seq_printf(seq, "  %lluus average transaction commit time\n",
+		   div_u64(s->journal->j_average_commit_time, 1000));
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	seq_printf(seq, "  %ums commit interval\n",
+		   jiffies_to_msecs(s->journal->j_commit_interval));
+#endif
+	seq_printf(seq, "  %lu handles per transaction\n",
+	    s->stats->run.rs_handle_count / tid);
+	seq_printf(seq, "  %lu blocks per transaction\n",
+	    s->stats->run.rs_blocks / tid);
+	seq_printf(seq, "  %lu logged blocks per transaction\n",
+	    s->stats->run.rs_blocks_logged / tid);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+#ifdef CONFIG_JBD_DEBUG
+	seq_printf(seq, "  %lu blocks moved to snapshot per transaction\n",
+	    s->stats->run.rs_cow.cs_moved / tid);
+	seq_printf(seq, "  %lu blocks copied to snapshot per transaction\n",
+	    s->stats->run.rs_cow.cs_copied / tid);
+	seq_printf(seq, "  %lu blocks already COWed per transaction\n",
+	    s->stats->run.rs_cow.cs_ok_jh / tid);
+	seq_printf(seq, "  %lu blocks not in COW bitmap per transaction\n",
+	    s->stats->run.rs_cow.cs_ok_bitmap / tid);
+	seq_printf(seq, "  %lu blocks mapped in snapshot per transaction\n",
+	    s->stats->run.rs_cow.cs_ok_mapped / tid);
+	seq_printf(seq, "  %lu COW bitmaps created per transaction\n",
+	    s->stats->run.rs_cow.cs_bitmaps / tid);
+	seq_printf(seq, "  %lu excluded blocks per transaction\n",
+	    s->stats->run.rs_cow.cs_excluded / tid);
+#endif
+#endif
+	return 0;
+}
+
+static void jbd_seq_info_stop(struct seq_file *seq, void *v)
+{
+}
+
+static const struct seq_operations jbd_seq_info_ops = {
+	.start  = jbd_seq_info_start,
+	.next   = jbd_seq_info_next,
+	.stop   = jbd_seq_info_stop,
+	.show   = jbd_seq_info_show,
+};
+
+static int jbd_seq_info_open(struct inode *inode, struct file *file)
+{
+	journal_t *journal = PDE(inode)->data;
+	struct jbd_stats_proc_session *s;
+	int rc, size;
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (s == NULL)
+		return -ENOMEM;
+	size = sizeof(struct transaction_stats_s);
+	s->stats = kmalloc(size, GFP_KERNEL);
+	if (s->stats == NULL) {
+		kfree(s);
+		return -ENOMEM;
+	}
+	spin_lock(&journal->j_history_lock);
+	memcpy(s->stats, &journal->j_stats, size);
+	s->journal = journal;
+	spin_unlock(&journal->j_history_lock);
+
+	rc = seq_open(file, &jbd_seq_info_ops);
+	if (rc == 0) {
+		struct seq_file *m = file->private_data;
+		m->private = s;
+	} else {
+		kfree(s->stats);
+		kfree(s);
+	}
+	return rc;
+}
+
+static int jbd_seq_info_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+	struct jbd_stats_proc_session *s = seq->private;
+	kfree(s->stats);
+	kfree(s);
+	return seq_release(inode, file);
+}
+
+static const struct file_operations jbd_seq_info_fops = {
+	.owner		= THIS_MODULE,
+	.open           = jbd_seq_info_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = jbd_seq_info_release,
+};
+
+static struct proc_dir_entry *proc_jbd_stats;
+
+static void jbd_stats_proc_init(journal_t *journal)
+{
+	char *p;
+
+	bdevname(journal->j_dev, journal->j_devname);
+	p = journal->j_devname;
+	while ((p = strchr(p, '/')))
+		*p = '!';
+	if (journal->j_inode) {
+		p = journal->j_devname + strlen(journal->j_devname);
+		sprintf(p, "-%lu", journal->j_inode->i_ino);
+	}
+	journal->j_proc_entry = proc_mkdir(journal->j_devname, proc_jbd_stats);
+	if (journal->j_proc_entry) {
+		proc_create_data("info", S_IRUGO, journal->j_proc_entry,
+				 &jbd_seq_info_fops, journal);
+	}
+}
+
+static void jbd_stats_proc_exit(journal_t *journal)
+{
+	if (!journal->j_proc_entry)
+		return;
+	remove_proc_entry("info", journal->j_proc_entry);
+	remove_proc_entry(journal->j_devname, proc_jbd_stats);
+	journal->j_proc_entry = NULL;
+}
+
+#endif
 /*
  * Management for journal control blocks: functions to create and
  * destroy journal_t structures, and to initialise and read existing
@@ -708,9 +931,18 @@ static journal_t * journal_init_common (void)
 	init_waitqueue_head(&journal->j_wait_updates);
 	mutex_init(&journal->j_barrier);
 	mutex_init(&journal->j_checkpoint_mutex);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+	INIT_WORK(&journal->j_checkpoint_work, journal_checkpoint_work);
+#endif
 	spin_lock_init(&journal->j_revoke_lock);
 	spin_lock_init(&journal->j_list_lock);
 	spin_lock_init(&journal->j_state_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	spin_lock_init(&journal->j_jh_reserve_lock);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+	spin_lock_init(&journal->j_frozen_lock);
+#endif
 
 	journal->j_commit_interval = (HZ * JBD_DEFAULT_MAX_COMMIT_AGE);
 
@@ -723,6 +955,9 @@ static journal_t * journal_init_common (void)
 		kfree(journal);
 		goto fail;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	spin_lock_init(&journal->j_history_lock);
+#endif
 	return journal;
 fail:
 	return NULL;
@@ -737,6 +972,68 @@ fail:
  *
  */
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+/*
+ * Use the direct_access mapping of an external journal device to write
+ * the log.  direct_access takes sectors of the whole disk, so we don't
+ * use it on partitions.
+ */
+static void journal_pmem_init(journal_t *journal)
+{
+	struct block_device *bdev = journal->j_dev;
+	char b[BDEVNAME_SIZE];
+
+	if (bdev == journal->j_fs_dev || bdev != bdev->bd_contains ||
+	    !bdev->bd_disk->fops->direct_access || !cpu_has_clflush)
+		return;
+
+	journal->j_flags |= JFS_PMEM;
+	printk(KERN_INFO "JBD: writing the log of %s through direct_access\n",
+	       bdevname(bdev, b));
+}
+
+/*
+ * Copy the locked log buffer @bh into the direct_access mapping of the
+ * journal device and flush it out of the CPU cache.  clflush_cache_range()
+ * fences before and after the flush, so the block is durable, and ordered
+ * against the log blocks written before it, when we return.
+ *
+ * Returns 0 on success.  On failure, the journal goes back to writing
+ * the log with bios and the caller must submit @bh.
+ */
+int journal_pmem_write_bh(journal_t *journal, struct buffer_head *bh)
+{
+	struct block_device *bdev = journal->j_dev;
+	sector_t sector = bh->b_blocknr * (bh->b_size >> 9);
+	sector_t page_sector = sector & ~((sector_t)(PAGE_SIZE >> 9) - 1);
+	unsigned int off = (sector - page_sector) << 9;
+	unsigned long pfn;
+	void *kaddr;
+	char *src;
+	int err;
+
+	err = bdev->bd_disk->fops->direct_access(bdev, page_sector,
+						  &kaddr, &pfn);
+	if (err) {
+		char b[BDEVNAME_SIZE];
+
+		printk(KERN_WARNING "JBD: direct_access failed on %s "
+		       "(err %d) - writing the log with bios\n",
+		       bdevname(bdev, b), err);
+		spin_lock(&journal->j_state_lock);
+		journal->j_flags &= ~JFS_PMEM;
+		spin_unlock(&journal->j_state_lock);
+		return err;
+	}
+
+	src = kmap_atomic(bh->b_page, KM_USER0);
+	memcpy(kaddr + off, src + bh_offset(bh), bh->b_size);
+	kunmap_atomic(src, KM_USER0);
+	clflush_cache_range(kaddr + off, bh->b_size);
+	return 0;
+}
+
+#endif
 /**
  *  journal_t * journal_init_dev() - creates and initialises a journal structure
  *  @bdev: Block device on which to create the journal
@@ -776,6 +1073,12 @@ journal_t * journal_init_dev(struct block_device *bdev,
 	journal->j_fs_dev = fs_dev;
 	journal->j_blk_offset = start;
 	journal->j_maxlen = len;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+	journal_pmem_init(journal);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_stats_proc_init(journal);
+#endif
 
 	bh = __getblk(journal->j_dev, start, journal->j_blocksize);
 	if (!bh) {
@@ -790,6 +1093,9 @@ journal_t * journal_init_dev(struct block_device *bdev,
 	return journal;
 out_err:
 	kfree(journal->j_wbuf);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_stats_proc_exit(journal);
+#endif
 	kfree(journal);
 	return NULL;
 }
@@ -823,6 +1129,9 @@ journal_t * journal_init_inode (struct inode *inode)
 
 	journal->j_maxlen = inode->i_size >> inode->i_sb->s_blocksize_bits;
 	journal->j_blocksize = inode->i_sb->s_blocksize;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_stats_proc_init(journal);
+#endif
 
 	/* journal descriptor can store up to n blocks -bzzz */
 	n = journal->j_blocksize / sizeof(journal_block_tag_t);
@@ -855,6 +1164,9 @@ journal_t * journal_init_inode (struct inode *inode)
 	return journal;
 out_err:
 	kfree(journal->j_wbuf);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_stats_proc_exit(journal);
+#endif
 	kfree(journal);
 	return NULL;
 }
@@ -1196,6 +1508,14 @@ int journal_destroy(journal_t *journal)
 	/* Force a final log commit */
 	if (journal->j_running_transaction)
 		journal_commit_transaction(journal);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+
+	/*
+	 * kjournald was the only one to queue background checkpoints.  A
+	 * running one may have been waiting for the final commit above.
+	 */
+	cancel_work_sync(&journal->j_checkpoint_work);
+#endif
 
 	/* Force any old transactions to disk */
 
@@ -1229,6 +1549,15 @@ int journal_destroy(journal_t *journal)
 		iput(journal->j_inode);
 	if (journal->j_revoke)
 		journal_destroy_revoke(journal);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_stats_proc_exit(journal);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	journal_destroy_jh_reserve(journal);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+	journal_destroy_frozen_pool(journal);
+#endif
 	kfree(journal->j_wbuf);
 	kfree(journal);
 
@@ -1338,6 +1667,34 @@ int journal_set_features (journal_t *journal, unsigned long compat,
 	return 1;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+/**
+ * void journal_clear_features () - Clear a given journal feature in the
+ * 				    superblock
+ * @journal: Journal to act on.
+ * @compat: bitmask of compatible features
+ * @ro: bitmask of features that force read-only mount
+ * @incompat: bitmask of incompatible features
+ *
+ * Clear a given journal feature as present on the
+ * superblock.
+ */
+void journal_clear_features(journal_t *journal, unsigned long compat,
+			    unsigned long ro, unsigned long incompat)
+{
+	journal_superblock_t *sb;
+
+	jbd_debug(1, "Clear features 0x%lx/0x%lx/0x%lx\n",
+		  compat, ro, incompat);
+
+	sb = journal->j_superblock;
+
+	sb->s_feature_compat    &= ~cpu_to_be32(compat);
+	sb->s_feature_ro_compat &= ~cpu_to_be32(ro);
+	sb->s_feature_incompat  &= ~cpu_to_be32(incompat);
+}
+#endif
+
 
 /**
  * int journal_update_format () - Update on-disk journal structure.
@@ -1686,6 +2043,126 @@ int journal_blocks_per_page(struct inode *inode)
 	return 1 << (PAGE_CACHE_SHIFT - inode->i_sb->s_blocksize_bits);
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+/*
+ * Initialize jbd inode head
+ */
+void journal_init_jbd_inode(struct jbd_inode *jinode, struct inode *inode)
+{
+	jinode->i_transaction = NULL;
+	jinode->i_next_transaction = NULL;
+	jinode->i_vfs_inode = inode;
+	jinode->i_flags = 0;
+	jinode->i_dirty_start = 0;
+	jinode->i_dirty_end = 0;
+	INIT_LIST_HEAD(&jinode->i_list);
+}
+
+/*
+ * Function to be called before we start removing inode from memory (i.e.,
+ * clear_inode() is a fine place to be called from). It removes inode from
+ * transaction's lists.
+ */
+void journal_release_jbd_inode(journal_t *journal, struct jbd_inode *jinode)
+{
+	if (!journal)
+		return;
+restart:
+	spin_lock(&journal->j_list_lock);
+	/* Is commit writing out inode - we have to wait */
+	if (jinode->i_flags & JI_COMMIT_RUNNING) {
+		wait_queue_head_t *wq;
+		DEFINE_WAIT_BIT(wait, &jinode->i_flags, __JI_COMMIT_RUNNING);
+
+		wq = bit_waitqueue(&jinode->i_flags, __JI_COMMIT_RUNNING);
+		prepare_to_wait(wq, &wait.wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock(&journal->j_list_lock);
+		schedule();
+		finish_wait(wq, &wait.wait);
+		goto restart;
+	}
+
+	/* Do we need to wait for data writeback? */
+	if (jinode->i_transaction) {
+		list_del(&jinode->i_list);
+		jinode->i_transaction = NULL;
+		jinode->i_next_transaction = NULL;
+	}
+	spin_unlock(&journal->j_list_lock);
+}
+
+#endif
+
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+/*
+ * Frozen buffer pool
+ *
+ * Frozen (and committed) copies of journaled buffers are freed when their
+ * transaction commits, and the same busy buffers are usually frozen again by
+ * the next transaction.  Freed block sized copies are kept in a small pool,
+ * so the next transaction reuses them instead of going back to the page
+ * allocator.  Buffers of other sizes bypass the pool.
+ */
+
+/*
+ * journal_get_frozen() - take a buffer from the frozen buffer pool
+ *
+ * Doesn't sleep, so it may be called under the buffer state lock.
+ * Returns NULL if the pool is empty.
+ */
+void *journal_get_frozen(journal_t *journal, size_t size)
+{
+	void *ptr;
+
+	if (size != journal->j_blocksize || !journal->j_frozen_pool)
+		return NULL;
+
+	spin_lock(&journal->j_frozen_lock);
+	ptr = journal->j_frozen_pool;
+	if (ptr) {
+		journal->j_frozen_pool = *(void **)ptr;
+		journal->j_frozen_count--;
+	}
+	spin_unlock(&journal->j_frozen_lock);
+	return ptr;
+}
+
+void *journal_alloc_frozen(journal_t *journal, size_t size, gfp_t flags)
+{
+	void *ptr = journal_get_frozen(journal, size);
+
+	if (!ptr)
+		ptr = jbd_alloc(size, flags);
+	return ptr;
+}
+
+void journal_free_frozen(journal_t *journal, void *ptr, size_t size)
+{
+	if (size == journal->j_blocksize &&
+			journal->j_frozen_count < JBD_MAX_FROZEN_POOL) {
+		spin_lock(&journal->j_frozen_lock);
+		if (journal->j_frozen_count < JBD_MAX_FROZEN_POOL) {
+			*(void **)ptr = journal->j_frozen_pool;
+			journal->j_frozen_pool = ptr;
+			journal->j_frozen_count++;
+			ptr = NULL;
+		}
+		spin_unlock(&journal->j_frozen_lock);
+	}
+	if (ptr)
+		jbd_free(ptr, size);
+}
+
+static void journal_destroy_frozen_pool(journal_t *journal)
+{
+	void *ptr;
+
+	while ((ptr = journal_get_frozen(journal, journal->j_blocksize)))
+		jbd_free(ptr, journal->j_blocksize);
+	J_ASSERT(journal->j_frozen_count == 0);
+}
+
+#endif
 /*
  * Journal_head storage management
  */
@@ -1720,16 +2197,88 @@ static void journal_destroy_journal_head_cache(void)
 	}
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+/*
+ * journal_fill_jh_reserve() - top up the journal_head reserve
+ * @journal: journal of the handle
+ * @nblocks: credits of the handle
+ *
+ * Called before a handle joins the running transaction, where it may sleep
+ * in the allocator without holding up the commit.  Every credit of the
+ * handle may need a new journal_head, so keep at least that many in the
+ * reserve, up to JBD_MAX_JH_RESERVE.  Failure to allocate is not an error:
+ * journal_alloc_journal_head() falls back to the slab allocator.
+ */
+void journal_fill_jh_reserve(journal_t *journal, int nblocks)
+{
+	struct journal_head *jh;
+	int target = min(nblocks, JBD_MAX_JH_RESERVE);
+
+	/* unlocked test: a short reserve is only a missed optimization */
+	while (journal->j_jh_reserved < target) {
+		jh = kmem_cache_alloc(journal_head_cache,
+				      GFP_NOFS|__GFP_NOWARN);
+		if (!jh)
+			break;
+		spin_lock(&journal->j_jh_reserve_lock);
+		jh->b_tnext = journal->j_jh_reserve;
+		journal->j_jh_reserve = jh;
+		journal->j_jh_reserved++;
+		spin_unlock(&journal->j_jh_reserve_lock);
+	}
+}
+
+static struct journal_head *journal_draw_jh_reserve(journal_t *journal)
+{
+	struct journal_head *jh;
+
+	spin_lock(&journal->j_jh_reserve_lock);
+	jh = journal->j_jh_reserve;
+	if (jh) {
+		journal->j_jh_reserve = jh->b_tnext;
+		journal->j_jh_reserved--;
+	}
+	spin_unlock(&journal->j_jh_reserve_lock);
+	return jh;
+}
+
+static void journal_destroy_jh_reserve(journal_t *journal)
+{
+	struct journal_head *jh;
+
+	while ((jh = journal_draw_jh_reserve(journal)))
+		kmem_cache_free(journal_head_cache, jh);
+	J_ASSERT(journal->j_jh_reserved == 0);
+}
+
+#endif
 /*
  * journal_head splicing and dicing
  */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+/*
+ * Journal_heads allocated on behalf of a handle of @journal come from the
+ * journal_head reserve, which was topped up when the handle started.
+ * The slab allocator is only used when @journal is NULL or the reserve
+ * ran dry.  Journal_heads are always freed back to the slab.
+ */
+static struct journal_head *journal_alloc_journal_head(journal_t *journal)
+#else
 static struct journal_head *journal_alloc_journal_head(void)
+#endif
 {
 	struct journal_head *ret;
 	static unsigned long last_warning;
 
 #ifdef CONFIG_JBD_DEBUG
 	atomic_inc(&nr_journal_heads);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	if (journal && journal->j_jh_reserve) {
+		ret = journal_draw_jh_reserve(journal);
+		if (ret)
+			return ret;
+	}
 #endif
 	ret = kmem_cache_alloc(journal_head_cache, GFP_NOFS);
 	if (ret == NULL) {
@@ -1799,14 +2348,28 @@ static void journal_free_journal_head(struct journal_head *jh)
  * Doesn't need the journal lock.
  * May sleep.
  */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+/*
+ * With a non-NULL @journal, the journal_head is drawn from the journal_head
+ * reserve of @journal and the call doesn't sleep as long as the reserve
+ * lasts.
+ */
+struct journal_head *__journal_add_journal_head(journal_t *journal,
+						struct buffer_head *bh)
+#else
 struct journal_head *journal_add_journal_head(struct buffer_head *bh)
+#endif
 {
 	struct journal_head *jh;
 	struct journal_head *new_jh = NULL;
 
 repeat:
 	if (!buffer_jbd(bh)) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+		new_jh = journal_alloc_journal_head(journal);
+#else
 		new_jh = journal_alloc_journal_head();
+#endif
 		memset(new_jh, 0, sizeof(*new_jh));
 	}
 
@@ -1974,6 +2537,21 @@ static inline void jbd_remove_debugfs_entry(void)
 
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+#define JBD_STATS_PROC_NAME "fs/jbd"
+
+static void __init jbd_create_jbd_stats_proc_entry(void)
+{
+	proc_jbd_stats = proc_mkdir(JBD_STATS_PROC_NAME, NULL);
+}
+
+static void __exit jbd_remove_jbd_stats_proc_entry(void)
+{
+	if (proc_jbd_stats)
+		remove_proc_entry(JBD_STATS_PROC_NAME, NULL);
+}
+
+#endif
 struct kmem_cache *jbd_handle_cache;
 
 static int __init journal_init_handle_cache(void)
@@ -2009,6 +2587,10 @@ static int __init journal_init_caches(void)
 		ret = journal_init_journal_head_cache();
 	if (ret == 0)
 		ret = journal_init_handle_cache();
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+	if (ret == 0)
+		ret = journal_init_checkpoint_wq();
+#endif
 	return ret;
 }
 
@@ -2017,6 +2599,9 @@ static void journal_destroy_caches(void)
 	journal_destroy_revoke_caches();
 	journal_destroy_journal_head_cache();
 	journal_destroy_handle_cache();
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+	journal_destroy_checkpoint_wq();
+#endif
 }
 
 static int __init journal_init(void)
@@ -2026,9 +2611,14 @@ static int __init journal_init(void)
 	BUILD_BUG_ON(sizeof(struct journal_superblock_s) != 1024);
 
 	ret = journal_init_caches();
-	if (ret != 0)
+	if (ret == 0) {
+		jbd_create_debugfs_entry();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+		jbd_create_jbd_stats_proc_entry();
+#endif
+	} else {
 		journal_destroy_caches();
-	jbd_create_debugfs_entry();
+	}
 	return ret;
 }
 
@@ -2040,6 +2630,13 @@ static void __exit journal_exit(void)
 		printk(KERN_EMERG "JBD: leaked %d journal_heads!\n", n);
 #endif
 	jbd_remove_debugfs_entry();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	jbd_remove_jbd_stats_proc_entry();
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/* wait for the RCU free of dropped transactions */
+	rcu_barrier();
+#endif
 	journal_destroy_caches();
 }
 
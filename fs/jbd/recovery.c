@@ -20,6 +20,9 @@
 #include <linux/fs.h>
 #include <linux/jbd.h>
 #include <linux/errno.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#include <linux/crc32.h>
+#endif
 #endif
 
 /*
@@ -120,6 +123,57 @@ failed:
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_RECOVERY_READAHEAD
+/*
+ * Start reading @nr log blocks from log offset @start, wrapping around
+ * the end of the log.  Blocks which are already cached or being read
+ * are skipped, so it is cheap to call this again for a range which
+ * overlaps a previous readahead.
+ */
+static void journal_readahead_log(journal_t *journal, unsigned int start,
+				  int nr)
+{
+	unsigned int next = start;
+	unsigned int blocknr;
+	struct buffer_head *bh;
+	struct buffer_head *bufs[MAXBUF];
+	int nbufs = 0;
+
+	if (nr > journal->j_last - journal->j_first)
+		nr = journal->j_last - journal->j_first;
+
+	while (nr-- > 0) {
+		if (next >= journal->j_last)
+			next -= journal->j_last - journal->j_first;
+		if (journal_bmap(journal, next++, &blocknr))
+			break;
+
+		bh = __getblk(journal->j_dev, blocknr, journal->j_blocksize);
+		if (!bh)
+			break;
+
+		if (!buffer_uptodate(bh) && !buffer_locked(bh)) {
+			bufs[nbufs++] = bh;
+			if (nbufs == MAXBUF) {
+				ll_rw_block(READ, nbufs, bufs);
+				journal_brelse_array(bufs, nbufs);
+				nbufs = 0;
+			}
+		} else
+			brelse(bh);
+	}
+
+	if (nbufs) {
+		ll_rw_block(READ, nbufs, bufs);
+		journal_brelse_array(bufs, nbufs);
+	}
+}
+
+#endif
+#else
+#ifdef CONFIG_NEXT3_FS_JOURNAL_RECOVERY_READAHEAD
+#define journal_readahead_log(journal, start, nr) do {} while (0)
+#endif
 #endif /* __KERNEL__ */
 
 
@@ -309,6 +363,39 @@ int journal_skip_recovery(journal_t *journal)
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+/*
+ * calc_chksums calculates the checksums for the blocks described in the
+ * descriptor block.
+ */
+static int calc_chksums(journal_t *journal, struct buffer_head *bh,
+			unsigned int *next_log_block, __u32 *crc32_sum)
+{
+	int i, num_blks, err;
+	unsigned int io_block;
+	struct buffer_head *obh;
+
+	num_blks = count_tags(bh, journal->j_blocksize);
+	/* Calculate checksum of the descriptor block. */
+	*crc32_sum = crc32_be(*crc32_sum, (void *)bh->b_data, bh->b_size);
+
+	for (i = 0; i < num_blks; i++) {
+		io_block = (*next_log_block)++;
+		wrap(journal, *next_log_block);
+		err = jread(&obh, journal, io_block);
+		if (err) {
+			printk(KERN_ERR "JBD: IO error %d recovering block "
+				"%u in log\n", err, io_block);
+			return err;
+		}
+		*crc32_sum = crc32_be(*crc32_sum, (void *)obh->b_data,
+				      obh->b_size);
+		put_bh(obh);
+	}
+	return 0;
+}
+
+#endif
 static int do_one_pass(journal_t *journal,
 			struct recovery_info *info, enum passtype pass)
 {
@@ -320,6 +407,9 @@ static int do_one_pass(journal_t *journal,
 	struct buffer_head *	bh;
 	unsigned int		sequence;
 	int			blocktype;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	__u32			crc32_sum = ~0; /* Transactional Checksums */
+#endif
 
 	/* Precompute the maximum metadata descriptors in a descriptor block */
 	int			MAX_BLOCKS_PER_DESC;
@@ -411,9 +501,43 @@ static int do_one_pass(journal_t *journal,
 		switch(blocktype) {
 		case JFS_DESCRIPTOR_BLOCK:
 			/* If it is a valid descriptor block, replay it
-			 * in pass REPLAY; otherwise, just skip over the
-			 * blocks it describes. */
+			 * in pass REPLAY; if journal_checksums enabled, then
+			 * calculate checksums in PASS_SCAN, otherwise,
+			 * just skip over the blocks it describes. */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_RECOVERY_READAHEAD
+			/*
+			 * Pipeline the log reads when the pass is going to
+			 * read the tagged blocks: start reading all the
+			 * blocks of this descriptor, and a descriptor worth
+			 * of blocks beyond it, so the next descriptor is
+			 * already in flight while this one is processed.
+			 */
+			if (pass == PASS_REPLAY
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+			    || (pass == PASS_SCAN &&
+				JFS_HAS_COMPAT_FEATURE(journal,
+					JFS_FEATURE_COMPAT_CHECKSUM))
+#endif
+			    )
+				journal_readahead_log(journal, next_log_block,
+					count_tags(bh, journal->j_blocksize) +
+					MAX_BLOCKS_PER_DESC + 1);
+
+#endif
 			if (pass != PASS_REPLAY) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+				if (pass == PASS_SCAN &&
+				    JFS_HAS_COMPAT_FEATURE(journal,
+					    JFS_FEATURE_COMPAT_CHECKSUM)) {
+					err = calc_chksums(journal, bh,
+							   &next_log_block,
+							   &crc32_sum);
+					brelse(bh);
+					if (err)
+						goto failed;
+					continue;
+				}
+#endif
 				next_log_block +=
 					count_tags(bh, journal->j_blocksize);
 				wrap(journal, next_log_block);
@@ -508,9 +632,56 @@ static int do_one_pass(journal_t *journal,
 			continue;
 
 		case JFS_COMMIT_BLOCK:
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+			/* Found an expected commit block: if checksums
+			 * are present verify them in PASS_SCAN; else not
+			 * much to do other than move on to the next sequence
+			 * number. */
+			if (pass == PASS_SCAN &&
+			    JFS_HAS_COMPAT_FEATURE(journal,
+				    JFS_FEATURE_COMPAT_CHECKSUM)) {
+				struct commit_header *cbh =
+					(struct commit_header *)bh->b_data;
+				unsigned found_chksum =
+					be32_to_cpu(cbh->h_chksum[0]);
+
+				/*
+				 * A commit block written by a kernel without
+				 * journal checksums has no checksum at all.
+				 * Any other mismatch means that the
+				 * transaction did not fully reach the log:
+				 * it is expected for the last transaction
+				 * with async commit, and a corruption
+				 * otherwise.  Either way, the log ends here.
+				 */
+				if (!(crc32_sum == found_chksum &&
+				      cbh->h_chksum_type == JFS_CRC32_CHKSUM &&
+				      cbh->h_chksum_size ==
+						JFS_CRC32_CHKSUM_SIZE) &&
+				    !(cbh->h_chksum_type == 0 &&
+				      cbh->h_chksum_size == 0 &&
+				      found_chksum == 0)) {
+					if (!JFS_HAS_INCOMPAT_FEATURE(journal,
+					    JFS_FEATURE_INCOMPAT_ASYNC_COMMIT))
+						printk(KERN_ERR "JBD: checksum "
+						       "error in transaction "
+						       "%u, end of log\n",
+						       next_commit_ID);
+					else
+						jbd_debug(1, "JBD: checksum "
+							  "error in transaction "
+							  "%u, end of log\n",
+							  next_commit_ID);
+					brelse(bh);
+					goto done;
+				}
+				crc32_sum = ~0;
+			}
+#else
 			/* Found an expected commit block: not much to
 			 * do other than move on to the next sequence
 			 * number. */
+#endif
 			brelse(bh);
 			next_commit_ID++;
 			continue;
@@ -87,6 +87,9 @@
 #include <linux/list.h>
 #include <linux/init.h>
 #include <linux/bio.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+#include <trace/events/jbd.h>
+#endif
 #endif
 #include <linux/log2.h>
 
@@ -113,8 +116,17 @@ struct jbd_revoke_table_s
 	int		  hash_size;
 	int		  hash_shift;
 	struct list_head *hash_table;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	/* Number of hashed records [j_revoke_lock] */
+	int		  hash_count;
+#endif
 };
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+/* Grow the running revoke table above this many records per bucket */
+#define REVOKE_HASH_LOAD	4
+#endif
+
 
 #ifdef __KERNEL__
 static void write_one_revoke_record(journal_t *, transaction_t *,
@@ -126,21 +138,82 @@ static void flush_descriptor(journal_t *, struct journal_head *, int, int);
 /* Utility functions to maintain the revoke table */
 
 /* Borrowed from buffer.c: this is a tried and tested block hash function */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+static inline int hash(struct jbd_revoke_table_s *table, unsigned int block)
+{
+	int hash_shift = table->hash_shift;
+#else
 static inline int hash(journal_t *journal, unsigned int block)
 {
 	struct jbd_revoke_table_s *table = journal->j_revoke;
 	int hash_shift = table->hash_shift;
+#endif
 
 	return ((block << (hash_shift - 6)) ^
 		(block >> 13) ^
 		(block << (hash_shift - 12))) & (table->hash_size - 1);
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+/*
+ * Double the number of buckets of the running revoke table, so that the
+ * hash chains stay short when a transaction revokes a lot of blocks
+ * (mass delete, snapshot shrink) and during recovery.
+ *
+ * The running table is stable while we hold a handle or run recovery,
+ * but other handles may look up and insert records concurrently, so the
+ * records are rehashed under j_revoke_lock.  The grown table is kept for
+ * the following transactions.  Failing to grow is not an error.
+ */
+static void journal_grow_revoke_table(journal_t *journal)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	struct jbd_revoke_record_s *record;
+	struct list_head *hash_table, *old_table;
+	int old_size = table->hash_size;
+	int i;
+
+	hash_table = kmalloc(2 * old_size * sizeof(struct list_head),
+			     GFP_NOFS | __GFP_NOWARN);
+	if (!hash_table)
+		return;
+	for (i = 0; i < 2 * old_size; i++)
+		INIT_LIST_HEAD(&hash_table[i]);
+
+	spin_lock(&journal->j_revoke_lock);
+	if (table->hash_size != old_size) {
+		/* someone else grew the table */
+		spin_unlock(&journal->j_revoke_lock);
+		kfree(hash_table);
+		return;
+	}
+	old_table = table->hash_table;
+	table->hash_table = hash_table;
+	table->hash_size = 2 * old_size;
+	table->hash_shift++;
+	for (i = 0; i < old_size; i++) {
+		while (!list_empty(&old_table[i])) {
+			record = list_entry(old_table[i].next,
+					    struct jbd_revoke_record_s, hash);
+			list_move(&record->hash,
+				  &hash_table[hash(table, record->blocknr)]);
+		}
+	}
+	spin_unlock(&journal->j_revoke_lock);
+	kfree(old_table);
+	jbd_debug(1, "revoke table grown to %d buckets\n", 2 * old_size);
+}
+
+#endif
 static int insert_revoke_hash(journal_t *journal, unsigned int blocknr,
 			      tid_t seq)
 {
 	struct list_head *hash_list;
 	struct jbd_revoke_record_s *record;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	struct jbd_revoke_table_s *table;
+	int grow;
+#endif
 
 repeat:
 	record = kmem_cache_alloc(revoke_record_cache, GFP_NOFS);
@@ -149,10 +222,22 @@ repeat:
 
 	record->sequence = seq;
 	record->blocknr = blocknr;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	spin_lock(&journal->j_revoke_lock);
+	table = journal->j_revoke;
+	hash_list = &table->hash_table[hash(table, blocknr)];
+	list_add(&record->hash, hash_list);
+	grow = ++table->hash_count > REVOKE_HASH_LOAD * table->hash_size &&
+		table->hash_size < JOURNAL_REVOKE_MAX_HASH;
+	spin_unlock(&journal->j_revoke_lock);
+	if (grow)
+		journal_grow_revoke_table(journal);
+#else
 	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
 	spin_lock(&journal->j_revoke_lock);
 	list_add(&record->hash, hash_list);
 	spin_unlock(&journal->j_revoke_lock);
+#endif
 	return 0;
 
 oom:
@@ -171,9 +256,16 @@ static struct jbd_revoke_record_s *find_revoke_record(journal_t *journal,
 	struct list_head *hash_list;
 	struct jbd_revoke_record_s *record;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	/* the table may be grown under us, so hash under the lock */
+	spin_lock(&journal->j_revoke_lock);
+	hash_list = &journal->j_revoke->hash_table[hash(journal->j_revoke,
+							 blocknr)];
+#else
 	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
 
 	spin_lock(&journal->j_revoke_lock);
+#endif
 	record = (struct jbd_revoke_record_s *) hash_list->next;
 	while (&(record->hash) != hash_list) {
 		if (record->blocknr == blocknr) {
@@ -240,6 +332,9 @@ static struct jbd_revoke_table_s *journal_init_revoke_table(int hash_size)
 
 	table->hash_size = hash_size;
 	table->hash_shift = shift;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	table->hash_count = 0;
+#endif
 	table->hash_table =
 		kmalloc(hash_size * sizeof(struct list_head), GFP_KERNEL);
 	if (!table->hash_table) {
@@ -352,6 +447,9 @@ int journal_revoke(handle_t *handle, unsigned int blocknr,
 
 	bdev = journal->j_fs_dev;
 	bh = bh_in;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_revoke(journal, handle->h_transaction->t_tid, blocknr);
+#endif
 
 	if (!bh) {
 		bh = __find_get_block(bdev, blocknr, journal->j_blocksize);
@@ -451,6 +549,9 @@ int journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
 				  "blocknr %llu\n", (unsigned long long)bh->b_blocknr);
 			spin_lock(&journal->j_revoke_lock);
 			list_del(&record->hash);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+			journal->j_revoke->hash_count--;
+#endif
 			spin_unlock(&journal->j_revoke_lock);
 			kmem_cache_free(revoke_record_cache, record);
 			did_revoke = 1;
@@ -494,6 +595,9 @@ void journal_switch_revoke_table(journal_t *journal)
 
 	for (i = 0; i < journal->j_revoke->hash_size; i++)
 		INIT_LIST_HEAD(&journal->j_revoke->hash_table[i]);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	journal->j_revoke->hash_count = 0;
+#endif
 }
 
 /*
@@ -531,6 +635,9 @@ void journal_write_revoke_records(journal_t *journal,
 			kmem_cache_free(revoke_record_cache, record);
 		}
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	revoke->hash_count = 0;
+#endif
 	if (descriptor)
 		flush_descriptor(journal, descriptor, offset, write_op);
 	jbd_debug(1, "Wrote %d revoke records\n", count);
@@ -616,6 +723,18 @@ static void flush_descriptor(journal_t *journal,
 	header->r_count = cpu_to_be32(offset);
 	set_buffer_jwrite(bh);
 	BUFFER_TRACE(bh, "write");
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+	if (journal->j_flags & JFS_PMEM) {
+		lock_buffer(bh);
+		if (!journal_pmem_write_bh(journal, bh)) {
+			clear_buffer_dirty(bh);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			return;
+		}
+		unlock_buffer(bh);
+	}
+#endif
 	set_buffer_dirty(bh);
 	ll_rw_block((write_op == WRITE) ? SWRITE : SWRITE_SYNC_PLUG, 1, &bh);
 }
@@ -703,4 +822,7 @@ void journal_clear_revoke(journal_t *journal)
 			kmem_cache_free(revoke_record_cache, record);
 		}
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+	revoke->hash_count = 0;
+#endif
 }
@@ -26,6 +26,9 @@
 #include <linux/mm.h>
 #include <linux/highmem.h>
 #include <linux/hrtimer.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+#include <trace/events/jbd.h>
+#endif
 
 static void __journal_temp_unlink_buffer(struct journal_head *jh);
 
@@ -53,7 +56,13 @@ get_transaction(journal_t *journal, transaction_t *transaction)
 	transaction->t_start_time = ktime_get();
 	transaction->t_tid = journal->j_transaction_sequence++;
 	transaction->t_expires = jiffies + journal->j_commit_interval;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	transaction->t_start = jiffies;
+#endif
 	spin_lock_init(&transaction->t_handle_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	INIT_LIST_HEAD(&transaction->t_inode_list);
+#endif
 
 	/* Set up the commit timer for the new transaction. */
 	journal->j_commit_timer.expires =
@@ -61,11 +70,48 @@ get_transaction(journal_t *journal, transaction_t *transaction)
 	add_timer(&journal->j_commit_timer);
 
 	J_ASSERT(journal->j_running_transaction == NULL);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/* publish an initialized transaction to start_this_handle_fast() */
+	smp_wmb();
+#endif
 	journal->j_running_transaction = transaction;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_start_transaction(journal, transaction);
+#endif
 
 	return transaction;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE) && defined(CONFIG_JBD_DEBUG)
+/*
+ * Add the snapshot COW counters of a handle to the stats of its
+ * transaction and reset them, so that the COW operations of a restarted
+ * handle are accounted to the transaction they were journaled in.
+ *
+ * Called under t_handle_lock
+ */
+static void journal_stats_cow(transaction_t *transaction, handle_t *handle)
+{
+	struct transaction_cow_stats_s *cs = &transaction->t_cow_stats;
+
+	cs->cs_moved += handle->h_cow_moved;
+	cs->cs_copied += handle->h_cow_copied;
+	cs->cs_ok_jh += handle->h_cow_ok_jh;
+	cs->cs_ok_bitmap += handle->h_cow_ok_bitmap;
+	cs->cs_ok_mapped += handle->h_cow_ok_mapped;
+	cs->cs_bitmaps += handle->h_cow_bitmaps;
+	cs->cs_excluded += handle->h_cow_excluded;
+	handle->h_cow_moved = handle->h_cow_copied = 0;
+	handle->h_cow_ok_jh = handle->h_cow_ok_bitmap = 0;
+	handle->h_cow_ok_mapped = handle->h_cow_bitmaps = 0;
+	handle->h_cow_excluded = 0;
+}
+#else
+#define journal_stats_cow(transaction, handle)
+#endif
+#endif
+
 /*
  * Handle management.
  *
@@ -81,6 +127,75 @@ get_transaction(journal_t *journal, transaction_t *transaction)
  * transaction's buffer credits.
  */
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+/*
+ * Drop an update that was taken on a transaction without j_state_lock
+ * and wake up whoever is waiting for the updates to drain.
+ */
+static void journal_put_update(journal_t *journal, transaction_t *transaction)
+{
+	if (atomic_dec_and_test(&transaction->t_updates)) {
+		wake_up(&journal->j_wait_updates);
+		if (journal->j_barrier_count)
+			wake_up(&journal->j_wait_transaction_locked);
+	}
+}
+
+/*
+ * start_this_handle_fast: attach a handle to the running transaction
+ * without taking j_state_lock.  This is the common case: there is a
+ * running transaction which is not locked down for commit, it has room
+ * for the handle credits and there is enough space in the log.
+ *
+ * The update is taken before the transaction state is checked, so that
+ * either the commit code sees our update when it locks the transaction
+ * down, or we see T_LOCKED and back off.  The same goes for
+ * journal_lock_updates() and j_barrier_count.  Transactions are freed by
+ * RCU, so the transaction cannot go away under us.
+ *
+ * Return 1 if the handle was attached, 0 to take the slow path.
+ */
+static int start_this_handle_fast(journal_t *journal, handle_t *handle)
+{
+	transaction_t *transaction;
+	int nblocks = handle->h_buffer_credits;
+	int needed;
+
+	rcu_read_lock();
+	transaction = rcu_dereference(journal->j_running_transaction);
+	if (!transaction || journal->j_barrier_count ||
+	    is_journal_aborted(journal) || journal->j_errno != 0)
+		goto out;
+
+	atomic_inc(&transaction->t_updates);
+	smp_mb__after_atomic_inc();
+	if (transaction->t_state != T_RUNNING || journal->j_barrier_count)
+		goto put_update;
+
+	needed = atomic_add_return(nblocks,
+				   &transaction->t_outstanding_credits);
+	if (needed > journal->j_max_transaction_buffers)
+		goto put_credits;
+	if (log_space_left_nolock(journal) < jbd_space_needed(journal))
+		goto put_credits;
+
+	atomic_inc(&transaction->t_handle_count);
+	handle->h_transaction = transaction;
+	rcu_read_unlock();
+	jbd_debug(4, "Handle %p given %d credits (total %d)\n",
+		  handle, nblocks, needed);
+	return 1;
+
+put_credits:
+	atomic_sub(nblocks, &transaction->t_outstanding_credits);
+put_update:
+	journal_put_update(journal, transaction);
+out:
+	rcu_read_unlock();
+	return 0;
+}
+
+#endif
 static int start_this_handle(journal_t *journal, handle_t *handle)
 {
 	transaction_t *transaction;
@@ -88,6 +203,9 @@ static int start_this_handle(journal_t *journal, handle_t *handle)
 	int nblocks = handle->h_buffer_credits;
 	transaction_t *new_transaction = NULL;
 	int ret = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	unsigned long ts = jiffies;
+#endif
 
 	if (nblocks > journal->j_max_transaction_buffers) {
 		printk(KERN_ERR "JBD: %s wants too many credits (%d > %d)\n",
@@ -96,7 +214,19 @@ static int start_this_handle(journal_t *journal, handle_t *handle)
 		ret = -ENOSPC;
 		goto out;
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
 
+	/* allocate journal_heads for the handle before it goes live */
+	journal_fill_jh_reserve(journal, nblocks);
+#endif
+
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	if (start_this_handle_fast(journal, handle)) {
+		lock_map_acquire(&handle->h_lockdep_map);
+		goto out;
+	}
+
+#endif
 alloc_transaction:
 	if (!journal->j_running_transaction) {
 		new_transaction = kzalloc(sizeof(*new_transaction),
@@ -164,7 +294,16 @@ repeat_locked:
 	 * checkpoint to free some more log space.
 	 */
 	spin_lock(&transaction->t_handle_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/*
+	 * Reserve the credits right away, so handles that are started
+	 * concurrently by start_this_handle_fast() see them.
+	 */
+	needed = atomic_add_return(nblocks,
+				   &transaction->t_outstanding_credits);
+#else
 	needed = transaction->t_outstanding_credits + nblocks;
+#endif
 
 	if (needed > journal->j_max_transaction_buffers) {
 		/*
@@ -175,6 +314,9 @@ repeat_locked:
 		DEFINE_WAIT(wait);
 
 		jbd_debug(2, "Handle %p starting new commit...\n", handle);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		atomic_sub(nblocks, &transaction->t_outstanding_credits);
+#endif
 		spin_unlock(&transaction->t_handle_lock);
 		prepare_to_wait(&journal->j_wait_transaction_locked, &wait,
 				TASK_UNINTERRUPTIBLE);
@@ -212,6 +354,9 @@ repeat_locked:
 	 */
 	if (__log_space_left(journal) < jbd_space_needed(journal)) {
 		jbd_debug(2, "Handle %p waiting for checkpoint...\n", handle);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		atomic_sub(nblocks, &transaction->t_outstanding_credits);
+#endif
 		spin_unlock(&transaction->t_handle_lock);
 		__log_wait_for_space(journal);
 		goto repeat_locked;
@@ -220,13 +365,30 @@ repeat_locked:
 	/* OK, account for the buffers that this operation expects to
 	 * use and add the handle to the running transaction. */
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	if (time_after(transaction->t_start, ts)) {
+		ts = jbd_time_diff(ts, transaction->t_start);
+		if (ts > transaction->t_max_wait)
+			transaction->t_max_wait = ts;
+	}
+
+#endif
 	handle->h_transaction = transaction;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	atomic_inc(&transaction->t_updates);
+	atomic_inc(&transaction->t_handle_count);
+	jbd_debug(4, "Handle %p given %d credits (total %d, free %d)\n",
+		  handle, nblocks,
+		  atomic_read(&transaction->t_outstanding_credits),
+		  __log_space_left(journal));
+#else
 	transaction->t_outstanding_credits += nblocks;
 	transaction->t_updates++;
 	transaction->t_handle_count++;
 	jbd_debug(4, "Handle %p given %d credits (total %d, free %d)\n",
 		  handle, nblocks, transaction->t_outstanding_credits,
 		  __log_space_left(journal));
+#endif
 	spin_unlock(&transaction->t_handle_lock);
 	spin_unlock(&journal->j_state_lock);
 
@@ -288,6 +450,10 @@ handle_t *journal_start(journal_t *journal, int nblocks)
 
 	current->journal_info = handle;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	/* the transaction is not known yet */
+	trace_jbd_handle_enter(journal, 0, nblocks, 0);
+#endif
 	err = start_this_handle(journal, handle);
 	if (err < 0) {
 		jbd_free_handle(handle);
@@ -295,6 +461,10 @@ handle_t *journal_start(journal_t *journal, int nblocks)
 		handle = ERR_PTR(err);
 		goto out;
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_handle_start(journal, handle->h_transaction->t_tid,
+			       nblocks, 0);
+#endif
 out:
 	return handle;
 }
@@ -342,22 +512,35 @@ int journal_extend(handle_t *handle, int nblocks)
 	}
 
 	spin_lock(&transaction->t_handle_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	wanted = atomic_add_return(nblocks,
+				   &transaction->t_outstanding_credits);
+#else
 	wanted = transaction->t_outstanding_credits + nblocks;
+#endif
 
 	if (wanted > journal->j_max_transaction_buffers) {
 		jbd_debug(3, "denied handle %p %d blocks: "
 			  "transaction too large\n", handle, nblocks);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		atomic_sub(nblocks, &transaction->t_outstanding_credits);
+#endif
 		goto unlock;
 	}
 
 	if (wanted > __log_space_left(journal)) {
 		jbd_debug(3, "denied handle %p %d blocks: "
 			  "insufficient log space\n", handle, nblocks);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		atomic_sub(nblocks, &transaction->t_outstanding_credits);
+#endif
 		goto unlock;
 	}
 
 	handle->h_buffer_credits += nblocks;
+#ifndef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
 	transaction->t_outstanding_credits += nblocks;
+#endif
 	result = 0;
 
 	jbd_debug(3, "extended handle %p by %d\n", handle, nblocks);
@@ -369,6 +552,57 @@ out:
 	return result;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+/**
+ * int journal_draw_credits() - draw buffer credits from transaction pool.
+ * @handle:  handle to add credits to
+ * @nblocks: nr blocks to draw
+ *
+ * Move @nblocks buffer credits from the shared credits pool of the
+ * transaction to @handle.  The credits were already reserved in the
+ * transaction, so unlike journal_extend(), this may be called after
+ * the transaction was locked down for commit.
+ *
+ * Return 0 on success, 1 if the pool does not have enough credits.
+ */
+int journal_draw_credits(handle_t *handle, int nblocks)
+{
+	transaction_t *transaction = handle->h_transaction;
+	int result = 1;
+
+	spin_lock(&transaction->t_handle_lock);
+	if (transaction->t_cow_credits >= nblocks) {
+		transaction->t_cow_credits -= nblocks;
+		handle->h_buffer_credits += nblocks;
+		result = 0;
+	}
+	spin_unlock(&transaction->t_handle_lock);
+	jbd_debug(3, "handle %p drew %d pool blocks: %s\n", handle, nblocks,
+		  result ? "denied" : "ok");
+	return result;
+}
+
+/**
+ * void journal_fill_credits() - give buffer credits to transaction pool.
+ * @handle:  handle to take credits from
+ * @nblocks: nr blocks to give
+ *
+ * Move @nblocks of the buffer credits reserved by @handle to the shared
+ * credits pool of the transaction.  Unused pool credits are released
+ * when the transaction is committed.
+ */
+void journal_fill_credits(handle_t *handle, int nblocks)
+{
+	transaction_t *transaction = handle->h_transaction;
+
+	J_ASSERT(handle->h_buffer_credits >= nblocks);
+	spin_lock(&transaction->t_handle_lock);
+	handle->h_buffer_credits -= nblocks;
+	transaction->t_cow_credits += nblocks;
+	spin_unlock(&transaction->t_handle_lock);
+}
+#endif
+
 
 /**
  * int journal_restart() - restart a handle.
@@ -390,6 +624,9 @@ int journal_restart(handle_t *handle, int nblocks)
 	transaction_t *transaction = handle->h_transaction;
 	journal_t *journal = transaction->t_journal;
 	int ret;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	tid_t tid;
+#endif
 
 	/* If we've had an abort of any type, don't even think about
 	 * actually doing the restart! */
@@ -400,6 +637,26 @@ int journal_restart(handle_t *handle, int nblocks)
 	 * First unlink the handle from its current transaction, and start the
 	 * commit on that.
 	 */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	J_ASSERT(atomic_read(&transaction->t_updates) > 0);
+	J_ASSERT(journal_current_handle() == handle);
+
+	tid = transaction->t_tid;
+	atomic_sub(handle->h_buffer_credits,
+		   &transaction->t_outstanding_credits);
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS) && \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE) && \
+	defined(CONFIG_JBD_DEBUG)
+	spin_lock(&transaction->t_handle_lock);
+	journal_stats_cow(transaction, handle);
+	spin_unlock(&transaction->t_handle_lock);
+#endif
+	/* the transaction may be committed and freed after this */
+	journal_put_update(journal, transaction);
+
+	jbd_debug(2, "restarting handle %p\n", handle);
+	log_start_commit(journal, tid);
+#else
 	J_ASSERT(transaction->t_updates > 0);
 	J_ASSERT(journal_current_handle() == handle);
 
@@ -407,6 +664,9 @@ int journal_restart(handle_t *handle, int nblocks)
 	spin_lock(&transaction->t_handle_lock);
 	transaction->t_outstanding_credits -= handle->h_buffer_credits;
 	transaction->t_updates--;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	journal_stats_cow(transaction, handle);
+#endif
 
 	if (!transaction->t_updates)
 		wake_up(&journal->j_wait_updates);
@@ -415,6 +675,7 @@ int journal_restart(handle_t *handle, int nblocks)
 	jbd_debug(2, "restarting handle %p\n", handle);
 	__log_start_commit(journal, transaction->t_tid);
 	spin_unlock(&journal->j_state_lock);
+#endif
 
 	lock_map_release(&handle->h_lockdep_map);
 	handle->h_buffer_credits = nblocks;
@@ -439,6 +700,10 @@ void journal_lock_updates(journal_t *journal)
 
 	spin_lock(&journal->j_state_lock);
 	++journal->j_barrier_count;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/* pairs with the barrier in start_this_handle_fast() */
+	smp_mb();
+#endif
 
 	/* Wait until there are no running updates */
 	while (1) {
@@ -447,6 +712,18 @@ void journal_lock_updates(journal_t *journal)
 		if (!transaction)
 			break;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		/*
+		 * Updates are dropped without j_state_lock, so get on the
+		 * wait queue before checking for them.
+		 */
+		prepare_to_wait(&journal->j_wait_updates, &wait,
+				TASK_UNINTERRUPTIBLE);
+		if (!atomic_read(&transaction->t_updates)) {
+			finish_wait(&journal->j_wait_updates, &wait);
+			break;
+		}
+#else
 		spin_lock(&transaction->t_handle_lock);
 		if (!transaction->t_updates) {
 			spin_unlock(&transaction->t_handle_lock);
@@ -455,6 +732,7 @@ void journal_lock_updates(journal_t *journal)
 		prepare_to_wait(&journal->j_wait_updates, &wait,
 				TASK_UNINTERRUPTIBLE);
 		spin_unlock(&transaction->t_handle_lock);
+#endif
 		spin_unlock(&journal->j_state_lock);
 		schedule();
 		finish_wait(&journal->j_wait_updates, &wait);
@@ -665,6 +943,13 @@ repeat:
 		if (jh->b_jlist != BJ_Forget || force_copy) {
 			JBUFFER_TRACE(jh, "generate frozen data");
 			if (!frozen_buffer) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+				/* reuse a copy freed by an earlier commit */
+				frozen_buffer = journal_get_frozen(journal,
+							jh2bh(jh)->b_size);
+			}
+			if (!frozen_buffer) {
+#endif
 				JBUFFER_TRACE(jh, "allocate memory for buffer");
 				jbd_unlock_bh_state(bh);
 				frozen_buffer =
@@ -728,7 +1013,11 @@ done:
 
 out:
 	if (unlikely(frozen_buffer))	/* It's usually NULL */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+		journal_free_frozen(journal, frozen_buffer, bh->b_size);
+#else
 		jbd_free(frozen_buffer, bh->b_size);
+#endif
 
 	JBUFFER_TRACE(jh, "exit");
 	return error;
@@ -747,7 +1036,12 @@ out:
 
 int journal_get_write_access(handle_t *handle, struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	struct journal_head *jh = __journal_add_journal_head(
+			handle->h_transaction->t_journal, bh);
+#else
 	struct journal_head *jh = journal_add_journal_head(bh);
+#endif
 	int rc;
 
 	/* We do not want to get caught playing with fields which the
@@ -782,7 +1076,11 @@ int journal_get_create_access(handle_t *handle, struct buffer_head *bh)
 {
 	transaction_t *transaction = handle->h_transaction;
 	journal_t *journal = transaction->t_journal;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	struct journal_head *jh = __journal_add_journal_head(journal, bh);
+#else
 	struct journal_head *jh = journal_add_journal_head(bh);
+#endif
 	int err;
 
 	jbd_debug(5, "journal_head %p\n", jh);
@@ -878,7 +1176,12 @@ out:
 int journal_get_undo_access(handle_t *handle, struct buffer_head *bh)
 {
 	int err;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	struct journal_head *jh = __journal_add_journal_head(
+			handle->h_transaction->t_journal, bh);
+#else
 	struct journal_head *jh = journal_add_journal_head(bh);
+#endif
 	char *committed_data = NULL;
 
 	JBUFFER_TRACE(jh, "entry");
@@ -894,7 +1197,13 @@ int journal_get_undo_access(handle_t *handle, struct buffer_head *bh)
 
 repeat:
 	if (!jh->b_committed_data) {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+		committed_data = journal_alloc_frozen(
+				handle->h_transaction->t_journal,
+				jh2bh(jh)->b_size, GFP_NOFS);
+#else
 		committed_data = jbd_alloc(jh2bh(jh)->b_size, GFP_NOFS);
+#endif
 		if (!committed_data) {
 			printk(KERN_EMERG "%s: No memory for committed data\n",
 				__func__);
@@ -921,7 +1230,12 @@ repeat:
 out:
 	journal_put_journal_head(jh);
 	if (unlikely(committed_data))
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+		journal_free_frozen(handle->h_transaction->t_journal,
+				    committed_data, bh->b_size);
+#else
 		jbd_free(committed_data, bh->b_size);
+#endif
 	return err;
 }
 
@@ -952,7 +1266,11 @@ int journal_dirty_data(handle_t *handle, struct buffer_head *bh)
 	if (is_handle_aborted(handle))
 		return ret;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+	jh = __journal_add_journal_head(journal, bh);
+#else
 	jh = journal_add_journal_head(bh);
+#endif
 	JBUFFER_TRACE(jh, "entry");
 
 	/*
@@ -1372,7 +1690,11 @@ int journal_stop(handle_t *handle)
 	if (is_handle_aborted(handle))
 		err = -EIO;
 	else {
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+		J_ASSERT(atomic_read(&transaction->t_updates) > 0);
+#else
 		J_ASSERT(transaction->t_updates > 0);
+#endif
 		err = 0;
 	}
 
@@ -1383,6 +1705,10 @@ int journal_stop(handle_t *handle)
 	}
 
 	jbd_debug(4, "Handle %p going down\n", handle);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_TRACE_EVENTS
+	trace_jbd_handle_stop(journal, transaction->t_tid,
+			      handle->h_buffer_credits, handle->h_sync);
+#endif
 
 	/*
 	 * Implement synchronous transaction batching.  If the handle
@@ -1436,10 +1762,59 @@ int journal_stop(handle_t *handle)
 	if (handle->h_sync)
 		transaction->t_synchronous_commit = 1;
 	current->journal_info = NULL;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	{
+		tid_t tid = transaction->t_tid;
+		int credits;
+		int need_commit;
+
+		credits = atomic_sub_return(handle->h_buffer_credits,
+					    &transaction->t_outstanding_credits);
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS) && \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE) && \
+	defined(CONFIG_JBD_DEBUG)
+		spin_lock(&transaction->t_handle_lock);
+		journal_stats_cow(transaction, handle);
+		spin_unlock(&transaction->t_handle_lock);
+#endif
+		/*
+		 * If the handle is marked SYNC, we need to set another commit
+		 * going!  We also want to force a commit if the current
+		 * transaction is occupying too much of the log, or if the
+		 * transaction is too old now.  Decide before dropping our
+		 * update, after which the transaction may be committed and
+		 * freed.
+		 */
+		need_commit = handle->h_sync ||
+			credits > journal->j_max_transaction_buffers ||
+			time_after_eq(jiffies, transaction->t_expires);
+		journal_put_update(journal, transaction);
+
+		if (need_commit) {
+			/* Do this even for aborted journals: an abort still
+			 * completes the commit thread, it just doesn't write
+			 * anything to disk. */
+			jbd_debug(2, "transaction too old, requesting commit "
+				  "for handle %p\n", handle);
+			/* This is non-blocking */
+			log_start_commit(journal, tid);
+
+			/*
+			 * Special case: JFS_SYNC synchronous updates require
+			 * us to wait for the commit to complete.
+			 */
+			if (handle->h_sync && !(current->flags & PF_MEMALLOC))
+				err = log_wait_commit(journal, tid);
+		}
+	}
+#else
 	spin_lock(&journal->j_state_lock);
 	spin_lock(&transaction->t_handle_lock);
 	transaction->t_outstanding_credits -= handle->h_buffer_credits;
 	transaction->t_updates--;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+	journal_stats_cow(transaction, handle);
+#endif
 	if (!transaction->t_updates) {
 		wake_up(&journal->j_wait_updates);
 		if (journal->j_barrier_count)
@@ -1478,6 +1853,7 @@ int journal_stop(handle_t *handle)
 		spin_unlock(&transaction->t_handle_lock);
 		spin_unlock(&journal->j_state_lock);
 	}
+#endif
 
 	lock_map_release(&handle->h_lockdep_map);
 
@@ -1485,6 +1861,105 @@ int journal_stop(handle_t *handle)
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+/**
+ * int journal_file_inode() - file the dirty data of an inode
+ * @handle: transaction handle
+ * @jinode: the inode
+ * @start: first byte of the dirty data
+ * @len: length of the dirty data
+ *
+ * The data in [@start, @start + @len) is written out before the
+ * transaction of @handle commits.  This is the inode based alternative
+ * to journal_dirty_data().  If the inode is on the committing transaction,
+ * it is moved to the transaction of @handle after that commit.
+ */
+int journal_file_inode(handle_t *handle, struct jbd_inode *jinode,
+		       loff_t start, loff_t len)
+{
+	transaction_t *transaction = handle->h_transaction;
+	journal_t *journal = transaction->t_journal;
+	loff_t end = start + len;
+
+	if (is_handle_aborted(handle))
+		return -EIO;
+
+	jbd_debug(4, "Adding inode %lu, tid:%d\n", jinode->i_vfs_inode->i_ino,
+			transaction->t_tid);
+
+	spin_lock(&journal->j_list_lock);
+	if (jinode->i_dirty_end) {
+		jinode->i_dirty_start = min(jinode->i_dirty_start, start);
+		jinode->i_dirty_end = max(jinode->i_dirty_end, end);
+	} else {
+		jinode->i_dirty_start = start;
+		jinode->i_dirty_end = end;
+	}
+
+	if (jinode->i_transaction == transaction ||
+	    jinode->i_next_transaction == transaction)
+		goto done;
+
+	/* On some different transaction's list - should be the committing one */
+	if (jinode->i_transaction) {
+		J_ASSERT(jinode->i_next_transaction == NULL);
+		J_ASSERT(jinode->i_transaction ==
+					journal->j_committing_transaction);
+		jinode->i_next_transaction = transaction;
+		goto done;
+	}
+	/* Not on any transaction list... */
+	J_ASSERT(!jinode->i_next_transaction);
+	jinode->i_transaction = transaction;
+	list_add(&jinode->i_list, &transaction->t_inode_list);
+done:
+	spin_unlock(&journal->j_list_lock);
+	return 0;
+}
+
+/**
+ * int journal_begin_ordered_truncate() - order truncate with commit
+ * @journal: journal of the inode
+ * @jinode: the inode
+ * @new_size: the size the inode is truncated to
+ *
+ * The page cache beyond @new_size is dropped by the truncate, and then
+ * commit cannot write it out anymore.  If the transaction that has to
+ * write out the inode data is committing, start the writeout of the data
+ * beyond @new_size now, so the committing transaction does not expose the
+ * blocks allocated for it.
+ */
+int journal_begin_ordered_truncate(journal_t *journal,
+				   struct jbd_inode *jinode, loff_t new_size)
+{
+	transaction_t *inode_trans, *commit_trans;
+	int ret = 0;
+
+	/* This is a quick check to avoid locking if not necessary */
+	if (!jinode->i_transaction)
+		goto out;
+	/*
+	 * Locks are here just to force reading of recent values, it is
+	 * enough that the transaction was not committing before we started
+	 * a transaction adding the inode to orphan list.
+	 */
+	spin_lock(&journal->j_state_lock);
+	commit_trans = journal->j_committing_transaction;
+	spin_unlock(&journal->j_state_lock);
+	spin_lock(&journal->j_list_lock);
+	inode_trans = jinode->i_transaction;
+	spin_unlock(&journal->j_list_lock);
+	if (inode_trans == commit_trans) {
+		ret = filemap_fdatawrite_range(jinode->i_vfs_inode->i_mapping,
+			new_size, LLONG_MAX);
+		if (ret)
+			journal_abort(journal, ret);
+	}
+out:
+	return ret;
+}
+#endif
+
 /**
  * int journal_force_commit() - force any uncommitted transactions
  * @journal: journal to force
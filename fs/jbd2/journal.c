@@ -41,6 +41,8 @@
 #include <linux/hash.h>
 #include <linux/log2.h>
 #include <linux/vmalloc.h>
+#include <linux/crc32.h>
+#include <linux/blkdev.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/jbd2.h>
@@ -1026,6 +1028,14 @@ static int journal_reset(journal_t *journal)
 
 	first = be32_to_cpu(sb->s_first);
 	last = be32_to_cpu(sb->s_maxlen);
+	/* The fast commit area at the end of the journal is not log */
+	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_FAST_COMMIT)) {
+		journal->j_fc_last = last;
+		last -= be32_to_cpu(sb->s_fc_blocks);
+		journal->j_fc_first = last;
+		journal->j_fc_off = 0;
+	}
 	if (first + JBD2_MIN_JOURNAL_BLOCKS > last + 1) {
 		printk(KERN_ERR "JBD: Journal too short (blocks %llu-%llu).\n",
 		       first, last);
@@ -1214,6 +1224,21 @@ static int load_superblock(journal_t *journal)
 	journal->j_last = be32_to_cpu(sb->s_maxlen);
 	journal->j_errno = be32_to_cpu(sb->s_errno);
 
+	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_FAST_COMMIT)) {
+		unsigned long nfc = be32_to_cpu(sb->s_fc_blocks);
+
+		if (!nfc || nfc >= journal->j_last - journal->j_first) {
+			printk(KERN_WARNING "JBD: Invalid fast commit area "
+			       "size %lu\n", nfc);
+			return -EINVAL;
+		}
+		journal->j_fc_last = journal->j_last;
+		journal->j_last -= nfc;
+		journal->j_fc_first = journal->j_last;
+		journal->j_fc_off = 0;
+	}
+
 	return 0;
 }
 
@@ -1475,6 +1500,173 @@ void jbd2_journal_clear_features(journal_t *journal, unsigned long compat,
 }
 EXPORT_SYMBOL(jbd2_journal_clear_features);
 
+/**
+ * int jbd2_fc_init() - Reserve a fast commit area at the end of the journal
+ * @journal: Journal to act on.
+ * @nblocks: Size of the fast commit area in blocks.
+ *
+ * The fast commit area is taken from the end of the log, so it can only be
+ * reserved while the log is empty, right after the journal is loaded.  The
+ * area is kept on the following loads of the journal.
+ */
+int jbd2_fc_init(journal_t *journal, unsigned int nblocks)
+{
+	journal_superblock_t *sb = journal->j_superblock;
+	int err = 0;
+
+	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_FAST_COMMIT))
+		return 0;
+	if (!jbd2_journal_check_available_features(journal, 0, 0,
+				JBD2_FEATURE_INCOMPAT_FAST_COMMIT))
+		return -EINVAL;
+
+	spin_lock(&journal->j_state_lock);
+	if (journal->j_head != journal->j_tail ||
+	    journal->j_free != journal->j_last - journal->j_first ||
+	    journal->j_committing_transaction ||
+	    journal->j_checkpoint_transactions) {
+		err = -EBUSY;
+	} else if (journal->j_first + JBD2_MIN_JOURNAL_BLOCKS + nblocks >
+		   journal->j_last) {
+		err = -ENOSPC;
+	} else {
+		journal->j_fc_last = journal->j_last;
+		journal->j_last -= nblocks;
+		journal->j_fc_first = journal->j_last;
+		journal->j_fc_off = 0;
+		journal->j_free -= nblocks;
+		sb->s_fc_blocks = cpu_to_be32(nblocks);
+		sb->s_feature_incompat |=
+			cpu_to_be32(JBD2_FEATURE_INCOMPAT_FAST_COMMIT);
+	}
+	spin_unlock(&journal->j_state_lock);
+	if (err)
+		return err;
+
+	/*
+	 * Fast commits are only used once the superblock with the feature
+	 * is on disk.  If the journal is clean, the first commit writes it.
+	 */
+	jbd2_journal_update_superblock(journal, 1);
+	return 0;
+}
+EXPORT_SYMBOL(jbd2_fc_init);
+
+/**
+ * struct buffer_head *jbd2_fc_get_buf() - Get a block of fast commit area
+ * @journal: Journal to act on.
+ * @tid: The running transaction ID.
+ *
+ * Returns the next block of the fast commit area, locked and with the fast
+ * commit header filled in, or an ERR_PTR.  The block must be written with
+ * jbd2_fc_write_buf().
+ *
+ * Only the running transaction may use the fast commit area and only while
+ * no transaction is committing, so the fast commit blocks apply on top of
+ * the last committed transaction.  The area is reused by the next
+ * transaction, once the running transaction has committed.
+ */
+struct buffer_head *jbd2_fc_get_buf(journal_t *journal, tid_t tid)
+{
+	struct buffer_head *bh;
+	jbd2_fc_header_t *fc;
+	unsigned long long blocknr;
+	unsigned long off;
+	int err;
+
+	spin_lock(&journal->j_state_lock);
+	if (!JBD2_HAS_INCOMPAT_FEATURE(journal,
+				       JBD2_FEATURE_INCOMPAT_FAST_COMMIT) ||
+	    (journal->j_flags & (JBD2_ABORT | JBD2_FLUSHED)) ||
+	    !journal->j_running_transaction ||
+	    journal->j_running_transaction->t_tid != tid ||
+	    journal->j_committing_transaction) {
+		spin_unlock(&journal->j_state_lock);
+		return ERR_PTR(-EAGAIN);
+	}
+	if (journal->j_fc_tid != tid) {
+		journal->j_fc_tid = tid;
+		journal->j_fc_off = 0;
+	}
+	if (journal->j_fc_first + journal->j_fc_off >= journal->j_fc_last) {
+		spin_unlock(&journal->j_state_lock);
+		return ERR_PTR(-ENOSPC);
+	}
+	off = journal->j_fc_off++;
+	spin_unlock(&journal->j_state_lock);
+
+	err = jbd2_journal_bmap(journal, journal->j_fc_first + off, &blocknr);
+	if (err)
+		return ERR_PTR(err);
+	bh = __getblk(journal->j_dev, blocknr, journal->j_blocksize);
+	if (!bh)
+		return ERR_PTR(-ENOMEM);
+
+	/* a stale fast commit of the previous transaction may be in flight */
+	lock_buffer(bh);
+	memset(bh->b_data, 0, journal->j_blocksize);
+	fc = (jbd2_fc_header_t *)bh->b_data;
+	fc->fc_header.h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+	fc->fc_header.h_blocktype = cpu_to_be32(JBD2_FC_BLOCK);
+	fc->fc_header.h_sequence = cpu_to_be32(tid);
+	fc->fc_index = cpu_to_be32(off);
+	return bh;
+}
+EXPORT_SYMBOL(jbd2_fc_get_buf);
+
+/**
+ * int jbd2_fc_write_buf() - Write a fast commit block and wait
+ * @journal: Journal to act on.
+ * @bh: Block returned by jbd2_fc_get_buf().
+ * @len: Count of bytes used in the block, including the header.
+ *
+ * The file data the fast commit refers to has already been written by the
+ * caller.  It is flushed to stable storage before the fast commit block is
+ * written, so a replayed fast commit never exposes stale blocks.
+ *
+ * Returns 0 only if the fast commit block is durable.  On error, the block
+ * is released and the caller must fall back to a full commit.
+ */
+int jbd2_fc_write_buf(journal_t *journal, struct buffer_head *bh,
+		      unsigned int len)
+{
+	jbd2_fc_header_t *fc = (jbd2_fc_header_t *)bh->b_data;
+	int ret = 0;
+
+	J_ASSERT_BH(bh, buffer_locked(bh));
+	J_ASSERT(len >= sizeof(*fc) && len <= journal->j_blocksize);
+	fc->fc_len = cpu_to_be32(len);
+	fc->fc_checksum = cpu_to_be32(crc32_be(~0, (void *)bh->b_data, len));
+
+	if (journal->j_flags & JBD2_BARRIER)
+		ret = blkdev_issue_flush(journal->j_fs_dev, GFP_KERNEL, NULL,
+					 BLKDEV_IFL_WAIT);
+	/* a device with no cache to flush is as good as a flushed one */
+	if (ret && ret != -EOPNOTSUPP) {
+		unlock_buffer(bh);
+		brelse(bh);
+		return ret;
+	}
+	ret = 0;
+	clear_buffer_dirty(bh);
+	set_buffer_uptodate(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(WRITE_SYNC, bh);
+	wait_on_buffer(bh);
+	if (unlikely(!buffer_uptodate(bh)))
+		ret = -EIO;
+	else if (journal->j_flags & JBD2_BARRIER)
+		ret = blkdev_issue_flush(journal->j_dev, GFP_KERNEL, NULL,
+					 BLKDEV_IFL_WAIT);
+	if (ret == -EOPNOTSUPP)
+		ret = 0;
+	brelse(bh);
+	return ret;
+}
+EXPORT_SYMBOL(jbd2_fc_write_buf);
+
 /**
  * int jbd2_journal_update_format () - Update on-disk journal structure.
  * @journal: Journal to act on.
@@ -202,6 +202,51 @@ static int count_tags(journal_t *journal, struct buffer_head *bh)
 	return nr;
 }
 
+/*
+ * Replay the fast commit blocks of the transaction that did not commit, in
+ * the order they were written.  Fast commits are written concurrently, so
+ * a missing block does not end the area.  Stale blocks of older
+ * transactions fail the sequence test and torn blocks fail the checksum.
+ */
+static int fc_do_replay(journal_t *journal, tid_t tid)
+{
+	struct buffer_head *bh;
+	jbd2_fc_header_t *fc;
+	unsigned long i, n = journal->j_fc_last - journal->j_fc_first;
+	unsigned int len;
+	__be32 crc;
+	int err = 0, nr_replays = 0;
+
+	for (i = 0; i < n && !err; i++) {
+		err = jread(&bh, journal, journal->j_fc_first + i);
+		if (err)
+			break;
+		fc = (jbd2_fc_header_t *)bh->b_data;
+		len = be32_to_cpu(fc->fc_len);
+		if (fc->fc_header.h_magic != cpu_to_be32(JBD2_MAGIC_NUMBER) ||
+		    fc->fc_header.h_blocktype != cpu_to_be32(JBD2_FC_BLOCK) ||
+		    be32_to_cpu(fc->fc_header.h_sequence) != tid ||
+		    be32_to_cpu(fc->fc_index) != i ||
+		    len < sizeof(*fc) || len > journal->j_blocksize) {
+			brelse(bh);
+			continue;
+		}
+		crc = fc->fc_checksum;
+		fc->fc_checksum = 0;
+		if (crc32_be(~0, (void *)bh->b_data, len) == be32_to_cpu(crc)) {
+			fc->fc_checksum = crc;
+			err = journal->j_fc_replay(journal, bh);
+			nr_replays++;
+		} else
+			fc->fc_checksum = crc;
+		brelse(bh);
+	}
+
+	jbd_debug(1, "JBD: Replayed %d fast commit blocks of transaction %u\n",
+		  nr_replays, tid);
+	return err;
+}
+
 
 /* Make sure we wrap around the log correctly! */
 #define wrap(journal, var)						\
@@ -257,6 +302,19 @@ int jbd2_journal_recover(journal_t *journal)
 	jbd_debug(1, "JBD: Replayed %d and revoked %d/%d blocks\n",
 		  info.nr_replays, info.nr_revoke_hits, info.nr_revokes);
 
+	/*
+	 * Fast commits of the transaction after the last committed one are
+	 * replayed on top of the recovered log.
+	 */
+	if (!err && JBD2_HAS_INCOMPAT_FEATURE(journal,
+					JBD2_FEATURE_INCOMPAT_FAST_COMMIT)) {
+		if (journal->j_fc_replay)
+			err = fc_do_replay(journal, info.end_transaction);
+		else
+			printk(KERN_WARNING "JBD: fast commit blocks not "
+			       "replayed\n");
+	}
+
 	/* Restart the log at the next transaction ID, thus invalidating
 	 * any existing commit records in the log. */
 	journal->j_transaction_sequence = ++info.end_transaction;
@@ -23,6 +23,9 @@
 #include "next3_jbd.h"
 #include <linux/quotaops.h>
 #include <linux/buffer_head.h>
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+#include <linux/sort.h>
+#endif
 #include "snapshot.h"
 
 /*
@@ -95,6 +98,12 @@ static int next3_valid_block_bitmap(struct super_block *sb,
 	next3_fsblk_t bitmap_blk;
 	next3_fsblk_t group_first_block;
 
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	if (NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_FLEX_BG))
+		/* with flex_bg, group metadata may be in another group */
+		return 1;
+
+#endif
 	group_first_block = next3_group_first_block_no(sb, block_group);
 
 	/* check whether block bitmap block number is set */
@@ -129,6 +138,251 @@ err_out:
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+/*
+ * next3_flex_group_range() returns in [*first, *last] the groups whose
+ * metadata may be packed into the block group of @block.  mke2fs packs the
+ * metadata of a flex group into its first groups, so these are the groups
+ * of the flex group of @block, or just its own group without flex_bg.
+ * Returns 0 if @block is not a valid data block.
+ */
+static int next3_flex_group_range(struct super_block *sb,
+		next3_fsblk_t block, unsigned long *first, unsigned long *last)
+{
+	struct next3_super_block *es = NEXT3_SB(sb)->s_es;
+	unsigned int log = es->s_log_groups_per_flex;
+	unsigned long group;
+
+	if (block < le32_to_cpu(es->s_first_data_block) ||
+	    block >= le32_to_cpu(es->s_blocks_count))
+		return 0;
+	group = (block - le32_to_cpu(es->s_first_data_block)) /
+		NEXT3_BLOCKS_PER_GROUP(sb);
+	*first = *last = group;
+	if (!NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_FLEX_BG) ||
+	    !log || log >= 32)
+		return 1;
+	*first = group & ~((1UL << log) - 1);
+	*last = min(*first + (1UL << log), NEXT3_SB(sb)->s_groups_count) - 1;
+	return 1;
+}
+
+/**
+ * next3_block_bitmap_group() -- find the block group of a block bitmap
+ * @sb:			super block
+ * @block:		filesystem wide block number
+ *
+ * With flex_bg, the block bitmap of a group is not necessarily inside the
+ * group.  mke2fs places the block bitmaps of a flex group one after the
+ * other, so we first try the group at the offset of @block from the first
+ * block bitmap of the flex group and then all the groups of the flex group.
+ * Returns the group of the block bitmap at @block, or -1 if @block is not
+ * a block bitmap.
+ */
+long next3_block_bitmap_group(struct super_block *sb, next3_fsblk_t block)
+{
+	struct next3_group_desc *desc;
+	next3_fsblk_t bitmap_blk;
+	unsigned long first, last, group;
+
+	if (!next3_flex_group_range(sb, block, &first, &last))
+		return -1;
+
+	desc = next3_get_group_desc(sb, first, NULL);
+	if (!desc)
+		return -1;
+	bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+	if (block >= bitmap_blk && block - bitmap_blk <= last - first) {
+		group = first + (block - bitmap_blk);
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (desc && le32_to_cpu(desc->bg_block_bitmap) == block)
+			return group;
+	}
+	if (first == last)
+		return -1;
+
+	for (group = first; group <= last; group++) {
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (desc && le32_to_cpu(desc->bg_block_bitmap) == block)
+			return group;
+	}
+	return -1;
+}
+
+/**
+ * next3_block_bitmap_offset() -- find the first block bitmap in a range
+ * @sb:			super block
+ * @block:		first block of the range
+ * @count:		no. of blocks in the range, which is inside one group
+ *
+ * Returns the offset from @block of the first block bitmap in the range,
+ * or @count if there is no block bitmap in the range.
+ */
+unsigned long next3_block_bitmap_offset(struct super_block *sb,
+		next3_fsblk_t block, unsigned long count)
+{
+	struct next3_group_desc *desc;
+	next3_fsblk_t bitmap_blk;
+	unsigned long first, last, group;
+
+	if (!next3_flex_group_range(sb, block, &first, &last))
+		return count;
+
+	for (group = first; group <= last; group++) {
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (!desc)
+			continue;
+		bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+		if (bitmap_blk >= block && bitmap_blk - block < count)
+			count = bitmap_blk - block;
+	}
+	return count;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+/*
+ * The bitmap buffers of recently used block groups are pinned, so the
+ * allocation, free and snapshot paths do not look up the buffer cache on
+ * every access.  A bitmap is validated when it is read from disk, so a
+ * pinned bitmap is never validated again.  At most s_bitmap_pin_groups
+ * groups are on the s_bitmap_pins list.  The list is scanned like a clock:
+ * a group that was accessed since the last scan gets a second chance.
+ */
+static inline int next3_group_pinned(struct next3_group_info *gi)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (gi->bg_exclude_bh)
+		return 1;
+#endif
+	return gi->bg_block_bh != NULL;
+}
+
+/*
+ * next3_get_pinned_bitmap() - get a reference to a pinned bitmap buffer
+ * @slot: pinned buffer of the block group
+ * @blk: current location of the bitmap
+ *
+ * Returns the pinned buffer if it is up to date, or NULL.
+ */
+static struct buffer_head *
+next3_get_pinned_bitmap(struct super_block *sb, unsigned int block_group,
+			struct buffer_head **slot, next3_fsblk_t blk)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct buffer_head *bh;
+
+	if (!ACCESS_ONCE(*slot))
+		return NULL;
+	spin_lock(sb_bgl_lock(sbi, block_group));
+	bh = *slot;
+	if (bh && bh->b_blocknr == blk && buffer_uptodate(bh)) {
+		get_bh(bh);
+		sbi->s_group_info[block_group].bg_pin_ref = 1;
+	} else {
+		bh = NULL;
+	}
+	spin_unlock(sb_bgl_lock(sbi, block_group));
+	return bh;
+}
+
+/*
+ * Release the pinned buffers of a block group and remove it from the list.
+ * Called under s_bitmap_pin_lock.
+ */
+static void next3_unpin_group(struct next3_sb_info *sbi,
+			      struct next3_group_info *gi)
+{
+	unsigned int block_group = gi - sbi->s_group_info;
+	struct buffer_head *block_bh;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	struct buffer_head *exclude_bh;
+#endif
+
+	spin_lock(sb_bgl_lock(sbi, block_group));
+	block_bh = gi->bg_block_bh;
+	gi->bg_block_bh = NULL;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	exclude_bh = gi->bg_exclude_bh;
+	gi->bg_exclude_bh = NULL;
+#endif
+	spin_unlock(sb_bgl_lock(sbi, block_group));
+	list_del(&gi->bg_pin_list);
+	sbi->s_bitmap_pinned--;
+	brelse(block_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bh);
+#endif
+}
+
+/*
+ * next3_pin_bitmap() - pin a bitmap buffer after it was read
+ * @slot: pinned buffer of the block group
+ * @bh: up to date bitmap buffer
+ *
+ * Pins @bh in place of a stale pinned buffer and evicts the groups that
+ * were not accessed recently when there are too many pinned groups.
+ */
+static void next3_pin_bitmap(struct super_block *sb, unsigned int block_group,
+			     struct buffer_head **slot, struct buffer_head *bh)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + block_group;
+	unsigned int limit = ACCESS_ONCE(sbi->s_bitmap_pin_groups);
+	struct buffer_head *old = NULL;
+	int first;
+
+	spin_lock(&sbi->s_bitmap_pin_lock);
+	if (limit) {
+		spin_lock(sb_bgl_lock(sbi, block_group));
+		first = !next3_group_pinned(gi);
+		if (*slot != bh) {
+			old = *slot;
+			get_bh(bh);
+			*slot = bh;
+		}
+		gi->bg_pin_ref = 1;
+		spin_unlock(sb_bgl_lock(sbi, block_group));
+		if (first) {
+			list_add_tail(&gi->bg_pin_list, &sbi->s_bitmap_pins);
+			sbi->s_bitmap_pinned++;
+		}
+		brelse(old);
+	}
+	while (sbi->s_bitmap_pinned > limit) {
+		struct next3_group_info *victim;
+
+		victim = list_first_entry(&sbi->s_bitmap_pins,
+					  struct next3_group_info, bg_pin_list);
+		/* bg_pin_ref is set without s_bitmap_pin_lock - it's a hint */
+		if (victim->bg_pin_ref && limit) {
+			victim->bg_pin_ref = 0;
+			list_move_tail(&victim->bg_pin_list,
+				       &sbi->s_bitmap_pins);
+			continue;
+		}
+		next3_unpin_group(sbi, victim);
+	}
+	spin_unlock(&sbi->s_bitmap_pin_lock);
+}
+
+/*
+ * next3_release_bitmap_pins() - release all pinned bitmap buffers
+ *
+ * Called on umount and on mount failure, before the group info is freed.
+ */
+void next3_release_bitmap_pins(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	spin_lock(&sbi->s_bitmap_pin_lock);
+	while (!list_empty(&sbi->s_bitmap_pins))
+		next3_unpin_group(sbi, list_first_entry(&sbi->s_bitmap_pins,
+				struct next3_group_info, bg_pin_list));
+	spin_unlock(&sbi->s_bitmap_pin_lock);
+}
+
+#endif
 /**
  * read_block_bitmap()
  * @sb:			super block
@@ -145,11 +399,21 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 	struct next3_group_desc * desc;
 	struct buffer_head * bh = NULL;
 	next3_fsblk_t bitmap_blk;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	struct next3_group_info *gi;
+#endif
 
 	desc = next3_get_group_desc(sb, block_group, NULL);
 	if (!desc)
 		return NULL;
 	bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	gi = NEXT3_SB(sb)->s_group_info + block_group;
+	bh = next3_get_pinned_bitmap(sb, block_group, &gi->bg_block_bh,
+				     bitmap_blk);
+	if (bh)
+		return bh;
+#endif
 	bh = sb_getblk(sb, bitmap_blk);
 	if (unlikely(!bh)) {
 		next3_error(sb, __func__,
@@ -159,7 +423,11 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 		return NULL;
 	}
 	if (likely(bh_uptodate_or_lock(bh)))
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+		goto pin;
+#else
 		return bh;
+#endif
 
 	if (bh_submit_read(bh) < 0) {
 		brelse(bh);
@@ -174,6 +442,10 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 	 * file system mounted not to panic on error, continue with corrupt
 	 * bitmap
 	 */
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+pin:
+	next3_pin_bitmap(sb, block_group, &gi->bg_block_bh, bh);
+#endif
 	return bh;
 }
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
@@ -190,13 +462,26 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 struct buffer_head *
 read_exclude_bitmap(struct super_block *sb, unsigned int block_group)
 {
+#if !defined(CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY) || \
+	defined(CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN)
 	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info + block_group;
+#endif
 	struct buffer_head *bh = NULL;
 	next3_fsblk_t exclude_bitmap_blk;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	exclude_bitmap_blk = next3_exclude_bitmap_blk(sb, block_group);
+#else
 	exclude_bitmap_blk = gi->bg_exclude_bitmap;
+#endif
 	if (!exclude_bitmap_blk)
 		return NULL;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	bh = next3_get_pinned_bitmap(sb, block_group, &gi->bg_exclude_bh,
+				     exclude_bitmap_blk);
+	if (bh)
+		return bh;
+#endif
 	bh = sb_getblk(sb, exclude_bitmap_blk);
 	if (unlikely(!bh)) {
 		next3_error(sb, __func__,
@@ -206,7 +491,11 @@ read_exclude_bitmap(struct super_block *sb, unsigned int block_group)
 		return NULL;
 	}
 	if (likely(bh_uptodate_or_lock(bh)))
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+		goto pin;
+#else
 		return bh;
+#endif
 
 	if (bh_submit_read(bh) < 0) {
 		brelse(bh);
@@ -216,6 +505,10 @@ read_exclude_bitmap(struct super_block *sb, unsigned int block_group)
 			    block_group, exclude_bitmap_blk);
 		return NULL;
 	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+pin:
+	next3_pin_bitmap(sb, block_group, &gi->bg_exclude_bh, bh);
+#endif
 	return bh;
 }
 
@@ -227,6 +520,207 @@ static struct inode dummy_exclude_inode = {
 	.i_ino = NEXT3_EXCLUDE_INO
 };
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+/*
+ * next3_fresh_add() - @count blocks at @grp_blk in @group were allocated
+ * Grows the run of blocks that were allocated since snapshot take when the
+ * new blocks are adjacent to it and starts a new run otherwise.
+ * Called under sb_bgl_lock()
+ */
+static inline void next3_fresh_add(struct super_block *sb,
+		unsigned long group, next3_grpblk_t grp_blk, int count)
+{
+	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info + group;
+
+	if (!next3_snapshot_has_active(sb))
+		return;
+	if (grp_blk == gi->bg_fresh_end && gi->bg_fresh_start < gi->bg_fresh_end)
+		gi->bg_fresh_end += count;
+	else if (grp_blk + count == gi->bg_fresh_start)
+		gi->bg_fresh_start = grp_blk;
+	else {
+		gi->bg_fresh_start = grp_blk;
+		gi->bg_fresh_end = grp_blk + count;
+	}
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+/*
+ * Buddy summary of block group free extents
+ * -----------------------------------------
+ * Like the buddy cache of ext4 mballoc, the free extents of a block group
+ * are split into naturally aligned power of 2 chunks.  Only the largest
+ * chunk order and the number of free extents are kept in memory, which
+ * is enough for the allocator to pass over groups that are known to be
+ * too fragmented for a request, without reading their block bitmap.
+ * A block is free if it is not set in the block bitmap nor in the last
+ * committed copy of the bitmap, which is the next3_test_allocatable()
+ * rule, so the COW bitmap and exclude bitmap semantics are not changed.
+ */
+
+/*
+ * next3_buddy_invalidate() - block bitmap of @group has changed
+ * Called under sb_bgl_lock()
+ */
+static inline void next3_buddy_invalidate(struct next3_sb_info *sbi,
+		unsigned long group)
+{
+	struct next3_group_info *gi = sbi->s_group_info + group;
+
+	gi->bg_buddy_valid = 0;
+	gi->bg_buddy_gen++;
+}
+
+/*
+ * next3_buddy_generate() - generate buddy summary of @group
+ * @bitmap_bh:	block bitmap of @group
+ *
+ * The summary is only stored if the bitmap was not changed during the
+ * scan.  Returns the largest free order of @group or -1 if none.
+ */
+static int next3_buddy_generate(struct super_block *sb, unsigned long group,
+		struct buffer_head *bitmap_bh)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + group;
+	struct journal_head *jh;
+	next3_grpblk_t max = NEXT3_BLOCKS_PER_GROUP(sb);
+	next3_grpblk_t start = 0, end, next, len;
+	int order, largest = -1, fragments = 0;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+	next3_grpblk_t longest = 0;
+#endif
+	unsigned int gen;
+	char *committed;
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	gen = gi->bg_buddy_gen;
+	spin_unlock(sb_bgl_lock(sbi, group));
+
+	jbd_lock_bh_state(bitmap_bh);
+	jh = buffer_jbd(bitmap_bh) ? bh2jh(bitmap_bh) : NULL;
+	committed = jh ? jh->b_committed_data : NULL;
+	while (start < max) {
+		/* find next block which is free in both bitmaps */
+		start = next3_find_next_zero_bit(bitmap_bh->b_data, max, start);
+		if (start >= max)
+			break;
+		if (committed && next3_test_bit(start, committed)) {
+			start = next3_find_next_zero_bit(committed, max, start);
+			continue;
+		}
+		end = next3_find_next_bit(bitmap_bh->b_data, max, start);
+		if (committed) {
+			next = next3_find_next_bit(committed, end, start);
+			if (next < end)
+				end = next;
+		}
+		fragments++;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+		if (end - start > longest)
+			longest = end - start;
+#endif
+		/* split free extent into aligned power of 2 chunks */
+		for (next = start; next < end; next += 1 << order) {
+			order = next ? __ffs(next) : sb->s_blocksize_bits + 3;
+			len = end - next;
+			while ((1 << order) > len)
+				order--;
+			if (order > largest)
+				largest = order;
+		}
+		start = end;
+	}
+	jbd_unlock_bh_state(bitmap_bh);
+
+	spin_lock(sb_bgl_lock(sbi, group));
+	if (gi->bg_buddy_gen == gen) {
+		gi->bg_buddy_order = largest;
+		gi->bg_buddy_fragments = fragments;
+		gi->bg_buddy_valid = 1;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+		gi->bg_free_run = longest;
+		gi->bg_free_run_valid = 1;
+#endif
+	}
+	spin_unlock(sb_bgl_lock(sbi, group));
+	return largest;
+}
+
+/*
+ * next3_buddy_too_small() - test if @group has no free chunk of @order
+ * or no free run of @run blocks
+ * Returns 1 only if the buddy summary of @group is known and shows that
+ * the largest free chunk in the group is smaller than 2^@order or that
+ * the largest free run is shorter than @run.
+ */
+static inline int next3_buddy_too_small(struct next3_sb_info *sbi,
+		unsigned long group, int order, int run)
+{
+	struct next3_group_info *gi = sbi->s_group_info + group;
+
+	if (order && ACCESS_ONCE(gi->bg_buddy_valid) &&
+	    ACCESS_ONCE(gi->bg_buddy_order) < order)
+		return 1;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+	if (run && ACCESS_ONCE(gi->bg_free_run_valid) &&
+	    ACCESS_ONCE(gi->bg_free_run) < run)
+		return 1;
+#endif
+	return 0;
+}
+
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+/* how far to look around freed blocks for the free run they belong to */
+#define NEXT3_FREE_RUN_SCAN	1024
+
+/*
+ * next3_free_run_update() - blocks [@bit, @bit+@count) of @group were freed
+ * @bitmap:	block bitmap data, after the blocks were cleared
+ *
+ * Raise the free run upper bound of @group to the longest free run that
+ * contains freed blocks.  If the run is longer than we care to look for,
+ * the bound becomes unknown until the buddy summary is generated again.
+ * Called under sb_bgl_lock()
+ */
+static void next3_free_run_update(struct super_block *sb, unsigned long group,
+		const char *bitmap, next3_grpblk_t bit, unsigned long count)
+{
+	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info + group;
+	next3_grpblk_t max = NEXT3_BLOCKS_PER_GROUP(sb);
+	next3_grpblk_t start, end, next, run, longest = 0;
+
+	if (!gi->bg_free_run_valid)
+		return;
+
+	start = bit > NEXT3_FREE_RUN_SCAN ? bit - NEXT3_FREE_RUN_SCAN : 0;
+	end = bit + count + NEXT3_FREE_RUN_SCAN;
+	if (end > max)
+		end = max;
+	next = start;
+	while (next < end) {
+		next = next3_find_next_zero_bit(bitmap, end, next);
+		if (next >= end)
+			break;
+		run = next3_find_next_bit(bitmap, end, next) - next;
+		if ((next == start && start > 0) ||
+		    (next + run == end && end < max)) {
+			/* run may continue beyond the scanned range */
+			gi->bg_free_run_valid = 0;
+			return;
+		}
+		if (run > longest)
+			longest = run;
+		next += run;
+	}
+	if (longest > gi->bg_free_run)
+		gi->bg_free_run = longest;
+}
+
+#endif
+
 #endif
 /*
  * The reservation window structure operations
@@ -298,6 +792,30 @@ restart:
 #define rsv_window_dump(root, verbose) do {} while (0)
 #endif
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+/*
+ * next3_rsv_tree() -- the reservation window tree of the group of @block.
+ * Allocators in different block groups usually work on different trees
+ * and do not contend on the same rsv_lock.
+ */
+static inline struct next3_rsv_tree *next3_rsv_tree(struct super_block *sb,
+		next3_fsblk_t block)
+{
+	next3_fsblk_t first = le32_to_cpu(NEXT3_SB(sb)->s_es->s_first_data_block);
+	unsigned long group = 0;
+
+	if (block > first)
+		group = (block - first) / NEXT3_BLOCKS_PER_GROUP(sb);
+	return &NEXT3_SB(sb)->s_rsv_trees[group % NEXT3_RSV_TREES];
+}
+
+#define next3_rsv_root(sb, block) (&next3_rsv_tree((sb), (block))->root)
+#define next3_rsv_lock(sb, block) (&next3_rsv_tree((sb), (block))->lock)
+#else
+#define next3_rsv_root(sb, block) (&NEXT3_SB(sb)->s_rsv_window_root)
+#define next3_rsv_lock(sb, block) (&NEXT3_SB(sb)->s_rsv_window_lock)
+#endif
+
 /**
  * goal_in_my_reservation()
  * @rsv:		inode's reservation window
@@ -383,7 +901,7 @@ search_reserve_window(struct rb_root *root, next3_fsblk_t goal)
 void next3_rsv_window_add(struct super_block *sb,
 		    struct next3_reserve_window_node *rsv)
 {
-	struct rb_root *root = &NEXT3_SB(sb)->s_rsv_window_root;
+	struct rb_root *root = next3_rsv_root(sb, rsv->rsv_start);
 	struct rb_node *node = &rsv->rsv_node;
 	next3_fsblk_t start = rsv->rsv_start;
 
@@ -422,10 +940,12 @@ void next3_rsv_window_add(struct super_block *sb,
 static void rsv_window_remove(struct super_block *sb,
 			      struct next3_reserve_window_node *rsv)
 {
+	struct rb_root *root = next3_rsv_root(sb, rsv->rsv_start);
+
 	rsv->rsv_start = NEXT3_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_end = NEXT3_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_alloc_hit = 0;
-	rb_erase(&rsv->rsv_node, &NEXT3_SB(sb)->s_rsv_window_root);
+	rb_erase(&rsv->rsv_node, root);
 }
 
 /*
@@ -459,7 +979,7 @@ static inline int rsv_is_empty(struct next3_reserve_window *rsv)
  * when setting the reservation window size through ioctl before the file
  * is open for write (needs block allocation).
  *
- * Needs truncate_mutex protection prior to call this function.
+ * Needs truncate_sem protection prior to call this function.
  */
 void next3_init_block_alloc_info(struct inode *inode)
 {
@@ -508,13 +1028,15 @@ void next3_discard_reservation(struct inode *inode)
 	struct next3_inode_info *ei = NEXT3_I(inode);
 	struct next3_block_alloc_info *block_i = ei->i_block_alloc_info;
 	struct next3_reserve_window_node *rsv;
-	spinlock_t *rsv_lock = &NEXT3_SB(inode->i_sb)->s_rsv_window_lock;
+	spinlock_t *rsv_lock;
 
 	if (!block_i)
 		return;
 
 	rsv = &block_i->rsv_window_node;
 	if (!rsv_is_empty(&rsv->rsv_window)) {
+		/* rsv_start is stable under truncate_sem */
+		rsv_lock = next3_rsv_lock(inode->i_sb, rsv->rsv_start);
 		spin_lock(rsv_lock);
 		if (!rsv_is_empty(&rsv->rsv_window))
 			rsv_window_remove(inode->i_sb, rsv);
@@ -531,10 +1053,22 @@ void next3_discard_reservation(struct inode *inode)
  * @pdquot_freed_blocks:	pointer to quota
  */
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+/*
+ * next3_free_ranges_sb_inode() -- free @nr sorted block ranges.
+ * The block bitmaps of a group are read and journaled once for all the
+ * ranges in that group.  Only the first range may cross a group boundary.
+ */
+static void next3_free_ranges_sb_inode(const char *where, handle_t *handle,
+				  struct super_block *sb, struct inode *inode,
+				  struct next3_free_range *ranges, int nr,
+				  unsigned long *pdquot_freed_blocks)
+#else
 void __next3_free_blocks_sb_inode(const char *where, handle_t *handle,
 				  struct super_block *sb, struct inode *inode,
 				  next3_fsblk_t block, unsigned long count,
 				  unsigned long *pdquot_freed_blocks)
+#endif
 #else
 void next3_free_blocks_sb(handle_t *handle, struct super_block *sb,
 			 next3_fsblk_t block, unsigned long count,
@@ -555,6 +1089,9 @@ void next3_free_blocks_sb(handle_t *handle, struct super_block *sb,
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
 	int state_locked;
 	next3_grpblk_t group_skipped = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+	int clear;
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
 	struct buffer_head *exclude_bitmap_bh = NULL;
 	int  exclude_bitmap_dirty = 0;
@@ -563,6 +1100,12 @@ void next3_free_blocks_sb(handle_t *handle, struct super_block *sb,
 	/* excluded_block is determined by testing exclude bitmap */
 	int excluded_block;
 #endif
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	next3_fsblk_t block = ranges->block;
+	unsigned long count = ranges->count;
+	/* no. of blocks in the ranges of this group */
+	unsigned long group_count;
 #endif
 
 	*pdquot_freed_blocks = 0;
@@ -655,12 +1198,30 @@ do_more:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
 	/* if we skip all blocks we won't need to aquire the state lock */
 	state_locked = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+	/* no. of blocks known not to be in use by snapshot */
+	clear = 0;
+#endif
 #else
 	jbd_lock_bh_state(bitmap_bh);
 #endif
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	group_freed = 0;
+	group_count = 0;
+next_range:
+	for (i = 0; i < count; i++) {
+#else
 	for (i = 0, group_freed = 0; i < count; i++) {
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		if (clear > 0) {
+			/* block is not in use by snapshot - delete it */
+			clear--;
+			goto delete_block;
+		}
+#endif
 		if (state_locked) {
 			/*
 			 * Moving blocks to snapshot may sleep and may need to take this
@@ -671,8 +1232,13 @@ do_more:
 			jbd_unlock_bh_state(bitmap_bh);
 			state_locked = 0;
 		}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		ret = next3_snapshot_get_delete_access_runs(handle, inode,
+						block + i, count - i, &clear);
+#else
 		ret = next3_snapshot_get_delete_access(handle, inode,
 						       block + i, count - i);
+#endif
 		if (ret < 0) {
 			next3_journal_abort_handle(where, __func__, NULL,
 						   handle, ret);
@@ -683,11 +1249,19 @@ do_more:
 			/* 'ret' blocks were moved to snapshot - skip them */
 			group_skipped += ret;
 			i += ret - 1;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+			clear = 0;
+#endif
 			cond_resched();
 			continue;
 		}
 		jbd_lock_bh_state(bitmap_bh);
 		state_locked = 1;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		/* this block is the first of 'clear' blocks to delete */
+		clear--;
+delete_block:
+#endif
 #endif
 		/*
 		 * An HJ special.  This is expensive...
@@ -760,7 +1334,7 @@ do_more:
 		 * always clear exclude bitmap just to be on the safe side.
 		 */
 		excluded_block = (exclude_bitmap_bh &&
-			next3_clear_bit_atomic(sb_bgl_lock(sbi, block_group),
+			next3_clear_bit_atomic(sb_snapshot_lock(sbi, block_group),
 				bit + i, exclude_bitmap_bh->b_data)) ? 1 : 0;
 		if ((excluded_block && !excluded_file) ||
 			(excluded_file && !excluded_block)) {
@@ -794,11 +1368,53 @@ do_more:
 #else
 	jbd_unlock_bh_state(bitmap_bh);
 #endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	group_count += count;
+	if (!err && !overflow && nr > 1 &&
+	    (ranges[1].block - le32_to_cpu(es->s_first_data_block)) /
+	    NEXT3_BLOCKS_PER_GROUP(sb) == block_group) {
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+		if (group_freed) {
+			spin_lock(sb_bgl_lock(sbi, block_group));
+			next3_free_run_update(sb, block_group,
+					      bitmap_bh->b_data, bit, count);
+			spin_unlock(sb_bgl_lock(sbi, block_group));
+		}
+#endif
+		/* next range is in this group - keep the bitmaps */
+		ranges++;
+		nr--;
+		block = ranges->block;
+		count = ranges->count;
+		bit = (block - le32_to_cpu(es->s_first_data_block)) %
+			NEXT3_BLOCKS_PER_GROUP(sb);
+		state_locked = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		clear = 0;
+#endif
+		goto next_range;
+	}
+#endif
 
 	spin_lock(sb_bgl_lock(sbi, block_group));
 	le16_add_cpu(&desc->bg_free_blocks_count, group_freed);
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_flex_stats_add(sb, block_group, 0, group_freed, 0);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	next3_buddy_invalidate(sbi, block_group);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+	if (group_freed)
+		next3_free_run_update(sb, block_group, bitmap_bh->b_data,
+				      bit, count);
+#endif
 	spin_unlock(sb_bgl_lock(sbi, block_group));
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	percpu_counter_add(&sbi->s_freeblocks_counter, group_count);
+#else
 	percpu_counter_add(&sbi->s_freeblocks_counter, count);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
 	percpu_counter_add(&sbi->s_freeblocks_counter, -group_skipped);
 	group_skipped = 0;
@@ -832,6 +1448,16 @@ do_more:
 		count = overflow;
 		goto do_more;
 	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	if (nr > 1 && !err) {
+		/* next range is in another group */
+		ranges++;
+		nr--;
+		block = ranges->block;
+		count = ranges->count;
+		goto do_more;
+	}
+#endif
 
 error_return:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
@@ -842,6 +1468,153 @@ error_return:
 	return;
 }
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+void __next3_free_blocks_sb_inode(const char *where, handle_t *handle,
+				  struct super_block *sb, struct inode *inode,
+				  next3_fsblk_t block, unsigned long count,
+				  unsigned long *pdquot_freed_blocks)
+{
+	struct next3_free_range range = {
+		.block = block,
+		.count = count,
+	};
+
+	next3_free_ranges_sb_inode(where, handle, sb, inode, &range, 1,
+				   pdquot_freed_blocks);
+}
+
+static inline unsigned long next3_free_batch_group(struct super_block *sb,
+						   next3_fsblk_t block)
+{
+	return (block - le32_to_cpu(NEXT3_SB(sb)->s_es->s_first_data_block)) /
+		NEXT3_BLOCKS_PER_GROUP(sb);
+}
+
+static int next3_free_range_cmp(const void *a, const void *b)
+{
+	const struct next3_free_range *ra = a, *rb = b;
+
+	if (ra->block < rb->block)
+		return -1;
+	return ra->block > rb->block;
+}
+
+/**
+ * next3_free_batch_flush() -- Free the pending block ranges of truncate
+ * @handle:		handle for this transaction
+ * @inode:		inode
+ *
+ * The ranges are sorted and coalesced, so every block group bitmap is
+ * journaled once and the snapshot delete access is checked once for every
+ * contiguous extent, instead of once for every range that truncate freed.
+ */
+void next3_free_batch_flush(handle_t *handle, struct inode *inode)
+{
+	struct next3_free_batch *batch = NEXT3_I(inode)->i_free_batch;
+	struct super_block *sb = inode->i_sb;
+	struct next3_free_range *r;
+	unsigned long dquot_freed_blocks;
+	int i, nr;
+
+	if (!batch || !batch->nr)
+		return;
+
+	sort(batch->ranges, batch->nr, sizeof(struct next3_free_range),
+	     next3_free_range_cmp, NULL);
+	r = batch->ranges;
+	for (i = 1, nr = 1; i < batch->nr; i++) {
+		struct next3_free_range *next = &batch->ranges[i];
+
+		if (r->block + r->count == next->block &&
+		    next3_free_batch_group(sb, r->block) ==
+		    next3_free_batch_group(sb, next->block)) {
+			r->count += next->count;
+			continue;
+		}
+		*(++r) = *next;
+		nr++;
+	}
+	batch->nr = 0;
+
+	next3_free_ranges_sb_inode(__func__, handle, sb, inode,
+				   batch->ranges, nr, &dquot_freed_blocks);
+	if (dquot_freed_blocks)
+		dquot_free_block(inode, dquot_freed_blocks);
+}
+
+/**
+ * next3_free_blocks_batch() -- Free blocks of truncate in batch
+ * @handle:		handle for this transaction
+ * @inode:		inode
+ * @block:		start physical block to free
+ * @count:		number of blocks to count
+ *
+ * Add the blocks to the pending free batch of the inode, if truncate has
+ * set one up, or free them at once otherwise.  Invalid ranges are freed
+ * at once, so next3_free_blocks() reports them.
+ */
+void next3_free_blocks_batch(handle_t *handle, struct inode *inode,
+			     next3_fsblk_t block, unsigned long count)
+{
+	struct next3_free_batch *batch = NEXT3_I(inode)->i_free_batch;
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_super_block *es = sbi->s_es;
+	struct next3_group_desc *desc;
+	struct next3_free_range *last;
+	unsigned long group, n;
+	next3_grpblk_t bit;
+
+	if (!batch || block < le32_to_cpu(es->s_first_data_block) ||
+	    block + count < block ||
+	    block + count > le32_to_cpu(es->s_blocks_count)) {
+		next3_free_blocks(handle, inode, block, count);
+		return;
+	}
+
+	while (count) {
+		group = next3_free_batch_group(sb, block);
+		bit = (block - le32_to_cpu(es->s_first_data_block)) %
+			NEXT3_BLOCKS_PER_GROUP(sb);
+		n = min_t(unsigned long, count,
+			  NEXT3_BLOCKS_PER_GROUP(sb) - bit);
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (!desc ||
+		    in_range(le32_to_cpu(desc->bg_block_bitmap), block, n) ||
+		    in_range(le32_to_cpu(desc->bg_inode_bitmap), block, n) ||
+		    in_range(block, le32_to_cpu(desc->bg_inode_table),
+			     sbi->s_itb_per_group) ||
+		    in_range(block + n - 1, le32_to_cpu(desc->bg_inode_table),
+			     sbi->s_itb_per_group)) {
+			next3_free_blocks(handle, inode, block, n);
+			goto next;
+		}
+
+		last = batch->nr ? &batch->ranges[batch->nr - 1] : NULL;
+		if (last && next3_free_batch_group(sb, last->block) == group) {
+			/* truncate frees in both directions */
+			if (last->block + last->count == block) {
+				last->count += n;
+				goto next;
+			}
+			if (block + n == last->block) {
+				last->block = block;
+				last->count += n;
+				goto next;
+			}
+		}
+		if (batch->nr == NEXT3_FREE_BATCH_SIZE)
+			next3_free_batch_flush(handle, inode);
+		batch->ranges[batch->nr].block = block;
+		batch->ranges[batch->nr].count = n;
+		batch->nr++;
+next:
+		block += n;
+		count -= n;
+	}
+}
+
+#endif
 /**
  * next3_free_blocks() -- Free given blocks and update quota
  * @handle:		handle for this transaction
@@ -860,6 +1633,9 @@ void next3_free_blocks(handle_t *handle, struct inode *inode,
 		printk ("next3_free_blocks: nonexistent device");
 		return;
 	}
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+	trace_next3_free_blocks(inode, block, count);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE
 	next3_free_blocks_sb_inode(handle, sb, inode, block, count,
 				   &dquot_freed_blocks);
@@ -1229,6 +2005,11 @@ static int find_next_reservable_window(
 	next3_fsblk_t cur;
 	int size = my_rsv->rsv_goal_size;
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	/* windows are sized in whole stripes and start on a stripe */
+	if (NEXT3_SB(sb)->s_stripe)
+		size = roundup(size, NEXT3_SB(sb)->s_stripe);
+#endif
 	/* TODO: make the start of the reservation window byte-aligned */
 	/* cur = *start_block & ~7;*/
 	cur = start_block;
@@ -1239,6 +2020,9 @@ static int find_next_reservable_window(
 	while (1) {
 		if (cur <= rsv->rsv_end)
 			cur = rsv->rsv_end + 1;
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+		cur = next3_stripe_align(sb, cur);
+#endif
 
 		/* TODO?
 		 * in the case we could not find a reservable space
@@ -1294,6 +2078,11 @@ static int find_next_reservable_window(
 	 */
 	my_rsv->rsv_start = cur;
 	my_rsv->rsv_end = cur + size - 1;
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	/* the window must not spill into the tree of the next group */
+	if (my_rsv->rsv_end > last_block)
+		my_rsv->rsv_end = last_block;
+#endif
 	my_rsv->rsv_alloc_hit = 0;
 
 	if (prev != my_rsv)
@@ -1302,6 +2091,26 @@ static int find_next_reservable_window(
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+/**
+ * next3_stripe_align() -- round a block up to a RAID stripe boundary
+ * @sb:			super block
+ * @block:		filesystem wide block number
+ *
+ * Stripes are aligned to the start of the block device, like the
+ * stride and stripe width that mke2fs uses to place the bitmaps.
+ * Returns @block if the file system is not stripe aligned.
+ */
+next3_fsblk_t next3_stripe_align(struct super_block *sb, next3_fsblk_t block)
+{
+	unsigned long stripe = NEXT3_SB(sb)->s_stripe;
+
+	if (!stripe)
+		return block;
+	return roundup(block, stripe);
+}
+
+#endif
 /**
  *	alloc_new_reservation()--allocate a new reservation window
  *
@@ -1346,13 +2155,15 @@ static int alloc_new_reservation(struct next3_reserve_window_node *my_rsv,
 	struct next3_reserve_window_node *search_head;
 	next3_fsblk_t group_first_block, group_end_block, start_block;
 	next3_grpblk_t first_free_block;
-	struct rb_root *fs_rsv_root = &NEXT3_SB(sb)->s_rsv_window_root;
+	struct rb_root *fs_rsv_root;
 	unsigned long size;
 	int ret;
-	spinlock_t *rsv_lock = &NEXT3_SB(sb)->s_rsv_window_lock;
+	spinlock_t *rsv_lock;
 
 	group_first_block = next3_group_first_block_no(sb, group);
 	group_end_block = group_first_block + (NEXT3_BLOCKS_PER_GROUP(sb) - 1);
+	fs_rsv_root = next3_rsv_root(sb, group_first_block);
+	rsv_lock = next3_rsv_lock(sb, group_first_block);
 
 	if (grp_goal < 0)
 		start_block = group_first_block;
@@ -1396,6 +2207,21 @@ static int alloc_new_reservation(struct next3_reserve_window_node *my_rsv,
 		}
 	}
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	/*
+	 * the old window is in the tree of another group.  drop it under
+	 * its own lock, so we never hold two tree locks at once.
+	 */
+	if (!rsv_is_empty(&my_rsv->rsv_window) &&
+	    next3_rsv_lock(sb, my_rsv->rsv_start) != rsv_lock) {
+		spinlock_t *old_lock = next3_rsv_lock(sb, my_rsv->rsv_start);
+
+		spin_lock(old_lock);
+		rsv_window_remove(sb, my_rsv);
+		spin_unlock(old_lock);
+	}
+
+#endif
 	spin_lock(rsv_lock);
 	/*
 	 * shift the search start to the window near the goal block
@@ -1488,7 +2314,10 @@ static void try_to_extend_reservation(struct next3_reserve_window_node *my_rsv,
 {
 	struct next3_reserve_window_node *next_rsv;
 	struct rb_node *next;
-	spinlock_t *rsv_lock = &NEXT3_SB(sb)->s_rsv_window_lock;
+	spinlock_t *rsv_lock = next3_rsv_lock(sb, my_rsv->rsv_start);
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	next3_fsblk_t group_end_block;
+#endif
 
 	if (!spin_trylock(rsv_lock))
 		return;
@@ -1505,6 +2334,14 @@ static void try_to_extend_reservation(struct next3_reserve_window_node *my_rsv,
 		else
 			my_rsv->rsv_end = next_rsv->rsv_start - 1;
 	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	/* windows of the next group are in another tree */
+	group_end_block = my_rsv->rsv_start + (NEXT3_BLOCKS_PER_GROUP(sb) - 1) -
+		(my_rsv->rsv_start - next3_group_first_block_no(sb, 0)) %
+		NEXT3_BLOCKS_PER_GROUP(sb);
+	if (my_rsv->rsv_end > group_end_block)
+		my_rsv->rsv_end = group_end_block;
+#endif
 	spin_unlock(rsv_lock);
 }
 
@@ -1652,7 +2489,8 @@ next3_try_to_allocate_with_rsv(struct super_block *sb, handle_t *handle,
 
 		if ((my_rsv->rsv_start > group_last_block) ||
 				(my_rsv->rsv_end < group_first_block)) {
-			rsv_window_dump(&NEXT3_SB(sb)->s_rsv_window_root, 1);
+			rsv_window_dump(next3_rsv_root(sb, my_rsv->rsv_start),
+					1);
 			BUG();
 		}
 		ret = next3_try_to_allocate(sb, handle, group, bitmap_bh,
@@ -1704,6 +2542,16 @@ out:
 	return ret;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_EXACT
+#ifdef CONFIG_SMP
+/* maximal error of percpu_counter_read() of the free blocks counter */
+#define NEXT3_FREEBLOCKS_WATERMARK	\
+	((next3_fsblk_t)percpu_counter_batch * num_online_cpus())
+#else
+#define NEXT3_FREEBLOCKS_WATERMARK	0
+#endif
+
+#endif
 /**
  * next3_has_free_blocks()
  * @sbi:		in-core super block structure.
@@ -1721,6 +2569,20 @@ static int next3_has_free_blocks(struct next3_sb_info *sbi)
 	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
 	root_blocks = le32_to_cpu(sbi->s_es->s_r_blocks_count);
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_EXACT
+	snapshot_r_blocks = sbi->s_active_snapshot ?
+		le64_to_cpu(sbi->s_es->s_snapshot_r_blocks_count) : 0;
+	/*
+	 * The approximate count is good enough far from the reserve.
+	 * Within the counter error of the reserve, sum up the exact count,
+	 * so we don't fail allocations (and make callers retry) just
+	 * because the per cpu deltas were not folded yet.
+	 */
+	if (free_blocks < root_blocks + snapshot_r_blocks + 1 +
+			NEXT3_FREEBLOCKS_WATERMARK)
+		free_blocks = percpu_counter_sum_positive(
+					&sbi->s_freeblocks_counter);
+#endif
 	if (unlikely(!free_blocks))
 		/* sorry, but we're really out of space */
 		return 0;
@@ -1728,9 +2590,11 @@ static int next3_has_free_blocks(struct next3_sb_info *sbi)
 		/* any available space may be used by COWing task */
 		return 1;
 	if (sbi->s_active_snapshot) {
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_EXACT
 		/* reserve blocks for active snapshot */
 		snapshot_r_blocks =
 			le64_to_cpu(sbi->s_es->s_snapshot_r_blocks_count);
+#endif
 		/*
 		 * The last snapshot_r_blocks are reserved for active snapshot
 		 * and may not be allocated even by root.
@@ -1766,6 +2630,20 @@ static int next3_has_free_blocks(struct next3_sb_info *sbi)
  */
 int next3_should_retry_alloc(struct super_block *sb, int *retries)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+	/*
+	 * Out of space, which is probably held by snapshots - wait for
+	 * reclaim of a snapshot instead of forcing commits in vain.
+	 * Every reclaim removes a snapshot, so the retries are bounded.
+	 */
+	if (!next3_has_free_blocks(NEXT3_SB(sb)) &&
+			next3_snapshot_reclaim(sb)) {
+		jbd_debug(1, "%s: retrying operation after snapshot reclaim\n",
+			  sb->s_id);
+		journal_force_commit_nested(NEXT3_SB(sb)->s_journal);
+		return 1;
+	}
+#endif
 	if (!next3_has_free_blocks(NEXT3_SB(sb)) || (*retries)++ > 3)
 		return 0;
 
@@ -1814,6 +2692,14 @@ next3_fsblk_t next3_new_blocks(handle_t *handle, struct inode *inode,
 #endif
 	unsigned long ngroups;
 	unsigned long num = *count;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	int buddy_order;		/* wanted free chunk order */
+	int buddy_run = 0;		/* wanted free run length */
+	int buddy_skipped;		/* groups skipped by buddy summary */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	unsigned long dquot_netted;	/* blocks not charged again */
+#endif
 
 	*errp = -ENOSPC;
 	sb = inode->i_sb;
@@ -1825,6 +2711,13 @@ next3_fsblk_t next3_new_blocks(handle_t *handle, struct inode *inode,
 	/*
 	 * Check quota for allocation of this block.
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	/* replacing blocks that this handle moved to snapshot? */
+	dquot_netted = next3_snapshot_dquot_net(handle, inode, num);
+	if (dquot_netted)
+		err = 0;
+	else
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
 	if (unlikely(IS_COWING(handle))) {
 		/* don't fail when allocating blocks for active snapshot */
@@ -1866,6 +2759,18 @@ next3_fsblk_t next3_new_blocks(handle_t *handle, struct inode *inode,
 	if (goal < le32_to_cpu(es->s_first_data_block) ||
 	    goal >= le32_to_cpu(es->s_blocks_count))
 		goal = le32_to_cpu(es->s_first_data_block);
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	/*
+	 * reservation windows are aligned when they are created.  start
+	 * a large allocation without a window on a stripe boundary.
+	 */
+	if (!my_rsv && sbi->s_stripe && num >= sbi->s_stripe) {
+		next3_fsblk_t aligned = next3_stripe_align(sb, goal);
+
+		if (aligned < le32_to_cpu(es->s_blocks_count))
+			goal = aligned;
+	}
+#endif
 	group_no = (goal - le32_to_cpu(es->s_first_data_block)) /
 			NEXT3_BLOCKS_PER_GROUP(sb);
 	goal_group = group_no;
@@ -1905,6 +2810,22 @@ retry_alloc:
 	ngroups = NEXT3_SB(sb)->s_groups_count;
 	smp_rmb();
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	/*
+	 * First pass prefers groups with a free chunk that can hold the
+	 * entire request (and a free run that can hold a new reservation
+	 * window).  If any group was skipped, the second pass searches all
+	 * groups.
+	 */
+	buddy_order = num > 1 ? ilog2(min_t(unsigned long, num,
+				NEXT3_BLOCKS_PER_GROUP(sb))) : 0;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+	if (my_rsv && rsv_is_empty(&my_rsv->rsv_window))
+		buddy_run = windowsz;
+#endif
+search_groups:
+	buddy_skipped = 0;
+#endif
 	/*
 	 * Now search the rest of the groups.  We assume that
 	 * group_no and gdp correctly point to the last group visited.
@@ -1930,11 +2851,38 @@ retry_alloc:
 		 */
 		if (my_rsv && (free_blocks <= (windowsz/2)))
 			continue;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+		/*
+		 * skip this group (and avoid loading bitmap) if it is
+		 * known to be too fragmented for the request.
+		 */
+		if (next3_buddy_too_small(sbi, group_no, buddy_order,
+					  buddy_run)) {
+			buddy_skipped++;
+			continue;
+		}
+#endif
 
 		brelse(bitmap_bh);
 		bitmap_bh = read_block_bitmap(sb, group_no);
 		if (!bitmap_bh)
 			goto io_error;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+		if ((buddy_order &&
+		     !sbi->s_group_info[group_no].bg_buddy_valid)
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+		    || (buddy_run &&
+			!sbi->s_group_info[group_no].bg_free_run_valid)
+#endif
+		   ) {
+			next3_buddy_generate(sb, group_no, bitmap_bh);
+			if (next3_buddy_too_small(sbi, group_no, buddy_order,
+						  buddy_run)) {
+				buddy_skipped++;
+				continue;
+			}
+		}
+#endif
 		/*
 		 * try to allocate block(s) from this group, without a goal(-1).
 		 */
@@ -1949,6 +2897,14 @@ retry_alloc:
 		if (grp_alloc_blk >= 0)
 			goto allocated;
 	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	if (buddy_skipped) {
+		/* group_no is back at the first group visited */
+		buddy_order = 0;
+		buddy_run = 0;
+		goto search_groups;
+	}
+#endif
 	/*
 	 * We may end up a bogus ealier ENOSPC error due to
 	 * filesystem is "full" of reservations, but
@@ -2045,6 +3001,15 @@ allocated:
 
 	spin_lock(sb_bgl_lock(sbi, group_no));
 	le16_add_cpu(&gdp->bg_free_blocks_count, -num);
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_flex_stats_add(sb, group_no, 0, -num, 0);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	next3_buddy_invalidate(sbi, group_no);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+	next3_fresh_add(sb, group_no, grp_alloc_blk, num);
+#endif
 	spin_unlock(sb_bgl_lock(sbi, group_no));
 	percpu_counter_sub(&sbi->s_freeblocks_counter, num);
 
@@ -2058,8 +3023,18 @@ allocated:
 
 	*errp = 0;
 	brelse(bitmap_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	if (dquot_netted) {
+		/* return the blocks that were not allocated */
+		if (*count > num)
+			next3_snapshot_dquot_free(handle, inode, *count-num);
+	} else
+#endif
 	dquot_free_block(inode, *count-num);
 	*count = num;
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+	trace_next3_allocate_blocks(inode, goal, num, ret_block, 0);
+#endif
 	return ret_block;
 
 io_error:
@@ -2072,9 +3047,17 @@ out:
 	/*
 	 * Undo the block allocation
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	if (!performed_allocation && dquot_netted)
+		next3_snapshot_dquot_free(handle, inode, *count);
+	else
+#endif
 	if (!performed_allocation)
 		dquot_free_block(inode, *count);
 	brelse(bitmap_bh);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+	trace_next3_allocate_blocks(inode, goal, 0, 0, *errp);
+#endif
 	return 0;
 }
 
@@ -30,3 +30,48 @@ unsigned long next3_count_free (struct buffer_head * map, unsigned int numchars)
 
 #endif  /*  NEXT3FS_DEBUG  */
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_RANGE
+/*
+ * next3_set_bits_range - set a range of bits in a little endian bitmap
+ * @bitmap:	bitmap buffer (e.g. exclude bitmap block)
+ * @bit:	first bit to set
+ * @count:	no. of bits to set
+ * @pfirst:	returns the first bit in range that was clear or -1
+ *
+ * Sets the bits one 32 bit word at a time with cmpxchg(), so it may race
+ * with next3_set_bit_atomic() on the same bitmap.  Words whose bits in range
+ * are all set already are skipped without being written.
+ * Returns the no. of bits in range that were clear.
+ */
+int next3_set_bits_range(char *bitmap, int bit, int count, int *pfirst)
+{
+	__le32 *p = (__le32 *)bitmap + (bit >> 5);
+	int n = 0;
+
+	*pfirst = -1;
+	while (count > 0) {
+		int offset = bit & 31;
+		int len = min(count, 32 - offset);
+		__le32 mask, old, new;
+		u32 clear;
+
+		mask = cpu_to_le32((len == 32) ? ~0U :
+				   ((1U << len) - 1) << offset);
+		do {
+			old = ACCESS_ONCE(*p);
+			new = old | mask;
+		} while (new != old && cmpxchg(p, old, new) != old);
+
+		clear = le32_to_cpu(new & ~old);
+		if (clear) {
+			if (*pfirst < 0)
+				*pfirst = bit - offset + __ffs(clear);
+			n += hweight32(clear);
+		}
+		bit += len;
+		count -= len;
+		p++;
+	}
+	return n;
+}
+#endif
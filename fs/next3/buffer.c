@@ -84,6 +84,11 @@ static void buffer_io_error(struct buffer_head *bh)
  * which is guarantied in readpage() and verified in next3_read_full_page().
  * The block device page buffer doesn't need any lock because the operations
  * {get|put}_bh_tracked_reader() are atomic.
+ * With hashed tracked readers, the readers count is kept in a per super block
+ * hashed array of atomic counters, keyed by block number, instead of in the
+ * block device buffer reference count, so tracked reads don't need to look up
+ * and pin a block device buffer.  Hash collisions only cause COW to wait for
+ * an unrelated read to complete.
  */
 
 #ifdef CONFIG_NEXT3_FS_DEBUG
@@ -128,10 +133,26 @@ void __next3_trace_bh_count(const char *fn, struct buffer_head *bh)
  */
 int start_buffer_tracked_read(struct buffer_head *bh)
 {
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
 	struct buffer_head *bdev_bh;
+#endif
 
 	BUG_ON(buffer_tracked_read(bh));
 	BUG_ON(!buffer_mapped(bh));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_start_tracked_read(bh);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+
+	atomic_inc(next3_tracked_readers(bh->b_bdev->bd_super, bh->b_blocknr));
+	/*
+	 * COW must see the readers count before we test if the block is
+	 * mapped in the snapshot
+	 */
+	smp_mb__after_atomic_inc();
+	set_buffer_tracked_read(bh);
+	return 0;
+#else
 
 	/* grab the buffer cache entry */
 	bdev_bh = __getblk(bh->b_bdev, bh->b_blocknr, bh->b_size);
@@ -144,6 +165,7 @@ int start_buffer_tracked_read(struct buffer_head *bh)
 	get_bh_tracked_reader(bdev_bh);
 	put_bh(bdev_bh);
 	return 0;
+#endif
 }
 
 /*
@@ -154,10 +176,27 @@ int start_buffer_tracked_read(struct buffer_head *bh)
  */
 void cancel_buffer_tracked_read(struct buffer_head *bh)
 {
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
 	struct buffer_head *bdev_bh;
+#endif
 
 	BUG_ON(!buffer_tracked_read(bh));
 	BUG_ON(!buffer_mapped(bh));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_cancel_tracked_read(bh);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+
+	clear_buffer_tracked_read(bh);
+	clear_buffer_mapped(bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (atomic_dec_and_test(next3_tracked_readers(bh->b_bdev->bd_super,
+						      bh->b_blocknr)))
+		next3_tracked_readers_wake(bh);
+#else
+	atomic_dec(next3_tracked_readers(bh->b_bdev->bd_super, bh->b_blocknr));
+#endif
+#else
 
 	/* try to grab the buffer cache entry */
 	bdev_bh = __find_get_block(bh->b_bdev, bh->b_blocknr, bh->b_size);
@@ -166,20 +205,75 @@ void cancel_buffer_tracked_read(struct buffer_head *bh)
 	clear_buffer_tracked_read(bh);
 	clear_buffer_mapped(bh);
 	put_bh_tracked_reader(bdev_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (!buffer_tracked_readers_count(bdev_bh))
+		next3_tracked_readers_wake(bdev_bh);
+#endif
 	put_bh(bdev_bh);
+#endif
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_BDEV
 /*
- * submit buffer tracked read
- * save a reference to buffer cache entry and submit I/O
+ * complete buffer tracked read from buffer cache
+ * called from inside get_block() for tracked read that was started but was
+ * not submitted.  if the block device buffer is uptodate and clean, copy it
+ * to the snapshot page buffer and cancel the tracked read.
+ * a block device buffer that is clean and had I/O (BH_Req) holds the on-disk
+ * data.  BH_Req is cleared by unmap_underlying_metadata() when a block is
+ * re-allocated as file data, which is written via the file page cache.
+ * returns 1 if buffer was copied and 0 otherwise
  */
-static int submit_buffer_tracked_read(struct buffer_head *bh)
+int copy_buffer_tracked_read(struct buffer_head *bh)
+{
+	struct buffer_head *bdev_bh;
+	char *kaddr;
+	int copied = 0;
+
+	BUG_ON(!buffer_tracked_read(bh));
+	BUG_ON(!buffer_mapped(bh));
+
+	bdev_bh = __find_get_block(bh->b_bdev, bh->b_blocknr, bh->b_size);
+	if (!bdev_bh)
+		return 0;
+	BUG_ON(bdev_bh == bh);
+	/* don't wait for I/O or for COW in progress */
+	if (!trylock_buffer(bdev_bh))
+		goto out;
+	if (buffer_uptodate(bdev_bh) && buffer_req(bdev_bh) &&
+			!buffer_dirty(bdev_bh)) {
+		kaddr = kmap_atomic(bh->b_page, KM_USER0);
+		memcpy(kaddr + bh_offset(bh), bdev_bh->b_data, bh->b_size);
+		kunmap_atomic(kaddr, KM_USER0);
+		copied = 1;
+	}
+	unlock_buffer(bdev_bh);
+	if (copied) {
+		cancel_buffer_tracked_read(bh);
+		/* cancel_buffer_tracked_read() clears mapped flag */
+		set_buffer_mapped(bh);
+		set_buffer_uptodate(bh);
+	}
+out:
+	brelse(bdev_bh);
+	return copied;
+}
+
+#endif
+/*
+ * prepare buffer tracked read
+ * save a reference to buffer cache entry before submitting I/O
+ */
+static void prepare_buffer_tracked_read(struct buffer_head *bh)
 {
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
 	struct buffer_head *bdev_bh;
+#endif
 	BUG_ON(!buffer_tracked_read(bh));
 	BUG_ON(!buffer_mapped(bh));
 	/* tracked read doesn't work with multiple buffers per page */
 	BUG_ON(bh->b_this_page != bh);
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
 
 	/*
 	 * Try to grab the buffer cache entry before submitting async read
@@ -191,6 +285,16 @@ static int submit_buffer_tracked_read(struct buffer_head *bh)
 	next3_trace_bh_count(bdev_bh);
 	/* override page buffers list with reference to buffer cache entry */
 	bh->b_this_page = bdev_bh;
+#endif
+}
+
+/*
+ * submit buffer tracked read
+ * save a reference to buffer cache entry and submit I/O
+ */
+static int submit_buffer_tracked_read(struct buffer_head *bh)
+{
+	prepare_buffer_tracked_read(bh);
 	submit_bh(READ, bh);
 	return 0;
 }
@@ -201,6 +305,22 @@ static int submit_buffer_tracked_read(struct buffer_head *bh)
  */
 static void end_buffer_tracked_read(struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	BUG_ON(!buffer_tracked_read(bh));
+	/*
+	 * clear the buffer mapping to make sure
+	 * that get_block() will always be called
+	 */
+	clear_buffer_mapped(bh);
+	clear_buffer_tracked_read(bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (atomic_dec_and_test(next3_tracked_readers(bh->b_bdev->bd_super,
+						      bh->b_blocknr)))
+		next3_tracked_readers_wake(bh);
+#else
+	atomic_dec(next3_tracked_readers(bh->b_bdev->bd_super, bh->b_blocknr));
+#endif
+#else
 	struct buffer_head *bdev_bh = bh->b_this_page;
 
 	BUG_ON(!buffer_tracked_read(bh));
@@ -213,7 +333,15 @@ static void end_buffer_tracked_read(struct buffer_head *bh)
 	clear_buffer_mapped(bh);
 	clear_buffer_tracked_read(bh);
 	put_bh_tracked_reader(bdev_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (!buffer_tracked_readers_count(bdev_bh))
+		next3_tracked_readers_wake(bdev_bh);
+#endif
 	put_bh(bdev_bh);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_end_tracked_read(bh);
+#endif
 }
 
 #endif
@@ -408,3 +536,140 @@ int next3_read_full_page(struct page *page, get_block_t *get_block)
 	}
 	return 0;
 }
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READAHEAD
+/*
+ * I/O completion handler for next3_read_full_pages().
+ * Every page in the bio has a single buffer, which completes the (tracked)
+ * read of the buffer and unlocks the page.
+ */
+static void end_bio_async_read(struct bio *bio, int err)
+{
+	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
+
+	do {
+		struct page *page = bvec->bv_page;
+
+		if (--bvec >= bio->bi_io_vec)
+			prefetchw(&bvec->bv_page->flags);
+		end_buffer_async_read(page_buffers(page), uptodate);
+	} while (bvec >= bio->bi_io_vec);
+	bio_put(bio);
+}
+
+static struct bio *next3_submit_bio(struct bio *bio)
+{
+	submit_bio(READ, bio);
+	return NULL;
+}
+
+/*
+ * Add a locked page with a single buffer to @bio, or submit @bio and
+ * start a new one if the page buffer is not contiguous on disk.
+ * If the page cannot be handled simply, fall back to next3_read_full_page().
+ */
+static struct bio *next3_read_page_bio(struct bio *bio, struct page *page,
+		unsigned nr_pages, sector_t *last_block,
+		get_block_t *get_block)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *bh;
+	sector_t iblock = page->index;
+	sector_t lblock;
+	int err;
+
+	lblock = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (inode->i_blkbits != PAGE_CACHE_SHIFT || iblock >= lblock)
+		goto confused;
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, PAGE_CACHE_SIZE, 0);
+	bh = page_buffers(page);
+	if (buffer_uptodate(bh) || buffer_mapped(bh))
+		goto confused;
+
+	err = get_block(inode, iblock, bh, 0);
+	if (err)
+		SetPageError(page);
+	if (!buffer_mapped(bh)) {
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		if (!err)
+			set_buffer_uptodate(bh);
+	}
+	if (!buffer_mapped(bh) || buffer_uptodate(bh)) {
+		/* get_block() might have updated the buffer synchronously */
+		if (buffer_uptodate(bh) && !PageError(page))
+			SetPageUptodate(page);
+		unlock_page(page);
+		return bio;
+	}
+
+	lock_buffer(bh);
+	mark_buffer_async_read(bh);
+	if (buffer_tracked_read(bh)) {
+		prepare_buffer_tracked_read(bh);
+	} else if (buffer_uptodate(bh)) {
+		/* another process brought the buffer uptodate */
+		end_buffer_async_read(bh, 1);
+		return bio;
+	}
+
+	if (bio && (*last_block + 1 != bh->b_blocknr ||
+				bio->bi_bdev != bh->b_bdev))
+		bio = next3_submit_bio(bio);
+alloc_new:
+	if (!bio) {
+		bio = bio_alloc(GFP_NOFS, min_t(int, nr_pages,
+					bio_get_nr_vecs(bh->b_bdev)));
+		bio->bi_sector = bh->b_blocknr << (inode->i_blkbits - 9);
+		bio->bi_bdev = bh->b_bdev;
+		bio->bi_end_io = end_bio_async_read;
+	}
+	if (bio_add_page(bio, page, PAGE_CACHE_SIZE, 0) < PAGE_CACHE_SIZE) {
+		bio = next3_submit_bio(bio);
+		goto alloc_new;
+	}
+	*last_block = bh->b_blocknr;
+	return bio;
+
+confused:
+	if (bio)
+		bio = next3_submit_bio(bio);
+	next3_read_full_page(page, get_block);
+	return bio;
+}
+
+/*
+ * Multi page variant of next3_read_full_page() for readpages().
+ * If the block size equals the page size, contiguous buffers, including
+ * tracked reads through to the block device, are read with large bios.
+ * The tracked read guaranties are preserved, because each page buffer
+ * is prepared for tracked read exactly as in next3_read_full_page() and
+ * is completed by end_buffer_async_read().
+ */
+int next3_read_full_pages(struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages,
+		get_block_t *get_block)
+{
+	struct bio *bio = NULL;
+	sector_t last_block = 0;
+	unsigned page_idx;
+
+	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+
+		prefetchw(&page->flags);
+		list_del(&page->lru);
+		if (!add_to_page_cache_lru(page, mapping,
+					page->index, GFP_KERNEL))
+			bio = next3_read_page_bio(bio, page,
+					nr_pages - page_idx,
+					&last_block, get_block);
+		page_cache_release(page);
+	}
+	BUG_ON(!list_empty(pages));
+	if (bio)
+		next3_submit_bio(bio);
+	return 0;
+}
+#endif
@@ -263,6 +263,69 @@ struct fname {
 	char		name[0];
 };
 
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+/*
+ * The fname records of a readdir batch are allocated from a list of page
+ * sized chunks, newest first.  A record never crosses a chunk, and the
+ * largest record (255 bytes name) always fits in an empty chunk.
+ */
+struct next3_fname_chunk {
+	struct next3_fname_chunk *next;
+	char		data[0];
+};
+
+#define NEXT3_FNAME_CHUNK_DATA \
+	(PAGE_SIZE - offsetof(struct next3_fname_chunk, data))
+
+static struct fname *next3_alloc_fname(struct dir_private_info *info,
+				       int len)
+{
+	struct next3_fname_chunk *chunk = info->fname_chunks;
+	struct fname *fname;
+
+	len = ALIGN(len, sizeof(long));
+	if (!chunk || info->fname_used + len > NEXT3_FNAME_CHUNK_DATA) {
+		chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!chunk)
+			return NULL;
+		chunk->next = info->fname_chunks;
+		info->fname_chunks = chunk;
+		info->fname_used = 0;
+	}
+	fname = (struct fname *)(chunk->data + info->fname_used);
+	info->fname_used += len;
+	memset(fname, 0, sizeof(*fname));
+	return fname;
+}
+
+/*
+ * Release all the fname records of the rbtree in bulk.  The first chunk
+ * is kept for the next batch, unless @all is set.
+ */
+static void next3_free_fnames(struct dir_private_info *info, int all)
+{
+	struct next3_fname_chunk *chunk = info->fname_chunks;
+
+	info->root = RB_ROOT;
+	info->fname_used = 0;
+	if (!chunk)
+		return;
+	if (all) {
+		info->fname_chunks = NULL;
+	} else {
+		info->fname_chunks = chunk;
+		chunk = chunk->next;
+		info->fname_chunks->next = NULL;
+	}
+	while (chunk) {
+		struct next3_fname_chunk *next = chunk->next;
+
+		kfree(chunk);
+		chunk = next;
+	}
+}
+
+#else
 /*
  * This functoin implements a non-recursive way of freeing all of the
  * nodes in the red-black tree.
@@ -305,6 +368,7 @@ static void free_rb_tree_fname(struct rb_root *root)
 		n = parent;
 	}
 }
+#endif
 
 
 static struct dir_private_info *next3_htree_create_dir_info(loff_t pos)
@@ -321,7 +385,11 @@ static struct dir_private_info *next3_htree_create_dir_info(loff_t pos)
 
 void next3_htree_free_dir_info(struct dir_private_info *p)
 {
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+	next3_free_fnames(p, 1);
+#else
 	free_rb_tree_fname(&p->root);
+#endif
 	kfree(p);
 }
 
@@ -342,7 +410,11 @@ int next3_htree_store_dirent(struct file *dir_file, __u32 hash,
 
 	/* Create and allocate the fname structure */
 	len = sizeof(struct fname) + dirent->name_len + 1;
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+	new_fn = next3_alloc_fname(info, len);
+#else
 	new_fn = kzalloc(len, GFP_KERNEL);
+#endif
 	if (!new_fn)
 		return -ENOMEM;
 	new_fn->hash = hash;
@@ -441,7 +513,11 @@ static int next3_dx_readdir(struct file * filp,
 
 	/* Some one has messed with f_pos; reset the world */
 	if (info->last_pos != filp->f_pos) {
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+		next3_free_fnames(info, 0);
+#else
 		free_rb_tree_fname(&info->root);
+#endif
 		info->curr_node = NULL;
 		info->extra_fname = NULL;
 		info->curr_hash = pos2maj_hash(filp->f_pos);
@@ -469,7 +545,11 @@ static int next3_dx_readdir(struct file * filp,
 		if ((!info->curr_node) ||
 		    (filp->f_version != inode->i_version)) {
 			info->curr_node = NULL;
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+			next3_free_fnames(info, 0);
+#else
 			free_rb_tree_fname(&info->root);
+#endif
 			filp->f_version = inode->i_version;
 			ret = next3_htree_fill_tree(filp, info->curr_hash,
 						   info->curr_minor_hash,
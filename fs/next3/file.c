@@ -24,6 +24,9 @@
 #include <linux/fs.h>
 #include <linux/jbd.h>
 #include <linux/quotaops.h>
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_SPLICE
+#include <linux/pipe_fs_i.h>
+#endif
 #include "next3.h"
 #include "next3_jbd.h"
 #include "xattr.h"
@@ -43,6 +46,82 @@ static int next3_file_open(struct inode *inode, struct file *filp)
 	return dquot_file_open(inode, filp);
 }
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_SPLICE
+/*
+ * Snapshot image pages are read with tracked reads into the snapshot page
+ * cache and are passed to the pipe without copy through user space.
+ * A snapshot image is typically streamed once, so the pages behind the
+ * splice position are dropped, to keep the snapshot export from evicting
+ * the page cache of the live file system.  Mapped pages (e.g. of a mounted
+ * snapshot image) are not dropped.
+ */
+static ssize_t next3_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len,
+		unsigned int flags)
+{
+	struct address_space *mapping = in->f_mapping;
+	pgoff_t index = *ppos >> PAGE_CACHE_SHIFT;
+	/* pages which are still referenced by the pipe are not dropped */
+	pgoff_t behind = 4 * pipe->buffers;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_SPLICE_NFS
+	/* last page read before this splice (see __generic_file_splice_read) */
+	pgoff_t prev = in->f_ra.prev_pos >> PAGE_CACHE_SHIFT;
+	/* a concurrent out of order reader (nfsd) must not drop behind */
+	int sequential = index == 0 || (in->f_ra.prev_pos != -1 &&
+			(index == prev || index == prev + 1));
+#endif
+	ssize_t ret;
+
+	ret = generic_file_splice_read(in, ppos, pipe, len, flags);
+	if (ret <= 0 || !next3_snapshot_file(mapping->host))
+		return ret;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	atomic_long_add(ret, &NEXT3_SNAP_I(mapping->host)->i_snap_read_bytes);
+#endif
+	if (in->f_mode & FMODE_RANDOM)
+		return ret;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_SPLICE_NFS
+	if (!sequential)
+		return ret;
+#endif
+
+	if (index > 0)
+		invalidate_mapping_pages(mapping,
+			index > behind ? index - behind : 0, index - 1);
+	return ret;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+/*
+ * Count the bytes read from snapshot files.  With snapshot_read_drop set,
+ * the pages behind the read position are dropped after every sequential
+ * read, so a scan of a snapshot image does not evict the page cache of
+ * the live file system.  Pages of the current read and pages that were
+ * read ahead are kept.
+ */
+static ssize_t next3_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	struct address_space *mapping = filp->f_mapping;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	ssize_t ret;
+
+	ret = generic_file_aio_read(iocb, iov, nr_segs, pos);
+	if (ret <= 0 || !next3_snapshot_file(mapping->host))
+		return ret;
+	atomic_long_add(ret, &NEXT3_SNAP_I(mapping->host)->i_snap_read_bytes);
+	if (!NEXT3_SB(mapping->host->i_sb)->s_snapshot_read_drop ||
+	    (filp->f_mode & FMODE_RANDOM))
+		return ret;
+
+	if (index > 0)
+		invalidate_mapping_pages(mapping, 0, index - 1);
+	return ret;
+}
+
 #endif
 /*
  * Called when an inode is released. Note that this is different
@@ -59,9 +138,9 @@ static int next3_release_file (struct inode * inode, struct file * filp)
 	if ((filp->f_mode & FMODE_WRITE) &&
 			(atomic_read(&inode->i_writecount) == 1))
 	{
-		mutex_lock(&NEXT3_I(inode)->truncate_mutex);
+		down_write(&NEXT3_I(inode)->truncate_sem);
 		next3_discard_reservation(inode);
-		mutex_unlock(&NEXT3_I(inode)->truncate_mutex);
+		up_write(&NEXT3_I(inode)->truncate_sem);
 	}
 	if (is_dx(inode) && filp->private_data)
 		next3_htree_free_dir_info(filp->private_data);
@@ -69,17 +148,106 @@ static int next3_release_file (struct inode * inode, struct file * filp)
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_BATCHED_WRITE
+/*
+ * Like generic_file_aio_write(), but a large buffered write is written by
+ * next3_write_batched() first.  The tail of the write, and any write that
+ * next3_write_batched() does not handle, goes through the per-page
+ * write_begin/write_end path.
+ */
+static ssize_t next3_file_aio_write(struct kiocb *iocb,
+				    const struct iovec *iov,
+				    unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	size_t count = 0;
+	ssize_t written = 0;
+	ssize_t err;
+
+	if ((file->f_flags & O_DIRECT) || next3_should_journal_data(inode) ||
+	    iov_length(iov, nr_segs) < 2 * PAGE_CACHE_SIZE)
+		return generic_file_aio_write(iocb, iov, nr_segs, pos);
+
+	BUG_ON(iocb->ki_pos != pos);
+	err = generic_segment_checks(iov, &nr_segs, &count, VERIFY_READ);
+	if (err)
+		return err;
+
+	mutex_lock(&inode->i_mutex);
+	vfs_check_frozen(inode->i_sb, SB_FREEZE_WRITE);
+	/* We can write back this queue in page reclaim */
+	current->backing_dev_info = mapping->backing_dev_info;
+	err = generic_write_checks(file, &pos, &count, 0);
+	if (err || !count)
+		goto out;
+	err = file_remove_suid(file);
+	if (err)
+		goto out;
+	file_update_time(file);
+
+	written = next3_write_batched(file, iov, nr_segs, pos, count);
+	iocb->ki_pos = pos + written;
+	if (written < count)
+		written = generic_file_buffered_write(iocb, iov, nr_segs,
+				pos + written, &iocb->ki_pos,
+				count - written, written);
+out:
+	current->backing_dev_info = NULL;
+	mutex_unlock(&inode->i_mutex);
+
+	if (written > 0) {
+		err = generic_write_sync(file, pos, written);
+		if (err < 0)
+			written = err;
+	}
+	return written ? written : err;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_PAGE_MKWRITE
+static const struct vm_operations_struct next3_file_vm_ops = {
+	.fault		= filemap_fault,
+	.page_mkwrite	= next3_page_mkwrite,
+};
+
+static int next3_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct address_space *mapping = file->f_mapping;
+
+	if (!mapping->a_ops->readpage)
+		return -ENOEXEC;
+	file_accessed(file);
+	vma->vm_ops = &next3_file_vm_ops;
+	vma->vm_flags |= VM_CAN_NONLINEAR;
+	return 0;
+}
+
+#endif
 const struct file_operations next3_file_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= do_sync_read,
 	.write		= do_sync_write,
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	.aio_read	= next3_file_aio_read,
+#else
 	.aio_read	= generic_file_aio_read,
+#endif
+#ifdef CONFIG_NEXT3_FS_BATCHED_WRITE
+	.aio_write	= next3_file_aio_write,
+#else
 	.aio_write	= generic_file_aio_write,
+#endif
 	.unlocked_ioctl	= next3_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= next3_compat_ioctl,
 #endif
+#ifdef CONFIG_NEXT3_FS_PAGE_MKWRITE
+	.mmap		= next3_file_mmap,
+#else
 	.mmap		= generic_file_mmap,
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_PERM
 	.open		= next3_file_open,
 #else
@@ -87,7 +255,11 @@ const struct file_operations next3_file_operations = {
 #endif
 	.release	= next3_release_file,
 	.fsync		= next3_sync_file,
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_SPLICE
+	.splice_read	= next3_file_splice_read,
+#else
 	.splice_read	= generic_file_splice_read,
+#endif
 	.splice_write	= generic_file_splice_write,
 };
 
@@ -28,8 +28,90 @@
 #include <linux/sched.h>
 #include <linux/writeback.h>
 #include <linux/jbd.h>
+#ifdef CONFIG_NEXT3_FS_FSYNC_BATCH
+#include <linux/hrtimer.h>
+#endif
 #include "next3.h"
 #include "next3_jbd.h"
+#include "snapshot.h"
+
+#ifdef CONFIG_NEXT3_FS_FSYNC_BATCH
+/*
+ * Batch concurrent fsync callers into one commit, the way journal_stop()
+ * batches synchronous handles: if the transaction to commit is still
+ * running and it has been running for less than the average commit time,
+ * sleep for the difference, so that other fsync callers can join it.
+ *
+ * Don't wait if this process was the last one to sync the journal: a
+ * single process doing a stream of fsyncs has nobody to wait for.
+ */
+static void next3_sync_file_batch(journal_t *journal, tid_t commit_tid)
+{
+	transaction_t *transaction;
+	u64 commit_time, trans_time;
+	ktime_t start_time;
+	pid_t pid = current->pid;
+
+	if (journal->j_last_sync_writer == pid)
+		return;
+	journal->j_last_sync_writer = pid;
+
+	spin_lock(&journal->j_state_lock);
+	transaction = journal->j_running_transaction;
+	if (!transaction || transaction->t_tid != commit_tid) {
+		/* already committing or committed */
+		spin_unlock(&journal->j_state_lock);
+		return;
+	}
+	commit_time = journal->j_average_commit_time;
+	start_time = transaction->t_start_time;
+	spin_unlock(&journal->j_state_lock);
+
+	commit_time = min_t(u64, commit_time, 1000*jiffies_to_usecs(1));
+	trans_time = ktime_to_ns(ktime_sub(ktime_get(), start_time));
+	if (trans_time < commit_time) {
+		ktime_t expires = ktime_add_ns(ktime_get(),
+					       commit_time - trans_time);
+
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	}
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+/*
+ * Check if fdatasync() of @inode has nothing to commit: the last
+ * transaction that changed the inode allocation or size, @commit_tid,
+ * has already been committed, so the only dirty metadata left is the
+ * timestamps.
+ *
+ * With snapshots, a dirty page may still have a move-on-write pending,
+ * which allocates a new block when it is written back.  The caller has
+ * already written back and waited on the pages, so a page that is dirty
+ * again was written concurrently and we take the slow path for it.
+ *
+ * Returns -EIO if the journal was aborted, like log_wait_commit() would.
+ */
+static int next3_sync_file_data_only(struct inode *inode, journal_t *journal,
+				     tid_t commit_tid)
+{
+	int committed;
+
+	if (is_journal_aborted(journal))
+		return -EIO;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	if (next3_snapshot_should_move_data(inode) &&
+	    mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY))
+		return 0;
+#endif
+	spin_lock(&journal->j_state_lock);
+	committed = tid_geq(journal->j_commit_sequence, commit_tid);
+	spin_unlock(&journal->j_state_lock);
+	return committed;
+}
+
+#endif
 
 /*
  * akpm: A new design for next3_sync_file().
@@ -43,7 +125,11 @@
  * inode to disk.
  */
 
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+static int __next3_sync_file(struct file *file, int datasync)
+#else
 int next3_sync_file(struct file *file, int datasync)
+#endif
 {
 	struct inode *inode = file->f_mapping->host;
 	struct next3_inode_info *ei = NEXT3_I(inode);
@@ -73,14 +159,46 @@ int next3_sync_file(struct file *file, int datasync)
 	if (next3_should_journal_data(inode))
 		return next3_force_commit(inode->i_sb);
 
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	/* fdatasync() doesn't care about timestamps */
+	if (!datasync) {
+		ret = next3_flush_lazy_time(inode);
+		if (ret)
+			return ret;
+	}
+
+#endif
 	if (datasync)
 		commit_tid = atomic_read(&ei->i_datasync_tid);
 	else
 		commit_tid = atomic_read(&ei->i_sync_tid);
 
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+	/*
+	 * fdatasync() of a data overwrite: the data pages were already
+	 * written by the caller, so we only need to flush the disk cache.
+	 */
+	if (datasync) {
+		ret = next3_sync_file_data_only(inode, journal, commit_tid);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			ret = 0;
+			if (test_opt(inode->i_sb, BARRIER))
+				ret = blkdev_issue_flush(inode->i_sb->s_bdev,
+						GFP_KERNEL, NULL,
+						BLKDEV_IFL_WAIT);
+			return ret;
+		}
+	}
+#endif
+
 	if (test_opt(inode->i_sb, BARRIER) &&
 	    !journal_trans_will_send_data_barrier(journal, commit_tid))
 		needs_barrier = 1;
+#ifdef CONFIG_NEXT3_FS_FSYNC_BATCH
+	next3_sync_file_batch(journal, commit_tid);
+#endif
 	log_start_commit(journal, commit_tid);
 	ret = log_wait_commit(journal, commit_tid);
 
@@ -94,3 +212,16 @@ int next3_sync_file(struct file *file, int datasync)
 				BLKDEV_IFL_WAIT);
 	return ret;
 }
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+
+int next3_sync_file(struct file *file, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	int ret;
+
+	trace_next3_sync_file_enter(inode, datasync);
+	ret = __next3_sync_file(file, datasync);
+	trace_next3_sync_file_exit(inode, ret);
+	return ret;
+}
+#endif
@@ -13,6 +13,9 @@
 #include <linux/jbd.h>
 #include "next3.h"
 #include <linux/cryptohash.h>
+#ifdef CONFIG_NEXT3_FS_DX_HASH_MURMUR
+#include <asm/unaligned.h>
+#endif
 
 #define DELTA 0x9E3779B9
 
@@ -34,6 +37,79 @@ static void TEA_transform(__u32 buf[4], __u32 const in[])
 }
 
 
+#ifdef CONFIG_NEXT3_FS_DX_HASH_MURMUR
+#define MURMUR_C1 0xcc9e2d51
+#define MURMUR_C2 0x1b873593
+
+static inline __u32 murmur_fmix(__u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * MurmurHash3 with two lanes, seeded from the 4 seed words.  The name is
+ * read 4 bytes at a time as little endian words, so the hash is the same on
+ * all architectures and doesn't depend on the signedness of char.  Both
+ * lanes mix every word, with different rotations, and are cross mixed at
+ * the end, so names with the same major hash rarely share the minor hash.
+ */
+static void dx_murmur_hash(const char *name, int len, const __u32 *seed,
+			   __u32 *hash, __u32 *minor_hash)
+{
+	const unsigned char *ucp = (const unsigned char *) name;
+	__u32 h1 = seed[0] ^ seed[2], h2 = seed[1] ^ seed[3];
+	__u32 k;
+	int n;
+
+	for (n = len >> 2; n; n--, ucp += 4) {
+		k = get_unaligned_le32(ucp);
+		k *= MURMUR_C1;
+		k = rol32(k, 15);
+		k *= MURMUR_C2;
+
+		h1 ^= k;
+		h1 = rol32(h1, 13);
+		h1 = h1 * 5 + 0xe6546b64;
+
+		h2 ^= k;
+		h2 = rol32(h2, 17);
+		h2 = h2 * 5 + 0x52dce729;
+	}
+
+	k = 0;
+	switch (len & 3) {
+	case 3:
+		k ^= ucp[2] << 16;
+	case 2:
+		k ^= ucp[1] << 8;
+	case 1:
+		k ^= ucp[0];
+		k *= MURMUR_C1;
+		k = rol32(k, 15);
+		k *= MURMUR_C2;
+		h1 ^= k;
+		h2 ^= rol32(k, 16);
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = murmur_fmix(h1);
+	h2 = murmur_fmix(h2);
+	h1 += h2;
+	h2 += h1;
+
+	*hash = h1;
+	*minor_hash = h2;
+}
+
+#endif
 /* The old legacy hash */
 static __u32 dx_hack_hash_unsigned(const char *name, int len)
 {
@@ -195,6 +271,11 @@ int next3fs_dirhash(const char *name, int len, struct dx_hash_info *hinfo)
 		hash = buf[0];
 		minor_hash = buf[1];
 		break;
+#ifdef CONFIG_NEXT3_FS_DX_HASH_MURMUR
+	case DX_HASH_MURMUR:
+		dx_murmur_hash(name, len, buf, &hash, &minor_hash);
+		break;
+#endif
 	default:
 		hinfo->hash = 0;
 		return -1;
@@ -28,6 +28,15 @@
 
 #include "xattr.h"
 #include "acl.h"
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+#include "snapshot.h"
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "snapshot.h"
+#endif
 
 /*
  * ialloc.c contains the inodes allocation and deallocation routines
@@ -70,6 +79,408 @@ error_out:
 	return bh;
 }
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+/*
+ * Lazy inode table zeroing.  Online resize does not write the inode tables
+ * of the groups it adds.  It flags them NEXT3_BG_ITABLE_UNINIT and sets the
+ * itable_uninit feature, and the itable work zeroes them in the background.
+ * Until then, the inode bitmap of the group tells which inodes are in use.
+ * next3_new_inode() allocates from the group as if its table was zeroed,
+ * because a new inode is written in full and free inodes are never read.
+ *
+ * s_itable_mutex serializes the zeroing of a group with setting bits in its
+ * inode bitmap.  It nests inside a journal handle.
+ */
+static struct workqueue_struct *next3_itable_wq;
+
+int __init init_next3_itable(void)
+{
+	next3_itable_wq = create_singlethread_workqueue("next3-itable");
+	return next3_itable_wq ? 0 : -ENOMEM;
+}
+
+void exit_next3_itable(void)
+{
+	destroy_workqueue(next3_itable_wq);
+}
+
+static inline int next3_itable_uninit(struct next3_group_desc *gdp)
+{
+	return gdp->bg_flags & cpu_to_le16(NEXT3_BG_ITABLE_UNINIT);
+}
+
+/*
+ * Returns the first group from @group on with a non zeroed inode table,
+ * or the groups count if there is none.
+ */
+static unsigned long next3_itable_next_group(struct super_block *sb,
+					     unsigned long group)
+{
+	unsigned long ngroups = NEXT3_SB(sb)->s_groups_count;
+	struct next3_group_desc *gdp;
+
+	smp_rmb();
+	for (; group < ngroups; group++) {
+		gdp = next3_get_group_desc(sb, group, NULL);
+		if (gdp && next3_itable_uninit(gdp))
+			break;
+	}
+	return group;
+}
+
+/*
+ * Inode table block @i of the group can be zeroed in place if none of its
+ * inodes is in use, its buffer is not waiting to be written by the journal
+ * (a recently freed inode) and it is not part of the active snapshot image.
+ */
+static int next3_itable_block_idle(struct super_block *sb,
+				   struct buffer_head *bitmap_bh,
+				   next3_fsblk_t block, int i)
+{
+	int ipb = NEXT3_SB(sb)->s_inodes_per_block;
+	struct buffer_head *bh;
+	int idle;
+
+	if (next3_find_next_bit(bitmap_bh->b_data, (i + 1) * ipb, i * ipb) <
+	    (i + 1) * ipb)
+		return 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT
+	if (next3_snapshot_has_active(sb) &&
+	    block < SNAPSHOT_BLOCKS(next3_snapshot_has_active(sb)))
+		return 0;
+#endif
+	bh = sb_find_get_block(sb, block);
+	if (!bh)
+		return 1;
+	idle = !buffer_jbd(bh) && !buffer_dirty(bh);
+	brelse(bh);
+	return idle;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+/* max. inode table blocks zeroed through the journal by one handle */
+#define NEXT3_ITABLE_CLEAN_BATCH	16
+
+/*
+ * Zero the free inodes of @count inode table blocks from block @i through
+ * the journal.  The blocks are in use by the active snapshot, so get write
+ * access to all of them at once and COW them to the snapshot in one pass.
+ */
+static int next3_itable_clean_blocks(struct super_block *sb,
+				     struct buffer_head *bitmap_bh,
+				     next3_fsblk_t block, int i, int count)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int ipb = sbi->s_inodes_per_block;
+	int isize = NEXT3_INODE_SIZE(sb);
+	struct buffer_head *bhs[NEXT3_ITABLE_CLEAN_BATCH];
+	int used[NEXT3_ITABLE_CLEAN_BATCH];
+	handle_t *handle;
+	int j, k, n = 0, err = 0, err2;
+
+	handle = next3_journal_start_sb(sb, count);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	mutex_lock(&sbi->s_itable_mutex);
+	for (k = 0; k < count; k++) {
+		used[k] = next3_find_next_bit(bitmap_bh->b_data,
+				(i + k + 1) * ipb, (i + k) * ipb) <
+			(i + k + 1) * ipb;
+		bhs[k] = used[k] ? sb_bread(sb, block + k) :
+			sb_getblk(sb, block + k);
+		if (!bhs[k]) {
+			err = -EIO;
+			goto out;
+		}
+		n++;
+	}
+	err = next3_journal_get_write_access_blocks(handle, NULL, bhs, n);
+	if (err)
+		goto out;
+	for (k = 0; k < n && !err; k++) {
+		lock_buffer(bhs[k]);
+		for (j = 0; j < ipb; j++)
+			if (!used[k] || !next3_test_bit((i + k) * ipb + j,
+							bitmap_bh->b_data))
+				memset(bhs[k]->b_data + j * isize, 0, isize);
+		set_buffer_uptodate(bhs[k]);
+		unlock_buffer(bhs[k]);
+		err = next3_journal_dirty_metadata(handle, bhs[k]);
+	}
+out:
+	while (n--)
+		brelse(bhs[n]);
+	mutex_unlock(&sbi->s_itable_mutex);
+	err2 = next3_journal_stop(handle);
+	return err ? err : err2;
+}
+#else
+/*
+ * Zero the free inodes of inode table block @i through the journal.
+ */
+static int next3_itable_clean_block(struct super_block *sb,
+				    struct buffer_head *bitmap_bh,
+				    next3_fsblk_t block, int i)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int ipb = sbi->s_inodes_per_block;
+	int isize = NEXT3_INODE_SIZE(sb);
+	struct buffer_head *bh;
+	handle_t *handle;
+	int j, used, err, err2;
+
+	handle = next3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	mutex_lock(&sbi->s_itable_mutex);
+	used = next3_find_next_bit(bitmap_bh->b_data, (i + 1) * ipb, i * ipb) <
+		(i + 1) * ipb;
+	bh = used ? sb_bread(sb, block) : sb_getblk(sb, block);
+	err = -EIO;
+	if (!bh)
+		goto out;
+	err = next3_journal_get_write_access(handle, bh);
+	if (err)
+		goto out_bh;
+	lock_buffer(bh);
+	for (j = 0; j < ipb; j++)
+		if (!used || !next3_test_bit(i * ipb + j, bitmap_bh->b_data))
+			memset(bh->b_data + j * isize, 0, isize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	err = next3_journal_dirty_metadata(handle, bh);
+out_bh:
+	brelse(bh);
+out:
+	mutex_unlock(&sbi->s_itable_mutex);
+	err2 = next3_journal_stop(handle);
+	return err ? err : err2;
+}
+#endif
+
+/*
+ * Zero the inode table of @group and clear its NEXT3_BG_ITABLE_UNINIT flag.
+ * The idle blocks are zeroed in place by one batch of writes.  The other
+ * blocks are then zeroed through the journal, and the in place writes are
+ * done before the flag is cleared.
+ */
+static int next3_zero_itable(struct super_block *sb, unsigned long group)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int itblocks = sbi->s_itb_per_group;
+	int shift = sb->s_blocksize_bits - 9;
+	struct buffer_head *bitmap_bh, *gdb, *bh;
+	struct next3_group_desc *gdp;
+	struct blk_zeroout_batch zb;
+	unsigned long *zeroed;
+	next3_fsblk_t itable;
+	handle_t *handle;
+	int i, j, err = 0, err2;
+
+	gdp = next3_get_group_desc(sb, group, &gdb);
+	if (!gdp)
+		return -EIO;
+	itable = le32_to_cpu(gdp->bg_inode_table);
+	zeroed = kcalloc(BITS_TO_LONGS(itblocks), sizeof(long), GFP_NOFS);
+	if (!zeroed)
+		return -ENOMEM;
+	bitmap_bh = read_inode_bitmap(sb, group);
+	if (!bitmap_bh) {
+		kfree(zeroed);
+		return -EIO;
+	}
+
+	mutex_lock(&sbi->s_itable_mutex);
+	if (!next3_itable_uninit(gdp)) {
+		mutex_unlock(&sbi->s_itable_mutex);
+		goto out;
+	}
+	blk_zeroout_batch_init(&zb);
+	for (i = 0; i < itblocks && !err; i = j + 1) {
+		for (j = i; j < itblocks; j++)
+			if (!next3_itable_block_idle(sb, bitmap_bh,
+						     itable + j, j))
+				break;
+		if (j == i)
+			continue;
+		err = blkdev_issue_zeroout_async(sb->s_bdev,
+					(sector_t)(itable + i) << shift,
+					(sector_t)(j - i) << shift,
+					GFP_NOFS, &zb);
+		bitmap_set(zeroed, i, j - i);
+	}
+	err2 = blk_zeroout_batch_wait(&zb);
+	if (!err)
+		err = err2;
+	for (i = 0; i < itblocks && !err; i++) {
+		if (!test_bit(i, zeroed))
+			continue;
+		bh = sb_find_get_block(sb, itable + i);
+		if (!bh)
+			continue;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		brelse(bh);
+	}
+	mutex_unlock(&sbi->s_itable_mutex);
+	if (err)
+		goto out;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+	/* zero runs of blocks that were not zeroed in place */
+	i = find_next_zero_bit(zeroed, itblocks, 0);
+	while (i < itblocks && !err) {
+		j = find_next_bit(zeroed,
+				  min(itblocks, i + NEXT3_ITABLE_CLEAN_BATCH), i);
+		err = next3_itable_clean_blocks(sb, bitmap_bh, itable + i, i,
+						j - i);
+		cond_resched();
+		i = find_next_zero_bit(zeroed, itblocks, j);
+	}
+#else
+	for (i = 0; i < itblocks && !err; i++) {
+		if (test_bit(i, zeroed))
+			continue;
+		err = next3_itable_clean_block(sb, bitmap_bh, itable + i, i);
+		cond_resched();
+	}
+#endif
+	if (err)
+		goto out;
+
+	handle = next3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+	mutex_lock(&sbi->s_itable_mutex);
+	err = next3_journal_get_write_access(handle, gdb);
+	if (!err) {
+		spin_lock(sb_bgl_lock(sbi, group));
+		gdp->bg_flags &= cpu_to_le16(~NEXT3_BG_ITABLE_UNINIT);
+		spin_unlock(sb_bgl_lock(sbi, group));
+		err = next3_journal_dirty_metadata(handle, gdb);
+	}
+	mutex_unlock(&sbi->s_itable_mutex);
+	err2 = next3_journal_stop(handle);
+	if (!err)
+		err = err2;
+out:
+	brelse(bitmap_bh);
+	kfree(zeroed);
+	return err;
+}
+
+/*
+ * Zero one inode table per run and requeue.  When there are none left,
+ * clear the itable_uninit feature, unless resize has added new groups.
+ */
+static void next3_itable_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(work, struct next3_sb_info,
+						 s_itable_work);
+	struct super_block *sb = sbi->s_sb;
+	unsigned long group;
+	handle_t *handle;
+	int err;
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+
+	group = next3_itable_next_group(sb, sbi->s_itable_group);
+	if (group < sbi->s_groups_count) {
+		err = next3_zero_itable(sb, group);
+		if (err) {
+			next3_warning(sb, __func__, "failed to zero inode "
+				      "table of group %lu (err=%d)", group, err);
+			return;
+		}
+		sbi->s_itable_group = group + 1;
+		queue_work(next3_itable_wq, &sbi->s_itable_work);
+		return;
+	}
+
+	handle = next3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		return;
+	mutex_lock(&sbi->s_resize_lock);
+	group = next3_itable_next_group(sb, 0);
+	if (group < sbi->s_groups_count) {
+		sbi->s_itable_group = group;
+		queue_work(next3_itable_wq, &sbi->s_itable_work);
+	} else if (!next3_journal_get_write_access(handle, sbi->s_sbh)) {
+		NEXT3_CLEAR_RO_COMPAT_FEATURE(sb,
+				NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT);
+		next3_journal_dirty_metadata(handle, sbi->s_sbh);
+	}
+	mutex_unlock(&sbi->s_resize_lock);
+	next3_journal_stop(handle);
+}
+
+/*
+ * next3_itable_init() - called on mount time
+ */
+void next3_itable_init(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_sb = sb;
+	mutex_init(&sbi->s_itable_mutex);
+	INIT_WORK(&sbi->s_itable_work, next3_itable_work);
+	sbi->s_itable_group = 0;
+}
+
+/*
+ * next3_itable_start() - start zeroing the inode tables in the background.
+ * Called when mounted or remounted read-write and after resize.
+ */
+void next3_itable_start(struct super_block *sb)
+{
+	if (!(sb->s_flags & MS_RDONLY) &&
+	    NEXT3_HAS_RO_COMPAT_FEATURE(sb,
+			NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT))
+		queue_work(next3_itable_wq, &NEXT3_SB(sb)->s_itable_work);
+}
+
+/*
+ * next3_itable_stop() - stop zeroing the inode tables.
+ * Called before remount read-only and from put_super().  The work goes on
+ * from the group it stopped at on next read-write mount.
+ */
+void next3_itable_stop(struct super_block *sb)
+{
+	cancel_work_sync(&NEXT3_SB(sb)->s_itable_work);
+}
+
+/*
+ * next3_itable_free_inode() - is @ino a free inode in a non zeroed inode
+ * table?  Such an inode holds garbage and must not be read.
+ */
+int next3_itable_free_inode(struct super_block *sb, unsigned long ino)
+{
+	unsigned long group = (ino - 1) / NEXT3_INODES_PER_GROUP(sb);
+	struct next3_group_desc *gdp;
+	struct buffer_head *bitmap_bh;
+	int free;
+
+	gdp = next3_get_group_desc(sb, group, NULL);
+	if (!gdp || !next3_itable_uninit(gdp))
+		return 0;
+	bitmap_bh = read_inode_bitmap(sb, group);
+	if (!bitmap_bh)
+		return 1;
+	free = !next3_test_bit((ino - 1) % NEXT3_INODES_PER_GROUP(sb),
+			       bitmap_bh->b_data);
+	brelse(bitmap_bh);
+	return free;
+}
+
+#endif
+
 /*
  * NOTE! When we get the inode, we're the only people
  * that have access to it, and as such there are no
@@ -125,6 +536,11 @@ void next3_free_inode (handle_t *handle, struct inode * inode)
 	 */
 	dquot_initialize(inode);
 	next3_xattr_delete_inode(handle, inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	/* free the quota of moved blocks before dropping the dquots */
+	if (handle->h_dquot_inode == inode)
+		next3_snapshot_dquot_flush(handle);
+#endif
 	dquot_free_inode(inode);
 	dquot_drop(inode);
 
@@ -167,6 +583,15 @@ void next3_free_inode (handle_t *handle, struct inode * inode)
 			le16_add_cpu(&gdp->bg_free_inodes_count, 1);
 			if (is_directory)
 				le16_add_cpu(&gdp->bg_used_dirs_count, -1);
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+			if (bit < sbi->s_group_info[block_group].bg_inode_hint)
+				sbi->s_group_info[block_group].bg_inode_hint =
+					bit;
+#endif
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+			next3_flex_stats_add(sb, block_group, 1, 0,
+					     is_directory ? -1 : 0);
+#endif
 			spin_unlock(sb_bgl_lock(sbi, block_group));
 			percpu_counter_inc(&sbi->s_freeinodes_counter);
 			if (is_directory)
@@ -251,7 +676,11 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
 #define INODE_COST 64
 #define BLOCK_COST 256
 
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+static int find_group_orlov_desc(struct super_block *sb, struct inode *parent)
+#else
 static int find_group_orlov(struct super_block *sb, struct inode *parent)
+#endif
 {
 	int parent_group = NEXT3_I(parent)->i_block_group;
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
@@ -349,13 +778,270 @@ fallback:
 	return -1;
 }
 
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+struct orlov_stats {
+	int free_inodes;
+	int free_blocks;
+	int used_dirs;
+};
+
+static inline void get_orlov_stats(struct next3_sb_info *sbi, int flex,
+				   struct orlov_stats *stats)
+{
+	struct next3_flex_stats *fs = &sbi->s_flex_stats[flex];
+
+	stats->free_inodes = atomic_read(&fs->free_inodes);
+	stats->free_blocks = atomic_read(&fs->free_blocks);
+	stats->used_dirs = atomic_read(&fs->used_dirs);
+}
+
+/*
+ * Pick a group for a new directory inside flex group @flex, by the rules
+ * of Orlov's allocator applied to the group descriptors of @flex only.
+ * If no group passes, the group with the most free inodes is returned.
+ */
+static int find_group_in_flex(struct super_block *sb, struct inode *parent,
+			      int flex, int topdir)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int ngroups = sbi->s_groups_count;
+	int inodes_per_group = NEXT3_INODES_PER_GROUP(sb);
+	int first = flex << sbi->s_log_groups_per_flex;
+	int count = min(1 << sbi->s_log_groups_per_flex, ngroups - first);
+	int parent_group = NEXT3_I(parent)->i_block_group;
+	unsigned int avefreei, ndirs;
+	next3_fsblk_t avefreeb;
+	int max_dirs, min_inodes;
+	next3_grpblk_t min_blocks;
+	int best_group = -1, best_ndir = inodes_per_group;
+	int most_group = -1, most_freei = 0;
+	int group, freei, start = 0, i;
+	struct next3_group_desc *desc;
+
+	avefreei = percpu_counter_read_positive(&sbi->s_freeinodes_counter) /
+		ngroups;
+	avefreeb = percpu_counter_read_positive(&sbi->s_freeblocks_counter) /
+		ngroups;
+	ndirs = percpu_counter_read_positive(&sbi->s_dirs_counter);
+	max_dirs = ndirs / ngroups + inodes_per_group / 16;
+	min_inodes = avefreei - inodes_per_group / 4;
+	min_blocks = avefreeb - NEXT3_BLOCKS_PER_GROUP(sb) / 4;
+
+	/* Parent's group is preferred for a non top level directory */
+	if (!topdir && parent_group >= first && parent_group < first + count)
+		start = parent_group - first;
+
+	for (i = 0; i < count; i++) {
+		group = first + (start + i) % count;
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (!desc || !desc->bg_free_inodes_count)
+			continue;
+		freei = le16_to_cpu(desc->bg_free_inodes_count);
+		if (freei > most_freei) {
+			most_group = group;
+			most_freei = freei;
+		}
+		if (topdir) {
+			if (le16_to_cpu(desc->bg_used_dirs_count) >= best_ndir)
+				continue;
+			if (freei < avefreei)
+				continue;
+			if (le16_to_cpu(desc->bg_free_blocks_count) < avefreeb)
+				continue;
+			best_group = group;
+			best_ndir = le16_to_cpu(desc->bg_used_dirs_count);
+			continue;
+		}
+		if (le16_to_cpu(desc->bg_used_dirs_count) >= max_dirs)
+			continue;
+		if (freei < min_inodes)
+			continue;
+		if (le16_to_cpu(desc->bg_free_blocks_count) < min_blocks)
+			continue;
+		return group;
+	}
+	return best_group >= 0 ? best_group : most_group;
+}
+
+/*
+ * Orlov's allocator for directories, with flex stats.
+ *
+ * The rules above first pick a flex group by its aggregate counts and
+ * then a group inside it by the group descriptors, so a mkdir reads the
+ * descriptors of a single flex group instead of scanning all of them.
+ */
+static int find_group_orlov(struct super_block *sb, struct inode *parent)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int ngroups = sbi->s_groups_count;
+	int inodes_per_group = NEXT3_INODES_PER_GROUP(sb);
+	int log = sbi->s_log_groups_per_flex;
+	int flex_size = 1 << log;
+	int nflex = (ngroups + flex_size - 1) >> log;
+	int parent_flex = NEXT3_I(parent)->i_block_group >> log;
+	unsigned int freei, avefreei, ndirs;
+	next3_fsblk_t freeb, avefreeb;
+	int max_dirs, min_inodes, min_blocks;
+	int topdir, flex = -1, group, i, last;
+	struct next3_group_desc *desc;
+	struct orlov_stats stats;
+
+	if (!sbi->s_flex_stats)
+		return find_group_orlov_desc(sb, parent);
+
+	freei = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
+	avefreei = freei / nflex;
+	freeb = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+	avefreeb = freeb / nflex;
+	ndirs = percpu_counter_read_positive(&sbi->s_dirs_counter);
+
+	topdir = (parent == sb->s_root->d_inode) ||
+		(NEXT3_I(parent)->i_flags & NEXT3_TOPDIR_FL);
+	if (topdir) {
+		int best_ndir = inodes_per_group * flex_size;
+
+		get_random_bytes(&group, sizeof(group));
+		parent_flex = (unsigned)group % nflex;
+		for (i = 0; i < nflex; i++) {
+			group = (parent_flex + i) % nflex;
+			get_orlov_stats(sbi, group, &stats);
+			if (!stats.free_inodes)
+				continue;
+			if (stats.used_dirs >= best_ndir)
+				continue;
+			if (stats.free_inodes < avefreei)
+				continue;
+			if (stats.free_blocks < avefreeb)
+				continue;
+			flex = group;
+			best_ndir = stats.used_dirs;
+		}
+	} else {
+		max_dirs = ndirs / nflex + inodes_per_group * flex_size / 16;
+		min_inodes = avefreei - inodes_per_group * flex_size / 4;
+		min_blocks = avefreeb - NEXT3_BLOCKS_PER_GROUP(sb) * flex_size / 4;
+
+		for (i = 0; i < nflex; i++) {
+			group = (parent_flex + i) % nflex;
+			get_orlov_stats(sbi, group, &stats);
+			if (!stats.free_inodes)
+				continue;
+			if (stats.used_dirs >= max_dirs)
+				continue;
+			if (stats.free_inodes < min_inodes)
+				continue;
+			if (stats.free_blocks < min_blocks)
+				continue;
+			flex = group;
+			break;
+		}
+	}
+	if (flex >= 0) {
+		group = find_group_in_flex(sb, parent, flex, topdir);
+		if (group >= 0)
+			return group;
+	}
+
+	/*
+	 * Look for a group with more free inodes than average, skipping
+	 * the flex groups which cannot have one.
+	 */
+	avefreei = freei / ngroups;
+fallback:
+	for (i = 0; i < nflex; i++) {
+		flex = (parent_flex + i) % nflex;
+		get_orlov_stats(sbi, flex, &stats);
+		if (stats.free_inodes < max(avefreei, 1U))
+			continue;
+		group = flex << log;
+		last = min(group + flex_size, ngroups);
+		for (; group < last; group++) {
+			desc = next3_get_group_desc (sb, group, NULL);
+			if (!desc || !desc->bg_free_inodes_count)
+				continue;
+			if (le16_to_cpu(desc->bg_free_inodes_count) >= avefreei)
+				return group;
+		}
+	}
+
+	if (avefreei) {
+		/*
+		 * The free-inodes counter is approximate, and for really small
+		 * filesystems the above test can fail to find any blockgroups
+		 */
+		avefreei = 0;
+		goto fallback;
+	}
+
+	return -1;
+}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+/* groups that racing cpus spread to, after the group they raced in */
+#define NEXT3_IALLOC_HINT_SPREAD	16
+
+/*
+ * Returns the preferred group of this cpu for new files in @parent_group
+ * or -1 if this cpu has not lost an inode bitmap race there recently.
+ */
+static int next3_ialloc_hint_get(struct super_block *sb, int parent_group)
+{
+	struct next3_ialloc_hint *hint;
+	int group = -1;
+
+	hint = per_cpu_ptr(NEXT3_SB(sb)->s_ialloc_hints, get_cpu());
+	if (hint->parent_group == parent_group &&
+			time_before(jiffies, hint->expires))
+		group = hint->group;
+	put_cpu();
+	return group;
+}
+
+/*
+ * This cpu lost an inode bitmap race in @group for a new file in
+ * @parent_group.  Move this cpu's new files in @parent_group to one of
+ * the next groups, picked by cpu number, so racing cpus move apart.
+ */
+static void next3_ialloc_hint_set(struct super_block *sb, int parent_group,
+		int group)
+{
+	struct next3_ialloc_hint *hint;
+	int cpu = get_cpu();
+
+	hint = per_cpu_ptr(NEXT3_SB(sb)->s_ialloc_hints, cpu);
+	hint->parent_group = parent_group;
+	hint->group = (group + 1 + cpu % NEXT3_IALLOC_HINT_SPREAD) %
+		NEXT3_SB(sb)->s_groups_count;
+	hint->expires = jiffies + HZ;
+	put_cpu();
+}
+
+#endif
 static int find_group_other(struct super_block *sb, struct inode *parent)
 {
 	int parent_group = NEXT3_I(parent)->i_block_group;
 	int ngroups = NEXT3_SB(sb)->s_groups_count;
 	struct next3_group_desc *desc;
 	int group, i;
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int flex_mask = (1 << sbi->s_log_groups_per_flex) - 1;
+#endif
 
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	/*
+	 * Try the group this cpu moved to after racing in the parent group
+	 */
+	group = next3_ialloc_hint_get(sb, parent_group);
+	if (group >= 0) {
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (desc && le16_to_cpu(desc->bg_free_inodes_count) &&
+				le16_to_cpu(desc->bg_free_blocks_count))
+			return group;
+	}
+
+#endif
 	/*
 	 * Try to place the inode in its parent directory
 	 */
@@ -398,6 +1084,19 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 	for (i = 0; i < ngroups; i++) {
 		if (++group >= ngroups)
 			group = 0;
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+		/* skip to the end of a flex group without free inodes */
+		if (sbi->s_flex_stats && !atomic_read(&sbi->s_flex_stats[
+			group >> sbi->s_log_groups_per_flex].free_inodes)) {
+			int last = group | flex_mask;
+
+			if (last >= ngroups)
+				last = ngroups - 1;
+			i += last - group;
+			group = last;
+			continue;
+		}
+#endif
 		desc = next3_get_group_desc (sb, group, NULL);
 		if (desc && le16_to_cpu(desc->bg_free_inodes_count))
 			return group;
@@ -431,6 +1130,13 @@ struct inode *next3_new_inode(handle_t *handle, struct inode * dir, int mode)
 	int err = 0;
 	struct inode *ret;
 	int i;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	int itable_locked = 0;
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	unsigned int hint;
+	int raced = 0;
+#endif
 
 	/* Cannot create files in a deleted directory */
 	if (!dir || !dir->i_nlink)
@@ -467,8 +1173,20 @@ struct inode *next3_new_inode(handle_t *handle, struct inode * dir, int mode)
 		bitmap_bh = read_inode_bitmap(sb, group);
 		if (!bitmap_bh)
 			goto fail;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+		/* keep the itable work off the inode we allocate */
+		if (next3_itable_uninit(gdp)) {
+			mutex_lock(&sbi->s_itable_mutex);
+			itable_locked = 1;
+		}
+#endif
 
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+		/* skip the in-use prefix of the inode bitmap */
+		hint = ino = ACCESS_ONCE(sbi->s_group_info[group].bg_inode_hint);
+#else
 		ino = 0;
+#endif
 
 repeat_in_this_group:
 		ino = next3_find_next_zero_bit((unsigned long *)
@@ -499,10 +1217,23 @@ repeat_in_this_group:
 #else
 			journal_release_buffer(handle, bitmap_bh);
 #endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+			raced = 1;
+#endif
 
 			if (++ino < NEXT3_INODES_PER_GROUP(sb))
 				goto repeat_in_this_group;
 		}
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+		if (hint && le16_to_cpu(gdp->bg_free_inodes_count)) {
+			/* the hint is stale - reset it and rescan the group */
+			spin_lock(sb_bgl_lock(sbi, group));
+			sbi->s_group_info[group].bg_inode_hint = 0;
+			spin_unlock(sb_bgl_lock(sbi, group));
+			hint = ino = 0;
+			goto repeat_in_this_group;
+		}
+#endif
 
 		/*
 		 * This case is possible in concurrent environment.  It is very
@@ -511,6 +1242,12 @@ repeat_in_this_group:
 		 * group descriptor metadata has not yet been updated.
 		 * So we just go onto the next blockgroup.
 		 */
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+		if (itable_locked) {
+			mutex_unlock(&sbi->s_itable_mutex);
+			itable_locked = 0;
+		}
+#endif
 		if (++group == sbi->s_groups_count)
 			group = 0;
 	}
@@ -518,6 +1255,12 @@ repeat_in_this_group:
 	goto out;
 
 got:
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	if (itable_locked) {
+		mutex_unlock(&sbi->s_itable_mutex);
+		itable_locked = 0;
+	}
+#endif
 	ino += group * NEXT3_INODES_PER_GROUP(sb) + 1;
 	if (ino < NEXT3_FIRST_INO(sb) || ino > le32_to_cpu(es->s_inodes_count)) {
 		next3_error (sb, "next3_new_inode",
@@ -535,6 +1278,19 @@ got:
 	if (S_ISDIR(mode)) {
 		le16_add_cpu(&gdp->bg_used_dirs_count, 1);
 	}
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_flex_stats_add(sb, group, -1, 0, S_ISDIR(mode) ? 1 : 0);
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	/*
+	 * Inodes [hint, ino] were in use when we scanned the bitmap, so if
+	 * there are no free inodes below hint, there are none up to ino.
+	 */
+	i = (ino - 1) % NEXT3_INODES_PER_GROUP(sb) + 1;
+	if (sbi->s_group_info[group].bg_inode_hint >= hint &&
+			sbi->s_group_info[group].bg_inode_hint < i)
+		sbi->s_group_info[group].bg_inode_hint = i;
+#endif
 	spin_unlock(sb_bgl_lock(sbi, group));
 	BUFFER_TRACE(bh2, "call next3_journal_dirty_metadata");
 	err = next3_journal_dirty_metadata(handle, bh2);
@@ -543,6 +1299,10 @@ got:
 	percpu_counter_dec(&sbi->s_freeinodes_counter);
 	if (S_ISDIR(mode))
 		percpu_counter_inc(&sbi->s_dirs_counter);
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	if (raced && !S_ISDIR(mode))
+		next3_ialloc_hint_set(sb, NEXT3_I(dir)->i_block_group, group);
+#endif
 
 
 	if (test_opt(sb, GRPID)) {
@@ -571,6 +1331,12 @@ got:
 	ei->i_file_acl = 0;
 	ei->i_dir_acl = 0;
 	ei->i_dtime = 0;
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	atomic_set(&NEXT3_SNAP_I(inode)->i_snap_copied, 0);
+	atomic_set(&NEXT3_SNAP_I(inode)->i_snap_moved, 0);
+#endif
+#endif
 	ei->i_block_alloc_info = NULL;
 	ei->i_block_group = group;
 
@@ -581,6 +1347,14 @@ got:
 		err = -EINVAL;
 		goto fail_drop;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	if (next3_snapshot_file(inode)) {
+		/* new file in snapshots directory */
+		err = next3_snapshot_info_alloc(inode);
+		if (err)
+			goto fail_drop;
+	}
+#endif
 	spin_lock(&sbi->s_next_gen_lock);
 	inode->i_generation = sbi->s_next_generation++;
 	spin_unlock(&sbi->s_next_gen_lock);
@@ -615,6 +1389,10 @@ got:
 	next3_debug("allocating inode %lu\n", inode->i_ino);
 	goto really_out;
 fail:
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	if (itable_locked)
+		mutex_unlock(&sbi->s_itable_mutex);
+#endif
 	next3_std_error(sb, err);
 out:
 	iput(inode);
@@ -41,6 +41,7 @@
 #include <linux/bio.h>
 #include <linux/fiemap.h>
 #include <linux/namei.h>
+#include <linux/swap.h>
 #include "xattr.h"
 #include "acl.h"
 #include "snapshot.h"
@@ -164,6 +165,16 @@ static handle_t *start_transaction(struct inode *inode)
  */
 static int try_to_extend_transaction(handle_t *handle, struct inode *inode)
 {
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	struct next3_free_batch *batch = NEXT3_I(inode)->i_free_batch;
+
+	/* pending frees must fit in this transaction - free them now */
+	if (batch && batch->nr &&
+	    !NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle,
+			NEXT3_RESERVE_TRANS_BLOCKS+1+
+			NEXT3_FREE_BATCH_CREDITS(batch)))
+		next3_free_batch_flush(handle, inode);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS
 	if (NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle,
 					    NEXT3_RESERVE_TRANS_BLOCKS+1))
@@ -187,19 +198,19 @@ static int truncate_restart_transaction(handle_t *handle, struct inode *inode)
 
 	jbd_debug(2, "restarting handle %p\n", handle);
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
-	/* Snapshot shrink/merge/clean do not take truncate_mutex */
-	if (!mutex_is_locked(&NEXT3_I(inode)->truncate_mutex))
+	/* Snapshot shrink/merge/clean do not take truncate_sem */
+	if (!rwsem_is_locked(&NEXT3_I(inode)->truncate_sem))
 		return next3_journal_restart(handle, blocks_for_truncate(inode));
 #endif
 	/*
-	 * Drop truncate_mutex to avoid deadlock with next3_get_blocks_handle
+	 * Drop truncate_sem to avoid deadlock with next3_get_blocks_handle
 	 * At this moment, get_block can be called only for blocks inside
 	 * i_size since page cache has been already dropped and writes are
-	 * blocked by i_mutex. So we can safely drop the truncate_mutex.
+	 * blocked by i_mutex. So we can safely drop the truncate_sem.
 	 */
-	mutex_unlock(&NEXT3_I(inode)->truncate_mutex);
+	up_write(&NEXT3_I(inode)->truncate_sem);
 	ret = next3_journal_restart(handle, blocks_for_truncate(inode));
-	mutex_lock(&NEXT3_I(inode)->truncate_mutex);
+	down_write(&NEXT3_I(inode)->truncate_sem);
 	return ret;
 }
 
@@ -263,6 +274,141 @@ no_delete:
 	clear_inode(inode);	/* We must guarantee clearing of inode... */
 }
 
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+/*
+ * Asynchronous unlink of large files (async_unlink=<blocks> mount option).
+ * next3_unlink() takes an extra reference to an unlinked regular file with
+ * at least s_async_unlink_blocks blocks, so the last iput() and with it
+ * next3_delete_inode() run from the unlink work instead of the caller's
+ * context.  The inode is on the on-disk orphan list from the time it was
+ * unlinked, so if we crash before the work gets to it, its blocks are freed
+ * by orphan cleanup on the next mount.
+ */
+struct next3_async_unlink {
+	struct list_head	list;
+	struct inode		*inode;
+};
+
+static struct workqueue_struct *next3_unlink_wq;
+
+int __init init_next3_async_unlink(void)
+{
+	next3_unlink_wq = create_singlethread_workqueue("next3-unlink");
+	return next3_unlink_wq ? 0 : -ENOMEM;
+}
+
+void exit_next3_async_unlink(void)
+{
+	destroy_workqueue(next3_unlink_wq);
+}
+
+static void next3_async_unlink_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(work, struct next3_sb_info,
+						 s_async_unlink_work);
+	struct next3_async_unlink *au;
+
+	spin_lock(&sbi->s_async_unlink_lock);
+	while (!list_empty(&sbi->s_async_unlink_list)) {
+		au = list_first_entry(&sbi->s_async_unlink_list,
+				      struct next3_async_unlink, list);
+		list_del(&au->list);
+		spin_unlock(&sbi->s_async_unlink_lock);
+		/* usually the last reference - frees the inode blocks */
+		iput(au->inode);
+		kfree(au);
+		cond_resched();
+		spin_lock(&sbi->s_async_unlink_lock);
+	}
+	spin_unlock(&sbi->s_async_unlink_lock);
+}
+
+/*
+ * next3_async_unlink_init() - called on mount time
+ */
+void next3_async_unlink_init(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	spin_lock_init(&sbi->s_async_unlink_lock);
+	INIT_LIST_HEAD(&sbi->s_async_unlink_list);
+	INIT_WORK(&sbi->s_async_unlink_work, next3_async_unlink_work);
+}
+
+/*
+ * next3_async_unlink_flush() - wait for pending unlinks to be freed.
+ * Called from sync_fs(), which is called before umount evicts the inodes,
+ * before remount read-only and before freeze, and from put_super().
+ */
+void next3_async_unlink_flush(struct super_block *sb)
+{
+	flush_work(&NEXT3_SB(sb)->s_async_unlink_work);
+}
+
+/*
+ * next3_async_unlink() - called from next3_unlink() after the handle was
+ * stopped.  If we cannot queue the inode, it is freed by the caller.
+ */
+void next3_async_unlink(struct inode *inode)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_async_unlink *au;
+
+	if (!sbi->s_async_unlink_blocks || inode->i_nlink ||
+	    !S_ISREG(inode->i_mode) ||
+	    (inode->i_blocks >> (inode->i_sb->s_blocksize_bits - 9)) <
+	    sbi->s_async_unlink_blocks)
+		return;
+
+	au = kmalloc(sizeof(*au), GFP_NOFS);
+	if (!au)
+		return;
+	au->inode = igrab(inode);
+	if (!au->inode) {
+		kfree(au);
+		return;
+	}
+	spin_lock(&sbi->s_async_unlink_lock);
+	list_add_tail(&au->list, &sbi->s_async_unlink_list);
+	spin_unlock(&sbi->s_async_unlink_lock);
+	queue_work(next3_unlink_wq, &sbi->s_async_unlink_work);
+}
+
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+/*
+ * next3_async_orphan_add() - called from orphan cleanup, which passes us
+ * its reference to a deleted orphan inode.  The inode is collected on
+ * @list, and queued on the unlink work when the walk of the orphan list
+ * is done, so the work doesn't change the orphan list under the walk.
+ * On failure, the inode is deleted by the caller.
+ */
+int next3_async_orphan_add(struct list_head *list, struct inode *inode)
+{
+	struct next3_async_unlink *au;
+
+	au = kmalloc(sizeof(*au), GFP_NOFS);
+	if (!au)
+		return -ENOMEM;
+	au->inode = inode;
+	list_add_tail(&au->list, list);
+	return 0;
+}
+
+void next3_async_orphans_queue(struct super_block *sb, struct list_head *list)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	if (list_empty(list))
+		return;
+	spin_lock(&sbi->s_async_unlink_lock);
+	list_splice_tail_init(list, &sbi->s_async_unlink_list);
+	spin_unlock(&sbi->s_async_unlink_lock);
+	queue_work(next3_unlink_wq, &sbi->s_async_unlink_work);
+}
+
+#endif
+#endif
+
 typedef struct {
 	__le32	*p;
 	__le32	key;
@@ -475,11 +621,57 @@ static next3_fsblk_t next3_find_near(struct inode *inode, Indirect *ind)
 	 * into the same cylinder group then.
 	 */
 	bg_start = next3_group_first_block_no(inode->i_sb, ei->i_block_group);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_REGION
+	/* keep the colours out of the snapshot region */
+	colour = (current->pid % 16) *
+			((NEXT3_BLOCKS_PER_GROUP(inode->i_sb) -
+			  NEXT3_SNAPSHOT_REGION_BLOCKS(inode->i_sb)) / 16);
+#else
 	colour = (current->pid % 16) *
 			(NEXT3_BLOCKS_PER_GROUP(inode->i_sb) / 16);
+#endif
 	return bg_start + colour;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_REGION
+/*
+ * next3_snapshot_region_goal - find the snapshot region of a block group
+ * @sb:		super block
+ * @block:	source block of the snapshot copy
+ *
+ * Returns the first block of the snapshot region of the group of @block,
+ * or 0 if @block is not a valid data block.
+ */
+static next3_fsblk_t next3_snapshot_region_goal(struct super_block *sb,
+		next3_fsblk_t block)
+{
+	struct next3_super_block *es = NEXT3_SB(sb)->s_es;
+	next3_fsblk_t first = le32_to_cpu(es->s_first_data_block);
+	next3_fsblk_t bg_start, goal;
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	next3_fsblk_t aligned;
+#endif
+
+	if (block < first || block >= le32_to_cpu(es->s_blocks_count))
+		return 0;
+	bg_start = next3_group_first_block_no(sb,
+			(block - first) / NEXT3_BLOCKS_PER_GROUP(sb));
+	goal = bg_start + NEXT3_BLOCKS_PER_GROUP(sb) -
+		NEXT3_SNAPSHOT_REGION_BLOCKS(sb);
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	/* pack COWed blocks into whole stripes of the region */
+	aligned = next3_stripe_align(sb, goal);
+	if (aligned < bg_start + NEXT3_BLOCKS_PER_GROUP(sb))
+		goal = aligned;
+#endif
+	if (goal >= le32_to_cpu(es->s_blocks_count))
+		/* last group is too short to have a snapshot region */
+		return bg_start;
+	return goal;
+}
+
+#endif
+
 /**
  *	next3_find_goal - find a preferred place for allocation.
  *	@inode: owner
@@ -510,6 +702,20 @@ static next3_fsblk_t next3_find_goal(struct inode *inode, long block,
 	/* snapshot file copied blocks are allocated close to their source */
 	if (next3_snapshot_file(inode))
 		return SNAPSHOT_BLOCK(block);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_REGION
+	/*
+	 * snapshot file copied blocks are allocated in the snapshot region
+	 * of their source group, away from the live files data.
+	 */
+	if (next3_snapshot_file(inode) && block >= SNAPSHOT_BLOCK_OFFSET) {
+		next3_fsblk_t goal;
+
+		goal = next3_snapshot_region_goal(inode->i_sb,
+				SNAPSHOT_BLOCK(block));
+		if (goal)
+			return goal;
+	}
 #endif
 	return next3_find_near(inode, partial);
 }
@@ -668,6 +874,10 @@ int next3_snapshot_shrink_blocks(handle_t *handle, struct inode *inode,
 	BUG_ON(shrink &&
 		(!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_DELETED_FL) ||
 		next3_snapshot_is_active(inode)));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	if (shrink)
+		next3_snapshot_map_invalidate(inode);
+#endif
 
 	depth = next3_block_to_path(inode, iblock, offsets,
 			&blocks_to_boundary);
@@ -781,11 +991,43 @@ cleanup:
 		partial--;
 	}
 	brelse(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	if (shrink)
+		next3_snapshot_map_invalidate(inode);
+#endif
 	return err;
 }
 
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE_READAHEAD
+/*
+ * next3_branch_readahead - read ahead the child blocks of a branch
+ * @inode:	inode that maps the branch
+ * @nr:		top block of the branch
+ *
+ * Called from next3_move_branches() before counting the blocks of a
+ * branch, which reads the child blocks one at a time.
+ */
+static void next3_branch_readahead(struct inode *inode, next3_fsblk_t nr)
+{
+	struct super_block *sb = inode->i_sb;
+	int addr_per_block = NEXT3_ADDR_PER_BLOCK(sb);
+	struct buffer_head *bh;
+	__le32 *p;
+
+	bh = sb_bread(sb, nr);
+	if (!bh)
+		/* let next3_free_branches_cow() report the error */
+		return;
+	for (p = (__le32 *)bh->b_data;
+	     p < (__le32 *)bh->b_data + addr_per_block; p++)
+		if (*p)
+			sb_breadahead(sb, le32_to_cpu(*p));
+	brelse(bh);
+}
+
+#endif
 /*
  * next3_move_branches - move an array of branches
  * @handle: JBD handle for this transaction
@@ -807,6 +1049,16 @@ static int next3_move_branches(handle_t *handle, struct inode *src,
 {
 	int i;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE_READAHEAD
+	/* start reading the top blocks of all the branches to move */
+	for (i = 0; depth > 1 && i < count; i++) {
+		if (ps[i] && pd[i])
+			break;
+		if (ps[i])
+			sb_breadahead(src->i_sb, le32_to_cpu(ps[i]));
+	}
+
+#endif
 	for (i = 0; i < count; i++, ps++, pd++) {
 		__le32 s = *ps, d = *pd;
 		if (s && d && depth)
@@ -817,6 +1069,11 @@ static int next3_move_branches(handle_t *handle, struct inode *src,
 			/* skip holes is src and mapped data blocks in dst */
 			continue;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE_READAHEAD
+		if (depth > 1)
+			/* indirect blocks are read below - read them ahead */
+			next3_branch_readahead(src, le32_to_cpu(s));
+#endif
 		/* count moved blocks (and verify they are excluded) */
 		next3_free_branches_cow(handle, src, NULL,
 				ps, ps+1, depth, pmoved);
@@ -859,6 +1116,10 @@ int next3_snapshot_merge_blocks(handle_t *handle,
 		   indirect blocks */
 		return -1;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	next3_snapshot_map_invalidate(src);
+	next3_snapshot_map_invalidate(dst);
+#endif
 	memset(D, 0, sizeof(D));
 	memset(S, 0, sizeof(S));
 	pD = next3_get_branch(dst, depth, offsets, D, &err);
@@ -941,6 +1202,10 @@ out:
 		if (ks <= kd)
 			brelse(D[ks].bh);
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	next3_snapshot_map_invalidate(src);
+	next3_snapshot_map_invalidate(dst);
+#endif
 	return err < maxblocks ? err : maxblocks;
 }
 
@@ -1075,6 +1340,15 @@ static int next3_alloc_branch(handle_t *handle, struct inode *inode,
 		num = *blks;
 		new_blocks[indirect_blks] = current_block;
 	} else
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+	if (SNAPMAP_ISIND(cmd)) {
+		/* allocating only indirect blocks and no data blocks */
+		next3_alloc_blocks(handle, inode, goal, indirect_blks,
+				0, new_blocks, &err);
+		num = 0;
+		new_blocks[indirect_blks] = 0;
+	} else
 #endif
 	num = next3_alloc_blocks(handle, inode, goal, indirect_blks,
 				*blks, new_blocks, &err);
@@ -1246,6 +1520,11 @@ static int next3_splice_branch(handle_t *handle, struct inode *inode,
 	if (SNAPMAP_ISMOVE(cmd))
 		/* don't update i_block_alloc_info with moved block */
 		block_i = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+	if (SNAPMAP_ISIND(cmd))
+		/* no data block to update i_block_alloc_info with */
+		block_i = NULL;
 #endif
 	if (block_i) {
 		block_i->last_alloc_logical_block = block + blks - 1;
@@ -1300,7 +1579,7 @@ err_out:
 	if (SNAPMAP_ISMOVE(cmd))
 		/* don't charge snapshot file owner if move failed */
 		dquot_free_block(inode, blks);
-	else
+	else if (blks > 0)
 		next3_free_blocks(handle, inode, le32_to_cpu(where[num].key),
 				  blks);
 #else
@@ -1356,9 +1635,21 @@ int next3_get_blocks_handle(handle_t *handle, struct inode *inode,
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ
 	int read_through = 0;
 	struct inode *prev_snapshot;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	struct inode *snapshot = inode;
+	unsigned int snapread_gen = 0;
+	int cached = 0;
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
 	struct buffer_head *sbh = NULL;
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	int srcu_idx = -1;
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	next3_fsblk_t defrag_block = 0;
+	int defrag = next3_test_inode_state(inode, NEXT3_STATE_DEFRAG);
 #endif
 
 
@@ -1369,6 +1660,12 @@ int next3_get_blocks_handle(handle_t *handle, struct inode *inode,
 		goto out;
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	if (next3_snapshot_file(inode))
+		/* keep snapshots on read through path from being freed */
+		srcu_idx = srcu_read_lock(
+				&NEXT3_SB(inode->i_sb)->s_snapshot_srcu);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ
 retry:
 	blocks_to_boundary = 0;
@@ -1387,6 +1684,19 @@ retry:
 		err = read_through;
 		goto out;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	if (read_through && prev_snapshot && inode == snapshot) {
+		/* read through to newer snapshot - check resolved mapping */
+		count = next3_snapshot_read_cache_lookup(inode, iblock,
+				&first_block, &snapread_gen);
+		if (count > 0) {
+			cached = 1;
+			clear_buffer_new(bh_result);
+			map_bh(bh_result, inode->i_sb, first_block);
+			goto got_cached;
+		}
+	}
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
 	if (read_through && !prev_snapshot) {
 		/*
@@ -1414,12 +1724,42 @@ retry:
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
 	if (!partial && create && buffer_move_data(bh_result)) {
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+		BUG_ON(!defrag && !next3_snapshot_should_move_data(inode));
+#else
 		BUG_ON(!next3_snapshot_should_move_data(inode));
+#endif
 		first_block = le32_to_cpu(chain[depth - 1].key);
 		blocks_to_boundary = 0;
 		/* should move 1 data block to snapshot? */
 		err = next3_snapshot_get_move_access(handle, inode,
 				first_block, 0);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+		if (err > 0 && buffer_delay_move(bh_result) &&
+				!buffer_jbd(bh_result)) {
+			/*
+			 * keep the old block mapped and mark the buffer delayed.
+			 * the block will be moved to snapshot by writepage().
+			 */
+			err = 0;
+			if (buffer_partial_write(bh_result) &&
+					!buffer_uptodate(bh_result))
+				/*
+				 * block_write_begin() does not read delayed
+				 * buffers.  Leave the buffer undelayed, so it is
+				 * read with the other buffers of the page, and
+				 * clear_move_data() marks it delayed after.
+				 */
+				clear_buffer_move_data(bh_result);
+			else
+				set_buffer_delay(bh_result);
+		}
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+		if (!err && defrag)
+			/* re-allocate block even if snapshot doesn't need it */
+			err = 1;
+#endif
 		if (err)
 			/* do not map found block */
 			partial = chain + depth - 1;
@@ -1431,8 +1771,23 @@ retry:
 			err = 0;
 			goto cleanup;
 		}
+		if (err > 0 && buffer_partial_write(bh_result) &&
+				!buffer_uptodate(bh_result)) {
+			/*
+			 * read old block data before moving it to snapshot,
+			 * but not under truncate_sem.
+			 */
+			map_bh(bh_result, inode->i_sb, first_block);
+			ll_rw_block(READ, 1, &bh_result);
+			wait_on_buffer(bh_result);
+			clear_buffer_mapped(bh_result);
+			if (!buffer_uptodate(bh_result)) {
+				err = -EIO;
+				goto cleanup;
+			}
+		}
 		if (err > 0)
-			/* check again under truncate_mutex */
+			/* check again under truncate_sem */
 			err = -EAGAIN;
 	}
 	if (partial && create && buffer_direct_io(bh_result)) {
@@ -1499,6 +1854,11 @@ retry:
 			}
 			/* repeat the same routine with prev snapshot */
 			inode = prev_snapshot;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+			/* skip snapshots that map no blocks in block group */
+			inode = next3_snapshot_read_skip(inode,
+					SNAPSHOT_BLOCK(iblock));
+#endif
 			goto retry;
 		}
 #endif
@@ -1518,20 +1878,53 @@ retry:
 	if (!create || err == -EIO)
 		goto cleanup;
 
+	/*
+	 * The chain changed under the lockless lookup, most likely because
+	 * another get_block filled the hole.  Re-read it under the shared
+	 * lock and take the lock exclusively only if there is still a block
+	 * to allocate.  Move-on-write goes straight to the exclusive lock.
+	 */
+	if ((err == -EAGAIN || !verify_chain(chain, partial))
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+			&& !buffer_move_data(bh_result)
+#endif
+			) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW
+		down_read_nested(&ei->truncate_sem, IS_COWING(handle));
+#else
+		down_read(&ei->truncate_sem);
+#endif
+		while (partial > chain) {
+			brelse(partial->bh);
+			partial--;
+		}
+		partial = next3_get_branch(inode, depth, offsets, chain, &err);
+		up_read(&ei->truncate_sem);
+		if (!partial) {
+			count++;
+			if (err)
+				goto cleanup;
+			clear_buffer_new(bh_result);
+			goto got_it;
+		}
+		/* re-read the chain under the exclusive lock */
+		err = -EAGAIN;
+	}
+
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW
 	/*
 	 * locking order for locks validator:
 	 * inode (VFS operation) -> active snapshot (COW operation)
 	 *
-	 * The active snapshot truncate_mutex is only taken during COW
+	 * The active snapshot truncate_sem is only taken during COW
 	 * operation, because snapshot file has read-only aops and because
 	 * truncate/unlink of snapshot file is not permitted.
 	 */
 	BUG_ON(next3_snapshot_is_active(inode) && !IS_COWING(handle));
 	BUG_ON(!next3_snapshot_is_active(inode) && IS_COWING(handle));
-	mutex_lock_nested(&ei->truncate_mutex, IS_COWING(handle));
+	down_write_nested(&ei->truncate_sem, IS_COWING(handle));
 #else
-	mutex_lock(&ei->truncate_mutex);
+	down_write(&ei->truncate_sem);
 #endif
 
 	/*
@@ -1554,12 +1947,21 @@ retry:
 		partial = next3_get_branch(inode, depth, offsets, chain, &err);
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
 		if (!partial &&  buffer_move_data(bh_result)) {
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+			BUG_ON(!defrag &&
+				!next3_snapshot_should_move_data(inode));
+#else
 			BUG_ON(!next3_snapshot_should_move_data(inode));
+#endif
 			first_block = le32_to_cpu(chain[depth - 1].key);
 			blocks_to_boundary = 0;
 			/* should move 1 data block to snapshot? */
 			err = next3_snapshot_get_move_access(handle, inode,
 					first_block, 0);
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+			if (!err && defrag)
+				err = 1;
+#endif
 			if (err)
 				/* re-allocate 1 data block */
 				partial = chain + depth - 1;
@@ -1570,7 +1972,7 @@ retry:
 #endif
 		if (!partial) {
 			count++;
-			mutex_unlock(&ei->truncate_mutex);
+			up_write(&ei->truncate_sem);
 			if (err)
 				goto cleanup;
 			clear_buffer_new(bh_result);
@@ -1596,6 +1998,26 @@ retry:
 	 */
 	count = next3_blks_to_allocate(partial, indirect_blks,
 					maxblocks, blocks_to_boundary);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+	if (SNAPMAP_ISIND(create)) {
+		/* allocate and splice only the missing indirect blocks */
+		count = 0;
+		err = 0;
+		if (indirect_blks > 0)
+			err = next3_alloc_branch_cow(handle, inode, iblock,
+					indirect_blks, &count, goal,
+					offsets + (partial - chain),
+					partial, create);
+		if (!err && indirect_blks > 0)
+			err = next3_splice_branch_cow(handle, inode, iblock,
+					partial, indirect_blks, 0, create);
+		up_write(&ei->truncate_sem);
+		if (!err)
+			/* the whole chain, except for the missing data block */
+			partial = chain + depth - 1;
+		goto cleanup;
+	}
+#endif
 	/*
 	 * Block out next3_truncate while we alter the tree
 	 */
@@ -1629,6 +2051,31 @@ retry:
 			goto out_mutex;
 		}
 		next3_snapshot_start_pending_cow(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		if (count > 1) {
+			int i;
+
+			/*
+			 * batched COW - all the new allocated blocks
+			 * are pending COW until each of them is copied.
+			 */
+			for (i = 1; i < count; i++) {
+				struct buffer_head *bh;
+
+				bh = sb_getblk(inode->i_sb, sbh->b_blocknr + i);
+				if (!bh)
+					break;
+				next3_snapshot_start_pending_cow(bh);
+				brelse(bh);
+			}
+			if (i < count) {
+				/* map only the blocks marked pending COW */
+				next3_free_blocks(handle, inode,
+						sbh->b_blocknr + i, count - i);
+				count = i;
+			}
+		}
+#endif
 	}
 
 #endif
@@ -1659,6 +2106,13 @@ retry:
 		/* move old block to snapshot */
 		ret = next3_snapshot_get_move_access(handle, inode,
 				le32_to_cpu(*(partial->p)), 1);
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+		if (!ret && defrag) {
+			/* not in use by snapshot - free after splice */
+			defrag_block = le32_to_cpu(*(partial->p));
+			ret = 1;
+		}
+#endif
 		if (ret < 1) {
 			/* failed to move to snapshot - free new block */
 			next3_free_blocks(handle, inode,
@@ -1668,6 +2122,10 @@ retry:
 		}
 		/* block moved to snapshot - continue to splice new block */
 		err = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+		/* delayed move (if any) is done */
+		clear_buffer_delay(bh_result);
+#endif
 	}
 
 #endif
@@ -1687,8 +2145,12 @@ retry:
 		err = next3_splice_branch(handle, inode, iblock,
 					partial, indirect_blks, count);
 #endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	if (!err && defrag_block)
+		next3_free_blocks(handle, inode, defrag_block, 1);
+#endif
 out_mutex:
-	mutex_unlock(&ei->truncate_mutex);
+	up_write(&ei->truncate_sem);
 	if (err)
 		goto cleanup;
 
@@ -1701,6 +2163,9 @@ got_it:
 		cancel_buffer_tracked_read(bh_result);
 #endif
 	map_bh(bh_result, inode->i_sb, le32_to_cpu(chain[depth-1].key));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+got_cached:
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
 	/*
 	 * On read of active snapshot, a mapped block may belong to a non
@@ -1708,10 +2173,38 @@ got_it:
 	 * condition.  if (bh_result->b_blocknr == SNAPSHOT_BLOCK(iblock)),
 	 * then this is either read through to block device or moved block.
 	 * Either way, it is not a COWed block, so it cannot be pending COW.
+	 * A cached read through mapping may belong to the active snapshot,
+	 * so it is tested the same way.
 	 */
 	if (read_through && next3_snapshot_is_active(inode) &&
 		bh_result->b_blocknr != SNAPSHOT_BLOCK(iblock))
 		sbh = sb_find_get_block(inode->i_sb, bh_result->b_blocknr);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	else if (cached && bh_result->b_blocknr != SNAPSHOT_BLOCK(iblock))
+		sbh = sb_find_get_block(inode->i_sb, bh_result->b_blocknr);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_DIRECT_IO
+	if (read_through && sbh && buffer_direct_io(bh_result)) {
+		/*
+		 * Direct I/O reads the COWed block from disk.  Don't wait for
+		 * pending COW while holding tracked reads and don't read a
+		 * COWed block from disk before it was written.
+		 */
+		if (buffer_new(sbh) || buffer_locked(sbh) ||
+		    buffer_dirty(sbh) || buffer_jbddirty(sbh)) {
+			err = -ENOTBLK;
+			partial = chain + depth - 1;	/* the whole chain */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+			if (cached)
+				/* chain was not read */
+				partial = chain;
+#endif
+			goto cleanup;
+		}
+		brelse(sbh);
+		sbh = NULL;
+	}
+#endif
 	if (read_through && sbh) {
 		/* wait for pending COW to complete */
 		next3_snapshot_test_pending_cow(sbh, SNAPSHOT_BLOCK(iblock));
@@ -1740,12 +2233,23 @@ got_it:
 		}
 		unlock_buffer(sbh);
 	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	if (read_through && inode != snapshot && !cached)
+		/* resolved read through to newer snapshot - cache it */
+		next3_snapshot_read_cache_insert(snapshot, iblock,
+				bh_result->b_blocknr, inode, snapread_gen);
 #endif
 	if (count > blocks_to_boundary)
 		set_buffer_boundary(bh_result);
 	err = count;
 	/* Clean up and exit */
 	partial = chain + depth - 1;	/* the whole chain */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	if (cached)
+		/* chain was not read */
+		partial = chain;
+#endif
 cleanup:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
@@ -1755,8 +2259,23 @@ cleanup:
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
 	/* cancel pending COW operation on failure to alloc snapshot block */
-	if (create && err < 0 && sbh)
+	if (create && err < 0 && sbh) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		int i;
+
+		for (i = 1; SNAPMAP_ISCOW(create) && i < count; i++) {
+			struct buffer_head *bh;
+
+			bh = sb_find_get_block(inode->i_sb,
+					sbh->b_blocknr + i);
+			if (!bh)
+				continue;
+			next3_snapshot_end_pending_cow(bh);
+			brelse(bh);
+		}
+#endif
 		next3_snapshot_end_pending_cow(sbh);
+	}
 	brelse(sbh);
 #endif
 #endif
@@ -1767,6 +2286,11 @@ cleanup:
 	}
 	BUFFER_TRACE(bh_result, "returned");
 out:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	if (srcu_idx >= 0)
+		srcu_read_unlock(&NEXT3_SB(inode->i_sb)->s_snapshot_srcu,
+				 srcu_idx);
+#endif
 	return err;
 }
 
@@ -1800,43 +2324,240 @@ static int next3_get_block(struct inode *inode, sector_t iblock,
  */
 #define DIO_CREDITS 25
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
-static int next3_get_block_dio(struct inode *inode, sector_t iblock,
-			struct buffer_head *bh_result, int create)
-#else
-static int next3_get_block(struct inode *inode, sector_t iblock,
-			struct buffer_head *bh_result, int create)
-#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+/* Maximum number of blocks we move for a single direct IO write */
+#define NEXT3_DIO_MOVE_MAX 256
+
+/*
+ * Blocks that need to be moved to snapshot by a direct I/O write are not
+ * moved by next3_get_block_dio().  Instead, a new block is allocated and
+ * the write is directed to the new block.  After the write has completed,
+ * next3_dio_splice_moves() moves the old block to snapshot and splices the
+ * new block into the file.
+ */
+struct next3_dio_move {
+	loff_t start, end;	/* byte range of direct I/O write */
+	int count, max;
+	struct {
+		sector_t iblock;
+		next3_fsblk_t old_block;
+		next3_fsblk_t new_block;
+	} map[0];
+};
+
+/*
+ * next3_dio_move_block - redirect direct I/O write to a new block
+ *
+ * Called from next3_get_block_dio() when direct I/O write to @iblock was
+ * suppressed by next3_get_blocks_handle().  If @iblock is mapped and fully
+ * covered by the write, allocate a new block and map @bh_result to it.
+ * Otherwise, leave @bh_result unmapped to fall back to buffered I/O.
+ */
+static int next3_dio_move_block(handle_t *handle, struct inode *inode,
+		sector_t iblock, struct buffer_head *bh_result)
 {
-	handle_t *handle = next3_journal_current_handle();
-	int ret = 0, started = 0;
-	unsigned max_blocks = bh_result->b_size >> inode->i_blkbits;
+	struct next3_dio_move *dm = NEXT3_I(inode)->i_dio_move;
+	int bits = inode->i_blkbits;
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	next3_fsblk_t old_block, new_block, goal;
+	int depth, err;
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
-	BUG_ON(handle != NULL);
-	if (NEXT3_HAS_RO_COMPAT_FEATURE(inode->i_sb,
-				NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT)) {
-		/*
-		 * DIO_SKIP_HOLES may ask to map direct I/O writes with create=0.
-		 * We need to change it to create=1, so that we can fall back to
-		 * buffered I/O when data blocks need to be moved to snapshot.
-		 */
-		create = 1;
-		/*
-		 * signal next3_get_blocks_handle() to return unmapped block if block
-		 * is not allocated or if it needs to be moved to snapshot.
-		 */
-		set_buffer_direct_io(bh_result);
-		if (next3_snapshot_should_move_data(inode))
-			set_buffer_move_data(bh_result);
+	if (!dm || dm->count >= dm->max ||
+			((loff_t)iblock << bits) < dm->start ||
+			((loff_t)(iblock + 1) << bits) > dm->end)
+		return 0;
+
+	depth = next3_block_to_path(inode, iblock, offsets, NULL);
+	if (depth == 0)
+		return 0;
+	partial = next3_get_branch(inode, depth, offsets, chain, &err);
+	old_block = partial ? 0 : le32_to_cpu(chain[depth - 1].key);
+	if (!partial)
+		partial = chain + depth - 1;
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
 	}
+	if (err == -EIO)
+		return err;
+	if (err || !old_block)
+		/* direct I/O write to holes is suppressed */
+		return 0;
 
-#endif
-	if (create && !handle) {	/* Direct IO write... */
-		if (max_blocks > DIO_MAX_BLOCKS)
-			max_blocks = DIO_MAX_BLOCKS;
-		handle = next3_journal_start(inode, DIO_CREDITS +
-				NEXT3_MAXQUOTAS_TRANS_BLOCKS(inode->i_sb));
+	goal = old_block;
+	if (dm->count && dm->map[dm->count - 1].iblock + 1 == iblock)
+		/* keep the new blocks of the write contiguous */
+		goal = dm->map[dm->count - 1].new_block + 1;
+	new_block = next3_new_block(handle, inode, goal, &err);
+	if (!new_block)
+		/* let buffered I/O deal with ENOSPC */
+		return 0;
+
+	dm->map[dm->count].iblock = iblock;
+	dm->map[dm->count].old_block = old_block;
+	dm->map[dm->count].new_block = new_block;
+	dm->count++;
+	map_bh(bh_result, inode->i_sb, new_block);
+	set_buffer_new(bh_result);
+	bh_result->b_size = 1 << bits;
+	return 0;
+}
+
+/*
+ * next3_dio_splice_block - move old block to snapshot and splice new block
+ */
+static int next3_dio_splice_block(handle_t *handle, struct inode *inode,
+		sector_t iblock, next3_fsblk_t old_block,
+		next3_fsblk_t new_block)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial, *where;
+	int depth, moved, err;
+
+	depth = next3_block_to_path(inode, iblock, offsets, NULL);
+	if (depth == 0)
+		return -EIO;
+
+	down_write(&ei->truncate_sem);
+	partial = next3_get_branch(inode, depth, offsets, chain, &err);
+	if (partial) {
+		if (!err)
+			err = -EAGAIN;
+		goto out;
+	}
+	partial = where = chain + depth - 1;
+	if (le32_to_cpu(where->key) != old_block) {
+		/* block was remapped while we were writing */
+		err = -EAGAIN;
+		goto out;
+	}
+
+	if (where->bh) {
+		BUFFER_TRACE(where->bh, "get_write_access");
+		err = next3_journal_get_write_access(handle, where->bh);
+		if (err)
+			goto out;
+	}
+	moved = next3_snapshot_get_move_access(handle, inode, old_block, 1);
+	if (moved < 0) {
+		err = moved;
+		goto out;
+	}
+	*where->p = cpu_to_le32(new_block);
+	if (where->bh) {
+		BUFFER_TRACE(where->bh, "call next3_journal_dirty_metadata");
+		err = next3_journal_dirty_metadata(handle, where->bh);
+		if (err)
+			goto out;
+	}
+	inode->i_ctime = CURRENT_TIME_SEC;
+	next3_mark_inode_dirty(handle, inode);
+	if (!moved)
+		/* old block is no longer needed by snapshot */
+		next3_free_blocks(handle, inode, old_block, 1);
+out:
+	up_write(&ei->truncate_sem);
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return err;
+}
+
+/*
+ * next3_dio_splice_moves - complete the block moves of direct I/O write
+ * @ret:	return value of blockdev_direct_IO()
+ *
+ * Splice the new blocks that were completely written and free the rest.
+ * If a block could not be spliced, the write is truncated at that block,
+ * so the caller falls back to buffered I/O for the rest of the write.
+ * Returns the updated number of bytes written or an error.
+ */
+static ssize_t next3_dio_splice_moves(struct inode *inode, loff_t offset,
+		ssize_t ret)
+{
+	struct next3_dio_move *dm = NEXT3_I(inode)->i_dio_move;
+	loff_t end = offset + (ret > 0 ? ret : 0);
+	handle_t *handle;
+	int i, err = 0;
+
+	for (i = 0; i < dm->count; i++) {
+		loff_t pos = (loff_t)dm->map[i].iblock << inode->i_blkbits;
+		int spliced = 0;
+
+		handle = next3_journal_start(inode,
+				next3_writepage_trans_blocks(inode));
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			if (pos < end)
+				end = pos;
+			break;
+		}
+		if (pos + inode->i_sb->s_blocksize <= end) {
+			err = next3_dio_splice_block(handle, inode,
+					dm->map[i].iblock, dm->map[i].old_block,
+					dm->map[i].new_block);
+			if (err)
+				end = pos;
+			else
+				spliced = 1;
+		}
+		if (!spliced)
+			next3_free_blocks(handle, inode,
+					dm->map[i].new_block, 1);
+		next3_journal_stop(handle);
+	}
+	dm->count = 0;
+
+	if (ret <= 0 || end >= offset + ret)
+		return ret;
+	if (end > offset)
+		return end - offset;
+	return err;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+static int next3_get_block_dio(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+#else
+static int next3_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+#endif
+{
+	handle_t *handle = next3_journal_current_handle();
+	int ret = 0, started = 0;
+	unsigned max_blocks = bh_result->b_size >> inode->i_blkbits;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	BUG_ON(handle != NULL);
+	if (NEXT3_HAS_RO_COMPAT_FEATURE(inode->i_sb,
+				NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT)) {
+		/*
+		 * DIO_SKIP_HOLES may ask to map direct I/O writes with create=0.
+		 * We need to change it to create=1, so that we can fall back to
+		 * buffered I/O when data blocks need to be moved to snapshot.
+		 */
+		create = 1;
+		/*
+		 * signal next3_get_blocks_handle() to return unmapped block if block
+		 * is not allocated or if it needs to be moved to snapshot.
+		 */
+		set_buffer_direct_io(bh_result);
+		if (next3_snapshot_should_move_data(inode))
+			set_buffer_move_data(bh_result);
+	}
+
+#endif
+	if (create && !handle) {	/* Direct IO write... */
+		if (max_blocks > DIO_MAX_BLOCKS)
+			max_blocks = DIO_MAX_BLOCKS;
+		handle = next3_journal_start(inode, DIO_CREDITS +
+				NEXT3_MAXQUOTAS_TRANS_BLOCKS(inode->i_sb));
 		if (IS_ERR(handle)) {
 			ret = PTR_ERR(handle);
 			goto out;
@@ -1850,6 +2571,11 @@ static int next3_get_block(struct inode *inode, sector_t iblock,
 		bh_result->b_size = (ret << inode->i_blkbits);
 		ret = 0;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	else if (!ret && started && buffer_move_data(bh_result) &&
+			!buffer_mapped(bh_result))
+		ret = next3_dio_move_block(handle, inode, iblock, bh_result);
+#endif
 	if (started)
 		next3_journal_stop(handle);
 out:
@@ -1859,6 +2585,11 @@ out:
 int next3_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		u64 start, u64 len)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIEMAP
+	if (next3_snapshot_list(inode))
+		/* report snapshot image extents including read through */
+		return next3_snapshot_fiemap(inode, fieinfo, start, len);
+#endif
 	return generic_block_fiemap(inode, fieinfo, start, len,
 				    next3_get_block);
 }
@@ -2064,6 +2795,29 @@ static int set_partial_write(handle_t *handle, struct buffer_head *bh)
 	return 0;
 }
 
+/*
+ * Like walk_page_buffers(), but only for the buffers that are partially
+ * covered by [from, to).  Buffers that are overwritten as a whole do not
+ * need their old data.
+ */
+static void walk_partial_buffers(struct buffer_head *head,
+				 unsigned from, unsigned to,
+				 int (*fn)(handle_t *handle,
+					   struct buffer_head *bh))
+{
+	struct buffer_head *bh = head;
+	unsigned block_start = 0, block_end;
+
+	do {
+		block_end = block_start + bh->b_size;
+		if (block_end > from && block_start < to &&
+		    (block_start < from || block_end > to))
+			fn(NULL, bh);
+		block_start = block_end;
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+
 static void set_page_move_data(struct page *page, unsigned from, unsigned to)
 {
 	struct buffer_head *page_bufs = page_buffers(page);
@@ -2080,13 +2834,29 @@ static void set_page_move_data(struct page *page, unsigned from, unsigned to)
 				NULL, set_move_data);
 		if (from > 0 || to < PAGE_CACHE_SIZE)
 			/* signal get_block() to update page before move-on-write */
-			walk_page_buffers(NULL, page_bufs, from, to,
-					NULL, set_partial_write);
+			walk_partial_buffers(page_bufs, from, to,
+					set_partial_write);
 	}
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+static int set_delay_move(handle_t *handle, struct buffer_head *bh)
+{
+	if (buffer_move_data(bh))
+		set_buffer_delay_move(bh);
+	return 0;
+}
+
+#endif
 static int clear_move_data(handle_t *handle, struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+	/* get_block() left a partial delayed move to be read first */
+	if (buffer_delay_move(bh) && !buffer_move_data(bh) &&
+			buffer_mapped(bh))
+		set_buffer_delay(bh);
+	clear_buffer_delay_move(bh);
+#endif
 	clear_buffer_partial_write(bh);
 	clear_buffer_move_data(bh);
 	return 0;
@@ -2103,6 +2873,43 @@ static void clear_page_move_data(struct page *page)
 			NULL, clear_move_data);
 }
 
+
+/*
+ * Prepare the buffers of @page for writing the range [@from, @to).
+ * Check if blocks need to be moved-on-write. if they do, unmap buffers,
+ * so get_block() is called to remap them.
+ */
+static void prepare_page_move_data(struct inode *inode, struct page *page,
+				   unsigned from, unsigned to)
+{
+	/*
+	 * only data=ordered mode is supported with snapshots, so the
+	 * buffer heads are going to be attached sooner or later anyway.
+	 */
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	if (next3_test_inode_state(inode, NEXT3_STATE_DEFRAG)) {
+		/*
+		 * signal get_block() to re-allocate all the blocks, but only
+		 * if the page is uptodate, so the data is not zeroed out.
+		 */
+		if (PageUptodate(page))
+			walk_page_buffers(NULL, page_buffers(page), from, to,
+					NULL, set_move_data);
+	} else
+#endif
+	if (next3_snapshot_should_move_data(inode)) {
+		set_page_move_data(page, from, to);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+		/* signal get_block() that move-on-write may be delayed */
+		if (next3_snapshot_should_delay_move(inode))
+			walk_page_buffers(NULL, page_buffers(page), from, to,
+					NULL, set_delay_move);
+#endif
+	}
+}
+
 #endif
 static int next3_write_begin(struct file *file, struct address_space *mapping,
 				loff_t pos, unsigned len, unsigned flags,
@@ -2137,18 +2944,7 @@ retry:
 		goto out;
 	}
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
-	/*
-	 * only data=ordered mode is supported with snapshots, so the
-	 * buffer heads are going to be attached sooner or later anyway.
-	 */
-	if (!page_has_buffers(page))
-		create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
-	/*
-	 * Check if blocks need to be moved-on-write. if they do, unmap buffers
-	 * and call block_write_begin() to remap them.
-	 */
-	if (next3_snapshot_should_move_data(inode))
-		set_page_move_data(page, from, to);
+	prepare_page_move_data(inode, page, from, to);
 #endif
 	ret = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata,
 							next3_get_block);
@@ -2197,6 +2993,47 @@ int next3_journal_dirty_data(handle_t *handle, struct buffer_head *bh)
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+/*
+ * File the data of @bh for writeout before commit.  With ORDERED_INODE,
+ * file the byte range of the buffer on the inode, otherwise file the
+ * buffer on the sync data list.
+ */
+static int next3_journal_order_data(handle_t *handle, struct buffer_head *bh)
+{
+	/* writepage() files the buffers after the page may be truncated */
+	struct address_space *mapping = ACCESS_ONCE(bh->b_page->mapping);
+	struct inode *inode;
+	int err;
+
+	if (!mapping)
+		return 0;
+	inode = mapping->host;
+	if (!test_opt(inode->i_sb, ORDERED_INODE))
+		return next3_journal_dirty_data(handle, bh);
+	err = journal_file_inode(handle, &NEXT3_I(inode)->jinode,
+			page_offset(bh->b_page) + bh_offset(bh), bh->b_size);
+	if (err)
+		next3_journal_abort_handle(__func__, __func__,
+						bh, handle, err);
+	return err;
+}
+
+#ifdef CONFIG_NEXT3_FS_NOBH
+/* File the byte range of a page without buffers for writeout */
+static int next3_journal_order_range(handle_t *handle, struct inode *inode,
+				     loff_t start, loff_t len)
+{
+	int err = journal_file_inode(handle, &NEXT3_I(inode)->jinode,
+				     start, len);
+	if (err)
+		next3_journal_abort_handle(__func__, __func__,
+						NULL, handle, err);
+	return err;
+}
+
+#endif
+#endif
 /* For ordered writepage and write_end functions */
 static int journal_dirty_data_fn(handle_t *handle, struct buffer_head *bh)
 {
@@ -2204,8 +3041,21 @@ static int journal_dirty_data_fn(handle_t *handle, struct buffer_head *bh)
 	 * Write could have mapped the buffer but it didn't copy the data in
 	 * yet. So avoid filing such buffer into a transaction.
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+	/*
+	 * Delayed move buffers are still mapped to the old block, which
+	 * belongs to snapshot. They will be filed by writepage() after
+	 * the block has been moved and a new block has been allocated.
+	 */
+	if (buffer_delay(bh))
+		return 0;
+#endif
 	if (buffer_mapped(bh) && buffer_uptodate(bh))
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+		return next3_journal_order_data(handle, bh);
+#else
 		return next3_journal_dirty_data(handle, bh);
+#endif
 	return 0;
 }
 
@@ -2235,6 +3085,42 @@ static void update_file_sizes(struct inode *inode, loff_t pos, unsigned copied)
 	}
 }
 
+#ifdef CONFIG_NEXT3_FS_NOBH
+/*
+ * With nobh, write_end() drops the buffers of the page once it is uptodate
+ * and all its blocks are mapped.  The page stays dirty and is written by
+ * nobh_writepage().  Buffers that are referenced or under I/O are kept.
+ */
+static void next3_page_drop_buffers(struct inode *inode, struct page *page)
+{
+	struct buffer_head *head, *bh;
+
+	if (!next3_nobh_data(inode) || !PageUptodate(page) ||
+	    !page_has_buffers(page))
+		return;
+	head = bh = page_buffers(page);
+	do {
+		if (!buffer_mapped(bh) || buffer_locked(bh) ||
+		    atomic_read(&bh->b_count))
+			return;
+	} while ((bh = bh->b_this_page) != head);
+
+	/* the page is locked, so writepage can't clean the buffers */
+	do {
+		clear_buffer_dirty(bh);
+	} while ((bh = bh->b_this_page) != head);
+	if (!try_to_free_buffers(page)) {
+		do {
+			mark_buffer_dirty(bh);
+		} while ((bh = bh->b_this_page) != head);
+		return;
+	}
+	/* try_to_free_buffers() cleaned the page along with the buffers */
+	__set_page_dirty_nobuffers(page);
+}
+
+#endif
+
 /*
  * We need to pick up the new inode size which generic_commit_write gave us
  * `file' can be NULL - eg, when called from page_symlink().
@@ -2261,6 +3147,10 @@ static int next3_ordered_write_end(struct file *file,
 
 	if (ret == 0)
 		update_file_sizes(inode, pos, copied);
+#ifdef CONFIG_NEXT3_FS_NOBH
+	if (ret == 0)
+		next3_page_drop_buffers(inode, page);
+#endif
 	/*
 	 * There may be allocated blocks outside of i_size because
 	 * we failed to copy some data. Prepare for truncate.
@@ -2289,6 +3179,9 @@ static int next3_writeback_write_end(struct file *file,
 
 	copied = block_write_end(file, mapping, pos, len, copied, page, fsdata);
 	update_file_sizes(inode, pos, copied);
+#ifdef CONFIG_NEXT3_FS_NOBH
+	next3_page_drop_buffers(inode, page);
+#endif
 	/*
 	 * There may be allocated blocks outside of i_size because
 	 * we failed to copy some data. Prepare for truncate.
@@ -2304,45 +3197,235 @@ static int next3_writeback_write_end(struct file *file,
 	return ret ? ret : copied;
 }
 
-static int next3_journalled_write_end(struct file *file,
-				struct address_space *mapping,
-				loff_t pos, unsigned len, unsigned copied,
-				struct page *page, void *fsdata)
+#ifdef CONFIG_NEXT3_FS_BATCHED_WRITE
+#define NEXT3_WRITE_BATCH	16
+
+/*
+ * Allocate the blocks past i_size, that are overwritten as a whole by the
+ * write of @bytes at @pos, with as few next3_get_blocks_handle() calls as
+ * possible.  The buffers are mapped later by get_block(), which then finds
+ * the blocks allocated.  Partially written blocks are left to get_block(),
+ * which zeroes the rest of new buffers.  Errors are left for get_block()
+ * to find again.
+ */
+static void next3_write_batch_map(struct inode *inode, handle_t *handle,
+				  loff_t pos, size_t bytes)
 {
-	handle_t *handle = next3_journal_current_handle();
+	unsigned blkbits = inode->i_blkbits;
+	loff_t start = max_t(loff_t, pos, i_size_read(inode));
+	sector_t block = (start + (1 << blkbits) - 1) >> blkbits;
+	sector_t end = (pos + bytes) >> blkbits;
+	struct buffer_head dummy;
+	int i, ret;
+
+	while (block < end) {
+		dummy.b_state = 0;
+		ret = next3_get_blocks_handle(handle, inode, block,
+					      end - block, &dummy, 1);
+		if (ret <= 0)
+			break;
+		/* get_block() will not find these blocks new */
+		if (buffer_new(&dummy))
+			for (i = 0; i < ret; i++)
+				unmap_underlying_metadata(dummy.b_bdev,
+							  dummy.b_blocknr + i);
+		block += ret;
+	}
+}
+
+/*
+ * Write the next pages of @i at @pos, like write_begin and write_end of
+ * each page would, but with all pages locked up front and under a single
+ * journal handle.  The data is copied from the current iovec segment only,
+ * which is faulted in before the pages are locked.  Returns the number of
+ * bytes written, or 0 to leave the rest of the write to the generic path.
+ */
+static size_t next3_write_batch(struct file *file, struct iov_iter *i,
+				loff_t pos)
+{
+	struct address_space *mapping = file->f_mapping;
 	struct inode *inode = mapping->host;
-	int ret = 0, ret2;
-	int partial = 0;
-	unsigned from, to;
+	struct page *pages[NEXT3_WRITE_BATCH];
+	int needed = next3_writepage_trans_blocks(inode) + 1;
+	int max_nr = (NEXT3_JOURNAL(inode)->j_max_transaction_buffers / 4 - 1) /
+		needed;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	unsigned offset = pos & (PAGE_CACHE_SIZE - 1);
+	size_t bytes = iov_iter_single_seg_count(i);
+	char __user *buf = i->iov->iov_base + i->iov_offset;
+	handle_t *handle;
+	size_t written = 0, off;
+	int nr, n, ret = 0, err;
+
+	nr = min_t(int, NEXT3_WRITE_BATCH, max_nr);
+	if (bytes > ((size_t)nr << PAGE_CACHE_SHIFT) - offset)
+		bytes = ((size_t)nr << PAGE_CACHE_SHIFT) - offset;
+	nr = (offset + bytes + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (nr < 2)
+		return 0;
 
-	from = pos & (PAGE_CACHE_SIZE - 1);
-	to = from + len;
+	/* the copies are atomic, so the source must not fault */
+	for (off = 0; off < bytes; off += PAGE_CACHE_SIZE)
+		if (fault_in_pages_readable(buf + off,
+				min_t(size_t, PAGE_CACHE_SIZE, bytes - off)))
+			return 0;
 
-	if (copied < len) {
-		if (!PageUptodate(page))
-			copied = 0;
-		page_zero_new_buffers(page, from + copied, to);
-		to = from + copied;
+	for (n = 0; n < nr; n++) {
+		pages[n] = grab_cache_page_write_begin(mapping, index + n, 0);
+		if (!pages[n])
+			break;
+	}
+	if (n < nr) {
+		nr = n;
+		bytes = ((size_t)nr << PAGE_CACHE_SHIFT) - offset;
+		if (!nr)
+			return 0;
 	}
 
-	ret = walk_page_buffers(handle, page_buffers(page), from,
-				to, &partial, write_end_fn);
-	if (!partial)
-		SetPageUptodate(page);
+	handle = next3_journal_start(inode, nr * needed + 1);
+	if (IS_ERR(handle)) {
+		n = 0;
+		goto out_pages;
+	}
+	next3_write_batch_map(inode, handle, pos, bytes);
 
-	if (pos + copied > inode->i_size)
-		i_size_write(inode, pos + copied);
+	for (n = 0; n < nr; n++) {
+		struct page *page = pages[n];
+		unsigned from = n ? 0 : offset;
+		unsigned len = min_t(size_t, PAGE_CACHE_SIZE - from,
+				     bytes - written);
+		size_t copied;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+		prepare_page_move_data(inode, page, from, from + len);
+#endif
+		ret = block_prepare_write(page, from, from + len,
+					  next3_get_block);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+		clear_page_move_data(page);
+#endif
+		if (ret)
+			break;
+
+		if (mapping_writably_mapped(mapping))
+			flush_dcache_page(page);
+		pagefault_disable();
+		copied = iov_iter_copy_from_user_atomic(page, i, from, len);
+		pagefault_enable();
+		flush_dcache_page(page);
+		mark_page_accessed(page);
+
+		copied = block_write_end(file, mapping, pos + written, len,
+					 copied, page, NULL);
+		if (next3_should_order_data(inode))
+			ret = walk_page_buffers(handle, page_buffers(page),
+					from, from + copied, NULL,
+					journal_dirty_data_fn);
+		if (!ret)
+			update_file_sizes(inode, pos + written, copied);
+#ifdef CONFIG_NEXT3_FS_NOBH
+		if (!ret)
+			next3_page_drop_buffers(inode, page);
+#endif
+		iov_iter_advance(i, copied);
+		written += copied;
+		unlock_page(page);
+		page_cache_release(page);
+		if (ret || copied < len) {
+			n++;
+			break;
+		}
+	}
 	/*
 	 * There may be allocated blocks outside of i_size because
 	 * we failed to copy some data. Prepare for truncate.
 	 */
-	if (pos + len > inode->i_size && next3_can_truncate(inode))
+	if (pos + bytes > inode->i_size && next3_can_truncate(inode))
 		next3_orphan_add(handle, inode);
-	next3_set_inode_state(inode, NEXT3_STATE_JDATA);
-	if (inode->i_size > NEXT3_I(inode)->i_disksize) {
-		NEXT3_I(inode)->i_disksize = inode->i_size;
-		ret2 = next3_mark_inode_dirty(handle, inode);
-		if (!ret)
+	err = next3_journal_stop(handle);
+	if (!ret)
+		ret = err;
+out_pages:
+	for (; n < nr; n++) {
+		unlock_page(pages[n]);
+		page_cache_release(pages[n]);
+	}
+	if (!IS_ERR(handle) && pos + bytes > inode->i_size)
+		next3_truncate_failed_write(inode);
+	return written;
+}
+
+/*
+ * Write as much of a large buffered write as possible in batches of
+ * pages, each under a single journal handle, so the credits are reserved
+ * once per batch and the blocks past i_size are allocated together.
+ * Called with i_mutex held, after the generic write checks.  Returns the
+ * number of bytes written, the rest of the write is left to the caller.
+ */
+size_t next3_write_batched(struct file *file, const struct iovec *iov,
+			   unsigned long nr_segs, loff_t pos, size_t count)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct iov_iter i;
+	size_t written = 0, ret;
+
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	if (next3_test_inode_state(mapping->host, NEXT3_STATE_DEFRAG))
+		return 0;
+#endif
+	iov_iter_init(&i, iov, nr_segs, count, 0);
+	while (iov_iter_count(&i) >= 2 * PAGE_CACHE_SIZE) {
+		ret = next3_write_batch(file, &i, pos + written);
+		if (!ret)
+			break;
+		written += ret;
+		balance_dirty_pages_ratelimited_nr(mapping,
+				DIV_ROUND_UP(ret, PAGE_CACHE_SIZE));
+		cond_resched();
+	}
+	return written;
+}
+
+#endif
+static int next3_journalled_write_end(struct file *file,
+				struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned copied,
+				struct page *page, void *fsdata)
+{
+	handle_t *handle = next3_journal_current_handle();
+	struct inode *inode = mapping->host;
+	int ret = 0, ret2;
+	int partial = 0;
+	unsigned from, to;
+
+	from = pos & (PAGE_CACHE_SIZE - 1);
+	to = from + len;
+
+	if (copied < len) {
+		if (!PageUptodate(page))
+			copied = 0;
+		page_zero_new_buffers(page, from + copied, to);
+		to = from + copied;
+	}
+
+	ret = walk_page_buffers(handle, page_buffers(page), from,
+				to, &partial, write_end_fn);
+	if (!partial)
+		SetPageUptodate(page);
+
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	/*
+	 * There may be allocated blocks outside of i_size because
+	 * we failed to copy some data. Prepare for truncate.
+	 */
+	if (pos + len > inode->i_size && next3_can_truncate(inode))
+		next3_orphan_add(handle, inode);
+	next3_set_inode_state(inode, NEXT3_STATE_JDATA);
+	if (inode->i_size > NEXT3_I(inode)->i_disksize) {
+		NEXT3_I(inode)->i_disksize = inode->i_size;
+		ret2 = next3_mark_inode_dirty(handle, inode);
+		if (!ret)
 			ret = ret2;
 	}
 
@@ -2423,9 +3506,106 @@ static int bput_one(handle_t *handle, struct buffer_head *bh)
 
 static int buffer_unmapped(handle_t *handle, struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+	/* delayed move buffers must go through get_block() */
+	if (buffer_delay(bh))
+		return 1;
+#endif
 	return !buffer_mapped(bh);
 }
 
+#ifdef CONFIG_NEXT3_FS_NOBH
+/*
+ * get_block() for writing pages without buffers, whose blocks are all
+ * mapped, without a journal handle.  Fails if a block is not mapped, so
+ * nobh_writepage() never allocates one.
+ */
+static int next3_get_block_mapped(struct inode *inode, sector_t iblock,
+				  struct buffer_head *bh_result, int create)
+{
+	int ret = next3_get_block(inode, iblock, bh_result, 0);
+
+	if (!ret && !buffer_mapped(bh_result))
+		ret = -EIO;
+	return ret;
+}
+
+/*
+ * Are all the blocks of @page inside i_size mapped, and contiguous, so
+ * mpage_writepage() can write the page in place without falling back to
+ * writepage()?
+ */
+static int next3_nobh_page_mapped(struct inode *inode, struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	unsigned blkbits = inode->i_blkbits;
+	sector_t block, last;
+	next3_fsblk_t next = 0;
+	struct buffer_head dummy;
+
+	if (page_offset(page) >= size)
+		return 0;
+	block = (sector_t)page->index << (PAGE_CACHE_SHIFT - blkbits);
+	last = min_t(sector_t, (size - 1) >> blkbits,
+		     block + (PAGE_CACHE_SIZE >> blkbits) - 1);
+	for (; block <= last; block++) {
+		dummy.b_state = 0;
+		dummy.b_size = 1 << blkbits;
+		if (next3_get_block(inode, block, &dummy, 0) ||
+		    !buffer_mapped(&dummy))
+			return 0;
+		if (next && dummy.b_blocknr != next)
+			return 0;
+		next = dummy.b_blocknr + 1;
+	}
+	return 1;
+}
+
+/*
+ * Write a page without buffers of an inode ordered by inode.  Pages with
+ * all blocks mapped are written in place, also by kjournald.  Otherwise
+ * the page is filed on the transaction that allocates its blocks.
+ */
+static int next3_nobh_ordered_writepage(struct page *page,
+					struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	handle_t *handle;
+	int ret, err;
+
+	if (next3_nobh_page_mapped(inode, page))
+		return nobh_writepage(page, next3_get_block_mapped, wbc);
+	/* kjournald can't start a handle, and there are no blocks to order */
+	if (current == NEXT3_JOURNAL(inode)->j_task) {
+		ret = 0;
+		goto out_fail;
+	}
+
+	handle = next3_journal_start(inode, next3_writepage_trans_blocks(inode));
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out_fail;
+	}
+	ret = next3_journal_order_range(handle, inode, page_offset(page),
+					PAGE_CACHE_SIZE);
+	if (ret) {
+		next3_journal_stop(handle);
+		goto out_fail;
+	}
+	ret = nobh_writepage(page, next3_get_block, wbc);
+	err = next3_journal_stop(handle);
+	if (!ret)
+		ret = err;
+	return ret;
+
+out_fail:
+	redirty_page_for_writepage(wbc, page);
+	unlock_page(page);
+	return ret;
+}
+
+#endif
+
 /*
  * Note that we always start a transaction even if we're not journalling
  * data.  This is to preserve ordering: any hole instantiation within
@@ -2445,7 +3625,7 @@ static int buffer_unmapped(handle_t *handle, struct buffer_head *bh)
  *	next3_file_write() -> generic_file_write() -> __alloc_pages() -> ...
  *
  * Same applies to next3_get_block().  We will deadlock on various things like
- * lock_journal and i_truncate_mutex.
+ * lock_journal and truncate_sem.
  *
  * Setting PF_MEMALLOC here doesn't work - too many internal memory
  * allocations fail.
@@ -2496,6 +3676,27 @@ static int next3_ordered_writepage(struct page *page,
 	 */
 	if (next3_journal_current_handle())
 		goto out_fail;
+#ifdef CONFIG_NEXT3_FS_NOBH
+	if (!page_has_buffers(page) && next3_nobh_data(inode))
+		return next3_nobh_ordered_writepage(page, wbc);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+
+	/*
+	 * Commit writes out the data of ORDERED_INODE inodes with
+	 * writepage().  kjournald must not start a handle, so it writes
+	 * only pages with mapped blocks, in place.  Unmapped buffers have
+	 * no blocks to order.  There is no active snapshot while any inode
+	 * is ordered by inode, so no block needs to be moved-on-write.
+	 */
+	if (current == NEXT3_JOURNAL(inode)->j_task) {
+		if (page_has_buffers(page) &&
+		    !walk_page_buffers(NULL, page_buffers(page), 0,
+				       PAGE_CACHE_SIZE, NULL, buffer_unmapped))
+			return block_write_full_page(page, NULL, wbc);
+		goto out_fail;
+	}
+#endif
 
 	if (!page_has_buffers(page)) {
 		create_empty_buffers(page, inode->i_sb->s_blocksize,
@@ -2609,6 +3810,412 @@ out_fail:
 	return ret;
 }
 
+#ifdef CONFIG_NEXT3_FS_WRITEPAGES
+/*
+ * next3_writepages() collects the dirty pages of a batch locked with
+ * write_cache_pages() and only then starts the journal handle, so the
+ * page lock -> journal start order of next3_write_begin() and writepage()
+ * is kept.  A batch is never wrapped around the end of the file, so its
+ * pages are always locked in ascending index order.
+ */
+#define NEXT3_WRITEPAGES_BATCH	32
+/* returned by the collect callback to stop write_cache_pages() */
+#define NEXT3_WRITEPAGES_FULL	1
+
+struct next3_writepages_batch {
+	struct page *pages[NEXT3_WRITEPAGES_BATCH];
+	int nr;
+};
+
+static int next3_writepages_collect(struct page *page,
+				    struct writeback_control *wbc, void *data)
+{
+	struct next3_writepages_batch *batch = data;
+
+	page_cache_get(page);
+	batch->pages[batch->nr++] = page;
+	return batch->nr == NEXT3_WRITEPAGES_BATCH ? NEXT3_WRITEPAGES_FULL : 0;
+}
+
+/*
+ * Start the handle of the batch, or make sure that it has @needed credits
+ * left.  The pages that were written under the handle so far are all
+ * filed, so it is safe to restart it.
+ */
+static int next3_writepages_credits(struct inode *inode, handle_t **handle,
+				    int needed)
+{
+	handle_t *h;
+
+	if (!*handle) {
+		*handle = next3_journal_start(inode, needed);
+		if (IS_ERR(*handle)) {
+			int err = PTR_ERR(*handle);
+
+			*handle = NULL;
+			return err;
+		}
+		return 0;
+	}
+	h = *handle;
+	if (NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(h, needed))
+		return 0;
+	if (!next3_journal_extend(h, needed))
+		return 0;
+	return next3_journal_restart(h, needed);
+}
+
+static int buffer_mapped_or_clean(handle_t *handle, struct buffer_head *bh)
+{
+	return !buffer_unmapped(handle, bh) || !buffer_dirty(bh);
+}
+
+/*
+ * Does block_write_full_page() need to allocate all blocks of @page?
+ * Pages without buffers are dirty as a whole.
+ */
+static int next3_writepages_page_unmapped(struct page *page)
+{
+	if (!page_has_buffers(page))
+		return 1;
+	return !walk_page_buffers(NULL, page_buffers(page), 0,
+				  PAGE_CACHE_SIZE, NULL,
+				  buffer_mapped_or_clean);
+}
+
+/*
+ * Allocate the blocks of the run of @nr pages from @index, that need
+ * all their blocks allocated, with as few next3_get_blocks_handle() calls
+ * as possible, so the run gets contiguous blocks.  Blocks beyond i_size
+ * are not allocated.  The buffers are mapped later by get_block(), which
+ * then finds the blocks allocated.  Errors are left for get_block() to
+ * find again.
+ */
+static void next3_writepages_map_run(struct inode *inode, handle_t **handle,
+				     pgoff_t index, int nr)
+{
+	int shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	sector_t block = (sector_t)index << shift;
+	sector_t end = block + ((sector_t)nr << shift);
+	sector_t last = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >>
+		inode->i_blkbits;
+	struct buffer_head dummy;
+	int i, ret;
+
+	if (end > last)
+		end = last;
+	while (block < end) {
+		if (next3_writepages_credits(inode, handle,
+				next3_writepage_trans_blocks(inode)))
+			break;
+		dummy.b_state = 0;
+		ret = next3_get_blocks_handle(*handle, inode, block,
+					      end - block, &dummy, 1);
+		if (ret <= 0)
+			break;
+		/* get_block() will not find these blocks new */
+		if (buffer_new(&dummy))
+			for (i = 0; i < ret; i++)
+				unmap_underlying_metadata(dummy.b_bdev,
+							  dummy.b_blocknr + i);
+		block += ret;
+	}
+}
+
+/*
+ * Write the collected pages of @batch, like next3_ordered_writepage() or
+ * next3_writeback_writepage() would, but under one handle.
+ */
+static int next3_writepages_batch(struct inode *inode,
+				  struct next3_writepages_batch *batch,
+				  struct writeback_control *wbc)
+{
+	int ordered = next3_should_order_data(inode);
+#ifdef CONFIG_NEXT3_FS_NOBH
+	int nobh = next3_nobh_data(inode);
+#endif
+	int needed = next3_writepage_trans_blocks(inode);
+	int should_move = 0;
+	handle_t *handle = NULL;
+	pgoff_t mapped_end = 0;
+	int i, n, ret = 0, err;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	/* one move-on-write check for all pages of the batch */
+	if (ordered)
+		should_move = next3_snapshot_should_move_data(inode);
+#endif
+	for (i = 0; i < batch->nr; i++) {
+		struct page *page = batch->pages[i];
+		struct buffer_head *page_bufs;
+#ifdef CONFIG_NEXT3_FS_NOBH
+		/* pages without buffers are written with nobh_writepage() */
+		int nobh_page = nobh && !page_has_buffers(page);
+#endif
+
+#ifdef CONFIG_NEXT3_FS_NOBH
+		if (ordered && !nobh_page) {
+#else
+		if (ordered) {
+#endif
+			if (!page_has_buffers(page))
+				create_empty_buffers(page,
+					inode->i_sb->s_blocksize,
+					(1 << BH_Dirty)|(1 << BH_Uptodate));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+			else if (should_move)
+				set_page_move_data(page, 0, PAGE_CACHE_SIZE);
+#endif
+		}
+		if (page_has_buffers(page) &&
+		    !walk_page_buffers(NULL, page_buffers(page), 0,
+				       PAGE_CACHE_SIZE, NULL, buffer_unmapped)) {
+			/* Provide NULL get_block() to catch bugs if buffers
+			 * weren't really mapped */
+			err = block_write_full_page(page, NULL, wbc);
+			goto next;
+		}
+
+		err = next3_writepages_credits(inode, &handle, needed);
+		if (err) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+			if (ordered)
+				clear_page_move_data(page);
+#endif
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			goto next;
+		}
+
+		/* a move-on-write page is moved one block at a time */
+		if (!should_move && page->index >= mapped_end &&
+		    next3_writepages_page_unmapped(page)) {
+			for (n = 1; i + n < batch->nr; n++)
+				if (batch->pages[i + n]->index !=
+				    page->index + n ||
+				    !next3_writepages_page_unmapped(
+						batch->pages[i + n]))
+					break;
+			next3_writepages_map_run(inode, &handle,
+						 page->index, n);
+			mapped_end = page->index + n;
+			err = next3_writepages_credits(inode, &handle, needed);
+			if (err) {
+				redirty_page_for_writepage(wbc, page);
+				unlock_page(page);
+				goto next;
+			}
+		}
+
+		if (!ordered) {
+			if (test_opt(inode->i_sb, NOBH) &&
+			    next3_should_writeback_data(inode))
+				err = nobh_writepage(page, next3_get_block,
+						     wbc);
+			else
+				err = block_write_full_page(page,
+						next3_get_block, wbc);
+			goto next;
+		}
+#ifdef CONFIG_NEXT3_FS_NOBH
+		if (nobh_page) {
+			/* see next3_nobh_ordered_writepage() */
+			err = next3_journal_order_range(handle, inode,
+					page_offset(page), PAGE_CACHE_SIZE);
+			if (err) {
+				redirty_page_for_writepage(wbc, page);
+				unlock_page(page);
+				goto next;
+			}
+			err = nobh_writepage(page, next3_get_block, wbc);
+			goto next;
+		}
+#endif
+
+		page_bufs = page_buffers(page);
+		walk_page_buffers(handle, page_bufs, 0,
+				PAGE_CACHE_SIZE, NULL, bget_one);
+		err = block_write_full_page(page, next3_get_block, wbc);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+		clear_page_move_data(page);
+#endif
+		/* see next3_ordered_writepage() */
+		if (!err)
+			err = walk_page_buffers(handle, page_bufs, 0,
+					PAGE_CACHE_SIZE, NULL,
+					journal_dirty_data_fn);
+		walk_page_buffers(handle, page_bufs, 0,
+				PAGE_CACHE_SIZE, NULL, bput_one);
+next:
+		if (err && !ret)
+			ret = err;
+		page_cache_release(page);
+	}
+	batch->nr = 0;
+
+	if (handle) {
+		err = next3_journal_stop(handle);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+static int next3_writepages(struct address_space *mapping,
+			    struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct next3_writepages_batch *batch;
+	loff_t range_start = wbc->range_start;
+	loff_t range_end = wbc->range_end;
+	int range_cyclic = wbc->range_cyclic;
+	pgoff_t index = 0, wrap_index = 0;
+	int ret, err, full;
+
+	/*
+	 * We give up here if we're reentered, because it might be for a
+	 * different filesystem.  writepage() redirties the pages.
+	 */
+	if (next3_journal_current_handle())
+		return generic_writepages(mapping, wbc);
+
+	batch = kmalloc(sizeof(*batch), GFP_NOFS);
+	if (!batch)
+		return generic_writepages(mapping, wbc);
+	batch->nr = 0;
+
+	if (range_cyclic) {
+		/* write from writeback_index to the end, then wrap around */
+		index = wrap_index = mapping->writeback_index;
+		wbc->range_cyclic = 0;
+		wbc->range_start = (loff_t)index << PAGE_CACHE_SHIFT;
+		wbc->range_end = LLONG_MAX;
+	}
+retry:
+	do {
+		ret = write_cache_pages(mapping, wbc, next3_writepages_collect,
+					batch);
+		full = (ret == NEXT3_WRITEPAGES_FULL);
+		if (full) {
+			/* write_cache_pages() did not count the last page */
+			ret = 0;
+			wbc->nr_to_write--;
+		}
+		if (batch->nr) {
+			index = batch->pages[batch->nr - 1]->index + 1;
+			wbc->range_start = (loff_t)index << PAGE_CACHE_SHIFT;
+		}
+		err = next3_writepages_batch(inode, batch, wbc);
+		if (err) {
+			mapping_set_error(mapping, err);
+			if (!ret)
+				ret = err;
+		}
+	} while (!ret && full && (wbc->nr_to_write > 0 ||
+				  wbc->sync_mode != WB_SYNC_NONE));
+
+	if (!ret && !full && wrap_index) {
+		wbc->range_start = 0;
+		wbc->range_end = ((loff_t)wrap_index << PAGE_CACHE_SHIFT) - 1;
+		wrap_index = 0;
+		goto retry;
+	}
+
+	if (range_cyclic)
+		mapping->writeback_index = index;
+	wbc->range_cyclic = range_cyclic;
+	wbc->range_start = range_start;
+	wbc->range_end = range_end;
+	kfree(batch);
+	return ret;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_PAGE_MKWRITE
+/*
+ * Called when a page of a shared writable mapping is about to be made
+ * writable.  Holes are allocated and blocks that belong to a snapshot are
+ * moved-on-write now, in the context of the writer, so that writepage() of
+ * the page, which may be called from reclaim, has nothing left to allocate
+ * and allocation errors can be reported with SIGBUS.
+ *
+ * Truncate is not excluded by i_alloc_sem.  i_size is checked under the
+ * page lock and truncate_inode_pages() waits for the page lock before the
+ * blocks are truncated, so the blocks we allocate inside the old i_size
+ * are freed by the truncate that follows.
+ */
+int next3_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct page *page = vmf->page;
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	handle_t *handle;
+	loff_t size;
+	unsigned len;
+	int should_move = 0;
+	int retries = 0;
+	int ret, ret2;
+
+	/* data=journal pages get their blocks in writepage() */
+	if (next3_should_journal_data(inode))
+		return 0;
+retry:
+	lock_page(page);
+	size = i_size_read(inode);
+	if (page->mapping != inode->i_mapping || page_offset(page) >= size) {
+		/* page got truncated from under us */
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+	wait_on_page_writeback(page);
+	if (page->index == (size - 1) >> PAGE_CACHE_SHIFT)
+		len = ((size - 1) & ~PAGE_CACHE_MASK) + 1;
+	else
+		len = PAGE_CACHE_SIZE;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	should_move = next3_snapshot_should_move_data(inode);
+#endif
+	/* nothing to allocate or move-on-write */
+	if (page_has_buffers(page) && !should_move &&
+	    !walk_page_buffers(NULL, page_buffers(page), 0, len, NULL,
+				buffer_unmapped))
+		return VM_FAULT_LOCKED;
+
+	handle = next3_journal_start(inode, next3_writepage_trans_blocks(inode));
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out_unlock;
+	}
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	/* don't delay move-on-write to writepage(), that is the point here */
+	if (should_move)
+		set_page_move_data(page, 0, len);
+#endif
+	ret = block_prepare_write(page, 0, len, next3_get_block);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
+	clear_page_move_data(page);
+#endif
+	if (!ret)
+		ret = block_commit_write(page, 0, len);
+	/* the new blocks must not be exposed before the data is written */
+	if (!ret && next3_should_order_data(inode))
+		ret = walk_page_buffers(handle, page_buffers(page), 0, len,
+				NULL, journal_dirty_data_fn);
+	ret2 = next3_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+	if (!ret)
+		return VM_FAULT_LOCKED;
+out_unlock:
+	unlock_page(page);
+	if (ret == -ENOSPC && next3_should_retry_alloc(inode->i_sb, &retries))
+		goto retry;
+	return ret == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+}
+
+#endif
 static int next3_journalled_writepage(struct page *page,
 				struct writeback_control *wbc)
 {
@@ -2676,8 +4283,14 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 			struct buffer_head *bh_result, int create)
 {
 	unsigned long block_group;
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	long bitmap_group;
+#else
 	struct next3_group_desc *desc;
+#endif
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
 	struct next3_group_info *gi;
+#endif
 	next3_fsblk_t bitmap_blk = 0;
 	int err;
 
@@ -2691,6 +4304,12 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 			"err = %d\n",
 			(long long)iblock, buffer_mapped(bh_result) ?
 			(long long)bh_result->b_blocknr : 0, err);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_snapshot_get_block(inode->i_sb, inode->i_generation,
+			iblock, buffer_mapped(bh_result) ?
+			bh_result->b_blocknr : 0,
+			buffer_tracked_read(bh_result), err);
+#endif
 
 	if (err < 0)
 		return err;
@@ -2700,9 +4319,19 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 
 	/* check for read through to block bitmap */
 	block_group = SNAPSHOT_BLOCK_GROUP(bh_result->b_blocknr);
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	/* the block bitmap may belong to another group of the flex group */
+	bitmap_group = next3_block_bitmap_group(inode->i_sb,
+						bh_result->b_blocknr);
+	if (bitmap_group >= 0) {
+		block_group = bitmap_group;
+		bitmap_blk = bh_result->b_blocknr;
+	}
+#else
 	desc = next3_get_group_desc(inode->i_sb, block_group, NULL);
 	if (desc)
 		bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+#endif
 	if (bitmap_blk && bitmap_blk == bh_result->b_blocknr) {
 		/* copy fixed block bitmap directly to page buffer */
 		cancel_buffer_tracked_read(bh_result);
@@ -2715,13 +4344,19 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 		 * but if we return mapped to block device and uptodate buffer
 		 * next readpage may read directly from block device without
 		 * fixing block bitmap.  This only affects fsck of snapshots.
+		 * With BLOCK_BITMAP_CACHE, the fixed bitmap is kept aside,
+		 * so the next readpage does not need to fix it again.
 		 */
 		return next3_snapshot_read_block_bitmap(inode->i_sb,
 				block_group, bh_result);
 	}
 	/* check for read through to exclude bitmap */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	bitmap_blk = next3_exclude_bitmap_blk(inode->i_sb, block_group);
+#else
 	gi = NEXT3_SB(inode->i_sb)->s_group_info + block_group;
 	bitmap_blk = gi->bg_exclude_bitmap;
+#endif
 	if (bitmap_blk && bitmap_blk == bh_result->b_blocknr) {
 		/* return unmapped buffer to zero out page */
 		cancel_buffer_tracked_read(bh_result);
@@ -2730,6 +4365,13 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 				block_group);
 		return 0;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_BDEV
+	/* try to read through from block device buffer cache */
+	if (copy_buffer_tracked_read(bh_result)) {
+		snapshot_stats_inc(inode->i_sb, read_bdev_cache);
+		return 0;
+	}
+#endif
 
 #ifdef CONFIG_NEXT3_FS_DEBUG
 	snapshot_debug(3, "started tracked read: block = [%lu/%lu]\n",
@@ -2750,11 +4392,238 @@ static int next3_snapshot_get_block(struct inode *inode, sector_t iblock,
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_DIRECT_IO
+/*
+ * Snapshot direct I/O read context.
+ * Read through blocks are read from disk under tracked read.  The tracked
+ * reads are ended by next3_snapshot_direct_IO() after the I/O has completed,
+ * so the read through extents are kept in the context of the reading task.
+ */
+#define NEXT3_SNAPSHOT_DIO_EXTENTS	64
+
+struct next3_snapshot_dio {
+	struct list_head list;		/* on s_snapshot_dio_reads */
+	struct task_struct *task;
+	int count;			/* no. of read through extents */
+	struct {
+		next3_fsblk_t start;
+		unsigned int len;
+	} extents[NEXT3_SNAPSHOT_DIO_EXTENTS];
+};
+
+/*
+ * next3_snapshot_dio_add() - add read through block to direct I/O context
+ * Returns 1 if @blk was added and 0 if the context is full.
+ */
+static int next3_snapshot_dio_add(struct super_block *sb, next3_fsblk_t blk)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_snapshot_dio *dio, *found = NULL;
+	int n;
+
+	spin_lock(&sbi->s_snapshot_dio_lock);
+	list_for_each_entry(dio, &sbi->s_snapshot_dio_reads, list)
+		if (dio->task == current) {
+			found = dio;
+			break;
+		}
+	spin_unlock(&sbi->s_snapshot_dio_lock);
+	/* only the reading task changes its context */
+	dio = found;
+	if (!dio)
+		return 0;
+
+	n = dio->count;
+	if (n && dio->extents[n-1].start + dio->extents[n-1].len == blk) {
+		dio->extents[n-1].len++;
+		return 1;
+	}
+	if (n == NEXT3_SNAPSHOT_DIO_EXTENTS)
+		return 0;
+	dio->extents[n].start = blk;
+	dio->extents[n].len = 1;
+	dio->count++;
+	return 1;
+}
+
+/*
+ * next3_snapshot_dio_end() - end tracked reads of direct I/O context
+ */
+static void next3_snapshot_dio_end(struct super_block *sb,
+		struct next3_snapshot_dio *dio)
+{
+	struct buffer_head bh;
+	unsigned int i;
+	int n;
+
+	for (n = 0; n < dio->count; n++) {
+		for (i = 0; i < dio->extents[n].len; i++) {
+			memset(&bh, 0, sizeof(bh));
+			map_bh(&bh, sb, dio->extents[n].start + i);
+			set_buffer_tracked_read(&bh);
+			cancel_buffer_tracked_read(&bh);
+		}
+	}
+}
+
+/*
+ * next3_snapshot_get_block_dio() - get_block() for snapshot direct I/O read
+ * Maps one block at a time, because next3_get_blocks_handle() checks the
+ * read through and pending COW state of the first block only.
+ * Returns -ENOTBLK for blocks that cannot be read from disk, so the rest of
+ * the request is read via the page cache.
+ */
+static int next3_snapshot_get_block_dio(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	unsigned long block_group;
+#ifndef CONFIG_NEXT3_FS_FLEX_BG
+	struct next3_group_desc *desc;
+#endif
+	next3_fsblk_t bitmap_blk = 0;
+	int err;
+
+	BUG_ON(create != 0);
+	BUG_ON(buffer_tracked_read(bh_result));
+
+	set_buffer_direct_io(bh_result);
+	err = next3_get_blocks_handle(NULL, inode, SNAPSHOT_IBLOCK(iblock),
+					1, bh_result, 0);
+	clear_buffer_direct_io(bh_result);
+	if (err <= 0)
+		return err;
+	bh_result->b_size = inode->i_sb->s_blocksize;
+
+	if (!buffer_tracked_read(bh_result))
+		return 0;
+
+	/* block bitmap needs to be fixed and exclude bitmap to be zeroed */
+	block_group = SNAPSHOT_BLOCK_GROUP(bh_result->b_blocknr);
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	/* the block bitmap may belong to another group of the flex group */
+	if (next3_block_bitmap_group(inode->i_sb, bh_result->b_blocknr) >= 0)
+		goto out_buffered;
+#else
+	desc = next3_get_group_desc(inode->i_sb, block_group, NULL);
+	if (desc)
+		bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+	if (bitmap_blk == bh_result->b_blocknr)
+		goto out_buffered;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	bitmap_blk = next3_exclude_bitmap_blk(inode->i_sb, block_group);
+#else
+	bitmap_blk = NEXT3_SB(inode->i_sb)->s_group_info[block_group].
+		bg_exclude_bitmap;
+#endif
+	if (bitmap_blk == bh_result->b_blocknr)
+		goto out_buffered;
+
+	/* keep tracked read until direct I/O is complete */
+	if (next3_snapshot_dio_add(inode->i_sb, bh_result->b_blocknr))
+		return 0;
+
+out_buffered:
+	cancel_buffer_tracked_read(bh_result);
+	return -ENOTBLK;
+}
+
+/*
+ * next3_snapshot_direct_IO() - direct I/O read of snapshot file
+ * Returns the no. of bytes read.  The rest of a short read, including a read
+ * that is not started here (0), is read via the page cache.
+ */
+static ssize_t next3_snapshot_direct_IO(int rw, struct kiocb *iocb,
+			const struct iovec *iov, loff_t offset,
+			unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_snapshot_dio *dio;
+	ssize_t ret;
+
+	if (rw != READ)
+		return -EINVAL;
+	/* tracked reads are ended after the I/O, which must not be async */
+	if (!is_sync_kiocb(iocb))
+		return 0;
+
+	dio = kmalloc(sizeof(*dio), GFP_NOFS);
+	if (!dio)
+		return 0;
+	dio->task = current;
+	dio->count = 0;
+	spin_lock(&sbi->s_snapshot_dio_lock);
+	list_add(&dio->list, &sbi->s_snapshot_dio_reads);
+	spin_unlock(&sbi->s_snapshot_dio_lock);
+
+	ret = blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
+				 offset, nr_segs,
+				 next3_snapshot_get_block_dio, NULL);
+
+	/* synchronous direct I/O has completed */
+	spin_lock(&sbi->s_snapshot_dio_lock);
+	list_del(&dio->list);
+	spin_unlock(&sbi->s_snapshot_dio_lock);
+	next3_snapshot_dio_end(inode->i_sb, dio);
+	kfree(dio);
+	return ret;
+}
+
+#endif
 static int next3_snapshot_readpage(struct file *file, struct page *page)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	int ioprio = next3_snapshot_read_io_begin(file,
+					page->mapping->host->i_sb);
+	int err;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	atomic_long_inc(&NEXT3_SNAP_I(page->mapping->host)->i_snap_read_pages);
+#endif
+	/* do read I/O with buffer heads to enable tracked reads */
+	err = next3_read_full_page(page, next3_snapshot_get_block);
+	next3_snapshot_io_end(ioprio);
+	return err;
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	atomic_long_inc(&NEXT3_SNAP_I(page->mapping->host)->i_snap_read_pages);
+#endif
 	/* do read I/O with buffer heads to enable tracked reads */
 	return next3_read_full_page(page, next3_snapshot_get_block);
+#endif
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READAHEAD
+static int next3_snapshot_readpages(struct file *file,
+		struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	int ioprio = next3_snapshot_read_io_begin(file,
+					mapping->host->i_sb);
+	int err;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	atomic_long_add(nr_pages,
+			&NEXT3_SNAP_I(mapping->host)->i_snap_read_pages);
+#endif
+	/* do read I/O with buffer heads and large bios */
+	err = next3_read_full_pages(mapping, pages, nr_pages,
+			next3_snapshot_get_block);
+	next3_snapshot_io_end(ioprio);
+	return err;
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	atomic_long_add(nr_pages,
+			&NEXT3_SNAP_I(mapping->host)->i_snap_read_pages);
+#endif
+	/* do read I/O with buffer heads and large bios */
+	return next3_read_full_pages(mapping, pages, nr_pages,
+			next3_snapshot_get_block);
+#endif
 }
+#endif
 
 #endif
 static int next3_readpage(struct file *file, struct page *page)
@@ -2779,6 +4648,13 @@ static void next3_invalidatepage(struct page *page, unsigned long offset)
 	if (offset == 0)
 		ClearPageChecked(page);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	/* snapshot image is mounted without a journal */
+	if (!journal) {
+		block_invalidatepage(page, offset);
+		return;
+	}
+#endif
 	journal_invalidatepage(journal, page, offset);
 }
 
@@ -2789,6 +4665,11 @@ static int next3_releasepage(struct page *page, gfp_t wait)
 	WARN_ON(PageChecked(page));
 	if (!page_has_buffers(page))
 		return 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	/* snapshot image is mounted without a journal */
+	if (!journal)
+		return try_to_free_buffers(page);
+#endif
 	return journal_try_to_free_buffers(journal, page, wait);
 }
 
@@ -2835,6 +4716,27 @@ static ssize_t next3_direct_IO(int rw, struct kiocb *iocb,
 		}
 	}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	/*
+	 * The new blocks can only be spliced after the write has completed,
+	 * so async direct I/O writes fall back to buffered I/O.
+	 */
+	if (rw == WRITE && is_sync_kiocb(iocb) &&
+			next3_snapshot_should_move_data(inode)) {
+		struct next3_dio_move *dm;
+
+		dm = kmalloc(sizeof(*dm) +
+				NEXT3_DIO_MOVE_MAX * sizeof(dm->map[0]), GFP_NOFS);
+		if (dm) {
+			dm->start = offset;
+			dm->end = offset + count;
+			dm->count = 0;
+			dm->max = NEXT3_DIO_MOVE_MAX;
+		}
+		ei->i_dio_move = dm;
+	}
+
+#endif
 retry:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA
 	ret = blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
@@ -2845,9 +4747,17 @@ retry:
 	ret = blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
 				 offset, nr_segs,
 				 next3_get_block, NULL);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	if (ei->i_dio_move)
+		ret = next3_dio_splice_moves(inode, offset, ret);
 #endif
 	if (ret == -ENOSPC && next3_should_retry_alloc(inode->i_sb, &retries))
 		goto retry;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	kfree(ei->i_dio_move);
+	ei->i_dio_move = NULL;
+#endif
 
 	if (orphan) {
 		int err;
@@ -2910,6 +4820,9 @@ static const struct address_space_operations next3_ordered_aops = {
 	.readpage		= next3_readpage,
 	.readpages		= next3_readpages,
 	.writepage		= next3_ordered_writepage,
+#ifdef CONFIG_NEXT3_FS_WRITEPAGES
+	.writepages		= next3_writepages,
+#endif
 	.sync_page		= block_sync_page,
 	.write_begin		= next3_write_begin,
 	.write_end		= next3_ordered_write_end,
@@ -2926,6 +4839,9 @@ static const struct address_space_operations next3_writeback_aops = {
 	.readpage		= next3_readpage,
 	.readpages		= next3_readpages,
 	.writepage		= next3_writeback_writepage,
+#ifdef CONFIG_NEXT3_FS_WRITEPAGES
+	.writepages		= next3_writepages,
+#endif
 	.sync_page		= block_sync_page,
 	.write_begin		= next3_write_begin,
 	.write_end		= next3_writeback_write_end,
@@ -2963,8 +4879,10 @@ static int next3_no_writepage(struct page *page,
 
 /*
  * Snapshot file page operations:
- * always readpage (by page) with buffer tracked read.
- * user cannot writepage or direct_IO to a snapshot file.
+ * always readpage (by page) or readpages (by contiguous pages)
+ * with buffer tracked read.
+ * user cannot writepage or direct_IO to a snapshot file, but may read a
+ * snapshot file with direct_IO and tracked read.
  *
  * snapshot file pages are written to disk after a COW operation in "ordered"
  * mode and are never changed after that again, so there is no data corruption
@@ -2975,12 +4893,18 @@ static int next3_no_writepage(struct page *page,
 static const struct address_space_operations next3_snapfile_aops = {
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
 	.readpage		= next3_snapshot_readpage,
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READAHEAD
+	.readpages		= next3_snapshot_readpages,
+#endif
 #else
 	.readpage		= next3_readpage,
 	.readpages		= next3_readpages,
 #endif
 	.writepage		= next3_no_writepage,
 	.bmap			= next3_bmap,
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_DIRECT_IO
+	.direct_IO		= next3_snapshot_direct_IO,
+#endif
 	.invalidatepage		= next3_invalidatepage,
 	.releasepage		= next3_releasepage,
 };
@@ -3025,12 +4949,24 @@ static int next3_block_truncate_page(handle_t *handle, struct page *page,
 	 * For "nobh" option,  we can only work if we don't need to
 	 * read-in the page - otherwise we create buffers to do the IO.
 	 */
+#ifdef CONFIG_NEXT3_FS_NOBH
+	if (!page_has_buffers(page) && next3_nobh_data(inode) &&
+	    PageUptodate(page)) {
+		zero_user(page, offset, length);
+		set_page_dirty(page);
+		if (next3_should_order_data(inode))
+			err = next3_journal_order_range(handle, inode,
+					page_offset(page) + offset, length);
+		goto unlock;
+	}
+#else
 	if (!page_has_buffers(page) && test_opt(inode->i_sb, NOBH) &&
 	     next3_should_writeback_data(inode) && PageUptodate(page)) {
 		zero_user(page, offset, length);
 		set_page_dirty(page);
 		goto unlock;
 	}
+#endif
 
 	if (!page_has_buffers(page))
 		create_empty_buffers(page, blocksize, 0);
@@ -3105,7 +5041,11 @@ static int next3_block_truncate_page(handle_t *handle, struct page *page,
 		err = next3_journal_dirty_metadata(handle, bh);
 	} else {
 		if (next3_should_order_data(inode))
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+			err = next3_journal_order_data(handle, bh);
+#else
 			err = next3_journal_dirty_data(handle, bh);
+#endif
 		mark_buffer_dirty(bh);
 	}
 
@@ -3299,7 +5239,11 @@ static void next3_clear_blocks(handle_t *handle, struct inode *inode,
 		}
 	}
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	next3_free_blocks_batch(handle, inode, block_to_free, count);
+#else
 	next3_free_blocks(handle, inode, block_to_free, count);
+#endif
 }
 
 /**
@@ -3451,6 +5395,71 @@ static void next3_free_data(handle_t *handle, struct inode *inode,
 	}
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE_BULK
+/*
+ * next3_free_leaf_bulk - free the data blocks of a whole leaf branch
+ * @handle:	handle for this transaction
+ * @inode:	inode we are dealing with
+ * @bh:		indirect block, which maps data blocks and is about to be freed
+ *
+ * If @bh maps a single contiguous run of data blocks, free the run at once,
+ * without clearing the block pointers in @bh.  Under an active snapshot,
+ * the run is moved to the snapshot with one delete access.  @bh itself is
+ * not modified, so it is not COWed before it is moved to the snapshot.
+ * The caller frees @bh in this transaction, so the on-disk file never
+ * points at the freed blocks.
+ * Returns 1 if the data blocks were freed and 0 if caller should free them.
+ */
+static int next3_free_leaf_bulk(handle_t *handle, struct inode *inode,
+		struct buffer_head *bh)
+{
+	__le32 *first = (__le32 *)bh->b_data;
+	__le32 *last = first + NEXT3_ADDR_PER_BLOCK(inode->i_sb);
+	__le32 *start, *p;
+	next3_fsblk_t block;
+	unsigned long count;
+	/* data run, indirect block and parent block credits */
+	int needed = 2 * NEXT3_RESERVE_TRANS_BLOCKS + 1;
+
+	if (next3_snapshot_file(inode))
+		return 0;
+	for (start = first; start < last && !*start; start++)
+		;
+	if (start == last)
+		return 0;
+	block = le32_to_cpu(*start);
+	for (p = start + 1; p < last && *p; p++)
+		if (le32_to_cpu(*p) != block + (p - start))
+			return 0;
+	count = p - start;
+	for (; p < last; p++)
+		if (*p)
+			return 0;
+
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	if (NEXT3_I(inode)->i_free_batch)
+		needed += NEXT3_FREE_BATCH_CREDITS(NEXT3_I(inode)->i_free_batch);
+#endif
+	/* the caller must not restart the transaction before freeing @bh */
+	if (!NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle, needed) &&
+	    next3_journal_extend(handle, needed))
+		return 0;
+
+	for (p = start; p < start + count; p++) {
+		next3_fsblk_t nr = le32_to_cpu(*p);
+
+		next3_forget(handle, 0, inode,
+			     sb_find_get_block(inode->i_sb, nr), nr);
+	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	next3_free_blocks_batch(handle, inode, block, count);
+#else
+	next3_free_blocks(handle, inode, block, count);
+#endif
+	return 1;
+}
+
+#endif
 /**
  *	next3_free_branches - free an array of branches
  *	@handle: JBD handle for this transaction
@@ -3518,6 +5527,11 @@ static void next3_free_branches(handle_t *handle, struct inode *inode,
 
 			/* This zaps the entire block.  Bottom up. */
 			BUFFER_TRACE(bh, "free child branches");
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE_BULK
+			if (!depth && !pblocks &&
+			    next3_free_leaf_bulk(handle, inode, bh))
+				goto free_branch;
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
 			next3_free_branches_cow(handle, inode, bh,
 					(__le32 *)bh->b_data,
@@ -3538,6 +5552,9 @@ static void next3_free_branches(handle_t *handle, struct inode *inode,
 					   (__le32*)bh->b_data,
 					   (__le32*)bh->b_data + addr_per_block,
 					   depth);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DELETE_BULK
+free_branch:
 #endif
 
 			/*
@@ -3584,7 +5601,11 @@ static void next3_free_branches(handle_t *handle, struct inode *inode,
 			}
 
 			next3_forget(handle, 1, inode, bh, bh->b_blocknr);
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+			next3_free_blocks_batch(handle, inode, nr, 1);
+#else
 			next3_free_blocks(handle, inode, nr, 1);
+#endif
 
 			if (parent_bh) {
 				/*
@@ -3660,7 +5681,11 @@ int next3_can_truncate(struct inode *inode)
  * that's fine - as long as they are linked from the inode, the post-crash
  * next3_truncate() run will find them and release them.
  */
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+static void __next3_truncate(struct inode *inode)
+#else
 void next3_truncate(struct inode *inode)
+#endif
 {
 	handle_t *handle;
 	struct next3_inode_info *ei = NEXT3_I(inode);
@@ -3675,6 +5700,9 @@ void next3_truncate(struct inode *inode)
 	long last_block;
 	unsigned blocksize = inode->i_sb->s_blocksize;
 	struct page *page;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	struct next3_free_batch *batch;
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_HUGE
 	/* prevent partial truncate of snapshot files */
@@ -3731,6 +5759,10 @@ void next3_truncate(struct inode *inode)
 	if (page)
 		next3_block_truncate_page(handle, page, mapping, inode->i_size);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	if (next3_snapshot_file(inode))
+		next3_snapshot_map_invalidate(inode);
+#endif
 	n = next3_block_to_path(inode, last_block, offsets, NULL);
 	if (n == 0)
 		goto out_stop;	/* error */
@@ -3760,7 +5792,14 @@ void next3_truncate(struct inode *inode)
 	 * From here we block out all next3_get_block() callers who want to
 	 * modify the block allocation tree.
 	 */
-	mutex_lock(&ei->truncate_mutex);
+	down_write(&ei->truncate_sem);
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	/* without a batch, blocks are freed one range at a time */
+	batch = kmalloc(sizeof(*batch), GFP_NOFS);
+	if (batch)
+		batch->nr = 0;
+	ei->i_free_batch = batch;
+#endif
 
 	if (n == 1) {		/* direct blocks */
 		next3_free_data(handle, inode, NULL, i_data+offsets[0],
@@ -3836,10 +5875,15 @@ do_indirects:
 		}
 	}
 
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	next3_free_batch_flush(handle, inode);
+	ei->i_free_batch = NULL;
+	kfree(batch);
 #endif
 	next3_discard_reservation(inode);
 
-	mutex_unlock(&ei->truncate_mutex);
+	up_write(&ei->truncate_sem);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 	next3_mark_inode_dirty(handle, inode);
 
@@ -3850,6 +5894,10 @@ do_indirects:
 	if (IS_SYNC(inode))
 		handle->h_sync = 1;
 out_stop:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	if (next3_snapshot_file(inode))
+		next3_snapshot_map_invalidate(inode);
+#endif
 	/*
 	 * If this was a simple ftruncate(), and the file will remain alive
 	 * then we need to clear up the orphan record which we created above.
@@ -3870,6 +5918,15 @@ out_notrans:
 	if (inode->i_nlink)
 		next3_orphan_del(NULL, inode);
 }
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+
+void next3_truncate(struct inode *inode)
+{
+	trace_next3_truncate_enter(inode);
+	__next3_truncate(inode);
+	trace_next3_truncate_exit(inode);
+}
+#endif
 
 next3_fsblk_t next3_get_inode_block(struct super_block *sb,
 		unsigned long ino, struct next3_iloc *iloc)
@@ -3905,6 +5962,65 @@ next3_fsblk_t next3_get_inode_block(struct super_block *sb,
 	return block;
 }
 
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+/*
+ * Read ahead the inode table blocks around @block, which holds the inode
+ * of @inode and is locked by the caller.  The window is aligned to
+ * s_inode_readahead_blks blocks and does not cross the inode table of the
+ * group.  If the inode bitmap is in cache, blocks without in-use inodes
+ * are skipped, otherwise the bitmap is read ahead for the next time.
+ */
+static void next3_inode_table_readahead(struct inode *inode,
+					next3_fsblk_t block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	unsigned long ra_blks = sbi->s_inode_readahead_blks;
+	int inodes_per_block = sbi->s_inodes_per_block;
+	struct buffer_head *bitmap_bh;
+	struct next3_group_desc *desc;
+	next3_fsblk_t table, b, end;
+	unsigned long block_group;
+	int i, start;
+
+	if (ra_blks <= 1)
+		return;
+	block_group = (inode->i_ino - 1) / NEXT3_INODES_PER_GROUP(sb);
+	desc = next3_get_group_desc(sb, block_group, NULL);
+	if (!desc)
+		return;
+	table = le32_to_cpu(desc->bg_inode_table);
+	b = block & ~((next3_fsblk_t)ra_blks - 1);
+	if (b < table)
+		b = table;
+	end = (block & ~((next3_fsblk_t)ra_blks - 1)) + ra_blks;
+	if (end > table + sbi->s_itb_per_group)
+		end = table + sbi->s_itb_per_group;
+
+	bitmap_bh = sb_getblk(sb, le32_to_cpu(desc->bg_inode_bitmap));
+	if (bitmap_bh && !buffer_uptodate(bitmap_bh)) {
+		ll_rw_block(READA, 1, &bitmap_bh);
+		brelse(bitmap_bh);
+		bitmap_bh = NULL;
+	}
+	for (; b < end; b++) {
+		if (b == block)
+			continue;
+		if (bitmap_bh) {
+			start = (b - table) * inodes_per_block;
+			for (i = start; i < start + inodes_per_block; i++)
+				if (next3_test_bit(i, bitmap_bh->b_data))
+					break;
+			/* no in-use inodes in this block */
+			if (i == start + inodes_per_block)
+				continue;
+		}
+		sb_breadahead(sb, b);
+	}
+	brelse(bitmap_bh);
+}
+
+#endif
 /*
  * next3_get_inode_loc returns with an extra refcount against the inode's
  * underlying buffer_head on success. If 'in_mem' is true, we have all
@@ -4011,6 +6127,9 @@ static int __next3_get_inode_loc(struct inode *inode,
 		}
 
 make_io:
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+		next3_inode_table_readahead(inode, block);
+#endif
 		/*
 		 * There are other valid inodes in the buffer, this inode
 		 * has in-inode xattrs, or we don't have this inode in memory.
@@ -4186,6 +6305,33 @@ struct inode *next3_iget(struct super_block *sb, unsigned long ino)
 	inode->i_blocks = le32_to_cpu(raw_inode->i_blocks);
 	ei->i_flags = le32_to_cpu(raw_inode->i_flags);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	if (next3_snapshot_file(inode)) {
+		ret = next3_snapshot_info_alloc(inode);
+		if (ret) {
+			brelse(bh);
+			goto bad_inode;
+		}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_copied,
+				le32_to_cpu(raw_inode->i_snapshot_copied));
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_moved,
+				le32_to_cpu(raw_inode->i_snapshot_moved));
+#endif
+	}
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	if (next3_snapshot_file(inode)) {
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_copied,
+				le32_to_cpu(raw_inode->i_snapshot_copied));
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_moved,
+				le32_to_cpu(raw_inode->i_snapshot_moved));
+	} else {
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_copied, 0);
+		atomic_set(&NEXT3_SNAP_I(inode)->i_snap_moved, 0);
+	}
+#endif
+#endif
 #ifdef NEXT3_FRAGMENTS
 	ei->i_faddr = le32_to_cpu(raw_inode->i_faddr);
 	ei->i_frag_no = raw_inode->i_frag;
@@ -4224,7 +6370,7 @@ struct inode *next3_iget(struct super_block *sb, unsigned long ino)
 			ei->i_data[block-NEXT3_N_BLOCKS] = 0;
 		}
 #endif
-		ei->i_next_snapshot_ino =
+		NEXT_SNAPSHOT(inode) =
 			le32_to_cpu(raw_inode->i_next_snapshot);
 		/*
 		 * Dynamic snapshot flags are not stored on-disk, so
@@ -4416,15 +6562,26 @@ static int next3_do_update_inode(handle_t *handle,
 	struct next3_inode_info *ei = NEXT3_I(inode);
 	struct buffer_head *bh = iloc->bh;
 	int err = 0, rc, block;
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+	int need_datasync = 0;
+#endif
 
 again:
 	/* we can't allow multiple procs in here at once, its a bit racey */
 	lock_buffer(bh);
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	/* the in-memory timestamps are copied below */
+	next3_clear_inode_state(inode, NEXT3_STATE_LAZY_TIME);
+#endif
 
 	/* For fields not not tracking in the in-memory inode,
 	 * initialise them to zero for new inodes. */
-	if (next3_test_inode_state(inode, NEXT3_STATE_NEW))
+	if (next3_test_inode_state(inode, NEXT3_STATE_NEW)) {
 		memset(raw_inode, 0, NEXT3_SB(inode->i_sb)->s_inode_size);
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+		need_datasync = 1;
+#endif
+	}
 
 	next3_get_inode_flags(ei);
 	raw_inode->i_mode = cpu_to_le16(inode->i_mode);
@@ -4453,6 +6610,11 @@ again:
 		raw_inode->i_gid_high = 0;
 	}
 	raw_inode->i_links_count = cpu_to_le16(inode->i_nlink);
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+	/* fdatasync() has to commit size changes, not only allocations */
+	if (raw_inode->i_size != cpu_to_le32(ei->i_disksize))
+		need_datasync = 1;
+#endif
 	raw_inode->i_size = cpu_to_le32(ei->i_disksize);
 	raw_inode->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
 	raw_inode->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
@@ -4467,6 +6629,14 @@ again:
 #endif
 	raw_inode->i_dtime = cpu_to_le32(ei->i_dtime);
 	raw_inode->i_flags = cpu_to_le32(ei->i_flags);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	if (next3_snapshot_file(inode)) {
+		raw_inode->i_snapshot_copied =
+			cpu_to_le32(atomic_read(&NEXT3_SNAP_I(inode)->i_snap_copied));
+		raw_inode->i_snapshot_moved =
+			cpu_to_le32(atomic_read(&NEXT3_SNAP_I(inode)->i_snap_moved));
+	}
+#endif
 #ifdef NEXT3_FRAGMENTS
 	raw_inode->i_faddr = cpu_to_le32(ei->i_faddr);
 	raw_inode->i_frag = ei->i_frag_no;
@@ -4476,6 +6646,11 @@ again:
 	if (!S_ISREG(inode->i_mode)) {
 		raw_inode->i_dir_acl = cpu_to_le32(ei->i_dir_acl);
 	} else {
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+		if (raw_inode->i_size_high !=
+				cpu_to_le32(ei->i_disksize >> 32))
+			need_datasync = 1;
+#endif
 		raw_inode->i_size_high =
 			cpu_to_le32(ei->i_disksize >> 32);
 		if (ei->i_disksize > 0x7fffffffULL) {
@@ -4538,7 +6713,7 @@ again:
 		}
 #endif
 		raw_inode->i_next_snapshot =
-			cpu_to_le32(ei->i_next_snapshot_ino);
+			cpu_to_le32(NEXT_SNAPSHOT(inode));
 		/* dynamic snapshot flags are not stored on-disk */
 		raw_inode->i_flags &= cpu_to_le32(~NEXT3_FL_SNAPSHOT_DYN_MASK);
 	}
@@ -4569,6 +6744,10 @@ again:
 	next3_clear_inode_state(inode, NEXT3_STATE_NEW);
 
 	atomic_set(&ei->i_sync_tid, handle->h_transaction->t_tid);
+#ifdef CONFIG_NEXT3_FS_FSYNC_DATA_FAST
+	if (need_datasync)
+		atomic_set(&ei->i_datasync_tid, handle->h_transaction->t_tid);
+#endif
 out_brelse:
 	brelse (bh);
 	next3_std_error(inode->i_sb, err);
@@ -4621,6 +6800,15 @@ int next3_write_inode(struct inode *inode, struct writeback_control *wbc)
 		return -EIO;
 	}
 
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	if (next3_test_inode_state(inode, NEXT3_STATE_LAZY_TIME)) {
+		int err = next3_flush_lazy_time(inode);
+
+		if (err)
+			return err;
+	}
+
+#endif
 	if (wbc->sync_mode != WB_SYNC_ALL)
 		return 0;
 
@@ -4699,6 +6887,14 @@ int next3_setattr(struct dentry *dentry, struct iattr *attr)
 		if (!error)
 			error = rc;
 		next3_journal_stop(handle);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+		if (test_opt(inode->i_sb, ORDERED_INODE)) {
+			rc = journal_begin_ordered_truncate(NEXT3_JOURNAL(inode),
+					&NEXT3_I(inode)->jinode, attr->ia_size);
+			if (!error)
+				error = rc;
+		}
+#endif
 	}
 
 	rc = inode_setattr(inode, attr);
@@ -4825,12 +7021,84 @@ next3_reserve_inode_write(handle_t *handle, struct inode *inode,
  * to do a write_super() to free up some memory.  It has the desired
  * effect.
  */
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+/*
+ * Queue @inode on @handle, which copies it to the inode table once, when
+ * it is stopped or restarted, instead of on every next3_mark_inode_dirty().
+ * Write access to the inode table block is taken when the inode is first
+ * queued in the running transaction.  The queue holds a reference to the
+ * inode, which is dropped after the handle is stopped.
+ *
+ * Returns 1 if the inode is queued, 0 if the handle queue is full or the
+ * inode is being evicted and has to be copied now, or an error.
+ */
+static int next3_queue_inode(handle_t *handle, struct inode *inode)
+{
+	struct next3_iloc iloc;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < handle->h_inodes_count; i++)
+		if (handle->h_inodes[i] == inode)
+			break;
+	if (i < handle->h_inodes_count) {
+		if (handle->h_inodes_dirty & (1 << i))
+			return 1;
+		/* the handle was restarted, so take write access again */
+	} else {
+		if (i == JBD_HANDLE_INODES ||
+		    !atomic_inc_not_zero(&inode->i_count))
+			return 0;
+		handle->h_inodes[handle->h_inodes_count++] = inode;
+	}
+
+	err = next3_reserve_inode_write(handle, inode, &iloc);
+	if (err)
+		return err;
+	brelse(iloc.bh);
+	handle->h_inodes_dirty |= 1 << i;
+	return 1;
+}
+
+/*
+ * Copy the inodes queued on the handle to the inode table.  Like the
+ * direct copies of next3_mark_inode_dirty(), the copies use the credits
+ * of the handle.  The inodes stay queued until the handle is stopped.
+ */
+int next3_flush_inodes(handle_t *handle)
+{
+	unsigned int i;
+	int err = 0, ret;
+
+	for (i = 0; i < handle->h_inodes_count; i++) {
+		struct inode *inode = handle->h_inodes[i];
+		struct next3_iloc iloc;
+
+		if (!(handle->h_inodes_dirty & (1 << i)))
+			continue;
+		ret = next3_get_inode_loc(inode, &iloc);
+		if (!ret)
+			/* consumes the bh reference */
+			ret = next3_do_update_inode(handle, inode, &iloc);
+		if (ret && !err)
+			err = ret;
+	}
+	handle->h_inodes_dirty = 0;
+	return err;
+}
+
+#endif
 int next3_mark_inode_dirty(handle_t *handle, struct inode *inode)
 {
 	struct next3_iloc iloc;
 	int err;
 
 	might_sleep();
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	err = next3_queue_inode(handle, inode);
+	if (err)
+		return err < 0 ? err : 0;
+#endif
 	err = next3_reserve_inode_write(handle, inode, &iloc);
 	if (!err)
 		err = next3_mark_iloc_dirty(handle, inode, &iloc);
@@ -4856,6 +7124,20 @@ void next3_dirty_inode(struct inode *inode)
 	handle_t *current_handle = next3_journal_current_handle();
 	handle_t *handle;
 
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	/*
+	 * Inode updates made outside of a next3 transaction are timestamp
+	 * updates (file_update_time(), touch_atime()).  Every inode change
+	 * of next3 itself is journaled by the operation making it, so we
+	 * can keep these in memory until the next journaled update of the
+	 * inode or until writeback calls next3_write_inode().
+	 */
+	if (!current_handle && test_opt(inode->i_sb, LAZYTIME)) {
+		next3_set_inode_state(inode, NEXT3_STATE_LAZY_TIME);
+		return;
+	}
+
+#endif
 	handle = next3_journal_start(inode, 2);
 	if (IS_ERR(handle))
 		goto out;
@@ -4874,6 +7156,27 @@ out:
 	return;
 }
 
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+/*
+ * Journal the inode updates that next3_dirty_inode() kept in memory.
+ */
+int next3_flush_lazy_time(struct inode *inode)
+{
+	handle_t *handle;
+	int err, err2;
+
+	if (!next3_test_inode_state(inode, NEXT3_STATE_LAZY_TIME))
+		return 0;
+
+	handle = next3_journal_start(inode, 2);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = next3_mark_inode_dirty(handle, inode);
+	err2 = next3_journal_stop(handle);
+	return err ? err : err2;
+}
+
+#endif
 #if 0
 /*
  * Bind an inode's backing buffer_head into this transaction, to prevent
@@ -4955,3 +7258,178 @@ int next3_change_inode_journal_flag(struct inode *inode, int val)
 
 	return err;
 }
+
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+/* no. of blocks to check for fragmentation and re-allocate at once */
+#define NEXT3_DEFRAG_CHUNK	512
+
+/*
+ * next3_defrag_extents - count the extents that map @count blocks
+ * @inode:	regular file
+ * @iblock:	first logical block
+ * @count:	no. of logical blocks
+ * @holes:	returns the no. of unmapped blocks
+ *
+ * Returns the no. of physically contiguous extents that map the blocks.
+ */
+static int next3_defrag_extents(struct inode *inode, sector_t iblock,
+		unsigned long count, unsigned long *holes)
+{
+	struct buffer_head dummy;
+	next3_fsblk_t next = 0;
+	int extents = 0;
+	int ret;
+
+	*holes = 0;
+	while (count > 0) {
+		dummy.b_state = 0;
+		ret = next3_get_blocks_handle(NULL, inode, iblock, count,
+				&dummy, 0);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			/* a hole breaks the extent */
+			(*holes)++;
+			next = 0;
+			ret = 1;
+		} else {
+			if (dummy.b_blocknr != next)
+				extents++;
+			next = dummy.b_blocknr + ret;
+		}
+		iblock += ret;
+		count -= ret;
+	}
+	return extents;
+}
+
+/*
+ * next3_defrag_page - re-allocate the blocks of a page
+ *
+ * The page is read uptodate and passed through write_begin()/write_end()
+ * with the DEFRAG inode state set, so get_block() allocates new blocks
+ * for all the mapped buffers of the page.  The old blocks are moved to the
+ * active snapshot if it needs them, or freed otherwise.
+ */
+static int next3_defrag_page(struct file *filp, pgoff_t index, unsigned len)
+{
+	struct address_space *mapping = filp->f_mapping;
+	loff_t pos = (loff_t)index << PAGE_CACHE_SHIFT;
+	struct page *page, *wpage;
+	void *fsdata;
+	int err;
+
+	page = read_mapping_page(mapping, index, filp);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	err = mapping->a_ops->write_begin(filp, mapping, pos, len,
+			AOP_FLAG_UNINTERRUPTIBLE, &wpage, &fsdata);
+	if (!err) {
+		/* the page data is unchanged, so all of it was 'copied' */
+		err = mapping->a_ops->write_end(filp, mapping, pos, len, len,
+				wpage, fsdata);
+		if (err > 0)
+			err = 0;
+	}
+	page_cache_release(page);
+	return err;
+}
+
+/*
+ * next3_defrag - re-allocate the fragmented blocks of a file
+ * @filp:	regular file, opened for read and write
+ * @range:	logical blocks range to defrag
+ *
+ * The range is scanned in chunks of NEXT3_DEFRAG_CHUNK blocks and every
+ * chunk that is mapped by more than one extent is re-allocated, one page at
+ * a time, so the new blocks of the chunk are allocated in sequence.
+ * Pages with holes are left as is, so holes are not filled.
+ * The no. of re-allocated blocks is returned in @range->dr_defragged.
+ */
+int next3_defrag(struct file *filp, struct next3_defrag_range *range)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	unsigned int blkbits = inode->i_blkbits;
+	unsigned long page_blocks = PAGE_CACHE_SIZE >> blkbits;
+	unsigned long count, holes;
+	sector_t iblock, end;
+	loff_t size;
+	int err = 0;
+
+	range->dr_defragged = 0;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+	/* snapshot file blocks and excluded file blocks stay in place */
+	if (next3_snapshot_excluded(inode))
+		return -EPERM;
+#endif
+	if (next3_should_journal_data(inode))
+		return -EINVAL;
+
+	mutex_lock(&inode->i_mutex);
+	size = i_size_read(inode);
+	end = (size + (1 << blkbits) - 1) >> blkbits;
+	if (range->dr_len && range->dr_start + range->dr_len < end)
+		end = range->dr_start + range->dr_len;
+	/* defrag whole pages */
+	iblock = range->dr_start & ~(sector_t)(page_blocks - 1);
+
+	/* write back dirty pages, including delayed move-on-write pages */
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		goto out;
+
+	next3_set_inode_state(inode, NEXT3_STATE_DEFRAG);
+	while (iblock < end) {
+		sector_t chunk_end;
+
+		count = min_t(sector_t, end - iblock, NEXT3_DEFRAG_CHUNK);
+		err = next3_defrag_extents(inode, iblock, count, &holes);
+		if (err < 0)
+			break;
+		chunk_end = iblock + count;
+		if (err <= 1)
+			/* chunk is not fragmented */
+			iblock = chunk_end;
+		err = 0;
+
+		for (; iblock < chunk_end; iblock += page_blocks) {
+			loff_t pos = (loff_t)iblock << blkbits;
+			unsigned len = min_t(loff_t, PAGE_CACHE_SIZE,
+					size - pos);
+
+			count = (len + (1 << blkbits) - 1) >> blkbits;
+			if (holes) {
+				err = next3_defrag_extents(inode, iblock,
+						count, &holes);
+				if (err < 0)
+					break;
+				err = 0;
+				if (holes)
+					continue;
+				/* there may be more holes in the chunk */
+				holes = 1;
+			}
+			err = next3_defrag_page(filp,
+					iblock >> (PAGE_CACHE_SHIFT - blkbits),
+					len);
+			if (err)
+				break;
+			range->dr_defragged += count;
+			balance_dirty_pages_ratelimited(inode->i_mapping);
+			if (fatal_signal_pending(current)) {
+				err = -EINTR;
+				break;
+			}
+			cond_resched();
+		}
+		if (err)
+			break;
+	}
+	next3_clear_inode_state(inode, NEXT3_STATE_DEFRAG);
+out:
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+#endif
@@ -164,18 +164,41 @@ flags_err:
 			goto flags_out;
 
 		if (!(oldflags & NEXT3_SNAPFILE_LIST_FL) &&
-				(flags & NEXT3_SNAPFILE_LIST_FL))
+				(flags & NEXT3_SNAPFILE_LIST_FL)) {
 			/* setting list flag - take snapshot */
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+			trace_next3_snapshot_take_enter(inode);
+#endif
 			err = next3_snapshot_take(inode);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+			trace_next3_snapshot_take_exit(inode, err);
+#endif
+		}
 #endif
 flags_out:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ENABLE_FAST
+		/*
+		 * snapshot enable/disable updates the in-use flags by itself,
+		 * so only take/delete need a full snapshots list update
+		 */
+		if ((snapflags & NEXT3_SNAPFILE_LIST_FL) &&
+		    ((flags ^ oldflags) & NEXT3_FL_SNAPSHOT_MASK) !=
+				NEXT3_SNAPFILE_ENABLED_FL) {
+#else
 		if (snapflags & NEXT3_SNAPFILE_LIST_FL) {
+#endif
 			/* if clearing list flag, cleanup snapshot list */
 			int ret, cleanup = !(flags & NEXT3_SNAPFILE_LIST_FL);
 
 			/* update/cleanup snapshots list even if take failed */
 			ret = next3_snapshot_update(inode->i_sb, cleanup, 0);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+			if (cleanup && !ret)
+				/* shrink/merge deleted snapshots in background */
+				next3_snapshot_cleanup_work_start(inode->i_sb,
+								  0);
+#endif
 			if (!err)
 				err = ret;
 		}
@@ -247,6 +270,212 @@ setversion_out:
 			remove_wait_queue(&NEXT3_SB(sb)->ro_wait_queue, &wait);
 			return ret;
 		}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	case NEXT3_IOC_SNAPSHOT_USAGE: {
+		struct next3_snapshot_usage usage;
+		int err;
+
+		err = next3_snapshot_get_usage(inode, &usage);
+		if (err)
+			return err;
+		if (copy_to_user((struct next3_snapshot_usage __user *)arg,
+					&usage, sizeof(usage)))
+			return -EFAULT;
+		return 0;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+	case NEXT3_IOC_SNAPSHOT_DIFF: {
+		struct next3_snapshot_diff __user *udiff =
+			(struct next3_snapshot_diff __user *)arg;
+		struct next3_snapshot_diff diff;
+		struct next3_snapshot_diff_extent *extents;
+		int err;
+
+		if (copy_from_user(&diff, udiff, sizeof(diff)))
+			return -EFAULT;
+		if (diff.sd_count > NEXT3_SNAPSHOT_DIFF_MAX)
+			diff.sd_count = NEXT3_SNAPSHOT_DIFF_MAX;
+		extents = (struct next3_snapshot_diff_extent *)
+			__get_free_page(GFP_KERNEL);
+		if (!extents)
+			return -ENOMEM;
+		/* extents are copied to user after snapshot_mutex is released */
+		err = next3_snapshot_get_diff(inode, &diff, extents);
+		if (!err && (copy_to_user(udiff, &diff, sizeof(diff)) ||
+			     copy_to_user(udiff->sd_extents, extents,
+				diff.sd_count * sizeof(*extents))))
+			err = -EFAULT;
+		free_page((unsigned long)extents);
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+	case NEXT3_IOC_SNAPSHOT_MAP: {
+		struct next3_snapshot_map __user *umap =
+			(struct next3_snapshot_map __user *)arg;
+		struct next3_snapshot_map map;
+		struct next3_snapshot_map_extent *extents;
+		int err;
+
+		if (copy_from_user(&map, umap, sizeof(map)))
+			return -EFAULT;
+		if (map.sm_reserved)
+			return -EINVAL;
+		if (map.sm_count > NEXT3_SNAPSHOT_MAP_MAX)
+			map.sm_count = NEXT3_SNAPSHOT_MAP_MAX;
+		extents = (struct next3_snapshot_map_extent *)
+			__get_free_page(GFP_KERNEL);
+		if (!extents)
+			return -ENOMEM;
+		/* extents are copied to user after snapshot_mutex is released */
+		err = next3_snapshot_get_map(inode, &map, extents);
+		if (!err && (copy_to_user(umap, &map, sizeof(map)) ||
+			     copy_to_user(umap->sm_extents, extents,
+				map.sm_count * sizeof(*extents))))
+			err = -EFAULT;
+		free_page((unsigned long)extents);
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+	case NEXT3_IOC_SNAPSHOT_VERIFY: {
+		struct next3_snapshot_verify __user *uverify =
+			(struct next3_snapshot_verify __user *)arg;
+		struct next3_snapshot_verify verify;
+		int err;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&verify, uverify, sizeof(verify)))
+			return -EFAULT;
+		err = next3_snapshot_verify(inode, &verify);
+		if (!err && copy_to_user(uverify, &verify, sizeof(verify)))
+			err = -EFAULT;
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+	case NEXT3_IOC_SNAPSHOT_ROLLBACK: {
+		struct next3_snapshot_rollback rollback;
+		int err;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		err = next3_snapshot_rollback(inode, &rollback);
+		if (!err && copy_to_user((void __user *)arg, &rollback,
+					 sizeof(rollback)))
+			err = -EFAULT;
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	case NEXT3_IOC_SNAPSHOT_QUEUE: {
+		struct next3_snapshot_ctl __user *uctl =
+			(struct next3_snapshot_ctl __user *)arg;
+		struct next3_snapshot_ctl ctl;
+		int err;
+
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+		if (copy_from_user(&ctl, uctl, sizeof(ctl)))
+			return -EFAULT;
+		err = next3_snapshot_ctl_queue(filp, ctl.sc_op, &ctl.sc_seq);
+		if (err)
+			return err;
+		ctl.sc_state = NEXT3_SNAPSHOT_CTL_PENDING;
+		ctl.sc_result = 0;
+		if (copy_to_user(uctl, &ctl, sizeof(ctl)))
+			return -EFAULT;
+		return 0;
+	}
+	case NEXT3_IOC_SNAPSHOT_STATUS: {
+		struct next3_snapshot_ctl __user *uctl =
+			(struct next3_snapshot_ctl __user *)arg;
+		struct next3_snapshot_ctl ctl;
+		int err;
+
+		if (copy_from_user(&ctl, uctl, sizeof(ctl)))
+			return -EFAULT;
+		err = next3_snapshot_ctl_status(inode->i_sb, &ctl);
+		if (err)
+			return err;
+		if (copy_to_user(uctl, &ctl, sizeof(ctl)))
+			return -EFAULT;
+		return 0;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	case NEXT3_IOC_DEFRAG: {
+		struct next3_defrag_range __user *urange =
+			(struct next3_defrag_range __user *)arg;
+		struct next3_defrag_range range;
+		int err;
+
+		if (!(filp->f_mode & FMODE_READ) ||
+		    !(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, urange, sizeof(range)))
+			return -EFAULT;
+		err = mnt_want_write(filp->f_path.mnt);
+		if (err)
+			return err;
+		err = next3_defrag(filp, &range);
+		mnt_drop_write(filp->f_path.mnt);
+		/* report progress even if defrag was interrupted */
+		if (copy_to_user(&urange->dr_defragged, &range.dr_defragged,
+					sizeof(range.dr_defragged)))
+			err = -EFAULT;
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	case NEXT3_IOC_SNAPSHOT_IOPRIO: {
+		int ioprio;
+
+		if (!next3_snapshot_file(inode))
+			return -EINVAL;
+		if (get_user(ioprio, (int __user *)arg))
+			return -EFAULT;
+		/* 0 (class none) resets to the file system default */
+		switch (IOPRIO_PRIO_CLASS(ioprio)) {
+		case IOPRIO_CLASS_RT:
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			/* fall through */
+		case IOPRIO_CLASS_BE:
+			if (IOPRIO_PRIO_DATA(ioprio) >= IOPRIO_BE_NR)
+				return -EINVAL;
+			break;
+		case IOPRIO_CLASS_IDLE:
+			break;
+		case IOPRIO_CLASS_NONE:
+			if (IOPRIO_PRIO_DATA(ioprio))
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+		}
+		filp->private_data = (void *)(long)ioprio;
+		return 0;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	case NEXT3_IOC_SNAPSHOT_READ_STATS: {
+		struct next3_snapshot_read_stats stats;
+
+		if (!next3_snapshot_file(inode) || !NEXT3_SNAP_I(inode))
+			return -EINVAL;
+		stats.bytes = atomic_long_read(
+				&NEXT3_SNAP_I(inode)->i_snap_read_bytes);
+		stats.pages = atomic_long_read(
+				&NEXT3_SNAP_I(inode)->i_snap_read_pages);
+		if (copy_to_user((struct next3_snapshot_read_stats __user *)arg,
+					&stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
 #endif
 	case NEXT3_IOC_GETRSVSZ:
 		if (test_opt(inode->i_sb, RESERVATION)
@@ -283,7 +512,7 @@ setversion_out:
 		 * need to allocate reservation structure for this inode
 		 * before set the window size
 		 */
-		mutex_lock(&ei->truncate_mutex);
+		down_write(&ei->truncate_sem);
 		if (!ei->i_block_alloc_info)
 			next3_init_block_alloc_info(inode);
 
@@ -291,7 +520,7 @@ setversion_out:
 			struct next3_reserve_window_node *rsv = &ei->i_block_alloc_info->rsv_window_node;
 			rsv->rsv_goal_size = rsv_window_size;
 		}
-		mutex_unlock(&ei->truncate_mutex);
+		up_write(&ei->truncate_sem);
 setrsvsz_out:
 		mnt_drop_write(filp->f_path.mnt);
 		return err;
@@ -364,6 +593,71 @@ group_add_out:
 		mnt_drop_write(filp->f_path.mnt);
 		return err;
 	}
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+	case NEXT3_IOC_GROUP_ADD_BATCH: {
+		struct next3_new_group_batch __user *ubatch =
+			(struct next3_new_group_batch __user *)arg;
+		struct next3_new_group_input uinput;
+		struct next3_new_group_data *input;
+		struct super_block *sb = inode->i_sb;
+		__u32 count, done, i, n;
+		int err, err2;
+
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+		if (get_user(count, &ubatch->gb_count))
+			return -EFAULT;
+
+		input = kmalloc(NEXT3_GROUP_ADD_BATCH_MAX * sizeof(*input),
+				GFP_KERNEL);
+		if (!input)
+			return -ENOMEM;
+
+		err = mnt_want_write(filp->f_path.mnt);
+		if (err)
+			goto group_add_batch_free;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL
+		/* avoid snapshot_take() in the middle of group_add() */
+		mutex_lock(&NEXT3_SB(sb)->s_snapshot_mutex);
+#endif
+		for (done = 0; !err && done < count; done += n) {
+			n = min_t(__u32, count - done,
+				  NEXT3_GROUP_ADD_BATCH_MAX);
+			for (i = 0; i < n; i++) {
+				if (copy_from_user(&uinput,
+						&ubatch->gb_groups[done + i],
+						sizeof(uinput))) {
+					err = -EFAULT;
+					break;
+				}
+				input[i].group = uinput.group;
+				input[i].block_bitmap = uinput.block_bitmap;
+				input[i].inode_bitmap = uinput.inode_bitmap;
+				input[i].inode_table = uinput.inode_table;
+				input[i].blocks_count = uinput.blocks_count;
+				input[i].reserved_blocks =
+					uinput.reserved_blocks;
+				input[i].unused = uinput.unused;
+			}
+			if (!err)
+				err = next3_group_add_batch(sb, input, n);
+		}
+		journal_lock_updates(NEXT3_SB(sb)->s_journal);
+		err2 = journal_flush(NEXT3_SB(sb)->s_journal);
+		journal_unlock_updates(NEXT3_SB(sb)->s_journal);
+		if (err == 0)
+			err = err2;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL
+		mutex_unlock(&NEXT3_SB(sb)->s_snapshot_mutex);
+#endif
+		mnt_drop_write(filp->f_path.mnt);
+group_add_batch_free:
+		kfree(input);
+		return err;
+	}
+#endif
 
 
 	default:
@@ -409,6 +703,37 @@ long next3_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		cmd = NEXT3_IOC_SETRSVSZ;
 		break;
 	case NEXT3_IOC_GROUP_ADD:
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+	case NEXT3_IOC_GROUP_ADD_BATCH:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	case NEXT3_IOC_SNAPSHOT_USAGE:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+	case NEXT3_IOC_SNAPSHOT_DIFF:
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	case NEXT3_IOC_DEFRAG:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+	case NEXT3_IOC_SNAPSHOT_MAP:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	case NEXT3_IOC_SNAPSHOT_QUEUE:
+	case NEXT3_IOC_SNAPSHOT_STATUS:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	case NEXT3_IOC_SNAPSHOT_IOPRIO:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	case NEXT3_IOC_SNAPSHOT_READ_STATS:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+	case NEXT3_IOC_SNAPSHOT_VERIFY:
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+	case NEXT3_IOC_SNAPSHOT_ROLLBACK:
+#endif
 		break;
 	default:
 		return -ENOIOCTLCMD;
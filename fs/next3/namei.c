@@ -39,6 +39,12 @@
 #include <linux/quotaops.h>
 #include <linux/buffer_head.h>
 #include <linux/bio.h>
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+#include <linux/vmalloc.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+#include <asm/unaligned.h>
+#endif
 
 #include "namei.h"
 #include "xattr.h"
@@ -142,6 +148,19 @@ struct dx_frame
 	struct dx_entry *at;
 };
 
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+/* max. number of htree index levels, including the root */
+#define NEXT3_HTREE_LEVEL_COMPAT	2
+#define NEXT3_HTREE_LEVEL		3
+
+static inline int next3_dir_htree_level(struct super_block *sb)
+{
+	return NEXT3_HAS_INCOMPAT_FEATURE(sb,
+			NEXT3_FEATURE_INCOMPAT_LARGEDIR) ?
+		NEXT3_HTREE_LEVEL : NEXT3_HTREE_LEVEL_COMPAT;
+}
+#endif
+
 struct dx_map_entry
 {
 	u32 hash;
@@ -353,13 +372,25 @@ dx_probe(struct qstr *entry, struct inode *dir,
 	struct dx_frame *frame = frame_in;
 	u32 hash;
 
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	/* dx_release() stops at the first frame without a buffer */
+	memset(frame_in, 0, NEXT3_HTREE_LEVEL * sizeof(frame_in[0]));
+#else
 	frame->bh = NULL;
+#endif
 	if (!(bh = next3_bread (NULL,dir, 0, 0, err)))
 		goto fail;
 	root = (struct dx_root *) bh->b_data;
+#ifdef CONFIG_NEXT3_FS_DX_HASH_MURMUR
+	if (root->info.hash_version != DX_HASH_TEA &&
+	    root->info.hash_version != DX_HASH_HALF_MD4 &&
+	    root->info.hash_version != DX_HASH_LEGACY &&
+	    root->info.hash_version != DX_HASH_MURMUR) {
+#else
 	if (root->info.hash_version != DX_HASH_TEA &&
 	    root->info.hash_version != DX_HASH_HALF_MD4 &&
 	    root->info.hash_version != DX_HASH_LEGACY) {
+#endif
 		next3_warning(dir->i_sb, __func__,
 			     "Unrecognised inode hash code %d",
 			     root->info.hash_version);
@@ -384,7 +415,12 @@ dx_probe(struct qstr *entry, struct inode *dir,
 		goto fail;
 	}
 
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	indirect = root->info.indirect_levels;
+	if (indirect >= next3_dir_htree_level(dir->i_sb)) {
+#else
 	if ((indirect = root->info.indirect_levels) > 1) {
+#endif
 		next3_warning(dir->i_sb, __func__,
 			     "Unimplemented inode hash depth: %#06x",
 			     root->info.indirect_levels);
@@ -479,12 +515,29 @@ fail:
 
 static void dx_release (struct dx_frame *frames)
 {
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	unsigned i, indirect_levels;
+
+	if (frames[0].bh == NULL)
+		return;
+
+	/* the root may be gone after brelse() */
+	indirect_levels =
+		((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels;
+	for (i = 0; i <= indirect_levels && i < NEXT3_HTREE_LEVEL; i++) {
+		if (frames[i].bh == NULL)
+			break;
+		brelse(frames[i].bh);
+		frames[i].bh = NULL;
+	}
+#else
 	if (frames[0].bh == NULL)
 		return;
 
 	if (((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels)
 		brelse(frames[1].bh);
 	brelse(frames[0].bh);
+#endif
 }
 
 /*
@@ -612,6 +665,42 @@ static int htree_dirblock_to_tree(struct file *dir_file,
 	return count;
 }
 
+#ifdef CONFIG_NEXT3_FS_HTREE_READAHEAD
+#define NEXT3_HTREE_RA_BLOCKS	32
+
+/*
+ * Read ahead the leaf blocks named by the dx entries of @frame, starting at
+ * @frame->at, if the first of them is not uptodate.  The reads of up to
+ * NEXT3_HTREE_RA_BLOCKS leaves are all submitted before waiting for any of
+ * them, so the block layer can merge and sort them.  The next batch is read
+ * when the scan reaches a leaf which was not read ahead.
+ */
+static void dx_readahead_leaves(struct inode *dir, struct dx_frame *frame)
+{
+	struct buffer_head *bh_ra[NEXT3_HTREE_RA_BLOCKS];
+	struct dx_entry *at = frame->at;
+	struct dx_entry *end = frame->entries + dx_get_count(frame->entries);
+	struct buffer_head *bh;
+	int i, nr = 0, err;
+
+	for (; at < end && nr < NEXT3_HTREE_RA_BLOCKS; at++) {
+		bh = next3_getblk(NULL, dir, dx_get_block(at), 0, &err);
+		if (!bh)
+			continue;
+		if (buffer_uptodate(bh)) {
+			brelse(bh);
+			if (!nr)
+				/* scan did not reach end of last batch */
+				return;
+			continue;
+		}
+		bh_ra[nr++] = bh;
+	}
+	ll_rw_block(READA, nr, bh_ra);
+	for (i = 0; i < nr; i++)
+		brelse(bh_ra[i]);
+}
+#endif
 
 /*
  * This function fills a red-black tree with information from a
@@ -626,7 +715,11 @@ int next3_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 {
 	struct dx_hash_info hinfo;
 	struct next3_dir_entry_2 *de;
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	struct dx_frame frames[NEXT3_HTREE_LEVEL], *frame;
+#else
 	struct dx_frame frames[2], *frame;
+#endif
 	struct inode *dir;
 	int block, err;
 	int count = 0;
@@ -670,6 +763,9 @@ int next3_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 
 	while (1) {
 		block = dx_get_block(frame->at);
+#ifdef CONFIG_NEXT3_FS_HTREE_READAHEAD
+		dx_readahead_leaves(dir, frame);
+#endif
 		ret = htree_dirblock_to_tree(dir_file, dir, block, &hinfo,
 					     start_hash, start_minor_hash);
 		if (ret < 0) {
@@ -802,6 +898,51 @@ static inline int next3_match (int len, const char * const name,
 	return !memcmp(name, de->name, len);
 }
 
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+/*
+ * Name prefilter for directory block scans.
+ * The first (up to) 4 bytes of the name we look for are loaded into a word,
+ * which is compared with the first name word of every dirent with the same
+ * name length, before the rest of the name is compared.  Most dirents of the
+ * same length that do not match are rejected by a single word compare,
+ * without calling memcmp().  Names of up to 4 bytes are fully compared by
+ * the word compare.
+ */
+struct next3_name_filter {
+	u32 word;
+	u32 mask;
+};
+
+static inline void next3_name_filter_init(struct next3_name_filter *f,
+		int len, const unsigned char * const name)
+{
+	int n = min(len, 4);
+
+	f->word = f->mask = 0;
+	memcpy(&f->word, name, n);
+	memset(&f->mask, 0xff, n);
+}
+
+/*
+ * Same as next3_match(), but uses the name prefilter @f.
+ * The caller guarantees that the first 4 bytes of the dirent name are
+ * within the directory block.
+ */
+static inline int next3_match_filter(int len,
+		const unsigned char * const name,
+		const struct next3_name_filter *f,
+		struct next3_dir_entry_2 *de)
+{
+	if (len != de->name_len)
+		return 0;
+	if ((get_unaligned((u32 *)de->name) & f->mask) != f->word)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return len <= 4 || !memcmp(name + 4, de->name + 4, len - 4);
+}
+#endif
+
 /*
  * Returns 0 if not found, -1 on failure, and 1 on success
  */
@@ -814,8 +955,17 @@ static inline int search_dirblock(struct buffer_head * bh,
 	struct next3_dir_entry_2 * de;
 	char * dlimit;
 	int de_len;
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+	const unsigned char *name = child->name;
+#else
 	const char *name = child->name;
+#endif
 	int namelen = child->len;
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+	struct next3_name_filter filter;
+
+	next3_name_filter_init(&filter, namelen, name);
+#endif
 
 	de = (struct next3_dir_entry_2 *) bh->b_data;
 	dlimit = bh->b_data + dir->i_sb->s_blocksize;
@@ -823,8 +973,13 @@ static inline int search_dirblock(struct buffer_head * bh,
 		/* this code is executed quadratically often */
 		/* do minimal checking `by hand' */
 
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+		if ((char *) de + NEXT3_DIR_REC_LEN(namelen) <= dlimit &&
+		    next3_match_filter(namelen, name, &filter, de)) {
+#else
 		if ((char *) de + namelen <= dlimit &&
 		    next3_match (namelen, name, de)) {
+#endif
 			/* found a match - just to be sure, do a full check */
 			if (!next3_check_dir_entry("next3_find_entry",
 						  dir, de, bh, offset))
@@ -961,6 +1116,319 @@ cleanup_and_exit:
 	return ret;
 }
 
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+/*
+ * In-memory htree index cache
+ *
+ * The leaf entries of the htree index of a large directory are flattened
+ * into a sorted array of (hash, block) pairs, so lookups find the leaf block
+ * with a binary search in memory, instead of reading and searching the
+ * dx_root and dx_node blocks.  The first entry of a dx_node takes the hash
+ * of its entry in the dx_root, so a search for the last entry whose hash is
+ * not above the lookup hash gives the same leaf as dx_probe().
+ *
+ * The hash range of leaf blocks only changes when a leaf is split, so the
+ * array is updated in do_split().  Index node splits in next3_dx_add_entry()
+ * and entry deletes in next3_delete_entry() do not change the leaf blocks
+ * and hash ranges.  All users of the cache hold the directory i_mutex.
+ */
+struct dx_cache_entry {
+	u32 hash;
+	u32 block;
+};
+
+struct next3_dx_cache {
+	unsigned int count;
+	unsigned int limit;
+	unsigned int hash_version;	/* adjusted like in dx_probe() */
+	struct dx_cache_entry entries[0];
+};
+
+#define DX_CACHE_MIN_LIMIT	64
+
+static void dx_cache_release(struct next3_dx_cache *cache)
+{
+	if (is_vmalloc_addr(cache))
+		vfree(cache);
+	else
+		kfree(cache);
+}
+
+void next3_dx_cache_free(struct inode *dir)
+{
+	struct next3_dx_cache *cache = NEXT3_I(dir)->i_dx_cache;
+
+	NEXT3_I(dir)->i_dx_cache = NULL;
+	if (cache)
+		dx_cache_release(cache);
+}
+
+/*
+ * Make room for @count entries in the cache at *@cachep.
+ * May be called inside a transaction, so use GFP_NOFS.
+ * On failure, the old cache is left intact.
+ */
+static int dx_cache_reserve(struct next3_dx_cache **cachep, unsigned count)
+{
+	struct next3_dx_cache *cache = *cachep, *new;
+	unsigned limit = cache ? cache->limit : 0;
+	size_t size;
+
+	if (count <= limit)
+		return 0;
+	limit = max(max(count, 2 * limit), (unsigned)DX_CACHE_MIN_LIMIT);
+	size = sizeof(*new) + limit * sizeof(struct dx_cache_entry);
+	if (size <= PAGE_SIZE)
+		new = kmalloc(size, GFP_NOFS);
+	else
+		new = __vmalloc(size, GFP_NOFS, PAGE_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	if (cache) {
+		memcpy(new, cache, sizeof(*cache) +
+		       cache->count * sizeof(struct dx_cache_entry));
+		dx_cache_release(cache);
+	} else {
+		new->count = 0;
+	}
+	new->limit = limit;
+	*cachep = new;
+	return 0;
+}
+
+static int dx_cache_add(struct next3_dx_cache **cachep, u32 hash, u32 block)
+{
+	struct dx_cache_entry *e;
+	unsigned count = *cachep ? (*cachep)->count : 0;
+
+	if (dx_cache_reserve(cachep, count + 1))
+		return -ENOMEM;
+	e = (*cachep)->entries + (*cachep)->count++;
+	e->hash = hash;
+	e->block = block;
+	return 0;
+}
+
+/*
+ * Flatten the leaf entries of the htree index of @dir into a new cache.
+ * Returns NULL on error or if the index is not valid, in which case the
+ * caller falls back to dx_probe(), which reports the problem.
+ */
+static struct next3_dx_cache *dx_cache_build(struct inode *dir)
+{
+	struct next3_dx_cache *cache = NULL;
+	struct buffer_head *bh, *bh2;
+	struct dx_root *root;
+	struct dx_entry *entries, *entries2;
+	unsigned count, count2, i, j;
+	u32 hash;
+	int err;
+
+	bh = next3_bread(NULL, dir, 0, 0, &err);
+	if (!bh)
+		return NULL;
+	root = (struct dx_root *) bh->b_data;
+#ifdef CONFIG_NEXT3_FS_DX_HASH_MURMUR
+	if ((root->info.hash_version != DX_HASH_TEA &&
+	     root->info.hash_version != DX_HASH_HALF_MD4 &&
+	     root->info.hash_version != DX_HASH_LEGACY &&
+	     root->info.hash_version != DX_HASH_MURMUR) ||
+#else
+	if ((root->info.hash_version != DX_HASH_TEA &&
+	     root->info.hash_version != DX_HASH_HALF_MD4 &&
+	     root->info.hash_version != DX_HASH_LEGACY) ||
+#endif
+	    (root->info.unused_flags & 1) ||
+	    root->info.indirect_levels > 1)
+		goto fail;
+	entries = (struct dx_entry *) (((char *)&root->info) +
+				       root->info.info_length);
+	count = dx_get_count(entries);
+	if (dx_get_limit(entries) != dx_root_limit(dir,
+						   root->info.info_length) ||
+	    !count || count > dx_get_limit(entries))
+		goto fail;
+
+	if (dx_cache_reserve(&cache, root->info.indirect_levels ?
+			     count * dx_node_limit(dir) / 2 : count))
+		goto fail;
+	cache->hash_version = root->info.hash_version;
+	if (cache->hash_version <= DX_HASH_TEA)
+		cache->hash_version += NEXT3_SB(dir->i_sb)->s_hash_unsigned;
+
+	for (i = 0; i < count; i++) {
+		hash = i ? dx_get_hash(entries + i) : 0;
+		if (!root->info.indirect_levels) {
+			if (dx_cache_add(&cache, hash,
+					 dx_get_block(entries + i)))
+				goto fail;
+			continue;
+		}
+		bh2 = next3_bread(NULL, dir, dx_get_block(entries + i), 0,
+				  &err);
+		if (!bh2)
+			goto fail;
+		entries2 = ((struct dx_node *) bh2->b_data)->entries;
+		count2 = dx_get_count(entries2);
+		if (dx_get_limit(entries2) != dx_node_limit(dir) ||
+		    !count2 || count2 > dx_get_limit(entries2)) {
+			brelse(bh2);
+			goto fail;
+		}
+		for (j = 0; j < count2; j++) {
+			if (dx_cache_add(&cache,
+					 j ? dx_get_hash(entries2 + j) : hash,
+					 dx_get_block(entries2 + j))) {
+				brelse(bh2);
+				goto fail;
+			}
+		}
+		brelse(bh2);
+		cond_resched();
+	}
+	brelse(bh);
+	dxtrace(printk(KERN_DEBUG "dx cache of inode %lu: %u leaves\n",
+		       dir->i_ino, cache->count));
+	return cache;
+
+fail:
+	if (cache)
+		dx_cache_release(cache);
+	brelse(bh);
+	return NULL;
+}
+
+/*
+ * Returns the index of the last cached leaf whose hash is not above @hash.
+ */
+static unsigned dx_cache_probe(struct next3_dx_cache *cache, u32 hash)
+{
+	unsigned p = 1, q = cache->count, m;
+
+	while (p < q) {
+		m = p + (q - p) / 2;
+		if (cache->entries[m].hash > hash)
+			q = m;
+		else
+			p = m + 1;
+	}
+	return p - 1;
+}
+
+/*
+ * Called from do_split() after leaf @block was split and @newblock was
+ * inserted into the index after it with start hash @hash2.
+ * @hinfo is the hash that was used to find @block.
+ * If the cache does not agree with the index or cannot grow, drop it.
+ */
+static void dx_cache_insert(struct inode *dir, struct dx_hash_info *hinfo,
+		u32 block, u32 hash2, u32 newblock)
+{
+	struct next3_dx_cache *cache = NEXT3_I(dir)->i_dx_cache;
+	struct dx_cache_entry *e;
+	unsigned at;
+
+	if (!cache)
+		return;
+	at = dx_cache_probe(cache, hinfo->hash);
+	if (cache->entries[at].block != block ||
+	    dx_cache_reserve(&NEXT3_I(dir)->i_dx_cache, cache->count + 1)) {
+		next3_dx_cache_free(dir);
+		return;
+	}
+	cache = NEXT3_I(dir)->i_dx_cache;
+	e = cache->entries + at + 1;
+	memmove(e + 1, e, (cache->count - at - 1) * sizeof(*e));
+	e->hash = hash2;
+	e->block = newblock;
+	cache->count++;
+}
+
+/*
+ * Look up @entry in the leaf blocks found by the htree index cache.
+ * Returns the buffer with the entry, or NULL with *err = -ENOENT if there is
+ * no such entry.  Returns NULL with *err = 0 if the cache is not enabled for
+ * @dir or in case of an error, in which case the caller uses dx_probe().
+ */
+static struct buffer_head *dx_cache_find_entry(struct inode *dir,
+		struct qstr *entry, struct next3_dir_entry_2 **res_dir,
+		int *err)
+{
+	struct next3_dx_cache *cache = NEXT3_I(dir)->i_dx_cache;
+	struct super_block *sb = dir->i_sb;
+	unsigned int dx_cache_blocks = NEXT3_SB(sb)->s_dx_cache_blocks;
+	struct next3_dir_entry_2 *de, *top;
+	struct dx_hash_info hinfo;
+	struct buffer_head *bh;
+	unsigned long block;
+	unsigned at;
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+	struct next3_name_filter filter;
+
+	next3_name_filter_init(&filter, entry->len, entry->name);
+#endif
+
+	*err = 0;
+	if (!dx_cache_blocks) {
+		/* cache was disabled on remount */
+		if (cache)
+			next3_dx_cache_free(dir);
+		return NULL;
+	}
+	if (!cache) {
+		if (dir->i_size >> NEXT3_BLOCK_SIZE_BITS(sb) < dx_cache_blocks)
+			return NULL;
+		cache = dx_cache_build(dir);
+		if (!cache)
+			return NULL;
+		NEXT3_I(dir)->i_dx_cache = cache;
+	}
+
+	hinfo.hash_version = cache->hash_version;
+	hinfo.seed = NEXT3_SB(sb)->s_hash_seed;
+	next3fs_dirhash((const char *)entry->name, entry->len, &hinfo);
+
+	at = dx_cache_probe(cache, hinfo.hash);
+	do {
+		block = cache->entries[at].block;
+		if (!(bh = next3_bread(NULL, dir, block, 0, err)))
+			goto drop;
+		de = (struct next3_dir_entry_2 *) bh->b_data;
+		top = (struct next3_dir_entry_2 *) ((char *) de +
+				sb->s_blocksize - NEXT3_DIR_REC_LEN(0));
+		for (; de < top; de = next3_next_entry(de)) {
+			int off = (block << NEXT3_BLOCK_SIZE_BITS(sb))
+				  + ((char *) de - bh->b_data);
+
+			if (!next3_check_dir_entry(__func__, dir, de, bh, off)) {
+				brelse(bh);
+				goto drop;
+			}
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+			if (next3_match_filter(entry->len, entry->name,
+					       &filter, de)) {
+#else
+			if (next3_match(entry->len, entry->name, de)) {
+#endif
+				*res_dir = de;
+				return bh;
+			}
+		}
+		brelse(bh);
+		/* continue on hash collision, like next3_htree_next_block() */
+	} while (++at < cache->count &&
+		 (cache->entries[at].hash & ~1) == hinfo.hash);
+
+	*err = -ENOENT;
+	return NULL;
+
+drop:
+	next3_dx_cache_free(dir);
+	*err = 0;
+	return NULL;
+}
+
+#endif
 static struct buffer_head * next3_dx_find_entry(struct inode *dir,
 			struct qstr *entry, struct next3_dir_entry_2 **res_dir,
 			int *err)
@@ -968,17 +1436,29 @@ static struct buffer_head * next3_dx_find_entry(struct inode *dir,
 	struct super_block * sb;
 	struct dx_hash_info	hinfo;
 	u32 hash;
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	struct dx_frame frames[NEXT3_HTREE_LEVEL], *frame;
+#else
 	struct dx_frame frames[2], *frame;
+#endif
 	struct next3_dir_entry_2 *de, *top;
 	struct buffer_head *bh;
 	unsigned long block;
 	int retval;
 	int namelen = entry->len;
 	const u8 *name = entry->name;
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+	struct next3_name_filter filter;
+#endif
 
 	sb = dir->i_sb;
 	/* NFS may look up ".." - look at dx_root directory block */
 	if (namelen > 2 || name[0] != '.'|| (namelen == 2 && name[1] != '.')) {
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+		bh = dx_cache_find_entry(dir, entry, res_dir, err);
+		if (bh || *err)
+			return bh;
+#endif
 		if (!(frame = dx_probe(entry, dir, &hinfo, frames, err)))
 			return NULL;
 	} else {
@@ -988,6 +1468,9 @@ static struct buffer_head * next3_dx_find_entry(struct inode *dir,
 		dx_set_block(frame->at, 0);		/* dx_root block is 0 */
 	}
 	hash = hinfo.hash;
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+	next3_name_filter_init(&filter, namelen, name);
+#endif
 	do {
 		block = dx_get_block(frame->at);
 		if (!(bh = next3_bread (NULL,dir, block, 0, err)))
@@ -1005,7 +1488,11 @@ static struct buffer_head * next3_dx_find_entry(struct inode *dir,
 				goto errout;
 			}
 
+#ifdef CONFIG_NEXT3_FS_DIRENT_PREFILTER
+			if (next3_match_filter(namelen, name, &filter, de)) {
+#else
 			if (next3_match(namelen, name, de)) {
+#endif
 				*res_dir = de;
 				dx_release(frames);
 				return bh;
@@ -1154,6 +1641,41 @@ static struct next3_dir_entry_2 *dx_pack_dirents(char *base, unsigned blocksize)
 	return prev;
 }
 
+#ifdef CONFIG_NEXT3_FS_DX_COMPACT
+/*
+ * Pack the entries of a full leaf block to the start of the block, if the
+ * free space scattered between the entries is enough for a new entry of
+ * @reclen bytes and leaves at least 1/8 of the block free after it.
+ * Leaf blocks are searched by hash, so entries may be moved like in
+ * do_split().  Called with write access to @bh.
+ * Returns the entry with the free space at the end of the block, or NULL if
+ * the block has to be split.
+ */
+static struct next3_dir_entry_2 *dx_compact_leaf(struct inode *dir,
+		struct buffer_head *bh, unsigned reclen)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct next3_dir_entry_2 *de = (struct next3_dir_entry_2 *) bh->b_data;
+	unsigned used = 0, offset = 0;
+
+	while (offset < blocksize) {
+		if (!next3_check_dir_entry("dx_compact_leaf", dir, de, bh,
+					   offset))
+			return NULL;
+		if (de->inode && de->name_len)
+			used += NEXT3_DIR_REC_LEN(de->name_len);
+		offset += next3_rec_len_from_disk(de->rec_len);
+		de = next3_next_entry(de);
+	}
+	if (used + reclen > blocksize - blocksize / 8)
+		return NULL;
+
+	de = dx_pack_dirents(bh->b_data, blocksize);
+	de->rec_len = next3_rec_len_to_disk(bh->b_data + blocksize - (char *) de);
+	return de;
+}
+#endif
+
 /*
  * Split a full leaf block to make room for a new dir entry.
  * Allocate a new block, and move entries so that they are approx. equally full.
@@ -1170,6 +1692,9 @@ static struct next3_dir_entry_2 *do_split(handle_t *handle, struct inode *dir,
 	u32 hash2;
 	struct dx_map_entry *map;
 	char *data1 = (*bh)->b_data, *data2;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+	struct buffer_head *bhs[2];
+#endif
 	unsigned split, move, size;
 	struct next3_dir_entry_2 *de = NULL, *de2;
 	int	err = 0, i;
@@ -1181,6 +1706,16 @@ static struct next3_dir_entry_2 *do_split(handle_t *handle, struct inode *dir,
 		goto errout;
 	}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+	/* COW the leaf and its index block in one pass */
+	BUFFER_TRACE(*bh, "get_write_access");
+	BUFFER_TRACE(frame->bh, "get_write_access");
+	bhs[0] = *bh;
+	bhs[1] = frame->bh;
+	err = next3_journal_get_write_access_blocks(handle, NULL, bhs, 2);
+	if (err)
+		goto journal_error;
+#else
 	BUFFER_TRACE(*bh, "get_write_access");
 	err = next3_journal_get_write_access(handle, *bh);
 	if (err)
@@ -1190,6 +1725,7 @@ static struct next3_dir_entry_2 *do_split(handle_t *handle, struct inode *dir,
 	err = next3_journal_get_write_access(handle, frame->bh);
 	if (err)
 		goto journal_error;
+#endif
 
 	data2 = bh2->b_data;
 
@@ -1231,6 +1767,10 @@ static struct next3_dir_entry_2 *do_split(handle_t *handle, struct inode *dir,
 		de = de2;
 	}
 	dx_insert_block (frame, hash2 + continued, newblock);
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	dx_cache_insert(dir, hinfo, dx_get_block(frame->at),
+			hash2 + continued, newblock);
+#endif
 	err = next3_journal_dirty_metadata (handle, bh2);
 	if (err)
 		goto journal_error;
@@ -1469,6 +2009,9 @@ static int next3_add_entry (handle_t *handle, struct dentry *dentry,
 		if (!retval || (retval != ERR_BAD_DX_DIR))
 			return retval;
 		NEXT3_I(dir)->i_flags &= ~NEXT3_INDEX_FL;
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+		next3_dx_cache_free(dir);
+#endif
 		dx_fallback++;
 		next3_mark_inode_dirty(handle, dir);
 	}
@@ -1501,7 +2044,11 @@ static int next3_add_entry (handle_t *handle, struct dentry *dentry,
 static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 			     struct inode *inode)
 {
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	struct dx_frame frames[NEXT3_HTREE_LEVEL], *frame;
+#else
 	struct dx_frame frames[2], *frame;
+#endif
 	struct dx_entry *entries, *at;
 	struct dx_hash_info hinfo;
 	struct buffer_head * bh;
@@ -1509,6 +2056,12 @@ static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	struct super_block * sb = dir->i_sb;
 	struct next3_dir_entry_2 *de;
 	int err;
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	int restart;
+
+again:
+	restart = 0;
+#endif
 
 	frame = dx_probe(&dentry->d_name, dir, &hinfo, frames, &err);
 	if (!frame)
@@ -1531,8 +2084,144 @@ static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	}
 
 	/* Block full, should compress but for now just split */
+#ifdef CONFIG_NEXT3_FS_DX_COMPACT
+	de = dx_compact_leaf(dir, bh, NEXT3_DIR_REC_LEN(dentry->d_name.len));
+	if (de) {
+		err = add_dirent_to_buf(handle, dentry, inode, de, bh);
+		bh = NULL;
+		goto cleanup;
+	}
+#endif
 	dxtrace(printk("using %u of %u node entries\n",
 		       dx_get_count(entries), dx_get_limit(entries)));
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	/* Need to split index? */
+	if (dx_get_count(entries) == dx_get_limit(entries)) {
+		u32 newblock;
+		unsigned icount;
+		int levels = frame - frames + 1;
+		int add_level = 1;
+		struct dx_entry *entries2;
+		struct dx_node *node2;
+		struct buffer_head *bh2;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		struct buffer_head *bhs[2];
+#endif
+
+		/*
+		 * Split the lowest full index block whose parent is not full.
+		 * If that is not the bottom index block, the access path is
+		 * no longer valid after the split and the insert restarts.
+		 */
+		while (frame > frames) {
+			if (dx_get_count((frame - 1)->entries) <
+			    dx_get_limit((frame - 1)->entries)) {
+				add_level = 0;
+				break;
+			}
+			frame--;
+			at = frame->at;
+			entries = frame->entries;
+			restart = 1;
+		}
+		if (add_level && levels == next3_dir_htree_level(sb)) {
+			next3_warning(sb, __func__,
+				     "Directory index full!");
+			err = -ENOSPC;
+			goto cleanup;
+		}
+		icount = dx_get_count(entries);
+		bh2 = next3_append (handle, dir, &newblock, &err);
+		if (!(bh2))
+			goto cleanup;
+		node2 = (struct dx_node *)(bh2->b_data);
+		entries2 = node2->entries;
+		node2->fake.rec_len = next3_rec_len_to_disk(sb->s_blocksize);
+		node2->fake.inode = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		/* COW the split index block and its parent in one pass */
+		BUFFER_TRACE(frame->bh, "get_write_access");
+		bhs[0] = frame->bh;
+		if (!add_level)
+			bhs[1] = (frame - 1)->bh;
+		err = next3_journal_get_write_access_blocks(handle, NULL, bhs,
+							    add_level ? 1 : 2);
+		if (err)
+			goto journal_error;
+#else
+		BUFFER_TRACE(frame->bh, "get_write_access");
+		err = next3_journal_get_write_access(handle, frame->bh);
+		if (err)
+			goto journal_error;
+#endif
+		if (!add_level) {
+			unsigned icount1 = icount/2, icount2 = icount - icount1;
+			unsigned hash2 = dx_get_hash(entries + icount1);
+			dxtrace(printk("Split index %i/%i\n", icount1, icount2));
+
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+			BUFFER_TRACE(frame->bh, "get_write_access"); /* parent */
+			err = next3_journal_get_write_access(handle,
+							     (frame - 1)->bh);
+			if (err)
+				goto journal_error;
+#endif
+
+			memcpy ((char *) entries2, (char *) (entries + icount1),
+				icount2 * sizeof(struct dx_entry));
+			dx_set_count (entries, icount1);
+			dx_set_count (entries2, icount2);
+			dx_set_limit (entries2, dx_node_limit(dir));
+
+			/* Which index block gets the new entry? */
+			if (at - entries >= icount1) {
+				frame->at = at = at - entries - icount1 + entries2;
+				frame->entries = entries = entries2;
+				swap(frame->bh, bh2);
+			}
+			dx_insert_block (frame - 1, hash2, newblock);
+			dxtrace(dx_show_index ("node", frame->entries));
+			dxtrace(dx_show_index ("node",
+			       ((struct dx_node *) bh2->b_data)->entries));
+			err = next3_journal_dirty_metadata(handle, bh2);
+			if (err)
+				goto journal_error;
+			brelse (bh2);
+			err = next3_journal_dirty_metadata(handle,
+							   (frame - 1)->bh);
+			if (err)
+				goto journal_error;
+			if (restart) {
+				/* do_split() does not dirty the split node */
+				err = next3_journal_dirty_metadata(handle,
+								   frame->bh);
+				goto journal_error;
+			}
+		} else {
+			struct dx_root *root = (struct dx_root *)
+				frames[0].bh->b_data;
+
+			dxtrace(printk("Creating %d level index...\n",
+				       root->info.indirect_levels + 2));
+			memcpy((char *) entries2, (char *) entries,
+			       icount * sizeof(struct dx_entry));
+			dx_set_limit(entries2, dx_node_limit(dir));
+
+			/* Set up root */
+			dx_set_count(entries, 1);
+			dx_set_block(entries + 0, newblock);
+			root->info.indirect_levels++;
+			err = next3_journal_dirty_metadata(handle, frames[0].bh);
+			if (err)
+				goto journal_error;
+			err = next3_journal_dirty_metadata(handle, bh2);
+			brelse(bh2);
+			/* look up the new access path */
+			restart = 1;
+			goto journal_error;
+		}
+	}
+#else
 	/* Need to split index? */
 	if (dx_get_count(entries) == dx_get_limit(entries)) {
 		u32 newblock;
@@ -1541,6 +2230,9 @@ static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 		struct dx_entry *entries2;
 		struct dx_node *node2;
 		struct buffer_head *bh2;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		struct buffer_head *bhs[2];
+#endif
 
 		if (levels && (dx_get_count(frames->entries) ==
 			       dx_get_limit(frames->entries))) {
@@ -1556,20 +2248,33 @@ static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 		entries2 = node2->entries;
 		node2->fake.rec_len = next3_rec_len_to_disk(sb->s_blocksize);
 		node2->fake.inode = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+		/* COW the split index block and the index root in one pass */
+		BUFFER_TRACE(frame->bh, "get_write_access");
+		bhs[0] = frame->bh;
+		bhs[1] = frames[0].bh;
+		err = next3_journal_get_write_access_blocks(handle, NULL, bhs,
+							    levels ? 2 : 1);
+		if (err)
+			goto journal_error;
+#else
 		BUFFER_TRACE(frame->bh, "get_write_access");
 		err = next3_journal_get_write_access(handle, frame->bh);
 		if (err)
 			goto journal_error;
+#endif
 		if (levels) {
 			unsigned icount1 = icount/2, icount2 = icount - icount1;
 			unsigned hash2 = dx_get_hash(entries + icount1);
 			dxtrace(printk("Split index %i/%i\n", icount1, icount2));
 
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
 			BUFFER_TRACE(frame->bh, "get_write_access"); /* index root */
 			err = next3_journal_get_write_access(handle,
 							     frames[0].bh);
 			if (err)
 				goto journal_error;
+#endif
 
 			memcpy ((char *) entries2, (char *) (entries + icount1),
 				icount2 * sizeof(struct dx_entry));
@@ -1614,6 +2319,7 @@ static int next3_dx_add_entry(handle_t *handle, struct dentry *dentry,
 		}
 		next3_journal_dirty_metadata(handle, frames[0].bh);
 	}
+#endif
 	de = do_split(handle, dir, &bh, frame, &hinfo, &err);
 	if (!de)
 		goto cleanup;
@@ -1627,6 +2333,11 @@ cleanup:
 	if (bh)
 		brelse(bh);
 	dx_release(frames);
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+	/* the index was reshaped, look up the new access path */
+	if (restart && !err)
+		goto again;
+#endif
 	return err;
 }
 
@@ -1973,9 +2684,20 @@ int next3_orphan_add(handle_t *handle, struct inode *inode)
 	struct next3_iloc iloc;
 	int err = 0, rc;
 
+#ifdef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
+	/*
+	 * The caller holds i_mutex or the inode is no longer referenced
+	 * (or snapshot_mutex for the snapshot list), so nobody else can add
+	 * the inode to the list or remove it from the list under our feet.
+	 * s_orphan_lock only protects the list itself.
+	 */
+	if (!list_empty(&NEXT3_I(inode)->i_orphan))
+		return 0;
+#else
 	mutex_lock(&NEXT3_SB(sb)->s_orphan_lock);
 	if (!list_empty(&NEXT3_I(inode)->i_orphan))
 		goto out_unlock;
+#endif
 
 	/* Orphan handling is only valid for files with data blocks
 	 * being truncated, or files being unlinked. */
@@ -1996,11 +2718,25 @@ int next3_orphan_add(handle_t *handle, struct inode *inode)
 	BUFFER_TRACE(NEXT3_SB(sb)->s_sbh, "get_write_access");
 	err = next3_journal_get_write_access(handle, NEXT3_SB(sb)->s_sbh);
 	if (err)
+#ifdef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
+		goto out;
+#else
 		goto out_unlock;
+#endif
 
 	err = next3_reserve_inode_write(handle, inode, &iloc);
 	if (err)
+#ifdef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
+		goto out;
+
+	/*
+	 * Getting journal write access may block on I/O and on the
+	 * committing transaction, so we only take the lock now.
+	 */
+	mutex_lock(&NEXT3_SB(sb)->s_orphan_lock);
+#else
 		goto out_unlock;
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	snapshot_debug(4, "add inode %lu to %s list\n",
@@ -2029,7 +2765,12 @@ int next3_orphan_add(handle_t *handle, struct inode *inode)
 	 * anyway on the next recovery. */
 	if (!err)
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+		/* publish a fully set up entry to lock-free read through */
+		list_add_rcu(&NEXT3_I(inode)->i_orphan, s_list);
+#else
 		list_add(&NEXT3_I(inode)->i_orphan, s_list);
+#endif
 #else
 		list_add(&NEXT3_I(inode)->i_orphan, &NEXT3_SB(sb)->s_orphan);
 #endif
@@ -2044,8 +2785,13 @@ int next3_orphan_add(handle_t *handle, struct inode *inode)
 	jbd_debug(4, "orphan inode %lu will point to %d\n",
 			inode->i_ino, NEXT_ORPHAN(inode));
 #endif
+#ifndef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
 out_unlock:
+#endif
 	mutex_unlock(&NEXT3_SB(sb)->s_orphan_lock);
+#ifdef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
+out:
+#endif
 	next3_std_error(inode->i_sb, err);
 	return err;
 }
@@ -2084,9 +2830,19 @@ int next3_orphan_del(handle_t *handle, struct inode *inode)
 	struct next3_iloc iloc;
 	int err = 0;
 
+#ifdef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
+	/* see comment in next3_orphan_add() */
+	if (list_empty(&ei->i_orphan))
+		return 0;
+	if (handle)
+		/* may block on I/O - do it before taking the lock */
+		err = next3_reserve_inode_write(handle, inode, &iloc);
+	mutex_lock(&NEXT3_SB(inode->i_sb)->s_orphan_lock);
+#else
 	mutex_lock(&NEXT3_SB(inode->i_sb)->s_orphan_lock);
 	if (list_empty(&ei->i_orphan))
 		goto out;
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	ino_next = *i_next;
@@ -2103,7 +2859,20 @@ int next3_orphan_del(handle_t *handle, struct inode *inode)
 	jbd_debug(4, "remove inode %lu from orphan list\n", inode->i_ino);
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	if (s_list != &sbi->s_orphan)
+		/*
+		 * Snapshot read through may be following the links of this
+		 * entry right now.  Unlink it, but leave its links intact.
+		 * next3_snapshot_remove() re-initializes the entry after a
+		 * grace period.
+		 */
+		__list_del(ei->i_orphan.prev, ei->i_orphan.next);
+	else
+		list_del_init(&ei->i_orphan);
+#else
 	list_del_init(&ei->i_orphan);
+#endif
 
 	/* If we're on an error path, we may not have a valid
 	 * transaction handle with which to update the orphan list on
@@ -2112,7 +2881,9 @@ int next3_orphan_del(handle_t *handle, struct inode *inode)
 	if (!handle)
 		goto out;
 
+#ifndef CONFIG_NEXT3_FS_ORPHAN_SCALABLE
 	err = next3_reserve_inode_write(handle, inode, &iloc);
+#endif
 	if (err)
 		goto out_err;
 
@@ -2300,6 +3071,10 @@ static int next3_unlink(struct inode * dir, struct dentry *dentry)
 end_unlink:
 	next3_journal_stop(handle);
 	brelse (bh);
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	if (!retval)
+		next3_async_unlink(inode);
+#endif
 	return retval;
 }
 
@@ -151,10 +151,18 @@ struct next3_group_desc
 	__le16	bg_free_blocks_count;	/* Free blocks count */
 	__le16	bg_free_inodes_count;	/* Free inodes count */
 	__le16	bg_used_dirs_count;	/* Directories count */
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	__le16	bg_flags;		/* NEXT3_BG_flags */
+#else
 	__u16	bg_pad;
+#endif
 	__le32	bg_reserved[3];
 };
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+#define NEXT3_BG_ITABLE_UNINIT	0x0008 /* Inode table not zeroed */
+
+#endif
 /*
  * Macro-instructions used to manage group descriptors
  */
@@ -328,6 +336,127 @@ struct next3_new_group_data {
 	__u32 free_blocks_count;
 };
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+/* Used to add a range of block groups by NEXT3_IOC_GROUP_ADD_BATCH */
+struct next3_new_group_batch {
+	__u32 gb_count;		/* Number of groups to add */
+	__u32 gb_unused;
+	struct next3_new_group_input gb_groups[0];
+};
+#define NEXT3_GROUP_ADD_BATCH_MAX \
+	(PAGE_SIZE / sizeof(struct next3_new_group_data))
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+/* Used to report snapshot space usage by NEXT3_IOC_SNAPSHOT_USAGE */
+struct next3_snapshot_usage {
+	__u64 copied;		/* Blocks copied to snapshot on write */
+	__u64 moved;		/* Blocks moved to snapshot on write/delete */
+	__u64 shared;		/* Blocks still shared with newer snapshots/fs */
+	__u64 blocks;		/* Blocks allocated to snapshot file */
+};
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+/* Used to verify snapshot image metadata by NEXT3_IOC_SNAPSHOT_VERIFY */
+struct next3_snapshot_verify {
+	__u32 sv_start;		/* In: first group, out: next group */
+	__u32 sv_count;		/* In: max groups, out: groups verified */
+	__u32 sv_errors;	/* Out: inconsistencies found */
+	__u32 sv_first_error;	/* Out: group of first inconsistency */
+	__u64 sv_blocks;	/* Out: metadata blocks read */
+};
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+/* Returned by NEXT3_IOC_SNAPSHOT_ROLLBACK */
+struct next3_snapshot_rollback {
+	__u64 sr_copied;	/* Blocks copied back in place */
+	__u64 sr_inplace;	/* Blocks moved to snapshot and still in place */
+};
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+/* Used to report snapshot file reads by NEXT3_IOC_SNAPSHOT_READ_STATS */
+struct next3_snapshot_read_stats {
+	__u64 bytes;		/* Bytes read from snapshot file */
+	__u64 pages;		/* Pages read into snapshot file page cache */
+};
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+/* Used to report changed blocks ranges by NEXT3_IOC_SNAPSHOT_DIFF */
+struct next3_snapshot_diff_extent {
+	__u64 de_block;		/* First changed block */
+	__u64 de_count;		/* Number of changed blocks */
+};
+
+struct next3_snapshot_diff {
+	__u32 sd_end;		/* Newer snapshot generation (0 - file system) */
+	__u32 sd_count;		/* In: max extents, out: extents returned */
+	__u64 sd_start;		/* In: first block to scan, out: next block */
+	struct next3_snapshot_diff_extent sd_extents[0];
+};
+#define NEXT3_SNAPSHOT_DIFF_MAX \
+	(PAGE_SIZE / sizeof(struct next3_snapshot_diff_extent))
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+/* Used to report snapshot file blocks map by NEXT3_IOC_SNAPSHOT_MAP */
+struct next3_snapshot_map_extent {
+	__u64 me_block;		/* First snapshot image block */
+	__u64 me_phys;		/* First physical block */
+	__u32 me_count;		/* Number of blocks */
+	__u32 me_flags;		/* NEXT3_SNAPSHOT_MAP_* */
+};
+
+#define NEXT3_SNAPSHOT_MAP_MOVED	0x0001 /* Blocks moved to snapshot */
+#define NEXT3_SNAPSHOT_MAP_COPIED	0x0002 /* Blocks copied to snapshot */
+
+struct next3_snapshot_map {
+	__u32 sm_count;		/* In: max extents, out: extents returned */
+	__u32 sm_reserved;	/* Must be 0 */
+	__u64 sm_start;		/* In: first block to scan, out: next block */
+	struct next3_snapshot_map_extent sm_extents[0];
+};
+#define NEXT3_SNAPSHOT_MAP_MAX \
+	(PAGE_SIZE / sizeof(struct next3_snapshot_map_extent))
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+/*
+ * Used to queue snapshot operations by NEXT3_IOC_SNAPSHOT_QUEUE and to get
+ * their status by NEXT3_IOC_SNAPSHOT_STATUS
+ */
+struct next3_snapshot_ctl {
+	__u32 sc_op;		/* In (queue): NEXT3_SNAPSHOT_OP_* */
+	__u32 sc_flags;		/* In (status): NEXT3_SNAPSHOT_CTL_WAIT */
+	__u64 sc_seq;		/* Out (queue), In (status): request no. */
+	__s32 sc_result;	/* Out (status): 0 or -errno of the request */
+	__u32 sc_state;		/* Out (status): NEXT3_SNAPSHOT_CTL_* */
+};
+
+#define NEXT3_SNAPSHOT_OP_TAKE		1 /* chattr +S of snapshot file */
+#define NEXT3_SNAPSHOT_OP_DELETE	2 /* chattr -S of snapshot file */
+#define NEXT3_SNAPSHOT_OP_CLEANUP	3 /* remove deleted snapshots */
+
+#define NEXT3_SNAPSHOT_CTL_WAIT		0x0001 /* Wait for request to complete */
+
+#define NEXT3_SNAPSHOT_CTL_PENDING	1 /* Request is queued or running */
+#define NEXT3_SNAPSHOT_CTL_DONE		2 /* Request completed, see sc_result */
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+/* Used to pass the file range to defrag to NEXT3_IOC_DEFRAG */
+struct next3_defrag_range {
+	__u64 dr_start;		/* In: first logical block to defrag */
+	__u64 dr_len;		/* In: no. of logical blocks (0 - to EOF) */
+	__u64 dr_defragged;	/* Out: no. of blocks re-allocated */
+};
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIEMAP
+/*
+ * FIEMAP extent flags of snapshot files (extents with none of these flags
+ * are owned by the snapshot file)
+ */
+#define NEXT3_FIEMAP_EXTENT_SNAPSHOT	0x00010000 /* Read through to newer
+						      snapshot */
+#define NEXT3_FIEMAP_EXTENT_BLOCKDEV	0x00020000 /* Read through to block
+						      device */
+#endif
 
 /*
  * ioctl commands
@@ -338,6 +467,9 @@ struct next3_new_group_data {
 #define	NEXT3_IOC_SETVERSION		_IOW('f', 4, long)
 #define NEXT3_IOC_GROUP_EXTEND		_IOW('f', 7, unsigned long)
 #define NEXT3_IOC_GROUP_ADD		_IOW('f', 8,struct next3_new_group_input)
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+#define NEXT3_IOC_GROUP_ADD_BATCH	_IOW('f', 9, struct next3_new_group_batch)
+#endif
 #define	NEXT3_IOC_GETVERSION_OLD		FS_IOC_GETVERSION
 #define	NEXT3_IOC_SETVERSION_OLD		FS_IOC_SETVERSION
 #ifdef CONFIG_JBD_DEBUG
@@ -345,6 +477,38 @@ struct next3_new_group_data {
 #endif
 #define NEXT3_IOC_GETRSVSZ		_IOR('f', 5, long)
 #define NEXT3_IOC_SETRSVSZ		_IOW('f', 6, long)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+#define NEXT3_IOC_SNAPSHOT_USAGE	_IOR('f', 40, struct next3_snapshot_usage)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+#define NEXT3_IOC_SNAPSHOT_DIFF		_IOWR('f', 41, struct next3_snapshot_diff)
+#endif
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+#define NEXT3_IOC_DEFRAG		_IOWR('f', 42, struct next3_defrag_range)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+/* Set read through I/O priority (ioprio_set(2) value) of open snapshot file */
+#define NEXT3_IOC_SNAPSHOT_IOPRIO	_IOW('f', 43, int)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+#define NEXT3_IOC_SNAPSHOT_MAP		_IOWR('f', 44, struct next3_snapshot_map)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+#define NEXT3_IOC_SNAPSHOT_QUEUE	_IOWR('f', 45, struct next3_snapshot_ctl)
+#define NEXT3_IOC_SNAPSHOT_STATUS	_IOWR('f', 46, struct next3_snapshot_ctl)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+#define NEXT3_IOC_SNAPSHOT_READ_STATS	_IOR('f', 47, \
+					     struct next3_snapshot_read_stats)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+#define NEXT3_IOC_SNAPSHOT_VERIFY	_IOWR('f', 48, \
+					      struct next3_snapshot_verify)
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+#define NEXT3_IOC_SNAPSHOT_ROLLBACK	_IOR('f', 49, \
+					     struct next3_snapshot_rollback)
+#endif
 
 /*
  * ioctl commands in 32 bit emulation
@@ -371,6 +535,25 @@ struct next3_mount_options {
 	uid_t s_resuid;
 	gid_t s_resgid;
 	unsigned long s_commit_interval;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	unsigned long s_min_commit_interval;
+	unsigned long s_max_commit_interval;
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	unsigned int s_async_unlink_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	unsigned int s_dx_cache_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	unsigned int s_bitmap_pin_groups;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	unsigned long s_stripe;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	unsigned int s_inode_readahead_blks;
+#endif
 #ifdef CONFIG_QUOTA
 	int s_jquota_fmt;
 	char *s_qf_names[MAXQUOTAS];
@@ -456,6 +639,11 @@ struct next3_inode {
 #else
 #define i_reserved1	osd1.linux1.l_i_reserved1
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+/* snapshot space usage counters are stored in unused fields */
+#define i_snapshot_copied	i_faddr
+#define i_snapshot_moved	osd2.linux2.l_i_reserved2
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_HUGE
 #define i_blocks_high	osd2.linux2.l_i_blocks_high
 #else
@@ -544,6 +732,19 @@ struct next3_inode {
 #define NEXT3_MOUNT_GRPQUOTA		0x200000 /* "old" group quota */
 #define NEXT3_MOUNT_DATA_ERR_ABORT	0x400000 /* Abort on file data write
 						  * error in ordered mode */
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+#define NEXT3_MOUNT_STATFS_APPROX	0x800000 /* Approximate statfs counters */
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#define NEXT3_MOUNT_JOURNAL_CHECKSUM	0x1000000 /* Journal checksums */
+#define NEXT3_MOUNT_JOURNAL_ASYNC_COMMIT	0x2000000 /* Journal Async Commit */
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+#define NEXT3_MOUNT_ORDERED_INODE	0x4000000 /* Order data by inode */
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+#define NEXT3_MOUNT_LAZYTIME		0x8000000 /* Defer timestamp updates */
+#endif
 
 /* Compatibility, for having both ext2_fs.h and next3_fs.h included at once */
 #ifndef _LINUX_EXT2_FS_H
@@ -564,6 +765,7 @@ struct next3_inode {
 #define next3_test_bit			ext2_test_bit
 #define next3_find_first_zero_bit	ext2_find_first_zero_bit
 #define next3_find_next_zero_bit		ext2_find_next_zero_bit
+#define next3_find_next_bit		ext2_find_next_bit
 
 /*
  * Maximal mount counts between two filesystem checks
@@ -677,15 +879,19 @@ struct next3_super_block {
 	__le32	s_snapshot_id;		/* Sequential ID of active snapshot */
 	__le64	s_snapshot_r_blocks_count; /* Reserved for active snapshot */
 	__le32	s_snapshot_list;	/* start of list of snapshot inodes */
+	__le32	s_snapshot_shrink_start;/* ID of snapshot before shrunk group */
+	__le32	s_snapshot_shrink_end;	/* ID of snapshot after shrunk group */
+	__le32	s_snapshot_shrink_next;	/* Next block group to shrink */
+	__le32	s_snapshot_cow_rate;	/* Blocks COWed per hour (average) */
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_OLD
-	__u32	s_reserved[151];	/* Padding to the end of the block */
+	__u32	s_reserved[147];	/* Padding to the end of the block */
 	/* old snapshot field positions */
 /*3F0*/	__le32	s_snapshot_list_old;	/* Old snapshot list head */
 	__le32	s_snapshot_r_blocks_old;/* Old reserved for snapshot */
 	__le32	s_snapshot_id_old;	/* Old active snapshot ID */
 	__le32	s_snapshot_inum_old;	/* Old active snapshot inode */
 #else
-	__u32	s_reserved[155];	/* Padding to the end of the block */
+	__u32	s_reserved[151];	/* Padding to the end of the block */
 #endif
 #else
 	__u32   s_reserved[160];        /* Padding to the end of the block */
@@ -724,6 +930,18 @@ enum {
 	NEXT3_STATE_NEW,			/* inode is newly created */
 	NEXT3_STATE_XATTR,		/* has in-inode xattrs */
 	NEXT3_STATE_FLUSH_ON_CLOSE,	/* flush dirty pages on close */
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+	NEXT3_STATE_DEFRAG,		/* defrag in progress */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	NEXT3_STATE_SNAPSHOT_MOUNT,	/* snapshot is mounted natively */
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	NEXT3_STATE_LAZY_TIME,		/* in-memory inode update pending */
+#endif
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	NEXT3_STATE_ORPHAN_PENDING,	/* orphan queued for async delete */
+#endif
 };
 
 static inline int next3_test_inode_state(struct inode *inode, int bit)
@@ -749,7 +967,12 @@ static inline void next3_clear_inode_state(struct inode *inode, int bit)
 
 #define NEXT_ORPHAN(inode) NEXT3_I(inode)->i_dtime
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
-#define NEXT_SNAPSHOT(inode) (NEXT3_I(inode)->i_next_snapshot_ino)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+#define NEXT3_SNAP_I(inode) (NEXT3_I(inode)->i_snapinfo)
+#else
+#define NEXT3_SNAP_I(inode) (&NEXT3_I(inode)->i_snapinfo)
+#endif
+#define NEXT_SNAPSHOT(inode) (NEXT3_SNAP_I(inode)->i_next_snapshot_ino)
 #endif
 
 /*
@@ -821,17 +1044,48 @@ static inline void next3_clear_inode_state(struct inode *inode, int bit)
 #define NEXT3_FEATURE_RO_COMPAT_FIX_SNAPSHOT_OLD 0x4000 /* Old fix snapshot */
 #define NEXT3_FEATURE_RO_COMPAT_FIX_EXCLUDE_OLD	0x8000 /* Old fix exclude */
 #endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+#define NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT	0x0100 /* Itables not zeroed */
+#endif
 
 #define NEXT3_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define NEXT3_FEATURE_INCOMPAT_FILETYPE		0x0002
 #define NEXT3_FEATURE_INCOMPAT_RECOVER		0x0004 /* Needs recovery */
 #define NEXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008 /* Journal device */
 #define NEXT3_FEATURE_INCOMPAT_META_BG		0x0010
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+#define NEXT3_FEATURE_INCOMPAT_FLEX_BG		0x0200 /* packed metadata */
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+#define NEXT3_FEATURE_INCOMPAT_LARGEDIR		0x4000 /* 3 level htree */
+#endif
 
 #define NEXT3_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+#define NEXT3_FEATURE_INCOMPAT_SUPP	(NEXT3_FEATURE_INCOMPAT_FILETYPE| \
+					 NEXT3_FEATURE_INCOMPAT_RECOVER| \
+					 NEXT3_FEATURE_INCOMPAT_META_BG| \
+					 NEXT3_FEATURE_INCOMPAT_FLEX_BG| \
+					 NEXT3_FEATURE_INCOMPAT_LARGEDIR)
+#else
+#define NEXT3_FEATURE_INCOMPAT_SUPP	(NEXT3_FEATURE_INCOMPAT_FILETYPE| \
+					 NEXT3_FEATURE_INCOMPAT_RECOVER| \
+					 NEXT3_FEATURE_INCOMPAT_META_BG| \
+					 NEXT3_FEATURE_INCOMPAT_LARGEDIR)
+#endif
+#else
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+#define NEXT3_FEATURE_INCOMPAT_SUPP	(NEXT3_FEATURE_INCOMPAT_FILETYPE| \
+					 NEXT3_FEATURE_INCOMPAT_RECOVER| \
+					 NEXT3_FEATURE_INCOMPAT_META_BG| \
+					 NEXT3_FEATURE_INCOMPAT_FLEX_BG)
+#else
 #define NEXT3_FEATURE_INCOMPAT_SUPP	(NEXT3_FEATURE_INCOMPAT_FILETYPE| \
 					 NEXT3_FEATURE_INCOMPAT_RECOVER| \
 					 NEXT3_FEATURE_INCOMPAT_META_BG)
+#endif
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_OLD
 #define NEXT3_FEATURE_RO_COMPAT_SUPP	(NEXT3_FEATURE_RO_COMPAT_SPARSE_SUPER| \
@@ -859,6 +1113,21 @@ static inline void next3_clear_inode_state(struct inode *inode, int bit)
  */
 #define	NEXT3_DEF_RESUID		0
 #define	NEXT3_DEF_RESGID		0
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+
+/*
+ * Default and maximal number of inode table blocks to read ahead
+ */
+#define NEXT3_DEF_INODE_READAHEAD_BLKS	32
+#define NEXT3_MAX_INODE_READAHEAD_BLKS	(1 << 12)
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+
+/*
+ * Default number of block groups with pinned bitmap buffers
+ */
+#define NEXT3_DEF_BITMAP_PIN_GROUPS	256
+#endif
 
 /*
  * Default mount options
@@ -962,6 +1231,7 @@ static inline __le16 next3_rec_len_to_disk(unsigned len)
 #define DX_HASH_LEGACY_UNSIGNED	3
 #define DX_HASH_HALF_MD4_UNSIGNED	4
 #define DX_HASH_TEA_UNSIGNED		5
+#define DX_HASH_MURMUR		6
 
 #ifdef __KERNEL__
 
@@ -1010,6 +1280,10 @@ struct dir_private_info {
 	__u32		curr_hash;
 	__u32		curr_minor_hash;
 	__u32		next_hash;
+#ifdef CONFIG_NEXT3_FS_HTREE_FNAME_ARENA
+	struct next3_fname_chunk *fname_chunks;	/* arena of fname records */
+	unsigned int	fname_used;	/* bytes used in the first chunk */
+#endif
 };
 
 /* calculate the first block number of the group */
@@ -1020,6 +1294,35 @@ next3_group_first_block_no(struct super_block *sb, unsigned long group_no)
 		le32_to_cpu(NEXT3_SB(sb)->s_es->s_first_data_block);
 }
 
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+/*
+ * Flex statistics are kept for file systems with at least
+ * NEXT3_FLEX_MIN_GROUPS groups, in ranges of at least NEXT3_FLEX_MIN_SIZE
+ * groups, and large enough for at most NEXT3_FLEX_MAX_COUNT ranges.
+ */
+#define NEXT3_FLEX_MIN_GROUPS	1024
+#define NEXT3_FLEX_MIN_SIZE	16
+#define NEXT3_FLEX_MAX_COUNT	256
+
+static inline void next3_flex_stats_add(struct super_block *sb,
+		unsigned long group, int free_inodes, int free_blocks,
+		int used_dirs)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_flex_stats *fs;
+
+	if (!sbi->s_flex_stats)
+		return;
+	fs = &sbi->s_flex_stats[group >> sbi->s_log_groups_per_flex];
+	if (free_inodes)
+		atomic_add(free_inodes, &fs->free_inodes);
+	if (free_blocks)
+		atomic_add(free_blocks, &fs->free_blocks);
+	if (used_dirs)
+		atomic_add(used_dirs, &fs->used_dirs);
+}
+
+#endif
 /*
  * Special error return code only used by dx_probe() and its callers.
  */
@@ -1053,6 +1356,11 @@ extern void __next3_free_blocks_sb_inode(const char *where, handle_t *handle,
 					 next3_fsblk_t block,
 					 unsigned long count,
 					 unsigned long *pdquot_freed_blocks);
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+extern void next3_free_blocks_batch(handle_t *handle, struct inode *inode,
+				    next3_fsblk_t block, unsigned long count);
+extern void next3_free_batch_flush(handle_t *handle, struct inode *inode);
+#endif
 
 #define next3_free_blocks_sb(handle, sb, block, count, freed) \
 	__next3_free_blocks_sb_inode(__func__, handle, sb, NULL, block, \
@@ -1068,6 +1376,19 @@ extern void next3_free_blocks_sb (handle_t *handle, struct super_block *sb,
 #endif
 extern next3_fsblk_t next3_count_free_blocks (struct super_block *);
 extern void next3_check_blocks_bitmap (struct super_block *);
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+extern void next3_release_bitmap_pins(struct super_block *sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+extern next3_fsblk_t next3_stripe_align(struct super_block *sb,
+					next3_fsblk_t block);
+#endif
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+extern long next3_block_bitmap_group(struct super_block *sb,
+				     next3_fsblk_t block);
+extern unsigned long next3_block_bitmap_offset(struct super_block *sb,
+				next3_fsblk_t block, unsigned long count);
+#endif
 extern struct next3_group_desc * next3_get_group_desc(struct super_block * sb,
 						    unsigned int block_group,
 						    struct buffer_head ** bh);
@@ -1095,10 +1416,22 @@ extern int next3fs_dirhash(const char *name, int len, struct
 extern struct inode * next3_new_inode (handle_t *, struct inode *, int);
 extern void next3_free_inode (handle_t *, struct inode *);
 extern struct inode * next3_orphan_get (struct super_block *, unsigned long);
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+extern int __init init_next3_itable(void);
+extern void exit_next3_itable(void);
+extern void next3_itable_init(struct super_block *sb);
+extern void next3_itable_start(struct super_block *sb);
+extern void next3_itable_stop(struct super_block *sb);
+extern int next3_itable_free_inode(struct super_block *sb, unsigned long ino);
+#endif
 extern unsigned long next3_count_free_inodes (struct super_block *);
 extern unsigned long next3_count_dirs (struct super_block *);
 extern void next3_check_inodes_bitmap (struct super_block *);
 extern unsigned long next3_count_free (struct buffer_head *, unsigned);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_RANGE
+extern int next3_set_bits_range(char *bitmap, int bit, int count,
+				int *pfirst);
+#endif
 
 
 /* inode.c */
@@ -1114,9 +1447,25 @@ extern struct inode *next3_iget(struct super_block *, unsigned long);
 extern int  next3_write_inode (struct inode *, struct writeback_control *);
 extern int  next3_setattr (struct dentry *, struct iattr *);
 extern void next3_delete_inode (struct inode *);
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+extern int __init init_next3_async_unlink(void);
+extern void exit_next3_async_unlink(void);
+extern void next3_async_unlink_init(struct super_block *sb);
+extern void next3_async_unlink_flush(struct super_block *sb);
+extern void next3_async_unlink(struct inode *inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+extern int next3_async_orphan_add(struct list_head *list,
+				  struct inode *inode);
+extern void next3_async_orphans_queue(struct super_block *sb,
+				      struct list_head *list);
+#endif
 extern int  next3_sync_inode (handle_t *, struct inode *);
 extern void next3_discard_reservation (struct inode *);
 extern void next3_dirty_inode(struct inode *);
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+extern int next3_flush_lazy_time(struct inode *);
+#endif
 extern int next3_change_inode_journal_flag(struct inode *, int);
 extern int next3_get_inode_loc(struct inode *, struct next3_iloc *);
 extern int next3_can_truncate(struct inode *inode);
@@ -1126,6 +1475,17 @@ extern void next3_get_inode_flags(struct next3_inode_info *);
 extern void next3_set_aops(struct inode *inode);
 extern int next3_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		       u64 start, u64 len);
+#ifdef CONFIG_NEXT3_FS_DEFRAG
+extern int next3_defrag(struct file *filp, struct next3_defrag_range *range);
+#endif
+#ifdef CONFIG_NEXT3_FS_PAGE_MKWRITE
+extern int next3_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
+#endif
+#ifdef CONFIG_NEXT3_FS_BATCHED_WRITE
+extern size_t next3_write_batched(struct file *file, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos,
+				  size_t count);
+#endif
 
 /* ioctl.c */
 extern long next3_ioctl(struct file *, unsigned int, unsigned long);
@@ -1136,10 +1496,17 @@ extern int next3_orphan_add(handle_t *, struct inode *);
 extern int next3_orphan_del(handle_t *, struct inode *);
 extern int next3_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 				__u32 start_minor_hash, __u32 *next_hash);
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+extern void next3_dx_cache_free(struct inode *dir);
+#endif
 
 /* resize.c */
 extern int next3_group_add(struct super_block *sb,
 				struct next3_new_group_data *input);
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+extern int next3_group_add_batch(struct super_block *sb,
+				struct next3_new_group_data *input, int count);
+#endif
 extern int next3_group_extend(struct super_block *sb,
 				struct next3_super_block *es,
 				next3_fsblk_t n_blocks_count);
@@ -1155,6 +1522,10 @@ extern void next3_warning (struct super_block *, const char *, const char *, ...
 extern void next3_msg(struct super_block *, const char *, const char *, ...)
 	__attribute__ ((format (printf, 3, 4)));
 extern void next3_update_dynamic_rev (struct super_block *sb);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+extern int next3_freeze_lite(struct super_block *sb);
+extern void next3_unfreeze_lite(struct super_block *sb);
+#endif
 
 #define next3_std_error(sb, errno)				\
 do {								\
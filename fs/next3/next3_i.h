@@ -20,6 +20,7 @@
 #include <linux/rbtree.h>
 #include <linux/seqlock.h>
 #include <linux/mutex.h>
+#include <linux/jbd.h>
 
 /* data type for block offset of block group */
 typedef int next3_grpblk_t;
@@ -64,6 +65,86 @@ struct next3_block_alloc_info {
 #define rsv_start rsv_window._rsv_start
 #define rsv_end rsv_window._rsv_end
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+/*
+ * Block ranges freed by truncate, which are yet to be cleared from the
+ * block bitmaps.  A range never crosses a block group boundary.
+ * The batch is flushed before the truncate handle is extended or
+ * restarted, so the ranges are freed in the transaction that detached
+ * them from the file.
+ */
+#define NEXT3_FREE_BATCH_SIZE	32
+
+struct next3_free_range {
+	next3_fsblk_t	block;
+	unsigned long	count;
+};
+
+struct next3_free_batch {
+	int			nr;
+	struct next3_free_range	ranges[NEXT3_FREE_BATCH_SIZE];
+};
+
+/* block bitmap, group descriptor and exclude bitmap for every range */
+#define NEXT3_FREE_BATCH_CREDITS(batch)	(3 * (batch)->nr)
+
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+/*
+ * In-memory map of snapshot file block ranges.
+ * @gen is changed whenever the map is invalidated, so a lookup that raced
+ * with invalidate does not insert stale extents.
+ */
+struct next3_snapmap {
+	rwlock_t	lock;
+	struct rb_root	root;
+	unsigned int	count;		/* no. of extents in map */
+	unsigned int	gen;		/* map generation */
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+/*
+ * in-memory state of snapshot file, see NEXT3_SNAP_I()
+ */
+struct next3_snapshot_info {
+	/*
+	 * In-memory snapshot list overrides i_orphan to link snapshot inodes,
+	 * but unlike the real orphan list, the next snapshot inode number
+	 * is stored in i_next_snapshot_ino and not in i_dtime
+	 */
+	__u32	i_next_snapshot_ino;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	/* in-memory extent map of snapshot file mapped ranges */
+	struct next3_snapmap i_snapmap;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	/* resolved read through mappings to newer snapshots */
+	struct next3_snapmap i_snapread;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+	/*
+	 * per block group summary of snapshot mapped blocks (known and mapped
+	 * bitmaps of i_snapgroups_count bits each), protected by i_snapmap.lock
+	 */
+	unsigned long *i_snapgroups;
+	unsigned long i_snapgroups_count;
+	unsigned int i_snapgroups_gen;
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	/* snapshot space usage counters */
+	atomic_t i_snap_copied;
+	atomic_t i_snap_moved;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	/* snapshot file read counters (not stored on disk) */
+	atomic_long_t i_snap_read_bytes;
+	atomic_long_t i_snap_read_pages;
+#endif
+};
+
+#endif
 /*
  * third extended file system inode data in memory
  */
@@ -95,8 +176,16 @@ struct next3_inode_info {
 
 	/* block reservation info */
 	struct next3_block_alloc_info *i_block_alloc_info;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	/* pending block frees of truncate, protected by truncate_sem */
+	struct next3_free_batch *i_free_batch;
+#endif
 
 	__u32	i_dir_start_lookup;
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	/* in-memory htree index of large directory, protected by i_mutex */
+	struct next3_dx_cache *i_dx_cache;
+#endif
 #ifdef CONFIG_NEXT3_FS_XATTR
 	/*
 	 * Extended attributes can be read independently of the main file
@@ -106,19 +195,26 @@ struct next3_inode_info {
 	 * EAs.
 	 */
 	struct rw_semaphore xattr_sem;
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	/* index of xattr names, see xattr.c */
+	struct next3_xattr_names *i_xattr_names;
+#endif
 #endif
 
 	struct list_head i_orphan;	/* unlinked but open inodes */
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 #define i_snaplist i_orphan
-	/*
-	 * In-memory snapshot list overrides i_orphan to link snapshot inodes,
-	 * but unlike the real orphan list, the next snapshot inode number
-	 * is stored in i_next_snapshot_ino and not in i_dtime
-	 */
-	__u32	i_next_snapshot_ino;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	struct next3_snapshot_info *i_snapinfo;	/* NULL if not snapshot file */
+#else
+	struct next3_snapshot_info i_snapinfo;
+#endif
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	/* blocks moved by direct I/O write in progress (under i_mutex) */
+	struct next3_dio_move *i_dio_move;
 #endif
 	/*
 	 * i_disksize keeps track of what the inode size is ON DISK, not
@@ -141,16 +237,20 @@ struct next3_inode_info {
 	__u16 i_extra_isize;
 
 	/*
-	 * truncate_mutex is for serialising next3_truncate() against
+	 * truncate_sem is for serialising next3_truncate() against
 	 * next3_getblock().  In the 2.4 ext2 design, great chunks of inode's
 	 * data tree are chopped off during truncate. We can't do that in
 	 * next3 because whenever we perform intermediate commits during
 	 * truncate, the inode and all the metadata blocks *must* be in a
 	 * consistent state which allows truncation of the orphans to restart
 	 * during recovery.  Hence we must fix the get_block-vs-truncate race
-	 * by other means, so we have truncate_mutex.
+	 * by other means, so we have truncate_sem.
+	 *
+	 * Lookups walk the tree without it.  It is taken shared to re-read
+	 * a chain that changed under a lockless lookup, and exclusive to
+	 * allocate, move-on-write or free blocks.
 	 */
-	struct mutex truncate_mutex;
+	struct rw_semaphore truncate_sem;
 
 	/*
 	 * Transactions that contain inode's metadata needed to complete
@@ -158,6 +258,11 @@ struct next3_inode_info {
 	 */
 	atomic_t i_sync_tid;
 	atomic_t i_datasync_tid;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+
+	/* ordered data of the inode in data=ordered mode */
+	struct jbd_inode jinode;
+#endif
 
 	struct inode vfs_inode;
 };
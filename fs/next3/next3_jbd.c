@@ -45,6 +45,33 @@ int __next3_journal_get_write_access(const char *where, handle_t *handle,
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+int __next3_journal_get_write_access_blocks(const char *where,
+		handle_t *handle, struct inode *inode,
+		struct buffer_head **bhs, int count)
+{
+	struct buffer_head *bh = NULL;
+	int i, err = 0;
+
+	for (i = 0; i < count && !err; i++) {
+		bh = bhs[i];
+		err = journal_get_write_access(handle, bh);
+	}
+	if (!err) {
+		bh = NULL;
+		/* COW all buffers to active snapshot in one pass */
+		err = next3_snapshot_get_write_access_blocks(handle, inode,
+							     bhs, count);
+	}
+	if (err)
+		next3_journal_abort_handle(where, __func__, bh, handle, err);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+	next3_journal_trace(SNAP_DEBUG, where, handle, count);
+#endif
+	return err;
+}
+
+#endif
 int __next3_journal_forget(const char *where, handle_t *handle,
 				struct buffer_head *bh)
 {
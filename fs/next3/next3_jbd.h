@@ -103,17 +103,60 @@
  * use the following formula and override the default (-J size=):
  * journal-size = MIN(3G, fs-size/32)
  */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+/*
+ * with a shared pool of COW credits per transaction, a handle only keeps
+ * enough credits for its N user buffers plus a single COW operation and
+ * draws the credits for more COW operations from the pool on demand.
+ * the pool is refilled by handles that find it below the low watermark
+ * when they start.
+ */
+#define NEXT3_SNAPSHOT_TRANS_BLOCKS(n) \
+	((n)+NEXT3_COW_CREDITS+NEXT3_SNAPSHOT_CREDITS)
+#define NEXT3_SNAPSHOT_START_TRANS_BLOCKS(n) \
+	((n)+NEXT3_COW_CREDITS+2*NEXT3_SNAPSHOT_CREDITS)
+/* COW credits pool refill size and low watermark (64 and 16 COWs) */
+#define NEXT3_COW_POOL_CREDITS	(64*NEXT3_COW_CREDITS)
+#define NEXT3_COW_POOL_LOW	(16*NEXT3_COW_CREDITS)
+#else
 #define NEXT3_SNAPSHOT_TRANS_BLOCKS(n) \
 	((n)*(1+NEXT3_COW_CREDITS)+NEXT3_SNAPSHOT_CREDITS)
 #define NEXT3_SNAPSHOT_START_TRANS_BLOCKS(n) \
 	((n)*(1+NEXT3_COW_CREDITS)+2*NEXT3_SNAPSHOT_CREDITS)
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+/*
+ * COW credits are only reserved while the file system has an active
+ * snapshot.  The active snapshot is only changed under
+ * journal_lock_updates(), so it cannot change during the life of a handle
+ * and a handle that was started without an active snapshot never COWs.
+ */
+#define NEXT3_HANDLE_SB(handle) \
+	((struct super_block *)(handle)->h_transaction->t_journal->j_private)
+#define next3_handle_has_snapshot(handle) \
+	(NEXT3_SB(NEXT3_HANDLE_SB(handle))->s_active_snapshot != NULL)
+#define NEXT3_HANDLE_TRANS_BLOCKS(handle, n)				\
+	(next3_handle_has_snapshot(handle) ?				\
+	 NEXT3_SNAPSHOT_TRANS_BLOCKS(n) : (n))
+#define NEXT3_SB_START_TRANS_BLOCKS(sb, n)				\
+	(NEXT3_SB(sb)->s_active_snapshot ?				\
+	 NEXT3_SNAPSHOT_START_TRANS_BLOCKS(n) : (n))
 
+/*
+ * check for sufficient buffer and COW credits
+ */
+#define NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle, n)			\
+	((handle)->h_buffer_credits >= NEXT3_HANDLE_TRANS_BLOCKS(handle, n) && \
+	 ((next3_handle_t *)(handle))->h_user_credits >= (n))
+#else
 /*
  * check for sufficient buffer and COW credits
  */
 #define NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle, n)			\
 	((handle)->h_buffer_credits >= NEXT3_SNAPSHOT_TRANS_BLOCKS(n) && \
 	 ((next3_handle_t *)(handle))->h_user_credits >= (n))
+#endif
 
 #define NEXT3_RESERVE_COW_CREDITS	(NEXT3_COW_CREDITS +		\
 					 NEXT3_SNAPSHOT_CREDITS)
@@ -131,7 +174,12 @@
 
 #define NEXT3_RESERVE_TRANS_BLOCKS	12U
 
+#ifdef CONFIG_NEXT3_FS_DX_LARGEDIR
+/* splitting a leaf of a 3 level htree may add 2 index blocks */
+#define NEXT3_INDEX_EXTRA_TRANS_BLOCKS	12
+#else
 #define NEXT3_INDEX_EXTRA_TRANS_BLOCKS	8
+#endif
 
 #ifdef CONFIG_QUOTA
 /* Amount of blocks needed for quota update - we know that the structure was
@@ -215,6 +263,27 @@ typedef struct next3_handle_s		next3_handle_t;	/* Next3 COW handle */
 #define IS_COWING(handle) \
 	((next3_handle_t *)(handle))->h_cowing
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+/*
+ * macros for next3 to update per-CPU file system COW statistics.
+ * unlike the transaction COW statistics below, these are always enabled.
+ */
+#define snapshot_stats_add(sb, name, num)				\
+	this_cpu_add(NEXT3_SB(sb)->s_snapshot_stats->name, (num))
+#define snapshot_stats_inc(sb, name)	snapshot_stats_add(sb, name, 1)
+
+#define trace_cow_stats_add(handle, name, num)				\
+	do {								\
+		if (handle)						\
+			snapshot_stats_add((handle)->h_transaction->	\
+				t_journal->j_private, name, (num));	\
+	} while (0)
+#else
+#define snapshot_stats_add(sb, name, num)
+#define snapshot_stats_inc(sb, name)
+#define trace_cow_stats_add(handle, name, num)
+#endif
+
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
 /*
  * macros for next3 to update transaction COW statistics.
@@ -233,22 +302,28 @@ extern const u8 journal_handle_size;
 	do {							\
 		if (trace_cow_enabled())			\
 			((next3_handle_t *)(handle))->h_cow_##name += (num);	\
+		trace_cow_stats_add(handle, name, num);		\
 	} while (0)
 
 #define trace_cow_inc(handle, name)				\
 	do {							\
 		if (trace_cow_enabled())			\
 			((next3_handle_t *)(handle))->h_cow_##name++;	\
+		trace_cow_stats_add(handle, name, 1);		\
 	} while (0)
 
 #else
 #define trace_cow_enabled()	0
-#define trace_cow_add(handle, name, num)
-#define trace_cow_inc(handle, name)
+#define trace_cow_add(handle, name, num)	\
+	trace_cow_stats_add(handle, name, num)
+#define trace_cow_inc(handle, name)		\
+	trace_cow_stats_add(handle, name, 1)
 #endif
 #else
-#define trace_cow_add(handle, name, num)
-#define trace_cow_inc(handle, name)
+#define trace_cow_add(handle, name, num)	\
+	trace_cow_stats_add(handle, name, num)
+#define trace_cow_inc(handle, name)		\
+	trace_cow_stats_add(handle, name, 1)
 #endif
 
 #endif
@@ -303,6 +378,12 @@ int __next3_journal_get_write_access(const char *where, handle_t *handle,
 				struct buffer_head *bh);
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+int __next3_journal_get_write_access_blocks(const char *where,
+		handle_t *handle, struct inode *inode,
+		struct buffer_head **bhs, int count);
+#endif
+
 int __next3_journal_forget(const char *where, handle_t *handle,
 				struct buffer_head *bh);
 
@@ -327,6 +408,11 @@ int __next3_journal_dirty_metadata(const char *where,
 #define next3_journal_get_write_access(handle, bh) \
 	__next3_journal_get_write_access(__func__, (handle), (bh))
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+#define next3_journal_get_write_access_blocks(handle, inode, bhs, count) \
+	__next3_journal_get_write_access_blocks(__func__, (handle), (inode), \
+						(bhs), (count))
+#endif
 #define next3_journal_revoke(handle, blocknr, bh) \
 	__next3_journal_revoke(__func__, (handle), (blocknr), (bh))
 #define next3_journal_get_create_access(handle, bh) \
@@ -357,6 +443,20 @@ void __next3_journal_trace(int debug, const char *fn, const char *caller,
 #else
 #define next3_journal_trace(n, caller, handle, nblocks)
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+extern u8 journal_credits_enable;
+void __next3_journal_credits_account(const char *where,
+		next3_handle_t *handle);
+
+/* account credits usage of a handle on final journal_stop() */
+#define next3_journal_credits_account(where, handle)			\
+	do {								\
+		if (journal_credits_enable && (handle)->h_ref == 1 &&	\
+		    !IS_COWING(handle))					\
+			__next3_journal_credits_account((where),	\
+				(next3_handle_t *)(handle));		\
+	} while (0)
+#endif
 
 handle_t *__next3_journal_start(const char *where,
 		struct super_block *sb, int nblocks);
@@ -379,6 +479,12 @@ static inline handle_t *next3_journal_start(struct inode *inode, int nblocks)
 #endif
 
 int __next3_journal_stop(const char *where, handle_t *handle);
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+void next3_flush_dquots(handle_t *handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+int next3_flush_inodes(handle_t *handle);
+#endif
 
 #define next3_journal_stop(handle) \
 	__next3_journal_stop(__func__, (handle))
@@ -401,7 +507,12 @@ static inline handle_t *next3_journal_current_handle(void)
 static inline int __next3_journal_extend(const char *where,
 		next3_handle_t *handle, int nblocks)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	int lower = NEXT3_HANDLE_TRANS_BLOCKS(handle,
+					      handle->h_user_credits+nblocks);
+#else
 	int lower = NEXT3_SNAPSHOT_TRANS_BLOCKS(handle->h_user_credits+nblocks);
+#endif
 	int err = 0;
 	int missing = lower - handle->h_buffer_credits;
 	if (missing > 0)
@@ -426,8 +537,43 @@ static inline int __next3_journal_extend(const char *where,
 static inline int __next3_journal_restart(const char *where,
 		next3_handle_t *handle, int nblocks)
 {
-	int err = journal_restart((handle_t *)handle,
-				  NEXT3_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	struct super_block *sb = NEXT3_HANDLE_SB(handle);
+	int credits = NEXT3_SB_START_TRANS_BLOCKS(sb, nblocks);
+	int err;
+
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+	/* queued dquots belong to the transaction we are leaving */
+	if (handle->h_dquots_count)
+		next3_flush_dquots((handle_t *)handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	/* and so do the queued inode copies */
+	if (handle->h_inodes_dirty)
+		next3_flush_inodes((handle_t *)handle);
+#endif
+	err = journal_restart((handle_t *)handle, credits);
+
+	/* a snapshot may have been taken while we waited for the restart */
+	if (!err && credits < NEXT3_SB_START_TRANS_BLOCKS(sb, nblocks))
+		err = journal_restart((handle_t *)handle,
+				NEXT3_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#else
+	int err;
+
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+	/* queued dquots belong to the transaction we are leaving */
+	if (handle->h_dquots_count)
+		next3_flush_dquots((handle_t *)handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	/* and so do the queued inode copies */
+	if (handle->h_inodes_dirty)
+		next3_flush_inodes((handle_t *)handle);
+#endif
+	err = journal_restart((handle_t *)handle,
+			      NEXT3_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#endif
 	if (!err) {
 		handle->h_base_credits = nblocks;
 		handle->h_user_credits = nblocks;
@@ -453,6 +599,16 @@ static inline int __next3_journal_extend(const char *where,
 static inline int __next3_journal_restart(const char *where,
 		handle_t *handle, int nblocks)
 {
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+	/* queued dquots belong to the transaction we are leaving */
+	if (handle->h_dquots_count)
+		next3_flush_dquots(handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	/* and so do the queued inode copies */
+	if (handle->h_inodes_dirty)
+		next3_flush_inodes(handle);
+#endif
 	return journal_restart(handle, nblocks);
 }
 
@@ -530,4 +686,22 @@ static inline int next3_should_writeback_data(struct inode *inode)
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_NOBH
+/*
+ * With the nobh option, the data pages of a regular file don't keep
+ * buffers, unless the buffers are needed to order the data or to move
+ * blocks on write, which is only while the file system has snapshots.
+ */
+static inline int next3_nobh_data(struct inode *inode)
+{
+	if (!test_opt(inode->i_sb, NOBH))
+		return 0;
+	if (next3_should_writeback_data(inode))
+		return 1;
+	return next3_should_order_data(inode) &&
+		test_opt(inode->i_sb, ORDERED_INODE);
+}
+
+#endif
+
 #endif	/* _LINUX_NEXT3_JBD_H */
@@ -26,6 +26,24 @@
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 #include <linux/mutex.h>
 #endif
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE)
+#include <linux/workqueue.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+#include <linux/radix-tree.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+#include <linux/srcu.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+#include <linux/journal-head.h>
+#endif
 #endif
 #include <linux/rbtree.h>
 
@@ -41,12 +59,218 @@ struct next3_group_info {
 	 * initialize bg_exclude_bitmap on mount time.
 	 * bg_cow_bitmap is reset to zero on mount time and on every snapshot
 	 * take and initialized lazily on first block group write access.
-	 * bg_cow_bitmap is protected by sb_bgl_lock().
+	 * With BLOCK_BITMAP_MOUNT, the COW bitmaps that already exist in the
+	 * active snapshot are loaded to the cache on read-write mount time.
+	 * bg_cow_bitmap is protected by sb_snapshot_lock().
 	 */
 	unsigned long bg_exclude_bitmap;/* Exclude bitmap cache */
 	unsigned long bg_cow_bitmap;	/* COW bitmap cache */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	/*
+	 * The active snapshot has no COW bitmap of the block group, so the
+	 * block bitmap was not changed since take and the masked block
+	 * bitmap is the COW bitmap.  Set on snapshot take, or after looking
+	 * up the snapshot file, and cleared before creating the COW bitmap.
+	 * Protected by sb_snapshot_lock().
+	 */
+	int bg_cow_bitmap_live;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	/*
+	 * bg_exclude_bitmap is valid - set after reading the exclude bitmap
+	 * location from exclude inode on first access to the block group.
+	 */
+	int bg_exclude_loaded;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+	struct buffer_head *bg_cow_bh;	/* pinned COW bitmap buffer */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	/*
+	 * Copy of the block bitmap of the active snapshot image, as read
+	 * through to the block bitmap.  Dropped on snapshot take.
+	 * Protected by sb_bgl_lock().
+	 */
+	char *bg_fixed_bitmap;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+	/*
+	 * Last run of blocks [start, end) that was allocated in the block
+	 * group since the active snapshot was taken, so it is not in use by
+	 * the active snapshot.  Reset to empty on every snapshot take.
+	 * Protected by sb_bgl_lock().
+	 */
+	next3_grpblk_t bg_fresh_start;
+	next3_grpblk_t bg_fresh_end;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	/*
+	 * Pinned bitmap buffers of a recently used block group.
+	 * The buffers are protected by sb_bgl_lock().  A group with pinned
+	 * buffers is on the s_bitmap_pins list [ s_bitmap_pin_lock ].
+	 */
+	struct buffer_head *bg_block_bh;	/* pinned block bitmap */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	struct buffer_head *bg_exclude_bh;	/* pinned exclude bitmap */
+#endif
+	struct list_head bg_pin_list;
+	int bg_pin_ref;			/* accessed since last scan */
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BUDDY
+	/*
+	 * Buddy summary of allocatable free extents in the block group.
+	 * Generated from the block bitmap and its last committed copy and
+	 * invalidated on every block allocation and free in the group.
+	 * Protected by sb_bgl_lock().
+	 */
+	unsigned int bg_buddy_gen;	/* bumped on invalidate */
+	unsigned short bg_buddy_fragments; /* no. of free extents */
+	signed char bg_buddy_order;	/* largest free order or -1 */
+	unsigned char bg_buddy_valid;	/* summary is up to date */
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_RUN
+	/*
+	 * Upper bound of the largest free run in the block group.
+	 * Allocations keep it valid and frees raise it when needed, so it
+	 * is not invalidated with the rest of the buddy summary.
+	 */
+	unsigned short bg_free_run;	/* largest free run upper bound */
+	unsigned char bg_free_run_valid; /* bg_free_run is known */
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	/*
+	 * No free inodes below this inode bitmap bit, unless an inode was
+	 * freed while the hint was raised.  Protected by sb_bgl_lock().
+	 */
+	unsigned int bg_inode_hint;
+#endif
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+/*
+ * per-cpu preferred group for new non-directory inodes whose parent
+ * directory is in @parent_group, set after losing an inode bitmap race.
+ */
+struct next3_ialloc_hint {
+	int parent_group;
+	int group;
+	unsigned long expires;			/* jiffies */
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+/* max. no. of COWed snapshot buffers whose write is deferred and batched */
+#define NEXT3_SNAPSHOT_COW_WRITE_BATCH	64
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+/*
+ * per file system set of blocks, which were COWed (or don't need to be
+ * COWed) during transaction @tid.  see next3_snapshot_cow_set_test().
+ */
+#define NEXT3_COW_SET_BITS	6
+#define NEXT3_COW_SET_SIZE	(1 << NEXT3_COW_SET_BITS)
+
+struct next3_cow_set_entry {
+	next3_fsblk_t block;
+	tid_t tid;
 };
 
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+/*
+ * reservation windows are kept in NEXT3_RSV_TREES trees, each with its own
+ * lock.  block group @group windows are in tree (@group % NEXT3_RSV_TREES)
+ * and windows never cross a block group boundary.
+ */
+#define NEXT3_RSV_TREES_BITS	6
+#define NEXT3_RSV_TREES		(1 << NEXT3_RSV_TREES_BITS)
+
+struct next3_rsv_tree {
+	spinlock_t lock;
+	struct rb_root root;
+	/* dummy window at the start of the tree */
+	struct next3_reserve_window_node head;
+} ____cacheline_aligned_in_smp;
+
+#endif
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+/*
+ * in-memory totals of a range of 2^s_log_groups_per_flex block groups,
+ * updated along with the group descriptor counters.
+ */
+struct next3_flex_stats {
+	atomic_t free_inodes;
+	atomic_t free_blocks;
+	atomic_t used_dirs;
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+/*
+ * per-CPU snapshot statistics counters.
+ * field names match the h_cow_* fields of next3_handle_t, so the
+ * trace_cow_inc() macros can update both.
+ */
+struct next3_snapshot_stats {
+	unsigned long moved;		/* blocks moved to snapshot */
+	unsigned long copied;		/* blocks copied to snapshot */
+	unsigned long ok_jh;		/* COW cache hits */
+	unsigned long ok_bitmap;	/* blocks not set in COW bitmap */
+	unsigned long ok_mapped;	/* blocks already mapped in snapshot */
+	unsigned long bitmaps;		/* COW bitmaps created */
+	unsigned long excluded;		/* blocks set in exclude bitmap */
+	unsigned long bitmap_miss;	/* COW bitmap cache misses */
+	unsigned long pending_cow_wait;	/* waits for pending COW */
+	unsigned long tracked_read_wait;/* waits for tracked reads */
+	unsigned long read_bdev_cache;	/* read through from buffer cache */
+	unsigned long cow_set_hit;	/* COW set hits */
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+/*
+ * snapshot control operations and phases of snapshot take,
+ * which are timed in next3_snapshot_phase_stats.
+ */
+enum next3_snapshot_phase {
+	SNAPSHOT_PHASE_TAKE,		/* snapshot take total */
+	SNAPSHOT_PHASE_TAKE_FREEZE,	/* freeze fs and lock super */
+	SNAPSHOT_PHASE_TAKE_SUPER,	/* copy super block */
+	SNAPSHOT_PHASE_TAKE_GDT,	/* copy group descriptors */
+	SNAPSHOT_PHASE_TAKE_INODES,	/* copy snapshot inodes blocks */
+	SNAPSHOT_PHASE_TAKE_BITMAP,	/* reset COW bitmap cache */
+	SNAPSHOT_PHASE_TAKE_UNFREEZE,	/* unlock super and unfreeze fs */
+	SNAPSHOT_PHASE_REMOVE,		/* snapshot remove (delete) */
+	SNAPSHOT_PHASE_SHRINK,		/* deleted snapshots shrink */
+	SNAPSHOT_PHASE_MERGE,		/* deleted snapshots merge */
+	SNAPSHOT_PHASES_NUM
+};
+
+/* slot i counts phases that took [2^(i-1), 2^i) usec */
+#define SNAPSHOT_PHASE_SLOTS	24
+
+/*
+ * snapshot control timing statistics [ s_snapshot_mutex ]
+ */
+struct next3_snapshot_phase_stats {
+	unsigned long count;
+	u64 total_us;
+	u64 max_us;
+	unsigned long slots[SNAPSHOT_PHASE_SLOTS];
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+/*
+ * results of the last completed snapshot requests are kept by request no.
+ * (modulo NEXT3_SNAPSHOT_CTL_RESULTS), which is also the max. no. of queued
+ * requests, so the result of a request is kept until the next
+ * NEXT3_SNAPSHOT_CTL_RESULTS requests complete.
+ */
+#define NEXT3_SNAPSHOT_CTL_RESULTS	64
+
 #endif
 /*
  * third extended-fs super-block data in memory
@@ -85,12 +309,24 @@ struct next3_sb_info {
 	struct percpu_counter s_freeblocks_counter;
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	unsigned long s_dirs_count;	/* counted by next3_check_descriptors */
+#endif
 	struct blockgroup_lock *s_blockgroup_lock;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	/* hashed locks of snapshot COW/exclude bitmap caches */
+	struct blockgroup_lock *s_snapshot_bgl;
+#endif
 
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	/* reservation window trees, partitioned by block group */
+	struct next3_rsv_tree s_rsv_trees[NEXT3_RSV_TREES];
+#else
 	/* root of the per fs reservation window tree */
 	spinlock_t s_rsv_window_lock;
 	struct rb_root s_rsv_window_root;
 	struct next3_reserve_window_node s_rsv_window_head;
+#endif
 
 	/* Journaling */
 	struct inode * s_journal_inode;
@@ -99,14 +335,159 @@ struct next3_sb_info {
 	struct mutex s_orphan_lock;
 	struct mutex s_resize_lock;
 	unsigned long s_commit_interval;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	unsigned long s_min_commit_interval;
+	unsigned long s_max_commit_interval;	/* 0 - fixed interval */
+#endif
 	struct block_device *journal_bdev;
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 	struct next3_group_info *s_group_info;	/* [ sb_bgl_lock ] */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INTERLEAVE
+	struct page **s_group_info_pages;	/* interleaved pages */
+	unsigned int s_group_info_npages;	/* or 0 if not interleaved */
+#endif
 	struct mutex s_snapshot_mutex;		/* protects 2 fields below: */
 	struct inode *s_active_snapshot;	/* [ s_snapshot_mutex ] */
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	struct list_head s_snapshot_list;	/* [ s_snapshot_mutex ] */
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	struct srcu_struct s_snapshot_srcu;	/* snapshot read through */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+	struct radix_tree_root s_snapshot_index; /* [ s_snapshot_mutex ] */
+	unsigned int s_snapshot_count;		/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	struct inode *s_exclude_inode;		/* for lazy exclude bitmap */
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	atomic_t *s_tracked_readers;		/* hashed tracked readers */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_DIRECT_IO
+	spinlock_t s_snapshot_dio_lock;		/* protects list below: */
+	struct list_head s_snapshot_dio_reads;	/* snapshot direct I/O reads */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	spinlock_t s_cow_batch_lock;		/* protects batch below: */
+	int s_cow_batch_count;			/* no. of batched COW writes */
+	struct buffer_head *s_cow_batch[NEXT3_SNAPSHOT_COW_WRITE_BATCH];
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	atomic_t s_snapread_gen;		/* read through cache generation */
+#endif
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE) || \
+	defined(CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE)
+	struct super_block *s_sb;		/* back pointer for work */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	struct work_struct s_cow_bitmap_work;	/* COW bitmaps pre-init */
+	int s_cow_bitmap_stop;			/* stop COW bitmaps pre-init */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	struct delayed_work s_cleanup_work;	/* background shrink/merge */
+	int s_cleanup_stop;			/* stop background cleanup */
+	unsigned int s_cleanup_budget;		/* [ s_snapshot_mutex ] */
+	int s_cleanup_pending;			/* [ s_snapshot_mutex ] */
+	unsigned int s_cleanup_groups;		/* block groups per chunk */
+	unsigned int s_cleanup_delay_ms;	/* sleep between chunks */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+	unsigned int s_snapshot_enospc_reclaim;	/* delete snapshots on ENOSPC */
+	struct work_struct s_reclaim_work;	/* delete oldest snapshot */
+	wait_queue_head_t s_reclaim_wait;	/* writers waiting for reclaim */
+	unsigned int s_reclaim_gen;		/* no. of completed reclaims */
+	unsigned int s_reclaim_want;		/* reclaim no. requested */
+	int s_reclaim_result;			/* result of last reclaim */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	spinlock_t s_snapctl_lock;		/* protects s_snapctl_* */
+	struct list_head s_snapctl_list;	/* queued snapshot requests */
+	unsigned int s_snapctl_queued;		/* no. of queued requests */
+	struct work_struct s_snapctl_work;	/* run queued requests */
+	wait_queue_head_t s_snapctl_wait;	/* waiting for requests */
+	u64 s_snapctl_seq;			/* last queued request no. */
+	u64 s_snapctl_done;			/* last completed request no. */
+	int s_snapctl_result[NEXT3_SNAPSHOT_CTL_RESULTS]; /* by request no. */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	unsigned int s_snapshot_io_class;	/* maintenance I/O class */
+	unsigned int s_snapshot_io_level;	/* maintenance I/O level */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	unsigned int s_snapshot_read_io_class;	/* read through I/O class */
+	unsigned int s_snapshot_read_io_level;	/* read through I/O level */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	unsigned int s_snapshot_read_drop;	/* drop behind snapshot reads */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	atomic_t s_fixed_bitmaps;		/* no. of cached fixed bitmaps */
+	unsigned int s_fixed_bitmaps_gen;	/* bumped on cache drop */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+	int s_snapshot_rollback;		/* rolled back - stale state */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	struct delayed_work s_reserve_work;	/* re-evaluate reserve */
+	int s_reserve_stop;			/* stop reserve work */
+	unsigned int s_snapshot_reserve_adaptive; /* adaptive reserve mode */
+	unsigned int s_snapshot_reserve_hours;	/* adaptive reserve horizon */
+	unsigned int s_snapshot_reserve_interval; /* re-evaluate (seconds) */
+	unsigned int s_snapshot_cow_rate;	/* [ s_snapshot_mutex ] */
+	unsigned long s_snapshot_active_since;	/* [ s_snapshot_mutex ] */
+	unsigned long s_snapshot_active_base;	/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	spinlock_t s_cow_set_lock;
+	struct next3_cow_set_entry s_cow_set[NEXT3_COW_SET_SIZE];
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	unsigned int s_async_unlink_blocks;	/* 0 - unlink synchronously */
+	spinlock_t s_async_unlink_lock;
+	struct list_head s_async_unlink_list;	/* inodes to free */
+	struct work_struct s_async_unlink_work;
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	struct mutex s_itable_mutex;		/* zeroing vs. inode bitmaps */
+	struct work_struct s_itable_work;	/* zero uninit inode tables */
+	unsigned long s_itable_group;		/* next group to zero */
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	unsigned int s_dx_cache_blocks;		/* 0 - no htree index cache */
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	unsigned int s_bitmap_pin_groups;	/* 0 - don't pin bitmaps */
+	spinlock_t s_bitmap_pin_lock;
+	struct list_head s_bitmap_pins;		/* [ s_bitmap_pin_lock ] */
+	unsigned int s_bitmap_pinned;		/* [ s_bitmap_pin_lock ] */
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	unsigned long s_stripe;			/* RAID stripe, 0 - not aligned */
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	unsigned int s_inode_readahead_blks;	/* power of 2, 0 - none */
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	struct next3_ialloc_hint __percpu *s_ialloc_hints;
+#endif
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	struct next3_flex_stats *s_flex_stats;	/* NULL - few groups */
+	unsigned int s_log_groups_per_flex;
+#endif
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	struct next3_xattr_share *s_xattr_share; /* shareable xattr blocks */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	struct next3_snapshot_stats __percpu *s_snapshot_stats;
+	struct kobject s_kobj;			/* /sys/fs/next3/<dev> */
+	struct completion s_kobj_unregister;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	struct next3_snapshot_phase_stats s_snapshot_phase[SNAPSHOT_PHASES_NUM];
 #endif
 #ifdef CONFIG_JBD_DEBUG
 	struct timer_list turn_ro_timer;	/* For turning read-only (crash simulation) */
@@ -124,4 +505,19 @@ sb_bgl_lock(struct next3_sb_info *sbi, unsigned int block_group)
 	return bgl_lock_ptr(sbi->s_blockgroup_lock, block_group);
 }
 
+/*
+ * Lock of the snapshot COW bitmap cache and the exclude bitmap bits of a
+ * block group, separate from the allocator's sb_bgl_lock(), so snapshot
+ * lookups and block allocations in the same group don't contend.
+ */
+static inline spinlock_t *
+sb_snapshot_lock(struct next3_sb_info *sbi, unsigned int block_group)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	return bgl_lock_ptr(sbi->s_snapshot_bgl, block_group);
+#else
+	return sb_bgl_lock(sbi, block_group);
+#endif
+}
+
 #endif	/* _LINUX_NEXT3_SB */
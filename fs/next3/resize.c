@@ -19,6 +19,9 @@
 
 #include <linux/errno.h>
 #include <linux/slab.h>
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+#include <linux/blkdev.h>
+#endif
 
 
 #define outside(b, first, last)	((b) < (first) || (b) >= (last))
@@ -219,8 +222,97 @@ static int extend_or_restart_transaction(handle_t *handle, int thresh,
  * ensure the recovery is correct in case of a failure just after resize.
  * If any part of this fails, we simply abort the resize.
  */
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+#ifndef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+/*
+ * Zero the inode tables of @count new groups with plain block device
+ * writes, which are all submitted before waiting for any of them, so the
+ * device sees one long stream of writes instead of one group at a time.
+ * The blocks are outside of the filesystem, so they need not be journaled,
+ * and the writes complete before the groups are added by later transactions.
+ * Cached copies of the blocks are zeroed as well.
+ *
+ * Groups whose inode table was zeroed are set in @zeroed.  A group is not
+ * zeroed if its input does not describe blocks beyond the end of the
+ * filesystem (it is rejected later by verify_group_input()), or if its
+ * blocks are in use by the active snapshot and must be COWed.  If any
+ * write fails, no group is set and all inode tables fall back to being
+ * cleared in the journal.
+ */
+static void zeroout_new_groups(struct super_block *sb,
+			       struct next3_new_group_data *input, int count,
+			       unsigned long *zeroed)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	next3_fsblk_t fs_end = le32_to_cpu(sbi->s_es->s_blocks_count);
+	int itblocks = sbi->s_itb_per_group;
+	int shift = sb->s_blocksize_bits - 9;
+	struct blk_zeroout_batch zb;
+	struct buffer_head *bh;
+	next3_fsblk_t start, block, end;
+	int i, err = 0;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
+	if (NEXT3_HAS_COMPAT_FEATURE(sb,
+		NEXT3_FEATURE_COMPAT_EXCLUDE_INODE))
+		/* clear reserved exclude bitmap block */
+		itblocks++;
+#endif
+	bitmap_zero(zeroed, count);
+	blk_zeroout_batch_init(&zb);
+	for (i = 0; i < count && !err; i++) {
+		if (input[i].group != sbi->s_groups_count + i)
+			break;
+		start = next3_group_first_block_no(sb, input[i].group);
+		block = input[i].inode_table;
+		end = block + itblocks;
+		if (start < fs_end || block < start ||
+		    end > start + NEXT3_BLOCKS_PER_GROUP(sb))
+			break;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT
+		/* blocks in use by the active snapshot must be COWed */
+		if (next3_snapshot_has_active(sb) &&
+		    block < SNAPSHOT_BLOCKS(next3_snapshot_has_active(sb)))
+			continue;
+#endif
+		err = blkdev_issue_zeroout_async(sb->s_bdev,
+					(sector_t)block << shift,
+					(sector_t)itblocks << shift,
+					GFP_NOFS, &zb);
+		set_bit(i, zeroed);
+	}
+	if (blk_zeroout_batch_wait(&zb) || err) {
+		bitmap_zero(zeroed, count);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!test_bit(i, zeroed))
+			continue;
+		block = input[i].inode_table;
+		for (end = block + itblocks; block < end; block++) {
+			bh = sb_find_get_block(sb, block);
+			if (!bh)
+				continue;
+			lock_buffer(bh);
+			memset(bh->b_data, 0, bh->b_size);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			brelse(bh);
+		}
+	}
+}
+
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+static int setup_new_group_blocks(struct super_block *sb,
+				  struct next3_new_group_data *input,
+				  int zeroed)
+#else
 static int setup_new_group_blocks(struct super_block *sb,
 				  struct next3_new_group_data *input)
+#endif
 {
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	next3_fsblk_t start = next3_group_first_block_no(sb, input->group);
@@ -235,6 +327,14 @@ static int setup_new_group_blocks(struct super_block *sb,
 	int i;
 	int err = 0, err2;
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
+	if (NEXT3_HAS_COMPAT_FEATURE(sb,
+		NEXT3_FEATURE_COMPAT_EXCLUDE_INODE))
+		/* clear reserved exclude bitmap block */
+		itend++;
+#endif
+#endif
 	/* This transaction may be extended/restarted along the way */
 	handle = next3_journal_start_sb(sb, NEXT3_MAX_TRANS_DATA);
 
@@ -312,18 +412,35 @@ static int setup_new_group_blocks(struct super_block *sb,
 		   input->inode_bitmap - start);
 	next3_set_bit(input->inode_bitmap - start, bh->b_data);
 
+#ifndef CONFIG_NEXT3_FS_RESIZE_BATCH
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
 	if (NEXT3_HAS_COMPAT_FEATURE(sb,
 		NEXT3_FEATURE_COMPAT_EXCLUDE_INODE))
 		/* clear reserved exclude bitmap block */
 		itend++;
 
+#endif
 #endif
 	/* Zero out all of the inode table blocks */
 	for (block = input->inode_table, bit = block - start;
 	     block < itend; bit++, block++) {
 		struct buffer_head *it;
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+		if (zeroed) {
+			/* already zeroed outside of the journal */
+			next3_set_bit(bit, bh->b_data);
+			continue;
+		}
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+		if (block < input->inode_table + sbi->s_itb_per_group) {
+			/* zeroed later by the itable work */
+			next3_set_bit(bit, bh->b_data);
+			continue;
+		}
+#endif
+
 		next3_debug("clear inode block %#04lx (+%d)\n", block, bit);
 
 		err = extend_or_restart_transaction(handle, 1, bh);
@@ -731,6 +848,9 @@ static void update_backups(struct super_block *sb,
 
 	while ((group = next3_list_backups(sb, &three, &five, &seven)) < last) {
 		struct buffer_head *bh;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW
+		struct inode *active_snapshot;
+#endif
 
 		/* Out of journal space, and can't get more - abort - so sad */
 		int buffer_credits = handle->h_buffer_credits;
@@ -748,11 +868,15 @@ static void update_backups(struct super_block *sb,
 			break;
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW
-		if (next3_snapshot_has_active(sb))
+		active_snapshot = next3_snapshot_has_active(sb);
+		if (active_snapshot && group * bpg + blk_off <
+				SNAPSHOT_BLOCKS(active_snapshot))
 			/*
 			 * test_and_cow() expects an uptodate buffer.
 			 * Read the buffer here to suppress the
 			 * "non uptodate buffer" warning.
+			 * Backups in groups added after snapshot take are
+			 * not in use by the snapshot and are not read.
 			 */
 			bh = sb_bread(sb, group * bpg + blk_off);
 		else
@@ -812,7 +936,13 @@ exit_err:
  * not really "added" the group at all.  We re-check that we are still
  * adding in the last group in case things have changed since verifying.
  */
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+static int __next3_group_add(struct super_block *sb,
+			     struct next3_new_group_data *input, int batch,
+			     int zeroed)
+#else
 int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
+#endif
 {
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	struct next3_super_block *es = sbi->s_es;
@@ -880,7 +1010,16 @@ int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
 	if (NEXT3_HAS_COMPAT_FEATURE(sb,
 		NEXT3_FEATURE_COMPAT_EXCLUDE_INODE)) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+		/* reuse the exclude inode reference kept since mount */
+		exclude_inode = NULL;
+		if (sbi->s_exclude_inode)
+			exclude_inode = igrab(sbi->s_exclude_inode);
+		if (!exclude_inode)
+			exclude_inode = next3_iget(sb, NEXT3_EXCLUDE_INO);
+#else
 		exclude_inode = next3_iget(sb, NEXT3_EXCLUDE_INO);
+#endif
 		if (IS_ERR(exclude_inode)) {
 			next3_warning(sb, __func__,
 				     "Error opening exclude inode");
@@ -904,8 +1043,13 @@ int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
 	if ((err = verify_group_input(sb, input)))
 		goto exit_put;
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+	if ((err = setup_new_group_blocks(sb, input, zeroed)))
+		goto exit_put;
+#else
 	if ((err = setup_new_group_blocks(sb, input)))
 		goto exit_put;
+#endif
 
 	/*
 	 * We will always be modifying at least the superblock and a GDT
@@ -989,6 +1133,10 @@ int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
 	gdp->bg_inode_table = cpu_to_le32(input->inode_table);
 	gdp->bg_free_blocks_count = cpu_to_le16(input->free_blocks_count);
 	gdp->bg_free_inodes_count = cpu_to_le16(NEXT3_INODES_PER_GROUP(sb));
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	gdp->bg_flags = cpu_to_le16(NEXT3_BG_ITABLE_UNINIT);
+	NEXT3_SET_RO_COMPAT_FEATURE(sb, NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT);
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
 	if (!exclude_inode)
@@ -1028,13 +1176,29 @@ int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
 		 */
 		i_size = SNAPSHOT_IBLOCK(input->group)
 				 << SNAPSHOT_BLOCK_SIZE_BITS;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+		/*
+		 * The size set on mount already covers all the groups resize
+		 * can add.  Shrinking it would make the next mount walk the
+		 * exclude inode of all reserved groups again.
+		 */
+		if (i_size > NEXT3_I(exclude_inode)->i_disksize) {
+			i_size_write(exclude_inode, i_size);
+			NEXT3_I(exclude_inode)->i_disksize = i_size;
+		}
+#else
 		i_size_write(exclude_inode, i_size);
 		NEXT3_I(exclude_inode)->i_disksize = i_size;
+#endif
 		exclude_inode->i_blocks += sb->s_blocksize >> 9;
 		next3_mark_iloc_dirty(handle, exclude_inode, &iloc);
 	}
 	/* update exclude bitmap cache */
 	gi->bg_exclude_bitmap = le32_to_cpu(exclude_bitmap);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	smp_wmb();
+	gi->bg_exclude_loaded = 1;
+#endif
 no_exclude_inode:
 #endif
 	/*
@@ -1049,6 +1213,11 @@ no_exclude_inode:
 	 */
 	le32_add_cpu(&es->s_blocks_count, input->blocks_count);
 	le32_add_cpu(&es->s_inodes_count, NEXT3_INODES_PER_GROUP(sb));
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	/* the flex stats array is sized for all groups resize can add */
+	next3_flex_stats_add(sb, input->group, NEXT3_INODES_PER_GROUP(sb),
+			     input->free_blocks_count, 0);
+#endif
 
 	/*
 	 * We need to protect s_groups_count against other CPUs seeing
@@ -1095,7 +1264,16 @@ exit_journal:
 	mutex_unlock(&sbi->s_resize_lock);
 	if ((err2 = next3_journal_stop(handle)) && !err)
 		err = err2;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	if (!err)
+		next3_itable_start(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+	/* backups are updated once for the whole batch */
+	if (!err && !batch) {
+#else
 	if (!err) {
+#endif
 		update_backups(sb, sbi->s_sbh->b_blocknr, (char *)es,
 			       sizeof(struct next3_super_block));
 		update_backups(sb, primary->b_blocknr, primary->b_data,
@@ -1128,6 +1306,64 @@ exit_put:
 	return err;
 } /* next3_group_add */
 
+#ifdef CONFIG_NEXT3_FS_RESIZE_BATCH
+int next3_group_add(struct super_block *sb, struct next3_new_group_data *input)
+{
+	return __next3_group_add(sb, input, 0, 0);
+}
+
+/*
+ * Add @count groups, in the order given.  This is next3_group_add() of
+ * every group, except that the inode tables are zeroed outside of the
+ * journal by one batch of writes, and the backup superblocks and the backups of the group
+ * descriptor blocks of the added groups are updated once at the end.
+ * On error, the backups are still updated for the groups already added.
+ */
+int next3_group_add_batch(struct super_block *sb,
+			  struct next3_new_group_data *input, int count)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	unsigned long gdb, first_gdb, last_gdb;
+	struct buffer_head *primary;
+	DECLARE_BITMAP(zeroed, NEXT3_GROUP_ADD_BATCH_MAX);
+	int added, err = 0;
+
+	if (count > NEXT3_GROUP_ADD_BATCH_MAX)
+		return -EINVAL;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	/* the inode tables are zeroed later by the itable work */
+	bitmap_zero(zeroed, count);
+#else
+	zeroout_new_groups(sb, input, count, zeroed);
+#endif
+	for (added = 0; added < count; added++) {
+		err = __next3_group_add(sb, input + added, 1,
+					test_bit(added, zeroed));
+		if (err)
+			break;
+		cond_resched();
+	}
+	if (!added)
+		return err;
+
+	update_backups(sb, sbi->s_sbh->b_blocknr, (char *)sbi->s_es,
+		       sizeof(struct next3_super_block));
+	first_gdb = input[0].group / NEXT3_DESC_PER_BLOCK(sb);
+	last_gdb = input[added - 1].group / NEXT3_DESC_PER_BLOCK(sb);
+	for (gdb = first_gdb; gdb <= last_gdb; gdb++) {
+		/* s_group_desc may be reallocated by add_new_gdb() */
+		mutex_lock(&sbi->s_resize_lock);
+		primary = sbi->s_group_desc[gdb];
+		get_bh(primary);
+		mutex_unlock(&sbi->s_resize_lock);
+		update_backups(sb, primary->b_blocknr, primary->b_data,
+			       primary->b_size);
+		brelse(primary);
+	}
+	return err;
+}
+#endif
+
 /* Extend the filesystem to the new number of blocks specified.  This entry
  * point is only used to extend the current filesystem to the end of the last
  * existing group.  It can be accessed via ioctl, or by "remount,resize=<size>"
@@ -15,12 +15,449 @@
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE
 #include <linux/quotaops.h>
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_BITMAP
+#include <linux/hash.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+#include <linux/backing-dev.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TASK_IO
+#include <linux/task_io_accounting_ops.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+#include <linux/sort.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_READ
+#include <linux/bio.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_DIRTY
+#include <linux/bit_spinlock.h>
+#endif
 #include "snapshot.h"
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK
 #define snapshot_debug_hl(n, f, a...)	snapshot_debug_l(n, handle ? 	\
 						 IS_COWING(handle) : 0, f, ## a)
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+/*
+ * In-memory extent map of snapshot file mapped ranges.
+ * It only caches the lookups of the indirect on-disk mapping.
+ * Snapshot blocks, once mapped, are only unmapped by shrink, merge and
+ * truncate of the snapshot file, which call next3_snapshot_map_invalidate().
+ * Holes are never cached, so a block allocated by COW after a lookup miss
+ * cannot be shadowed by a stale map entry.
+ */
+struct next3_snapmap_extent {
+	struct rb_node		node;
+	next3_snapblk_t		block;	/* first logical snapshot block */
+	next3_fsblk_t		mapped;	/* first physical block */
+	unsigned int		len;	/* no. of blocks in extent */
+	__u32			owner;	/* snapshot that maps the blocks */
+};
+
+/* map is reset when it grows over this many extents */
+#define NEXT3_SNAPMAP_MAX_EXTENTS	4096
+
+/*
+ * next3_snapmap_lookup() - look for @block in snapshot extent map
+ * Returns the no. of mapped blocks (up to @maxblocks) starting at @block
+ * and stores the physical block in @mapped and the owner snapshot in
+ * @owner, or returns 0 if @block is not cached.
+ * The map generation is returned in @gen for next3_snapmap_insert().
+ */
+static int next3_snapmap_lookup(struct next3_snapmap *map,
+		next3_snapblk_t block, unsigned long maxblocks,
+		next3_fsblk_t *mapped, __u32 *owner, unsigned int *gen)
+{
+	struct rb_node *n;
+	struct next3_snapmap_extent *ex;
+	int ret = 0;
+
+	read_lock(&map->lock);
+	*gen = map->gen;
+	n = map->root.rb_node;
+	while (n) {
+		ex = rb_entry(n, struct next3_snapmap_extent, node);
+		if (block < ex->block) {
+			n = n->rb_left;
+		} else if (block >= ex->block + ex->len) {
+			n = n->rb_right;
+		} else {
+			ret = ex->block + ex->len - block;
+			if (ret > maxblocks)
+				ret = maxblocks;
+			if (mapped)
+				*mapped = ex->mapped + (block - ex->block);
+			if (owner)
+				*owner = ex->owner;
+			break;
+		}
+	}
+	read_unlock(&map->lock);
+	return ret;
+}
+
+static void next3_snapmap_free(struct rb_root *root)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(root))) {
+		rb_erase(n, root);
+		kfree(rb_entry(n, struct next3_snapmap_extent, node));
+	}
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+/*
+ * next3_snapmap_reset() - drop all extents and set map generation to @gen
+ */
+static void next3_snapmap_reset(struct next3_snapmap *map, unsigned int gen)
+{
+	struct rb_root old;
+
+	write_lock(&map->lock);
+	map->gen = gen;
+	old = map->root;
+	map->root = RB_ROOT;
+	map->count = 0;
+	write_unlock(&map->lock);
+	next3_snapmap_free(&old);
+}
+
+#endif
+/*
+ * next3_snapmap_insert() - cache @len blocks mapped at @block
+ * @gen:	map generation sampled before the mapping was looked up.
+ *		If the map was reset since, the mapping is not cached.
+ * The new extent is merged with adjacent contiguous extents.
+ * Cache insert failures are ignored.
+ */
+static void next3_snapmap_insert(struct next3_snapmap *map,
+		next3_snapblk_t block, next3_fsblk_t mapped, unsigned int len,
+		__u32 owner, unsigned int gen)
+{
+	struct rb_node **p, *parent = NULL, *n;
+	struct next3_snapmap_extent *ex, *new;
+	struct rb_root old = RB_ROOT;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return;
+	new->block = block;
+	new->mapped = mapped;
+	new->len = len;
+	new->owner = owner;
+
+	write_lock(&map->lock);
+	if (map->gen != gen)
+		goto out_free;
+	if (map->count >= NEXT3_SNAPMAP_MAX_EXTENTS) {
+		/* reset the map and free it outside the lock */
+		old = map->root;
+		map->root = RB_ROOT;
+		map->count = 0;
+	}
+
+	p = &map->root.rb_node;
+	while (*p) {
+		parent = *p;
+		ex = rb_entry(parent, struct next3_snapmap_extent, node);
+		if (block + len <= ex->block)
+			p = &(*p)->rb_left;
+		else if (block >= ex->block + ex->len)
+			p = &(*p)->rb_right;
+		else
+			/* overlaps a cached extent - already cached */
+			goto out_free;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &map->root);
+	map->count++;
+
+	/* merge with contiguous previous extent */
+	n = rb_prev(&new->node);
+	if (n) {
+		ex = rb_entry(n, struct next3_snapmap_extent, node);
+		if (ex->owner == new->owner &&
+		    ex->block + ex->len == new->block &&
+		    ex->mapped + ex->len == new->mapped) {
+			ex->len += new->len;
+			rb_erase(&new->node, &map->root);
+			map->count--;
+			kfree(new);
+			new = ex;
+		}
+	}
+	/* merge with contiguous next extent */
+	n = rb_next(&new->node);
+	if (n) {
+		ex = rb_entry(n, struct next3_snapmap_extent, node);
+		if (ex->owner == new->owner &&
+		    new->block + new->len == ex->block &&
+		    new->mapped + new->len == ex->mapped) {
+			new->len += ex->len;
+			rb_erase(&ex->node, &map->root);
+			map->count--;
+			kfree(ex);
+		}
+	}
+	new = NULL;
+out_free:
+	write_unlock(&map->lock);
+	kfree(new);
+	next3_snapmap_free(&old);
+}
+
+/*
+ * next3_snapshot_map_invalidate() - drop all cached extents of @inode
+ * Called before and after snapshot blocks are unmapped and on inode clear.
+ * Also invalidates the read through caches of all snapshots.
+ */
+void next3_snapshot_map_invalidate(struct inode *inode)
+{
+	struct next3_snapshot_info *si = NEXT3_SNAP_I(inode);
+	struct next3_snapmap *map;
+	struct rb_root old;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	if (!si)
+		/* not a snapshot file */
+		return;
+#endif
+	map = &si->i_snapmap;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	/* read through mappings of all snapshots may be affected */
+	atomic_inc(&NEXT3_SB(inode->i_sb)->s_snapread_gen);
+#endif
+	write_lock(&map->lock);
+	map->gen++;
+	old = map->root;
+	map->root = RB_ROOT;
+	map->count = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+	/* forget the block groups summary */
+	si->i_snapgroups_gen++;
+	if (si->i_snapgroups)
+		bitmap_zero(si->i_snapgroups, si->i_snapgroups_count);
+#endif
+	write_unlock(&map->lock);
+	next3_snapmap_free(&old);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	next3_snapmap_reset(&si->i_snapread,
+			atomic_read(&NEXT3_SB(inode->i_sb)->s_snapread_gen));
+#endif
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+/*
+ * next3_snapshot_read_cache_lookup() - look for a resolved read through
+ * mapping of @iblock in snapshot @inode.
+ * Entries are valid as long as the super block read through generation has
+ * not changed.  The sampled generation is returned in @gen for
+ * next3_snapshot_read_cache_insert().
+ */
+int next3_snapshot_read_cache_lookup(struct inode *inode, sector_t iblock,
+		next3_fsblk_t *mapped, unsigned int *gen)
+{
+	struct next3_snapmap *map = &NEXT3_SNAP_I(inode)->i_snapread;
+	unsigned int sbgen = atomic_read(&NEXT3_SB(inode->i_sb)->s_snapread_gen);
+	unsigned int mapgen;
+	__u32 owner = 0;
+	int ret;
+
+	*gen = sbgen;
+	ret = next3_snapmap_lookup(map, iblock, 1, mapped, &owner, &mapgen);
+	if (mapgen != sbgen) {
+		/* map is out of date */
+		next3_snapmap_reset(map, sbgen);
+		return 0;
+	}
+	if (ret > 0)
+		snapshot_debug(4, "snapshot (%u) read through cache hit "
+			       "block=%lld -> snapshot (%u) block=%lld\n",
+			       inode->i_generation, (long long)iblock,
+			       owner, (long long)*mapped);
+	return ret;
+}
+
+/*
+ * next3_snapshot_read_cache_insert() - cache the resolved read through
+ * mapping of @iblock in snapshot @inode to block @mapped of snapshot @owner.
+ */
+void next3_snapshot_read_cache_insert(struct inode *inode, sector_t iblock,
+		next3_fsblk_t mapped, struct inode *owner, unsigned int gen)
+{
+	next3_snapmap_insert(&NEXT3_SNAP_I(inode)->i_snapread, iblock, mapped, 1,
+			     owner->i_generation, gen);
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+/*
+ * next3_snapshot_group_mapped() - test if snapshot maps blocks in group
+ * The summary of non-active snapshots is built on demand, one block group
+ * at a time, by walking the snapshot file map of the group.  Non-active
+ * snapshots are not COWed to, so the summary is valid until the snapshot
+ * blocks are shrunk, merged or truncated.
+ * Returns 0 if @inode maps no blocks in @group and 1 if it does (or if it
+ * may map blocks in @group).
+ */
+static int next3_snapshot_group_mapped(struct inode *inode,
+		unsigned long group)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	struct next3_snapshot_info *si = NEXT3_SNAP_I(inode);
+	struct next3_snapmap *map = &si->i_snapmap;
+	unsigned long ngroups, *groups;
+	next3_fsblk_t block, end;
+	unsigned int gen;
+	int err, mapped = 0, known;
+
+	if (next3_snapshot_is_active(inode) ||
+			(ei->i_flags & NEXT3_SNAPFILE_ACTIVE_FL))
+		/* active snapshot may be COWed to at any time */
+		return 1;
+
+	end = le32_to_cpu(NEXT3_SB(inode->i_sb)->s_es->s_blocks_count);
+	ngroups = SNAPSHOT_BLOCK_GROUP(end + SNAPSHOT_BLOCKS_PER_GROUP - 1);
+	if (!si->i_snapgroups) {
+		/* known bitmap followed by mapped bitmap */
+		groups = kzalloc(2 * BITS_TO_LONGS(ngroups) * sizeof(long),
+				 GFP_NOFS);
+		if (!groups)
+			return 1;
+		write_lock(&map->lock);
+		if (!si->i_snapgroups) {
+			si->i_snapgroups = groups;
+			si->i_snapgroups_count = ngroups;
+			groups = NULL;
+		}
+		write_unlock(&map->lock);
+		kfree(groups);
+	}
+	if (group >= si->i_snapgroups_count)
+		/* file system was resized */
+		return 1;
+
+	groups = si->i_snapgroups;
+	read_lock(&map->lock);
+	known = test_bit(group, groups);
+	mapped = test_bit(group, groups + BITS_TO_LONGS(si->i_snapgroups_count));
+	gen = si->i_snapgroups_gen;
+	read_unlock(&map->lock);
+	if (known)
+		return mapped;
+
+	/* walk the snapshot map of the group until a mapped block is found */
+	block = (next3_fsblk_t)group << SNAPSHOT_BLOCKS_PER_GROUP_BITS;
+	if (end > block + SNAPSHOT_BLOCKS_PER_GROUP)
+		end = block + SNAPSHOT_BLOCKS_PER_GROUP;
+	while (block < end) {
+		err = next3_snapshot_shrink_blocks(NULL, inode,
+				SNAPSHOT_IBLOCK(block), end - block,
+				NULL, 0, &mapped);
+		if (err <= 0)
+			return 1;
+		if (mapped)
+			break;
+		block += err;
+	}
+
+	write_lock(&map->lock);
+	if (si->i_snapgroups_gen == gen) {
+		if (mapped)
+			__set_bit(group, groups +
+				  BITS_TO_LONGS(si->i_snapgroups_count));
+		__set_bit(group, groups);
+	}
+	write_unlock(&map->lock);
+	snapshot_debug(4, "snapshot (%u) group (%lu) summary: mapped=%d\n",
+		       inode->i_generation, group, mapped ? 1 : 0);
+	return mapped ? 1 : 0;
+}
+
+/*
+ * next3_snapshot_read_skip() - skip snapshots on read through
+ * Returns the first snapshot, starting at @inode and towards the active
+ * snapshot, that may map @block.
+ */
+struct inode *next3_snapshot_read_skip(struct inode *inode,
+		next3_fsblk_t block)
+{
+	struct list_head *l, *list = &NEXT3_SB(inode->i_sb)->s_snapshot_list;
+	unsigned long group = SNAPSHOT_BLOCK_GROUP(block);
+
+	while (!next3_snapshot_group_mapped(inode, group)) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+		l = rcu_dereference(NEXT3_I(inode)->i_snaplist.prev);
+#else
+		l = NEXT3_I(inode)->i_snaplist.prev;
+#endif
+		if (l == list || list_empty(l))
+			/* let next3_snapshot_get_inode_access() deal with it */
+			break;
+		inode = &list_entry(l, struct next3_inode_info,
+				    i_snaplist)->vfs_inode;
+		snapshot_debug(4, "skipping to snapshot (%u) on read through "
+			       "of block (%llu)\n", inode->i_generation,
+			       (unsigned long long)block);
+	}
+	return inode;
+}
+
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+/*
+ * Quota of blocks moved to snapshot.
+ * The quota of moved blocks is not freed on every move.  It is accumulated
+ * in the handle for one inode at a time and freed by
+ * next3_snapshot_dquot_flush() when the handle is stopped, when blocks of
+ * another inode are moved and before the inode is freed.  Meanwhile, the
+ * handle may allocate replacement blocks for the same inode without
+ * charging the quota again (see next3_snapshot_dquot_net()).
+ */
+void next3_snapshot_dquot_flush(handle_t *handle)
+{
+	if (handle->h_dquot_moved)
+		dquot_free_block(handle->h_dquot_inode, handle->h_dquot_moved);
+	handle->h_dquot_inode = NULL;
+	handle->h_dquot_moved = 0;
+}
+
+/*
+ * next3_snapshot_dquot_free() - free quota of @count blocks of @inode,
+ * which were moved to snapshot (or were netted out and not allocated)
+ */
+void next3_snapshot_dquot_free(handle_t *handle, struct inode *inode,
+			       unsigned long count)
+{
+	if (handle->h_dquot_inode != inode)
+		next3_snapshot_dquot_flush(handle);
+	handle->h_dquot_inode = inode;
+	handle->h_dquot_moved += count;
+}
+
+/*
+ * next3_snapshot_dquot_net() - net out allocation of @count blocks for
+ * @inode against blocks of @inode that were moved to snapshot by @handle.
+ * Nothing is netted out unless all @count blocks can be netted out, so the
+ * caller charges either @count blocks or none.
+ *
+ * Returns the no. of blocks that need not be charged (0 or @count).
+ */
+unsigned long next3_snapshot_dquot_net(handle_t *handle, struct inode *inode,
+				       unsigned long count)
+{
+	if (!handle || handle->h_dquot_inode != inode ||
+			handle->h_dquot_moved < count)
+		return 0;
+	handle->h_dquot_moved -= count;
+	return count;
+}
+
+#endif
 /*
  * next3_snapshot_map_blocks() - helper function for
  * next3_snapshot_test_and_cow().  Test if blocks are mapped in snapshot file.
@@ -38,6 +475,19 @@ int next3_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 {
 	struct buffer_head dummy;
 	int err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	struct next3_snapmap *map = &NEXT3_SNAP_I(inode)->i_snapmap;
+	unsigned int gen;
+
+	err = next3_snapmap_lookup(map, block, maxblocks, mapped, NULL, &gen);
+	if (err > 0) {
+		snapshot_debug_hl(4, "snapshot (%u) map_blocks "
+				"[%lu/%lu] cached, maxblocks=%lu, mapped=%d\n",
+				inode->i_generation,
+				SNAPSHOT_BLOCK_TUPLE(block), maxblocks, err);
+		return err;
+	}
+#endif
 
 	dummy.b_state = 0;
 	dummy.b_blocknr = 0;
@@ -49,6 +499,11 @@ int next3_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 	 */
 	if (mapped && err > 0)
 		*mapped = dummy.b_blocknr;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	if (err > 0)
+		next3_snapmap_insert(map, block, dummy.b_blocknr, err,
+				     inode->i_generation, gen);
+#endif
 
 	snapshot_debug_hl(4, "snapshot (%u) map_blocks "
 			"[%lu/%lu] = [%lu/%lu] "
@@ -86,6 +541,12 @@ int next3_snapshot_map_blocks(handle_t *handle, struct inode *inode,
  * operation is only allowed for a disabled snapshot, when no older enabled
  * snapshot exists (i.e., the deleted snapshot in not 'in-use').  Hence,
  * read through is safe from races with snapshot list delete operations.
+
+ * With CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU, the lifetime of the list entries does not depend on that argument:
+ * next3_get_blocks_handle() walks the list inside an s_snapshot_srcu read
+ * side section, snapshot remove unlinks the entry without clearing its
+ * links and only re-initializes it and drops its reference after a grace
+ * period, and snapshot take publishes the new entry with list_add_rcu().
  *
  * Proof of no race with snapshot take:
  * ------------------------------------
@@ -117,9 +578,14 @@ int next3_snapshot_get_inode_access(handle_t *handle, struct inode *inode,
 {
 	struct next3_inode_info *ei = NEXT3_I(inode);
 	unsigned int flags = ei->i_flags;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	/* caller holds s_snapshot_srcu read lock on read through */
+	struct list_head *prev = rcu_dereference(ei->i_snaplist.prev);
+#else
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ
 	struct list_head *prev = ei->i_snaplist.prev;
 #endif
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK
 #ifdef CONFIG_NEXT3_FS_DEBUG
 	next3_fsblk_t block = SNAPSHOT_BLOCK(iblock);
@@ -249,6 +715,223 @@ __next3_snapshot_copy_bitmap(struct buffer_head *sbh,
 }
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_ASYNC
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_DIRTY
+/*
+ * Account the start (or end) of the write of a COWed snapshot buffer.
+ * The writeback counters count pages, but with block size smaller than
+ * page size, several COWed buffers of a page may be in flight together.
+ * The page is accounted once, from the start of the first write of its
+ * buffers until the end of the last one.  The buffers of the page are
+ * serialized by BH_Uptodate_Lock of the first one, as in async write
+ * completion.  Callable from I/O completion context.
+ */
+static void next3_snapshot_account_cow_write(struct buffer_head *sbh,
+		int start)
+{
+	struct backing_dev_info *bdi = sbh->b_bdev->bd_super->s_bdi;
+	struct buffer_head *first = page_buffers(sbh->b_page);
+	struct buffer_head *tmp;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	bit_spin_lock(BH_Uptodate_Lock, &first->b_state);
+	if (start)
+		set_buffer_cow_write(sbh);
+	else
+		clear_buffer_cow_write(sbh);
+	for (tmp = sbh->b_this_page; tmp != sbh; tmp = tmp->b_this_page)
+		if (buffer_cow_write(tmp))
+			/* page is (still) accounted by another buffer */
+			goto out;
+	if (start)
+		account_fs_write_start(bdi, sbh->b_page);
+	else
+		account_fs_write_end(bdi, sbh->b_page);
+out:
+	bit_spin_unlock(BH_Uptodate_Lock, &first->b_state);
+	local_irq_restore(flags);
+}
+
+#endif
+/*
+ * I/O completion handler of COWed snapshot buffer.
+ * Unlock the snapshot buffer and complete the pending COW operation.
+ */
+static void next3_snapshot_end_cow_write(struct buffer_head *sbh,
+		int uptodate)
+{
+	if (uptodate) {
+		set_buffer_uptodate(sbh);
+	} else {
+		/* journal commit will find the buffer not uptodate */
+		set_buffer_write_io_error(sbh);
+		clear_buffer_uptodate(sbh);
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_DIRTY
+	next3_snapshot_account_cow_write(sbh, 0);
+#endif
+	unlock_buffer(sbh);
+	/* COW operation is complete */
+	next3_snapshot_end_pending_cow(sbh);
+	put_bh(sbh);
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+static int next3_snapshot_cow_batch_cmp(const void *a, const void *b)
+{
+	const struct buffer_head *bha = *(const struct buffer_head **)a;
+	const struct buffer_head *bhb = *(const struct buffer_head **)b;
+
+	if (bha->b_blocknr < bhb->b_blocknr)
+		return -1;
+	return bha->b_blocknr > bhb->b_blocknr;
+}
+
+/*
+ * next3_snapshot_cow_batch_flush()
+ * Submit the writes of the batched COWed snapshot buffers, sorted by block
+ * number, so that the elevator gets them in one ascending run.
+ */
+void next3_snapshot_cow_batch_flush(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct buffer_head *bhs[NEXT3_SNAPSHOT_COW_WRITE_BATCH];
+	int i, count;
+
+	spin_lock(&sbi->s_cow_batch_lock);
+	count = sbi->s_cow_batch_count;
+	memcpy(bhs, sbi->s_cow_batch, count * sizeof(bhs[0]));
+	sbi->s_cow_batch_count = 0;
+	spin_unlock(&sbi->s_cow_batch_lock);
+	if (!count)
+		return;
+
+	sort(bhs, count, sizeof(bhs[0]), next3_snapshot_cow_batch_cmp, NULL);
+	for (i = 0; i < count; i++)
+		submit_bh(WRITE, bhs[i]);
+}
+
+/*
+ * next3_snapshot_cow_batch_commit()
+ * Journal commit callback - the committing transaction waits for the writes
+ * of its COWed buffers, so submit them before the commit writes out data.
+ */
+void next3_snapshot_cow_batch_commit(journal_t *journal,
+		transaction_t *transaction)
+{
+	next3_snapshot_cow_batch_flush(journal->j_private);
+}
+
+/*
+ * add a locked snapshot buffer to the COW batch and submit the batch if
+ * it is full
+ */
+static void next3_snapshot_cow_batch_add(struct super_block *sb,
+		struct buffer_head *sbh)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	for (;;) {
+		spin_lock(&sbi->s_cow_batch_lock);
+		if (sbi->s_cow_batch_count < NEXT3_SNAPSHOT_COW_WRITE_BATCH) {
+			sbi->s_cow_batch[sbi->s_cow_batch_count++] = sbh;
+			spin_unlock(&sbi->s_cow_batch_lock);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+			/*
+			 * A reader may have gone to sleep on the pending COW
+			 * before the buffer was queued, so it could not flush
+			 * the batch in next3_snapshot_wait_pending_cow().
+			 */
+			smp_mb();
+			if (waitqueue_active(bit_waitqueue(&sbh->b_state,
+							   BH_New)))
+				next3_snapshot_cow_batch_flush(sb);
+#endif
+			return;
+		}
+		spin_unlock(&sbi->s_cow_batch_lock);
+		next3_snapshot_cow_batch_flush(sb);
+	}
+}
+
+#endif
+/*
+ * next3_snapshot_submit_cow()
+ * Submit the write of a newly COWed (locked) snapshot buffer and add it to
+ * the current transaction as data, so journal commit waits for the write.
+ * The COW operation is completed by next3_snapshot_end_cow_write().
+ * With batched COW writes, the write is only queued here and submitted with
+ * the batch, at the latest when the COWing handle is stopped.
+ */
+static int
+next3_snapshot_submit_cow(handle_t *handle, struct buffer_head *sbh)
+{
+	/* keep buffer in cache until the write is complete */
+	get_bh(sbh);
+	sbh->b_end_io = next3_snapshot_end_cow_write;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_DIRTY
+	/* the buffer is not dirtied, so charge the write to the COWing task */
+	next3_snapshot_account_cow_write(sbh, 1);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	next3_snapshot_cow_batch_add(handle->h_transaction->t_journal->j_private,
+				     sbh);
+#else
+	submit_bh(WRITE, sbh);
+#endif
+	/*
+	 * The buffer is locked and clean, so journal_dirty_data() won't try
+	 * to write it. If the write is still in progress at commit time,
+	 * the buffer will be waited on in the commit locked data list.
+	 */
+	return next3_journal_dirty_data(handle, sbh);
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+/*
+ * Wait action for readers of a pending COW buffer.
+ * The pending COW may be waiting for the write of the locked COW buffer,
+ * which may be waiting in the COW batch.
+ */
+int next3_snapshot_wait_pending_cow(void *word)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	struct buffer_head *sbh = container_of(word, struct buffer_head,
+					       b_state);
+
+	if (buffer_locked(sbh))
+		next3_snapshot_cow_batch_flush(sbh->b_bdev->bd_super);
+#endif
+	io_schedule();
+	return 0;
+}
+
+/*
+ * Wait for the tracked readers of @bh to complete.
+ * Woken up by next3_tracked_readers_wake() of the last tracked reader.
+ * Returns the number of times we slept.
+ */
+static int next3_snapshot_wait_tracked_readers(struct buffer_head *bh)
+{
+	wait_queue_head_t *wq =
+		next3_tracked_readers_wq(next3_tracked_readers_key(bh));
+	DEFINE_WAIT(wait);
+	int waits = 0;
+
+	for (;;) {
+		prepare_to_wait(wq, &wait, TASK_UNINTERRUPTIBLE);
+		if (buffer_tracked_readers_count(bh) <= 0)
+			break;
+		io_schedule();
+		waits++;
+	}
+	finish_wait(wq, &wait);
+	return waits;
+}
+
+#endif
 /*
  * next3_snapshot_complete_cow()
  * Unlock a newly COWed snapshot buffer and complete the COW operation.
@@ -261,14 +944,33 @@ next3_snapshot_complete_cow(handle_t *handle,
 {
 	int err = 0;
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
-	
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	int waits = 0;
+#endif
+
 	/* wait for completion of tracked reads before completing COW */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (bh && buffer_tracked_readers_count(bh) > 0) {
+		snapshot_debug_once(2, "waiting for tracked reads: "
+			"block = [%lu/%lu], "
+			"tracked_readers_count = %d...\n",
+			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
+			buffer_tracked_readers_count(bh));
+		snapshot_stats_inc(bh->b_bdev->bd_super, tracked_read_wait);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+		waits = next3_snapshot_wait_tracked_readers(bh);
+#else
+		next3_snapshot_wait_tracked_readers(bh);
+#endif
+	}
+#else
 	while (bh && buffer_tracked_readers_count(bh) > 0) {
 		snapshot_debug_once(2, "waiting for tracked reads: "
 			"block = [%lu/%lu], "
 			"tracked_readers_count = %d...\n",
 			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
 			buffer_tracked_readers_count(bh));
+		snapshot_stats_inc(bh->b_bdev->bd_super, tracked_read_wait);
 		/*
 		 * Quote from LVM snapshot pending_complete() function:
 	         * "Check for conflicting reads. This is extremely improbable,
@@ -277,9 +979,23 @@ next3_snapshot_complete_cow(handle_t *handle,
 		 */
 		msleep(1);
 		/* XXX: Should we fail after N retries? */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+		waits++;
+#endif
 	}
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	if (waits)
+		trace_next3_snapshot_tracked_read_wait(bh->b_bdev->bd_super,
+				bh->b_blocknr, waits);
+#endif
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_ASYNC
+	if (handle && !sync)
+		return next3_snapshot_submit_cow(handle, sbh);
 
+#endif
 	unlock_buffer(sbh);
 	if (handle) {
 		err = next3_journal_dirty_data(handle, sbh);
@@ -318,6 +1034,7 @@ next3_snapshot_copy_buffer_cow(handle_t *handle,
  * helper function for next3_snapshot_take()
  * used for initializing pre-allocated snapshot blocks
  * copy buffer to snapshot buffer and sync to disk
+ * (with batched take copies, the caller writes the dirty buffer to disk)
  * 'mask' block bitmap with exclude bitmap before copying to snapshot.
  */
 void next3_snapshot_copy_buffer(struct buffer_head *sbh,
@@ -335,43 +1052,10 @@ void next3_snapshot_copy_buffer(struct buffer_head *sbh,
 #endif
 	unlock_buffer(sbh);
 	mark_buffer_dirty(sbh);
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
 	sync_dirty_buffer(sbh);
-}
-
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
-/*
- * XXX: Experimental code
- * next3_snapshot_zero_buffer()
- * helper function for next3_snapshot_test_and_cow()
- * reset snapshot data buffer to zero and
- * add to current transaction (as dirty data)
- * 'blk' is the logical snapshot block number
- * 'blocknr' is the physical block number
- */
-static int
-next3_snapshot_zero_buffer(handle_t *handle, struct inode *inode,
-		next3_snapblk_t blk, next3_fsblk_t blocknr)
-{
-	int err;
-	struct buffer_head *sbh;
-	sbh = sb_getblk(inode->i_sb, blocknr);
-	if (!sbh)
-		return -EIO;
-
-	snapshot_debug(3, "zeroing snapshot block [%lu/%lu] = [%lu/%lu]\n",
-			SNAPSHOT_BLOCK_TUPLE(blk),
-			SNAPSHOT_BLOCK_TUPLE(blocknr));
-
-	lock_buffer(sbh);
-	memset(sbh->b_data, 0, SNAPSHOT_BLOCK_SIZE);
-	set_buffer_uptodate(sbh);
-	unlock_buffer(sbh);
-	err = next3_journal_dirty_data(handle, sbh);
-	mark_buffer_dirty(sbh);
-	brelse(sbh);
-	return err;
-}
 #endif
+}
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP
 /*
@@ -439,6 +1123,182 @@ next3_snapshot_init_cow_bitmap(struct super_block *sb,
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+/*
+ * next3_snapshot_test_live_bitmap() tests blocks [@bit, @end) of
+ * @block_group in the block bitmap masked with the exclude bitmap, which
+ * is the COW bitmap that next3_snapshot_init_cow_bitmap() would create,
+ * as long as the COW bitmap of the group is in live state.
+ *
+ * Return values:
+ * > 0 - no. of blocks from @bit that are in use by snapshot
+ * = 0 - block @bit is not in use by snapshot and if @pclear is not NULL,
+ *       it returns the no. of blocks from @bit that are not in use
+ * -EAGAIN - the COW bitmap left live state, so the caller should read it
+ * < 0 - error
+ */
+static int
+next3_snapshot_test_live_bitmap(struct super_block *sb,
+		unsigned int block_group, next3_grpblk_t bit,
+		next3_grpblk_t end, int *pclear)
+{
+	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info +
+		block_group;
+	struct buffer_head *bitmap_bh;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	struct buffer_head *exclude_bitmap_bh = NULL;
+#endif
+	char *src, *mask = NULL;
+	struct journal_head *jh;
+	next3_grpblk_t i;
+	int inuse;
+
+	bitmap_bh = read_block_bitmap(sb, block_group);
+	if (!bitmap_bh)
+		return -EIO;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	exclude_bitmap_bh = read_exclude_bitmap(sb, block_group);
+	if (exclude_bitmap_bh)
+		mask = exclude_bitmap_bh->b_data;
+#endif
+
+	/* see the comment about committed_data in init_cow_bitmap() */
+	jbd_lock_bh_journal_head(bitmap_bh);
+	jbd_lock_bh_state(bitmap_bh);
+	jh = bh2jh(bitmap_bh);
+	src = (jh && jh->b_committed_data) ? jh->b_committed_data :
+		bitmap_bh->b_data;
+	for (i = bit; i < end; i++)
+		if (!next3_test_bit(i, src) || (mask && next3_test_bit(i, mask)))
+			break;
+	inuse = i - bit;
+	if (!inuse && pclear) {
+		for (i = bit + 1; i < end; i++)
+			if (next3_test_bit(i, src) &&
+			    !(mask && next3_test_bit(i, mask)))
+				break;
+		*pclear = i - bit;
+	}
+	jbd_unlock_bh_state(bitmap_bh);
+	jbd_unlock_bh_journal_head(bitmap_bh);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bitmap_bh);
+#endif
+	brelse(bitmap_bh);
+
+	/*
+	 * The block bitmap is only changed after the COW bitmap was created,
+	 * which clears the live state first.  If we still see the live state
+	 * after testing, we tested the block bitmap before it was changed.
+	 */
+	smp_rmb();
+	if (!ACCESS_ONCE(gi->bg_cow_bitmap_live))
+		return -EAGAIN;
+	return inuse;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+/*
+ * Snapshot files drop the pages behind their reads, so every pass of a
+ * snapshot fsck reads through to the block bitmaps again.  The fixed
+ * block bitmap of a group does not change until the block bitmap is
+ * COWed to the active snapshot, and from then on it is read from the
+ * snapshot file, so we keep a copy of it until the next snapshot take.
+ */
+#define NEXT3_FIXED_BITMAPS_MAX		8192
+
+/*
+ * next3_snapshot_get_fixed_bitmap() copies the cached fixed block bitmap
+ * of @block_group to the locked user page buffer @bh.
+ * Returns 1 if the bitmap was cached and 0 otherwise.
+ */
+static int next3_snapshot_get_fixed_bitmap(struct super_block *sb,
+		unsigned int block_group, struct buffer_head *bh)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + block_group;
+	char *dst;
+	int ret = 0;
+
+	if (!ACCESS_ONCE(gi->bg_fixed_bitmap))
+		return 0;
+
+	spin_lock(sb_bgl_lock(sbi, block_group));
+	if (gi->bg_fixed_bitmap) {
+		dst = kmap_atomic(bh->b_page, KM_USER0);
+		memcpy(dst, gi->bg_fixed_bitmap, SNAPSHOT_BLOCK_SIZE);
+		kunmap_atomic(dst, KM_USER0);
+		set_buffer_uptodate(bh);
+		ret = 1;
+	}
+	spin_unlock(sb_bgl_lock(sbi, block_group));
+	return ret;
+}
+
+/*
+ * next3_snapshot_set_fixed_bitmap() caches a copy of the fixed block
+ * bitmap in user page buffer @bh, unless the cache was dropped since
+ * @gen was sampled, because then @bh may be the image of an old snapshot.
+ */
+static void next3_snapshot_set_fixed_bitmap(struct super_block *sb,
+		unsigned int block_group, struct buffer_head *bh,
+		unsigned int gen)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + block_group;
+	char *copy, *src;
+
+	if (atomic_read(&sbi->s_fixed_bitmaps) >= NEXT3_FIXED_BITMAPS_MAX)
+		return;
+
+	copy = kmalloc(SNAPSHOT_BLOCK_SIZE, GFP_NOFS);
+	if (!copy)
+		return;
+	src = kmap_atomic(bh->b_page, KM_USER0);
+	memcpy(copy, src, SNAPSHOT_BLOCK_SIZE);
+	kunmap_atomic(src, KM_USER0);
+
+	spin_lock(sb_bgl_lock(sbi, block_group));
+	if (!gi->bg_fixed_bitmap && gen == sbi->s_fixed_bitmaps_gen) {
+		gi->bg_fixed_bitmap = copy;
+		atomic_inc(&sbi->s_fixed_bitmaps);
+		copy = NULL;
+	}
+	spin_unlock(sb_bgl_lock(sbi, block_group));
+	kfree(copy);
+}
+
+/*
+ * next3_snapshot_drop_fixed_bitmaps() frees all cached fixed block bitmaps.
+ * Called when the active snapshot changes and on umount.
+ * Readers that sampled the old generation will not cache their bitmaps.
+ */
+void next3_snapshot_drop_fixed_bitmaps(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info;
+	unsigned long i;
+
+	sbi->s_fixed_bitmaps_gen++;
+	for (i = 0; i < sbi->s_groups_count; i++, gi++) {
+		char *bitmap;
+
+		spin_lock(sb_bgl_lock(sbi, i));
+		bitmap = gi->bg_fixed_bitmap;
+		gi->bg_fixed_bitmap = NULL;
+		spin_unlock(sb_bgl_lock(sbi, i));
+		if (bitmap) {
+			atomic_dec(&sbi->s_fixed_bitmaps);
+			kfree(bitmap);
+		}
+		if (!(i & 0xff))
+			cond_resched();
+	}
+}
+
+#endif
 /*
  * next3_snapshot_read_block_bitmap()
  * helper function for next3_snapshot_get_block()
@@ -448,19 +1308,102 @@ next3_snapshot_init_cow_bitmap(struct super_block *sb,
 int next3_snapshot_read_block_bitmap(struct super_block *sb,
 		unsigned int block_group, struct buffer_head *bitmap_bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	unsigned int gen = ACCESS_ONCE(NEXT3_SB(sb)->s_fixed_bitmaps_gen);
+#endif
 	int err;
 
 	lock_buffer(bitmap_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	if (next3_snapshot_get_fixed_bitmap(sb, block_group, bitmap_bh)) {
+		unlock_buffer(bitmap_bh);
+		return 0;
+	}
+	/* sample the cache generation before reading the bitmaps */
+	smp_rmb();
 	err = next3_snapshot_init_cow_bitmap(sb, block_group, bitmap_bh);
+	if (!err)
+		next3_snapshot_set_fixed_bitmap(sb, block_group, bitmap_bh,
+						gen);
+#else
+	err = next3_snapshot_init_cow_bitmap(sb, block_group, bitmap_bh);
+#endif
 	unlock_buffer(bitmap_bh);
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_BITMAP
+/*
+ * Tasks waiting for a pending COW bitmap creation sleep on a hashed wait
+ * queue, keyed by the address of the block group info struct, so we don't
+ * need to add a wait queue head to every block group info struct.
+ */
+#define COW_BITMAP_WAIT_TABLE_BITS	6
+#define COW_BITMAP_WAIT_TABLE_SIZE	(1 << COW_BITMAP_WAIT_TABLE_BITS)
+/* max. time to wait for another task to create a COW bitmap */
+#define COW_BITMAP_WAIT_TIMEOUT		(60*HZ)
+
+static wait_queue_head_t cow_bitmap_wait_table[COW_BITMAP_WAIT_TABLE_SIZE];
+
+void init_next3_snapshot_cow_bitmap_wait(void)
+{
+	int i;
+
+	for (i = 0; i < COW_BITMAP_WAIT_TABLE_SIZE; i++)
+		init_waitqueue_head(cow_bitmap_wait_table + i);
+}
+
+static inline wait_queue_head_t *
+cow_bitmap_waitqueue(struct next3_group_info *gi)
+{
+	return cow_bitmap_wait_table +
+		hash_ptr(gi, COW_BITMAP_WAIT_TABLE_BITS);
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+/*
+ * The pinned COW bitmap buffer holds an extra reference to the buffer of
+ * an initialized COW bitmap cache entry.  It is set after the COW bitmap
+ * cache is initialized and released by next3_snapshot_reset_bitmap_cache()
+ * on snapshot take (under journal_lock_updates()) and on umount.
+ */
+static inline struct buffer_head *
+next3_snapshot_get_cow_bh(struct next3_sb_info *sbi,
+			  struct next3_group_info *gi, unsigned int block_group)
+{
+	struct buffer_head *cow_bh;
+
+	spin_lock(sb_snapshot_lock(sbi, block_group));
+	cow_bh = gi->bg_cow_bh;
+	if (cow_bh)
+		get_bh(cow_bh);
+	spin_unlock(sb_snapshot_lock(sbi, block_group));
+	return cow_bh;
+}
+
+static inline void
+next3_snapshot_pin_cow_bh(struct next3_sb_info *sbi,
+			  struct next3_group_info *gi, unsigned int block_group,
+			  struct buffer_head *cow_bh)
+{
+	spin_lock(sb_snapshot_lock(sbi, block_group));
+	if (!gi->bg_cow_bh && gi->bg_cow_bitmap == cow_bh->b_blocknr) {
+		get_bh(cow_bh);
+		gi->bg_cow_bh = cow_bh;
+	}
+	spin_unlock(sb_snapshot_lock(sbi, block_group));
+}
+
+#endif
 /*
  * next3_snapshot_read_cow_bitmap - read COW bitmap from active snapshot
  * @handle:	JBD handle
  * @snapshot:	active snapshot
  * @block_group: block group
+ * @live:	(BLOCK_BITMAP_LIVE) if not NULL, return NULL and set *@live
+ *		instead of creating the COW bitmap, when the block bitmap
+ *		was not changed since snapshot take
  *
  * Reads the COW bitmap block (i.e., the active snapshot copy of block bitmap).
  * Creates the COW bitmap on first access to @block_group after snapshot take.
@@ -470,9 +1413,15 @@ int next3_snapshot_read_block_bitmap(struct super_block *sb,
  *
  * Return COW bitmap buffer on success or NULL in case of failure.
  */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+static struct buffer_head *
+next3_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
+			       unsigned int block_group, int *live)
+#else
 static struct buffer_head *
 next3_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 			       unsigned int block_group)
+#endif
 {
 	struct super_block *sb = snapshot->i_sb;
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
@@ -500,16 +1449,31 @@ next3_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	 * The first task to access block group after mount or snapshot take,
 	 * will read the uninitialized state, mark pending COW state, initialize
 	 * the COW bitmap block and update COW bitmap cache.  Other tasks will
-	 * busy wait until the COW bitmap cache is in initialized state, before
-	 * reading the COW bitmap block.
+	 * sleep on the block group's hashed wait queue until the COW bitmap
+	 * cache is in initialized state, before reading the COW bitmap block.
 	 */
 	do {
-		spin_lock(sb_bgl_lock(sbi, block_group));
+		spin_lock(sb_snapshot_lock(sbi, block_group));
 		cow_bitmap_blk = gi->bg_cow_bitmap;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		if (cow_bitmap_blk == 0 && live && gi->bg_cow_bitmap_live) {
+			/* test the masked block bitmap instead */
+			spin_unlock(sb_snapshot_lock(sbi, block_group));
+			*live = 1;
+			return NULL;
+		}
+		if (cow_bitmap_blk == 0) {
+			/* mark pending COW of bitmap block */
+			gi->bg_cow_bitmap = bitmap_blk;
+			/* the block bitmap may change after we create it */
+			gi->bg_cow_bitmap_live = 0;
+		}
+#else
 		if (cow_bitmap_blk == 0)
 			/* mark pending COW of bitmap block */
 			gi->bg_cow_bitmap = bitmap_blk;
-		spin_unlock(sb_bgl_lock(sbi, block_group));
+#endif
+		spin_unlock(sb_snapshot_lock(sbi, block_group));
 
 		if (cow_bitmap_blk == 0) {
 			snapshot_debug(3, "initializing COW bitmap #%u "
@@ -523,22 +1487,46 @@ next3_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 			/* wait for another task to COW bitmap block */
 			snapshot_debug_once(2, "waiting for pending COW "
 					    "bitmap #%d...\n", block_group);
+			snapshot_stats_inc(sb, pending_cow_wait);
 			/*
-			 * This is an unlikely event that can happen only once
-			 * per block_group/snapshot, so msleep(1) is sufficient
-			 * and there is no need for a wait queue.
+			 * The COWing task wakes us up after updating the COW
+			 * bitmap cache, either to the initialized state or
+			 * back to uninitialized state on failure, in which
+			 * case we will try to create the COW bitmap ourselves.
 			 */
-			msleep(1);
+			if (!wait_event_timeout(*cow_bitmap_waitqueue(gi),
+					ACCESS_ONCE(gi->bg_cow_bitmap) !=
+					bitmap_blk, COW_BITMAP_WAIT_TIMEOUT)) {
+				snapshot_debug(1, "timeout waiting for pending "
+						"COW bitmap #%u of snapshot "
+						"(%u)!\n", block_group,
+						snapshot->i_generation);
+				return NULL;
+			}
 		}
-		/* XXX: Should we fail after N retries? */
 	} while (cow_bitmap_blk == 0 || cow_bitmap_blk == bitmap_blk);
 #else
-	spin_lock(sb_bgl_lock(sbi, block_group));
+	spin_lock(sb_snapshot_lock(sbi, block_group));
 	cow_bitmap_blk = gi->bg_cow_bitmap;
-	spin_unlock(sb_bgl_lock(sbi, block_group));
+	spin_unlock(sb_snapshot_lock(sbi, block_group));
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+	if (cow_bitmap_blk) {
+		cow_bh = next3_snapshot_get_cow_bh(sbi, gi, block_group);
+		if (cow_bh)
+			return cow_bh;
+		cow_bh = sb_bread(sb, cow_bitmap_blk);
+		if (cow_bh)
+			next3_snapshot_pin_cow_bh(sbi, gi, block_group, cow_bh);
+		return cow_bh;
+	}
+#else
 	if (cow_bitmap_blk)
 		return sb_bread(sb, cow_bitmap_blk);
+#endif
+
+	/* COW bitmap cache miss */
+	snapshot_stats_inc(sb, bitmap_miss);
 
 	/*
 	 * Try to read cow bitmap block from snapshot file.  If COW bitmap
@@ -548,6 +1536,21 @@ next3_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 				SNAPMAP_READ, &err);
 	if (cow_bh)
 		goto out;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	if (live && !err) {
+		/*
+		 * No COW bitmap in snapshot file, so the block bitmap was not
+		 * changed since take - switch to live state.
+		 */
+		spin_lock(sb_snapshot_lock(sbi, block_group));
+		gi->bg_cow_bitmap = 0;
+		gi->bg_cow_bitmap_live = 1;
+		spin_unlock(sb_snapshot_lock(sbi, block_group));
+		wake_up_all(cow_bitmap_waitqueue(gi));
+		*live = 1;
+		return NULL;
+	}
+#endif
 
 	/* allocate snapshot block for COW bitmap */
 	cow_bh = next3_getblk(handle, snapshot, SNAPSHOT_IBLOCK(bitmap_blk),
@@ -597,14 +1600,277 @@ out:
 		cow_bh = NULL;
 	}
 
-	/* update or reset COW bitmap cache */
+	/* update or reset COW bitmap cache */
+	spin_lock(sb_snapshot_lock(sbi, block_group));
+	gi->bg_cow_bitmap = cow_bitmap_blk;
+	spin_unlock(sb_snapshot_lock(sbi, block_group));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	/* COW bitmap cache miss - read or created the COW bitmap block */
+	trace_next3_snapshot_read_cow_bitmap(sb, snapshot->i_generation,
+			block_group, cow_bitmap_blk, 1);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+	if (cow_bh)
+		next3_snapshot_pin_cow_bh(sbi, gi, block_group, cow_bh);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_BITMAP
+	/* wake up tasks waiting for pending COW bitmap */
+	wake_up_all(cow_bitmap_waitqueue(gi));
+#endif
+
+	return cow_bh;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+/*
+ * Background creation of COW bitmaps.
+ * After snapshot take and after mount, the COW bitmap cache is reset and
+ * the COW bitmap of every block group is created on the first write access
+ * to the block group.  The COW bitmap work walks all block groups and creates
+ * the missing COW bitmaps ahead of demand, so foreground writers find the
+ * COW bitmap cache already initialized.  Foreground writers and the work are
+ * synchronized by the pending COW bitmap state of the COW bitmap cache.
+ */
+static struct workqueue_struct *next3_snapshot_wq;
+
+int init_next3_snapshot_cow_bitmap_work(void)
+{
+	next3_snapshot_wq = create_singlethread_workqueue("next3-snapshot");
+	return next3_snapshot_wq ? 0 : -ENOMEM;
+}
+
+void exit_next3_snapshot_cow_bitmap_work(void)
+{
+	destroy_workqueue(next3_snapshot_wq);
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+/*
+ * next3_snapshot_prealloc_ind() - pre-allocate indirect blocks of group
+ * Allocate the snapshot indirect blocks that map all the blocks of
+ * @block_group, so COW into the block group does not allocate indirect blocks
+ * inside user transactions.  Every indirect block is allocated in its own
+ * transaction in the context of a COW operation.  Existing indirect blocks are
+ * left as they are.
+ *
+ * Returns the no. of indirect blocks that were checked or < 0 on error.
+ */
+static int next3_snapshot_prealloc_ind(struct super_block *sb,
+		struct inode *snapshot, unsigned long block_group)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	next3_fsblk_t block = next3_group_first_block_no(sb, block_group);
+	handle_t *handle;
+	int i, err = 0;
+
+	for (i = 0; i < SNAPSHOT_IND_PER_BLOCK_GROUP; i++,
+			block += SNAPSHOT_ADDR_PER_BLOCK) {
+		if (sbi->s_cow_bitmap_stop)
+			break;
+		/* yield to foreground I/O */
+		while (!sbi->s_cow_bitmap_stop &&
+				(bdi_write_congested(sb->s_bdi) ||
+				 bdi_read_congested(sb->s_bdi)))
+			congestion_wait(BLK_RW_ASYNC, HZ/10);
+
+		handle = next3_journal_start_sb(sb, NEXT3_DATA_TRANS_BLOCKS(sb));
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		/* active snapshot cannot change while we hold a handle */
+		if (next3_snapshot_has_active(sb) != snapshot ||
+				block >= SNAPSHOT_BLOCKS(snapshot)) {
+			next3_journal_stop(handle);
+			return -ESTALE;
+		}
+		/* allocate indirect blocks in the context of a COW operation */
+		IS_COWING(handle) = 1;
+		err = next3_snapshot_map_blocks(handle, snapshot, block, 1,
+						NULL, SNAPMAP_IND);
+		IS_COWING(handle) = 0;
+		next3_journal_stop(handle);
+		if (err < 0) {
+			snapshot_debug(1, "failed to pre-allocate indirect "
+				       "block %d of group %lu in snapshot "
+				       "(%u) (err=%d)\n", i, block_group,
+				       snapshot->i_generation, err);
+			return err;
+		}
+	}
+	return i;
+}
+
+#endif
+static void next3_snapshot_cow_bitmap_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(work, struct next3_sb_info,
+						 s_cow_bitmap_work);
+	struct super_block *sb = sbi->s_sb;
+	struct inode *snapshot = next3_snapshot_has_active(sb);
+	struct buffer_head *cow_bh;
+	unsigned long group, created = 0;
+	handle_t *handle;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	int ioprio;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	int live;
+#endif
+
+	if (!snapshot)
+		return;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	ioprio = next3_snapshot_io_begin(sb);
+#endif
+	for (group = 0; group < sbi->s_groups_count; group++) {
+		if (sbi->s_cow_bitmap_stop)
+			break;
+		/* COW bitmap cache may be read without lock */
+		if (ACCESS_ONCE(sbi->s_group_info[group].bg_cow_bitmap))
+			/* initialized or pending COW bitmap */
+			continue;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		if (ACCESS_ONCE(sbi->s_group_info[group].bg_cow_bitmap_live))
+			/* COW bitmap will be created on first change */
+			continue;
+#endif
+
+		/* yield to foreground I/O */
+		while (!sbi->s_cow_bitmap_stop &&
+				(bdi_write_congested(sb->s_bdi) ||
+				 bdi_read_congested(sb->s_bdi)))
+			congestion_wait(BLK_RW_ASYNC, HZ/10);
+
+		handle = next3_journal_start_sb(sb, 1);
+		if (IS_ERR(handle))
+			break;
+		/* active snapshot cannot change while we hold a handle */
+		if (next3_snapshot_has_active(sb) != snapshot ||
+				next3_group_first_block_no(sb, group) >=
+				SNAPSHOT_BLOCKS(snapshot)) {
+			/*
+			 * snapshot was deactivated (new snapshot take will
+			 * restart the work) or block group was added after
+			 * snapshot take.
+			 */
+			next3_journal_stop(handle);
+			break;
+		}
+		/* create COW bitmap in the context of a COW operation */
+		IS_COWING(handle) = 1;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		/* only look up the COW bitmap, or find it in live state */
+		live = 0;
+		cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot,
+							 group, &live);
+#else
+		cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot,
+							 group);
+#endif
+		IS_COWING(handle) = 0;
+		next3_journal_stop(handle);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		if (!cow_bh && live) {
+			cond_resched();
+			continue;
+		}
+#endif
+		if (!cow_bh)
+			break;
+		brelse(cow_bh);
+		created++;
+		cond_resched();
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+
+	for (group = 0; group < sbi->s_groups_count; group++) {
+		if (sbi->s_cow_bitmap_stop)
+			break;
+		if (next3_snapshot_prealloc_ind(sb, snapshot, group) < 0)
+			break;
+		cond_resched();
+	}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	next3_snapshot_io_end(ioprio);
+#endif
+	snapshot_debug(2, "%lu COW bitmaps created in background.\n",
+			created);
+}
+
+/*
+ * next3_snapshot_cow_bitmap_work_init() - called on mount time
+ */
+void next3_snapshot_cow_bitmap_work_init(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_sb = sb;
+	sbi->s_cow_bitmap_stop = 0;
+	INIT_WORK(&sbi->s_cow_bitmap_work, next3_snapshot_cow_bitmap_work);
+}
+
+/*
+ * next3_snapshot_cow_bitmap_work_start() - called after the COW bitmap
+ * cache was reset (on snapshot take and mount time).
+ * If the work is already running, it will run again after it is done.
+ */
+void next3_snapshot_cow_bitmap_work_start(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+	sbi->s_cow_bitmap_stop = 0;
+	queue_work(next3_snapshot_wq, &sbi->s_cow_bitmap_work);
+}
+
+/*
+ * next3_snapshot_cow_bitmap_work_stop() - called on umount time
+ */
+void next3_snapshot_cow_bitmap_work_stop(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_cow_bitmap_stop = 1;
+	cancel_work_sync(&sbi->s_cow_bitmap_work);
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+/*
+ * next3_snapshot_test_fresh() - test if block @bit in @block_group was
+ * allocated since active snapshot take
+ *
+ * Blocks that were allocated since snapshot take were free at take time,
+ * so they are not set in the COW bitmap.  Blocks that were in use at take
+ * time and deleted since are moved to snapshot and never reallocated.
+ * If @pclear is not NULL, it is set to the no. of blocks from @bit to the
+ * end of the allocated run or to @end, whichever comes first.
+ * Returns 1 if block was allocated since snapshot take.
+ */
+static int next3_snapshot_test_fresh(struct super_block *sb,
+		unsigned long block_group, next3_grpblk_t bit, int end,
+		int *pclear)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + block_group;
+	int fresh = 0;
+
 	spin_lock(sb_bgl_lock(sbi, block_group));
-	gi->bg_cow_bitmap = cow_bitmap_blk;
+	if (bit >= gi->bg_fresh_start && bit < gi->bg_fresh_end) {
+		fresh = 1;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		if (pclear)
+			*pclear = min_t(int, end, gi->bg_fresh_end) - bit;
+#endif
+	}
 	spin_unlock(sb_bgl_lock(sbi, block_group));
-
-	return cow_bh;
+	return fresh;
 }
 
+#endif
 /*
  * next3_snapshot_test_cow_bitmap - test if blocks are in use by snapshot
  * @handle:	JBD handle
@@ -612,6 +1878,8 @@ out:
  * @block:	address of block
  * @maxblocks:	max no. of blocks to be tested
  * @excluded:	if not NULL, blocks belong to this excluded inode
+ * @pclear:	if not NULL, returns no. of blocks not in use by snapshot
+ *		(only when returning 0)
  *
  * If the block bit is set in the COW bitmap, than it was allocated at the time
  * that the active snapshot was taken and is therefore "in use" by the snapshot.
@@ -623,34 +1891,96 @@ out:
  */
 static int
 next3_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
-		next3_fsblk_t block, int maxblocks, struct inode *excluded)
+		next3_fsblk_t block, int maxblocks, struct inode *excluded,
+		int *pclear)
 {
 	struct buffer_head *cow_bh;
 	unsigned long block_group = SNAPSHOT_BLOCK_GROUP(block);
 	next3_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
 	next3_fsblk_t snapshot_blocks = SNAPSHOT_BLOCKS(snapshot);
 	int inuse, err = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+	int end = min_t(int, bit + maxblocks, SNAPSHOT_BLOCKS_PER_GROUP);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	struct next3_group_desc *desc;
+	int live = 0;
+#endif
 
-	if (block >= snapshot_blocks)
+	if (pclear)
+		*pclear = 1;
+	if (block >= snapshot_blocks) {
 		/*
 		 * Block is not is use by snapshot because it is past the
 		 * last f/s block at the time that the snapshot was taken.
 		 * (suggests that f/s was resized after snapshot take)
 		 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		if (pclear)
+			*pclear = end - bit;
+#endif
+		return 0;
+	}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+	if (next3_snapshot_test_fresh(snapshot->i_sb, block_group, bit,
+			min_t(int, bit + maxblocks, SNAPSHOT_BLOCKS_PER_GROUP),
+			pclear))
 		return 0;
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	/*
+	 * The COW of the block bitmap itself (before allocating or freeing
+	 * blocks) must create the COW bitmap.  Excluded file blocks, which
+	 * are set in the COW bitmap, are fixed in the COW bitmap below.
+	 */
+	desc = next3_get_group_desc(snapshot->i_sb, block_group, NULL);
+	if (!desc)
+		return -EIO;
+	if (!excluded && block != le32_to_cpu(desc->bg_block_bitmap)) {
+		cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot,
+							block_group, &live);
+		if (!cow_bh && live) {
+			inuse = next3_snapshot_test_live_bitmap(snapshot->i_sb,
+				block_group, bit,
+				min_t(int, bit + maxblocks,
+				      SNAPSHOT_BLOCKS_PER_GROUP),
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+				pclear);
+#else
+				NULL);
+#endif
+			if (inuse != -EAGAIN)
+				return inuse;
+			cow_bh = next3_snapshot_read_cow_bitmap(handle,
+					snapshot, block_group, NULL);
+		}
+	} else {
+		cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot,
+							block_group, NULL);
+	}
+#else
 	cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot, block_group);
+#endif
 	if (!cow_bh)
 		return -EIO;
 	/*
 	 * if the bit is set in the COW bitmap,
 	 * then the block is in use by snapshot
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+	inuse = next3_find_next_zero_bit(cow_bh->b_data, end, bit) - bit;
+	if (!inuse && pclear)
+		/* run of blocks not in use by snapshot */
+		*pclear = next3_find_next_bit(cow_bh->b_data, end, bit) - bit;
+#else
 	for (inuse = 0; inuse < maxblocks && bit+inuse < SNAPSHOT_BLOCKS_PER_GROUP;
 			inuse++) {
 		if (!next3_test_bit(bit+inuse, cow_bh->b_data))
 			break;
 	}
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (inuse && excluded) {
@@ -680,6 +2010,48 @@ next3_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	brelse(cow_bh);
 	return err ? err : inuse;
 }
+
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+/*
+ * next3_snapshot_cow_flex_bitmap() is called before COWing a block with no
+ * owner inode, which may be a block bitmap packed in another group of its
+ * flex group.  COW of a block bitmap stores the COW bitmap of its group in
+ * the snapshot in place of the block bitmap, but the block is tested in the
+ * COW bitmap of the group that it is in, so create the COW bitmap here.
+ *
+ * Return values:
+ * = 0 - @block is not a packed block bitmap or its COW bitmap exists
+ * < 0 - error
+ */
+static int next3_snapshot_cow_flex_bitmap(handle_t *handle,
+		struct inode *snapshot, next3_fsblk_t block)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct buffer_head *cow_bh;
+	long group;
+
+	if (!NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_FLEX_BG))
+		return 0;
+	group = next3_block_bitmap_group(sb, block);
+	if (group < 0 || group == SNAPSHOT_BLOCK_GROUP(block))
+		/* not a block bitmap or not packed */
+		return 0;
+	if (next3_group_first_block_no(sb, group) >= SNAPSHOT_BLOCKS(snapshot))
+		/* block group was added after snapshot take */
+		return 0;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot, group, NULL);
+#else
+	cow_bh = next3_snapshot_read_cow_bitmap(handle, snapshot, group);
+#endif
+	if (!cow_bh)
+		return -EIO;
+	brelse(cow_bh);
+	return 0;
+}
+
+#endif
 #endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
@@ -715,8 +2087,36 @@ int next3_snapshot_test_and_exclude(const char *where, handle_t *handle,
 	if (err)
 		goto out;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_RANGE
+	if (count > SNAPSHOT_BLOCKS_PER_GROUP - bit)
+		count = SNAPSHOT_BLOCKS_PER_GROUP - bit;
+	if (!exclude) {
+		/* look for the first block not in exclude bitmap */
+		n = next3_find_next_zero_bit(exclude_bitmap_bh->b_data,
+					     bit + count, bit);
+		if (n < bit + count) {
+			next3_set_bit_atomic(sb_snapshot_lock(NEXT3_SB(sb),
+						block_group),
+					n, exclude_bitmap_bh->b_data);
+			bit = n;
+			n = 1;
+		} else
+			n = 0;
+	} else {
+		int first;
+
+		n = next3_set_bits_range(exclude_bitmap_bh->b_data, bit,
+					 count, &first);
+		if (n)
+			snapshot_debug(2, "excluded %d blocks: [%d-%d/%ld]\n",
+					n, first, bit + count - 1,
+					block_group);
+		excluded = n;
+		n = 0;
+	}
+#else
 	while (count > 0 && bit < SNAPSHOT_BLOCKS_PER_GROUP) {
-		if (!next3_set_bit_atomic(sb_bgl_lock(NEXT3_SB(sb),
+		if (!next3_set_bit_atomic(sb_snapshot_lock(NEXT3_SB(sb),
 						block_group),
 					bit, exclude_bitmap_bh->b_data)) {
 			n++;
@@ -731,6 +2131,7 @@ int next3_snapshot_test_and_exclude(const char *where, handle_t *handle,
 		bit++;
 		count--;
 	}
+#endif
 
 	if (n && !exclude) {
 		NEXT3_SET_FLAGS(sb, NEXT3_FLAGS_FIX_EXCLUDE);
@@ -815,6 +2216,12 @@ void init_next3_snapshot_cow_cache(void)
 	if (cow_tid_offset)
 		return;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE_FIELD
+	/* journal_head has a dedicated b_cow_tid field */
+	pos = (char *)&jh->b_cow_tid;
+	goto found;
+
+#endif
 #ifdef CONFIG_64BIT
 	/* check for 32bit padding to 64bit alignment after b_modified */
 	pos = (char *)&jh->b_modified + sizeof(jh->b_modified);
@@ -839,15 +2246,91 @@ found:
 #endif
 }
 
+/*
+ * next3_snapshot_cow_cache_enabled() - report COW tid cache state
+ * Returns the offset of the COW tid in journal_head, or 0 if disabled.
+ */
+int next3_snapshot_cow_cache_enabled(void)
+{
+	return cow_tid_offset > 0 ? cow_tid_offset : 0;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE_FIELD
+#define cow_cache_enabled()	(1)
+#define jh_cow_tid(jh)		((jh)->b_cow_tid)
+#else
 #define cow_cache_enabled()	(cow_tid_offset > 0)
 #define jh_cow_tid(jh)		\
 	*(tid_t *)(((char *)(jh))+cow_tid_offset)
+#endif
 
 #define test_cow_tid(jh, handle)	\
 	(jh_cow_tid(jh) == (handle)->h_transaction->t_tid)
 #define set_cow_tid(jh, handle)		\
 	jh_cow_tid(jh) = (handle)->h_transaction->t_tid
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+/*
+ * Blocks without a journal_head (i.e., blocks being moved or COWed before
+ * they were journaled) cannot use the COW tid cache.  Instead, they are
+ * recorded in a small per file system hash set, tagged with the running
+ * transaction id.  An entry of an older transaction is stale, so the set
+ * is implicitly emptied on transaction commit, including the commit before
+ * a new snapshot becomes active.
+ * [s_cow_set_lock]
+ */
+static inline struct next3_cow_set_entry *next3_snapshot_cow_set_entry(
+		struct next3_sb_info *sbi, next3_fsblk_t block)
+{
+	return sbi->s_cow_set + hash_long(block, NEXT3_COW_SET_BITS);
+}
+
+/*
+ * next3_snapshot_cow_set_test() - test if @block doesn't need COW
+ * Returns 1 if @block was COWed, moved or found not in use by the active
+ * snapshot during the running transaction and 0 otherwise.
+ */
+static int next3_snapshot_cow_set_test(handle_t *handle, next3_fsblk_t block)
+{
+	struct super_block *sb = handle->h_transaction->t_journal->j_private;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_cow_set_entry *e = next3_snapshot_cow_set_entry(sbi, block);
+	int found;
+
+	spin_lock(&sbi->s_cow_set_lock);
+	found = (e->block == block &&
+		 e->tid == handle->h_transaction->t_tid);
+	spin_unlock(&sbi->s_cow_set_lock);
+	if (found)
+		snapshot_stats_inc(sb, cow_set_hit);
+	return found;
+}
+
+/*
+ * next3_snapshot_cow_set_add() - record that @count blocks from @block
+ * don't need COW during the running transaction
+ */
+static void next3_snapshot_cow_set_add(handle_t *handle, next3_fsblk_t block,
+		int count)
+{
+	struct next3_sb_info *sbi =
+		NEXT3_SB(handle->h_transaction->t_journal->j_private);
+	struct next3_cow_set_entry *e;
+
+	/* a large range would only evict the entire set */
+	if (count > NEXT3_COW_SET_SIZE / 4)
+		count = NEXT3_COW_SET_SIZE / 4;
+	spin_lock(&sbi->s_cow_set_lock);
+	for (; count > 0; count--, block++) {
+		e = next3_snapshot_cow_set_entry(sbi, block);
+		e->block = block;
+		e->tid = handle->h_transaction->t_tid;
+	}
+	spin_unlock(&sbi->s_cow_set_lock);
+}
+
+#endif
+
 /*
  * Journal COW cache functions.
  * a block can only be COWed once per snapshot,
@@ -864,6 +2347,10 @@ next3_snapshot_test_cowed(handle_t *handle, struct buffer_head *bh)
 {
 	struct journal_head *jh;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	if (bh && !buffer_jbd(bh))
+		return next3_snapshot_cow_set_test(handle, bh->b_blocknr);
+#endif
 	if (!cow_cache_enabled())
 		return 0;
 
@@ -889,6 +2376,12 @@ next3_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
 {
 	struct journal_head *jh;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	if (bh && !buffer_jbd(bh)) {
+		next3_snapshot_cow_set_add(handle, bh->b_blocknr, 1);
+		return;
+	}
+#endif
 	if (!cow_cache_enabled())
 		return;
 
@@ -914,6 +2407,16 @@ next3_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
  */
 static inline void next3_snapshot_cow_begin(handle_t *handle)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+	int user = ((next3_handle_t *)handle)->h_user_credits;
+	int missing = NEXT3_SNAPSHOT_TRANS_BLOCKS(user) -
+		handle->h_buffer_credits;
+
+	/* draw credits for this COW operation from the transaction pool */
+	if (missing > 0 && journal_draw_credits(handle, missing))
+		/* pool is empty - try to extend the transaction */
+		journal_extend(handle, missing);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS
 	if (!NEXT3_SNAPSHOT_HAS_TRANS_BLOCKS(handle, 1)) {
 		/*
@@ -983,6 +2486,14 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 				  "skip block cow!\n");
 		return 0;
 	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
+	if (inode && next3_snapshot_excluded(inode) > 0) {
+		/* excluded file blocks were excluded on allocation */
+		snapshot_debug_hl(4, "file (%lu) excluded from snapshot - "
+				  "skip block cow!\n", inode->i_ino);
+		return 0;
+	}
 #endif
 	if (IS_COWING(handle)) {
 		/* avoid recursion on active snapshot updates */
@@ -1008,6 +2519,10 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 
 	/* BEGIN COWing */
 	next3_snapshot_cow_begin(handle);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_snapshot_test_and_cow_enter(sb,
+			active_snapshot->i_generation, block);
+#endif
 
 	if (inode)
 		clear = next3_snapshot_excluded(inode);
@@ -1023,9 +2538,17 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 	}
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	if (!inode) {
+		err = next3_snapshot_cow_flex_bitmap(handle, active_snapshot,
+						     block);
+		if (err < 0)
+			goto out;
+	}
+#endif
 	/* get the COW bitmap and test if blocks are in use by snapshot */
 	err = next3_snapshot_test_cow_bitmap(handle, active_snapshot,
-			block, 1, clear < 0 ? inode : NULL);
+			block, 1, clear < 0 ? inode : NULL, NULL);
 	if (err < 0)
 		goto out;
 #else
@@ -1037,6 +2560,15 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 		goto cowed;
 	}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_READ
+	/*
+	 * start reading a non uptodate source buffer while we look up the
+	 * snapshot mapping.  it is waited for below, before it is copied.
+	 */
+	if (cow && buffer_mapped(bh) && !buffer_uptodate(bh))
+		ll_rw_block(READ_META, 1, &bh);
+
+#endif
 	/* block is in use by snapshot - check if it is mapped */
 	err = next3_snapshot_map_blocks(handle, active_snapshot, block, 1, &blk,
 					SNAPMAP_READ);
@@ -1107,24 +2639,23 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 			SNAPSHOT_BLOCK_TUPLE(sbh->b_blocknr));
 
 	trace_cow_inc(handle, copied);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TASK_IO
+	task_io_account_snapshot_cow(1, sb->s_blocksize);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	next3_snapshot_usage_add(active_snapshot, 1, 0);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_ASYNC
+	if (!clear)
+		/* our own pending COW is completed by I/O completion */
+		goto cowed;
+#endif
 test_pending_cow:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
 	if (sbh)
 		/* wait for pending COW to complete */
 		next3_snapshot_test_pending_cow(sbh, block);
 #endif
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
-	if (clear && blk) {
-		/*
-		 * XXX: Experimental code
-		 * zero out snapshot block data
-		 */
-		err = next3_snapshot_zero_buffer(handle, active_snapshot,
-				block, blk);
-		if (err)
-			goto out;
-	}
-#endif
 
 cowed:
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
@@ -1141,12 +2672,348 @@ cowed:
 	}
 #endif
 out:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_snapshot_test_and_cow(sb, active_snapshot->i_generation,
+			block, cow, blk, err);
+#endif
 	brelse(sbh);
 	/* END COWing */
 	next3_snapshot_cow_end(where, handle, block, err);
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+/* max. no. of subsequent blocks to COW in one batch */
+#define NEXT3_SNAPSHOT_COW_BATCH	16
+
+/*
+ * next3_snapshot_cow_batch - COW a run of subsequent metadata blocks
+ * @handle:	JBD handle
+ * @snapshot:	active snapshot
+ * @bhs:	buffer heads of subsequent metadata blocks
+ * @count:	no. of buffers in @bhs (all in use by snapshot)
+ * @cow:	if false, return -EIO if blocks need to be COWed
+ *
+ * Helper function for next3_snapshot_test_and_cow_blocks().
+ * Maps or allocates snapshot blocks for the whole run with as few calls to
+ * next3_get_blocks_handle() as possible and copies the new allocated blocks.
+ * Runs of snapshot blocks that are already mapped were allocated by another
+ * COWing task, so we only need to wait for their pending COW to complete.
+ *
+ * Return values:
+ * = 0 - all blocks in @bhs were COWed
+ * < 0 - error
+ */
+static int next3_snapshot_cow_batch(handle_t *handle, struct inode *snapshot,
+		struct buffer_head **bhs, int count, int cow)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct buffer_head dummy, *sbh, *bh;
+	next3_fsblk_t block = bhs[0]->b_blocknr, blk = 0;
+	int i, n, done, ret, err = 0;
+
+	/* make sure we hold uptodate source buffers */
+	for (i = 0; i < count; i++) {
+		bh = bhs[i];
+		if (!buffer_mapped(bh))
+			return -EIO;
+		if (buffer_uptodate(bh))
+			continue;
+		snapshot_debug(1, "warning: non uptodate buffer (%lu)"
+				" needs to be copied to active snapshot!\n",
+				bh->b_blocknr);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_READ
+		ll_rw_block(READ_META, 1, &bh);
+#else
+		ll_rw_block(READ, 1, &bh);
+#endif
+	}
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_READ
+	for (i = 0; i < count; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			return -EIO;
+	}
+#endif
+
+	for (done = 0; done < count; done += n) {
+		/* check if blocks are mapped in snapshot */
+		n = next3_snapshot_map_blocks(handle, snapshot, block + done,
+				count - done, &blk, SNAPMAP_READ);
+		if (n < 0)
+			return n;
+		if (n > 0)
+			goto mapped;
+
+		/* blocks need to be COWed */
+		if (!cow)
+			/* don't COW - we were just checking */
+			return -EIO;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_READ
+		/* wait for the source buffers that we may need to copy */
+		for (i = done; i < count; i++) {
+			wait_on_buffer(bhs[i]);
+			if (!buffer_uptodate(bhs[i]))
+				return -EIO;
+		}
+#endif
+
+		/* try to allocate snapshot blocks for the rest of the run */
+		dummy.b_state = 0;
+		dummy.b_blocknr = 0;
+		n = next3_get_blocks_handle(handle, snapshot,
+				SNAPSHOT_IBLOCK(block + done), count - done,
+				&dummy, SNAPMAP_COW);
+		if (n <= 0)
+			return n ? n : -EIO;
+		blk = dummy.b_blocknr;
+		if (!buffer_new(&dummy))
+			/*
+			 * we didn't allocate these blocks -
+			 * another COWing task must have allocated them
+			 */
+			goto mapped;
+
+		/*
+		 * we allocated these blocks -
+		 * copy blocks data to snapshot and complete COW operations.
+		 * the pending COW refcount keeps the snapshot buffers cached.
+		 */
+		for (i = 0; i < n; i++) {
+			sbh = sb_getblk(sb, blk + i);
+			if (!sbh) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
+				/*
+				 * the pending COW refcount should have kept
+				 * the buffer cached - if it is there, cancel
+				 * the pending COW, so waiters don't hang.
+				 */
+				sbh = sb_find_get_block(sb, blk + i);
+				if (sbh) {
+					next3_snapshot_end_pending_cow(sbh);
+					brelse(sbh);
+				}
+#endif
+				err = -EIO;
+				continue;
+			}
+			lock_buffer(sbh);
+			clear_buffer_uptodate(sbh);
+			/* completes (or cancels) the pending COW of sbh */
+			ret = next3_snapshot_copy_buffer_cow(handle, sbh,
+							     bhs[done + i]);
+			brelse(sbh);
+			if (ret && !err)
+				err = ret;
+			trace_cow_inc(handle, copied);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TASK_IO
+			task_io_account_snapshot_cow(1, sb->s_blocksize);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+			next3_snapshot_usage_add(snapshot, 1, 0);
+#endif
+		}
+		if (err)
+			return err;
+		snapshot_debug(3, "blocks [%lu-%lu/%lu] of snapshot (%u) "
+				"mapped to blocks [%lu/%lu]\n",
+				SNAPSHOT_BLOCK_GROUP_OFFSET(block + done),
+				SNAPSHOT_BLOCK_GROUP_OFFSET(block + done + n - 1),
+				SNAPSHOT_BLOCK_GROUP(block + done),
+				snapshot->i_generation,
+				SNAPSHOT_BLOCK_TUPLE(blk));
+		continue;
+mapped:
+		for (i = 0; i < n; i++) {
+			trace_cow_inc(handle, ok_mapped);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
+			sbh = sb_find_get_block(sb, blk + i);
+			if (sbh)
+				/* wait for pending COW to complete */
+				next3_snapshot_test_pending_cow(sbh,
+						block + done + i);
+			brelse(sbh);
+#endif
+		}
+	}
+	return 0;
+}
+
+/*
+ * next3_snapshot_test_and_cow_blocks - COW an array of metadata blocks
+ * @where:	name of caller function
+ * @handle:	JBD handle
+ * @inode:	owner of blocks (NULL for global metadata blocks)
+ * @bhs:	buffer heads of metadata blocks
+ * @count:	no. of buffers in @bhs
+ * @cow:	if false, return -EIO if any block needs to be COWed
+ *
+ * Vectored variant of next3_snapshot_test_and_cow().
+ * The blocks are tested against the COW bitmap in one pass, reading each
+ * COW bitmap block once per block group, and runs of subsequent blocks,
+ * which are in use by snapshot, are COWed in one batch.
+ * For best results, @bhs should be sorted by block number.
+ *
+ * Return values:
+ * = 0 - all blocks were COWed or don't need to be COWed
+ * < 0 - error
+ */
+int next3_snapshot_test_and_cow_blocks(const char *where, handle_t *handle,
+		struct inode *inode, struct buffer_head **bhs, int count,
+		int cow)
+{
+	struct super_block *sb = handle->h_transaction->t_journal->j_private;
+	struct inode *active_snapshot = next3_snapshot_has_active(sb);
+	struct buffer_head *batch[NEXT3_SNAPSHOT_COW_BATCH];
+	struct buffer_head *cow_bh = NULL, *bh;
+	unsigned long block_group = 0;
+	int i, n = 0, err = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+	int live = 0, inuse;
+#endif
+
+	if (!active_snapshot || count <= 0)
+		/* no active snapshot - no need to COW */
+		return 0;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
+	/* same owner checks as next3_snapshot_test_and_cow() */
+	if (inode && next3_snapshot_exclude_inode(inode)) {
+		snapshot_debug_hl(4, "exclude bitmap update - "
+				  "skip block cow!\n");
+		return 0;
+	}
+#endif
+	if (count == 1 || IS_COWING(handle) ||
+			(inode && next3_snapshot_excluded(inode))) {
+		/*
+		 * Single block, active snapshot update or excluded file
+		 * block access - none of these benefit from batching.
+		 */
+		for (i = 0; i < count && !err; i++)
+			err = next3_snapshot_test_and_cow(where, handle, inode,
+							  bhs[i], cow);
+		return err;
+	}
+	if (inode == active_snapshot) {
+		/* active snapshot may only be modified during COW */
+		snapshot_debug_hl(4, "active snapshot access denied!\n");
+		return -EPERM;
+	}
+
+	/* BEGIN COWing */
+	next3_snapshot_cow_begin(handle);
+
+	for (i = 0; i < count; i++) {
+		bh = bhs[i];
+		next3_snapshot_trace_cow(where, handle, sb, inode, bh,
+					 bh->b_blocknr, cow);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
+		/* check if the buffer was COWed in the current transaction */
+		if (next3_snapshot_test_cowed(handle, bh)) {
+			trace_cow_inc(handle, ok_jh);
+			continue;
+		}
+#endif
+		if (bh->b_blocknr >= SNAPSHOT_BLOCKS(active_snapshot))
+			/* block is past the last f/s block of snapshot */
+			continue;
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+		if (!inode) {
+			err = next3_snapshot_cow_flex_bitmap(handle,
+					active_snapshot, bh->b_blocknr);
+			if (err < 0)
+				goto out;
+		}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		/* read the COW bitmap once per block group */
+		if ((!cow_bh && !live) || SNAPSHOT_BLOCK_GROUP(bh->b_blocknr) !=
+				block_group) {
+			brelse(cow_bh);
+			block_group = SNAPSHOT_BLOCK_GROUP(bh->b_blocknr);
+			live = 0;
+			cow_bh = next3_snapshot_read_cow_bitmap(handle,
+					active_snapshot, block_group, &live);
+			if (!cow_bh && !live) {
+				err = -EIO;
+				goto out;
+			}
+		}
+		inuse = -EAGAIN;
+		if (live) {
+			inuse = next3_snapshot_test_live_bitmap(sb, block_group,
+				SNAPSHOT_BLOCK_GROUP_OFFSET(bh->b_blocknr),
+				SNAPSHOT_BLOCK_GROUP_OFFSET(bh->b_blocknr) + 1,
+				NULL);
+			if (inuse == -EAGAIN) {
+				/* block bitmap changed - read COW bitmap */
+				live = 0;
+				cow_bh = next3_snapshot_read_cow_bitmap(handle,
+					active_snapshot, block_group, NULL);
+				if (!cow_bh) {
+					err = -EIO;
+					goto out;
+				}
+			} else if (inuse < 0) {
+				err = inuse;
+				goto out;
+			}
+		}
+		if (inuse == -EAGAIN)
+			inuse = next3_test_bit(
+				SNAPSHOT_BLOCK_GROUP_OFFSET(bh->b_blocknr),
+				cow_bh->b_data);
+		if (inuse) {
+#else
+		/* read the COW bitmap once per block group */
+		if (!cow_bh || SNAPSHOT_BLOCK_GROUP(bh->b_blocknr) !=
+				block_group) {
+			brelse(cow_bh);
+			block_group = SNAPSHOT_BLOCK_GROUP(bh->b_blocknr);
+			cow_bh = next3_snapshot_read_cow_bitmap(handle,
+					active_snapshot, block_group);
+			if (!cow_bh) {
+				err = -EIO;
+				goto out;
+			}
+		}
+		if (next3_test_bit(SNAPSHOT_BLOCK_GROUP_OFFSET(bh->b_blocknr),
+					cow_bh->b_data)) {
+#endif
+			/* block is in use by snapshot - add to batch */
+			if (n > 0 && (n == NEXT3_SNAPSHOT_COW_BATCH ||
+				bh->b_blocknr != batch[n-1]->b_blocknr + 1)) {
+				err = next3_snapshot_cow_batch(handle,
+						active_snapshot, batch, n, cow);
+				if (err)
+					goto out;
+				n = 0;
+			}
+			batch[n++] = bh;
+			continue;
+		}
+		trace_cow_inc(handle, ok_bitmap);
+	}
+
+	if (n > 0)
+		err = next3_snapshot_cow_batch(handle, active_snapshot,
+					       batch, n, cow);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
+	/* mark all the buffers COWed in the current transaction */
+	for (i = 0; !err && i < count; i++)
+		next3_snapshot_mark_cowed(handle, bhs[i]);
+#endif
+out:
+	brelse(cow_bh);
+	/* END COWing */
+	next3_snapshot_cow_end(where, handle, bhs[0]->b_blocknr, err);
+	return err;
+}
+#endif
+
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE
 /*
@@ -1157,6 +3024,8 @@ out:
  * @block:	address of first block to move
  * @maxblocks:	max. blocks to move
  * @move:	if false, only test if @block needs to be moved
+ * @pclear:	if not NULL, returns no. of blocks that don't need to be moved
+ *		(only when returning 0)
  *
  * Return values:
  * > 0 - no. of blocks that were (or needs to be) moved to snapshot
@@ -1164,7 +3033,8 @@ out:
  * < 0 - error
  */
 int next3_snapshot_test_and_move(const char *where, handle_t *handle,
-	struct inode *inode, next3_fsblk_t block, int maxblocks, int move)
+	struct inode *inode, next3_fsblk_t block, int maxblocks, int move,
+	int *pclear)
 {
 	struct super_block *sb = handle->h_transaction->t_journal->j_private;
 	struct inode *active_snapshot = next3_snapshot_has_active(sb);
@@ -1172,9 +3042,26 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 	int err = 0, count = maxblocks;
 	int excluded = 0;
 
-	if (!active_snapshot)
+	if (pclear)
+		*pclear = 1;
+	if (!active_snapshot) {
 		/* no active snapshot - no need to move */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		if (pclear)
+			*pclear = maxblocks;
+#endif
+		return 0;
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
+	if (inode && next3_snapshot_excluded(inode) > 0) {
+		/* excluded file blocks were excluded on allocation */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+		if (pclear)
+			*pclear = maxblocks;
+#endif
 		return 0;
+	}
+#endif
 
 	next3_snapshot_trace_cow(where, handle, sb, inode, NULL, block, move);
 
@@ -1182,6 +3069,10 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 
 	/* BEGIN moving */
 	next3_snapshot_cow_begin(handle);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_snapshot_test_and_move_enter(sb,
+			active_snapshot->i_generation, block);
+#endif
 
 	if (inode)
 		excluded = next3_snapshot_excluded(inode);
@@ -1192,10 +3083,20 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 		move = 0;
 	}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	/* check if the block was handled in the current transaction */
+	if (maxblocks == 1 && !excluded &&
+	    next3_snapshot_cow_set_test(handle, block)) {
+		snapshot_debug_hl(4, "block found in COW set - "
+				  "skip block move!\n");
+		goto out;
+	}
+
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP
 	/* get the COW bitmap and test if blocks are in use by snapshot */
 	err = next3_snapshot_test_cow_bitmap(handle, active_snapshot,
-			block, count, excluded ? inode : NULL);
+			block, count, excluded ? inode : NULL, pclear);
 	if (err < 0)
 		goto out;
 	count = err;
@@ -1206,6 +3107,10 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 	if (!err) {
 		/* block not in COW bitmap - no need to move */
 		trace_cow_inc(handle, ok_bitmap);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+		if (!excluded)
+			next3_snapshot_cow_set_add(handle, block, 1);
+#endif
 		goto out;
 	}
 
@@ -1232,6 +3137,9 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 	if (err > 0) {
 		/* block already mapped in snapshot - no need to move */
 		trace_cow_inc(handle, ok_mapped);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+		next3_snapshot_cow_set_add(handle, block, 1);
+#endif
 		err = 0;
 		goto out;
 	}
@@ -1253,8 +3161,16 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 	 * Snapshot file owner was charged for these blocks
 	 * when they were mapped to snapshot file.
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	if (inode)
+		next3_snapshot_dquot_free(handle, inode, count);
+#else
 	if (inode)
 		dquot_free_block(inode, count);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	next3_snapshot_usage_add(active_snapshot, 0, count);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
 	/* mark moved blocks in exclude bitmap */
 	excluded = next3_snapshot_exclude_blocks(handle, sb, block, count);
@@ -1262,7 +3178,18 @@ int next3_snapshot_test_and_move(const char *where, handle_t *handle,
 		err = excluded;
 #endif
 	trace_cow_add(handle, moved, count);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TASK_IO
+	task_io_account_snapshot_move(count);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	/* moved blocks are mapped in snapshot - no need to move again */
+	next3_snapshot_cow_set_add(handle, block, count);
+#endif
 out:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	trace_next3_snapshot_test_and_move(sb, active_snapshot->i_generation,
+			inode ? inode->i_ino : 0, block, maxblocks, move, err);
+#endif
 	/* END moving */
 	next3_snapshot_cow_end(where, handle, block, err);
 	return err;
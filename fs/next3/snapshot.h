@@ -19,6 +19,16 @@
 #include <linux/delay.h>
 #include "next3_jbd.h"
 #include "snapshot_debug.h"
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+#include <trace/events/next3.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+#include <linux/hash.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+#include <linux/iocontext.h>
+#include <linux/ioprio.h>
+#endif
 
 
 #define NEXT3_SNAPSHOT_VERSION "next3 snapshot v1.0.13-rc6 (14-Dec-2010)"
@@ -93,6 +103,15 @@ static inline void dquot_free_block(struct inode *inode, qsize_t nr)
 #define SNAPSHOT_IBLOCK(block)						\
 	(next3_fsblk_t)((block) + SNAPSHOT_BLOCK_OFFSET)
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_REGION
+/*
+ * The last 1/16 of every block group is the preferred place for snapshot
+ * file copied blocks.  Live file allocation goals avoid this region.
+ */
+#define NEXT3_SNAPSHOT_REGION_BLOCKS(sb)	\
+	(NEXT3_BLOCKS_PER_GROUP(sb) >> 4)
+
+#endif
 #define SNAPSHOT_BYTES_OFFSET					\
 	(SNAPSHOT_BLOCK_OFFSET << SNAPSHOT_BLOCK_SIZE_BITS)
 #define SNAPSHOT_ISIZE(size)			\
@@ -119,6 +138,9 @@ enum next3_bh_state_bits {
 							 * to serialize write I/O to block device.
 							 * that is, don't write over this block
 							 * until I finished reading it. */
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+	BH_Delay_Move = 27,		/* Move-on-write may be delayed to writeback */
 #endif
 	BH_Partial_Write = 29,	/* Buffer should be uptodate before write */
 	BH_Direct_IO = 30,		/* Buffer is under direct I/O */
@@ -128,10 +150,20 @@ enum next3_bh_state_bits {
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
 BUFFER_FNS(Tracked_Read, tracked_read)
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+BUFFER_FNS(Delay_Move, delay_move)
+#endif
 BUFFER_FNS(Partial_Write, partial_write)
 BUFFER_FNS(Direct_IO, direct_io)
 BUFFER_FNS(Move_Data, move_data)
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_DIRTY
+enum next3_cow_bh_state_bits {
+	BH_Cow_Write = 26,	/* COW write is accounted as writeback */
+};
+
+BUFFER_FNS(Cow_Write, cow_write)
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL
 /*
@@ -142,6 +174,48 @@ extern void next3_snapshot_get_flags(struct next3_inode_info *ei,
 extern int next3_snapshot_set_flags(handle_t *handle, struct inode *inode,
 				    unsigned int flags);
 extern int next3_snapshot_take(struct inode *inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+extern int next3_snapshot_get_usage(struct inode *inode,
+				    struct next3_snapshot_usage *usage);
+
+/*
+ * account @copied and @moved blocks to @snapshot space usage.
+ * the counters are stored in the snapshot inode on its next update,
+ * which usually happens in the same transaction, when the blocks are
+ * mapped to the snapshot file.
+ */
+static inline void next3_snapshot_usage_add(struct inode *snapshot,
+		int copied, int moved)
+{
+	if (copied)
+		atomic_add(copied, &NEXT3_SNAP_I(snapshot)->i_snap_copied);
+	if (moved)
+		atomic_add(moved, &NEXT3_SNAP_I(snapshot)->i_snap_moved);
+}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+extern int next3_snapshot_get_diff(struct inode *inode,
+				   struct next3_snapshot_diff *diff,
+				   struct next3_snapshot_diff_extent *extents);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+extern int next3_snapshot_get_map(struct inode *inode,
+				  struct next3_snapshot_map *map,
+				  struct next3_snapshot_map_extent *extents);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIEMAP
+extern int next3_snapshot_fiemap(struct inode *inode,
+				 struct fiemap_extent_info *fieinfo,
+				 u64 start, u64 len);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+extern int next3_snapshot_verify(struct inode *inode,
+				 struct next3_snapshot_verify *verify);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+extern int next3_snapshot_rollback(struct inode *inode,
+				   struct next3_snapshot_rollback *rollback);
+#endif
 
 #endif
 
@@ -164,6 +238,10 @@ extern int next3_snapshot_take(struct inode *inode);
 #define SNAPMAP_SYNC	0x8
 /* creating COW bitmap - handle COW races and bypass journal */
 #define SNAPMAP_BITMAP	(SNAPMAP_COW|SNAPMAP_SYNC)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+/* pre-allocating snapshot indirect blocks - allocate no data blocks */
+#define SNAPMAP_IND	0x10
+#endif
 
 /* original @create flag test - only check map or create map? */
 #define SNAPMAP_ISREAD(cmd)	((cmd) == SNAPMAP_READ)
@@ -174,12 +252,41 @@ extern int next3_snapshot_take(struct inode *inode);
 #define SNAPMAP_ISCOW(cmd)	((cmd) & SNAPMAP_COW)
 #define SNAPMAP_ISMOVE(cmd)	((cmd) & SNAPMAP_MOVE)
 #define SNAPMAP_ISSYNC(cmd)	((cmd) & SNAPMAP_SYNC)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_PREALLOC_IND
+#define SNAPMAP_ISIND(cmd)	((cmd) & SNAPMAP_IND)
+#endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+extern void next3_snapshot_dquot_free(handle_t *handle, struct inode *inode,
+				      unsigned long count);
+extern unsigned long next3_snapshot_dquot_net(handle_t *handle,
+					      struct inode *inode,
+					      unsigned long count);
+extern void next3_snapshot_dquot_flush(handle_t *handle);
+
+#endif
 /* helper functions for next3_snapshot_create() */
 extern int next3_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 				     next3_snapblk_t block,
 				     unsigned long maxblocks,
 				     next3_fsblk_t *mapped, int cmd);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+extern void next3_snapshot_map_invalidate(struct inode *inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+/* helper functions for next3_get_blocks_handle() */
+extern int next3_snapshot_read_cache_lookup(struct inode *inode,
+		sector_t iblock, next3_fsblk_t *mapped, unsigned int *gen);
+extern void next3_snapshot_read_cache_insert(struct inode *inode,
+		sector_t iblock, next3_fsblk_t mapped, struct inode *owner,
+		unsigned int gen);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+extern struct inode *next3_snapshot_read_skip(struct inode *inode,
+		next3_fsblk_t block);
+#endif
+#else
+#define next3_snapshot_map_invalidate(inode) do {} while (0)
+#endif
 /* helper function for next3_snapshot_take() */
 extern void next3_snapshot_copy_buffer(struct buffer_head *sbh,
 					   struct buffer_head *bh,
@@ -187,6 +294,9 @@ extern void next3_snapshot_copy_buffer(struct buffer_head *sbh,
 /* helper function for next3_snapshot_get_block() */
 extern int next3_snapshot_read_block_bitmap(struct super_block *sb,
 		unsigned int block_group, struct buffer_head *bitmap_bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+extern void next3_snapshot_drop_fixed_bitmaps(struct super_block *sb);
+#endif
 
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW
@@ -201,6 +311,19 @@ extern int next3_snapshot_test_and_cow(const char *where,
 #define next3_snapshot_cow(handle, inode, bh, cow)		\
 	next3_snapshot_test_and_cow(__func__, handle, inode,	\
 			bh, cow)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+extern int next3_snapshot_test_and_cow_blocks(const char *where,
+		handle_t *handle, struct inode *inode,
+		struct buffer_head **bhs, int count, int cow);
+
+/*
+ * test if an array of metadata blocks should be COWed
+ * and if they should, copy the blocks to the active snapshot in one pass
+ */
+#define next3_snapshot_cow_blocks(handle, inode, bhs, count, cow)	\
+	next3_snapshot_test_and_cow_blocks(__func__, handle, inode,	\
+			bhs, count, cow)
+#endif
 #else
 #define next3_snapshot_cow(handle, inode, bh, cow) 0
 #endif
@@ -208,7 +331,7 @@ extern int next3_snapshot_test_and_cow(const char *where,
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE
 extern int next3_snapshot_test_and_move(const char *where,
 		handle_t *handle, struct inode *inode,
-		next3_fsblk_t block, int maxblocks, int move);
+		next3_fsblk_t block, int maxblocks, int move, int *pclear);
 
 /*
  * test if blocks should be moved to snapshot
@@ -216,7 +339,16 @@ extern int next3_snapshot_test_and_move(const char *where,
  */
 #define next3_snapshot_move(handle, inode, block, num, move)	\
 	next3_snapshot_test_and_move(__func__, handle, inode,	\
-			block, num, move)
+			block, num, move, NULL)
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+/*
+ * same as next3_snapshot_move(), but if @block doesn't need to be moved,
+ * also returns the no. of blocks from @block that don't need to be moved
+ */
+#define next3_snapshot_move_runs(handle, inode, block, num, move, pclear) \
+	next3_snapshot_test_and_move(__func__, handle, inode,	\
+			block, num, move, pclear)
+#endif
 #else
 #define next3_snapshot_move(handle, inode, block, num, move) (num)
 #endif
@@ -238,9 +370,32 @@ extern int next3_snapshot_test_and_move(const char *where,
 static inline int next3_snapshot_get_write_access(handle_t *handle,
 		struct inode *inode, struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
 	return next3_snapshot_cow(handle, inode, bh, 1);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_COW_BATCH
+/*
+ * get_write_access() to an array of metadata blocks
+ *
+ * Return values:
+ * = 0 - blocks were COWed or don't need to be COWed
+ * < 0 - error
+ */
+static inline int next3_snapshot_get_write_access_blocks(handle_t *handle,
+		struct inode *inode, struct buffer_head **bhs, int count)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
+	return next3_snapshot_cow_blocks(handle, inode, bhs, count, 1);
+}
+#endif
+
 /*
  * called from next3_journal_get_undo_access(),
  * which is called for group bitmap block from:
@@ -254,6 +409,10 @@ static inline int next3_snapshot_get_write_access(handle_t *handle,
 static inline int next3_snapshot_get_undo_access(handle_t *handle,
 		struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP
 	/*
 	 * undo access is only requested for block bitmaps, which should be
@@ -275,6 +434,10 @@ static inline int next3_snapshot_get_undo_access(handle_t *handle,
 static inline int next3_snapshot_get_create_access(handle_t *handle,
 		struct buffer_head *bh)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
 	/*
 	 * This block shouldn't need to be COWed if get_delete_access() was
 	 * called for all deleted blocks.  However, it may need to be COWed
@@ -298,7 +461,7 @@ static inline int next3_snapshot_get_create_access(handle_t *handle,
  * whose data is not being journaled are moved on full page write.
  * Journaled data blocks are COWed on get_write_access().
  * Snapshots and excluded files blocks are never moved-on-write.
- * If @move is true, then truncate_mutex is held.
+ * If @move is true, then truncate_sem is held.
  *
  * Return values:
  * = 1 - @block was moved or may not be overwritten
@@ -308,6 +471,10 @@ static inline int next3_snapshot_get_create_access(handle_t *handle,
 static inline int next3_snapshot_get_move_access(handle_t *handle,
 		struct inode *inode, next3_fsblk_t block, int move)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
 	return next3_snapshot_move(handle, inode, block, 1, move);
 }
 
@@ -321,7 +488,7 @@ static inline int next3_snapshot_get_move_access(handle_t *handle,
  * @count:	no. of blocks to move
  *
  * Called from next3_free_blocks_sb_inode() before deleting blocks with
- * truncate_mutex held
+ * truncate_sem held
  *
  * Return values:
  * > 0 - no. of blocks that were moved to snapshot and may not be deleted
@@ -331,8 +498,32 @@ static inline int next3_snapshot_get_move_access(handle_t *handle,
 static inline int next3_snapshot_get_delete_access(handle_t *handle,
 		struct inode *inode, next3_fsblk_t block, int count)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle)))
+		return 0;
+#endif
 	return next3_snapshot_move(handle, inode, block, count, 1);
 }
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_SCAN
+/*
+ * get_delete_access_runs() - move count blocks to snapshot
+ * Same as get_delete_access(), but when returning 0, also returns in
+ * @pclear the no. of blocks from @block that may be deleted.
+ */
+static inline int next3_snapshot_get_delete_access_runs(handle_t *handle,
+		struct inode *inode, next3_fsblk_t block, int count,
+		int *pclear)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	if (likely(!next3_handle_has_snapshot(handle))) {
+		*pclear = count;
+		return 0;
+	}
+#endif
+	return next3_snapshot_move_runs(handle, inode, block, count, 1,
+					pclear);
+}
+#endif
 
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
@@ -378,6 +569,54 @@ extern int next3_snapshot_get_inode_access(handle_t *handle,
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
 extern void init_next3_snapshot_cow_cache(void);
+extern int next3_snapshot_cow_cache_enabled(void);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_BITMAP
+extern void init_next3_snapshot_cow_bitmap_wait(void);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+extern int init_next3_snapshot_cow_bitmap_work(void);
+extern void exit_next3_snapshot_cow_bitmap_work(void);
+extern void next3_snapshot_cow_bitmap_work_init(struct super_block *sb);
+extern void next3_snapshot_cow_bitmap_work_start(struct super_block *sb);
+extern void next3_snapshot_cow_bitmap_work_stop(struct super_block *sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+extern int init_next3_snapshot_cleanup_work(void);
+extern void exit_next3_snapshot_cleanup_work(void);
+extern void next3_snapshot_cleanup_work_init(struct super_block *sb);
+extern void next3_snapshot_cleanup_work_start(struct super_block *sb,
+					      unsigned long delay);
+extern void next3_snapshot_cleanup_work_stop(struct super_block *sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+extern int next3_snapshot_reclaim(struct super_block *sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+extern int next3_snapshot_ctl_queue(struct file *filp, unsigned int op,
+				    u64 *seq);
+extern int next3_snapshot_ctl_status(struct super_block *sb,
+				     struct next3_snapshot_ctl *ctl);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+/* snapshot_mount.c */
+extern int init_next3_snapshot_mount(void);
+extern void exit_next3_snapshot_mount(void);
+extern int next3_snapshot_mount_option(void *data, __u32 *pid);
+extern int next3_snapshot_get_sb(struct file_system_type *fs_type,
+		int flags, const char *dev_name, void *data, __u32 id,
+		int (*fill_super)(struct super_block *, void *, int),
+		struct vfsmount *mnt);
+extern void next3_snapshot_kill_sb(struct super_block *sb);
+/* snapshot_ctl.c */
+extern struct inode *next3_snapshot_mount_get(struct super_block *sb,
+					      __u32 id);
+extern void next3_snapshot_mount_put(struct inode *inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+extern void next3_snapshot_reserve_work_init(struct super_block *sb);
+extern void next3_snapshot_reserve_work_start(struct super_block *sb);
+extern void next3_snapshot_reserve_work_stop(struct super_block *sb);
 #endif
 
 /*
@@ -391,16 +630,61 @@ extern void next3_snapshot_destroy(struct super_block *sb);
 
 static inline int init_next3_snapshot(void)
 {
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_MOUNT)
+	int err;
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	err = init_next3_snapshot_cow_bitmap_work();
+	if (err)
+		return err;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	err = init_next3_snapshot_cleanup_work();
+	if (err) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+		exit_next3_snapshot_cow_bitmap_work();
+#endif
+		return err;
+	}
+#endif
 	init_next3_snapshot_debug();
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
 	init_next3_snapshot_cow_cache();
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	err = init_next3_snapshot_mount();
+	if (err) {
+		exit_next3_snapshot_debug();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+		exit_next3_snapshot_cleanup_work();
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+		exit_next3_snapshot_cow_bitmap_work();
+#endif
+		return err;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_BITMAP
+	init_next3_snapshot_cow_bitmap_wait();
 #endif
 	return 0;
 }
 
 static inline void exit_next3_snapshot(void)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	exit_next3_snapshot_mount();
+#endif
 	exit_next3_snapshot_debug();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	exit_next3_snapshot_cleanup_work();
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	exit_next3_snapshot_cow_bitmap_work();
+#endif
 }
 
 
@@ -411,6 +695,11 @@ extern struct buffer_head *read_block_bitmap(struct super_block *sb,
 extern struct buffer_head *read_exclude_bitmap(struct super_block *sb,
 					       unsigned int block_group);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+/* snapshot_ctl.c */
+extern unsigned long next3_exclude_bitmap_blk(struct super_block *sb,
+					      unsigned int block_group);
+#endif
 
 /* namei.c */
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
@@ -453,6 +742,9 @@ extern int next3_snapshot_merge_blocks(handle_t *handle,
 struct kstatfs;
 extern int next3_statfs_sb(struct super_block *sb, struct kstatfs *buf);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+extern int next3_snapshot_info_alloc(struct inode *inode);
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 /* tests if @inode is a snapshot file */
@@ -507,7 +799,7 @@ static inline int next3_snapshot_excluded(struct inode *inode)
 		return -1;
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
-	/* XXX: exclude file with 'nosnap' flag (Experimental) */
+	/* exclude file with 'nosnap' flag */
 	if (NEXT3_I(inode)->i_flags & NEXT3_NOSNAP_FL)
 		return 1;
 #endif
@@ -533,6 +825,30 @@ static inline int next3_snapshot_should_move_data(struct inode *inode)
 		return 0;
 	return 1;
 }
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DELAY
+/*
+ * check if move-on-write of the data blocks of @inode may be delayed to
+ * writeback. the new blocks are allocated at writeback time, so only delay
+ * moves while free space is well above the reserved blocks watermark.
+ */
+static inline int next3_snapshot_should_delay_move(struct inode *inode)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_super_block *es = sbi->s_es;
+	next3_fsblk_t free_blocks, watermark;
+
+	if (!next3_should_order_data(inode))
+		return 0;
+	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+	watermark = le32_to_cpu(es->s_r_blocks_count) +
+		(le32_to_cpu(es->s_blocks_count) >> 6);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+	watermark += le64_to_cpu(es->s_snapshot_r_blocks_count);
+#endif
+	return free_blocks > watermark;
+}
+#endif
 #endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
@@ -557,6 +873,68 @@ static inline int next3_snapshot_is_active(struct inode *inode)
 }
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+/*
+ * Snapshot maintenance I/O (shrink, merge and COW bitmaps pre-init) is
+ * submitted with the I/O class and level set in sysfs, so the I/O scheduler
+ * can serve it after foreground I/O.  I/O class 0 (none) keeps the I/O
+ * priority of the calling task.
+ * Returns the previous I/O priority, for next3_snapshot_io_end().
+ */
+static inline int __next3_snapshot_io_begin(unsigned int class,
+		unsigned int level)
+{
+	struct io_context *ioc = current->io_context;
+	int old = ioc ? ioc->ioprio : 0;
+	int ioprio;
+
+	if (class == IOPRIO_CLASS_NONE || class > IOPRIO_CLASS_IDLE)
+		return old;
+	ioprio = IOPRIO_PRIO_VALUE(class,
+			min_t(unsigned int, level, IOPRIO_BE_NR - 1));
+	if (ioprio != old)
+		set_task_ioprio(current, ioprio);
+	return old;
+}
+
+static inline int next3_snapshot_io_begin(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	return __next3_snapshot_io_begin(sbi->s_snapshot_io_class,
+					 sbi->s_snapshot_io_level);
+}
+
+static inline void next3_snapshot_io_end(int ioprio)
+{
+	struct io_context *ioc = current->io_context;
+
+	if (ioc && ioc->ioprio != ioprio)
+		set_task_ioprio(current, ioprio);
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+/*
+ * Snapshot file read through I/O is submitted with the I/O priority set on
+ * the open file by NEXT3_IOC_SNAPSHOT_IOPRIO (stored in file->private_data)
+ * or else with the read I/O class and level set in sysfs, so long backup
+ * streams don't compete with foreground I/O under the reader's priority.
+ */
+static inline int next3_snapshot_read_io_begin(struct file *file,
+		struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int ioprio = file ? (int)(long)file->private_data : 0;
+
+	if (ioprio)
+		return __next3_snapshot_io_begin(IOPRIO_PRIO_CLASS(ioprio),
+						 IOPRIO_PRIO_DATA(ioprio));
+	return __next3_snapshot_io_begin(sbi->s_snapshot_read_io_class,
+					 sbi->s_snapshot_read_io_level);
+}
+#endif
+#endif
+
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW
 /*
  * Pending COW functions
@@ -590,21 +968,57 @@ static inline void next3_snapshot_end_pending_cow(struct buffer_head *sbh)
 	 * indicates that the COW operation is complete.
 	 */
 	clear_buffer_new(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	/* wake up readers in next3_snapshot_test_pending_cow() */
+	smp_mb__after_clear_bit();
+	wake_up_bit(&sbh->b_state, BH_New);
+#endif
 	/* we no longer need to keep the buffer in cache */
 	put_bh(sbh);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+extern void next3_snapshot_cow_batch_flush(struct super_block *sb);
+extern void next3_snapshot_cow_batch_commit(journal_t *journal,
+		transaction_t *transaction);
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+extern int next3_snapshot_wait_pending_cow(void *word);
+
+#endif
 /*
  * Test for pending COW operation and wait for its completion.
  */
 static inline void next3_snapshot_test_pending_cow(struct buffer_head *sbh,
 						sector_t blocknr)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	int waits = 0;
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+	if (buffer_new(sbh)) {
+		/* wait for pending COW to complete */
+		snapshot_debug_once(2, "waiting for pending cow: "
+				"block = [%lu/%lu]...\n",
+				SNAPSHOT_BLOCK_TUPLE(blocknr));
+		snapshot_stats_inc(sbh->b_bdev->bd_super, pending_cow_wait);
+		/* woken up by next3_snapshot_end_pending_cow() */
+		wait_on_bit(&sbh->b_state, BH_New,
+			    next3_snapshot_wait_pending_cow,
+			    TASK_UNINTERRUPTIBLE);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+		waits++;
+#endif
+	}
+#else
 	while (buffer_new(sbh)) {
 		/* wait for pending COW to complete */
 		snapshot_debug_once(2, "waiting for pending cow: "
 				"block = [%lu/%lu]...\n",
 				SNAPSHOT_BLOCK_TUPLE(blocknr));
+		snapshot_stats_inc(sbh->b_bdev->bd_super, pending_cow_wait);
 		/*
 		 * An unusually long pending COW operation can be caused by
 		 * the debugging function snapshot_test_delay(SNAPTEST_COW)
@@ -612,6 +1026,11 @@ static inline void next3_snapshot_test_pending_cow(struct buffer_head *sbh,
 		 * The new COW buffer is locked during those events, so wait
 		 * on the buffer before the short msleep.
 		 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+		/* the locked COW buffer may be waiting in the COW batch */
+		if (buffer_locked(sbh))
+			next3_snapshot_cow_batch_flush(sbh->b_bdev->bd_super);
+#endif
 		wait_on_buffer(sbh);
 		/*
 		 * This is an unlikely event that can happen only once per
@@ -620,7 +1039,16 @@ static inline void next3_snapshot_test_pending_cow(struct buffer_head *sbh,
 		 */
 		msleep(1);
 		/* XXX: Should we fail after N retries? */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+		waits++;
+#endif
 	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_TRACE_EVENTS
+	if (waits)
+		trace_next3_snapshot_test_pending_cow(sbh->b_bdev->bd_super,
+				blocknr, waits);
+#endif
 }
 #endif
 
@@ -645,14 +1073,79 @@ static inline void put_bh_tracked_reader(struct buffer_head *bdev_bh)
 	atomic_sub(1<<BH_TRACKED_READERS_COUNT_SHIFT, &bdev_bh->b_count);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+/*
+ * Hashed tracked readers count of block device block @block.
+ * The counters array is allocated on mount.
+ */
+#define NEXT3_TRACKED_READERS_HASH_BITS	10
+#define NEXT3_TRACKED_READERS_HASH_SIZE	(1 << NEXT3_TRACKED_READERS_HASH_BITS)
+
+static inline atomic_t *next3_tracked_readers(struct super_block *sb,
+		sector_t block)
+{
+	return NEXT3_SB(sb)->s_tracked_readers +
+		hash_long((unsigned long)block, NEXT3_TRACKED_READERS_HASH_BITS);
+}
+
+static inline int buffer_tracked_readers_count(struct buffer_head *bdev_bh)
+{
+	/* pairs with smp_mb__after_atomic_inc() in start_buffer_tracked_read() */
+	smp_mb();
+	return atomic_read(next3_tracked_readers(bdev_bh->b_bdev->bd_super,
+				bdev_bh->b_blocknr));
+}
+#else
 static inline int buffer_tracked_readers_count(struct buffer_head *bdev_bh)
 {
 	return atomic_read(&bdev_bh->b_count)>>BH_TRACKED_READERS_COUNT_SHIFT;
 }
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_WAIT
+/*
+ * COWing tasks wait for the tracked readers of a block on a hashed wait
+ * queue, keyed by the address of the block's tracked readers count.
+ */
+static inline void *next3_tracked_readers_key(struct buffer_head *bh)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	return next3_tracked_readers(bh->b_bdev->bd_super, bh->b_blocknr);
+#else
+	return &bh->b_count;
+#endif
+}
+
+static inline wait_queue_head_t *next3_tracked_readers_wq(void *key)
+{
+	return bit_waitqueue(key, BH_Tracked_Read);
+}
+
+/*
+ * Wake up the COWing task after the last tracked reader of @bh is done.
+ * May be called from interrupt context.
+ */
+static inline void next3_tracked_readers_wake(struct buffer_head *bh)
+{
+	void *key = next3_tracked_readers_key(bh);
+
+	/* order the readers count update before the wait queue test */
+	smp_mb();
+	__wake_up_bit(next3_tracked_readers_wq(key), key, BH_Tracked_Read);
+}
+#endif
 
 extern int start_buffer_tracked_read(struct buffer_head *bh);
 extern void cancel_buffer_tracked_read(struct buffer_head *bh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_BDEV
+extern int copy_buffer_tracked_read(struct buffer_head *bh);
+#endif
 extern int next3_read_full_page(struct page *page, get_block_t *get_block);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READAHEAD
+extern int next3_read_full_pages(struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages,
+		get_block_t *get_block);
+#endif
 
 #ifdef CONFIG_NEXT3_FS_DEBUG
 extern void __next3_trace_bh_count(const char *fn, struct buffer_head *bh);
@@ -15,6 +15,21 @@
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
 #include <linux/statfs.h>
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+#include <linux/backing-dev.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+#include <linux/mount.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+#include <linux/kthread.h>
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIEMAP
+#include <linux/fiemap.h>
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+#include <linux/sort.h>
+#endif
 #include "snapshot.h"
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
@@ -50,6 +65,40 @@
  * fields on that struct (i.e. h_cowing, h_cow_*).
  */
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+/*
+ * next3_snapshot_phase_end() - account the time since @start to @phase
+ * Returns the current time, which is the start time of the next phase.
+ * Called under snapshot_mutex.
+ */
+static ktime_t next3_snapshot_phase_end(struct super_block *sb,
+		enum next3_snapshot_phase phase, ktime_t start)
+{
+	struct next3_snapshot_phase_stats *ps =
+		&NEXT3_SB(sb)->s_snapshot_phase[phase];
+	ktime_t now = ktime_get();
+	u64 us = ktime_us_delta(now, start);
+	int slot = fls64(us);
+
+	if (slot >= SNAPSHOT_PHASE_SLOTS)
+		slot = SNAPSHOT_PHASE_SLOTS - 1;
+	ps->count++;
+	ps->total_us += us;
+	if (us > ps->max_us)
+		ps->max_us = us;
+	ps->slots[slot]++;
+	return now;
+}
+
+#define snapshot_phase_start(t)	((t) = ktime_get())
+/* account phase since @t and restart @t for the next phase */
+#define snapshot_phase_next(sb, phase, t)				\
+	((t) = next3_snapshot_phase_end((sb), SNAPSHOT_PHASE_##phase, (t)))
+#else
+#define snapshot_phase_start(t)
+#define snapshot_phase_next(sb, phase, t)
+#endif
+
 /*
  * next3_snapshot_set_active - set the current active snapshot
  * First, if current active snapshot exists, it is deactivated.
@@ -93,6 +142,67 @@ static int next3_snapshot_set_active(struct super_block *sb,
 }
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+/*
+ * next3_snapshot_index_add() - index snapshot that was added to the list
+ * Failure to index a snapshot is not fatal, because lookup falls back to
+ * walking the list for snapshots that are not found in the index.
+ * Called under snapshot_mutex or under sb_lock during mount time.
+ */
+static void next3_snapshot_index_add(struct super_block *sb,
+		struct inode *inode)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int err;
+
+	sbi->s_snapshot_count++;
+	err = radix_tree_insert(&sbi->s_snapshot_index,
+				inode->i_generation, inode);
+	if (err)
+		snapshot_debug(1, "failed to index snapshot (%u) (err=%d)\n",
+			       inode->i_generation, err);
+}
+
+/*
+ * next3_snapshot_index_del() - remove snapshot that was removed from list
+ * Called under snapshot_mutex or under sb_lock during umount time.
+ */
+static void next3_snapshot_index_del(struct super_block *sb,
+		struct inode *inode)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_snapshot_count--;
+	if (radix_tree_lookup(&sbi->s_snapshot_index,
+			      inode->i_generation) == inode)
+		radix_tree_delete(&sbi->s_snapshot_index,
+				  inode->i_generation);
+}
+
+/*
+ * next3_snapshot_lookup() - find snapshot on the list by snapshot id
+ * Called under snapshot_mutex.
+ * Returns snapshot inode (without reference) or NULL if not found.
+ */
+static struct inode *next3_snapshot_lookup(struct super_block *sb,
+		__u32 id)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_inode_info *ei;
+	struct inode *inode;
+
+	inode = radix_tree_lookup(&sbi->s_snapshot_index, id);
+	if (inode)
+		return inode;
+	/* snapshot may have failed to be indexed */
+	list_for_each_entry(ei, &sbi->s_snapshot_list, i_snaplist)
+		if (ei->vfs_inode.i_generation == id)
+			return &ei->vfs_inode;
+	return NULL;
+}
+
+#endif
+
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP
 /*
  * next3_snapshot_reset_bitmap_cache():
@@ -101,6 +211,7 @@ static int next3_snapshot_set_active(struct super_block *sb,
  *
  * Called from init_bitmap_cache() with @init=1 under sb_lock during mount time.
  * Called from snapshot_take() with @init=0 under journal_lock_updates().
+ * Called from snapshot_destroy() with @init=0 during umount time.
  * Returns 0 on success and <0 on error.
  */
 static int next3_snapshot_reset_bitmap_cache(struct super_block *sb, int init)
@@ -108,10 +219,32 @@ static int next3_snapshot_reset_bitmap_cache(struct super_block *sb, int init)
 	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info;
 	int i;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	/* fixed block bitmaps of old active snapshot are stale */
+	if (!init)
+		next3_snapshot_drop_fixed_bitmaps(sb);
+#endif
 	for (i = 0; i < NEXT3_SB(sb)->s_groups_count; i++, gi++) {
 		gi->bg_cow_bitmap = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_LIVE
+		/* no block bitmap changed since take, but unknown on mount */
+		gi->bg_cow_bitmap_live = !init;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+		/* release pinned COW bitmap buffer of old active snapshot */
+		brelse(gi->bg_cow_bh);
+		gi->bg_cow_bh = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_FRESH
+		/* blocks allocated before take may be in new COW bitmap */
+		gi->bg_fresh_start = gi->bg_fresh_end = 0;
+#endif
 		if (init)
 			gi->bg_exclude_bitmap = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+		if (init)
+			gi->bg_exclude_loaded = 0;
+#endif
 		cond_resched();
 	}
 	return 0;
@@ -148,7 +281,8 @@ static int next3_snapshot_reset_bitmap_cache(struct super_block *sb, int init)
  * A snapshot on the list can be enabled for user read access by setting the
  * enabled flag (chattr -X +n) and disabled by clearing the enabled flag.
  * An enabled snapshot can be mounted via a loop device and mounted as a
- * read-only ext2 filesystem.
+ * read-only ext2 filesystem, or mounted without a loop device with the
+ * command: mount -t next3 -o ro,snapshot=<id> <device> <mount point>.
  *
  * 4. Deleting a snapshot
  * A non-mounted and disabled snapshot may be marked for removal from the
@@ -175,11 +309,19 @@ static int next3_snapshot_reset_bitmap_cache(struct super_block *sb, int init)
  */
 static int next3_snapshot_enable(struct inode *inode);
 static int next3_snapshot_disable(struct inode *inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ENABLE_FAST
+static void next3_snapshot_update_inuse(struct inode *inode);
+#endif
 static int next3_snapshot_create(struct inode *inode);
 static int next3_snapshot_delete(struct inode *inode);
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
 static int next3_snapshot_exclude(handle_t *handle, struct inode *inode);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+static int next3_snapshot_shrink_reset(handle_t *handle, struct inode *inode);
+#endif
+#endif
 
 /*
  * next3_snapshot_get_flags() check snapshot state
@@ -194,10 +336,30 @@ void next3_snapshot_get_flags(struct next3_inode_info *ei, struct file *filp)
 	 */
 	if ((ei->i_flags & NEXT3_SNAPFILE_LIST_FL) && open_count > 1)
 		ei->i_flags |= NEXT3_SNAPFILE_OPEN_FL;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	/* snapshot is mounted without a loop device */
+	else if (next3_test_inode_state(&ei->vfs_inode,
+					NEXT3_STATE_SNAPSHOT_MOUNT))
+		ei->i_flags |= NEXT3_SNAPFILE_OPEN_FL;
+#endif
 	else
 		ei->i_flags &= ~NEXT3_SNAPFILE_OPEN_FL;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
+/* tests if any blocks are mapped to @inode */
+static int next3_inode_has_blocks(struct inode *inode)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	int i;
+
+	for (i = 0; i < NEXT3_N_BLOCKS; i++)
+		if (ei->i_data[i])
+			return 1;
+	return 0;
+}
+
+#endif
 /*
  * next3_snapshot_set_flags() monitors snapshot state changes
  * Called from next3_ioctl() under i_mutex and snapshot_mutex
@@ -223,6 +385,21 @@ int next3_snapshot_set_flags(handle_t *handle, struct inode *inode,
 					inode->i_ino);
 			return -EINVAL;
 		}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
+		if (((flags ^ oldflags) & NEXT3_NOSNAP_FL) &&
+				S_ISREG(inode->i_mode) &&
+				next3_inode_has_blocks(inode)) {
+			/*
+			 * excluded file blocks are marked in exclude bitmap
+			 * on allocation, so existing blocks would be left
+			 * with the wrong exclude status.
+			 */
+			snapshot_debug(1, "changing nosnap flag for non empty "
+					"file (ino=%lu) is not allowed\n",
+					inode->i_ino);
+			return -EINVAL;
+		}
+#endif
 		goto non_snapshot;
 	}
 
@@ -251,6 +428,10 @@ int next3_snapshot_set_flags(handle_t *handle, struct inode *inode,
 			err = next3_snapshot_enable(inode);
 		else
 			err = next3_snapshot_disable(inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ENABLE_FAST
+		if (!err)
+			next3_snapshot_update_inuse(inode);
+#endif
 	}
 	if (err)
 		goto out;
@@ -261,6 +442,13 @@ int next3_snapshot_set_flags(handle_t *handle, struct inode *inode,
 			err = next3_snapshot_create(inode);
 		else
 			err = next3_snapshot_delete(inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+		if (!err && !(flags & NEXT3_SNAPFILE_LIST_FL))
+			/* deleted snapshots groups have changed */
+			err = next3_snapshot_shrink_reset(handle, inode);
+#endif
+#endif
 	}
 	if (err)
 		goto out;
@@ -346,10 +534,10 @@ static inline int next3_snapshot_shift_blocks(struct next3_inode_info *ei,
 	BUG_ON(to < NEXT3_NDIR_BLOCKS || to + count > NEXT3_SNAPSHOT_N_BLOCKS);
 
 	/*
-	 * truncate_mutex is held whenever allocating or freeing inode
+	 * truncate_sem is held whenever allocating or freeing inode
 	 * blocks.
 	 */
-	mutex_lock(&ei->truncate_mutex);
+	down_write(&ei->truncate_sem);
 
 	/*
 	 * verify that 'from' blocks are allocated
@@ -369,7 +557,7 @@ static inline int next3_snapshot_shift_blocks(struct next3_inode_info *ei,
 	}
 	err = 0;
 out:
-	mutex_unlock(&ei->truncate_mutex);
+	up_write(&ei->truncate_sem);
 	return err;
 }
 #endif
@@ -477,12 +665,24 @@ static int next3_snapshot_create(struct inode *inode)
 	/* record the file system size in the snapshot inode disksize field */
 	SNAPSHOT_SET_BLOCKS(inode, snapshot_blocks);
 	SNAPSHOT_SET_DISABLED(inode);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	atomic_set(&NEXT3_SNAP_I(inode)->i_snap_copied, 0);
+	atomic_set(&NEXT3_SNAP_I(inode)->i_snap_moved, 0);
+#endif
 
 	if (!NEXT3_HAS_RO_COMPAT_FEATURE(sb,
 		NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT))
 		/* set the 'has_snapshot' feature */
 		NEXT3_SET_RO_COMPAT_FEATURE(sb,
 			NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	/*
+	 * From now on order data by buffer.  The inodes already filed are
+	 * written out by their commits, at the latest when snapshot take
+	 * flushes the journal, before the snapshot becomes active.
+	 */
+	clear_opt(NEXT3_SB(sb)->s_mount_opt, ORDERED_INODE);
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	/* add snapshot list reference */
@@ -507,6 +707,9 @@ static int next3_snapshot_create(struct inode *inode)
 		iput(inode);
 		goto out_handle;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+	next3_snapshot_index_add(sb, inode);
+#endif
 	l = list->next;
 #else
 	lock_super(sb);
@@ -705,1253 +908,4214 @@ out_handle:
  */
 static handle_t dummy_handle;
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
 /*
- * next3_snapshot_copy_block() - copy block to new snapshot
- * @snapshot:	new snapshot to copy block to
- * @bh:		source buffer to be copied
- * @mask:	if not NULL, mask buffer data before copying to snapshot
- * 		(used to mask block bitmap with exclude bitmap)
- * @name:	name of copied block to print
- * @idx:	index of copied block to print
- *
- * Called from next3_snapshot_take() under journal_lock_updates()
- * Returns snapshot buffer on success, NULL on error
+ * Calculate maximum disk space for snapshot file metadata based on:
+ * 1 indirect block per 1K fs blocks (to map moved data blocks)
+ * +1 data block per 1K fs blocks (to copy indirect blocks)
+ * +1 data block per fs meta block (to copy meta blocks)
+ * +1 data block per directory (to copy small directory index blocks)
+ * +1 data block per 64 inodes (to copy large directory index blocks)
+ * XXX: reserved space may be too small in data jounaling mode,
+ *      which is currently not supported.
  */
-static struct buffer_head *next3_snapshot_copy_block(struct inode *snapshot,
-		struct buffer_head *bh, const char *mask,
-		const char *name, unsigned long idx)
+static u64 next3_snapshot_reserve_static(struct kstatfs *statfs)
 {
-	struct buffer_head *sbh = NULL;
-	int err;
-
-	if (!bh)
-		return NULL;
+	return 2 * (statfs->f_blocks >> SNAPSHOT_ADDR_PER_BLOCK_BITS) +
+		statfs->f_spare[0] + statfs->f_spare[1] +
+		(statfs->f_files - statfs->f_ffree) / 64;
+}
 
-	sbh = next3_getblk(&dummy_handle, snapshot,
-			SNAPSHOT_IBLOCK(bh->b_blocknr),
-			SNAPMAP_READ, &err);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+/* minimal active snapshot age (in seconds) to observe its COW rate */
+#define NEXT3_SNAPSHOT_RESERVE_OBSERVE	3600
+#define NEXT3_SNAPSHOT_RESERVE_HOURS	24
+#define NEXT3_SNAPSHOT_RESERVE_INTERVAL	600
 
-	if (err || !sbh || sbh->b_blocknr == bh->b_blocknr) {
-		snapshot_debug(1, "failed to copy %s (%lu) "
-				"block [%lu/%lu] to snapshot (%u)\n",
-				name, idx,
-				SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
-				snapshot->i_generation);
-		brelse(sbh);
-		return NULL;
-	}
+/*
+ * next3_snapshot_active_cow_rate() - COW rate of the active snapshot
+ * Returns the number of blocks per hour that were copied and moved to the
+ * active snapshot since it was taken (or since mount time), or 0 if the
+ * active snapshot is too young to tell.
+ */
+static unsigned int next3_snapshot_active_cow_rate(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct inode *active_snapshot = sbi->s_active_snapshot;
+	unsigned long elapsed, used;
+	u64 rate;
 
-	next3_snapshot_copy_buffer(sbh, bh, mask);
+	if (!active_snapshot)
+		return 0;
+	elapsed = get_seconds() - sbi->s_snapshot_active_since;
+	if (elapsed < NEXT3_SNAPSHOT_RESERVE_OBSERVE)
+		return 0;
+	used = atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_copied) +
+		atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_moved);
+	if (used <= sbi->s_snapshot_active_base)
+		return 1;
+	rate = (u64)(used - sbi->s_snapshot_active_base) * 3600;
+	do_div(rate, elapsed);
+	return rate < UINT_MAX ? (unsigned int)rate + 1 : UINT_MAX;
+}
 
-	snapshot_debug(4, "copied %s (%lu) block [%lu/%lu] "
-			"to snapshot (%u)\n",
-			name, idx,
-			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
-			snapshot->i_generation);
-	return sbh;
+/*
+ * combine a new COW rate observation with the average of previous ones
+ */
+static unsigned int next3_snapshot_cow_rate_avg(unsigned int avg,
+		unsigned int rate)
+{
+	if (!rate)
+		return avg;
+	if (!avg)
+		return rate;
+	return ((u64)avg * 3 + rate) / 4;
 }
 
 /*
- * List of blocks which are copied to snapshot for every special inode.
- * Keep block bitmap first and inode table block last in the list.
+ * next3_snapshot_reserve_adapt() - calculate adaptive snapshot reserve
+ * Reserve twice the blocks expected to be COWed with @cow_rate over the
+ * reserve horizon plus the indirect blocks to map moved blocks, but never
+ * more than the static reserve.  Without observations, use static reserve.
  */
-enum copy_inode_block {
-	COPY_BLOCK_BITMAP,
-	COPY_INODE_BITMAP,
-	COPY_INODE_TABLE,
-	COPY_INODE_BLOCKS_NUM
-};
+static u64 next3_snapshot_reserve_adapt(struct super_block *sb,
+		struct kstatfs *statfs, u64 static_r_blocks,
+		unsigned int cow_rate)
+{
+	u64 r_blocks;
 
-static char *copy_inode_block_name[COPY_INODE_BLOCKS_NUM] = {
-	"block bitmap",
-	"inode bitmap",
-	"inode table"
-};
-#endif
+	if (!cow_rate)
+		return static_r_blocks;
+	r_blocks = 2ULL * cow_rate * NEXT3_SB(sb)->s_snapshot_reserve_hours +
+		(statfs->f_blocks >> SNAPSHOT_ADDR_PER_BLOCK_BITS);
+	return min(r_blocks, static_r_blocks);
+}
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
 /*
- * next3_snapshot_take() makes a new snapshot file
- * into the active snapshot
+ * next3_snapshot_get_usage() - report snapshot space usage
+ * @inode:	snapshot inode
+ * @usage:	space usage counters to fill
  *
- * this function calls journal_lock_updates()
- * and should not be called during a journal transaction
- * Called from next3_ioctl() under i_mutex and snapshot_mutex
+ * Copied and moved blocks are read from the snapshot inode counters.
+ * Shared blocks are the blocks that were in use at snapshot take time,
+ * according to the snapshot copy of the super block, and were neither
+ * copied nor moved to the snapshot since.
  */
-int next3_snapshot_take(struct inode *inode)
+int next3_snapshot_get_usage(struct inode *inode,
+		struct next3_snapshot_usage *usage)
 {
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
-	struct list_head *list = &NEXT3_SB(inode->i_sb)->s_snapshot_list;
-	struct list_head *l = list->next;
-#endif
-	struct super_block *sb = inode->i_sb;
-	struct next3_sb_info *sbi = NEXT3_SB(sb);
-	struct next3_super_block *es = NULL;
-	struct buffer_head *sbh = NULL;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
-	struct buffer_head *exclude_bitmap_bh = NULL;
-#endif
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
-	struct buffer_head *bhs[COPY_INODE_BLOCKS_NUM] = { NULL };
-	const char *mask = NULL;
-	struct inode *curr_inode;
-	struct next3_iloc iloc;
-	struct next3_group_desc *desc;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
-	next3_fsblk_t prev_inode_blk = 0;
-	struct next3_inode *raw_inode;
-#endif
-	int i;
-#endif
-	int err = -EIO;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
-	u64 snapshot_r_blocks;
-	struct kstatfs statfs;
-#endif
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_super_block *es;
+	struct buffer_head *sbh;
+	__u64 used;
+	int err = 0;
 
-	if (!sbi->s_sbh)
-		goto out_err;
-	else if (sbi->s_sbh->b_blocknr != 0) {
-		snapshot_debug(1, "warning: unexpected super block at block "
-			"(%lld:%d)!\n", (long long)sbi->s_sbh->b_blocknr,
-			(int)((char *)sbi->s_es - (char *)sbi->s_sbh->b_data));
-	} else if (sbi->s_es->s_magic != cpu_to_le16(NEXT3_SUPER_MAGIC)) {
-		snapshot_debug(1, "warning: super block of snapshot (%u) is "
-			       "broken!\n", inode->i_generation);
-	} else
-		sbh = next3_getblk(&dummy_handle, inode, SNAPSHOT_IBLOCK(0),
-				   SNAPMAP_READ, &err);
+	if (!next3_snapshot_file(inode))
+		return -EINVAL;
+
+	usage->copied = atomic_read(&NEXT3_SNAP_I(inode)->i_snap_copied);
+	usage->moved = atomic_read(&NEXT3_SNAP_I(inode)->i_snap_moved);
+	usage->blocks = inode->i_blocks >> (inode->i_blkbits - 9);
+	usage->shared = 0;
 
+	sbh = next3_getblk(&dummy_handle, inode, SNAPSHOT_IBLOCK(0),
+			   SNAPMAP_READ, &err);
 	if (!sbh || sbh->b_blocknr == 0) {
-		snapshot_debug(1, "warning: super block of snapshot (%u) not "
-			       "allocated\n", inode->i_generation);
-		goto out_err;
-	} else {
-		snapshot_debug(4, "super block of snapshot (%u) mapped to "
-			       "block (%lld)\n", inode->i_generation,
-			       (long long)sbh->b_blocknr);
-		es = (struct next3_super_block *)(sbh->b_data +
-						  ((char *)sbi->s_es -
-						   sbi->s_sbh->b_data));
+		/* snapshot super block not allocated */
+		brelse(sbh);
+		return 0;
 	}
-
-	err = -EIO;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
-	/* update fs statistics to calculate snapshot reserved space */
-	if (next3_statfs_sb(sb, &statfs)) {
-		snapshot_debug(1, "failed to statfs before snapshot (%u) "
-			       "take\n", inode->i_generation);
-		goto out_err;
+	if (!buffer_uptodate(sbh)) {
+		ll_rw_block(READ, 1, &sbh);
+		wait_on_buffer(sbh);
 	}
-	/*
-	 * Calculate maximum disk space for snapshot file metadata based on:
-	 * 1 indirect block per 1K fs blocks (to map moved data blocks)
-	 * +1 data block per 1K fs blocks (to copy indirect blocks)
-	 * +1 data block per fs meta block (to copy meta blocks)
-	 * +1 data block per directory (to copy small directory index blocks)
-	 * +1 data block per 64 inodes (to copy large directory index blocks)
-	 * XXX: reserved space may be too small in data jounaling mode,
-	 *      which is currently not supported.
-	 */
-	snapshot_r_blocks = 2 * (statfs.f_blocks >>
-				 SNAPSHOT_ADDR_PER_BLOCK_BITS) +
-		statfs.f_spare[0] + statfs.f_spare[1] +
-		(statfs.f_files - statfs.f_ffree) / 64;
-
-	/* verify enough free space before taking the snapshot */
-	if (statfs.f_bfree < snapshot_r_blocks) {
-		err = -ENOSPC;
-		goto out_err;
+	if (buffer_uptodate(sbh)) {
+		es = (struct next3_super_block *)(sbh->b_data +
+				((char *)sbi->s_es - sbi->s_sbh->b_data));
+		used = le32_to_cpu(es->s_blocks_count) -
+			le32_to_cpu(es->s_free_blocks_count);
+		if (used > usage->copied + usage->moved)
+			usage->shared = used - usage->copied - usage->moved;
 	}
+	brelse(sbh);
+	return 0;
+}
+
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DIFF
+/*
+ * next3_snapshot_get_diff() - report blocks changed after snapshot take
+ * @inode:	snapshot inode (snapshot N)
+ * @diff:	in: scan start block, newer snapshot and max extents
+ *		out: next block to scan and number of returned extents
+ * @extents:	array of (at least @diff->sd_count) extents to fill
+ *
+ * The blocks that were changed between the take of snapshot N and the take
+ * of snapshot M (or the file system, if @diff->sd_end is 0) are the blocks
+ * that are mapped in snapshot files N..M-1 (copied or moved on write before
+ * snapshot M was taken).  Blocks that were free on snapshot N take are not
+ * copied, so they are not reported.  Those blocks can be found by comparing
+ * the block bitmaps of the 2 snapshot images.
+ * Scan stops when @diff->sd_count extents were found and @diff->sd_start is
+ * set to the next block to scan, or to the blocks count when scan is done.
+ * Returns 0 on success and <0 on error.
+ */
+int next3_snapshot_get_diff(struct inode *inode,
+		struct next3_snapshot_diff *diff,
+		struct next3_snapshot_diff_extent *extents)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_snapshot_diff_extent *ext = NULL;
+	struct list_head *l;
+	struct inode *snapshot, *end = NULL;
+	next3_fsblk_t block, blocks_count;
+	unsigned int max = diff->sd_count, n = 0;
+	int err = 0;
 
-	/*
-	 * flush journal to disk and clear the RECOVER flag
-	 * before taking the snapshot
-	 */
-	sb->s_op->freeze_fs(sb);
-	lock_super(sb);
+	if (!next3_snapshot_list(inode) ||
+		(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_DELETED_FL))
+		return -EINVAL;
 
-#ifdef CONFIG_NEXT3_FS_DEBUG
-	if (snapshot_enable_test[SNAPTEST_TAKE]) {
-		snapshot_debug(1, "taking snapshot (%u) ...\n",
-				inode->i_generation);
-		/* sleep 1 tunable delay unit */
-		snapshot_test_delay(SNAPTEST_TAKE);
-	}
+	mutex_lock(&sbi->s_snapshot_mutex);
+	/* find @end snapshot, which should be newer than @inode */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+	if (diff->sd_end) {
+		/* snapshot ids are allocated in increasing order */
+		end = next3_snapshot_lookup(sb, diff->sd_end);
+		if (end && end->i_generation <= inode->i_generation)
+			end = NULL;
+#else
+	if (diff->sd_end) {
+		list_for_each_prev(l, &NEXT3_I(inode)->i_snaplist) {
+			if (l == &sbi->s_snapshot_list)
+				break;
+			snapshot = &list_entry(l, struct next3_inode_info,
+					       i_snaplist)->vfs_inode;
+			if (snapshot->i_generation == diff->sd_end) {
+				end = snapshot;
+				break;
+			}
+		}
 #endif
+		if (!end || (NEXT3_I(end)->i_flags &
+			     NEXT3_SNAPFILE_DELETED_FL)) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
-	/*
-	 * copy super block to snapshot and fix it
-	 */
-	lock_buffer(sbh);
-	memcpy(sbh->b_data, sbi->s_sbh->b_data, sb->s_blocksize);
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
-	/*
-	 * Convert from Next3 to Ext3 super block:
-	 * Remove the HAS_SNAPSHOT flag and snapshot inode number.
-	 * Set the IS_SNAPSHOT flag to signal fsck this is a snapshot image.
-	 */
-	es->s_feature_ro_compat &=
-		~cpu_to_le32(NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT);
-	es->s_snapshot_inum = 0;
-	es->s_snapshot_list = 0;
-	es->s_flags |= cpu_to_le32(NEXT3_FLAGS_IS_SNAPSHOT);
-#endif
-	set_buffer_uptodate(sbh);
-	unlock_buffer(sbh);
-	mark_buffer_dirty(sbh);
-	sync_dirty_buffer(sbh);
+	blocks_count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	block = diff->sd_start;
+	while (block < blocks_count && n < max) {
+		/* scan up to block group boundary */
+		unsigned long count = SNAPSHOT_BLOCKS_PER_GROUP -
+			SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+		int mapped, changed = 0;
+
+		if (count > blocks_count - block)
+			count = blocks_count - block;
+		/* iterate on (@inode <= snapshot < @end) */
+		snapshot = inode;
+		l = &NEXT3_I(inode)->i_snaplist;
+		do {
+			err = next3_snapshot_shrink_blocks(NULL, snapshot,
+					SNAPSHOT_IBLOCK(block), count,
+					NULL, 0, &mapped);
+			if (err < 0)
+				goto out;
+			/* narrow down to a range that is all holes or all
+			 * mapped in every snapshot */
+			BUG_ON(!err || err > count);
+			count = err;
+			if (mapped)
+				changed = 1;
+			l = l->prev;
+			if (l == &sbi->s_snapshot_list)
+				break;
+			snapshot = &list_entry(l, struct next3_inode_info,
+					       i_snaplist)->vfs_inode;
+		} while (snapshot != end);
+		err = 0;
+
+		if (changed) {
+			if (ext && ext->de_block + ext->de_count == block) {
+				/* extend last extent */
+				ext->de_count += count;
+			} else {
+				ext = extents + n++;
+				ext->de_block = block;
+				ext->de_count = count;
+			}
+		}
+		block += count;
 
-	/*
-	 * copy group descriptors to snapshot
-	 */
-	for (i = 0; i < sbi->s_gdb_count; i++) {
-		brelse(sbh);
-		sbh = next3_snapshot_copy_block(inode,
-				sbi->s_group_desc[i], NULL,
-				"GDT", i);
-		if (!sbh)
-			goto out_unlockfs;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
 	}
+	diff->sd_start = block;
+	diff->sd_count = n;
+out:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return err;
+}
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
-	/* start with root inode and continue with snapshot list */
-	curr_inode = sb->s_root->d_inode;
-copy_inode_blocks:
-#else
-	curr_inode = inode;
-#endif
-	/*
-	 * copy the following blocks to the new snapshot:
-	 * - block and inode bitmap blocks of curr_inode block group
-	 * - inode table block that contains curr_inode
-	 */
-	iloc.block_group = 0;
-	err = next3_get_inode_loc(curr_inode, &iloc);
-	desc = next3_get_group_desc(sb, iloc.block_group, NULL);
-	if (err || !desc) {
-		snapshot_debug(1, "failed to read inode and bitmap blocks "
-			       "of inode (%lu)\n", curr_inode->i_ino);
-		err = err ? : -EIO;
-		goto out_unlockfs;
-	}
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
-	if (iloc.bh->b_blocknr == prev_inode_blk)
-		goto fix_inode_copy;
-	prev_inode_blk = iloc.bh->b_blocknr;
 #endif
-	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
-		brelse(bhs[i]);
-	bhs[COPY_BLOCK_BITMAP] = sb_bread(sb,
-			le32_to_cpu(desc->bg_block_bitmap));
-	bhs[COPY_INODE_BITMAP] = sb_bread(sb,
-			le32_to_cpu(desc->bg_inode_bitmap));
-	bhs[COPY_INODE_TABLE] = iloc.bh;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
-	brelse(exclude_bitmap_bh);
-	exclude_bitmap_bh = read_exclude_bitmap(sb, iloc.block_group);
-	if (exclude_bitmap_bh)
-		/* mask block bitmap with exclude bitmap */
-		mask = exclude_bitmap_bh->b_data;
-#endif
-	err = -EIO;
-	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++) {
-		brelse(sbh);
-		sbh = next3_snapshot_copy_block(inode, bhs[i], mask,
-				copy_inode_block_name[i], curr_inode->i_ino);
-		if (!sbh)
-			goto out_unlockfs;
-		mask = NULL;
-	}
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
-fix_inode_copy:
-	/* get snapshot copy of raw inode */
-	iloc.bh = sbh;
-	raw_inode = next3_raw_inode(&iloc);
-	if (curr_inode->i_ino != NEXT3_ROOT_INO) {
-		/*
-		 * Snapshot inode blocks are excluded from COW bitmap,
-		 * so they appear to be not allocated in the snapshot's
-		 * block bitmap.  If we want the snapshot image to pass
-		 * fsck with no errors, we need to detach those blocks
-		 * from the copy of the snapshot inode, so we fix the
-		 * snapshot inodes to appear as empty regular files.
-		 */
-		raw_inode->i_size = 0;
-		raw_inode->i_size_high = 0;
-		raw_inode->i_blocks_lo = 0;
-		raw_inode->i_blocks_high = 0;
-		raw_inode->i_flags &= cpu_to_le32(~NEXT3_FL_SNAPSHOT_MASK);
-		memset(raw_inode->i_block, 0, sizeof(raw_inode->i_block));
-	}
-	mark_buffer_dirty(sbh);
-	sync_dirty_buffer(sbh);
-
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
-	if (l != list) {
-		curr_inode = &list_entry(l, struct next3_inode_info,
-				       i_snaplist)->vfs_inode;
-		l = l->next;
-		goto copy_inode_blocks;
-	}
-#else
-	if (curr_inode->i_ino == NEXT3_ROOT_INO) {
-		curr_inode = inode;
-		goto copy_inode_blocks;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_MAP
+/*
+ * next3_snapshot_get_map() - report snapshot file blocks map
+ * @inode:	snapshot inode
+ * @map:	in: scan start block and max extents
+ *		out: next block to scan and number of returned extents
+ * @extents:	array of (at least @map->sm_count) extents to fill
+ *
+ * Reports the mapped blocks of the snapshot image, without reading through
+ * holes.  A block that was moved to the snapshot is mapped to itself, so an
+ * extent is either all moved or all copied blocks.  Scan stops when
+ * @map->sm_count extents were found and @map->sm_start is set to the next
+ * block to scan, or to the blocks count when scan is done.
+ * Returns 0 on success and <0 on error.
+ */
+int next3_snapshot_get_map(struct inode *inode,
+		struct next3_snapshot_map *map,
+		struct next3_snapshot_map_extent *extents)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_snapshot_map_extent *ext = NULL;
+	struct buffer_head dummy;
+	next3_fsblk_t block, blocks_count;
+	unsigned int max = map->sm_count, n = 0;
+	int err = 0, mapped;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (!next3_snapshot_list(inode)) {
+		err = -EINVAL;
+		goto out;
 	}
-#endif
-#endif
-#endif
-
-	/* reset COW bitmap cache */
-	err = next3_snapshot_reset_bitmap_cache(sb, 0);
-	if (err)
-		goto out_unlockfs;
-	/* set as in-memory active snapshot */
-	err = next3_snapshot_set_active(sb, inode);
-	if (err)
-		goto out_unlockfs;
-
-	/* set as on-disk active snapshot */
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
-	sbi->s_es->s_snapshot_r_blocks_count = cpu_to_le64(snapshot_r_blocks);
-#endif
-	sbi->s_es->s_snapshot_id =
-		cpu_to_le32(le32_to_cpu(sbi->s_es->s_snapshot_id)+1);
-	if (sbi->s_es->s_snapshot_id == 0)
-		/* 0 is not a valid snapshot id */
-		sbi->s_es->s_snapshot_id = cpu_to_le32(1);
-	sbi->s_es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
-
-	err = 0;
-out_unlockfs:
-	unlock_super(sb);
-	sb->s_op->unfreeze_fs(sb);
 
-	if (err)
-		goto out_err;
-
-	snapshot_debug(1, "snapshot (%u) has been taken\n",
-			inode->i_generation);
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DUMP
-	next3_snapshot_dump(5, inode);
-#endif
+	blocks_count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	block = map->sm_start;
+	while (block < blocks_count && n < max) {
+		/* scan up to block group boundary */
+		unsigned long count = SNAPSHOT_BLOCKS_PER_GROUP -
+			SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+		__u32 flags;
+
+		if (count > blocks_count - block)
+			count = blocks_count - block;
+		dummy.b_state = 0;
+		dummy.b_blocknr = 0;
+		/* non NULL handle - plain lookup without read through */
+		err = next3_get_blocks_handle(&dummy_handle, inode,
+				SNAPSHOT_IBLOCK(block), count, &dummy, 0);
+		if (err < 0)
+			goto out;
+		if (!err) {
+			/* skip the holes */
+			err = next3_snapshot_shrink_blocks(NULL, inode,
+					SNAPSHOT_IBLOCK(block), count,
+					NULL, 0, &mapped);
+			if (err < 0)
+				goto out;
+			BUG_ON(!err || err > count || mapped);
+		} else {
+			flags = (dummy.b_blocknr == block) ?
+				NEXT3_SNAPSHOT_MAP_MOVED :
+				NEXT3_SNAPSHOT_MAP_COPIED;
+			if (ext && ext->me_flags == flags &&
+			    ext->me_block + ext->me_count == block &&
+			    ext->me_phys + ext->me_count == dummy.b_blocknr) {
+				/* extend last extent */
+				ext->me_count += err;
+			} else {
+				ext = extents + n++;
+				ext->me_block = block;
+				ext->me_phys = dummy.b_blocknr;
+				ext->me_count = err;
+				ext->me_flags = flags;
+			}
+		}
+		block += err;
+		err = 0;
 
-out_err:
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
-	brelse(exclude_bitmap_bh);
-#endif
-	brelse(sbh);
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
-	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
-		brelse(bhs[i]);
-#endif
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	map->sm_start = block;
+	map->sm_count = n;
+out:
+	mutex_unlock(&sbi->s_snapshot_mutex);
 	return err;
 }
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIEMAP
 /*
- * next3_snapshot_clean() "cleans" snapshot file blocks in 1 of 2 ways:
- * 1. from next3_snapshot_remove() with @cleanup=1 to free snapshot file
- *    blocks, before removing snapshot file from snapshots list.
- * 2. from next3_snapshot_exclude() with @cleanup=0 to mark snapshot file
- *    blocks in exclude bitmap.
- * Called under snapshot_mutex.
+ * next3_snapshot_fiemap_resolve() - resolve snapshot image blocks range
+ * @inode:	snapshot inode
+ * @block:	first snapshot image block to resolve
+ * @count:	max blocks to resolve (within block group boundary)
+ * @phys:	returns physical block of the resolved range
+ * @flags:	returns FIEMAP extent flags of the resolved range
  *
- * Return values:
- * > 0 - no. of blocks in snapshot file (@cleanup=0)
- * = 0 - successful cleanup (@cleanup=1)
- * < 0 - error
+ * Looks up @block in @inode and then in newer snapshots up to the active
+ * snapshot, the same way next3_snapshot_get_block() reads through holes.
+ * Called from next3_snapshot_fiemap() under snapshot_mutex.
+ * Returns the number of resolved blocks and <0 on error.
  */
-static int next3_snapshot_clean(handle_t *handle, struct inode *inode,
-		int cleanup)
+static int next3_snapshot_fiemap_resolve(struct inode *inode,
+		next3_fsblk_t block, unsigned long count,
+		next3_fsblk_t *phys, __u32 *flags)
 {
-	struct next3_inode_info *ei = NEXT3_I(inode);
-	int i, nblocks = 0;
-	int *pblocks = (cleanup ? NULL : &nblocks);
-
-	if (!next3_snapshot_list(inode)) {
-		snapshot_debug(1, "next3_snapshot_clean() called with "
-			       "snapshot file (ino=%lu) not on list\n",
-			       inode->i_ino);
-		return -EINVAL;
-	}
-
-	if (ei->i_flags & NEXT3_SNAPFILE_ACTIVE_FL) {
-		snapshot_debug(1, "clean of active snapshot (%u) "
-			       "is not allowed.\n",
-			       inode->i_generation);
-		return -EPERM;
-	}
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct list_head *l = &NEXT3_I(inode)->i_snaplist;
+	struct buffer_head dummy;
+	int err, mapped;
+
+	*flags = 0;
+	while (1) {
+		dummy.b_state = 0;
+		dummy.b_blocknr = 0;
+		/* non NULL handle - plain lookup without read through */
+		err = next3_get_blocks_handle(&dummy_handle, inode,
+				SNAPSHOT_IBLOCK(block), count, &dummy, 0);
+		if (err > 0) {
+			*phys = dummy.b_blocknr;
+			return err;
+		}
+		if (err < 0)
+			return err;
+		/* count the holes to read through */
+		err = next3_snapshot_shrink_blocks(NULL, inode,
+				SNAPSHOT_IBLOCK(block), count, NULL, 0, &mapped);
+		if (err < 0)
+			return err;
+		/* mapped blocks were not found above, so these are holes */
+		BUG_ON(!err || err > count || mapped);
+		count = err;
 
-	/*
-	 * A very simplified version of next3_truncate() for snapshot files.
-	 * A non-active snapshot file never allocates new blocks and only frees
-	 * blocks under snapshot_mutex, so no need to take truncate_mutex here.
-	 * No need to add inode to orphan list for post crash truncate, because
-	 * snapshot is still on the snapshot list and marked for deletion.
-	 */
-	for (i = NEXT3_DIND_BLOCK; i < NEXT3_SNAPSHOT_N_BLOCKS; i++) {
-		int depth = (i == NEXT3_DIND_BLOCK ? 2 : 3);
-		if (!ei->i_data[i])
-			continue;
-		next3_free_branches_cow(handle, inode, NULL,
-				ei->i_data+i, ei->i_data+i+1, depth, pblocks);
-		if (cleanup)
-			ei->i_data[i] = 0;
+		if (next3_snapshot_is_active(inode)) {
+			/* read through to block device */
+			*phys = block;
+			*flags = NEXT3_FIEMAP_EXTENT_BLOCKDEV;
+			return count;
+		}
+		/* read through to newer snapshot */
+		l = l->prev;
+		if (l == &sbi->s_snapshot_list)
+			/* active snapshot not found on list? */
+			return -EIO;
+		inode = &list_entry(l, struct next3_inode_info,
+				    i_snaplist)->vfs_inode;
+		*flags = NEXT3_FIEMAP_EXTENT_SNAPSHOT;
 	}
-	return nblocks;
 }
 
 /*
- * next3_snapshot_exclude() marks snapshot file blocks in exclude bitmap.
- * Snapshot file blocks should already be excluded if everything works properly.
- * This function is used only to verify the correctness of exclude bitmap.
- * Called under i_mutex and snapshot_mutex.
+ * next3_snapshot_fiemap() - report snapshot image extents
+ *
+ * Unlike generic_block_fiemap(), holes in the snapshot file are resolved to
+ * the newer snapshot or to the block device that they are read through to.
+ * The block bitmap of every group is fixed up on read through to the block
+ * device, so it is reported as an encoded extent, which should be read via
+ * the snapshot file.  Read through mapping (including mapping to the active
+ * snapshot) is only valid until the block is COWed, so backup tools should
+ * verify that the mapping has not changed after reading the blocks.
+ * Called from next3_fiemap() for snapshot files on the list.
  */
-static int next3_snapshot_exclude(handle_t *handle, struct inode *inode)
+int next3_snapshot_fiemap(struct inode *inode,
+		struct fiemap_extent_info *fieinfo, u64 start, u64 len)
 {
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int blkbits = inode->i_blkbits;
+	next3_fsblk_t block, end, phys, ext_block = 0, ext_phys = 0;
+	next3_fsblk_t ext_count = 0;
+	__u32 flags, ext_flags = 0;
 	int err;
 
-	/* extend small transaction started in next3_ioctl() */
-	err = extend_or_restart_transaction(handle, NEXT3_MAX_TRANS_DATA);
+	err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
 	if (err)
 		return err;
 
-	err = next3_snapshot_clean(handle, inode, 0);
-	if (err < 0)
-		return err;
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (!next3_snapshot_list(inode)) {
+		err = -EINVAL;
+		goto out;
+	}
+	/* snapshot image size is limited by the current fs size */
+	end = min_t(u64, i_size_read(inode) >> blkbits,
+		  le32_to_cpu(sbi->s_es->s_blocks_count));
+	block = start >> blkbits;
+	if (len < ~0ULL - start)
+		end = min_t(u64, end, (start + len + (1 << blkbits) - 1) >>
+			    blkbits);
+
+	while (block < end) {
+		unsigned long count = SNAPSHOT_BLOCKS_PER_GROUP -
+			SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+#ifndef CONFIG_NEXT3_FS_FLEX_BG
+		struct next3_group_desc *desc;
+#endif
 
-	snapshot_debug(1, "snapshot (%u) is clean (%d blocks)\n",
-			inode->i_generation, err);
-	return 0;
+		if (count > end - block)
+			count = end - block;
+		err = next3_snapshot_fiemap_resolve(inode, block, count,
+						    &phys, &flags);
+		if (err < 0)
+			goto out;
+		count = err;
+		err = 0;
+
+		if (flags & NEXT3_FIEMAP_EXTENT_BLOCKDEV) {
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+			/* several packed block bitmaps may be in the group */
+			unsigned long offset = next3_block_bitmap_offset(sb,
+							block, count);
+
+			if (!offset) {
+				/* fixed block bitmap */
+				count = 1;
+				flags |= FIEMAP_EXTENT_ENCODED;
+			} else {
+				/* stop before fixed block bitmap */
+				count = offset;
+			}
+#else
+			desc = next3_get_group_desc(sb,
+					SNAPSHOT_BLOCK_GROUP(block), NULL);
+			if (desc && block == le32_to_cpu(desc->bg_block_bitmap)) {
+				/* fixed block bitmap */
+				count = 1;
+				flags |= FIEMAP_EXTENT_ENCODED;
+			} else if (desc &&
+				   block < le32_to_cpu(desc->bg_block_bitmap) &&
+				   block + count >
+				   le32_to_cpu(desc->bg_block_bitmap)) {
+				/* stop before fixed block bitmap */
+				count = le32_to_cpu(desc->bg_block_bitmap) -
+					block;
+			}
+#endif
+		}
+
+		if (ext_count && ext_flags == flags &&
+		    !(flags & FIEMAP_EXTENT_ENCODED) &&
+		    ext_block + ext_count == block &&
+		    ext_phys + ext_count == phys) {
+			/* extend last extent */
+			ext_count += count;
+		} else {
+			if (ext_count) {
+				err = fiemap_fill_next_extent(fieinfo,
+					(u64)ext_block << blkbits,
+					(u64)ext_phys << blkbits,
+					(u64)ext_count << blkbits, ext_flags);
+				if (err)
+					break;
+			}
+			ext_block = block;
+			ext_phys = phys;
+			ext_count = count;
+			ext_flags = flags;
+		}
+		block += count;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	if (!err && ext_count)
+		err = fiemap_fill_next_extent(fieinfo,
+				(u64)ext_block << blkbits,
+				(u64)ext_phys << blkbits,
+				(u64)ext_count << blkbits,
+				ext_flags | FIEMAP_EXTENT_LAST);
+	/* 1 means extents array is full */
+	if (err == 1)
+		err = 0;
+out:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return err;
 }
+
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_VERIFY
+/*
+ * Snapshot image verification
+ *
+ * The metadata of the snapshot image (copies of the super block, group
+ * descriptors, bitmaps and inode tables) is resolved to physical blocks,
+ * the same way that FIEMAP resolves read through extents, and read directly
+ * from the block device.  The inode table of every block group is read ahead
+ * in physical order, so the scan does not do a snapshot file block lookup
+ * and a tracked read for every block that it reads.
+ * Read through mapping is only valid until the block is COWed, so a group
+ * that fails verification is verified again before the inconsistencies are
+ * reported.
+ */
+#define snapshot_verify_error(report, inode, group, fmt, a...)		\
+	do {								\
+		if (report)						\
+			next3_warning((inode)->i_sb, "snapshot_verify",	\
+				"snapshot (%u) group %lu: " fmt,	\
+				(inode)->i_generation, (group), ## a);	\
+	} while (0)
 
 /*
- * next3_snapshot_enable() enables snapshot mount
- * sets the in-use flag and the active snapshot
- * Called under i_mutex and snapshot_mutex
+ * next3_snapshot_verify_resolve() - resolve snapshot image block @block
+ * Returns the physical block or 0 if @block could not be resolved and sets
+ * *@flags to the FIEMAP read through flags of the block.
  */
-static int next3_snapshot_enable(struct inode *inode)
+static next3_fsblk_t next3_snapshot_verify_resolve(struct inode *inode,
+		next3_fsblk_t block, __u32 *flags)
 {
-	struct next3_inode_info *ei = NEXT3_I(inode);
+	next3_fsblk_t phys;
 
-	if (!next3_snapshot_list(inode)) {
-		snapshot_debug(1, "next3_snapshot_enable() called with "
-			       "snapshot file (ino=%lu) not on list\n",
-			       inode->i_ino);
-		return -EINVAL;
+	if (next3_snapshot_fiemap_resolve(inode, block, 1, &phys, flags) <= 0)
+		return 0;
+	return phys;
+}
+
+/*
+ * next3_snapshot_verify_bread() - read snapshot image block @block
+ * Returns the buffer of the resolved physical block or NULL on error.
+ */
+static struct buffer_head *next3_snapshot_verify_bread(struct inode *inode,
+		next3_fsblk_t block, __u64 *pblocks)
+{
+	next3_fsblk_t phys;
+	__u32 flags;
+
+	phys = next3_snapshot_verify_resolve(inode, block, &flags);
+	if (!phys)
+		return NULL;
+	(*pblocks)++;
+	return sb_bread(inode->i_sb, phys);
+}
+
+/*
+ * next3_snapshot_verify_readahead() - start reading @count snapshot image
+ * blocks from @block (within block group boundary) in physical order.
+ */
+static void next3_snapshot_verify_readahead(struct inode *inode,
+		next3_fsblk_t block, unsigned long count)
+{
+	next3_fsblk_t phys;
+	__u32 flags;
+	int i, n;
+
+	while (count > 0) {
+		n = next3_snapshot_fiemap_resolve(inode, block, count,
+						  &phys, &flags);
+		if (n <= 0)
+			return;
+		for (i = 0; i < n; i++)
+			sb_breadahead(inode->i_sb, phys + i);
+		block += n;
+		count -= n;
 	}
+}
 
-	if (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL) {
-		snapshot_debug(1, "enable of deleted snapshot (%u) "
-				"is not permitted\n",
-				inode->i_generation);
-		return -EPERM;
+/* count the bits that are set in the first @nbits bits of @bitmap */
+static unsigned long next3_snapshot_verify_weight(const char *bitmap,
+		unsigned long nbits)
+{
+	unsigned long i, weight = 0;
+
+	for (i = 0; i < nbits / 8; i++)
+		weight += hweight8((u8)bitmap[i]);
+	for (i *= 8; i < nbits; i++)
+		if (next3_test_bit(i, bitmap))
+			weight++;
+	return weight;
+}
+
+/*
+ * next3_snapshot_verify_group() - verify snapshot image block group
+ * @es:		snapshot copy of the super block
+ * @desc:	snapshot copy of the group descriptor
+ * @report:	report inconsistencies to kernel log
+ *
+ * The block bitmap of a group that was not written since snapshot take is
+ * read through to the file system block bitmap, which is not the snapshot
+ * image block bitmap (see next3_snapshot_read_block_bitmap()), so it is not
+ * verified.
+ * Returns the no. of inconsistencies found in the group.
+ */
+static int next3_snapshot_verify_group(struct inode *inode,
+		struct next3_super_block *es, struct next3_group_desc *desc,
+		unsigned long group, __u64 *pblocks, int report)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	next3_fsblk_t first = next3_group_first_block_no(sb, group);
+	next3_fsblk_t block_bitmap = le32_to_cpu(desc->bg_block_bitmap);
+	next3_fsblk_t inode_bitmap = le32_to_cpu(desc->bg_inode_bitmap);
+	next3_fsblk_t inode_table = le32_to_cpu(desc->bg_inode_table);
+	unsigned long ipg = NEXT3_INODES_PER_GROUP(sb);
+	unsigned long count, used, ino, i, j, bad;
+	struct buffer_head *bh, *ibh;
+	next3_fsblk_t phys;
+	__u32 flags;
+	int errors = 0;
+
+	count = le32_to_cpu(es->s_blocks_count) - first;
+	if (count > NEXT3_BLOCKS_PER_GROUP(sb))
+		count = NEXT3_BLOCKS_PER_GROUP(sb);
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	if (NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_FLEX_BG)) {
+		/* with flex_bg, metadata may be packed into another group */
+		first = le32_to_cpu(es->s_first_data_block);
+		count = le32_to_cpu(es->s_blocks_count) - first;
+	}
+#endif
+	if (block_bitmap < first || block_bitmap >= first + count ||
+	    inode_bitmap < first || inode_bitmap >= first + count ||
+	    inode_table < first ||
+	    inode_table + sbi->s_itb_per_group > first + count) {
+		snapshot_verify_error(report, inode, group,
+				"metadata blocks (%lu,%lu,%lu) not in group\n",
+				block_bitmap, inode_bitmap, inode_table);
+		return 1;
+	}
+	if (le16_to_cpu(desc->bg_free_blocks_count) > count ||
+	    le16_to_cpu(desc->bg_free_inodes_count) > ipg) {
+		snapshot_verify_error(report, inode, group,
+				"bad free counts (%u,%u)\n",
+				le16_to_cpu(desc->bg_free_blocks_count),
+				le16_to_cpu(desc->bg_free_inodes_count));
+		errors++;
 	}
 
-	/*
-	 * set i_size to block device size to enable loop device mount
-	 */
-	SNAPSHOT_SET_ENABLED(inode);
-	ei->i_flags |= NEXT3_SNAPFILE_ENABLED_FL;
+	/* read ahead the group metadata blocks */
+	phys = next3_snapshot_verify_resolve(inode, block_bitmap, &flags);
+	if (flags & NEXT3_FIEMAP_EXTENT_BLOCKDEV)
+		phys = 0;
+	if (phys)
+		sb_breadahead(sb, phys);
+	next3_snapshot_verify_readahead(inode, inode_bitmap, 1);
+	next3_snapshot_verify_readahead(inode, inode_table,
+					sbi->s_itb_per_group);
+
+	if (phys) {
+		(*pblocks)++;
+		bh = sb_bread(sb, phys);
+		if (!bh) {
+			snapshot_verify_error(report, inode, group,
+					"failed to read block bitmap\n");
+			errors++;
+		} else {
+			if (!next3_test_bit(block_bitmap - first, bh->b_data) ||
+			    !next3_test_bit(inode_bitmap - first, bh->b_data) ||
+			    next3_find_next_zero_bit(bh->b_data,
+				    inode_table - first + sbi->s_itb_per_group,
+				    inode_table - first) <
+			    inode_table - first + sbi->s_itb_per_group) {
+				snapshot_verify_error(report, inode, group,
+					"metadata blocks not in use\n");
+				errors++;
+			}
+			/* exclude bitmap masking only frees blocks */
+			used = next3_snapshot_verify_weight(bh->b_data, count);
+			if (used + le16_to_cpu(desc->bg_free_blocks_count) >
+			    count) {
+				snapshot_verify_error(report, inode, group,
+					"%lu blocks in use, %u free of %lu\n",
+					used,
+					le16_to_cpu(desc->bg_free_blocks_count),
+					count);
+				errors++;
+			}
+			brelse(bh);
+		}
+	}
 
-	/* Don't need i_size_read because we hold i_mutex */
-	snapshot_debug(4, "setting snapshot (%u) i_size to (%lld)\n",
-			inode->i_generation, inode->i_size);
-	snapshot_debug(1, "snapshot (%u) enabled\n", inode->i_generation);
-	return 0;
+	ibh = next3_snapshot_verify_bread(inode, inode_bitmap, pblocks);
+	if (!ibh) {
+		snapshot_verify_error(report, inode, group,
+				"failed to read inode bitmap\n");
+		errors++;
+	} else {
+		used = next3_snapshot_verify_weight(ibh->b_data, ipg);
+		if (used + le16_to_cpu(desc->bg_free_inodes_count) != ipg) {
+			snapshot_verify_error(report, inode, group,
+					"%lu inodes in use, %u free of %lu\n",
+					used,
+					le16_to_cpu(desc->bg_free_inodes_count),
+					ipg);
+			errors++;
+		}
+	}
+
+	for (i = 0; i < sbi->s_itb_per_group; i++) {
+		bh = next3_snapshot_verify_bread(inode, inode_table + i,
+						 pblocks);
+		if (!bh) {
+			snapshot_verify_error(report, inode, group,
+					"failed to read inode table block "
+					"%lu\n", inode_table + i);
+			errors++;
+			continue;
+		}
+		/* inodes in use must have a mode */
+		bad = 0;
+		for (j = 0; ibh && j < sbi->s_inodes_per_block; j++) {
+			struct next3_inode *raw_inode;
+
+			ino = i * sbi->s_inodes_per_block + j;
+			if (ino >= ipg)
+				break;
+			if (group * ipg + ino + 1 < NEXT3_FIRST_INO(sb) ||
+			    !next3_test_bit(ino, ibh->b_data))
+				continue;
+			raw_inode = (struct next3_inode *)(bh->b_data +
+					j * NEXT3_INODE_SIZE(sb));
+			if (!raw_inode->i_mode)
+				bad++;
+		}
+		brelse(bh);
+		if (bad) {
+			snapshot_verify_error(report, inode, group,
+					"%lu inodes in use with no mode in "
+					"inode table block %lu\n",
+					bad, inode_table + i);
+			errors++;
+		}
+		cond_resched();
+	}
+	brelse(ibh);
+	return errors;
 }
 
 /*
- * next3_snapshot_disable() disables snapshot mount
- * Called under i_mutex and snapshot_mutex
+ * next3_snapshot_verify() - verify snapshot image metadata
+ * @inode:	snapshot inode
+ * @verify:	in: first group and max groups to verify
+ *		out: next group to verify, groups verified and results
+ *
+ * Verifies the snapshot copy of the super block and for every block group,
+ * the snapshot copy of the group descriptor against the snapshot image
+ * bitmaps and inode table.  Inconsistencies are reported to kernel log.
+ * Returns 0 on success and <0 on error.
  */
-static int next3_snapshot_disable(struct inode *inode)
+int next3_snapshot_verify(struct inode *inode,
+		struct next3_snapshot_verify *verify)
 {
-	struct next3_inode_info *ei = NEXT3_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct buffer_head *sbh = NULL, *gbh = NULL;
+	struct next3_super_block *es;
+	struct next3_group_desc *desc;
+	unsigned long group, end, groups_count, gdb = ~0UL;
+	__u64 blocks = 0;
+	int err = 0, errors;
+
+	verify->sv_errors = 0;
+	verify->sv_first_error = 0;
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (!next3_snapshot_list(inode) ||
+		(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_DELETED_FL)) {
+		err = -EINVAL;
+		goto out;
+	}
 
-	if (!next3_snapshot_list(inode)) {
-		snapshot_debug(1, "next3_snapshot_disable() called with "
-			       "snapshot file (ino=%lu) not on list\n",
-			       inode->i_ino);
-		return -EINVAL;
+	sbh = next3_snapshot_verify_bread(inode, sbi->s_sbh->b_blocknr,
+					  &blocks);
+	if (!sbh) {
+		err = -EIO;
+		goto out;
+	}
+	es = (struct next3_super_block *)(sbh->b_data +
+			((char *)sbi->s_es - sbi->s_sbh->b_data));
+	if (es->s_magic != cpu_to_le16(NEXT3_SUPER_MAGIC) ||
+	    le32_to_cpu(es->s_blocks_count) >
+	    le32_to_cpu(sbi->s_es->s_blocks_count) ||
+	    es->s_first_data_block != sbi->s_es->s_first_data_block ||
+	    es->s_blocks_per_group != sbi->s_es->s_blocks_per_group ||
+	    es->s_inodes_per_group != sbi->s_es->s_inodes_per_group) {
+		next3_warning(sb, __func__, "snapshot (%u) bad super block "
+			      "copy", inode->i_generation);
+		verify->sv_errors = 1;
+		verify->sv_count = 0;
+		goto out;
 	}
 
-	if (ei->i_flags & NEXT3_SNAPFILE_OPEN_FL) {
-		snapshot_debug(1, "disable of mounted snapshot (%u) "
-				"is not permitted\n",
-				inode->i_generation);
-		return -EPERM;
+	groups_count = DIV_ROUND_UP(le32_to_cpu(es->s_blocks_count) -
+				    le32_to_cpu(es->s_first_data_block),
+				    NEXT3_BLOCKS_PER_GROUP(sb));
+	end = verify->sv_start + verify->sv_count;
+	if (end > groups_count || end < verify->sv_start)
+		end = groups_count;
+	for (group = verify->sv_start; group < end; group++) {
+		if (group / NEXT3_DESC_PER_BLOCK(sb) != gdb) {
+			gdb = group / NEXT3_DESC_PER_BLOCK(sb);
+			brelse(gbh);
+			gbh = next3_snapshot_verify_bread(inode,
+					sbi->s_group_desc[gdb]->b_blocknr,
+					&blocks);
+			if (!gbh) {
+				err = -EIO;
+				break;
+			}
+		}
+		desc = (struct next3_group_desc *)gbh->b_data +
+			group % NEXT3_DESC_PER_BLOCK(sb);
+		errors = next3_snapshot_verify_group(inode, es, desc, group,
+						     &blocks, 0);
+		if (errors)
+			/* verify again in case read through mapping changed */
+			errors = next3_snapshot_verify_group(inode, es, desc,
+							group, &blocks, 1);
+		if (errors && !verify->sv_errors)
+			verify->sv_first_error = group;
+		verify->sv_errors += errors;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			group++;
+			break;
+		}
+		cond_resched();
 	}
+	verify->sv_count = group - verify->sv_start;
+	verify->sv_start = group;
+out:
+	verify->sv_blocks = blocks;
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	brelse(gbh);
+	brelse(sbh);
+	return err;
+}
 
-	/*
-	 * set i_size to zero to disable loop device mount
-	 */
-	SNAPSHOT_SET_DISABLED(inode);
-	ei->i_flags &= ~NEXT3_SNAPFILE_ENABLED_FL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+/*
+ * Snapshot rollback
+ *
+ * The blocks that were changed since snapshot take are the blocks that are
+ * mapped in the snapshot file or in newer snapshot files.  Rollback writes
+ * the snapshot image version of those blocks back in place, the same way
+ * that FIEMAP resolves the snapshot image:
+ * - blocks that were moved to a snapshot are mapped to themselves, so the
+ *   snapshot image version is still in place and nothing is copied.  Once
+ *   the metadata of the snapshot image is restored, those blocks are owned
+ *   again by the files of the image.
+ * - blocks that were copied to a snapshot are copied back in place.
+ * - block bitmaps that were not copied to a snapshot are masked with the
+ *   exclude bitmap, which is then cleared, because the snapshot image has no
+ *   snapshot files (see next3_snapshot_take()).
+ * Blocks that are copied back are never snapshot file blocks, so the
+ * snapshot files can still be read while they are being copied.  The group
+ * descriptors, the inode table blocks of the snapshot inodes and the super
+ * block are written last, so an interrupted rollback can be run again.
+ * Rollback is done on a read-only mounted file system, which has to be
+ * unmounted afterwards, because all the in-memory state is stale.
+ */
+struct next3_rollback_block {
+	next3_fsblk_t dst;		/* block to write back in place */
+	next3_fsblk_t src;		/* snapshot image version or 0 */
+};
 
-	/* invalidate page cache */
-	truncate_inode_pages(&inode->i_data, 0);
+static int next3_rollback_block_cmp(const void *a, const void *b)
+{
+	const struct next3_rollback_block *x = a, *y = b;
 
-	/* Don't need i_size_read because we hold i_mutex */
-	snapshot_debug(4, "setting snapshot (%u) i_size to (%lld)\n",
-			inode->i_generation, inode->i_size);
-	snapshot_debug(1, "snapshot (%u) disabled\n", inode->i_generation);
-	return 0;
+	if (x->dst < y->dst)
+		return -1;
+	return x->dst > y->dst;
 }
 
 /*
- * next3_snapshot_delete() marks snapshot for deletion
- * Called under i_mutex and snapshot_mutex
+ * next3_snapshot_rollback_copy() - copy @count blocks from @src to @dst
+ * The source blocks are read ahead, so the run is read in large requests.
  */
-static int next3_snapshot_delete(struct inode *inode)
+static int next3_snapshot_rollback_copy(struct super_block *sb,
+		next3_fsblk_t dst, next3_fsblk_t src, unsigned long count)
 {
-	struct next3_inode_info *ei = NEXT3_I(inode);
+	struct buffer_head *sbh, *bh;
+	unsigned long i;
 
-	if (!next3_snapshot_list(inode)) {
-		snapshot_debug(1, "next3_snapshot_delete() called with "
-			       "snapshot file (ino=%lu) not on list\n",
-			       inode->i_ino);
-		return -EINVAL;
+	for (i = 0; i < count; i++)
+		sb_breadahead(sb, src + i);
+	for (i = 0; i < count; i++) {
+		sbh = sb_bread(sb, src + i);
+		if (!sbh)
+			return -EIO;
+		bh = sb_getblk(sb, dst + i);
+		if (!bh) {
+			brelse(sbh);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, sbh->b_data, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		brelse(sbh);
 	}
+	return 0;
+}
 
-	if (ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL) {
-		snapshot_debug(1, "delete of enabled snapshot (%u) "
-				"is not permitted\n",
-				inode->i_generation);
-		return -EPERM;
+/*
+ * next3_snapshot_rollback_bitmaps() - fix block bitmaps and exclude bitmaps
+ * @groups_count:	no. of block groups in the snapshot image
+ * Called before group descriptors are rolled back.
+ */
+static int next3_snapshot_rollback_bitmaps(struct inode *inode,
+		unsigned long groups_count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_group_desc *desc;
+	struct buffer_head *bh, *exclude_bh;
+	next3_fsblk_t bitmap_blk, phys;
+	unsigned long group;
+	__u32 flags;
+	unsigned int i;
+	int err;
+
+	for (group = 0; group < groups_count; group++) {
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (!desc)
+			return -EIO;
+		bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+		err = next3_snapshot_fiemap_resolve(inode, bitmap_blk, 1,
+						    &phys, &flags);
+		if (err < 0)
+			return err;
+		if (!(flags & NEXT3_FIEMAP_EXTENT_BLOCKDEV))
+			/* COW bitmap was copied back in place */
+			continue;
+		exclude_bh = read_exclude_bitmap(sb, group);
+		if (!exclude_bh)
+			continue;
+		bh = sb_bread(sb, bitmap_blk);
+		if (!bh) {
+			brelse(exclude_bh);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		for (i = 0; i < sb->s_blocksize / sizeof(long); i++)
+			((unsigned long *)bh->b_data)[i] &=
+				~((unsigned long *)exclude_bh->b_data)[i];
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		brelse(exclude_bh);
+		cond_resched();
 	}
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		return err;
 
-	/* mark deleted for later cleanup to finish the job */
-	ei->i_flags |= NEXT3_SNAPFILE_DELETED_FL;
-	snapshot_debug(1, "snapshot (%u) marked for deletion\n",
-			inode->i_generation);
-	return 0;
+	/* masked block bitmaps are on disk - clear exclude bitmaps */
+	for (group = 0; group < groups_count; group++) {
+		exclude_bh = read_exclude_bitmap(sb, group);
+		if (!exclude_bh)
+			continue;
+		lock_buffer(exclude_bh);
+		memset(exclude_bh->b_data, 0, sb->s_blocksize);
+		unlock_buffer(exclude_bh);
+		mark_buffer_dirty(exclude_bh);
+		brelse(exclude_bh);
+		cond_resched();
+	}
+	return sync_blockdev(sb->s_bdev);
 }
 
 /*
- * next3_snapshot_remove - removes a snapshot from the list
- * @inode: snapshot inode
+ * next3_snapshot_rollback() - roll back the file system to snapshot image
+ * @inode:	snapshot inode
+ * @rollback:	returns no. of blocks copied and restored in place
  *
- * Removed the snapshot inode from in-memory and on-disk snapshots list of
- * and truncates the snapshot inode.
- * Called from next3_snapshot_update/cleanup/merge() under snapshot_mutex.
+ * Called on a read-only mounted file system.  The file system cannot be
+ * remounted read-write after rollback and has to be unmounted.
  * Returns 0 on success and <0 on error.
  */
-static int next3_snapshot_remove(struct inode *inode)
+int next3_snapshot_rollback(struct inode *inode,
+		struct next3_snapshot_rollback *rollback)
 {
-	handle_t *handle;
-	struct next3_sb_info *sbi;
-	struct next3_inode_info *ei = NEXT3_I(inode);
-	int err = 0, ret;
-
-	/* elevate ref count until final cleanup */
-	if (!igrab(inode))
-		return -EIO;
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_rollback_block *deferred = NULL;
+	struct next3_super_block *es;
+	struct next3_group_desc *desc;
+	struct buffer_head *sbh = NULL;
+	struct list_head *l;
+	next3_fsblk_t block, blocks_count, phys;
+	unsigned long groups_count, ino, i, n, m, d, ndeferred = 0;
+	__u32 flags;
+	int err = 0;
 
-	if (ei->i_flags & (NEXT3_SNAPFILE_ENABLED_FL | NEXT3_SNAPFILE_INUSE_FL
-			   | NEXT3_SNAPFILE_ACTIVE_FL)) {
-		snapshot_debug(4, "deferred delete of %s snapshot (%u)\n",
-				(ei->i_flags & NEXT3_SNAPFILE_ACTIVE_FL) ?
-				"active" :
-				((ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL) ?
-				"enabled" : "referenced"),
-			       inode->i_generation);
-		goto out_err;
+	rollback->sr_copied = 0;
+	rollback->sr_inplace = 0;
+	/* rollback writes behind the back of a read-write mount */
+	if (!(sb->s_flags & MS_RDONLY) || sbi->s_snapshot_rollback ||
+	    NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_RECOVER))
+		return -EBUSY;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (!next3_snapshot_list(inode) ||
+		(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_DELETED_FL)) {
+		err = -EINVAL;
+		goto out;
 	}
 
-	/* start large truncate transaction that will be extended/restarted */
-	handle = next3_journal_start(inode, NEXT3_MAX_TRANS_DATA);
-	if (IS_ERR(handle)) {
-		err = PTR_ERR(handle);
-		goto out_err;
+	/* snapshot copy of super block */
+	err = -EIO;
+	if (next3_snapshot_fiemap_resolve(inode, sbi->s_sbh->b_blocknr, 1,
+					  &phys, &flags) <= 0 ||
+	    (flags & NEXT3_FIEMAP_EXTENT_BLOCKDEV))
+		goto out;
+	sbh = sb_bread(sb, phys);
+	if (!sbh)
+		goto out;
+	es = (struct next3_super_block *)(sbh->b_data +
+			((char *)sbi->s_es - sbi->s_sbh->b_data));
+	blocks_count = le32_to_cpu(es->s_blocks_count);
+	if (es->s_magic != cpu_to_le16(NEXT3_SUPER_MAGIC) ||
+	    blocks_count > le32_to_cpu(sbi->s_es->s_blocks_count) ||
+	    es->s_blocks_per_group != sbi->s_es->s_blocks_per_group ||
+	    es->s_inodes_per_group != sbi->s_es->s_inodes_per_group)
+		goto out;
+	groups_count = DIV_ROUND_UP(blocks_count -
+				    le32_to_cpu(es->s_first_data_block),
+				    NEXT3_BLOCKS_PER_GROUP(sb));
+
+	/*
+	 * Blocks that are needed to read the snapshot files: super block,
+	 * group descriptors and inode table blocks of snapshot inodes.
+	 */
+	n = 1 + sbi->s_gdb_count;
+	list_for_each(l, &sbi->s_snapshot_list)
+		n++;
+	err = -ENOMEM;
+	deferred = kcalloc(n, sizeof(*deferred), GFP_KERNEL);
+	if (!deferred)
+		goto out;
+	deferred[ndeferred++].dst = sbi->s_sbh->b_blocknr;
+	for (i = 0; i < sbi->s_gdb_count; i++)
+		deferred[ndeferred++].dst = sbi->s_group_desc[i]->b_blocknr;
+	list_for_each(l, &sbi->s_snapshot_list) {
+		ino = list_entry(l, struct next3_inode_info,
+				 i_snaplist)->vfs_inode.i_ino - 1;
+		desc = next3_get_group_desc(sb,
+				ino / NEXT3_INODES_PER_GROUP(sb), NULL);
+		if (!desc)
+			goto out;
+		deferred[ndeferred++].dst = le32_to_cpu(desc->bg_inode_table) +
+			(ino % NEXT3_INODES_PER_GROUP(sb)) /
+			(NEXT3_BLOCK_SIZE(sb) / NEXT3_INODE_SIZE(sb));
 	}
-	sbi = NEXT3_SB(inode->i_sb);
+	sort(deferred, ndeferred, sizeof(*deferred),
+	     next3_rollback_block_cmp, NULL);
+
+	/* copy back changed blocks in place */
+	snapshot_debug(1, "rollback to snapshot (%u)...\n",
+		       inode->i_generation);
+	block = 0;
+	d = 0;
+	while (block < blocks_count) {
+		/* scan up to block group boundary */
+		unsigned long count = SNAPSHOT_BLOCKS_PER_GROUP -
+			SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+
+		if (count > blocks_count - block)
+			count = blocks_count - block;
+		err = next3_snapshot_fiemap_resolve(inode, block, count,
+						    &phys, &flags);
+		if (err < 0)
+			goto out;
+		n = err;
+		err = 0;
+		if (flags & NEXT3_FIEMAP_EXTENT_BLOCKDEV) {
+			/* not changed since snapshot take */
+		} else if (phys == block) {
+			/* moved to snapshot and still in place */
+			rollback->sr_inplace += n;
+		} else {
+			for (i = 0; i < n; i += m) {
+				while (d < ndeferred &&
+				       deferred[d].dst < block + i)
+					d++;
+				m = n - i;
+				if (d < ndeferred &&
+				    deferred[d].dst < block + n)
+					m = deferred[d].dst - (block + i);
+				if (!m) {
+					/* copy back deferred block last */
+					deferred[d].src = phys + i;
+					m = 1;
+					continue;
+				}
+				err = next3_snapshot_rollback_copy(sb,
+						block + i, phys + i, m);
+				if (err)
+					goto out;
+				rollback->sr_copied += m;
+			}
+		}
+		block += n;
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
-	err = next3_snapshot_clean(handle, inode, 1);
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		cond_resched();
+	}
+	err = sync_blockdev(sb->s_bdev);
 	if (err)
-		goto out_handle;
+		goto out;
 
-	/* reset snapshot inode size */
-	i_size_write(inode, 0);
-	ei->i_disksize = 0;
-	err = next3_mark_inode_dirty(handle, inode);
+	err = next3_snapshot_rollback_bitmaps(inode, groups_count);
 	if (err)
-		goto out_handle;
-#endif
+		goto out;
 
-	err = extend_or_restart_transaction_inode(handle, inode, 2);
-	if (err)
-		goto out_handle;
-
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
-	err = next3_inode_list_del(handle, inode, &NEXT_SNAPSHOT(inode),
-			&sbi->s_es->s_snapshot_list,
-			&NEXT3_SB(inode->i_sb)->s_snapshot_list,
-			"snapshot");
-	if (err)
-		goto out_handle;
-	/* remove snapshot list reference - taken on snapshot_create() */
-	iput(inode);
-#else
-	lock_super(inode->i_sb);
-	err = next3_journal_get_write_access(handle, sbi->s_sbh);
-	sbi->s_es->s_snapshot_list = 0;
+	/* no turning back from here */
+	sbi->s_snapshot_rollback = 1;
+	for (d = 0; d < ndeferred; d++) {
+		if (!deferred[d].src)
+			continue;
+		err = next3_snapshot_rollback_copy(sb, deferred[d].dst,
+						   deferred[d].src, 1);
+		if (err)
+			goto out;
+		rollback->sr_copied++;
+	}
+	/* the snapshot image is a file system now */
+	lock_buffer(sbi->s_sbh);
+	sbi->s_es->s_flags &= ~cpu_to_le32(NEXT3_FLAGS_IS_SNAPSHOT);
+	unlock_buffer(sbi->s_sbh);
+	mark_buffer_dirty(sbi->s_sbh);
+	err = sync_blockdev(sb->s_bdev);
 	if (!err)
-		err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
-	unlock_super(inode->i_sb);
-	if (err)
-		goto out_handle;
+		next3_msg(sb, KERN_INFO, "rolled back to snapshot (%u) - "
+			  "copied %llu blocks. umount and run fsck.",
+			  inode->i_generation, rollback->sr_copied);
+out:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	kfree(deferred);
+	brelse(sbh);
+	return err;
+}
+
 #endif
-	/*
-	 * At this point, this snapshot is empty and not on the snapshots list.
-	 * As long as it was on the list it had to have the LIST flag to prevent
-	 * truncate/unlink.  Now that it is removed from the list, the LIST flag
-	 * and other snapshot status flags should be cleared.  It will still
-	 * have the SNAPFILE and DELETED flag to indicate this is a deleted
-	 * snapshot that should not be recycled.  There is no need to mark the
-	 * inode dirty, because the 'dynamic' status flags are not persistent.
-	 */
-	ei->i_flags &= ~NEXT3_FL_SNAPSHOT_DYN_MASK;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
+/*
+ * next3_snapshot_copy_block() - copy block to new snapshot
+ * @snapshot:	new snapshot to copy block to
+ * @bh:		source buffer to be copied
+ * @mask:	if not NULL, mask buffer data before copying to snapshot
+ * 		(used to mask block bitmap with exclude bitmap)
+ * @name:	name of copied block to print
+ * @idx:	index of copied block to print
+ *
+ * Called from next3_snapshot_take() under journal_lock_updates()
+ * Returns snapshot buffer on success, NULL on error
+ */
+static struct buffer_head *next3_snapshot_copy_block(struct inode *snapshot,
+		struct buffer_head *bh, const char *mask,
+		const char *name, unsigned long idx)
+{
+	struct buffer_head *sbh = NULL;
+	int err;
 
-out_handle:
-	ret = next3_journal_stop(handle);
-	if (!err)
-		err = ret;
-	if (err)
-		goto out_err;
+	if (!bh)
+		return NULL;
 
-	/* sleep 1 tunable delay unit */
-	snapshot_test_delay(SNAPTEST_DELETE);
-	snapshot_debug(1, "snapshot (%u) deleted\n", inode->i_generation);
+	sbh = next3_getblk(&dummy_handle, snapshot,
+			SNAPSHOT_IBLOCK(bh->b_blocknr),
+			SNAPMAP_READ, &err);
 
-	err = 0;
-out_err:
-	/* drop final ref count - taken on entry to this function */
-	iput(inode);
-	if (err) {
-		snapshot_debug(1, "failed to delete snapshot (%u)\n",
-				inode->i_generation);
+	if (err || !sbh || sbh->b_blocknr == bh->b_blocknr) {
+		snapshot_debug(1, "failed to copy %s (%lu) "
+				"block [%lu/%lu] to snapshot (%u)\n",
+				name, idx,
+				SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
+				snapshot->i_generation);
+		brelse(sbh);
+		return NULL;
 	}
-	return err;
+
+	next3_snapshot_copy_buffer(sbh, bh, mask);
+
+	snapshot_debug(4, "copied %s (%lu) block [%lu/%lu] "
+			"to snapshot (%u)\n",
+			name, idx,
+			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
+			snapshot->i_generation);
+	return sbh;
 }
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
 /*
- * next3_snapshot_shrink_range - free unused blocks from deleted snapshots
- * @handle: JBD handle for this transaction
- * @start:	latest non-deleted snapshot before deleted snapshots group
- * @end:	first non-deleted snapshot after deleted snapshots group
- * @iblock:	inode offset to first data block to shrink
- * @maxblocks:	inode range of data blocks to shrink
- * @cow_bh:	buffer head to map the COW bitmap block of snapshot @start
- *		if NULL, don't look for COW bitmap block
- *
- * Shrinks @maxblocks blocks starting at inode offset @iblock in a group of
- * subsequent deleted snapshots starting after @start and ending before @end.
- * Shrinking is done by finding a range of mapped blocks in @start snapshot
- * or in one of the deleted snapshots, where no other blocks are mapped in the
- * same range in @start snapshot or in snapshots between them.
- * The blocks in the found range may be 'in-use' by @start snapshot, so only
- * blocks which are not set in the COW bitmap are freed.
- * All mapped blocks of other deleted snapshots in the same range are freed.
- *
- * Called from next3_snapshot_shrink() under snapshot_mutex.
- * Returns the shrunk blocks range and <0 on error.
+ * Snapshot take copies are written to disk in batches.  All writes of a
+ * batch are submitted before waiting on any of them, so the time the file
+ * system is frozen is the latency of a few parallel (and merged) writes
+ * instead of the sum of the latencies of all the synchronous writes.
  */
-static int next3_snapshot_shrink_range(handle_t *handle,
-		struct inode *start, struct inode *end,
-		sector_t iblock, unsigned long maxblocks,
-		struct buffer_head *cow_bh)
-{
-	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
-	struct list_head *l;
-	struct inode *inode = start;
-	/* start with @maxblocks range and narrow it down */
-	int err, count = maxblocks;
-	/* @start snapshot blocks should not be freed only counted */
-	int mapped, shrink = 0;
-
-	/* iterate on (@start <= snapshot < @end) */
-	list_for_each_prev(l, &NEXT3_I(start)->i_snaplist) {
-		err = next3_snapshot_shrink_blocks(handle, inode,
-				iblock, count, cow_bh, shrink, &mapped);
-		if (err < 0)
-			return err;
+#define NEXT3_SNAPSHOT_COPY_BATCH	32
 
-		/* 0 < new range <= old range */
-		BUG_ON(!err || err > count);
-		count = err;
-		cond_resched();
+struct next3_snapshot_copy_batch {
+	struct buffer_head *bhs[NEXT3_SNAPSHOT_COPY_BATCH];
+	int count;
+	int err;
+};
 
-		/*
-		 * shrink mode state transitions:
-		 * 1. on @start, shrink is set to 0 ('don't free' mode).
-		 * 2. after @start, shrink is incremented until mapped blocks
-		 *    are found in the shrunk range ('free unused' mode).
-		 * 3. after mapped block were found, or if cow_bh is NULL,
-		 *    shrink is set to -1 and decremented until the end of
-		 *    the deleted snapshots group ('free all' mode).
-		 */
-		if (shrink < 0)
-			/* stay in 'free all' mode */
-			shrink--;
-		else if (!cow_bh)
-			/* no COW bitmap - enter 'free all' mode */
-			shrink = -1;
-		else if (mapped)
-			/* found mapped blocks - enter 'free all' mode */
-			shrink = -1;
-		else
-			/* enter/stay in 'free unused' mode */
-			shrink++;
+/*
+ * next3_snapshot_copy_batch_flush() - write batched snapshot buffers
+ * Submits all dirty buffers in @batch, waits for their completion and
+ * releases them.  I/O errors are recorded in @batch->err.
+ */
+static void next3_snapshot_copy_batch_flush(
+		struct next3_snapshot_copy_batch *batch)
+{
+	struct buffer_head *bh;
+	int i;
 
-		if (l == &sbi->s_snapshot_list)
-			/* didn't reach @end */
-			return -EINVAL;
-		inode = &list_entry(l, struct next3_inode_info,
-						  i_snaplist)->vfs_inode;
-		if (inode == end)
-			break;
+	for (i = 0; i < batch->count; i++) {
+		bh = batch->bhs[i];
+		lock_buffer(bh);
+		if (!test_clear_buffer_dirty(bh)) {
+			unlock_buffer(bh);
+			continue;
+		}
+		get_bh(bh);
+		bh->b_end_io = end_buffer_write_sync;
+		submit_bh(WRITE, bh);
 	}
-	return count;
+	for (i = 0; i < batch->count; i++) {
+		bh = batch->bhs[i];
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			batch->err = -EIO;
+		brelse(bh);
+	}
+	snapshot_debug(4, "flushed %d snapshot take buffers (err=%d)\n",
+			batch->count, batch->err);
+	batch->count = 0;
 }
 
 /*
- * next3_snapshot_shrink - free unused blocks from deleted snapshot files
- * @handle: JBD handle for this transaction
- * @start:	latest non-deleted snapshot before deleted snapshots group
- * @end:	first non-deleted snapshot after deleted snapshots group
- * @need_shrink: no. of deleted snapshots in the group
- *
- * Frees all blocks in subsequent deleted snapshots starting after @start and
- * ending before @end, except for blocks which are 'in-use' by @start snapshot.
- * (blocks 'in-use' are set in snapshot COW bitmap and not copied to snapshot).
- * Called from next3_snapshot_update() under snapshot_mutex.
- * Returns 0 on success and <0 on error.
+ * next3_snapshot_copy_batch_add() - add dirty snapshot buffer to @batch
+ * The batch takes its own reference on @sbh.  A buffer that is modified
+ * after it was added, but before the batch is flushed, is written once.
  */
-static int next3_snapshot_shrink(struct inode *start, struct inode *end,
-				 int need_shrink)
+static void next3_snapshot_copy_batch_add(
+		struct next3_snapshot_copy_batch *batch,
+		struct buffer_head *sbh)
 {
-	struct list_head *l;
-	handle_t *handle;
-	struct buffer_head cow_bitmap, *cow_bh = NULL;
-	next3_fsblk_t block = 0;
-	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
-	/* blocks beyond the size of @start are not in-use by @start */
-	next3_fsblk_t snapshot_blocks = SNAPSHOT_BLOCKS(start);
-	unsigned long count = le32_to_cpu(sbi->s_es->s_blocks_count);
-	long block_group = -1;
-	next3_fsblk_t bg_boundary = 0;
-	int err, ret;
+	int i;
 
-	snapshot_debug(3, "snapshot (%u-%u) shrink: "
-			"count = 0x%lx, need_shrink = %d\n",
-			start->i_generation, end->i_generation,
-			count, need_shrink);
+	for (i = 0; i < batch->count; i++)
+		if (batch->bhs[i] == sbh)
+			return;
+	if (batch->count == NEXT3_SNAPSHOT_COPY_BATCH)
+		next3_snapshot_copy_batch_flush(batch);
+	get_bh(sbh);
+	batch->bhs[batch->count++] = sbh;
+}
 
-	/* start large truncate transaction that will be extended/restarted */
-	handle = next3_journal_start(start, NEXT3_MAX_TRANS_DATA);
-	if (IS_ERR(handle))
-		return PTR_ERR(handle);
+#endif
+/*
+ * List of blocks which are copied to snapshot for every special inode.
+ * Keep block bitmap first and inode table block last in the list.
+ */
+enum copy_inode_block {
+	COPY_BLOCK_BITMAP,
+	COPY_INODE_BITMAP,
+	COPY_INODE_TABLE,
+	COPY_INODE_BLOCKS_NUM
+};
 
-	while (count > 0) {
-		while (block >= bg_boundary) {
-			/* sleep 1/block_groups tunable delay unit */
-			snapshot_test_delay_per_ticks(SNAPTEST_DELETE,
-					sbi->s_groups_count);
-			/* reset COW bitmap cache */
-			cow_bitmap.b_state = 0;
-			cow_bitmap.b_blocknr = 0;
-			cow_bh = &cow_bitmap;
-			bg_boundary += SNAPSHOT_BLOCKS_PER_GROUP;
-			block_group++;
-			if (block >= snapshot_blocks)
-				/*
-				 * Past last snapshot block group - pass NULL
-				 * cow_bh to next3_snapshot_shrink_range().
-				 * This will cause snapshots after resize to
-				 * shrink to the size of @start snapshot.
-				 */
-				cow_bh = NULL;
-		}
+static char *copy_inode_block_name[COPY_INODE_BLOCKS_NUM] = {
+	"block bitmap",
+	"inode bitmap",
+	"inode table"
+};
 
-		err = extend_or_restart_transaction(handle,
-						    NEXT3_MAX_TRANS_DATA);
-		if (err)
-			goto out_err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+/*
+ * Inode table blocks, which were already copied to the new snapshot.
+ * Snapshot inodes tend to share a few inode table blocks, so each of
+ * those blocks (and the bitmaps of its group) is copied only once and
+ * the raw snapshot inodes are fixed in the existing copy.
+ */
+struct next3_snapshot_take_copy {
+	next3_fsblk_t blk;
+	unsigned long group;
+	struct buffer_head *sbh;
+};
 
-		err = next3_snapshot_shrink_range(handle, start, end,
-					      SNAPSHOT_IBLOCK(block), count,
-					      cow_bh);
+/*
+ * next3_snapshot_take_copied() - lookup inode table block copy
+ * Returns the copy of inode table block @blk or NULL if it was not copied.
+ * Sets *@group_copied if the bitmaps of block group @group were copied.
+ */
+static struct next3_snapshot_take_copy *next3_snapshot_take_copied(
+		struct next3_snapshot_take_copy *copied, int ncopied,
+		next3_fsblk_t blk, unsigned long group, int *group_copied)
+{
+	int i;
 
-		snapshot_debug(3, "snapshot (%u-%u) shrink: "
-				"block = 0x%lx, count = 0x%lx, err = 0x%x\n",
-				start->i_generation, end->i_generation,
-				block, count, err);
+	*group_copied = 0;
+	for (i = 0; i < ncopied; i++) {
+		if (copied[i].blk == blk)
+			return copied + i;
+		if (copied[i].group == group)
+			*group_copied = 1;
+	}
+	return NULL;
+}
 
-		if (buffer_mapped(&cow_bitmap) && buffer_new(&cow_bitmap)) {
-			snapshot_debug(2, "snapshot (%u-%u) shrink: "
-				"block group = %ld/%lu, "
-				"COW bitmap = [%lu/%lu]\n",
-				start->i_generation, end->i_generation,
-				block_group, sbi->s_groups_count,
-				SNAPSHOT_BLOCK_TUPLE(cow_bitmap.b_blocknr));
-			clear_buffer_new(&cow_bitmap);
-		}
+#endif
+#endif
+
+/*
+ * next3_snapshot_take() makes a new snapshot file
+ * into the active snapshot
+ *
+ * this function calls journal_lock_updates()
+ * and should not be called during a journal transaction
+ * Called from next3_ioctl() under i_mutex and snapshot_mutex
+ */
+int next3_snapshot_take(struct inode *inode)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
+	struct list_head *list = &NEXT3_SB(inode->i_sb)->s_snapshot_list;
+	struct list_head *l = list->next;
+#endif
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_super_block *es = NULL;
+	struct buffer_head *sbh = NULL;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	struct buffer_head *exclude_bitmap_bh = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
+	struct buffer_head *bhs[COPY_INODE_BLOCKS_NUM] = { NULL };
+	const char *mask = NULL;
+	struct inode *curr_inode;
+	struct next3_iloc iloc;
+	struct next3_group_desc *desc;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
+	next3_fsblk_t prev_inode_blk = 0;
+	struct next3_inode *raw_inode;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	struct next3_snapshot_take_copy *copied = NULL, *copy;
+	int ncopied = 0, maxcopied = 2;
+	int group_copied = 0;
+#endif
+	int i;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	struct next3_snapshot_copy_batch batch;
+#endif
+#endif
+	int err = -EIO;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+	u64 snapshot_r_blocks;
+	struct kstatfs statfs;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	unsigned int cow_rate;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	ktime_t take_start, phase_start;
+#endif
+
+	snapshot_phase_start(take_start);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	batch.count = 0;
+	batch.err = 0;
+#endif
+	if (!sbi->s_sbh)
+		goto out_err;
+	else if (sbi->s_sbh->b_blocknr != 0) {
+		snapshot_debug(1, "warning: unexpected super block at block "
+			"(%lld:%d)!\n", (long long)sbi->s_sbh->b_blocknr,
+			(int)((char *)sbi->s_es - (char *)sbi->s_sbh->b_data));
+	} else if (sbi->s_es->s_magic != cpu_to_le16(NEXT3_SUPER_MAGIC)) {
+		snapshot_debug(1, "warning: super block of snapshot (%u) is "
+			       "broken!\n", inode->i_generation);
+	} else
+		sbh = next3_getblk(&dummy_handle, inode, SNAPSHOT_IBLOCK(0),
+				   SNAPMAP_READ, &err);
+
+	if (!sbh || sbh->b_blocknr == 0) {
+		snapshot_debug(1, "warning: super block of snapshot (%u) not "
+			       "allocated\n", inode->i_generation);
+		goto out_err;
+	} else {
+		snapshot_debug(4, "super block of snapshot (%u) mapped to "
+			       "block (%lld)\n", inode->i_generation,
+			       (long long)sbh->b_blocknr);
+		es = (struct next3_super_block *)(sbh->b_data +
+						  ((char *)sbi->s_es -
+						   sbi->s_sbh->b_data));
+	}
+
+	err = -EIO;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+	/* update fs statistics to calculate snapshot reserved space */
+	if (next3_statfs_sb(sb, &statfs)) {
+		snapshot_debug(1, "failed to statfs before snapshot (%u) "
+			       "take\n", inode->i_generation);
+		goto out_err;
+	}
+	snapshot_r_blocks = next3_snapshot_reserve_static(&statfs);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	/* learn from the active snapshot, which is about to be replaced */
+	cow_rate = next3_snapshot_cow_rate_avg(sbi->s_snapshot_cow_rate,
+					next3_snapshot_active_cow_rate(sb));
+	if (sbi->s_snapshot_reserve_adaptive)
+		snapshot_r_blocks = next3_snapshot_reserve_adapt(sb, &statfs,
+						snapshot_r_blocks, cow_rate);
+#endif
+
+	/* verify enough free space before taking the snapshot */
+	if (statfs.f_bfree < snapshot_r_blocks) {
+		err = -ENOSPC;
+		goto out_err;
+	}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	/* one inode table block copy at most per snapshot inode + root */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
+	maxcopied = 1;
+	for (l = list->next; l != list; l = l->next)
+		maxcopied++;
+	l = list->next;
+#endif
+	/* on allocation failure, fall back to copy block per inode */
+	copied = kmalloc(maxcopied * sizeof(*copied), GFP_NOFS);
+	if (!copied)
+		maxcopied = 0;
+
+#endif
+	/*
+	 * flush journal to disk and clear the RECOVER flag
+	 * before taking the snapshot
+	 */
+	snapshot_phase_start(phase_start);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+	/* flush the journal, but leave the RECOVER flag set */
+	err = next3_freeze_lite(sb);
+	lock_super(sb);
+	if (err)
+		goto out_unlockfs;
+#else
+	sb->s_op->freeze_fs(sb);
+	lock_super(sb);
+#endif
+	snapshot_phase_next(sb, TAKE_FREEZE, phase_start);
+
+#ifdef CONFIG_NEXT3_FS_DEBUG
+	if (snapshot_enable_test[SNAPTEST_TAKE]) {
+		snapshot_debug(1, "taking snapshot (%u) ...\n",
+				inode->i_generation);
+		/* sleep 1 tunable delay unit */
+		snapshot_test_delay(SNAPTEST_TAKE);
+	}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
+	/*
+	 * copy super block to snapshot and fix it
+	 */
+	lock_buffer(sbh);
+	memcpy(sbh->b_data, sbi->s_sbh->b_data, sb->s_blocksize);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+	/*
+	 * The journal was flushed, but RECOVER is still set on the file
+	 * system.  The snapshot image needs no recovery.
+	 */
+	es->s_feature_incompat &=
+		~cpu_to_le32(NEXT3_FEATURE_INCOMPAT_RECOVER);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
+	/*
+	 * Convert from Next3 to Ext3 super block:
+	 * Remove the HAS_SNAPSHOT flag and snapshot inode number.
+	 * Set the IS_SNAPSHOT flag to signal fsck this is a snapshot image.
+	 */
+	es->s_feature_ro_compat &=
+		~cpu_to_le32(NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT);
+	es->s_snapshot_inum = 0;
+	es->s_snapshot_list = 0;
+	es->s_flags |= cpu_to_le32(NEXT3_FLAGS_IS_SNAPSHOT);
+#endif
+	set_buffer_uptodate(sbh);
+	unlock_buffer(sbh);
+	mark_buffer_dirty(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	next3_snapshot_copy_batch_add(&batch, sbh);
+#else
+	sync_dirty_buffer(sbh);
+#endif
+	snapshot_phase_next(sb, TAKE_SUPER, phase_start);
+
+	/*
+	 * copy group descriptors to snapshot
+	 */
+	for (i = 0; i < sbi->s_gdb_count; i++) {
+		brelse(sbh);
+		sbh = next3_snapshot_copy_block(inode,
+				sbi->s_group_desc[i], NULL,
+				"GDT", i);
+		if (!sbh)
+			goto out_unlockfs;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+		next3_snapshot_copy_batch_add(&batch, sbh);
+#endif
+	}
+	snapshot_phase_next(sb, TAKE_GDT, phase_start);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
+	/* start with root inode and continue with snapshot list */
+	curr_inode = sb->s_root->d_inode;
+copy_inode_blocks:
+#else
+	curr_inode = inode;
+#endif
+	/*
+	 * copy the following blocks to the new snapshot:
+	 * - block and inode bitmap blocks of curr_inode block group
+	 * - inode table block that contains curr_inode
+	 */
+	iloc.block_group = 0;
+	err = next3_get_inode_loc(curr_inode, &iloc);
+	desc = next3_get_group_desc(sb, iloc.block_group, NULL);
+	if (err || !desc) {
+		snapshot_debug(1, "failed to read inode and bitmap blocks "
+			       "of inode (%lu)\n", curr_inode->i_ino);
+		err = err ? : -EIO;
+		goto out_unlockfs;
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	copy = next3_snapshot_take_copied(copied, ncopied,
+			iloc.bh->b_blocknr, iloc.block_group, &group_copied);
+	if (copy) {
+		/* inode table block was copied - only fix the raw inode */
+		brelse(iloc.bh);
+		brelse(sbh);
+		sbh = copy->sbh;
+		get_bh(sbh);
+		goto fix_inode_copy;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
+	if (iloc.bh->b_blocknr == prev_inode_blk) {
+		/* bhs[COPY_INODE_TABLE] holds a reference to this block */
+		brelse(iloc.bh);
+		goto fix_inode_copy;
+	}
+	prev_inode_blk = iloc.bh->b_blocknr;
+#endif
+	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
+		brelse(bhs[i]);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	memset(bhs, 0, sizeof(bhs));
+	if (group_copied) {
+		/* group bitmaps were copied - only copy inode table block */
+		bhs[COPY_INODE_TABLE] = iloc.bh;
+		i = COPY_INODE_TABLE;
+		goto copy_inode_table;
+	}
+#endif
+	bhs[COPY_BLOCK_BITMAP] = sb_bread(sb,
+			le32_to_cpu(desc->bg_block_bitmap));
+	bhs[COPY_INODE_BITMAP] = sb_bread(sb,
+			le32_to_cpu(desc->bg_inode_bitmap));
+	bhs[COPY_INODE_TABLE] = iloc.bh;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bitmap_bh);
+	exclude_bitmap_bh = read_exclude_bitmap(sb, iloc.block_group);
+	if (exclude_bitmap_bh)
+		/* mask block bitmap with exclude bitmap */
+		mask = exclude_bitmap_bh->b_data;
+#endif
+	i = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+copy_inode_table:
+#endif
+	err = -EIO;
+	for (; i < COPY_INODE_BLOCKS_NUM; i++) {
+		brelse(sbh);
+		sbh = next3_snapshot_copy_block(inode, bhs[i], mask,
+				copy_inode_block_name[i], curr_inode->i_ino);
+		if (!sbh)
+			goto out_unlockfs;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+		next3_snapshot_copy_batch_add(&batch, sbh);
+#endif
+		mask = NULL;
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	if (ncopied < maxcopied) {
+		copied[ncopied].blk = bhs[COPY_INODE_TABLE]->b_blocknr;
+		copied[ncopied].group = iloc.block_group;
+		copied[ncopied].sbh = sbh;
+		get_bh(sbh);
+		ncopied++;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FIX
+fix_inode_copy:
+	/* get snapshot copy of raw inode */
+	iloc.bh = sbh;
+	raw_inode = next3_raw_inode(&iloc);
+	if (curr_inode->i_ino != NEXT3_ROOT_INO) {
+		/*
+		 * Snapshot inode blocks are excluded from COW bitmap,
+		 * so they appear to be not allocated in the snapshot's
+		 * block bitmap.  If we want the snapshot image to pass
+		 * fsck with no errors, we need to detach those blocks
+		 * from the copy of the snapshot inode, so we fix the
+		 * snapshot inodes to appear as empty regular files.
+		 */
+		raw_inode->i_size = 0;
+		raw_inode->i_size_high = 0;
+		raw_inode->i_blocks_lo = 0;
+		raw_inode->i_blocks_high = 0;
+		raw_inode->i_flags &= cpu_to_le32(~NEXT3_FL_SNAPSHOT_MASK);
+		memset(raw_inode->i_block, 0, sizeof(raw_inode->i_block));
+	}
+	mark_buffer_dirty(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	next3_snapshot_copy_batch_add(&batch, sbh);
+#else
+	sync_dirty_buffer(sbh);
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
+	if (l != list) {
+		curr_inode = &list_entry(l, struct next3_inode_info,
+				       i_snaplist)->vfs_inode;
+		l = l->next;
+		goto copy_inode_blocks;
+	}
+#else
+	if (curr_inode->i_ino == NEXT3_ROOT_INO) {
+		curr_inode = inode;
+		goto copy_inode_blocks;
+	}
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	/* snapshot copies must be on disk before snapshot becomes active */
+	next3_snapshot_copy_batch_flush(&batch);
+	err = batch.err;
+	if (err)
+		goto out_unlockfs;
+#endif
+	snapshot_phase_next(sb, TAKE_INODES, phase_start);
+#endif
+
+	/* reset COW bitmap cache */
+	err = next3_snapshot_reset_bitmap_cache(sb, 0);
+	if (err)
+		goto out_unlockfs;
+	/* set as in-memory active snapshot */
+	err = next3_snapshot_set_active(sb, inode);
+	if (err)
+		goto out_unlockfs;
+
+	/* set as on-disk active snapshot */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+	sbi->s_es->s_snapshot_r_blocks_count = cpu_to_le64(snapshot_r_blocks);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	/* start observing the COW rate of the new active snapshot */
+	sbi->s_snapshot_cow_rate = cow_rate;
+	sbi->s_es->s_snapshot_cow_rate = cpu_to_le32(cow_rate);
+	sbi->s_snapshot_active_since = get_seconds();
+	sbi->s_snapshot_active_base = 0;
+#endif
+	sbi->s_es->s_snapshot_id =
+		cpu_to_le32(le32_to_cpu(sbi->s_es->s_snapshot_id)+1);
+	if (sbi->s_es->s_snapshot_id == 0)
+		/* 0 is not a valid snapshot id */
+		sbi->s_es->s_snapshot_id = cpu_to_le32(1);
+	sbi->s_es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
+	snapshot_phase_next(sb, TAKE_BITMAP, phase_start);
+
+	err = 0;
+out_unlockfs:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_ASYNC
+	/* release batched buffers on error */
+	next3_snapshot_copy_batch_flush(&batch);
+#endif
+	unlock_super(sb);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+	next3_unfreeze_lite(sb);
+#else
+	sb->s_op->unfreeze_fs(sb);
+#endif
+
+	if (err)
+		goto out_err;
+
+	snapshot_phase_next(sb, TAKE_UNFREEZE, phase_start);
+	snapshot_phase_next(sb, TAKE, take_start);
+	snapshot_debug(1, "snapshot (%u) has been taken\n",
+			inode->i_generation);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	/* create COW bitmaps of the new snapshot in background */
+	next3_snapshot_cow_bitmap_work_start(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DUMP
+	next3_snapshot_dump(5, inode);
+#endif
+
+out_err:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bitmap_bh);
+#endif
+	brelse(sbh);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT
+	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
+		brelse(bhs[i]);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_INIT_DEDUP
+	for (i = 0; i < ncopied; i++)
+		brelse(copied[i].sbh);
+	kfree(copied);
+#endif
+	return err;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
+/*
+ * next3_snapshot_clean() "cleans" snapshot file blocks in 1 of 2 ways:
+ * 1. from next3_snapshot_remove() with @cleanup=1 to free snapshot file
+ *    blocks, before removing snapshot file from snapshots list.
+ * 2. from next3_snapshot_exclude() with @cleanup=0 to mark snapshot file
+ *    blocks in exclude bitmap.
+ * Called under snapshot_mutex.
+ *
+ * Return values:
+ * > 0 - no. of blocks in snapshot file (@cleanup=0)
+ * = 0 - successful cleanup (@cleanup=1)
+ * < 0 - error
+ */
+static int next3_snapshot_clean(handle_t *handle, struct inode *inode,
+		int cleanup)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	int i, nblocks = 0;
+	int *pblocks = (cleanup ? NULL : &nblocks);
+
+	if (!next3_snapshot_list(inode)) {
+		snapshot_debug(1, "next3_snapshot_clean() called with "
+			       "snapshot file (ino=%lu) not on list\n",
+			       inode->i_ino);
+		return -EINVAL;
+	}
+
+	if (ei->i_flags & NEXT3_SNAPFILE_ACTIVE_FL) {
+		snapshot_debug(1, "clean of active snapshot (%u) "
+			       "is not allowed.\n",
+			       inode->i_generation);
+		return -EPERM;
+	}
+
+	/*
+	 * A very simplified version of next3_truncate() for snapshot files.
+	 * A non-active snapshot file never allocates new blocks and only frees
+	 * blocks under snapshot_mutex, so no need to take truncate_sem here.
+	 * No need to add inode to orphan list for post crash truncate, because
+	 * snapshot is still on the snapshot list and marked for deletion.
+	 */
+	for (i = NEXT3_DIND_BLOCK; i < NEXT3_SNAPSHOT_N_BLOCKS; i++) {
+		int depth = (i == NEXT3_DIND_BLOCK ? 2 : 3);
+		if (!ei->i_data[i])
+			continue;
+		next3_free_branches_cow(handle, inode, NULL,
+				ei->i_data+i, ei->i_data+i+1, depth, pblocks);
+		if (cleanup)
+			ei->i_data[i] = 0;
+	}
+	return nblocks;
+}
+
+/*
+ * next3_snapshot_exclude() marks snapshot file blocks in exclude bitmap.
+ * Snapshot file blocks should already be excluded if everything works properly.
+ * This function is used only to verify the correctness of exclude bitmap.
+ * Called under i_mutex and snapshot_mutex.
+ */
+static int next3_snapshot_exclude(handle_t *handle, struct inode *inode)
+{
+	int err;
+
+	/* extend small transaction started in next3_ioctl() */
+	err = extend_or_restart_transaction(handle, NEXT3_MAX_TRANS_DATA);
+	if (err)
+		return err;
+
+	err = next3_snapshot_clean(handle, inode, 0);
+	if (err < 0)
+		return err;
+
+	snapshot_debug(1, "snapshot (%u) is clean (%d blocks)\n",
+			inode->i_generation, err);
+	return 0;
+}
+#endif
+
+/*
+ * next3_snapshot_enable() enables snapshot mount
+ * sets the in-use flag and the active snapshot
+ * Called under i_mutex and snapshot_mutex
+ */
+static int next3_snapshot_enable(struct inode *inode)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+
+	if (!next3_snapshot_list(inode)) {
+		snapshot_debug(1, "next3_snapshot_enable() called with "
+			       "snapshot file (ino=%lu) not on list\n",
+			       inode->i_ino);
+		return -EINVAL;
+	}
+
+	if (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL) {
+		snapshot_debug(1, "enable of deleted snapshot (%u) "
+				"is not permitted\n",
+				inode->i_generation);
+		return -EPERM;
+	}
+
+	/*
+	 * set i_size to block device size to enable loop device mount
+	 */
+	SNAPSHOT_SET_ENABLED(inode);
+	ei->i_flags |= NEXT3_SNAPFILE_ENABLED_FL;
+
+	/* Don't need i_size_read because we hold i_mutex */
+	snapshot_debug(4, "setting snapshot (%u) i_size to (%lld)\n",
+			inode->i_generation, inode->i_size);
+	snapshot_debug(1, "snapshot (%u) enabled\n", inode->i_generation);
+	return 0;
+}
+
+/*
+ * next3_snapshot_disable() disables snapshot mount
+ * Called under i_mutex and snapshot_mutex
+ */
+static int next3_snapshot_disable(struct inode *inode)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+
+	if (!next3_snapshot_list(inode)) {
+		snapshot_debug(1, "next3_snapshot_disable() called with "
+			       "snapshot file (ino=%lu) not on list\n",
+			       inode->i_ino);
+		return -EINVAL;
+	}
+
+	if (ei->i_flags & NEXT3_SNAPFILE_OPEN_FL) {
+		snapshot_debug(1, "disable of mounted snapshot (%u) "
+				"is not permitted\n",
+				inode->i_generation);
+		return -EPERM;
+	}
+
+	/*
+	 * set i_size to zero to disable loop device mount
+	 */
+	SNAPSHOT_SET_DISABLED(inode);
+	ei->i_flags &= ~NEXT3_SNAPFILE_ENABLED_FL;
+
+	/* invalidate page cache */
+	truncate_inode_pages(&inode->i_data, 0);
+
+	/* Don't need i_size_read because we hold i_mutex */
+	snapshot_debug(4, "setting snapshot (%u) i_size to (%lld)\n",
+			inode->i_generation, inode->i_size);
+	snapshot_debug(1, "snapshot (%u) disabled\n", inode->i_generation);
+	return 0;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ENABLE_FAST
+/*
+ * next3_snapshot_update_inuse() updates the in-use flag of the snapshots
+ * newer than @inode, after @inode was enabled or disabled.
+ * A snapshot is in-use if an older snapshot, which is not deleted, is
+ * enabled, so the flag can only change for the newer snapshots up to (and
+ * including) the next newer enabled snapshot.  This gives the same result
+ * as next3_snapshot_update() without walking the whole snapshot list.
+ * Called from next3_snapshot_set_flags() under snapshot_mutex.
+ */
+static void next3_snapshot_update_inuse(struct inode *inode)
+{
+	struct list_head *head = &NEXT3_SB(inode->i_sb)->s_snapshot_list;
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	int enabled = ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL;
+	struct list_head *l;
+	int n = 0;
+
+	/*
+	 * newer snapshots of an in-use snapshot are in use by the same older
+	 * enabled snapshot and a deleted snapshot doesn't make them in use.
+	 */
+	if (ei->i_flags & (NEXT3_SNAPFILE_INUSE_FL|NEXT3_SNAPFILE_DELETED_FL))
+		return;
+
+	/* iterate from @inode towards the newest snapshot */
+	for (l = ei->i_snaplist.prev; l != head; l = l->prev) {
+		ei = list_entry(l, struct next3_inode_info, i_snaplist);
+		if (enabled) {
+			if (ei->i_flags & NEXT3_SNAPFILE_INUSE_FL)
+				/* all newer snapshots are in use already */
+				break;
+			ei->i_flags |= NEXT3_SNAPFILE_INUSE_FL;
+		} else {
+			ei->i_flags &= ~NEXT3_SNAPFILE_INUSE_FL;
+			if ((ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL) &&
+			    !(ei->i_flags & NEXT3_SNAPFILE_DELETED_FL))
+				/* newer snapshots are in use by this one */
+				break;
+		}
+		n++;
+	}
+	snapshot_debug(4, "in-use flag of %d snapshots updated after "
+		       "snapshot (%u) was %s\n", n, inode->i_generation,
+		       enabled ? "enabled" : "disabled");
+}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+/*
+ * next3_snapshot_mount_get() - get an enabled snapshot for mount
+ * Called from next3_snapshot_get_sb() with an active reference to @sb.
+ * The snapshot is marked as mounted, so it cannot be disabled (and therefore
+ * cannot be deleted) until next3_snapshot_mount_put().
+ * Returns a referenced snapshot inode or ERR_PTR().
+ */
+struct inode *next3_snapshot_mount_get(struct super_block *sb, __u32 id)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct inode *inode;
+	int err = 0;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	inode = next3_snapshot_lookup(sb, id);
+	if (!inode)
+		err = -ENOENT;
+	else if (!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_ENABLED_FL))
+		err = -EPERM;
+	else if (next3_test_inode_state(inode, NEXT3_STATE_SNAPSHOT_MOUNT))
+		err = -EBUSY;
+	else if (!igrab(inode))
+		err = -ENOENT;
+	else
+		next3_set_inode_state(inode, NEXT3_STATE_SNAPSHOT_MOUNT);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+
+	if (err) {
+		snapshot_debug(1, "mount of snapshot (%u) failed (err=%d)\n",
+				id, err);
+		return ERR_PTR(err);
+	}
+	snapshot_debug(1, "snapshot (%u) mounted\n", id);
+	return inode;
+}
+
+/*
+ * next3_snapshot_mount_put() - release snapshot on umount
+ * Called from next3_snapshot_kill_sb() or on next3_snapshot_get_sb() failure.
+ */
+void next3_snapshot_mount_put(struct inode *inode)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	next3_clear_inode_state(inode, NEXT3_STATE_SNAPSHOT_MOUNT);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	snapshot_debug(1, "snapshot (%u) unmounted\n", inode->i_generation);
+	iput(inode);
+}
+
+#endif
+/*
+ * next3_snapshot_delete() marks snapshot for deletion
+ * Called under i_mutex and snapshot_mutex
+ */
+static int next3_snapshot_delete(struct inode *inode)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+
+	if (!next3_snapshot_list(inode)) {
+		snapshot_debug(1, "next3_snapshot_delete() called with "
+			       "snapshot file (ino=%lu) not on list\n",
+			       inode->i_ino);
+		return -EINVAL;
+	}
+
+	if (ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL) {
+		snapshot_debug(1, "delete of enabled snapshot (%u) "
+				"is not permitted\n",
+				inode->i_generation);
+		return -EPERM;
+	}
+
+	/* mark deleted for later cleanup to finish the job */
+	ei->i_flags |= NEXT3_SNAPFILE_DELETED_FL;
+	snapshot_debug(1, "snapshot (%u) marked for deletion\n",
+			inode->i_generation);
+	return 0;
+}
+
+/*
+ * next3_snapshot_remove - removes a snapshot from the list
+ * @inode: snapshot inode
+ *
+ * Removed the snapshot inode from in-memory and on-disk snapshots list of
+ * and truncates the snapshot inode.
+ * Called from next3_snapshot_update/cleanup/merge() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_remove(struct inode *inode)
+{
+	handle_t *handle;
+	struct next3_sb_info *sbi;
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	int err = 0, ret;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	ktime_t phase_start;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	int unlinked = 0;
+#endif
+
+	/* elevate ref count until final cleanup */
+	if (!igrab(inode))
+		return -EIO;
+	snapshot_phase_start(phase_start);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+	trace_next3_snapshot_remove_enter(inode);
+#endif
+
+	if (ei->i_flags & (NEXT3_SNAPFILE_ENABLED_FL | NEXT3_SNAPFILE_INUSE_FL
+			   | NEXT3_SNAPFILE_ACTIVE_FL)) {
+		snapshot_debug(4, "deferred delete of %s snapshot (%u)\n",
+				(ei->i_flags & NEXT3_SNAPFILE_ACTIVE_FL) ?
+				"active" :
+				((ei->i_flags & NEXT3_SNAPFILE_ENABLED_FL) ?
+				"enabled" : "referenced"),
+			       inode->i_generation);
+		goto out_err;
+	}
+
+	/* start large truncate transaction that will be extended/restarted */
+	handle = next3_journal_start(inode, NEXT3_MAX_TRANS_DATA);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out_err;
+	}
+	sbi = NEXT3_SB(inode->i_sb);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
+	err = next3_snapshot_clean(handle, inode, 1);
+	if (err)
+		goto out_handle;
+
+	/* reset snapshot inode size */
+	i_size_write(inode, 0);
+	ei->i_disksize = 0;
+	err = next3_mark_inode_dirty(handle, inode);
+	if (err)
+		goto out_handle;
+#endif
+
+	err = extend_or_restart_transaction_inode(handle, inode, 2);
+	if (err)
+		goto out_handle;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
+	err = next3_inode_list_del(handle, inode, &NEXT_SNAPSHOT(inode),
+			&sbi->s_es->s_snapshot_list,
+			&NEXT3_SB(inode->i_sb)->s_snapshot_list,
+			"snapshot");
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	/* unlinked from in-memory list even if on-disk update failed */
+	unlinked = 1;
+#endif
+	if (err)
+		goto out_handle;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+	next3_snapshot_index_del(inode->i_sb, inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	/* drop read through mappings to the removed snapshot */
+	next3_snapshot_map_invalidate(inode);
+#endif
+	/* remove snapshot list reference - taken on snapshot_create() */
+	iput(inode);
+#else
+	lock_super(inode->i_sb);
+	err = next3_journal_get_write_access(handle, sbi->s_sbh);
+	sbi->s_es->s_snapshot_list = 0;
+	if (!err)
+		err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
+	unlock_super(inode->i_sb);
+	if (err)
+		goto out_handle;
+#endif
+	/*
+	 * At this point, this snapshot is empty and not on the snapshots list.
+	 * As long as it was on the list it had to have the LIST flag to prevent
+	 * truncate/unlink.  Now that it is removed from the list, the LIST flag
+	 * and other snapshot status flags should be cleared.  It will still
+	 * have the SNAPFILE and DELETED flag to indicate this is a deleted
+	 * snapshot that should not be recycled.  There is no need to mark the
+	 * inode dirty, because the 'dynamic' status flags are not persistent.
+	 */
+	ei->i_flags &= ~NEXT3_FL_SNAPSHOT_DYN_MASK;
+
+out_handle:
+	ret = next3_journal_stop(handle);
+	if (!err)
+		err = ret;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	if (unlinked) {
+		/*
+		 * Wait for read through that may still follow the links of
+		 * the removed entry.  We hold an inode reference until the
+		 * final iput() below, so the inode cannot be freed before.
+		 * Don't wait with the handle open, because read through may
+		 * be waiting for I/O.
+		 */
+		synchronize_srcu(&sbi->s_snapshot_srcu);
+		INIT_LIST_HEAD(&ei->i_snaplist);
+	}
+#endif
+	if (err)
+		goto out_err;
+
+	/* sleep 1 tunable delay unit */
+	snapshot_test_delay(SNAPTEST_DELETE);
+	snapshot_phase_next(inode->i_sb, REMOVE, phase_start);
+	snapshot_debug(1, "snapshot (%u) deleted\n", inode->i_generation);
+
+	err = 0;
+out_err:
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+	trace_next3_snapshot_remove_exit(inode, err);
+#endif
+	/* drop final ref count - taken on entry to this function */
+	iput(inode);
+	if (err) {
+		snapshot_debug(1, "failed to delete snapshot (%u)\n",
+				inode->i_generation);
+	}
+	return err;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK
+/*
+ * next3_snapshot_shrink_range - free unused blocks from deleted snapshots
+ * @handle: JBD handle for this transaction
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @iblock:	inode offset to first data block to shrink
+ * @maxblocks:	inode range of data blocks to shrink
+ * @cow_bh:	buffer head to map the COW bitmap block of snapshot @start
+ *		if NULL, don't look for COW bitmap block
+ *
+ * Shrinks @maxblocks blocks starting at inode offset @iblock in a group of
+ * subsequent deleted snapshots starting after @start and ending before @end.
+ * Shrinking is done by finding a range of mapped blocks in @start snapshot
+ * or in one of the deleted snapshots, where no other blocks are mapped in the
+ * same range in @start snapshot or in snapshots between them.
+ * The blocks in the found range may be 'in-use' by @start snapshot, so only
+ * blocks which are not set in the COW bitmap are freed.
+ * All mapped blocks of other deleted snapshots in the same range are freed.
+ *
+ * Called from next3_snapshot_shrink_group() under snapshot_mutex.
+ * Returns the shrunk blocks range and <0 on error.
+ */
+static int next3_snapshot_shrink_range(handle_t *handle,
+		struct inode *start, struct inode *end,
+		sector_t iblock, unsigned long maxblocks,
+		struct buffer_head *cow_bh)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
+	struct list_head *l;
+	struct inode *inode = start;
+	/* start with @maxblocks range and narrow it down */
+	int err, count = maxblocks;
+	/* @start snapshot blocks should not be freed only counted */
+	int mapped, shrink = 0;
+
+	/* iterate on (@start <= snapshot < @end) */
+	list_for_each_prev(l, &NEXT3_I(start)->i_snaplist) {
+		err = next3_snapshot_shrink_blocks(handle, inode,
+				iblock, count, cow_bh, shrink, &mapped);
+		if (err < 0)
+			return err;
+
+		/* 0 < new range <= old range */
+		BUG_ON(!err || err > count);
+		count = err;
+		cond_resched();
+
+		/*
+		 * shrink mode state transitions:
+		 * 1. on @start, shrink is set to 0 ('don't free' mode).
+		 * 2. after @start, shrink is incremented until mapped blocks
+		 *    are found in the shrunk range ('free unused' mode).
+		 * 3. after mapped block were found, or if cow_bh is NULL,
+		 *    shrink is set to -1 and decremented until the end of
+		 *    the deleted snapshots group ('free all' mode).
+		 */
+		if (shrink < 0)
+			/* stay in 'free all' mode */
+			shrink--;
+		else if (!cow_bh)
+			/* no COW bitmap - enter 'free all' mode */
+			shrink = -1;
+		else if (mapped)
+			/* found mapped blocks - enter 'free all' mode */
+			shrink = -1;
+		else
+			/* enter/stay in 'free unused' mode */
+			shrink++;
+
+		if (l == &sbi->s_snapshot_list)
+			/* didn't reach @end */
+			return -EINVAL;
+		inode = &list_entry(l, struct next3_inode_info,
+						  i_snaplist)->vfs_inode;
+		if (inode == end)
+			break;
+	}
+	return count;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+/*
+ * next3_snapshot_shrink_progress - record shrink progress in super block
+ * @handle: JBD handle for this transaction
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @next_group:	next block group to shrink (0 to clear progress)
+ *
+ * Shrink is idempotent, so a crash before the progress record is committed
+ * only causes the last chunk of block groups to be shrunk again.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink_progress(handle_t *handle,
+		struct inode *start, struct inode *end,
+		unsigned long next_group)
+{
+	struct super_block *sb = start->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_super_block *es = sbi->s_es;
+	int err;
+
+	err = extend_or_restart_transaction(handle, 1);
+	if (err)
+		return err;
+
+	lock_super(sb);
+	err = next3_journal_get_write_access(handle, sbi->s_sbh);
+	es->s_snapshot_shrink_start = next_group ?
+		cpu_to_le32(start->i_generation) : 0;
+	es->s_snapshot_shrink_end = next_group ?
+		cpu_to_le32(end->i_generation) : 0;
+	es->s_snapshot_shrink_next = cpu_to_le32(next_group);
+	if (!err)
+		err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
+	unlock_super(sb);
+	return err;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+/*
+ * next3_snapshot_shrink_reset - discard shrink progress on snapshot delete
+ * @handle: JBD handle for this transaction
+ * @inode:	snapshot being deleted
+ *
+ * The recorded progress is only valid for the deleted snapshots groups it
+ * was recorded for.  Deleting another snapshot may change these groups
+ * without changing their boundaries, so shrink has to start over.
+ * Called from next3_snapshot_set_flags() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink_reset(handle_t *handle, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_super_block *es = sbi->s_es;
+	int err;
+
+	if (!es->s_snapshot_shrink_next)
+		return 0;
+
+	err = extend_or_restart_transaction_inode(handle, inode, 2);
+	if (err)
+		return err;
+
+	lock_super(sb);
+	err = next3_journal_get_write_access(handle, sbi->s_sbh);
+	es->s_snapshot_shrink_start = 0;
+	es->s_snapshot_shrink_end = 0;
+	es->s_snapshot_shrink_next = 0;
+	if (!err)
+		err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
+	unlock_super(sb);
+	return err;
+}
+
+#endif
+#endif
+/*
+ * next3_snapshot_shrink_group - free unused blocks in one block group
+ * @handle: JBD handle for this transaction
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @group:	snapshot block group to shrink
+ *
+ * Block groups are shrunk independently of each other.  The only per group
+ * state is the COW bitmap of @start, which is looked up in @start
+ * (or in older deleted snapshots) by next3_snapshot_shrink_range().
+ * Called from next3_snapshot_shrink_groups() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink_group(handle_t *handle,
+		struct inode *start, struct inode *end, unsigned long group)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
+	struct buffer_head cow_bitmap, *cow_bh = &cow_bitmap;
+	next3_fsblk_t block = (next3_fsblk_t)group * SNAPSHOT_BLOCKS_PER_GROUP;
+	next3_fsblk_t blocks_count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	unsigned long count;
+	int err;
+
+	if (block >= blocks_count)
+		return 0;
+	count = min_t(next3_fsblk_t, blocks_count - block,
+		      SNAPSHOT_BLOCKS_PER_GROUP);
+
+	/* sleep 1/block_groups tunable delay unit */
+	snapshot_test_delay_per_ticks(SNAPTEST_DELETE, sbi->s_groups_count);
+	/* reset COW bitmap cache */
+	cow_bitmap.b_state = 0;
+	cow_bitmap.b_blocknr = 0;
+	/* blocks beyond the size of @start are not in-use by @start */
+	if (block >= SNAPSHOT_BLOCKS(start))
+		/*
+		 * Past last snapshot block group - pass NULL
+		 * cow_bh to next3_snapshot_shrink_range().
+		 * This will cause snapshots after resize to
+		 * shrink to the size of @start snapshot.
+		 */
+		cow_bh = NULL;
+
+	while (count > 0) {
+		err = extend_or_restart_transaction(handle,
+						    NEXT3_MAX_TRANS_DATA);
+		if (err)
+			return err;
+
+		err = next3_snapshot_shrink_range(handle, start, end,
+					      SNAPSHOT_IBLOCK(block), count,
+					      cow_bh);
+
+		snapshot_debug(3, "snapshot (%u-%u) shrink: "
+				"block = 0x%lx, count = 0x%lx, err = 0x%x\n",
+				start->i_generation, end->i_generation,
+				block, count, err);
+
+		if (buffer_mapped(&cow_bitmap) && buffer_new(&cow_bitmap)) {
+			snapshot_debug(2, "snapshot (%u-%u) shrink: "
+				"block group = %lu/%lu, "
+				"COW bitmap = [%lu/%lu]\n",
+				start->i_generation, end->i_generation,
+				group, sbi->s_groups_count,
+				SNAPSHOT_BLOCK_TUPLE(cow_bitmap.b_blocknr));
+			clear_buffer_new(&cow_bitmap);
+		}
+
+		if (err < 0)
+			return err;
+
+		block += err;
+		count -= err;
+	}
+	return 0;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+/*
+ * Parallel shrink of block groups.
+ * Up to NEXT3_SNAPSHOT_SHRINK_WORKERS kernel threads claim block groups from
+ * a shared cursor and shrink them, each with its own journal handle.
+ * The caller holds snapshot_mutex and no journal handle while it waits for
+ * the workers, so worker transaction restarts cannot block on the caller.
+ */
+#define NEXT3_SNAPSHOT_SHRINK_WORKERS	8
+
+struct next3_snapshot_shrink_batch {
+	struct inode *start;
+	struct inode *end;
+	atomic_long_t next_group;	/* next block group to claim */
+	unsigned long end_group;	/* first block group not to shrink */
+	atomic_t workers;		/* no. of running workers */
+	int err;			/* first worker error */
+	struct completion done;		/* last worker exited */
+};
+
+static int next3_snapshot_shrink_worker(void *data)
+{
+	struct next3_snapshot_shrink_batch *batch = data;
+	handle_t *handle;
+	unsigned long group;
+	int err = 0, ret;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	next3_snapshot_io_begin(batch->start->i_sb);
+#endif
+	while (!ACCESS_ONCE(batch->err)) {
+		group = atomic_long_inc_return(&batch->next_group) - 1;
+		if (group >= batch->end_group)
+			break;
+
+		handle = next3_journal_start(batch->start,
+					     NEXT3_MAX_TRANS_DATA);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		err = next3_snapshot_shrink_group(handle, batch->start,
+						  batch->end, group);
+		ret = next3_journal_stop(handle);
+		if (!err)
+			err = ret;
+		if (err)
+			break;
+		cond_resched();
+	}
+
+	if (err)
+		cmpxchg(&batch->err, 0, err);
+	if (atomic_dec_and_test(&batch->workers))
+		complete(&batch->done);
+	return 0;
+}
+
+#endif
+/*
+ * next3_snapshot_shrink_groups - free unused blocks in a range of groups
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @group:	first snapshot block group to shrink
+ * @end_group:	first snapshot block group not to shrink
+ *
+ * Called from next3_snapshot_shrink() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink_groups(struct inode *start,
+		struct inode *end, unsigned long group,
+		unsigned long end_group)
+{
+	handle_t *handle;
+	int err, ret;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+	struct next3_snapshot_shrink_batch batch;
+	struct task_struct *task;
+	unsigned long workers = min_t(unsigned long, end_group - group,
+			min_t(unsigned int, NEXT3_SNAPSHOT_SHRINK_WORKERS,
+			      num_online_cpus()));
+	int i;
+
+	if (workers > 1) {
+		batch.start = start;
+		batch.end = end;
+		atomic_long_set(&batch.next_group, group);
+		batch.end_group = end_group;
+		atomic_set(&batch.workers, workers);
+		batch.err = 0;
+		init_completion(&batch.done);
+
+		for (i = 0; i < workers; i++) {
+			task = kthread_run(next3_snapshot_shrink_worker,
+					   &batch, "next3-shrink/%d", i);
+			if (IS_ERR(task)) {
+				/* shrink with the workers we have */
+				if (atomic_sub_and_test(workers - i,
+							&batch.workers))
+					complete(&batch.done);
+				break;
+			}
+		}
+		wait_for_completion(&batch.done);
+
+		snapshot_debug(3, "snapshot (%u-%u) shrink: "
+				"groups = %lu-%lu, workers = %d, err = %d\n",
+				start->i_generation, end->i_generation,
+				group, end_group, i, batch.err);
+		if (batch.err)
+			return batch.err;
+		/* shrink the rest if no worker could be started */
+		group = min_t(unsigned long, end_group,
+			      atomic_long_read(&batch.next_group));
+	}
+#endif
+
+	for (; group < end_group; group++) {
+		handle = next3_journal_start(start, NEXT3_MAX_TRANS_DATA);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		err = next3_snapshot_shrink_group(handle, start, end, group);
+		ret = next3_journal_stop(handle);
+		if (!err)
+			err = ret;
+		if (err)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * next3_snapshot_shrink_mark - mark deleted snapshots shrunk
+ * @handle: JBD handle for this transaction
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @need_shrink: no. of deleted snapshots in the group
+ *
+ * Returns the no. of deleted snapshots that were not found (0 expected)
+ * and <0 on error.
+ */
+static int next3_snapshot_shrink_mark(handle_t *handle, struct inode *start,
+		struct inode *end, int need_shrink)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
+	struct list_head *l;
+	int err;
+
+	/* marks need_shrink snapshots shrunk */
+	err = extend_or_restart_transaction(handle, need_shrink);
+	if (err)
+		return err;
+
+	/* iterate on (@start < snapshot < @end) */
+	list_for_each_prev(l, &NEXT3_I(start)->i_snaplist) {
+		struct next3_inode_info *ei;
+		struct next3_iloc iloc;
+		if (l == &sbi->s_snapshot_list)
+			break;
+		ei = list_entry(l, struct next3_inode_info, i_snaplist);
+		if (&ei->vfs_inode == end)
+			break;
+		if (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL &&
+			!(ei->i_flags &
+			(NEXT3_SNAPFILE_SHRUNK_FL|NEXT3_SNAPFILE_ACTIVE_FL))) {
+			/* mark snapshot shrunk */
+			err = next3_reserve_inode_write(handle, &ei->vfs_inode,
+							&iloc);
+			ei->i_flags |= NEXT3_SNAPFILE_SHRUNK_FL;
+			if (!err)
+				next3_mark_iloc_dirty(handle, &ei->vfs_inode,
+						      &iloc);
+			if (--need_shrink <= 0)
+				break;
+		}
+	}
+	return need_shrink;
+}
+
+/*
+ * next3_snapshot_shrink - free unused blocks from deleted snapshot files
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @need_shrink: no. of deleted snapshots in the group
+ *
+ * Frees all blocks in subsequent deleted snapshots starting after @start and
+ * ending before @end, except for blocks which are 'in-use' by @start snapshot.
+ * (blocks 'in-use' are set in snapshot COW bitmap and not copied to snapshot).
+ * With background cleanup, at most s_cleanup_budget block groups are shrunk
+ * per call and the next block group to shrink is recorded in super block.
+ * The next call with the same @start and @end resumes from that block group.
+ * Called from next3_snapshot_update() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink(struct inode *start, struct inode *end,
+				 int need_shrink)
+{
+	handle_t *handle;
+	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
+	unsigned long count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	unsigned long ngroups = DIV_ROUND_UP(count, SNAPSHOT_BLOCKS_PER_GROUP);
+	unsigned long group = 0, end_group = ngroups;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	struct next3_super_block *es = sbi->s_es;
+#endif
+	int err, ret;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	if (!sbi->s_cleanup_budget) {
+		/* defer shrink to background cleanup */
+		sbi->s_cleanup_pending = 1;
+		return 0;
+	}
+
+	if (es->s_snapshot_shrink_next &&
+		le32_to_cpu(es->s_snapshot_shrink_start) == start->i_generation &&
+		le32_to_cpu(es->s_snapshot_shrink_end) == end->i_generation)
+		/* resume shrink of this deleted snapshots group */
+		group = min_t(unsigned long, ngroups,
+			      le32_to_cpu(es->s_snapshot_shrink_next));
+	end_group = min_t(unsigned long, ngroups,
+			  group + sbi->s_cleanup_budget);
+#endif
+	snapshot_debug(3, "snapshot (%u-%u) shrink: "
+			"count = 0x%lx, groups = %lu-%lu, need_shrink = %d\n",
+			start->i_generation, end->i_generation,
+			count, group, end_group, need_shrink);
+
+	err = next3_snapshot_shrink_groups(start, end, group, end_group);
+	if (err)
+		return err;
+
+	/* start large transaction that will be extended/restarted */
+	handle = next3_journal_start(start, NEXT3_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	sbi->s_cleanup_budget -= min_t(unsigned long, end_group - group,
+				       sbi->s_cleanup_budget);
+	if (end_group < ngroups) {
+		/* I/O budget exhausted - record progress */
+		err = next3_snapshot_shrink_progress(handle, start, end,
+						     end_group);
+		sbi->s_cleanup_budget = 0;
+		sbi->s_cleanup_pending = 1;
+		need_shrink = 0;
+		goto out_err;
+	}
+	if (es->s_snapshot_shrink_next) {
+		/* clear progress of completed shrink */
+		err = next3_snapshot_shrink_progress(handle, start, end, 0);
+		if (err)
+			goto out_err;
+	}
+
+#endif
+	err = next3_snapshot_shrink_mark(handle, start, end, need_shrink);
+	if (err < 0)
+		goto out_err;
+	need_shrink = err;
+
+	err = 0;
+out_err:
+	ret = next3_journal_stop(handle);
+	if (!err)
+		err = ret;
+	if (need_shrink)
+		snapshot_debug(1, "snapshot (%u-%u) shrink: "
+			       "need_shrink=%d(>0!), err=%d\n",
+			       start->i_generation, end->i_generation,
+			       need_shrink, err);
+	return err;
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+/*
+ * Bulk shrink of deleted snapshots groups.
+ * Up to NEXT3_SNAPSHOT_SHRINK_SETS groups of deleted snapshots are shrunk
+ * in one scan over the block groups.  Groups of deleted snapshots beyond
+ * that are shrunk one by one by next3_snapshot_update().
+ */
+#define NEXT3_SNAPSHOT_SHRINK_SETS	16
+
+struct next3_snapshot_shrink_set {
+	struct inode *start;	/* non-deleted snapshot before the group */
+	struct inode *end;	/* non-deleted snapshot after the group */
+	int need_shrink;	/* no. of deleted snapshots in the group */
+};
+
+/*
+ * next3_snapshot_shrink_all - free unused blocks from all deleted snapshots
+ * @sb:			handle to file system super block
+ * @active_snapshot:	the active snapshot
+ *
+ * Finds all groups of deleted snapshots which are in use by an older
+ * non-deleted snapshot and shrinks them all in a single pass over the
+ * block groups.  Each group of deleted snapshots is shrunk against the COW
+ * bitmap of the snapshot before it, like next3_snapshot_shrink() does.
+ * With a single group of deleted snapshots there is nothing to gain and
+ * next3_snapshot_update() shrinks it.
+ * Called from next3_snapshot_update() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_shrink_all(struct super_block *sb,
+		struct inode *active_snapshot)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_snapshot_shrink_set sets[NEXT3_SNAPSHOT_SHRINK_SETS];
+	struct next3_inode_info *ei;
+	struct inode *used_by = NULL;
+	unsigned long count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	unsigned long ngroups = DIV_ROUND_UP(count, SNAPSHOT_BLOCKS_PER_GROUP);
+	unsigned long group = 0, end_group = ngroups, g;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	struct next3_super_block *es = sbi->s_es;
+#endif
+	handle_t *handle;
+	int nsets = 0, need_shrink = 0, i, err = 0, ret;
+
+	if (!active_snapshot)
+		/* all snapshots are going to be removed */
+		return 0;
+
+	/* iterate from oldest snapshot towards the active snapshot */
+	list_for_each_entry_reverse(ei, &sbi->s_snapshot_list, i_snaplist) {
+		struct inode *inode = &ei->vfs_inode;
+
+		if (inode != active_snapshot &&
+		    (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL)) {
+			/* deleted snapshots not in use are just removed */
+			if (used_by &&
+			    !(ei->i_flags & NEXT3_SNAPFILE_SHRUNK_FL))
+				need_shrink++;
+			continue;
+		}
+		if (need_shrink) {
+			if (nsets == NEXT3_SNAPSHOT_SHRINK_SETS)
+				break;
+			sets[nsets].start = used_by;
+			sets[nsets].end = inode;
+			sets[nsets].need_shrink = need_shrink;
+			nsets++;
+			need_shrink = 0;
+		}
+		if (inode == active_snapshot)
+			break;
+		used_by = inode;
+	}
+
+	if (nsets < 2)
+		return 0;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	if (!sbi->s_cleanup_budget) {
+		/* defer shrink to background cleanup */
+		sbi->s_cleanup_pending = 1;
+		return 0;
+	}
+
+	if (es->s_snapshot_shrink_next &&
+		le32_to_cpu(es->s_snapshot_shrink_start) ==
+			sets[0].start->i_generation &&
+		le32_to_cpu(es->s_snapshot_shrink_end) ==
+			sets[nsets-1].end->i_generation)
+		/* resume bulk shrink of these deleted snapshots groups */
+		group = min_t(unsigned long, ngroups,
+			      le32_to_cpu(es->s_snapshot_shrink_next));
+	end_group = min_t(unsigned long, ngroups,
+			  group + sbi->s_cleanup_budget);
+#endif
+	snapshot_debug(3, "snapshot (%u-%u) bulk shrink: "
+			"count = 0x%lx, groups = %lu-%lu, sets = %d\n",
+			sets[0].start->i_generation,
+			sets[nsets-1].end->i_generation,
+			count, group, end_group, nsets);
+
+	for (g = group; g < end_group; g++) {
+		handle = next3_journal_start(sets[0].start,
+					     NEXT3_MAX_TRANS_DATA);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		/* shrink block group for all deleted snapshots groups */
+		for (i = 0; !err && i < nsets; i++)
+			err = next3_snapshot_shrink_group(handle,
+					sets[i].start, sets[i].end, g);
+		ret = next3_journal_stop(handle);
+		if (!err)
+			err = ret;
+		if (err)
+			return err;
+		cond_resched();
+	}
+
+	/* start large transaction that will be extended/restarted */
+	handle = next3_journal_start(sets[0].start, NEXT3_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	sbi->s_cleanup_budget -= min_t(unsigned long, end_group - group,
+				       sbi->s_cleanup_budget);
+	if (end_group < ngroups) {
+		/* I/O budget exhausted - record progress */
+		err = next3_snapshot_shrink_progress(handle, sets[0].start,
+				sets[nsets-1].end, end_group);
+		sbi->s_cleanup_budget = 0;
+		sbi->s_cleanup_pending = 1;
+		goto out_err;
+	}
+	if (es->s_snapshot_shrink_next) {
+		/* clear progress of completed shrink */
+		err = next3_snapshot_shrink_progress(handle, sets[0].start,
+				sets[nsets-1].end, 0);
+		if (err)
+			goto out_err;
+	}
+
+#endif
+	for (i = 0; i < nsets; i++) {
+		err = next3_snapshot_shrink_mark(handle, sets[i].start,
+				sets[i].end, sets[i].need_shrink);
+		if (err < 0)
+			goto out_err;
+		if (err)
+			snapshot_debug(1, "snapshot (%u-%u) bulk shrink: "
+				       "need_shrink=%d(>0!)\n",
+				       sets[i].start->i_generation,
+				       sets[i].end->i_generation, err);
+	}
+
+	err = 0;
+out_err:
+	ret = next3_journal_stop(handle);
+	if (!err)
+		err = ret;
+	return err;
+}
+#endif
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
+/*
+ * next3_snapshot_merge - merge deleted snapshots
+ * @handle: JBD handle for this transaction
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ * @need_merge: no. of deleted snapshots in the group
+ *
+ * Move all blocks from deleted snapshots group starting after @start and
+ * ending before @end to @start snapshot.  All moved blocks are 'in-use' by
+ * @start snapshot, because these deleted snapshots have already been shrunk
+ * (blocks 'in-use' are set in snapshot COW bitmap and not copied to snapshot).
+ * Called from next3_snapshot_update() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_merge(struct inode *start, struct inode *end,
+				int need_merge)
+{
+	struct list_head *l, *n;
+	handle_t *handle = NULL;
+	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
+	int err, ret;
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	if (!sbi->s_cleanup_budget) {
+		/* defer merge to background cleanup */
+		sbi->s_cleanup_pending = 1;
+		return 0;
+	}
+
+#endif
+	snapshot_debug(3, "snapshot (%u-%u) merge: need_merge=%d\n",
+			start->i_generation, end->i_generation, need_merge);
+
+	/* iterate safe on (@start < snapshot < @end) */
+	list_for_each_prev_safe(l, n, &NEXT3_I(start)->i_snaplist) {
+		struct next3_inode_info *ei = list_entry(l,
+						 struct next3_inode_info,
+						 i_snaplist);
+		struct inode *inode = &ei->vfs_inode;
+		next3_fsblk_t block = 0;
+		/* blocks beyond the size of @start are not in-use by @start */
+		int count = SNAPSHOT_BLOCKS(start);
+
+		if (n == &sbi->s_snapshot_list || inode == end ||
+			!(ei->i_flags & NEXT3_SNAPFILE_SHRUNK_FL))
+			break;
+
+		/* start large transaction that will be extended/restarted */
+		handle = next3_journal_start(inode, NEXT3_MAX_TRANS_DATA);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+
+		while (count > 0) {
+			/* we modify one indirect block and the inode itself
+			 * for both the source and destination inodes */
+			err = extend_or_restart_transaction(handle, 4);
+			if (err)
+				goto out_err;
+
+			err = next3_snapshot_merge_blocks(handle, inode, start,
+						 SNAPSHOT_IBLOCK(block), count);
+
+			snapshot_debug(3, "snapshot (%u) -> snapshot (%u) "
+				       "merge: block = 0x%lx, count = 0x%x, "
+				       "err = 0x%x\n", inode->i_generation,
+				       start->i_generation, block, count, err);
+
+			if (err <= 0)
+				goto out_err;
+
+			block += err;
+			count -= err;
+			cond_resched();
+		}
+
+		err = next3_journal_stop(handle);
+		handle = NULL;
+		if (err)
+			goto out_err;
+
+		/* we finished moving all blocks of interest from 'inode'
+		 * into 'start' so it is now safe to remove 'inode' from the
+		 * snapshots list forever */
+		err = next3_snapshot_remove(inode);
+		if (err)
+			goto out_err;
+
+		if (--need_merge <= 0)
+			break;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+		/* merge of one snapshot uses up the I/O budget */
+		sbi->s_cleanup_budget = 0;
+		sbi->s_cleanup_pending = 1;
+		need_merge = 0;
+		break;
+#endif
+	}
+
+	err = 0;
+out_err:
+	if (handle) {
+		ret = next3_journal_stop(handle);
+		if (!err)
+			err = ret;
+	}
+	if (need_merge)
+		snapshot_debug(1, "snapshot (%u-%u) merge: need_merge=%d(>0!), "
+			       "err=%d\n", start->i_generation,
+			       end->i_generation, need_merge, err);
+	return err;
+}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
+/*
+ * next3_snapshot_cleanup - shrink/merge/remove snapshot marked for deletion
+ * @inode - inode in question
+ * @used_by - latest non-deleted snapshot
+ * @deleted - true if snapshot is marked for deletion and not active
+ * @need_shrink - counter of deleted snapshots to shrink
+ * @need_merge - counter of deleted snapshots to merge
+ *
+ * Deleted snapshot with no older non-deleted snapshot - remove from list
+ * Deleted snapshot with no older enabled snapshot - add to merge count
+ * Deleted snapshot with older enabled snapshot - add to shrink count
+ * Non-deleted snapshot - shrink and merge deleted snapshots group
+ *
+ * Called from next3_snapshot_update() under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int next3_snapshot_cleanup(struct inode *inode, struct inode *used_by,
+		int deleted, int *need_shrink, int *need_merge)
+{
+	int err = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	ktime_t phase_start;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	int ioprio;
+#endif
+
+	if (deleted && !used_by)
+		/* remove permanently unused deleted snapshot */
+		return next3_snapshot_remove(inode);
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK
+	if (deleted) {
+		/* deleted (non-active) snapshot file */
+		if (!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_SHRUNK_FL))
+			/* deleted snapshot needs shrinking */
+			(*need_shrink)++;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
+		if (!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_INUSE_FL))
+			/* temporarily unused deleted
+			 * snapshot needs merging */
+			(*need_merge)++;
+#endif
+		return 0;
+	}
+
+	/* non-deleted (or active) snapshot file */
+	if (*need_shrink) {
+		/* pass 1: shrink all deleted snapshots
+		 * between 'used_by' and 'inode' */
+		snapshot_phase_start(phase_start);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_shrink_enter(used_by);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+		ioprio = next3_snapshot_io_begin(inode->i_sb);
+		err = next3_snapshot_shrink(used_by, inode, *need_shrink);
+		next3_snapshot_io_end(ioprio);
+#else
+		err = next3_snapshot_shrink(used_by, inode, *need_shrink);
+#endif
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_shrink_exit(used_by, err);
+#endif
+		if (err)
+			return err;
+		snapshot_phase_next(inode->i_sb, SHRINK, phase_start);
+		*need_shrink = 0;
+	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
+	if (*need_merge) {
+		/* pass 2: merge all shrunk snapshots
+		 * between 'used_by' and 'inode' */
+		snapshot_phase_start(phase_start);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_merge_enter(used_by);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+		ioprio = next3_snapshot_io_begin(inode->i_sb);
+		err = next3_snapshot_merge(used_by, inode, *need_merge);
+		next3_snapshot_io_end(ioprio);
+#else
+		err = next3_snapshot_merge(used_by, inode, *need_merge);
+#endif
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_merge_exit(used_by, err);
+#endif
+		if (err)
+			return err;
+		snapshot_phase_next(inode->i_sb, MERGE, phase_start);
+		*need_merge = 0;
+	}
+#endif
+#endif
+	return 0;
+}
+#endif
+#endif
+
+/*
+ * Snapshot constructor/destructor
+ */
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
+/*
+ * next3_exclude_inode_bread - read indirect block from exclude inode
+ * @handle:	JBD handle (NULL is !@create)
+ * @inode:	exclude inode
+ * @grp:	block group
+ * @create:	if true, try to allocate missing indirect block
+ *
+ * Helper function for next3_snapshot_init_bitmap_cache().
+ * Called under sb_lock and before snapshots are loaded, so changes made to
+ * exclude inode are not COWed.
+ *
+ * Returns indirect block buffer or NULL if not allocated.
+ */
+static struct buffer_head *next3_exclude_inode_bread(handle_t *handle,
+		struct inode *inode, int grp, int create)
+{
+	int dind_offset = grp / SNAPSHOT_ADDR_PER_BLOCK;
+	struct buffer_head *ind_bh;
+	int err;
+
+	/* exclude bitmap blocks addresses are exposed on the IND branch */
+	ind_bh = next3_bread(NULL, inode, NEXT3_IND_BLOCK + dind_offset,
+						 0, &err);
+	if (ind_bh)
+		return ind_bh;
+
+	snapshot_debug(1, "failed to read exclude inode indirect[%d] block\n",
+			dind_offset);
+	if (!create)
+		return NULL;
+
+	err = extend_or_restart_transaction(handle, NEXT3_RESERVE_TRANS_BLOCKS);
+	if (err)
+		return NULL;
+	ind_bh = next3_bread(handle, inode, NEXT3_IND_BLOCK + dind_offset,
+			create, &err);
+	if (!ind_bh) {
+		snapshot_debug(1, "failed to allocate exclude "
+				"inode indirect[%d] block\n",
+				dind_offset);
+		return NULL;
+	}
+	snapshot_debug(2, "allocated exclude bitmap "
+			"indirect[%d] block (%lld)\n",
+			dind_offset, (long long)ind_bh->b_blocknr);
+	return ind_bh;
+}
+
+/*
+ * next3_exclude_inode_getblk - read address of exclude bitmap block
+ * @handle:	JBD handle (NULL is !@create)
+ * @inode:	exclude inode
+ * @grp:	block group
+ * @create:	if true, try to allocate missing blocks
+  *
+ * Helper function for next3_snapshot_init_bitmap_cache().
+ * Called under sb_lock and before snapshots are loaded, so changes made to
+ * exclude inode are not COWed.
+ *
+ * Returns exclude bitmap block address (little endian) or 0 if not allocated.
+ */
+static __le32 next3_exclude_inode_getblk(handle_t *handle,
+		struct inode *inode, int grp, int create)
+{
+	int ind_offset = grp % SNAPSHOT_ADDR_PER_BLOCK;
+	struct buffer_head *bh, *ind_bh = NULL;
+	__le32 exclude_bitmap = 0;
+	int err = 0;
 
-		if (err <= 0)
-			goto out_err;
+	/* read exclude inode indirect block */
+	ind_bh = next3_exclude_inode_bread(handle, inode, grp, create);
+	if (!ind_bh)
+		return 0;
 
-		block += err;
-		count -= err;
-	}
+	if (grp >= NEXT3_SB(inode->i_sb)->s_groups_count)
+		/* past last block group - just allocating indirect blocks */
+		goto out;
 
-	/* marks need_shrink snapshots shrunk */
-	err = extend_or_restart_transaction(handle, need_shrink);
+	exclude_bitmap = ((__le32 *)ind_bh->b_data)[ind_offset];
+	if (exclude_bitmap)
+		goto out;
+	if (!create)
+		goto alloc_out;
+
+	/* try to allocate missing exclude bitmap(+ind+dind) block */
+	err = extend_or_restart_transaction(handle,
+			NEXT3_RESERVE_TRANS_BLOCKS);
 	if (err)
-		goto out_err;
+		goto alloc_out;
 
-	/* iterate on (@start < snapshot < @end) */
-	list_for_each_prev(l, &NEXT3_I(start)->i_snaplist) {
-		struct next3_inode_info *ei;
-		struct next3_iloc iloc;
-		if (l == &sbi->s_snapshot_list)
-			break;
-		ei = list_entry(l, struct next3_inode_info, i_snaplist);
-		if (&ei->vfs_inode == end)
-			break;
-		if (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL &&
-			!(ei->i_flags &
-			(NEXT3_SNAPFILE_SHRUNK_FL|NEXT3_SNAPFILE_ACTIVE_FL))) {
-			/* mark snapshot shrunk */
-			err = next3_reserve_inode_write(handle, &ei->vfs_inode,
-							&iloc);
-			ei->i_flags |= NEXT3_SNAPFILE_SHRUNK_FL;
-			if (!err)
-				next3_mark_iloc_dirty(handle, &ei->vfs_inode,
-						      &iloc);
-			if (--need_shrink <= 0)
-				break;
-		}
-	}
+	/* exclude bitmap blocks are mapped on the DIND branch */
+	bh = next3_getblk(handle, inode, SNAPSHOT_IBLOCK(grp), create, &err);
+	if (!bh)
+		goto alloc_out;
+	brelse(bh);
+	exclude_bitmap = ((__le32 *)ind_bh->b_data)[ind_offset];
+alloc_out:
+	if (exclude_bitmap)
+		snapshot_debug(2, "allocated exclude bitmap #%d block "
+				"(%u)\n", grp,
+				le32_to_cpu(exclude_bitmap));
+	else
+		snapshot_debug(1, "failed to allocate exclude "
+				"bitmap #%d block (err = %d)\n",
+				grp, err);
+out:
+	brelse(ind_bh);
+	return exclude_bitmap;
+}
 
-	err = 0;
-out_err:
-	ret = next3_journal_stop(handle);
-	if (!err)
-		err = ret;
-	if (need_shrink)
-		snapshot_debug(1, "snapshot (%u-%u) shrink: "
-			       "need_shrink=%d(>0!), err=%d\n",
-			       start->i_generation, end->i_generation,
-			       need_shrink, err);
-	return err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+/*
+ * next3_exclude_bitmap_blk - get location of exclude bitmap block
+ * @sb:			super block
+ * @block_group:	given block group
+ *
+ * Read the exclude bitmap block address of @block_group from the exclude
+ * inode on first access to the block group and cache it in group info.
+ * Exclude bitmap blocks are never moved, so concurrent loaders of the same
+ * block group store the same value.
+ * Called from read_exclude_bitmap() and from next3_snapshot_get_block().
+ *
+ * Returns exclude bitmap block or 0 if block group has no exclude bitmap.
+ */
+unsigned long next3_exclude_bitmap_blk(struct super_block *sb,
+		unsigned int block_group)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info + block_group;
+	struct inode *inode = sbi->s_exclude_inode;
+	struct buffer_head *ind_bh;
+	__le32 exclude_bitmap = 0;
+
+	if (gi->bg_exclude_loaded) {
+		smp_rmb();
+		return gi->bg_exclude_bitmap;
+	}
+	if (!inode)
+		/* no exclude inode - bg_exclude_bitmap was set on mount */
+		return gi->bg_exclude_bitmap;
+
+	ind_bh = next3_exclude_inode_bread(NULL, inode, block_group, 0);
+	if (ind_bh) {
+		exclude_bitmap = ((__le32 *)ind_bh->b_data)
+			[block_group % SNAPSHOT_ADDR_PER_BLOCK];
+		brelse(ind_bh);
+	}
+	if (!exclude_bitmap)
+		snapshot_debug(1, "warning: no exclude bitmap for "
+			       "block group %u\n", block_group);
+
+	gi->bg_exclude_bitmap = le32_to_cpu(exclude_bitmap);
+	smp_wmb();
+	gi->bg_exclude_loaded = 1;
+	snapshot_debug(2, "update exclude bitmap #%u cache (block=%lu)\n",
+		       block_group, gi->bg_exclude_bitmap);
+	return gi->bg_exclude_bitmap;
 }
 #endif
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
 /*
- * next3_snapshot_merge - merge deleted snapshots
- * @handle: JBD handle for this transaction
- * @start:	latest non-deleted snapshot before deleted snapshots group
- * @end:	first non-deleted snapshot after deleted snapshots group
- * @need_merge: no. of deleted snapshots in the group
+ * next3_snapshot_init_bitmap_cache():
  *
- * Move all blocks from deleted snapshots group starting after @start and
- * ending before @end to @start snapshot.  All moved blocks are 'in-use' by
- * @start snapshot, because these deleted snapshots have already been shrunk
- * (blocks 'in-use' are set in snapshot COW bitmap and not copied to snapshot).
- * Called from next3_snapshot_update() under snapshot_mutex.
+ * Init the COW/exclude bitmap cache for all block groups.
+ * COW bitmap cache is set to 0 (lazy init on first access to block group).
+ * Read exclude bitmap blocks addresses from exclude inode and store them
+ * in block group descriptor.  If @create is true, Try to allocate missing
+ * exclude bitmap blocks.
+ * With lazy exclude bitmap cache, exclude bitmap blocks addresses are read
+ * on first access to block group and the exclude inode reference is kept
+ * until umount.  The mount time pass is only done to allocate missing blocks
+ * when the exclude inode is not fully allocated.
+ *
+ * Called from snapshot_load() under sb_lock during mount time.
  * Returns 0 on success and <0 on error.
  */
-static int next3_snapshot_merge(struct inode *start, struct inode *end,
-				int need_merge)
+static int next3_snapshot_init_bitmap_cache(struct super_block *sb, int create)
 {
-	struct list_head *l, *n;
+	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	handle_t *handle = NULL;
-	struct next3_sb_info *sbi = NEXT3_SB(start->i_sb);
-	int err, ret;
+	struct inode *inode;
+	__le32 exclude_bitmap = 0;
+	int grp, max_groups = sbi->s_groups_count;
+	int err = 0, ret;
+	loff_t i_size;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	int lazy;
+#endif
+#ifdef CONFIG_NEXT3_FS_FAST_MOUNT
+	/* exclude inode indirect block of the current group */
+	struct buffer_head *ind_bh = NULL;
+	int ind_grp = -1;
+#endif
 
-	snapshot_debug(3, "snapshot (%u-%u) merge: need_merge=%d\n",
-			start->i_generation, end->i_generation, need_merge);
+	/* reset COW/exclude bitmap cache */
+	err = next3_snapshot_reset_bitmap_cache(sb, 1);
+	if (err)
+		return err;
 
-	/* iterate safe on (@start < snapshot < @end) */
-	list_for_each_prev_safe(l, n, &NEXT3_I(start)->i_snaplist) {
-		struct next3_inode_info *ei = list_entry(l,
-						 struct next3_inode_info,
-						 i_snaplist);
-		struct inode *inode = &ei->vfs_inode;
-		next3_fsblk_t block = 0;
-		/* blocks beyond the size of @start are not in-use by @start */
-		int count = SNAPSHOT_BLOCKS(start);
+	if (!NEXT3_HAS_COMPAT_FEATURE(sb,
+				      NEXT3_FEATURE_COMPAT_EXCLUDE_INODE)) {
+		/* exclude inode is a recommended feature - don't force it */
+		snapshot_debug(1, "warning: exclude_inode feature not set - "
+			       "snapshot merge might not free all unused "
+			       "blocks!\n");
+		return 0;
+	}
 
-		if (n == &sbi->s_snapshot_list || inode == end ||
-			!(ei->i_flags & NEXT3_SNAPFILE_SHRUNK_FL))
-			break;
+	inode = next3_iget(sb, NEXT3_EXCLUDE_INO);
+	if (IS_ERR(inode)) {
+		snapshot_debug(1, "warning: bad exclude inode - "
+				"no exclude bitmap!\n");
+		return PTR_ERR(inode);
+	}
+
+	if (create) {
+		/* number of groups the filesystem can grow to */
+		max_groups = sbi->s_gdb_count +
+			le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks);
+		max_groups *= NEXT3_DESC_PER_BLOCK(sb);
+	}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	/*
+	 * Exclude inode size is only updated after exclude bitmap blocks of
+	 * all block groups and indirect blocks of all reserved block groups
+	 * have been allocated, so there is nothing to allocate here.
+	 */
+	i_size = SNAPSHOT_IBLOCK(max_groups) << SNAPSHOT_BLOCK_SIZE_BITS;
+	lazy = !create || NEXT3_I(inode)->i_disksize >= i_size;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_OLD
+	if (create && NEXT3_HAS_COMPAT_FEATURE(sb,
+				NEXT3_FEATURE_COMPAT_EXCLUDE_INODE_OLD))
+		lazy = 0;
+#endif
+	if (lazy) {
+		/* keep exclude inode reference until snapshot_destroy() */
+		sbi->s_exclude_inode = inode;
+		return 0;
+	}
 
+#endif
+	if (create) {
 		/* start large transaction that will be extended/restarted */
 		handle = next3_journal_start(inode, NEXT3_MAX_TRANS_DATA);
 		if (IS_ERR(handle))
 			return PTR_ERR(handle);
+	}
 
-		while (count > 0) {
-			/* we modify one indirect block and the inode itself
-			 * for both the source and destination inodes */
-			err = extend_or_restart_transaction(handle, 4);
-			if (err)
-				goto out_err;
-
-			err = next3_snapshot_merge_blocks(handle, inode, start,
-						 SNAPSHOT_IBLOCK(block), count);
-
-			snapshot_debug(3, "snapshot (%u) -> snapshot (%u) "
-				       "merge: block = 0x%lx, count = 0x%x, "
-				       "err = 0x%x\n", inode->i_generation,
-				       start->i_generation, block, count, err);
-
-			if (err <= 0)
-				goto out_err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_OLD
+	if (create && NEXT3_HAS_COMPAT_FEATURE(sb,
+				NEXT3_FEATURE_COMPAT_EXCLUDE_INODE_OLD)) {
+		/* journal exclude inode migration done inside next3_iget */
+		err = next3_journal_get_write_access(handle, sbi->s_sbh);
+		NEXT3_CLEAR_COMPAT_FEATURE(sb,
+				NEXT3_FEATURE_COMPAT_EXCLUDE_INODE_OLD);
+		if (!err)
+			err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
+		if (!err)
+			err = next3_mark_inode_dirty(handle, inode);
+	}
 
-			block += err;
-			count -= err;
-			cond_resched();
+#endif
+	/*
+	 * Init exclude bitmap blocks for all existing block groups and
+	 * allocate indirect blocks for all reserved block groups.
+	 */
+	err = -EIO;
+	for (grp = 0; grp < max_groups; grp++, gi++) {
+#ifdef CONFIG_NEXT3_FS_FAST_MOUNT
+		/*
+		 * Read every exclude inode indirect block once for all the
+		 * block groups it maps, instead of mapping it for every
+		 * block group.  Only missing exclude bitmaps go through
+		 * next3_exclude_inode_getblk() to be allocated.
+		 */
+		if (grp / SNAPSHOT_ADDR_PER_BLOCK != ind_grp) {
+			brelse(ind_bh);
+			ind_grp = grp / SNAPSHOT_ADDR_PER_BLOCK;
+			ind_bh = next3_exclude_inode_bread(handle, inode, grp,
+							   create);
 		}
+		exclude_bitmap = 0;
+		if (ind_bh && grp < sbi->s_groups_count)
+			exclude_bitmap = ((__le32 *)ind_bh->b_data)
+				[grp % SNAPSHOT_ADDR_PER_BLOCK];
+		if (!exclude_bitmap && create && grp < sbi->s_groups_count)
+			exclude_bitmap = next3_exclude_inode_getblk(handle,
+					inode, grp, create);
+#else
+		exclude_bitmap = next3_exclude_inode_getblk(handle, inode, grp,
+				create);
+#endif
+		cond_resched();
+		if (create && grp >= sbi->s_groups_count)
+			/* only allocating indirect blocks with getblk above */
+			continue;
 
-		err = next3_journal_stop(handle);
-		handle = NULL;
-		if (err)
-			goto out_err;
-
-		/* we finished moving all blocks of interest from 'inode'
-		 * into 'start' so it is now safe to remove 'inode' from the
-		 * snapshots list forever */
-		err = next3_snapshot_remove(inode);
-		if (err)
-			goto out_err;
+		if (create && !exclude_bitmap)
+			goto out;
 
-		if (--need_merge <= 0)
-			break;
+		gi->bg_exclude_bitmap = le32_to_cpu(exclude_bitmap);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+		gi->bg_exclude_loaded = 1;
+#endif
+		snapshot_debug(2, "update exclude bitmap #%d cache "
+			       "(block=%lu)\n", grp,
+			       gi->bg_exclude_bitmap);
 	}
 
 	err = 0;
-out_err:
+	if (!create)
+		goto out;
+
+	i_size = SNAPSHOT_IBLOCK(max_groups) << SNAPSHOT_BLOCK_SIZE_BITS;
+	if (NEXT3_I(inode)->i_disksize >= i_size)
+		goto out;
+	i_size_write(inode, i_size);
+	NEXT3_I(inode)->i_disksize = i_size;
+	err = next3_mark_inode_dirty(handle, inode);
+out:
+#ifdef CONFIG_NEXT3_FS_FAST_MOUNT
+	brelse(ind_bh);
+#endif
 	if (handle) {
 		ret = next3_journal_stop(handle);
 		if (!err)
 			err = ret;
 	}
-	if (need_merge)
-		snapshot_debug(1, "snapshot (%u-%u) merge: need_merge=%d(>0!), "
-			       "err=%d\n", start->i_generation,
-			       end->i_generation, need_merge, err);
+	iput(inode);
 	return err;
 }
+
+#else
+/* with no exclude inode, exclude bitmap is reset to 0 */
+#define next3_snapshot_init_bitmap_cache(sb, create)	\
+		next3_snapshot_reset_bitmap_cache(sb, 1)
 #endif
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_MOUNT
 /*
- * next3_snapshot_cleanup - shrink/merge/remove snapshot marked for deletion
- * @inode - inode in question
- * @used_by - latest non-deleted snapshot
- * @deleted - true if snapshot is marked for deletion and not active
- * @need_shrink - counter of deleted snapshots to shrink
- * @need_merge - counter of deleted snapshots to merge
+ * next3_snapshot_load_cow_bitmap_cache():
  *
- * Deleted snapshot with no older non-deleted snapshot - remove from list
- * Deleted snapshot with no older enabled snapshot - add to merge count
- * Deleted snapshot with older enabled snapshot - add to shrink count
- * Non-deleted snapshot - shrink and merge deleted snapshots group
+ * Init the COW bitmap cache of all block groups, whose COW bitmap was
+ * already created in the active snapshot @snapshot before umount.
+ * The COW bitmap blocks are looked up in block group order, which is the
+ * snapshot file block order, so every snapshot indirect block is read
+ * once and the write path finds the COW bitmap cache initialized.
+ * Block groups with no COW bitmap are left for lazy (or background) init.
  *
- * Called from next3_snapshot_update() under snapshot_mutex.
+ * Called from snapshot_load() under sb_lock during read-write mount time,
+ * so there are no concurrent COW bitmap cache users.
  * Returns 0 on success and <0 on error.
  */
-static int next3_snapshot_cleanup(struct inode *inode, struct inode *used_by,
-		int deleted, int *need_shrink, int *need_merge)
+static int next3_snapshot_load_cow_bitmap_cache(struct super_block *sb,
+		struct inode *snapshot)
 {
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_group_info *gi = sbi->s_group_info;
+	struct next3_group_desc *desc;
+	next3_fsblk_t bitmap_blk, cow_bitmap_blk;
+	unsigned long group, loaded = 0;
+	handle_t *handle;
 	int err = 0;
 
-	if (deleted && !used_by)
-		/* remove permanently unused deleted snapshot */
-		return next3_snapshot_remove(inode);
+	/* a handle makes the snapshot lookups map the snapshot file only */
+	handle = next3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK
-	if (deleted) {
-		/* deleted (non-active) snapshot file */
-		if (!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_SHRUNK_FL))
-			/* deleted snapshot needs shrinking */
-			(*need_shrink)++;
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
-		if (!(NEXT3_I(inode)->i_flags & NEXT3_SNAPFILE_INUSE_FL))
-			/* temporarily unused deleted
-			 * snapshot needs merging */
-			(*need_merge)++;
-#endif
-		return 0;
+	for (group = 0; group < sbi->s_groups_count; group++, gi++) {
+		if (next3_group_first_block_no(sb, group) >=
+				SNAPSHOT_BLOCKS(snapshot))
+			/* block group was added after snapshot take */
+			break;
+		desc = next3_get_group_desc(sb, group, NULL);
+		if (!desc) {
+			err = -EIO;
+			break;
+		}
+		bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
+		cow_bitmap_blk = 0;
+		err = next3_snapshot_map_blocks(handle, snapshot, bitmap_blk, 1,
+						&cow_bitmap_blk, SNAPMAP_READ);
+		if (err < 0)
+			break;
+		err = 0;
+		if (cow_bitmap_blk) {
+			spin_lock(sb_snapshot_lock(sbi, group));
+			gi->bg_cow_bitmap = cow_bitmap_blk;
+			spin_unlock(sb_snapshot_lock(sbi, group));
+			loaded++;
+		}
+		cond_resched();
 	}
 
-	/* non-deleted (or active) snapshot file */
-	if (*need_shrink) {
-		/* pass 1: shrink all deleted snapshots
-		 * between 'used_by' and 'inode' */
-		err = next3_snapshot_shrink(used_by, inode, *need_shrink);
-		if (err)
-			return err;
-		*need_shrink = 0;
-	}
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_MERGE
-	if (*need_merge) {
-		/* pass 2: merge all shrunk snapshots
-		 * between 'used_by' and 'inode' */
-		err = next3_snapshot_merge(used_by, inode, *need_merge);
-		if (err)
-			return err;
-		*need_merge = 0;
-	}
+	next3_journal_stop(handle);
+	snapshot_debug(1, "%lu COW bitmaps of snapshot (%u) loaded to "
+			"cache (err=%d)\n", loaded, snapshot->i_generation, err);
+	return err;
+}
+
 #endif
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+/*
+ * Background cleanup of deleted snapshots.
+ * Snapshot delete only marks snapshots for deletion and removes unused
+ * snapshots.  Shrink and merge of deleted snapshots is deferred to the
+ * cleanup work, which calls next3_snapshot_update() with an I/O budget of
+ * s_cleanup_groups block groups.  snapshot_mutex is released and the work
+ * sleeps s_cleanup_delay_ms between chunks, so snapshot take and other
+ * snapshot control operations can make progress during a long cleanup.
+ */
+#define NEXT3_SNAPSHOT_CLEANUP_GROUPS	64
+#define NEXT3_SNAPSHOT_CLEANUP_DELAY_MS	100
+
+static struct workqueue_struct *next3_snapshot_cleanup_wq;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+/*
+ * snapshot requests of different file systems should not wait for each other
+ * nor for the background cleanup, so they get a multi threaded workqueue.
+ */
+static struct workqueue_struct *next3_snapshot_ctl_wq;
 #endif
+
+int init_next3_snapshot_cleanup_work(void)
+{
+	next3_snapshot_cleanup_wq =
+		create_singlethread_workqueue("next3-cleanup");
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	if (!next3_snapshot_cleanup_wq)
+		return -ENOMEM;
+	next3_snapshot_ctl_wq = create_workqueue("next3-snapctl");
+	if (!next3_snapshot_ctl_wq) {
+		destroy_workqueue(next3_snapshot_cleanup_wq);
+		return -ENOMEM;
+	}
 	return 0;
-}
+#else
+	return next3_snapshot_cleanup_wq ? 0 : -ENOMEM;
 #endif
+}
+
+void exit_next3_snapshot_cleanup_work(void)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	destroy_workqueue(next3_snapshot_ctl_wq);
 #endif
+	destroy_workqueue(next3_snapshot_cleanup_wq);
+}
+
+static void next3_snapshot_cleanup_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct next3_sb_info,
+						 s_cleanup_work);
+	struct super_block *sb = sbi->s_sb;
+	int err, pending;
+
+	if (sbi->s_cleanup_stop || (sb->s_flags & MS_RDONLY))
+		return;
+
+	if (bdi_write_congested(sb->s_bdi) || bdi_read_congested(sb->s_bdi)) {
+		/* yield to foreground I/O */
+		queue_delayed_work(next3_snapshot_cleanup_wq,
+				   &sbi->s_cleanup_work, HZ/10);
+		return;
+	}
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	sbi->s_cleanup_budget = max(sbi->s_cleanup_groups, 1U);
+	sbi->s_cleanup_pending = 0;
+	err = next3_snapshot_update(sb, 1, 0);
+	pending = sbi->s_cleanup_pending;
+	sbi->s_cleanup_budget = 0;
+	mutex_unlock(&sbi->s_snapshot_mutex);
+
+	if (err) {
+		snapshot_debug(1, "background snapshot cleanup failed "
+			       "(err=%d)\n", err);
+		return;
+	}
+	if (pending && !sbi->s_cleanup_stop)
+		queue_delayed_work(next3_snapshot_cleanup_wq,
+				   &sbi->s_cleanup_work,
+				   msecs_to_jiffies(sbi->s_cleanup_delay_ms));
+}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
 /*
- * Snapshot constructor/destructor
+ * Reclaim of space held by snapshots on ENOSPC.
+ * A writer that runs out of space requests reclaim no. s_reclaim_gen+1 and
+ * waits for s_reclaim_gen to change.  The reclaim work deletes the oldest
+ * snapshot, which is not active and not enabled (pinned), the same way as
+ * chattr -S does, removes it if it can and forces a commit, so the freed
+ * blocks can be allocated.  Requests that were made before the last reclaim
+ * was completed are answered without deleting another snapshot.
  */
+#define NEXT3_SNAPSHOT_RECLAIM_TIMEOUT	(30*HZ)
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE
 /*
- * next3_exclude_inode_bread - read indirect block from exclude inode
- * @handle:	JBD handle (NULL is !@create)
- * @inode:	exclude inode
- * @grp:	block group
- * @create:	if true, try to allocate missing indirect block
- *
- * Helper function for next3_snapshot_init_bitmap_cache().
- * Called under sb_lock and before snapshots are loaded, so changes made to
- * exclude inode are not COWed.
- *
- * Returns indirect block buffer or NULL if not allocated.
+ * find the oldest snapshot that can be deleted to reclaim space
+ * and return it with an elevated ref count
  */
-static struct buffer_head *next3_exclude_inode_bread(handle_t *handle,
-		struct inode *inode, int grp, int create)
+static struct inode *next3_snapshot_reclaim_victim(struct super_block *sb)
 {
-	int dind_offset = grp / SNAPSHOT_ADDR_PER_BLOCK;
-	struct buffer_head *ind_bh;
-	int err;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_inode_info *ei;
+	struct inode *inode = NULL;
 
-	/* exclude bitmap blocks addresses are exposed on the IND branch */
-	ind_bh = next3_bread(NULL, inode, NEXT3_IND_BLOCK + dind_offset,
-						 0, &err);
-	if (ind_bh)
-		return ind_bh;
+	mutex_lock(&sbi->s_snapshot_mutex);
+	list_for_each_entry_reverse(ei, &sbi->s_snapshot_list, i_snaplist) {
+		if (ei->i_flags & (NEXT3_SNAPFILE_ACTIVE_FL |
+				   NEXT3_SNAPFILE_ENABLED_FL |
+				   NEXT3_SNAPFILE_DELETED_FL))
+			continue;
+		inode = igrab(&ei->vfs_inode);
+		if (inode)
+			break;
+	}
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return inode;
+}
 
-	snapshot_debug(1, "failed to read exclude inode indirect[%d] block\n",
-			dind_offset);
-	if (!create)
-		return NULL;
+/*
+ * delete the victim snapshot like next3_ioctl() does on chattr -S
+ * Called under i_mutex and snapshot_mutex.
+ */
+static int next3_snapshot_reclaim_delete(struct inode *inode)
+{
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	struct next3_iloc iloc;
+	handle_t *handle;
+	int err, ret;
 
-	err = extend_or_restart_transaction(handle, NEXT3_RESERVE_TRANS_BLOCKS);
+	if (!next3_snapshot_list(inode) ||
+			(ei->i_flags & (NEXT3_SNAPFILE_ACTIVE_FL |
+					NEXT3_SNAPFILE_ENABLED_FL |
+					NEXT3_SNAPFILE_DELETED_FL)))
+		/* snapshot state changed since we picked it */
+		return -EAGAIN;
+
+	handle = next3_journal_start(inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = next3_reserve_inode_write(handle, inode, &iloc);
 	if (err)
-		return NULL;
-	ind_bh = next3_bread(handle, inode, NEXT3_IND_BLOCK + dind_offset,
-			create, &err);
-	if (!ind_bh) {
-		snapshot_debug(1, "failed to allocate exclude "
-				"inode indirect[%d] block\n",
-				dind_offset);
-		return NULL;
+		goto out_handle;
+	err = next3_snapshot_set_flags(handle, inode,
+				       ei->i_flags & ~NEXT3_SNAPFILE_LIST_FL);
+	if (err) {
+		brelse(iloc.bh);
+		goto out_handle;
 	}
-	snapshot_debug(2, "allocated exclude bitmap "
-			"indirect[%d] block (%lld)\n",
-			dind_offset, (long long)ind_bh->b_blocknr);
-	return ind_bh;
+	inode->i_ctime = CURRENT_TIME_SEC;
+	err = next3_mark_iloc_dirty(handle, inode, &iloc);
+out_handle:
+	ret = next3_journal_stop(handle);
+	if (!err)
+		err = ret;
+	if (err)
+		return err;
+
+	/* remove the snapshot now if it is the oldest */
+	err = next3_snapshot_update(inode->i_sb, 1, 0);
+	if (!err)
+		/* shrink/merge deleted snapshots in background */
+		next3_snapshot_cleanup_work_start(inode->i_sb, 0);
+	return err;
+}
+
+static void next3_snapshot_reclaim_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(work, struct next3_sb_info,
+						 s_reclaim_work);
+	struct super_block *sb = sbi->s_sb;
+	struct inode *inode;
+	unsigned int gen = sbi->s_reclaim_gen;
+	int err = 0, reclaimed = 0;
+
+	if (sbi->s_cleanup_stop || (sb->s_flags & MS_RDONLY))
+		goto out;
+	if ((int)(ACCESS_ONCE(sbi->s_reclaim_want) - gen) <= 0) {
+		/* requested before the last reclaim - just retry */
+		reclaimed = 1;
+		goto out;
+	}
+
+	inode = next3_snapshot_reclaim_victim(sb);
+	if (!inode)
+		goto out;
+
+	mutex_lock(&inode->i_mutex);
+	mutex_lock(&sbi->s_snapshot_mutex);
+	err = next3_snapshot_reclaim_delete(inode);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	mutex_unlock(&inode->i_mutex);
+	if (!err) {
+		next3_warning(sb, __func__, "snapshot (%u) deleted to "
+			      "reclaim space", inode->i_generation);
+		/* freed blocks can only be allocated after commit */
+		journal_force_commit(sbi->s_journal);
+		reclaimed = 1;
+	} else {
+		snapshot_debug(1, "failed to delete snapshot (%u) to reclaim "
+			       "space (err=%d)\n", inode->i_generation, err);
+		/* snapshot state changed - let the writer try again */
+		reclaimed = (err == -EAGAIN);
+	}
+	iput(inode);
+out:
+	sbi->s_reclaim_result = reclaimed;
+	smp_wmb();
+	sbi->s_reclaim_gen = gen + 1;
+	wake_up_all(&sbi->s_reclaim_wait);
 }
 
 /*
- * next3_exclude_inode_getblk - read address of exclude bitmap block
- * @handle:	JBD handle (NULL is !@create)
- * @inode:	exclude inode
- * @grp:	block group
- * @create:	if true, try to allocate missing blocks
-  *
- * Helper function for next3_snapshot_init_bitmap_cache().
- * Called under sb_lock and before snapshots are loaded, so changes made to
- * exclude inode are not COWed.
+ * next3_snapshot_reclaim() - reclaim space held by snapshots
+ * Called from next3_should_retry_alloc() on ENOSPC, with no journal handle.
+ *
+ * Returns 1 if the failed allocation should be retried and 0 if there is
+ * no snapshot to reclaim, or if reclaim is disabled.
+ */
+int next3_snapshot_reclaim(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	unsigned int gen;
+
+	if (!sbi->s_snapshot_enospc_reclaim || sbi->s_cleanup_stop ||
+			list_empty(&sbi->s_snapshot_list))
+		return 0;
+	/* cannot wait for the reclaim transactions while holding a handle */
+	if (journal_current_handle())
+		return 0;
+
+	gen = ACCESS_ONCE(sbi->s_reclaim_gen);
+	sbi->s_reclaim_want = gen + 1;
+	queue_work(next3_snapshot_cleanup_wq, &sbi->s_reclaim_work);
+	if (!wait_event_timeout(sbi->s_reclaim_wait,
+				ACCESS_ONCE(sbi->s_reclaim_gen) != gen,
+				NEXT3_SNAPSHOT_RECLAIM_TIMEOUT))
+		return 0;
+	smp_rmb();
+	return sbi->s_reclaim_result;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+/*
+ * Asynchronous snapshot control.
+ * NEXT3_IOC_SNAPSHOT_QUEUE adds a request to the per file system queue and
+ * returns its request no.  The snapshot control work runs the requests in
+ * queue order, each the same way as next3_ioctl() does on chattr +S/-S, and
+ * records the result of request no. N in s_snapctl_result[N % RESULTS].
+ * NEXT3_IOC_SNAPSHOT_STATUS reports (or waits for) the result by request no.
+ */
+struct next3_snapshot_request {
+	struct list_head list;
+	struct inode *inode;		/* snapshot file (NULL for cleanup) */
+	struct vfsmount *mnt;		/* held for write until done */
+	u64 seq;
+	unsigned int op;		/* NEXT3_SNAPSHOT_OP_* */
+};
+
+/*
+ * set or clear the list flag of snapshot @inode like next3_ioctl() does on
+ * chattr +S/-S, take the new snapshot and update/cleanup the snapshots list.
+ */
+static int next3_snapshot_ctl_set_list(struct inode *inode, int take)
+{
+	struct super_block *sb = inode->i_sb;
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_inode_info *ei = NEXT3_I(inode);
+	struct next3_iloc iloc;
+	unsigned int flags;
+	handle_t *handle;
+	int err, ret;
+
+	mutex_lock(&inode->i_mutex);
+	mutex_lock(&sbi->s_snapshot_mutex);
+	flags = ei->i_flags;
+	if (take && (flags & NEXT3_SNAPFILE_LIST_FL)) {
+		err = -EEXIST;
+		goto out_unlock;
+	}
+	if (!take && !(flags & NEXT3_SNAPFILE_LIST_FL)) {
+		/* already deleted, but may still need cleanup */
+		err = 0;
+		goto out_update;
+	}
+
+	handle = next3_journal_start(inode, 1);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out_update;
+	}
+	err = next3_reserve_inode_write(handle, inode, &iloc);
+	if (err)
+		goto out_handle;
+	if (take)
+		flags |= NEXT3_SNAPFILE_LIST_FL;
+	else
+		flags &= ~NEXT3_SNAPFILE_LIST_FL;
+	err = next3_snapshot_set_flags(handle, inode, flags);
+	if (err) {
+		brelse(iloc.bh);
+		goto out_handle;
+	}
+	next3_set_inode_flags(inode);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	err = next3_mark_iloc_dirty(handle, inode, &iloc);
+out_handle:
+	ret = next3_journal_stop(handle);
+	if (!err)
+		err = ret;
+
+	if (!err && take) {
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_take_enter(inode);
+#endif
+		err = next3_snapshot_take(inode);
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+		trace_next3_snapshot_take_exit(inode, err);
+#endif
+	}
+out_update:
+	/* update/cleanup snapshots list even if take failed */
+	ret = next3_snapshot_update(sb, !take, 0);
+	if (!take && !ret)
+		/* shrink/merge deleted snapshots in background */
+		next3_snapshot_cleanup_work_start(sb, 0);
+	if (!err)
+		err = ret;
+out_unlock:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+static int next3_snapshot_ctl_run(struct super_block *sb,
+				  struct next3_snapshot_request *req)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	int err;
+
+	switch (req->op) {
+	case NEXT3_SNAPSHOT_OP_TAKE:
+		return next3_snapshot_ctl_set_list(req->inode, 1);
+	case NEXT3_SNAPSHOT_OP_DELETE:
+		return next3_snapshot_ctl_set_list(req->inode, 0);
+	case NEXT3_SNAPSHOT_OP_CLEANUP:
+		mutex_lock(&sbi->s_snapshot_mutex);
+		err = next3_snapshot_update(sb, 1, 0);
+		if (!err)
+			next3_snapshot_cleanup_work_start(sb, 0);
+		mutex_unlock(&sbi->s_snapshot_mutex);
+		return err;
+	}
+	return -EINVAL;
+}
+
+static void next3_snapshot_ctl_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(work, struct next3_sb_info,
+						 s_snapctl_work);
+	struct super_block *sb = sbi->s_sb;
+	struct next3_snapshot_request *req;
+	int err;
+
+	spin_lock(&sbi->s_snapctl_lock);
+	while (!list_empty(&sbi->s_snapctl_list)) {
+		req = list_first_entry(&sbi->s_snapctl_list,
+				       struct next3_snapshot_request, list);
+		list_del(&req->list);
+		spin_unlock(&sbi->s_snapctl_lock);
+
+		err = next3_snapshot_ctl_run(sb, req);
+		snapshot_debug(1, "snapshot request %llu (op=%u) completed "
+			       "(err=%d)\n", req->seq, req->op, err);
+		iput(req->inode);
+		mnt_drop_write(req->mnt);
+		mntput(req->mnt);
+
+		spin_lock(&sbi->s_snapctl_lock);
+		sbi->s_snapctl_result[req->seq % NEXT3_SNAPSHOT_CTL_RESULTS] =
+			err;
+		sbi->s_snapctl_done = req->seq;
+		sbi->s_snapctl_queued--;
+		wake_up_all(&sbi->s_snapctl_wait);
+		kfree(req);
+	}
+	spin_unlock(&sbi->s_snapctl_lock);
+}
+
+/*
+ * next3_snapshot_ctl_queue() - queue snapshot operation @op
+ * Called from next3_ioctl() on the snapshot file @filp (any file for
+ * cleanup), which is held until the operation is done.
  *
- * Returns exclude bitmap block address (little endian) or 0 if not allocated.
+ * Returns 0 and the request no. in @seq on success and <0 on error.
  */
-static __le32 next3_exclude_inode_getblk(handle_t *handle,
-		struct inode *inode, int grp, int create)
+int next3_snapshot_ctl_queue(struct file *filp, unsigned int op, u64 *seq)
 {
-	int ind_offset = grp % SNAPSHOT_ADDR_PER_BLOCK;
-	struct buffer_head *bh, *ind_bh = NULL;
-	__le32 exclude_bitmap = 0;
-	int err = 0;
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct next3_sb_info *sbi = NEXT3_SB(inode->i_sb);
+	struct next3_snapshot_request *req;
+	int err;
 
-	/* read exclude inode indirect block */
-	ind_bh = next3_exclude_inode_bread(handle, inode, grp, create);
-	if (!ind_bh)
-		return 0;
+	switch (op) {
+	case NEXT3_SNAPSHOT_OP_TAKE:
+	case NEXT3_SNAPSHOT_OP_DELETE:
+		if (!next3_snapshot_file(inode))
+			return -EINVAL;
+		break;
+	case NEXT3_SNAPSHOT_OP_CLEANUP:
+		break;
+	default:
+		return -EINVAL;
+	}
 
-	if (grp >= NEXT3_SB(inode->i_sb)->s_groups_count)
-		/* past last block group - just allocating indirect blocks */
-		goto out;
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err) {
+		kfree(req);
+		return err;
+	}
+	req->mnt = mntget(filp->f_path.mnt);
+	req->inode = (op == NEXT3_SNAPSHOT_OP_CLEANUP) ? NULL : igrab(inode);
+	req->op = op;
+
+	spin_lock(&sbi->s_snapctl_lock);
+	if (sbi->s_snapctl_queued >= NEXT3_SNAPSHOT_CTL_RESULTS) {
+		spin_unlock(&sbi->s_snapctl_lock);
+		iput(req->inode);
+		mnt_drop_write(req->mnt);
+		mntput(req->mnt);
+		kfree(req);
+		return -EAGAIN;
+	}
+	req->seq = *seq = ++sbi->s_snapctl_seq;
+	sbi->s_snapctl_queued++;
+	list_add_tail(&req->list, &sbi->s_snapctl_list);
+	spin_unlock(&sbi->s_snapctl_lock);
 
-	exclude_bitmap = ((__le32 *)ind_bh->b_data)[ind_offset];
-	if (exclude_bitmap)
-		goto out;
-	if (!create)
-		goto alloc_out;
+	queue_work(next3_snapshot_ctl_wq, &sbi->s_snapctl_work);
+	return 0;
+}
 
-	/* try to allocate missing exclude bitmap(+ind+dind) block */
-	err = extend_or_restart_transaction(handle,
-			NEXT3_RESERVE_TRANS_BLOCKS);
-	if (err)
-		goto alloc_out;
+static int next3_snapshot_ctl_get_status(struct next3_sb_info *sbi,
+					 struct next3_snapshot_ctl *ctl)
+{
+	int err = 0;
 
-	/* exclude bitmap blocks are mapped on the DIND branch */
-	bh = next3_getblk(handle, inode, SNAPSHOT_IBLOCK(grp), create, &err);
-	if (!bh)
-		goto alloc_out;
-	brelse(bh);
-	exclude_bitmap = ((__le32 *)ind_bh->b_data)[ind_offset];
-alloc_out:
-	if (exclude_bitmap)
-		snapshot_debug(2, "allocated exclude bitmap #%d block "
-				"(%u)\n", grp,
-				le32_to_cpu(exclude_bitmap));
-	else
-		snapshot_debug(1, "failed to allocate exclude "
-				"bitmap #%d block (err = %d)\n",
-				grp, err);
-out:
-	brelse(ind_bh);
-	return exclude_bitmap;
+	spin_lock(&sbi->s_snapctl_lock);
+	if (!ctl->sc_seq || ctl->sc_seq > sbi->s_snapctl_seq) {
+		/* not a queued request */
+		err = -EINVAL;
+	} else if (ctl->sc_seq > sbi->s_snapctl_done) {
+		ctl->sc_state = NEXT3_SNAPSHOT_CTL_PENDING;
+		ctl->sc_result = 0;
+	} else if (sbi->s_snapctl_done - ctl->sc_seq >=
+		   NEXT3_SNAPSHOT_CTL_RESULTS) {
+		/* result was overwritten by newer requests */
+		err = -ENOENT;
+	} else {
+		ctl->sc_state = NEXT3_SNAPSHOT_CTL_DONE;
+		ctl->sc_result = sbi->s_snapctl_result[ctl->sc_seq %
+						       NEXT3_SNAPSHOT_CTL_RESULTS];
+	}
+	spin_unlock(&sbi->s_snapctl_lock);
+	return err;
 }
 
 /*
- * next3_snapshot_init_bitmap_cache():
- *
- * Init the COW/exclude bitmap cache for all block groups.
- * COW bitmap cache is set to 0 (lazy init on first access to block group).
- * Read exclude bitmap blocks addresses from exclude inode and store them
- * in block group descriptor.  If @create is true, Try to allocate missing
- * exclude bitmap blocks.
- *
- * Called from snapshot_load() under sb_lock during mount time.
- * Returns 0 on success and <0 on error.
+ * next3_snapshot_ctl_status() - get status of snapshot request ctl->sc_seq
+ * Called from next3_ioctl().  With NEXT3_SNAPSHOT_CTL_WAIT, sleeps
+ * (interruptible) until the request is completed.
  */
-static int next3_snapshot_init_bitmap_cache(struct super_block *sb, int create)
+int next3_snapshot_ctl_status(struct super_block *sb,
+			      struct next3_snapshot_ctl *ctl)
 {
-	struct next3_group_info *gi = NEXT3_SB(sb)->s_group_info;
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
-	handle_t *handle = NULL;
-	struct inode *inode;
-	__le32 exclude_bitmap = 0;
-	int grp, max_groups = sbi->s_groups_count;
-	int err = 0, ret;
-	loff_t i_size;
+	int err;
 
-	/* reset COW/exclude bitmap cache */
-	err = next3_snapshot_reset_bitmap_cache(sb, 1);
-	if (err)
+	if (ctl->sc_flags & ~NEXT3_SNAPSHOT_CTL_WAIT)
+		return -EINVAL;
+	err = next3_snapshot_ctl_get_status(sbi, ctl);
+	if (err || !(ctl->sc_flags & NEXT3_SNAPSHOT_CTL_WAIT))
 		return err;
+	if (wait_event_interruptible(sbi->s_snapctl_wait,
+			next3_snapshot_ctl_get_status(sbi, ctl) ||
+			ctl->sc_state != NEXT3_SNAPSHOT_CTL_PENDING))
+		return -ERESTARTSYS;
+	return next3_snapshot_ctl_get_status(sbi, ctl);
+}
 
-	if (!NEXT3_HAS_COMPAT_FEATURE(sb,
-				      NEXT3_FEATURE_COMPAT_EXCLUDE_INODE)) {
-		/* exclude inode is a recommended feature - don't force it */
-		snapshot_debug(1, "warning: exclude_inode feature not set - "
-			       "snapshot merge might not free all unused "
-			       "blocks!\n");
-		return 0;
-	}
+#endif
+/*
+ * next3_snapshot_cleanup_work_init() - called on mount time
+ */
+void next3_snapshot_cleanup_work_init(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
 
-	inode = next3_iget(sb, NEXT3_EXCLUDE_INO);
-	if (IS_ERR(inode)) {
-		snapshot_debug(1, "warning: bad exclude inode - "
-				"no exclude bitmap!\n");
-		return PTR_ERR(inode);
-	}
+	sbi->s_sb = sb;
+	sbi->s_cleanup_stop = 0;
+	sbi->s_cleanup_budget = 0;
+	sbi->s_cleanup_pending = 0;
+	sbi->s_cleanup_groups = NEXT3_SNAPSHOT_CLEANUP_GROUPS;
+	sbi->s_cleanup_delay_ms = NEXT3_SNAPSHOT_CLEANUP_DELAY_MS;
+	INIT_DELAYED_WORK(&sbi->s_cleanup_work, next3_snapshot_cleanup_work);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+	sbi->s_reclaim_gen = 0;
+	sbi->s_reclaim_want = 0;
+	sbi->s_reclaim_result = 0;
+	init_waitqueue_head(&sbi->s_reclaim_wait);
+	INIT_WORK(&sbi->s_reclaim_work, next3_snapshot_reclaim_work);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	spin_lock_init(&sbi->s_snapctl_lock);
+	INIT_LIST_HEAD(&sbi->s_snapctl_list);
+	sbi->s_snapctl_queued = 0;
+	sbi->s_snapctl_seq = 0;
+	sbi->s_snapctl_done = 0;
+	init_waitqueue_head(&sbi->s_snapctl_wait);
+	INIT_WORK(&sbi->s_snapctl_work, next3_snapshot_ctl_work);
+#endif
+}
 
-	if (create) {
-		/* start large transaction that will be extended/restarted */
-		handle = next3_journal_start(inode, NEXT3_MAX_TRANS_DATA);
-		if (IS_ERR(handle))
-			return PTR_ERR(handle);
-		/* number of groups the filesystem can grow to */
-		max_groups = sbi->s_gdb_count +
-			le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks);
-		max_groups *= NEXT3_DESC_PER_BLOCK(sb);
-	}
+/*
+ * next3_snapshot_cleanup_work_start() - called after foreground cleanup
+ * under snapshot_mutex and on mount time, with @delay in jiffies.
+ * Queues the work only if foreground cleanup deferred shrink/merge or
+ * (on mount time) if there are deleted snapshots on the list.
+ */
+void next3_snapshot_cleanup_work_start(struct super_block *sb,
+				       unsigned long delay)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_inode_info *ei;
 
-#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_OLD
-	if (create && NEXT3_HAS_COMPAT_FEATURE(sb,
-				NEXT3_FEATURE_COMPAT_EXCLUDE_INODE_OLD)) {
-		/* journal exclude inode migration done inside next3_iget */
-		err = next3_journal_get_write_access(handle, sbi->s_sbh);
-		NEXT3_CLEAR_COMPAT_FEATURE(sb,
-				NEXT3_FEATURE_COMPAT_EXCLUDE_INODE_OLD);
-		if (!err)
-			err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
-		if (!err)
-			err = next3_mark_inode_dirty(handle, inode);
+	if (sb->s_flags & MS_RDONLY)
+		return;
+	if (!sbi->s_cleanup_pending &&
+			!sbi->s_es->s_snapshot_shrink_next) {
+		list_for_each_entry(ei, &sbi->s_snapshot_list, i_snaplist)
+			if (ei->i_flags & NEXT3_SNAPFILE_DELETED_FL)
+				break;
+		if (&ei->i_snaplist == &sbi->s_snapshot_list)
+			/* no deleted snapshots */
+			return;
 	}
+	sbi->s_cleanup_pending = 0;
+	queue_delayed_work(next3_snapshot_cleanup_wq, &sbi->s_cleanup_work,
+			   delay);
+}
+
+/*
+ * next3_snapshot_cleanup_work_stop() - called on umount time
+ */
+void next3_snapshot_cleanup_work_stop(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
 
+	sbi->s_cleanup_stop = 1;
+	cancel_delayed_work_sync(&sbi->s_cleanup_work);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+	cancel_work_sync(&sbi->s_reclaim_work);
+	/* release writers that are still waiting for reclaim */
+	sbi->s_reclaim_result = 0;
+	smp_wmb();
+	sbi->s_reclaim_gen++;
+	wake_up_all(&sbi->s_reclaim_wait);
 #endif
-	/*
-	 * Init exclude bitmap blocks for all existing block groups and
-	 * allocate indirect blocks for all reserved block groups.
-	 */
-	err = -EIO;
-	for (grp = 0; grp < max_groups; grp++, gi++) {
-		exclude_bitmap = next3_exclude_inode_getblk(handle, inode, grp,
-				create);
-		cond_resched();
-		if (create && grp >= sbi->s_groups_count)
-			/* only allocating indirect blocks with getblk above */
-			continue;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ASYNC
+	/* queued requests hold the mount, so this is only for safety */
+	flush_work(&sbi->s_snapctl_work);
+#endif
+}
 
-		if (create && !exclude_bitmap)
-			goto out;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+/*
+ * Periodic re-evaluation of the active snapshot reserve in adaptive mode.
+ * The reserve of a snapshot that COWs less than expected is reduced and the
+ * reserve of a snapshot that COWs more than expected is increased (up to the
+ * static reserve).
+ */
+static void next3_snapshot_reserve_work(struct work_struct *work)
+{
+	struct next3_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct next3_sb_info,
+						 s_reserve_work);
+	struct super_block *sb = sbi->s_sb;
+	struct next3_super_block *es = sbi->s_es;
+	struct kstatfs statfs;
+	unsigned int cow_rate;
+	u64 r_blocks;
+	handle_t *handle;
+	int err;
 
-		gi->bg_exclude_bitmap = le32_to_cpu(exclude_bitmap);
-		snapshot_debug(2, "update exclude bitmap #%d cache "
-			       "(block=%lu)\n", grp,
-			       gi->bg_exclude_bitmap);
-	}
+	if (sbi->s_reserve_stop || (sb->s_flags & MS_RDONLY))
+		return;
 
-	err = 0;
-	if (!create)
-		goto out;
+	mutex_lock(&sbi->s_snapshot_mutex);
+	if (!sbi->s_snapshot_reserve_adaptive || !sbi->s_active_snapshot ||
+			next3_statfs_sb(sb, &statfs))
+		goto out_unlock;
 
-	i_size = SNAPSHOT_IBLOCK(max_groups) << SNAPSHOT_BLOCK_SIZE_BITS;
-	if (NEXT3_I(inode)->i_disksize >= i_size)
-		goto out;
-	i_size_write(inode, i_size);
-	NEXT3_I(inode)->i_disksize = i_size;
-	err = next3_mark_inode_dirty(handle, inode);
-out:
-	if (handle) {
-		ret = next3_journal_stop(handle);
-		if (!err)
-			err = ret;
+	cow_rate = max(sbi->s_snapshot_cow_rate,
+			next3_snapshot_active_cow_rate(sb));
+	r_blocks = next3_snapshot_reserve_adapt(sb, &statfs,
+					next3_snapshot_reserve_static(&statfs),
+					cow_rate);
+	if (r_blocks == le64_to_cpu(es->s_snapshot_r_blocks_count))
+		goto out_unlock;
+
+	handle = next3_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		goto out_unlock;
+	lock_super(sb);
+	err = next3_journal_get_write_access(handle, sbi->s_sbh);
+	if (!err) {
+		snapshot_debug(2, "snapshot reserve changed from %llu to %llu "
+			       "blocks (cow rate=%u blocks/hour)\n",
+			       le64_to_cpu(es->s_snapshot_r_blocks_count),
+			       r_blocks, cow_rate);
+		es->s_snapshot_r_blocks_count = cpu_to_le64(r_blocks);
+		err = next3_journal_dirty_metadata(handle, sbi->s_sbh);
 	}
-	iput(inode);
-	return err;
+	unlock_super(sb);
+	next3_journal_stop(handle);
+out_unlock:
+	mutex_unlock(&sbi->s_snapshot_mutex);
+
+	if (!sbi->s_reserve_stop)
+		schedule_delayed_work(&sbi->s_reserve_work,
+			max(sbi->s_snapshot_reserve_interval, 1U) * HZ);
 }
 
-#else
-/* with no exclude inode, exclude bitmap is reset to 0 */
-#define next3_snapshot_init_bitmap_cache(sb, create)	\
-		next3_snapshot_reset_bitmap_cache(sb, 1)
-#endif
+/*
+ * next3_snapshot_reserve_work_init() - called on mount time
+ */
+void next3_snapshot_reserve_work_init(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_sb = sb;
+	sbi->s_reserve_stop = 0;
+	sbi->s_snapshot_reserve_adaptive = 0;
+	sbi->s_snapshot_reserve_hours = NEXT3_SNAPSHOT_RESERVE_HOURS;
+	sbi->s_snapshot_reserve_interval = NEXT3_SNAPSHOT_RESERVE_INTERVAL;
+	sbi->s_snapshot_cow_rate = le32_to_cpu(sbi->s_es->s_snapshot_cow_rate);
+	sbi->s_snapshot_active_since = get_seconds();
+	sbi->s_snapshot_active_base = 0;
+	INIT_DELAYED_WORK(&sbi->s_reserve_work, next3_snapshot_reserve_work);
+}
+
+/*
+ * next3_snapshot_reserve_work_start() - called on mount time after the
+ * snapshots were loaded.  The COW rate of the active snapshot is observed
+ * from mount time.
+ */
+void next3_snapshot_reserve_work_start(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct inode *active_snapshot = sbi->s_active_snapshot;
+
+	if (active_snapshot)
+		sbi->s_snapshot_active_base =
+			atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_copied) +
+			atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_moved);
+	schedule_delayed_work(&sbi->s_reserve_work,
+			max(sbi->s_snapshot_reserve_interval, 1U) * HZ);
+}
+
+/*
+ * next3_snapshot_reserve_work_stop() - called on umount time
+ */
+void next3_snapshot_reserve_work_stop(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	sbi->s_reserve_stop = 1;
+	cancel_delayed_work_sync(&sbi->s_reserve_work);
+}
 
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
 /*
  * next3_snapshot_load - load the on-disk snapshot list to memory.
@@ -1972,6 +5136,24 @@ int next3_snapshot_load(struct super_block *sb, struct next3_super_block *es,
 	int err, num = 0, snapshot_id = 0;
 	int has_active = 0;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	/* lowest best-effort priority by default */
+	NEXT3_SB(sb)->s_snapshot_io_class = IOPRIO_CLASS_BE;
+	NEXT3_SB(sb)->s_snapshot_io_level = IOPRIO_BE_NR - 1;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	NEXT3_SB(sb)->s_snapshot_read_io_class = IOPRIO_CLASS_BE;
+	NEXT3_SB(sb)->s_snapshot_read_io_level = IOPRIO_BE_NR - 1;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	next3_snapshot_cow_bitmap_work_init(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	next3_snapshot_cleanup_work_init(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	next3_snapshot_reserve_work_init(sb);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	if (!list_empty(&NEXT3_SB(sb)->s_snapshot_list)) {
 		snapshot_debug(1, "warning: snapshots already loaded!\n");
@@ -2105,6 +5287,9 @@ int next3_snapshot_load(struct super_block *sb, struct next3_super_block *es,
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 		list_add_tail(&NEXT3_I(inode)->i_snaplist,
 			      &NEXT3_SB(sb)->s_snapshot_list);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+		next3_snapshot_index_add(sb, inode);
+#endif
 		load_ino = NEXT_SNAPSHOT(inode);
 		/* keep snapshot list reference */
 #else
@@ -2127,6 +5312,31 @@ int next3_snapshot_load(struct super_block *sb, struct next3_super_block *es,
 		err = next3_snapshot_update(sb, 0, read_only);
 		snapshot_debug(1, "%d snapshots loaded\n", num);
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_MOUNT
+	if (!err && has_active && !read_only)
+		/*
+		 * Failure to load the COW bitmap cache is not fatal.
+		 * COW bitmaps will be looked up on first block group access.
+		 */
+		(void) next3_snapshot_load_cow_bitmap_cache(sb,
+				next3_snapshot_has_active(sb));
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	if (!err && has_active && !read_only)
+		/* create COW bitmaps of active snapshot in background */
+		next3_snapshot_cow_bitmap_work_start(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	if (!err && num > 0 && !read_only)
+		/* resume cleanup of deleted snapshots after mount */
+		next3_snapshot_cleanup_work_start(sb,
+			msecs_to_jiffies(NEXT3_SB(sb)->s_cleanup_delay_ms));
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	if (!err && !read_only)
+		/* re-evaluate snapshot reserve periodically */
+		next3_snapshot_reserve_work_start(sb);
+#endif
 	return err;
 }
 
@@ -2139,18 +5349,48 @@ void next3_snapshot_destroy(struct super_block *sb)
 {
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	struct list_head *l, *n;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PREINIT
+	/* stop background work before releasing the active snapshot */
+	next3_snapshot_cow_bitmap_work_stop(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	/* stop background cleanup before releasing the snapshots list */
+	next3_snapshot_cleanup_work_stop(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	next3_snapshot_reserve_work_stop(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	/* iterate safe because we are deleting from list and freeing the
 	 * inodes */
 	list_for_each_safe(l, n, &NEXT3_SB(sb)->s_snapshot_list) {
 		struct inode *inode = &list_entry(l, struct next3_inode_info,
 						  i_snaplist)->vfs_inode;
 		list_del_init(&NEXT3_I(inode)->i_snaplist);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+		next3_snapshot_index_del(sb, inode);
+#endif
 		/* remove snapshot list reference */
 		iput(inode);
 	}
 #endif
 	/* deactivate in-memory active snapshot - cannot fail */
 	(void) next3_snapshot_set_active(sb, NULL);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_PIN
+	/* release pinned COW bitmap buffers */
+	next3_snapshot_reset_bitmap_cache(sb, 0);
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+	/* release cached fixed block bitmaps */
+	next3_snapshot_drop_fixed_bitmaps(sb);
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_BITMAP_LAZY
+	/* release exclude inode reference */
+	iput(NEXT3_SB(sb)->s_exclude_inode);
+	NEXT3_SB(sb)->s_exclude_inode = NULL;
+#endif
 }
 
 /*
@@ -2180,6 +5420,14 @@ int next3_snapshot_update(struct super_block *sb, int cleanup, int read_only)
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP
 	int need_shrink = 0;
 	int need_merge = 0;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	ktime_t phase_start;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	int ioprio;
+#endif
 #endif
 	int err = 0;
 
@@ -2193,6 +5441,23 @@ int next3_snapshot_update(struct super_block *sb, int cleanup, int read_only)
 	prev = NEXT3_SB(sb)->s_snapshot_list.prev;
 	if (list_empty(prev))
 		return 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_SHRINK_BULK
+
+	if (cleanup) {
+		/* shrink all deleted snapshots groups in one pass */
+		snapshot_phase_start(phase_start);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+		ioprio = next3_snapshot_io_begin(sb);
+		err = next3_snapshot_shrink_all(sb, active_snapshot);
+		next3_snapshot_io_end(ioprio);
+#else
+		err = next3_snapshot_shrink_all(sb, active_snapshot);
+#endif
+		if (err)
+			return err;
+		snapshot_phase_next(sb, SHRINK, phase_start);
+	}
+#endif
 
 update_snapshot:
 	ei = list_entry(prev, struct next3_inode_info, i_snaplist);
@@ -2272,14 +5537,26 @@ prev_snapshot:
 	deleted = NEXT3_I(active_snapshot)->i_flags & NEXT3_SNAPFILE_DELETED_FL;
 	if (deleted && igrab(active_snapshot)) {
 		/* lock journal updates before deactivating snapshot */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+		(void) next3_freeze_lite(sb);
+#else
 		sb->s_op->freeze_fs(sb);
+#endif
 		lock_super(sb);
 		/* deactivate in-memory active snapshot - cannot fail */
 		(void) next3_snapshot_set_active(sb, NULL);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_BITMAP_CACHE
+		/* block bitmaps may change without COW from now on */
+		next3_snapshot_drop_fixed_bitmaps(sb);
+#endif
 		/* clear on-disk active snapshot */
 		NEXT3_SB(sb)->s_es->s_snapshot_inum = 0;
 		unlock_super(sb);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+		next3_unfreeze_lite(sb);
+#else
 		sb->s_op->unfreeze_fs(sb);
+#endif
 		/* remove unused deleted active snapshot */
 		err = next3_snapshot_remove(active_snapshot);
 		/* drop the refcount to 0 */
@@ -16,6 +16,16 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/debugfs.h>
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+#include <linux/fs_struct.h>
+#include <linux/mount.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+#include <linux/hash.h>
+#include <linux/seq_file.h>
+#endif
 #include "snapshot.h"
 
 /*
@@ -50,6 +60,11 @@ u8 snapshot_enable_debug __read_mostly = 1;
 u8 cow_cache_offset __read_mostly = 0;
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+/* no. of operations per benchmark run */
+static u32 snapshot_bench_count __read_mostly = 1024;
+#endif
+
 static struct dentry *next3_debugfs_dir;
 static struct dentry *snapshot_debug;
 static struct dentry *snapshot_version;
@@ -57,6 +72,17 @@ static struct dentry *snapshot_test[SNAPSHOT_TESTS_NUM];
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
 static struct dentry *cow_cache;
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+static struct dentry *snapshot_bench;
+static struct dentry *snapshot_bench_ops;
+static const struct file_operations snapshot_bench_fops;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+u8 journal_credits_enable __read_mostly;
+static struct dentry *journal_credits;
+static struct dentry *journal_credits_on;
+static const struct file_operations journal_credits_fops;
+#endif
 
 static char snapshot_version_str[] = NEXT3_SNAPSHOT_VERSION;
 static struct debugfs_blob_wrapper snapshot_version_blob = {
@@ -91,6 +117,23 @@ void next3_create_debugfs_entry(void)
 					   next3_debugfs_dir,
 					   &cow_cache_offset);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+	snapshot_bench_ops = debugfs_create_u32("bench-ops", S_IRUGO|S_IWUSR,
+					   next3_debugfs_dir,
+					   &snapshot_bench_count);
+	snapshot_bench = debugfs_create_file("bench", S_IRUGO|S_IWUSR,
+					   next3_debugfs_dir, NULL,
+					   &snapshot_bench_fops);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+	journal_credits_on = debugfs_create_u8("journal-credits-enable",
+					   S_IRUGO|S_IWUSR, next3_debugfs_dir,
+					   &journal_credits_enable);
+	journal_credits = debugfs_create_file("journal-credits",
+					   S_IRUGO|S_IWUSR,
+					   next3_debugfs_dir, NULL,
+					   &journal_credits_fops);
+#endif
 }
 
 /*
@@ -103,6 +146,18 @@ void next3_remove_debugfs_entry(void)
 
 	if (!next3_debugfs_dir)
 		return;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+	if (journal_credits)
+		debugfs_remove(journal_credits);
+	if (journal_credits_on)
+		debugfs_remove(journal_credits_on);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+	if (snapshot_bench)
+		debugfs_remove(snapshot_bench);
+	if (snapshot_bench_ops)
+		debugfs_remove(snapshot_bench_ops);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
 	if (cow_cache)
 		debugfs_remove(cow_cache);
@@ -117,6 +172,437 @@ void next3_remove_debugfs_entry(void)
 	debugfs_remove(next3_debugfs_dir);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_DEBUG_BENCH
+/*
+ * Snapshot COW microbenchmarks
+ *
+ * Writing one of the operation names below to <debugfs>/next3/bench runs
+ * bench-ops operations against the active snapshot of the next3 file system
+ * of the writer's current directory.  Use a scratch snapshot: the 'bitmap'
+ * run initializes the COW bitmaps, so it should be run right after snapshot
+ * take to measure COW bitmap init and not COW bitmap cache lookup.
+ * Reading <debugfs>/next3/bench reports the latency distribution of the
+ * last run.
+ */
+enum {
+	SNAPSHOT_BENCH_COW,	/* test_and_cow() of metadata blocks */
+	SNAPSHOT_BENCH_MOVE,	/* test_and_move() of data blocks */
+	SNAPSHOT_BENCH_BITMAP,	/* COW bitmap of every block group */
+	SNAPSHOT_BENCH_READ,	/* read through mapping of snapshot blocks */
+	SNAPSHOT_BENCH_NUM
+};
+
+static const char *snapshot_bench_names[SNAPSHOT_BENCH_NUM] = {
+	"cow",
+	"move",
+	"bitmap",
+	"read",
+};
+
+/* latency histogram buckets - log2 of nsec */
+#define SNAPSHOT_BENCH_BUCKETS	32
+
+struct next3_bench_result {
+	int op;		/* benchmark operation (-1 - no results) */
+	u32 done;	/* no. of timed operations */
+	u32 hits;	/* no. of blocks in use by snapshot */
+	u32 errors;	/* no. of failed operations */
+	u64 min;	/* min. latency in nsec */
+	u64 max;	/* max. latency in nsec */
+	u64 total;	/* total latency in nsec */
+	u32 hist[SNAPSHOT_BENCH_BUCKETS];
+};
+
+/* serializes benchmark runs and protects the last run results */
+static DEFINE_MUTEX(snapshot_bench_mutex);
+static struct next3_bench_result snapshot_bench_result = { .op = -1 };
+
+/*
+ * next3_snapshot_bench_op - run and time one benchmark operation
+ *	@sb:		super block
+ *	@snapshot:	active snapshot
+ *	@op:		benchmark operation
+ *	@block:		block to test
+ *	@nsec:		returns the operation latency
+ *
+ * Only the snapshot function call is timed, not the journal handle start.
+ * Blocks are only tested and never COWed or moved to snapshot.
+ *
+ * Returns 1 if @block is in use by snapshot, 0 if not, < 0 on error.
+ */
+static int next3_snapshot_bench_op(struct super_block *sb,
+		struct inode *snapshot, int op, next3_fsblk_t block,
+		u64 *nsec)
+{
+	struct buffer_head *bh, dummy;
+	handle_t *handle = NULL;
+	ktime_t start;
+	int err;
+
+	if (op != SNAPSHOT_BENCH_READ) {
+		handle = next3_journal_start_sb(sb, 1);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+	}
+
+	switch (op) {
+	case SNAPSHOT_BENCH_COW:
+		bh = sb_getblk(sb, block);
+		if (!bh) {
+			err = -ENOMEM;
+			break;
+		}
+		start = ktime_get();
+		err = next3_snapshot_test_and_cow(__func__, handle, NULL,
+				bh, 0);
+		*nsec = ktime_to_ns(ktime_sub(ktime_get(), start));
+		brelse(bh);
+		if (err == -EIO)
+			/* block needs to be COWed */
+			err = 1;
+		break;
+	case SNAPSHOT_BENCH_MOVE:
+	case SNAPSHOT_BENCH_BITMAP:
+		start = ktime_get();
+		err = next3_snapshot_test_and_move(__func__, handle,
+				sb->s_root->d_inode, block, 1, 0, NULL);
+		*nsec = ktime_to_ns(ktime_sub(ktime_get(), start));
+		break;
+	default:
+		dummy.b_state = 0;
+		start = ktime_get();
+		err = next3_get_blocks_handle(NULL, snapshot,
+				SNAPSHOT_IBLOCK(block), 1, &dummy, 0);
+		*nsec = ktime_to_ns(ktime_sub(ktime_get(), start));
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ
+		if (buffer_tracked_read(&dummy))
+			/* read through to block device is not submitted */
+			cancel_buffer_tracked_read(&dummy);
+#endif
+		/* mapped in snapshot or read through to newer snapshot */
+		if (err > 0)
+			err = (dummy.b_blocknr != block);
+		break;
+	}
+
+	if (handle)
+		next3_journal_stop(handle);
+	return err < 0 ? err : !!err;
+}
+
+/*
+ * next3_snapshot_bench_run - run a benchmark against the active snapshot
+ *	@sb:	super block
+ *	@op:	benchmark operation
+ *	@res:	results of the run
+ *
+ * Blocks are spread evenly over the file system, or one block per group
+ * for the 'bitmap' run.  Called under snapshot_mutex, so the active
+ * snapshot cannot go away.
+ */
+static int next3_snapshot_bench_run(struct super_block *sb, int op,
+		struct next3_bench_result *res)
+{
+	struct next3_super_block *es = NEXT3_SB(sb)->s_es;
+	next3_fsblk_t first = le32_to_cpu(es->s_first_data_block);
+	next3_fsblk_t nblocks = le32_to_cpu(es->s_blocks_count) - first;
+	unsigned long ngroups = NEXT3_SB(sb)->s_groups_count;
+	struct inode *snapshot;
+	next3_fsblk_t block, stride;
+	u32 i, count = snapshot_bench_count;
+	u64 nsec;
+	int err = 0;
+
+	snapshot = next3_snapshot_has_active(sb);
+	if (!snapshot)
+		return -ENOENT;
+
+	memset(res, 0, sizeof(*res));
+	res->op = op;
+	res->min = ~0ULL;
+	stride = max_t(next3_fsblk_t, nblocks / max_t(u32, count, 1), 1);
+	for (i = 0; i < count; i++) {
+		if (op == SNAPSHOT_BENCH_BITMAP)
+			block = next3_group_first_block_no(sb, i % ngroups);
+		else
+			block = first + (i * stride) % nblocks;
+
+		nsec = 0;
+		err = next3_snapshot_bench_op(sb, snapshot, op, block, &nsec);
+		if (err < 0) {
+			res->errors++;
+			if (err == -EROFS)
+				break;
+			err = 0;
+			continue;
+		}
+		res->hits += err;
+		res->done++;
+		res->total += nsec;
+		res->min = min(res->min, nsec);
+		res->max = max(res->max, nsec);
+		res->hist[min(fls64(nsec), SNAPSHOT_BENCH_BUCKETS - 1)]++;
+		err = 0;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	if (!res->done)
+		res->min = 0;
+	return err;
+}
+
+static ssize_t snapshot_bench_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct super_block *sb;
+	struct path pwd;
+	char buf[16];
+	int op, err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	for (op = 0; op < SNAPSHOT_BENCH_NUM; op++)
+		if (!strcmp(strstrip(buf), snapshot_bench_names[op]))
+			break;
+	if (op == SNAPSHOT_BENCH_NUM)
+		return -EINVAL;
+
+	/* benchmark the file system of the current directory */
+	read_lock(&current->fs->lock);
+	pwd = current->fs->pwd;
+	path_get(&pwd);
+	read_unlock(&current->fs->lock);
+
+	sb = pwd.mnt->mnt_sb;
+	err = -EINVAL;
+	if (strcmp(sb->s_type->name, "next3"))
+		goto out;
+	err = -EROFS;
+	if (sb->s_flags & MS_RDONLY)
+		goto out;
+
+	mutex_lock(&snapshot_bench_mutex);
+	mutex_lock(&NEXT3_SB(sb)->s_snapshot_mutex);
+	err = next3_snapshot_bench_run(sb, op, &snapshot_bench_result);
+	mutex_unlock(&NEXT3_SB(sb)->s_snapshot_mutex);
+	mutex_unlock(&snapshot_bench_mutex);
+out:
+	path_put(&pwd);
+	return err ? err : count;
+}
+
+/*
+ * Sample output:
+ * op: cow
+ * ops: 1024 (errors: 0)
+ * hits: 17
+ * latency (nsec): min 310 avg 842 max 91355
+ * 256-511: 402
+ * 512-1023: 590
+ * ...
+ */
+static ssize_t snapshot_bench_read(struct file *file,
+		char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct next3_bench_result *res = &snapshot_bench_result;
+	char *buf;
+	int i, len = 0;
+	ssize_t ret;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&snapshot_bench_mutex);
+	if (res->op < 0) {
+		len = scnprintf(buf, PAGE_SIZE, "no results\n");
+		goto out;
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			"op: %s\nops: %u (errors: %u)\nhits: %u\n"
+			"latency (nsec): min %llu avg %llu max %llu\n",
+			snapshot_bench_names[res->op], res->done, res->errors,
+			res->hits, res->min,
+			res->done ? div_u64(res->total, res->done) : 0,
+			res->max);
+	for (i = 0; i < SNAPSHOT_BENCH_BUCKETS; i++) {
+		if (!res->hist[i])
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu-%llu: %u\n",
+				i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+				res->hist[i]);
+	}
+out:
+	mutex_unlock(&snapshot_bench_mutex);
+	ret = simple_read_from_buffer(ubuf, count, ppos, buf, len);
+	free_page((unsigned long)buf);
+	return ret;
+}
+
+static const struct file_operations snapshot_bench_fops = {
+	.owner	= THIS_MODULE,
+	.read	= snapshot_bench_read,
+	.write	= snapshot_bench_write,
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+/*
+ * Journal credits usage statistics
+ *
+ * With journal-credits-enable set, the final journal_stop() of every handle
+ * accounts the credits requested by the caller (h_base_credits, including
+ * extends) vs. the credits used, and the buffer credits reserved for the
+ * handle (including the COW credits factor) vs. the buffer credits used.
+ * Handles are keyed by the function that stopped them, which is the function
+ * that started them for almost all handles.  Reading journal-credits shows
+ * the totals and histograms of used credits in percent of reserved credits
+ * per key.  Writing to journal-credits resets the statistics.
+ */
+#define JOURNAL_CREDITS_KEYS_BITS	7
+#define JOURNAL_CREDITS_KEYS		(1 << JOURNAL_CREDITS_KEYS_BITS)
+/* 10% steps, the last slot counts handles that used more than reserved */
+#define JOURNAL_CREDITS_SLOTS		11
+
+struct next3_credits_stats {
+	const char *where;
+	unsigned long count;
+	unsigned long requested;	/* user credits requested */
+	unsigned long used;		/* user credits used */
+	unsigned int max_used;
+	unsigned long reserved;		/* buffer credits reserved */
+	unsigned long buffer_used;	/* buffer credits used */
+	unsigned int max_buffer_used;
+	unsigned long user_slots[JOURNAL_CREDITS_SLOTS];
+	unsigned long buffer_slots[JOURNAL_CREDITS_SLOTS];
+};
+
+static struct next3_credits_stats journal_credits_stats[JOURNAL_CREDITS_KEYS];
+static unsigned long journal_credits_dropped;
+static DEFINE_SPINLOCK(journal_credits_lock);
+
+static inline int journal_credits_slot(int used, int reserved)
+{
+	if (used > reserved)
+		return JOURNAL_CREDITS_SLOTS - 1;
+	if (reserved <= 0)
+		return 0;
+	return min(used * 10 / reserved, JOURNAL_CREDITS_SLOTS - 2);
+}
+
+void __next3_journal_credits_account(const char *where,
+		next3_handle_t *handle)
+{
+	struct next3_credits_stats *cs;
+	int requested = handle->h_base_credits;
+	int used = max(requested - (int)handle->h_user_credits, 0);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	int reserved = NEXT3_SB_START_TRANS_BLOCKS(NEXT3_HANDLE_SB(handle),
+						   requested);
+#else
+	int reserved = NEXT3_SNAPSHOT_START_TRANS_BLOCKS(requested);
+#endif
+	int buffer_used = max(reserved - handle->h_buffer_credits, 0);
+	unsigned long i, key = hash_ptr((void *)where,
+					JOURNAL_CREDITS_KEYS_BITS);
+
+	spin_lock(&journal_credits_lock);
+	/* open addressing - the keys are static __func__ strings */
+	for (i = 0; i < JOURNAL_CREDITS_KEYS; i++) {
+		cs = &journal_credits_stats[(key + i) &
+					    (JOURNAL_CREDITS_KEYS - 1)];
+		if (cs->where == where || !cs->where)
+			break;
+	}
+	if (i == JOURNAL_CREDITS_KEYS) {
+		journal_credits_dropped++;
+		goto out;
+	}
+	cs->where = where;
+	cs->count++;
+	cs->requested += requested;
+	cs->used += used;
+	cs->max_used = max_t(unsigned int, cs->max_used, used);
+	cs->reserved += reserved;
+	cs->buffer_used += buffer_used;
+	cs->max_buffer_used = max_t(unsigned int, cs->max_buffer_used,
+				    buffer_used);
+	cs->user_slots[journal_credits_slot(used, requested)]++;
+	cs->buffer_slots[journal_credits_slot(buffer_used, reserved)]++;
+out:
+	spin_unlock(&journal_credits_lock);
+}
+
+/*
+ * One line per key:
+ * <where> <count> <requested> <used> <max used> <reserved> <buffer used>
+ *	<max buffer used> | <user % slots...> | <buffer % slots...>
+ */
+static int journal_credits_show(struct seq_file *m, void *v)
+{
+	struct next3_credits_stats *cs;
+	int i, j;
+
+	seq_printf(m, "# where count requested used max_used reserved "
+		   "buffer_used max_buffer_used | used%% 0-10...90-100,>100 "
+		   "| buffer_used%% 0-10...90-100,>100\n");
+	spin_lock(&journal_credits_lock);
+	for (i = 0; i < JOURNAL_CREDITS_KEYS; i++) {
+		cs = &journal_credits_stats[i];
+		if (!cs->where)
+			continue;
+		seq_printf(m, "%s %lu %lu %lu %u %lu %lu %u |", cs->where,
+			   cs->count, cs->requested, cs->used, cs->max_used,
+			   cs->reserved, cs->buffer_used, cs->max_buffer_used);
+		for (j = 0; j < JOURNAL_CREDITS_SLOTS; j++)
+			seq_printf(m, " %lu", cs->user_slots[j]);
+		seq_printf(m, " |");
+		for (j = 0; j < JOURNAL_CREDITS_SLOTS; j++)
+			seq_printf(m, " %lu", cs->buffer_slots[j]);
+		seq_printf(m, "\n");
+	}
+	if (journal_credits_dropped)
+		seq_printf(m, "# dropped %lu\n", journal_credits_dropped);
+	spin_unlock(&journal_credits_lock);
+	return 0;
+}
+
+static int journal_credits_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, journal_credits_show, NULL);
+}
+
+static ssize_t journal_credits_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	spin_lock(&journal_credits_lock);
+	memset(journal_credits_stats, 0, sizeof(journal_credits_stats));
+	journal_credits_dropped = 0;
+	spin_unlock(&journal_credits_lock);
+	return count;
+}
+
+static const struct file_operations journal_credits_fops = {
+	.owner		= THIS_MODULE,
+	.open		= journal_credits_open,
+	.read		= seq_read,
+	.write		= journal_credits_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_DUMP
 /* snapshot dump state */
 struct next3_dump_info {
@@ -0,0 +1,413 @@
+/*
+ * linux/fs/next3/snapshot_mount.c
+ *
+ * Copyright (C) 2008-2010 CTERA Networks
+ *
+ * This file is part of the Linux kernel and is made available under
+ * the terms of the GNU General Public License, version 2, or at your
+ * option, any later version, incorporated herein by reference.
+ *
+ * Next3 snapshot mount without a loop device.
+ */
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/idr.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/parser.h>
+#include <linux/workqueue.h>
+#endif
+#include "snapshot.h"
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+/*
+ * A mounted snapshot is a read-only block device, whose sectors are the
+ * snapshot file blocks.  The snapshot super block is read from this device
+ * and the bios it submits are served from the snapshot file page cache by
+ * the snapshot mount work queue.  The snapshot file read path resolves every
+ * block through the snapshot map or reads it through from the block device
+ * buffer cache, so a page, which was not cached before the bio, is dropped
+ * after it was copied and the snapshot image is cached only once, by the
+ * snapshot super block.  The bios cannot be served inline by make_request(),
+ * because the snapshot file reads submit bios of their own.
+ */
+
+/* max pages per bio - size of the uncached pages bitmap */
+#define SNAPSHOT_DISK_MAX_PAGES	32
+
+struct next3_snapshot_disk {
+	struct gendisk *disk;
+	struct request_queue *queue;
+	struct inode *snapshot;		/* referenced and marked as mounted */
+	struct super_block *live_sb;	/* with an active reference */
+	int minor;
+};
+
+struct next3_snapshot_bio {
+	struct work_struct work;
+	struct bio *bio;
+	struct next3_snapshot_disk *sdisk;
+};
+
+static int next3_snapshot_major;
+static struct workqueue_struct *next3_snapshot_mount_wq;
+static DEFINE_IDA(next3_snapshot_minors);
+static DEFINE_SPINLOCK(next3_snapshot_minors_lock);
+
+static const struct block_device_operations next3_snapshot_disk_fops = {
+	.owner		= THIS_MODULE,
+};
+
+/*
+ * next3_snapshot_disk_work() - copy snapshot file pages to bio pages
+ */
+static void next3_snapshot_disk_work(struct work_struct *work)
+{
+	struct next3_snapshot_bio *sbio =
+		container_of(work, struct next3_snapshot_bio, work);
+	struct bio *bio = sbio->bio;
+	struct address_space *mapping = sbio->sdisk->snapshot->i_mapping;
+	DECLARE_BITMAP(uncached, SNAPSHOT_DISK_MAX_PAGES + 1);
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	pgoff_t first = pos >> PAGE_CACHE_SHIFT;
+	pgoff_t last = (pos + bio->bi_size - 1) >> PAGE_CACHE_SHIFT;
+	unsigned int nr_pages = last - first + 1;
+	struct bio_vec *bvec;
+	struct page *page;
+	int i, err = 0;
+
+	/* remember the pages that are read only for this bio */
+	bitmap_zero(uncached, SNAPSHOT_DISK_MAX_PAGES + 1);
+	for (i = 0; i < nr_pages; i++) {
+		page = find_get_page(mapping, first + i);
+		if (page)
+			page_cache_release(page);
+		else
+			__set_bit(i, uncached);
+	}
+	if (!bitmap_empty(uncached, nr_pages)) {
+		struct file_ra_state ra;
+
+		/* read the missing pages of the bio with large reads */
+		file_ra_state_init(&ra, mapping);
+		ra.ra_pages = nr_pages;
+		page_cache_sync_readahead(mapping, &ra, NULL, first, nr_pages);
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int offset = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			unsigned int poff = pos & ~PAGE_CACHE_MASK;
+			unsigned int n = min_t(unsigned int, len,
+					       PAGE_CACHE_SIZE - poff);
+			char *src, *dst;
+
+			page = read_mapping_page(mapping,
+					pos >> PAGE_CACHE_SHIFT, NULL);
+			if (IS_ERR(page)) {
+				err = PTR_ERR(page);
+				goto out;
+			}
+			dst = kmap_atomic(bvec->bv_page, KM_USER0);
+			src = kmap_atomic(page, KM_USER1);
+			memcpy(dst + offset, src + poff, n);
+			kunmap_atomic(src, KM_USER1);
+			kunmap_atomic(dst, KM_USER0);
+			flush_dcache_page(bvec->bv_page);
+			page_cache_release(page);
+			pos += n;
+			offset += n;
+			len -= n;
+		}
+	}
+out:
+	for_each_set_bit(i, uncached, nr_pages)
+		invalidate_mapping_pages(mapping, first + i, first + i);
+	bio_endio(bio, err);
+	kfree(sbio);
+}
+
+static int next3_snapshot_make_request(struct request_queue *q,
+		struct bio *bio)
+{
+	struct next3_snapshot_bio *sbio;
+
+	if (bio_data_dir(bio) == WRITE) {
+		bio_endio(bio, -EROFS);
+		return 0;
+	}
+	if (!bio->bi_size) {
+		bio_endio(bio, 0);
+		return 0;
+	}
+	sbio = kmalloc(sizeof(*sbio), GFP_NOIO);
+	if (!sbio) {
+		bio_endio(bio, -ENOMEM);
+		return 0;
+	}
+	INIT_WORK(&sbio->work, next3_snapshot_disk_work);
+	sbio->bio = bio;
+	sbio->sdisk = q->queuedata;
+	queue_work(next3_snapshot_mount_wq, &sbio->work);
+	return 0;
+}
+
+static struct next3_snapshot_disk *next3_snapshot_disk_create(
+		struct super_block *live_sb, struct inode *snapshot)
+{
+	struct next3_snapshot_disk *sdisk;
+	int err;
+
+	sdisk = kzalloc(sizeof(*sdisk), GFP_KERNEL);
+	if (!sdisk)
+		return ERR_PTR(-ENOMEM);
+
+	do {
+		err = -ENOMEM;
+		if (!ida_pre_get(&next3_snapshot_minors, GFP_KERNEL))
+			goto out_free;
+		spin_lock(&next3_snapshot_minors_lock);
+		err = ida_get_new(&next3_snapshot_minors, &sdisk->minor);
+		spin_unlock(&next3_snapshot_minors_lock);
+	} while (err == -EAGAIN);
+	if (err)
+		goto out_free;
+	err = -EBUSY;
+	if (sdisk->minor > MINORMASK)
+		goto out_minor;
+
+	err = -ENOMEM;
+	sdisk->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!sdisk->queue)
+		goto out_minor;
+	sdisk->queue->queuedata = sdisk;
+	blk_queue_make_request(sdisk->queue, next3_snapshot_make_request);
+	blk_queue_max_hw_sectors(sdisk->queue,
+			SNAPSHOT_DISK_MAX_PAGES << (PAGE_CACHE_SHIFT - 9));
+
+	sdisk->disk = alloc_disk(1);
+	if (!sdisk->disk)
+		goto out_queue;
+	sdisk->disk->major = next3_snapshot_major;
+	sdisk->disk->first_minor = sdisk->minor;
+	sdisk->disk->fops = &next3_snapshot_disk_fops;
+	sdisk->disk->private_data = sdisk;
+	sdisk->disk->queue = sdisk->queue;
+	snprintf(sdisk->disk->disk_name, sizeof(sdisk->disk->disk_name),
+		 "next3snap%d", sdisk->minor);
+	set_capacity(sdisk->disk, i_size_read(snapshot) >> 9);
+	set_disk_ro(sdisk->disk, 1);
+
+	sdisk->snapshot = snapshot;
+	sdisk->live_sb = live_sb;
+	add_disk(sdisk->disk);
+	return sdisk;
+
+out_queue:
+	blk_cleanup_queue(sdisk->queue);
+out_minor:
+	spin_lock(&next3_snapshot_minors_lock);
+	ida_remove(&next3_snapshot_minors, sdisk->minor);
+	spin_unlock(&next3_snapshot_minors_lock);
+out_free:
+	kfree(sdisk);
+	return ERR_PTR(err);
+}
+
+/*
+ * next3_snapshot_disk_destroy() - remove snapshot disk and release snapshot
+ * Called after the last reference to the disk block device was dropped.
+ */
+static void next3_snapshot_disk_destroy(struct next3_snapshot_disk *sdisk)
+{
+	flush_workqueue(next3_snapshot_mount_wq);
+	del_gendisk(sdisk->disk);
+	blk_cleanup_queue(sdisk->queue);
+	put_disk(sdisk->disk);
+	spin_lock(&next3_snapshot_minors_lock);
+	ida_remove(&next3_snapshot_minors, sdisk->minor);
+	spin_unlock(&next3_snapshot_minors_lock);
+
+	next3_snapshot_mount_put(sdisk->snapshot);
+	deactivate_super(sdisk->live_sb);
+	kfree(sdisk);
+}
+
+static int next3_snapshot_test_bdev_super(struct super_block *s, void *data)
+{
+	return (void *)s->s_bdev == data;
+}
+
+static int next3_snapshot_set_bdev_super(struct super_block *s, void *data)
+{
+	s->s_bdev = data;
+	s->s_dev = s->s_bdev->bd_dev;
+	s->s_bdi = &bdev_get_queue(s->s_bdev)->backing_dev_info;
+	return 0;
+}
+
+/*
+ * next3_snapshot_mount_option() - find snapshot=<id> mount option
+ * The option is also accepted (and ignored) by parse_options().
+ * Returns 1 and the snapshot id in @pid if the option was found.
+ */
+int next3_snapshot_mount_option(void *data, __u32 *pid)
+{
+	char *p = data;
+	substring_t arg;
+	int id;
+
+	while (p && *p) {
+		char *end = strchr(p, ',');
+
+		if (!end)
+			end = p + strlen(p);
+		if (end - p > 9 && !strncmp(p, "snapshot=", 9)) {
+			arg.from = p + 9;
+			arg.to = end;
+			if (match_int(&arg, &id) || id < 0)
+				return 0;
+			*pid = id;
+			return 1;
+		}
+		p = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/*
+ * next3_snapshot_get_sb() - mount snapshot @id of the file system on @dev_name
+ * Called from next3_get_sb() if the snapshot=<id> mount option was given.
+ * Holds an active reference to the file system super block and a reference to
+ * the snapshot inode until the snapshot is unmounted.  The snapshot image is
+ * mounted read-only and without a journal by @fill_super().
+ */
+int next3_snapshot_get_sb(struct file_system_type *fs_type,
+		int flags, const char *dev_name, void *data, __u32 id,
+		int (*fill_super)(struct super_block *, void *, int),
+		struct vfsmount *mnt)
+{
+	struct next3_snapshot_disk *sdisk;
+	struct block_device *bdev;
+	struct super_block *live_sb, *s;
+	struct inode *snapshot;
+	fmode_t mode = FMODE_READ;
+	char b[BDEVNAME_SIZE];
+	int err;
+
+	if (!(flags & MS_RDONLY))
+		return -EROFS;
+
+	bdev = lookup_bdev(dev_name);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+	live_sb = get_super(bdev);
+	bdput(bdev);
+	if (!live_sb)
+		return -EINVAL;
+	if (live_sb->s_type != fs_type) {
+		drop_super(live_sb);
+		return -EINVAL;
+	}
+	/* s_root was checked by get_super() under s_umount */
+	atomic_inc(&live_sb->s_active);
+	drop_super(live_sb);
+
+	snapshot = next3_snapshot_mount_get(live_sb, id);
+	if (IS_ERR(snapshot)) {
+		err = PTR_ERR(snapshot);
+		goto out_live;
+	}
+
+	sdisk = next3_snapshot_disk_create(live_sb, snapshot);
+	if (IS_ERR(sdisk)) {
+		err = PTR_ERR(sdisk);
+		goto out_snapshot;
+	}
+
+	/* from here on, the disk owns the snapshot and live_sb references */
+	err = -ENOMEM;
+	bdev = bdget_disk(sdisk->disk, 0);
+	if (!bdev)
+		goto out_disk;
+	err = blkdev_get(bdev, mode);
+	if (err)
+		goto out_disk;
+	err = bd_claim(bdev, fs_type);
+	if (err) {
+		blkdev_put(bdev, mode);
+		goto out_disk;
+	}
+
+	s = sget(fs_type, next3_snapshot_test_bdev_super,
+		 next3_snapshot_set_bdev_super, bdev);
+	if (IS_ERR(s)) {
+		close_bdev_exclusive(bdev, mode);
+		err = PTR_ERR(s);
+		goto out_disk;
+	}
+
+	/* a new disk has no super block, so s->s_root is NULL */
+	s->s_flags = flags;
+	s->s_mode = mode;
+	strlcpy(s->s_id, bdevname(bdev, b), sizeof(s->s_id));
+	sb_set_blocksize(s, block_size(bdev));
+	err = fill_super(s, data, flags & MS_SILENT ? 1 : 0);
+	if (err) {
+		/* next3_snapshot_kill_sb() destroys the disk */
+		deactivate_locked_super(s);
+		return err;
+	}
+	s->s_flags |= MS_ACTIVE;
+	bdev->bd_super = s;
+
+	simple_set_mnt(mnt, s);
+	return 0;
+
+out_disk:
+	next3_snapshot_disk_destroy(sdisk);
+	return err;
+out_snapshot:
+	next3_snapshot_mount_put(snapshot);
+out_live:
+	deactivate_super(live_sb);
+	return err;
+}
+
+/*
+ * next3_snapshot_kill_sb() - next3 kill_sb()
+ * Destroys the disk of a mounted snapshot after the super block is killed.
+ */
+void next3_snapshot_kill_sb(struct super_block *sb)
+{
+	struct gendisk *disk = sb->s_bdev->bd_disk;
+
+	kill_block_super(sb);
+	if (disk->fops == &next3_snapshot_disk_fops)
+		next3_snapshot_disk_destroy(disk->private_data);
+}
+
+int init_next3_snapshot_mount(void)
+{
+	next3_snapshot_major = register_blkdev(0, "next3snap");
+	if (next3_snapshot_major <= 0)
+		return -EBUSY;
+	next3_snapshot_mount_wq = create_workqueue("next3snap");
+	if (!next3_snapshot_mount_wq) {
+		unregister_blkdev(next3_snapshot_major, "next3snap");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void exit_next3_snapshot_mount(void)
+{
+	destroy_workqueue(next3_snapshot_mount_wq);
+	unregister_blkdev(next3_snapshot_major, "next3snap");
+	ida_destroy(&next3_snapshot_minors);
+}
+#endif
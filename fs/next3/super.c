@@ -48,6 +48,10 @@
 #include "acl.h"
 #include "namei.h"
 #include "snapshot.h"
+#ifdef CONFIG_NEXT3_FS_TRACE_EVENTS
+#define CREATE_TRACE_POINTS
+#include <trace/events/next3.h>
+#endif
 
 #ifdef CONFIG_NEXT3_DEFAULTS_TO_ORDERED
   #define NEXT3_MOUNT_DEFAULT_DATA_MODE NEXT3_MOUNT_ORDERED_DATA
@@ -73,6 +77,15 @@ static int next3_remount (struct super_block * sb, int * flags, char * data);
 static int next3_statfs (struct dentry * dentry, struct kstatfs * buf);
 static int next3_unfreeze(struct super_block *sb);
 static int next3_freeze(struct super_block *sb);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+static void next3_sysfs_unregister(struct super_block *sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+static void next3_free_flex_stats(struct next3_sb_info *sbi);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+static void next3_free_group_info(struct next3_sb_info *sbi);
+#endif
 
 /*
  * Wrappers for journal_start/end.
@@ -87,6 +100,9 @@ handle_t *__next3_journal_start(const char *where,
 		struct super_block *sb, int nblocks)
 {
 	next3_handle_t *handle;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	int credits;
+#endif
 #else
 handle_t *next3_journal_start_sb(struct super_block *sb, int nblocks)
 {
@@ -112,13 +128,40 @@ handle_t *next3_journal_start_sb(struct super_block *sb, int nblocks)
 	if (sizeof(next3_handle_t) != sizeof(handle_t))
 		return ERR_PTR(-EINVAL);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_ACTIVE
+	credits = NEXT3_SB_START_TRANS_BLOCKS(sb, nblocks);
+	handle = (next3_handle_t *)journal_start(journal, credits);
+	if (!IS_ERR(handle) && handle->h_ref == 1 &&
+	    credits < NEXT3_SB_START_TRANS_BLOCKS(sb, nblocks)) {
+		/*
+		 * A snapshot was taken while journal_start() waited for
+		 * journal_unlock_updates() - start over with COW credits.
+		 */
+		journal_stop((handle_t *)handle);
+		handle = (next3_handle_t *)journal_start(journal,
+				NEXT3_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+	}
+#else
 	handle = (next3_handle_t *)journal_start(journal,
 			       NEXT3_SNAPSHOT_START_TRANS_BLOCKS(nblocks));
+#endif
 	if (!IS_ERR(handle)) {
 		if (handle->h_ref == 1) {
 			handle->h_base_credits = nblocks;
 			handle->h_user_credits = nblocks;
 		}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+		/*
+		 * Refill the COW credits pool of the running transaction.
+		 * t_cow_credits is read without lock, because a wrong guess
+		 * only means an early or late refill.
+		 */
+		if (handle->h_ref == 1 && next3_snapshot_has_active(sb) &&
+		    handle->h_transaction->t_cow_credits < NEXT3_COW_POOL_LOW &&
+		    !journal_extend((handle_t *)handle, NEXT3_COW_POOL_CREDITS))
+			journal_fill_credits((handle_t *)handle,
+					     NEXT3_COW_POOL_CREDITS);
+#endif
 		next3_journal_trace(SNAP_WARN, where, handle, nblocks);
 	}
 	return (handle_t *)handle;
@@ -138,19 +181,66 @@ int __next3_journal_stop(const char *where, handle_t *handle)
 	struct super_block *sb;
 	int err;
 	int rc;
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	struct inode *inodes[JBD_HANDLE_INODES];
+	unsigned int ninodes = 0;
+#endif
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
 	next3_journal_trace(SNAP_WARN, where, handle, 0);
 
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_STATS
+	next3_journal_credits_account(where, handle);
+
 #endif
 	sb = handle->h_transaction->t_journal->j_private;
 	err = handle->h_err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	/* free the quota of moved blocks once per handle */
+	if (handle->h_ref == 1 && handle->h_dquot_moved)
+		next3_snapshot_dquot_flush(handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+	/* write the dquots changed by the handle once per handle */
+	if (handle->h_ref == 1 && handle->h_dquots_count)
+		next3_flush_dquots(handle);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	/*
+	 * Copy the inodes changed by the handle once per handle.  This goes
+	 * last, because writing dquots dirties the quota file inode.
+	 */
+	if (handle->h_ref == 1 && handle->h_inodes_count) {
+		rc = next3_flush_inodes(handle);
+		if (!err)
+			err = rc;
+		ninodes = handle->h_inodes_count;
+		memcpy(inodes, handle->h_inodes, ninodes * sizeof(*inodes));
+		handle->h_inodes_count = 0;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	/*
+	 * Submit the COW writes batched by this (and concurrent) handles.
+	 * Tasks that lock or wait on the locked COW buffers can't flush the
+	 * batch themselves, so don't leave it for the commit callback.
+	 * This goes after the inode copies, which may COW inode tables.
+	 */
+	if (handle->h_ref == 1 && NEXT3_SB(sb)->s_cow_batch_count)
+		next3_snapshot_cow_batch_flush(sb);
+#endif
 	rc = journal_stop(handle);
 
 	if (!err)
 		err = rc;
 	if (err)
 		__next3_std_error(sb, where, err);
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+	/* a final iput() may start a new handle */
+	while (ninodes)
+		iput(inodes[--ninodes]);
+#endif
 	return err;
 }
 
@@ -522,15 +612,30 @@ static void next3_put_super (struct super_block * sb)
 	struct next3_super_block *es = sbi->s_es;
 	int i, err;
 
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	/* inodes unlinked during umount */
+	next3_async_unlink_flush(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	next3_itable_stop(sb);
+#endif
 	dquot_disable(sb, -1, DQUOT_USAGE_ENABLED | DQUOT_LIMITS_ENABLED);
 
 	lock_kernel();
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	next3_sysfs_unregister(sb);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT
 	next3_snapshot_destroy(sb);
 #endif
 	next3_xattr_put_super(sb);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	/* snapshot image is mounted without a journal */
+	err = sbi->s_journal ? journal_destroy(sbi->s_journal) : 0;
+#else
 	err = journal_destroy(sbi->s_journal);
+#endif
 	sbi->s_journal = NULL;
 	if (err < 0)
 		next3_abort(sb, __func__, "Couldn't clean up the journal");
@@ -546,15 +651,32 @@ static void next3_put_super (struct super_block * sb)
 	for (i = 0; i < sbi->s_gdb_count; i++)
 		brelse(sbi->s_group_desc[i]);
 	kfree(sbi->s_group_desc);
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_free_flex_stats(sbi);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	next3_release_bitmap_pins(sb);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
-	if (is_vmalloc_addr(sbi->s_group_info))
-		vfree(sbi->s_group_info);
-	else
-		kfree(sbi->s_group_info);
+	next3_free_group_info(sbi);
 #endif
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	free_percpu(sbi->s_snapshot_stats);
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	free_percpu(sbi->s_ialloc_hints);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	kfree(sbi->s_tracked_readers);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	/* NULL if init_srcu_struct() was not reached or failed */
+	if (sbi->s_snapshot_srcu.per_cpu_ref)
+		cleanup_srcu_struct(&sbi->s_snapshot_srcu);
+#endif
 	brelse(sbi->s_sbh);
 #ifdef CONFIG_QUOTA
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -582,6 +704,9 @@ static void next3_put_super (struct super_block * sb)
 	}
 	sb->s_fs_info = NULL;
 	kfree(sbi->s_blockgroup_lock);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	kfree(sbi->s_snapshot_bgl);
+#endif
 	kfree(sbi);
 
 	unlock_kernel();
@@ -600,9 +725,33 @@ static struct inode *next3_alloc_inode(struct super_block *sb)
 	if (!ei)
 		return NULL;
 	ei->i_block_alloc_info = NULL;
+#ifdef CONFIG_NEXT3_FS_BALLOC_FREE_BATCH
+	ei->i_free_batch = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	ei->i_dx_cache = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	ei->i_xattr_names = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_DATA_DIO
+	ei->i_dio_move = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	ei->i_snapinfo = NULL;
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+	ei->i_snapinfo.i_snapgroups = NULL;
+	ei->i_snapinfo.i_snapgroups_count = 0;
+	ei->i_snapinfo.i_snapgroups_gen = 0;
+#endif
+#endif
 	ei->vfs_inode.i_version = 1;
 	atomic_set(&ei->i_datasync_tid, 0);
 	atomic_set(&ei->i_sync_tid, 0);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	journal_init_jbd_inode(&ei->jinode, &ei->vfs_inode);
+#endif
 	return &ei->vfs_inode;
 }
 
@@ -619,6 +768,53 @@ static void next3_destroy_inode(struct inode *inode)
 	kmem_cache_free(next3_inode_cachep, NEXT3_I(inode));
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+static void next3_snapmap_init(struct next3_snapmap *map)
+{
+	rwlock_init(&map->lock);
+	map->root = RB_ROOT;
+	map->count = 0;
+	map->gen = 0;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+/*
+ * next3_snapshot_info_alloc() - attach in-memory snapshot state to @inode
+ * Called for snapshot files only, on load and on create, before the inode
+ * is visible to anyone else.
+ */
+int next3_snapshot_info_alloc(struct inode *inode)
+{
+	struct next3_snapshot_info *si;
+
+	si = kzalloc(sizeof(*si), GFP_NOFS);
+	if (!si)
+		return -ENOMEM;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	next3_snapmap_init(&si->i_snapmap);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	next3_snapmap_init(&si->i_snapread);
+#endif
+#endif
+	NEXT3_I(inode)->i_snapinfo = si;
+	return 0;
+}
+
+static void next3_snapshot_info_free(struct inode *inode)
+{
+	struct next3_snapshot_info *si = NEXT3_I(inode)->i_snapinfo;
+
+	if (!si)
+		return;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+	kfree(si->i_snapgroups);
+#endif
+	kfree(si);
+	NEXT3_I(inode)->i_snapinfo = NULL;
+}
+
+#endif
 static void init_once(void *foo)
 {
 	struct next3_inode_info *ei = (struct next3_inode_info *) foo;
@@ -627,7 +823,15 @@ static void init_once(void *foo)
 #ifdef CONFIG_NEXT3_FS_XATTR
 	init_rwsem(&ei->xattr_sem);
 #endif
-	mutex_init(&ei->truncate_mutex);
+	init_rwsem(&ei->truncate_sem);
+#ifndef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	next3_snapmap_init(&ei->i_snapinfo.i_snapmap);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_CACHE
+	next3_snapmap_init(&ei->i_snapinfo.i_snapread);
+#endif
+#endif
+#endif
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -657,6 +861,30 @@ static void next3_clear_inode(struct inode *inode)
 	NEXT3_I(inode)->i_block_alloc_info = NULL;
 	if (unlikely(rsv))
 		kfree(rsv);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MAP_CACHE
+	next3_snapshot_map_invalidate(inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	next3_dx_cache_free(inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	next3_xattr_names_free(inode);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INFO
+	next3_snapshot_info_free(inode);
+#else
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_READ_SKIP
+	kfree(NEXT3_SNAP_I(inode)->i_snapgroups);
+	NEXT3_SNAP_I(inode)->i_snapgroups = NULL;
+#endif
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (NEXT3_SB(inode->i_sb)->s_journal)
+#endif
+	journal_release_jbd_inode(NEXT3_SB(inode->i_sb)->s_journal,
+				  &NEXT3_I(inode)->jinode);
+#endif
 }
 
 static inline void next3_show_quota_options(struct seq_file *seq, struct super_block *sb)
@@ -776,6 +1004,34 @@ static int next3_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_printf(seq, ",commit=%u",
 			   (unsigned) (sbi->s_commit_interval / HZ));
 	}
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	if (sbi->s_max_commit_interval) {
+		seq_printf(seq, ",commit_min=%u,commit_max=%u",
+			   (unsigned) (sbi->s_min_commit_interval / HZ),
+			   (unsigned) (sbi->s_max_commit_interval / HZ));
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	if (sbi->s_async_unlink_blocks)
+		seq_printf(seq, ",async_unlink=%u", sbi->s_async_unlink_blocks);
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	if (sbi->s_dx_cache_blocks)
+		seq_printf(seq, ",dx_cache=%u", sbi->s_dx_cache_blocks);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	if (sbi->s_bitmap_pin_groups != NEXT3_DEF_BITMAP_PIN_GROUPS)
+		seq_printf(seq, ",bitmap_pin=%u", sbi->s_bitmap_pin_groups);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	if (sbi->s_stripe)
+		seq_printf(seq, ",stripe=%lu", sbi->s_stripe);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	if (sbi->s_inode_readahead_blks != NEXT3_DEF_INODE_READAHEAD_BLKS)
+		seq_printf(seq, ",inode_readahead_blks=%u",
+			   sbi->s_inode_readahead_blks);
+#endif
 
 	/*
 	 * Always display barrier state so it's clear what the status is.
@@ -784,6 +1040,20 @@ static int next3_show_options(struct seq_file *seq, struct vfsmount *vfs)
 	seq_puts(seq, test_opt(sb, BARRIER) ? "1" : "0");
 	if (test_opt(sb, NOBH))
 		seq_puts(seq, ",nobh");
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	if (test_opt(sb, STATFS_APPROX))
+		seq_puts(seq, ",statfs_approx");
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	if (test_opt(sb, LAZYTIME))
+		seq_puts(seq, ",lazytime");
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	if (test_opt(sb, JOURNAL_ASYNC_COMMIT))
+		seq_puts(seq, ",journal_async_commit");
+	else if (test_opt(sb, JOURNAL_CHECKSUM))
+		seq_puts(seq, ",journal_checksum");
+#endif
 
 	seq_printf(seq, ",data=%s", data_mode_string(test_opt(sb, DATA_FLAGS)));
 	if (test_opt(sb, DATA_ERR_ABORT))
@@ -807,6 +1077,10 @@ static struct inode *next3_nfs_get_inode(struct super_block *sb,
 		return ERR_PTR(-ESTALE);
 	if (ino > le32_to_cpu(NEXT3_SB(sb)->s_es->s_inodes_count))
 		return ERR_PTR(-ESTALE);
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	if (next3_itable_free_inode(sb, ino))
+		return ERR_PTR(-ESTALE);
+#endif
 
 	/* iget isn't really right if the inode is currently unallocated!!
 	 *
@@ -823,6 +1097,13 @@ static struct inode *next3_nfs_get_inode(struct super_block *sb,
 		iput(inode);
 		return ERR_PTR(-ESTALE);
 	}
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	/* a deleted orphan, which the unlink work didn't free yet */
+	if (next3_test_inode_state(inode, NEXT3_STATE_ORPHAN_PENDING)) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+#endif
 
 	return inode;
 }
@@ -938,7 +1219,37 @@ enum {
 	Opt_usrjquota, Opt_grpjquota, Opt_offusrjquota, Opt_offgrpjquota,
 	Opt_jqfmt_vfsold, Opt_jqfmt_vfsv0, Opt_jqfmt_vfsv1, Opt_quota,
 	Opt_noquota, Opt_ignore, Opt_barrier, Opt_nobarrier, Opt_err,
-	Opt_resize, Opt_usrquota, Opt_grpquota
+	Opt_resize, Opt_usrquota, Opt_grpquota,
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	Opt_commit_min, Opt_commit_max,
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	Opt_async_unlink,
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	Opt_dx_cache,
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	Opt_bitmap_pin,
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	Opt_stripe,
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	Opt_inode_readahead_blks,
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	Opt_snapshot,
+#endif
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	Opt_statfs_approx, Opt_nostatfs_approx,
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	Opt_lazytime, Opt_nolazytime,
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	Opt_journal_checksum, Opt_journal_async_commit,
+#endif
 };
 
 static const match_table_t tokens = {
@@ -970,7 +1281,41 @@ static const match_table_t tokens = {
 	{Opt_noload, "norecovery"},
 	{Opt_nobh, "nobh"},
 	{Opt_bh, "bh"},
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	{Opt_statfs_approx, "statfs_approx"},
+	{Opt_nostatfs_approx, "nostatfs_approx"},
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	{Opt_journal_checksum, "journal_checksum"},
+	{Opt_journal_async_commit, "journal_async_commit"},
+#endif
 	{Opt_commit, "commit=%u"},
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	{Opt_commit_min, "commit_min=%u"},
+	{Opt_commit_max, "commit_max=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	{Opt_async_unlink, "async_unlink=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	{Opt_dx_cache, "dx_cache=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	{Opt_bitmap_pin, "bitmap_pin=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	{Opt_stripe, "stripe=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	{Opt_inode_readahead_blks, "inode_readahead_blks=%u"},
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	{Opt_snapshot, "snapshot=%u"},
+#endif
 	{Opt_journal_update, "journal=update"},
 	{Opt_journal_inum, "journal=%u"},
 	{Opt_journal_dev, "journal_dev=%u"},
@@ -1238,6 +1583,80 @@ static int parse_options (char *options, struct super_block *sb,
 				option = JBD_DEFAULT_MAX_COMMIT_AGE;
 			sbi->s_commit_interval = HZ * option;
 			break;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+		case Opt_commit_min:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_min_commit_interval = HZ * option;
+			break;
+		case Opt_commit_max:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			/* commit_max=0 turns the adaptive interval off */
+			sbi->s_max_commit_interval = HZ * option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+		case Opt_async_unlink:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_async_unlink_blocks = option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+		case Opt_dx_cache:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_dx_cache_blocks = option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+		case Opt_bitmap_pin:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_bitmap_pin_groups = option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+		case Opt_stripe:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_stripe = option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+		case Opt_inode_readahead_blks:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0 ||
+			    option > NEXT3_MAX_INODE_READAHEAD_BLKS ||
+			    (option && !is_power_of_2(option))) {
+				next3_msg(sb, KERN_ERR,
+					"error: inode_readahead_blks must be "
+					"0 or a power of 2 no larger than %d",
+					NEXT3_MAX_INODE_READAHEAD_BLKS);
+				return 0;
+			}
+			sbi->s_inode_readahead_blks = option;
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+		case Opt_snapshot:
+			/* handled by next3_get_sb() */
+			break;
+#endif
 		case Opt_data_journal:
 			data_opt = NEXT3_MOUNT_JOURNAL_DATA;
 			goto datacheck;
@@ -1381,6 +1800,42 @@ set_qf_format:
 		case Opt_bh:
 			clear_opt(sbi->s_mount_opt, NOBH);
 			break;
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+		case Opt_statfs_approx:
+			set_opt(sbi->s_mount_opt, STATFS_APPROX);
+			break;
+		case Opt_nostatfs_approx:
+			clear_opt(sbi->s_mount_opt, STATFS_APPROX);
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_LAZY_TIME
+		case Opt_lazytime:
+			set_opt(sbi->s_mount_opt, LAZYTIME);
+			break;
+		case Opt_nolazytime:
+			clear_opt(sbi->s_mount_opt, LAZYTIME);
+			break;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+		/* journal features are only set on mount */
+		case Opt_journal_checksum:
+			if (is_remount && !test_opt(sb, JOURNAL_CHECKSUM)) {
+				next3_msg(sb, KERN_ERR, "error: cannot enable "
+					"journal_checksum on remount");
+				return 0;
+			}
+			set_opt(sbi->s_mount_opt, JOURNAL_CHECKSUM);
+			break;
+		case Opt_journal_async_commit:
+			if (is_remount && !test_opt(sb, JOURNAL_ASYNC_COMMIT)) {
+				next3_msg(sb, KERN_ERR, "error: cannot enable "
+					"journal_async_commit on remount");
+				return 0;
+			}
+			set_opt(sbi->s_mount_opt, JOURNAL_ASYNC_COMMIT);
+			set_opt(sbi->s_mount_opt, JOURNAL_CHECKSUM);
+			break;
+#endif
 		default:
 			next3_msg(sb, KERN_ERR,
 				"error: unrecognized mount option \"%s\" "
@@ -1476,6 +1931,12 @@ static int next3_setup_super(struct super_block *sb, struct next3_super_block *e
 			NEXT3_INODES_PER_GROUP(sb),
 			sbi->s_mount_opt);
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (!NEXT3_SB(sb)->s_journal) {
+		next3_msg(sb, KERN_INFO, "mounting snapshot image "
+			  "without journal");
+	} else
+#endif
 	if (NEXT3_SB(sb)->s_journal->j_inode == NULL) {
 		char b[BDEVNAME_SIZE];
 		next3_msg(sb, KERN_INFO, "using external journal on %s",
@@ -1491,6 +1952,10 @@ static int next3_check_descriptors(struct super_block *sb)
 {
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	int i;
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	next3_fsblk_t free_blocks = 0;
+	unsigned long free_inodes = 0, dirs = 0;
+#endif
 
 	next3_debug ("Checking group descriptors");
 
@@ -1499,6 +1964,14 @@ static int next3_check_descriptors(struct super_block *sb)
 		next3_fsblk_t first_block = next3_group_first_block_no(sb, i);
 		next3_fsblk_t last_block;
 
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+		/* with flex_bg, group metadata may be anywhere in the fs */
+		if (NEXT3_HAS_INCOMPAT_FEATURE(sb,
+					NEXT3_FEATURE_INCOMPAT_FLEX_BG)) {
+			first_block = le32_to_cpu(sbi->s_es->s_first_data_block);
+			last_block = le32_to_cpu(sbi->s_es->s_blocks_count) - 1;
+		} else
+#endif
 		if (i == sbi->s_groups_count - 1)
 			last_block = le32_to_cpu(sbi->s_es->s_blocks_count) - 1;
 		else
@@ -1536,13 +2009,183 @@ static int next3_check_descriptors(struct super_block *sb)
 					le32_to_cpu(gdp->bg_inode_table));
 			return 0;
 		}
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+		free_blocks += le16_to_cpu(gdp->bg_free_blocks_count);
+		free_inodes += le16_to_cpu(gdp->bg_free_inodes_count);
+		dirs += le16_to_cpu(gdp->bg_used_dirs_count);
+#endif
 	}
 
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	/* totals of the validated descriptors are used to init the counters */
+	sbi->s_es->s_free_blocks_count = cpu_to_le32(free_blocks);
+	sbi->s_es->s_free_inodes_count = cpu_to_le32(free_inodes);
+	sbi->s_dirs_count = dirs;
+#else
 	sbi->s_es->s_free_blocks_count=cpu_to_le32(next3_count_free_blocks(sb));
 	sbi->s_es->s_free_inodes_count=cpu_to_le32(next3_count_free_inodes(sb));
+#endif
 	return 1;
 }
 
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+/*
+ * Called at mount-time, after the descriptors were checked.  Without
+ * memory for the flex stats, the allocators scan the group descriptors.
+ */
+static void next3_fill_flex_stats(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	unsigned long ngroups = sbi->s_groups_count;
+	unsigned long max_groups, flex_count, i;
+	unsigned int log = ilog2(NEXT3_FLEX_MIN_SIZE);
+	struct next3_flex_stats *flex_stats;
+	size_t size;
+
+	if (ngroups < NEXT3_FLEX_MIN_GROUPS)
+		return;
+#ifdef CONFIG_NEXT3_FS_FLEX_BG
+	/* keep the groups of a packed flex group in one range */
+	if (NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_FLEX_BG) &&
+	    sbi->s_es->s_log_groups_per_flex > log &&
+	    sbi->s_es->s_log_groups_per_flex < 32)
+		log = sbi->s_es->s_log_groups_per_flex;
+#endif
+	while (((ngroups - 1) >> log) >= NEXT3_FLEX_MAX_COUNT)
+		log++;
+	/* We allocate both existing and potentially added groups */
+	max_groups = (sbi->s_gdb_count +
+		le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks)) <<
+		NEXT3_DESC_PER_BLOCK_BITS(sb);
+	flex_count = ((max_groups - 1) >> log) + 1;
+	size = flex_count * sizeof(struct next3_flex_stats);
+	flex_stats = kzalloc(size, GFP_KERNEL);
+	if (flex_stats == NULL) {
+		flex_stats = vmalloc(size);
+		if (flex_stats)
+			memset(flex_stats, 0, size);
+	}
+	if (flex_stats == NULL) {
+		next3_msg(sb, KERN_WARNING,
+			"warning: not enough memory for %lu flex groups",
+			flex_count);
+		return;
+	}
+	sbi->s_log_groups_per_flex = log;
+	sbi->s_flex_stats = flex_stats;
+	for (i = 0; i < ngroups; i++) {
+		struct next3_group_desc *gdp = next3_get_group_desc(sb, i, NULL);
+
+		next3_flex_stats_add(sb, i,
+				     le16_to_cpu(gdp->bg_free_inodes_count),
+				     le16_to_cpu(gdp->bg_free_blocks_count),
+				     le16_to_cpu(gdp->bg_used_dirs_count));
+	}
+}
+
+static void next3_free_flex_stats(struct next3_sb_info *sbi)
+{
+	if (is_vmalloc_addr(sbi->s_flex_stats))
+		vfree(sbi->s_flex_stats);
+	else
+		kfree(sbi->s_flex_stats);
+	sbi->s_flex_stats = NULL;
+}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INTERLEAVE
+
+/*
+ * Allocate the group info array from zeroed pages, which are spread round
+ * robin on the online nodes and mapped contiguously with vmap(), so group
+ * info is still indexed by group number.  Returns NULL on a single node
+ * machine, for an array that fits in one page or on allocation failure, and
+ * the caller falls back to a plain allocation.
+ */
+static void *next3_alloc_group_info_interleaved(struct next3_sb_info *sbi,
+						size_t size)
+{
+	unsigned int i, npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	struct page **pages;
+	void *addr = NULL;
+	int node;
+
+	if (nr_online_nodes < 2 || npages < 2)
+		return NULL;
+
+	pages = kcalloc(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+
+	node = numa_node_id();
+	for (i = 0; i < npages; i++) {
+		pages[i] = alloc_pages_node(node, GFP_KERNEL|__GFP_ZERO, 0);
+		if (!pages[i])
+			goto out;
+		node = next_online_node(node);
+		if (node == MAX_NUMNODES)
+			node = first_online_node;
+	}
+
+	addr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+out:
+	if (!addr) {
+		while (i--)
+			__free_page(pages[i]);
+		kfree(pages);
+		return NULL;
+	}
+	sbi->s_group_info_pages = pages;
+	sbi->s_group_info_npages = npages;
+	return addr;
+}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+
+static void next3_free_group_info(struct next3_sb_info *sbi)
+{
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INTERLEAVE
+	unsigned int i;
+
+	if (sbi->s_group_info_npages) {
+		vunmap(sbi->s_group_info);
+		for (i = 0; i < sbi->s_group_info_npages; i++)
+			__free_page(sbi->s_group_info_pages[i]);
+		kfree(sbi->s_group_info_pages);
+		sbi->s_group_info_pages = NULL;
+		sbi->s_group_info_npages = 0;
+	} else if (is_vmalloc_addr(sbi->s_group_info))
+		vfree(sbi->s_group_info);
+	else
+		kfree(sbi->s_group_info);
+#else
+	if (is_vmalloc_addr(sbi->s_group_info))
+		vfree(sbi->s_group_info);
+	else
+		kfree(sbi->s_group_info);
+#endif
+	sbi->s_group_info = NULL;
+}
+#endif
+
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+/*
+ * Deleted orphans are unreachable, so they can be deleted in the
+ * background after mount, unless the cleanup runs on a read-only mount
+ * or has to update journaled quota, which is only on during cleanup.
+ */
+static int next3_orphan_async_ok(struct super_block *sb,
+				 unsigned int s_flags)
+{
+#ifdef CONFIG_QUOTA
+	int i;
+
+	for (i = 0; i < MAXQUOTAS; i++)
+		if (NEXT3_SB(sb)->s_qf_names[i])
+			return 0;
+#endif
+	return !(s_flags & MS_RDONLY);
+}
+#endif
 
 /* next3_orphan_cleanup() walks a singly-linked list of inodes (starting at
  * the superblock) which were deleted from all directories, but held open by
@@ -1560,12 +2203,27 @@ static int next3_check_descriptors(struct super_block *sb)
  * next3_free_inode().  The only reason we would point at a wrong inode is if
  * e2fsck was run on this filesystem, and it must have already done the orphan
  * inode cleanup for us, so we can safely abort without any further action.
+ *
+ * With asynchronous orphan delete, the deleted orphans can't be popped off
+ * the head of the orphan list with iput(), so we walk the chain instead.
+ * The in-memory list is kept in chain order, which is what
+ * next3_orphan_del() expects when it unlinks an orphan from the middle of
+ * the chain.  The deleted orphans are queued on the unlink work after the
+ * walk, and the other orphans are processed as they are found.
  */
 static void next3_orphan_cleanup (struct super_block * sb,
 				 struct next3_super_block * es)
 {
 	unsigned int s_flags = sb->s_flags;
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	int nr_orphans = 0, nr_truncates = 0, nr_async = 0;
+	struct inode *last = NULL;
+	LIST_HEAD(async_list);
+	unsigned long ino;
+	int async;
+#else
 	int nr_orphans = 0, nr_truncates = 0;
+#endif
 #ifdef CONFIG_QUOTA
 	int i;
 #endif
@@ -1589,6 +2247,9 @@ static void next3_orphan_cleanup (struct super_block * sb,
 		return;
 	}
 
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	async = next3_orphan_async_ok(sb, s_flags);
+#endif
 	if (s_flags & MS_RDONLY) {
 		next3_msg(sb, KERN_INFO, "orphan cleanup on readonly fs");
 		sb->s_flags &= ~MS_RDONLY;
@@ -1608,6 +2269,42 @@ static void next3_orphan_cleanup (struct super_block * sb,
 	}
 #endif
 
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	ino = le32_to_cpu(es->s_last_orphan);
+	while (ino) {
+		struct inode *inode;
+
+		inode = next3_orphan_get(sb, ino);
+		if (!IS_ERR(inode) && !list_empty(&NEXT3_I(inode)->i_orphan)) {
+			/* a loop in the chain - we already hold this one */
+			iput(inode);
+			inode = ERR_PTR(-EIO);
+		}
+		if (IS_ERR(inode)) {
+			/* end the chain after the orphans we hold */
+			if (last)
+				NEXT_ORPHAN(last) = 0;
+			else
+				es->s_last_orphan = 0;
+			break;
+		}
+		ino = NEXT_ORPHAN(inode);
+
+		list_add_tail(&NEXT3_I(inode)->i_orphan,
+			      &NEXT3_SB(sb)->s_orphan);
+		dquot_initialize(inode);
+		if (async && !inode->i_nlink &&
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+		    !next3_snapshot_file(inode) &&
+#endif
+		    !next3_async_orphan_add(&async_list, inode)) {
+			next3_set_inode_state(inode,
+					      NEXT3_STATE_ORPHAN_PENDING);
+			last = inode;
+			nr_async++;
+			continue;
+		}
+#else
 	while (es->s_last_orphan) {
 		struct inode *inode;
 
@@ -1619,6 +2316,7 @@ static void next3_orphan_cleanup (struct super_block * sb,
 
 		list_add(&NEXT3_I(inode)->i_orphan, &NEXT3_SB(sb)->s_orphan);
 		dquot_initialize(inode);
+#endif
 		if (inode->i_nlink) {
 			printk(KERN_DEBUG
 				"%s: truncating inode %lu to %Ld bytes\n",
@@ -1646,6 +2344,12 @@ static void next3_orphan_cleanup (struct super_block * sb,
 	if (nr_truncates)
 		next3_msg(sb, KERN_INFO, "%d truncate%s cleaned up",
 		       PLURAL(nr_truncates));
+#ifdef CONFIG_NEXT3_FS_ORPHAN_ASYNC
+	if (nr_async)
+		next3_msg(sb, KERN_INFO, "%d orphan inode%s queued for delete",
+		       PLURAL(nr_async));
+	next3_async_orphans_queue(sb, &async_list);
+#endif
 #ifdef CONFIG_QUOTA
 	/* Turn quotas off */
 	for (i = 0; i < MAXQUOTAS; i++) {
@@ -1707,36 +2411,350 @@ static loff_t next3_max_size(int bits)
 #else
 	res += 1LL << (3*(bits-2));
 #endif
-	res <<= bits;
-	if (res > upper_limit)
-		res = upper_limit;
+	res <<= bits;
+	if (res > upper_limit)
+		res = upper_limit;
+
+	if (res > MAX_LFS_FILESIZE)
+		res = MAX_LFS_FILESIZE;
+
+	return res;
+}
+
+static next3_fsblk_t descriptor_loc(struct super_block *sb,
+				    next3_fsblk_t logic_sb_block,
+				    int nr)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	unsigned long bg, first_meta_bg;
+	int has_super = 0;
+
+	first_meta_bg = le32_to_cpu(sbi->s_es->s_first_meta_bg);
+
+	if (!NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_META_BG) ||
+	    nr < first_meta_bg)
+		return (logic_sb_block + nr + 1);
+	bg = sbi->s_desc_per_block * nr;
+	if (next3_bg_has_super(sb, bg))
+		has_super = 1;
+	return (has_super + next3_group_first_block_no(sb, bg));
+}
+
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+/*
+ * Next3 sysfs entries: /sys/fs/next3/<dev>/
+ */
+static struct kset *next3_kset;
+
+struct next3_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct next3_attr *, struct next3_sb_info *, char *);
+	ssize_t (*store)(struct next3_attr *, struct next3_sb_info *,
+			 const char *, size_t);
+	int offset;
+};
+
+static ssize_t snapshot_stats_show(struct next3_attr *a,
+				   struct next3_sb_info *sbi, char *buf)
+{
+	struct next3_snapshot_stats sum;
+	int cpu;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct next3_snapshot_stats *stats =
+			per_cpu_ptr(sbi->s_snapshot_stats, cpu);
+
+		sum.moved += stats->moved;
+		sum.copied += stats->copied;
+		sum.ok_jh += stats->ok_jh;
+		sum.ok_bitmap += stats->ok_bitmap;
+		sum.ok_mapped += stats->ok_mapped;
+		sum.bitmaps += stats->bitmaps;
+		sum.excluded += stats->excluded;
+		sum.bitmap_miss += stats->bitmap_miss;
+		sum.pending_cow_wait += stats->pending_cow_wait;
+		sum.tracked_read_wait += stats->tracked_read_wait;
+		sum.read_bdev_cache += stats->read_bdev_cache;
+		sum.cow_set_hit += stats->cow_set_hit;
+	}
+
+	return snprintf(buf, PAGE_SIZE,
+			"copied: %lu\n"
+			"moved: %lu\n"
+			"cow_cache_hit: %lu\n"
+			"cow_bitmap_clear: %lu\n"
+			"cow_mapped: %lu\n"
+			"cow_bitmap_miss: %lu\n"
+			"cow_bitmap_created: %lu\n"
+			"excluded: %lu\n"
+			"pending_cow_wait: %lu\n"
+			"tracked_read_wait: %lu\n"
+			"read_bdev_cache: %lu\n"
+			"cow_set_hit: %lu\n",
+			sum.copied, sum.moved, sum.ok_jh, sum.ok_bitmap,
+			sum.ok_mapped, sum.bitmap_miss, sum.bitmaps,
+			sum.excluded, sum.pending_cow_wait,
+			sum.tracked_read_wait, sum.read_bdev_cache,
+			sum.cow_set_hit);
+}
+
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+static const char *snapshot_phase_names[SNAPSHOT_PHASES_NUM] = {
+	[SNAPSHOT_PHASE_TAKE]		= "take",
+	[SNAPSHOT_PHASE_TAKE_FREEZE]	= "take_freeze",
+	[SNAPSHOT_PHASE_TAKE_SUPER]	= "take_super",
+	[SNAPSHOT_PHASE_TAKE_GDT]	= "take_gdt",
+	[SNAPSHOT_PHASE_TAKE_INODES]	= "take_inodes",
+	[SNAPSHOT_PHASE_TAKE_BITMAP]	= "take_bitmap",
+	[SNAPSHOT_PHASE_TAKE_UNFREEZE]	= "take_unfreeze",
+	[SNAPSHOT_PHASE_REMOVE]		= "remove",
+	[SNAPSHOT_PHASE_SHRINK]		= "shrink",
+	[SNAPSHOT_PHASE_MERGE]		= "merge",
+};
+
+/*
+ * One line per phase:
+ * <phase> <count> <total usec> <max usec> <log2 usec histogram slots...>
+ */
+static ssize_t snapshot_phase_stats_show(struct next3_attr *a,
+					 struct next3_sb_info *sbi, char *buf)
+{
+	ssize_t len = 0;
+	int i, j;
+
+	for (i = 0; i < SNAPSHOT_PHASES_NUM; i++) {
+		struct next3_snapshot_phase_stats *ps =
+			&sbi->s_snapshot_phase[i];
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %lu %llu %llu",
+				 snapshot_phase_names[i], ps->count,
+				 (unsigned long long)ps->total_us,
+				 (unsigned long long)ps->max_us);
+		for (j = 0; j < SNAPSHOT_PHASE_SLOTS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %lu",
+					 ps->slots[j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	return len;
+}
+
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
+/*
+ * Offset of the COW tid in journal_head or 0 if the COW cache is disabled
+ */
+static ssize_t snapshot_cow_cache_show(struct next3_attr *a,
+				       struct next3_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n",
+			next3_snapshot_cow_cache_enabled());
+}
+
+#endif
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE) || \
+	defined(CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO)
+static ssize_t sbi_ui_show(struct next3_attr *a,
+			   struct next3_sb_info *sbi, char *buf)
+{
+	unsigned int *ui = (unsigned int *) (((char *) sbi) + a->offset);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", *ui);
+}
+
+static ssize_t sbi_ui_store(struct next3_attr *a,
+			    struct next3_sb_info *sbi,
+			    const char *buf, size_t count)
+{
+	unsigned int *ui = (unsigned int *) (((char *) sbi) + a->offset);
+	char *end;
+	unsigned long t;
+
+	t = simple_strtoul(skip_spaces(buf), &end, 0);
+	if (end == buf || t > UINT_MAX)
+		return -EINVAL;
+	*ui = t;
+	return count;
+}
+
+#endif
+#define NEXT3_ATTR_OFFSET(_name, _mode, _show, _store, _elname)	\
+static struct next3_attr next3_attr_##_name = {			\
+	.attr = {.name = __stringify(_name), .mode = _mode },		\
+	.show	= _show,						\
+	.store	= _store,						\
+	.offset = offsetof(struct next3_sb_info, _elname),		\
+}
+#define NEXT3_ATTR(name, mode, show, store) \
+static struct next3_attr next3_attr_##name = __ATTR(name, mode, show, store)
+
+#define NEXT3_RO_ATTR(name) NEXT3_ATTR(name, 0444, name##_show, NULL)
+#define NEXT3_RW_ATTR_SBI_UI(name, elname)	\
+	NEXT3_ATTR_OFFSET(name, 0644, sbi_ui_show, sbi_ui_store, elname)
+#define ATTR_LIST(name) &next3_attr_##name.attr
+
+NEXT3_RO_ATTR(snapshot_stats);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+NEXT3_RO_ATTR(snapshot_phase_stats);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
+NEXT3_RO_ATTR(snapshot_cow_cache);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+NEXT3_RW_ATTR_SBI_UI(snapshot_cleanup_groups, s_cleanup_groups);
+NEXT3_RW_ATTR_SBI_UI(snapshot_cleanup_delay_ms, s_cleanup_delay_ms);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+NEXT3_RW_ATTR_SBI_UI(snapshot_enospc_reclaim, s_snapshot_enospc_reclaim);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+NEXT3_RW_ATTR_SBI_UI(snapshot_reserve_adaptive, s_snapshot_reserve_adaptive);
+NEXT3_RW_ATTR_SBI_UI(snapshot_reserve_hours, s_snapshot_reserve_hours);
+NEXT3_RW_ATTR_SBI_UI(snapshot_reserve_interval, s_snapshot_reserve_interval);
+NEXT3_ATTR_OFFSET(snapshot_cow_rate, 0444, sbi_ui_show, NULL,
+		  s_snapshot_cow_rate);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+NEXT3_RW_ATTR_SBI_UI(snapshot_io_class, s_snapshot_io_class);
+NEXT3_RW_ATTR_SBI_UI(snapshot_io_level, s_snapshot_io_level);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+NEXT3_RW_ATTR_SBI_UI(snapshot_read_io_class, s_snapshot_read_io_class);
+NEXT3_RW_ATTR_SBI_UI(snapshot_read_io_level, s_snapshot_read_io_level);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+NEXT3_RW_ATTR_SBI_UI(snapshot_read_drop, s_snapshot_read_drop);
+#endif
+
+static struct attribute *next3_attrs[] = {
+	ATTR_LIST(snapshot_stats),
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_TIMING
+	ATTR_LIST(snapshot_phase_stats),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE
+	ATTR_LIST(snapshot_cow_cache),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_ASYNC
+	ATTR_LIST(snapshot_cleanup_groups),
+	ATTR_LIST(snapshot_cleanup_delay_ms),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CLEANUP_RECLAIM
+	ATTR_LIST(snapshot_enospc_reclaim),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE_ADAPTIVE
+	ATTR_LIST(snapshot_reserve_adaptive),
+	ATTR_LIST(snapshot_reserve_hours),
+	ATTR_LIST(snapshot_reserve_interval),
+	ATTR_LIST(snapshot_cow_rate),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_IOPRIO
+	ATTR_LIST(snapshot_io_class),
+	ATTR_LIST(snapshot_io_level),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_READ_IOPRIO
+	ATTR_LIST(snapshot_read_io_class),
+	ATTR_LIST(snapshot_read_io_level),
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_READ_STATS
+	ATTR_LIST(snapshot_read_drop),
+#endif
+	NULL,
+};
 
-	if (res > MAX_LFS_FILESIZE)
-		res = MAX_LFS_FILESIZE;
+static ssize_t next3_attr_show(struct kobject *kobj,
+			       struct attribute *attr, char *buf)
+{
+	struct next3_sb_info *sbi = container_of(kobj, struct next3_sb_info,
+						s_kobj);
+	struct next3_attr *a = container_of(attr, struct next3_attr, attr);
 
-	return res;
+	return a->show ? a->show(a, sbi, buf) : 0;
 }
 
-static next3_fsblk_t descriptor_loc(struct super_block *sb,
-				    next3_fsblk_t logic_sb_block,
-				    int nr)
+static ssize_t next3_attr_store(struct kobject *kobj,
+				struct attribute *attr,
+				const char *buf, size_t len)
+{
+	struct next3_sb_info *sbi = container_of(kobj, struct next3_sb_info,
+						s_kobj);
+	struct next3_attr *a = container_of(attr, struct next3_attr, attr);
+
+	return a->store ? a->store(a, sbi, buf, len) : 0;
+}
+
+static void next3_sb_release(struct kobject *kobj)
+{
+	struct next3_sb_info *sbi = container_of(kobj, struct next3_sb_info,
+						s_kobj);
+	complete(&sbi->s_kobj_unregister);
+}
+
+static const struct sysfs_ops next3_attr_ops = {
+	.show	= next3_attr_show,
+	.store	= next3_attr_store,
+};
+
+static struct kobj_type next3_ktype = {
+	.default_attrs	= next3_attrs,
+	.sysfs_ops	= &next3_attr_ops,
+	.release	= next3_sb_release,
+};
+
+static int next3_sysfs_register(struct super_block *sb)
 {
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
-	unsigned long bg, first_meta_bg;
-	int has_super = 0;
+	int err;
 
-	first_meta_bg = le32_to_cpu(sbi->s_es->s_first_meta_bg);
+	sbi->s_kobj.kset = next3_kset;
+	init_completion(&sbi->s_kobj_unregister);
+	err = kobject_init_and_add(&sbi->s_kobj, &next3_ktype, NULL,
+				   "%s", sb->s_id);
+	if (err)
+		kobject_put(&sbi->s_kobj);
+	return err;
+}
 
-	if (!NEXT3_HAS_INCOMPAT_FEATURE(sb, NEXT3_FEATURE_INCOMPAT_META_BG) ||
-	    nr < first_meta_bg)
-		return (logic_sb_block + nr + 1);
-	bg = sbi->s_desc_per_block * nr;
-	if (next3_bg_has_super(sb, bg))
-		has_super = 1;
-	return (has_super + next3_group_first_block_no(sb, bg));
+static void next3_sysfs_unregister(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+
+	if (!sbi->s_kobj.state_in_sysfs)
+		return;
+	kobject_del(&sbi->s_kobj);
+	kobject_put(&sbi->s_kobj);
+	wait_for_completion(&sbi->s_kobj_unregister);
 }
 
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+/*
+ * next3_get_stripe_size() returns the RAID stripe size in blocks to align
+ * allocations to.  The stripe=n mount option takes precedence over the
+ * stripe width and the stride that mke2fs stored in the super block.
+ * A stripe larger than a block group cannot be honored and one block
+ * stripes need no alignment, so 0 is returned in these cases.
+ */
+static unsigned long next3_get_stripe_size(struct next3_sb_info *sbi,
+		unsigned long stripe)
+{
+	unsigned long stride = le16_to_cpu(sbi->s_es->s_raid_stride);
+	unsigned long stripe_width =
+		le32_to_cpu(sbi->s_es->s_raid_stripe_width);
+
+	if (!stripe) {
+		if (stripe_width && stripe_width <= sbi->s_blocks_per_group)
+			stripe = stripe_width;
+		else if (stride && stride <= sbi->s_blocks_per_group)
+			stripe = stride;
+	}
+	if (stripe <= 1 || stripe > sbi->s_blocks_per_group)
+		return 0;
+	return stripe;
+}
 
+#endif
 static int next3_fill_super (struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head * bh;
@@ -1773,11 +2791,28 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 		kfree(sbi);
 		return -ENOMEM;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	sbi->s_snapshot_bgl =
+		kzalloc(sizeof(struct blockgroup_lock), GFP_KERNEL);
+	if (!sbi->s_snapshot_bgl) {
+		kfree(sbi->s_blockgroup_lock);
+		kfree(sbi);
+		return -ENOMEM;
+	}
+#endif
 	sb->s_fs_info = sbi;
 	sbi->s_mount_opt = 0;
 	sbi->s_resuid = NEXT3_DEF_RESUID;
 	sbi->s_resgid = NEXT3_DEF_RESGID;
 	sbi->s_sb_block = sb_block;
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	sbi->s_bitmap_pin_groups = NEXT3_DEF_BITMAP_PIN_GROUPS;
+	spin_lock_init(&sbi->s_bitmap_pin_lock);
+	INIT_LIST_HEAD(&sbi->s_bitmap_pins);
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	sbi->s_inode_readahead_blks = NEXT3_DEF_INODE_READAHEAD_BLKS;
+#endif
 
 	unlock_kernel();
 
@@ -1873,7 +2908,13 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 			"optional features (%x)", le32_to_cpu(features));
 		goto failed_mount;
 	}
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	features = NEXT3_HAS_RO_COMPAT_FEATURE(sb,
+			~(NEXT3_FEATURE_RO_COMPAT_SUPP|
+			  NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT));
+#else
 	features = NEXT3_HAS_RO_COMPAT_FEATURE(sb, ~NEXT3_FEATURE_RO_COMPAT_SUPP);
+#endif
 	if (!(sb->s_flags & MS_RDONLY) && features) {
 		next3_msg(sb, KERN_ERR,
 			"error: couldn't mount RDWR because of unsupported "
@@ -1987,6 +3028,10 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	sbi->s_blocks_per_group = le32_to_cpu(es->s_blocks_per_group);
 	sbi->s_frags_per_group = le32_to_cpu(es->s_frags_per_group);
 	sbi->s_inodes_per_group = le32_to_cpu(es->s_inodes_per_group);
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	/* stripe=0 keeps the stripe from the super block */
+	sbi->s_stripe = next3_get_stripe_size(sbi, sbi->s_stripe);
+#endif
 	if (NEXT3_INODE_SIZE(sb) == 0 || NEXT3_INODES_PER_GROUP(sb) == 0)
 		goto cantfind_next3;
 	sbi->s_inodes_per_block = blocksize / NEXT3_INODE_SIZE(sb);
@@ -2059,7 +3104,17 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	}
 
 	bgl_lock_init(sbi->s_blockgroup_lock);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	/* not bgl_lock_init(), to get a lock class of its own for lockstat */
+	for (i = 0; i < NR_BG_LOCKS; i++)
+		spin_lock_init(&sbi->s_snapshot_bgl->locks[i].lock);
+#endif
 
+#ifdef CONFIG_NEXT3_FS_FAST_MOUNT
+	/* submit all group descriptor reads before waiting for the first */
+	for (i = 0; i < db_count; i++)
+		sb_breadahead(sb, descriptor_loc(sb, logic_sb_block, i));
+#endif
 	for (i = 0; i < db_count; i++) {
 		block = descriptor_loc(sb, logic_sb_block, i);
 		sbi->s_group_desc[i] = sb_bread(sb, block);
@@ -2080,7 +3135,13 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	max_groups = (db_count + le16_to_cpu(es->s_reserved_gdt_blocks)) <<
 		NEXT3_DESC_PER_BLOCK_BITS(sb);
 	size = max_groups * sizeof(struct next3_group_info);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE_INTERLEAVE
+	sbi->s_group_info = next3_alloc_group_info_interleaved(sbi, size);
+	if (sbi->s_group_info == NULL)
+		sbi->s_group_info = kzalloc(size, GFP_KERNEL);
+#else
 	sbi->s_group_info = kzalloc(size, GFP_KERNEL);
+#endif
 	if (sbi->s_group_info == NULL) {
 		sbi->s_group_info = vmalloc(size);
 		if (sbi->s_group_info)
@@ -2093,11 +3154,43 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	}
 #endif
 	sbi->s_gdb_count = db_count;
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_fill_flex_stats(sb);
+#endif
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	next3_async_unlink_init(sb);
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	next3_itable_init(sb);
+#endif
 
+#ifndef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
 	/* per fileystem reservation list head & lock */
 	spin_lock_init(&sbi->s_rsv_window_lock);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_COW_SET
+	spin_lock_init(&sbi->s_cow_set_lock);
+	/* start with no valid entries */
+	for (i = 0; i < NEXT3_COW_SET_SIZE; i++)
+		sbi->s_cow_set[i].block = ~0UL;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_RSV_TREES
+	/* per block group range reservation trees, each with a dummy head */
+	for (i = 0; i < NEXT3_RSV_TREES; i++) {
+		struct next3_rsv_tree *tree = &sbi->s_rsv_trees[i];
+
+		spin_lock_init(&tree->lock);
+		tree->root = RB_ROOT;
+		tree->head.rsv_start = NEXT3_RESERVE_WINDOW_NOT_ALLOCATED;
+		tree->head.rsv_end = NEXT3_RESERVE_WINDOW_NOT_ALLOCATED;
+		tree->head.rsv_alloc_hit = 0;
+		tree->head.rsv_goal_size = 0;
+		rb_link_node(&tree->head.rsv_node, NULL, &tree->root.rb_node);
+		rb_insert_color(&tree->head.rsv_node, &tree->root);
+	}
+#else
 	sbi->s_rsv_window_root = RB_ROOT;
 	/* Add a single, static dummy reservation to the start of the
 	 * reservation window list --- it gives us a placeholder for
@@ -2108,6 +3201,7 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	sbi->s_rsv_window_head.rsv_alloc_hit = 0;
 	sbi->s_rsv_window_head.rsv_goal_size = 0;
 	next3_rsv_window_add(sb, &sbi->s_rsv_window_head);
+#endif
 
 	/*
 	 * set up enough so that it can read an inode
@@ -2131,6 +3225,18 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST
 	INIT_LIST_HEAD(&sbi->s_snapshot_list); /* snapshot files */
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_INDEX
+	INIT_RADIX_TREE(&sbi->s_snapshot_index, GFP_NOFS);
+	sbi->s_snapshot_count = 0;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_DIRECT_IO
+	spin_lock_init(&sbi->s_snapshot_dio_lock);
+	INIT_LIST_HEAD(&sbi->s_snapshot_dio_reads);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	spin_lock_init(&sbi->s_cow_batch_lock);
+	sbi->s_cow_batch_count = 0;
+#endif
 
 #endif
 	needs_recovery = (es->s_last_orphan != 0 ||
@@ -2141,6 +3247,17 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	 * The first inode we look at is the journal inode.  Don't try
 	 * root first: it may be modified in the journal!
 	 */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if ((sb->s_flags & MS_RDONLY) &&
+	    (le32_to_cpu(es->s_flags) & NEXT3_FLAGS_IS_SNAPSHOT)) {
+		/*
+		 * The journal inode of a snapshot image reads through to the
+		 * live journal and the image was frozen with an empty journal.
+		 */
+		set_opt(sbi->s_mount_opt, NOLOAD);
+		needs_recovery = 0;
+	} else
+#endif
 	if (!test_opt(sb, NOLOAD) &&
 	    NEXT3_HAS_COMPAT_FEATURE(sb, NEXT3_FEATURE_COMPAT_HAS_JOURNAL)) {
 		if (next3_load_journal(sb, es, journal_devnum))
@@ -2155,6 +3272,26 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 				"mounting next3 over ext2?");
 		goto failed_mount2;
 	}
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	if (needs_recovery) {
+		/* journal replay may have changed the group descriptors */
+		es->s_free_blocks_count =
+			cpu_to_le32(next3_count_free_blocks(sb));
+		es->s_free_inodes_count =
+			cpu_to_le32(next3_count_free_inodes(sb));
+		sbi->s_dirs_count = next3_count_dirs(sb);
+	}
+	err = percpu_counter_init(&sbi->s_freeblocks_counter,
+			le32_to_cpu(es->s_free_blocks_count));
+	if (!err) {
+		err = percpu_counter_init(&sbi->s_freeinodes_counter,
+				le32_to_cpu(es->s_free_inodes_count));
+	}
+	if (!err) {
+		err = percpu_counter_init(&sbi->s_dirs_counter,
+				sbi->s_dirs_count);
+	}
+#else
 	err = percpu_counter_init(&sbi->s_freeblocks_counter,
 			next3_count_free_blocks(sb));
 	if (!err) {
@@ -2165,11 +3302,68 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 		err = percpu_counter_init(&sbi->s_dirs_counter,
 				next3_count_dirs(sb));
 	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	if (!err) {
+		sbi->s_snapshot_stats =
+			alloc_percpu(struct next3_snapshot_stats);
+		if (!sbi->s_snapshot_stats)
+			err = -ENOMEM;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	if (!err) {
+		sbi->s_ialloc_hints = alloc_percpu(struct next3_ialloc_hint);
+		if (!sbi->s_ialloc_hints)
+			err = -ENOMEM;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	if (!err) {
+		sbi->s_tracked_readers = kzalloc(sizeof(atomic_t) *
+				NEXT3_TRACKED_READERS_HASH_SIZE, GFP_KERNEL);
+		if (!sbi->s_tracked_readers)
+			err = -ENOMEM;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	if (!err)
+		err = init_srcu_struct(&sbi->s_snapshot_srcu);
+#endif
 	if (err) {
 		next3_msg(sb, KERN_ERR, "error: insufficient memory");
 		goto failed_mount3;
 	}
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (!sbi->s_journal) {
+		/* read-only snapshot image mount - no data is written */
+		clear_opt(sbi->s_mount_opt, DATA_FLAGS);
+		set_opt(sbi->s_mount_opt, ORDERED_DATA);
+		goto no_journal;
+	}
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+	if (test_opt(sb, JOURNAL_ASYNC_COMMIT)) {
+		if (!journal_set_features(sbi->s_journal,
+				JFS_FEATURE_COMPAT_CHECKSUM, 0,
+				JFS_FEATURE_INCOMPAT_ASYNC_COMMIT))
+			next3_msg(sb, KERN_WARNING, "warning: failed to set "
+				"journal async commit feature");
+	} else if (test_opt(sb, JOURNAL_CHECKSUM)) {
+		if (!journal_set_features(sbi->s_journal,
+				JFS_FEATURE_COMPAT_CHECKSUM, 0, 0))
+			next3_msg(sb, KERN_WARNING, "warning: failed to set "
+				"journal checksum feature");
+		journal_clear_features(sbi->s_journal, 0, 0,
+				JFS_FEATURE_INCOMPAT_ASYNC_COMMIT);
+	} else {
+		journal_clear_features(sbi->s_journal,
+				JFS_FEATURE_COMPAT_CHECKSUM, 0,
+				JFS_FEATURE_INCOMPAT_ASYNC_COMMIT);
+	}
+
+#endif
 	/* We have now updated the journal if required, so we can
 	 * validate the data journaling mode. */
 	switch (test_opt(sb, DATA_FLAGS)) {
@@ -2196,12 +3390,22 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	default:
 		break;
 	}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+no_journal:
+#endif
 
 	if (test_opt(sb, NOBH)) {
+#ifdef CONFIG_NEXT3_FS_NOBH
+		if (test_opt(sb, DATA_FLAGS) == NEXT3_MOUNT_JOURNAL_DATA) {
+			next3_msg(sb, KERN_WARNING,
+				"warning: ignoring nobh option - "
+				"it is not supported with journal mode");
+#else
 		if (!(test_opt(sb, DATA_FLAGS) == NEXT3_MOUNT_WRITEBACK_DATA)) {
 			next3_msg(sb, KERN_WARNING,
 				"warning: ignoring nobh option - "
 				"it is supported only with writeback mode");
+#endif
 			clear_opt(sbi->s_mount_opt, NOBH);
 		}
 	}
@@ -2221,6 +3425,20 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 	}
 #endif
 
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	/*
+	 * Order data by inode, unless the file system has snapshots, which
+	 * need the data buffers on the sync data list, see
+	 * buffer_first_write().  Cleared when the first snapshot is created.
+	 */
+	if (test_opt(sb, DATA_FLAGS) == NEXT3_MOUNT_ORDERED_DATA
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
+	    && !NEXT3_HAS_RO_COMPAT_FEATURE(sb,
+				NEXT3_FEATURE_RO_COMPAT_HAS_SNAPSHOT)
+#endif
+	    )
+		set_opt(sbi->s_mount_opt, ORDERED_INODE);
 #endif
 	/*
 	 * The journal_load will have done any necessary log recovery,
@@ -2253,12 +3471,21 @@ static int next3_fill_super (struct super_block *sb, void *data, int silent)
 		next3_error(sb, __func__, "load snapshot failed\n");
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	if (next3_sysfs_register(sb))
+		next3_msg(sb, KERN_WARNING,
+			"warning: failed to register sysfs entry");
+#endif
+
 	NEXT3_SB(sb)->s_mount_state |= NEXT3_ORPHAN_FS;
 	next3_orphan_cleanup(sb, es);
 	NEXT3_SB(sb)->s_mount_state &= ~NEXT3_ORPHAN_FS;
 	if (needs_recovery)
 		next3_msg(sb, KERN_INFO, "recovery complete");
 	next3_mark_recovery_complete(sb, es);
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	next3_itable_start(sb);
+#endif
 	next3_msg(sb, KERN_INFO, "mounted filesystem with %s data mode",
 		test_opt(sb,DATA_FLAGS) == NEXT3_MOUNT_JOURNAL_DATA ? "journal":
 		test_opt(sb,DATA_FLAGS) == NEXT3_MOUNT_ORDERED_DATA ? "ordered":
@@ -2278,15 +3505,34 @@ failed_mount3:
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	free_percpu(sbi->s_snapshot_stats);
+#endif
+#ifdef CONFIG_NEXT3_FS_IALLOC_HINTS
+	free_percpu(sbi->s_ialloc_hints);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_READ_HASH
+	kfree(sbi->s_tracked_readers);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_LIST_RCU
+	/* NULL if init_srcu_struct() was not reached or failed */
+	if (sbi->s_snapshot_srcu.per_cpu_ref)
+		cleanup_srcu_struct(&sbi->s_snapshot_srcu);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (sbi->s_journal)
+#endif
 	journal_destroy(sbi->s_journal);
 failed_mount2:
+#ifdef CONFIG_NEXT3_FS_FLEX_STATS
+	next3_free_flex_stats(sbi);
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	next3_release_bitmap_pins(sb);
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
-	if (sbi->s_group_info) {
-		if (is_vmalloc_addr(sbi->s_group_info))
-			vfree(sbi->s_group_info);
-		else
-			kfree(sbi->s_group_info);
-	}
+	if (sbi->s_group_info)
+		next3_free_group_info(sbi);
 #endif
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
@@ -2301,6 +3547,9 @@ failed_mount:
 out_fail:
 	sb->s_fs_info = NULL;
 	kfree(sbi->s_blockgroup_lock);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BGL
+	kfree(sbi->s_snapshot_bgl);
+#endif
 	kfree(sbi);
 	lock_kernel();
 	return ret;
@@ -2320,8 +3569,21 @@ static void next3_init_journal_params(struct super_block *sb, journal_t *journal
 	/* We could also set up an next3-specific default for the commit
 	 * interval here, but for now we'll just fall back to the jbd
 	 * default. */
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+	journal->j_submit_data_callback = next3_snapshot_cow_batch_commit;
+#endif
 
 	spin_lock(&journal->j_state_lock);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	journal->j_min_commit_interval = sbi->s_min_commit_interval;
+	journal->j_max_commit_interval = sbi->s_max_commit_interval;
+	if (sbi->s_max_commit_interval) {
+		/* start from the commit= interval, within the bounds */
+		journal->j_commit_interval = clamp(journal->j_commit_interval,
+			max(sbi->s_min_commit_interval, 1UL),
+			sbi->s_max_commit_interval);
+	}
+#endif
 	if (test_opt(sb, BARRIER))
 		journal->j_flags |= JFS_BARRIER;
 	else
@@ -2659,6 +3921,10 @@ static void next3_mark_recovery_complete(struct super_block * sb,
 {
 	journal_t *journal = NEXT3_SB(sb)->s_journal;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (!journal)
+		return;
+#endif
 	journal_lock_updates(journal);
 	if (journal_flush(journal) < 0)
 		goto out;
@@ -2758,6 +4024,10 @@ static int next3_sync_fs(struct super_block *sb, int wait)
 {
 	tid_t target;
 
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	if (wait)
+		next3_async_unlink_flush(sb);
+#endif
 	if (journal_start_commit(NEXT3_SB(sb)->s_journal, &target)) {
 		if (wait)
 			log_wait_commit(NEXT3_SB(sb)->s_journal, target);
@@ -2801,6 +4071,51 @@ out:
 	return error;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_FREEZE_LITE
+/*
+ * Called before a next3 snapshot is taken.  Snapshot read through maps
+ * blocks that were not COWed to their location on disk, so all committed
+ * metadata must be checkpointed before the snapshot is taken, as in
+ * next3_freeze().  Unlike next3_freeze(), leave the RECOVER flag alone:
+ * handles are locked out until next3_unfreeze_lite() writes the super
+ * block once with the snapshot changes, so there is nothing to clear and
+ * set again around the take.
+ * Updates are left locked even on error, so next3_unfreeze_lite() must
+ * always be called.
+ */
+int next3_freeze_lite(struct super_block *sb)
+{
+	journal_t *journal = NEXT3_SB(sb)->s_journal;
+	int err;
+
+	if (sb->s_flags & MS_RDONLY)
+		return 0;
+
+	/* wait for running handles and lock out new ones */
+	journal_lock_updates(journal);
+	/* commit and checkpoint all transactions */
+	err = journal_flush(journal);
+	if (!err && is_journal_aborted(journal))
+		err = -EROFS;
+	return err;
+}
+
+/*
+ * Called after a next3 snapshot was taken, to write the super block with the
+ * snapshot changes and let handles run again.
+ */
+void next3_unfreeze_lite(struct super_block *sb)
+{
+	if (sb->s_flags & MS_RDONLY)
+		return;
+
+	lock_super(sb);
+	next3_commit_super(sb, NEXT3_SB(sb)->s_es, 1);
+	unlock_super(sb);
+	journal_unlock_updates(NEXT3_SB(sb)->s_journal);
+}
+
+#endif
 /*
  * Called by LVM after the snapshot is done.  We need to reset the RECOVER
  * flag here, even though the filesystem is not technically dirty yet.
@@ -2840,6 +4155,25 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 	old_opts.s_resuid = sbi->s_resuid;
 	old_opts.s_resgid = sbi->s_resgid;
 	old_opts.s_commit_interval = sbi->s_commit_interval;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	old_opts.s_min_commit_interval = sbi->s_min_commit_interval;
+	old_opts.s_max_commit_interval = sbi->s_max_commit_interval;
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	old_opts.s_async_unlink_blocks = sbi->s_async_unlink_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	old_opts.s_dx_cache_blocks = sbi->s_dx_cache_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	old_opts.s_bitmap_pin_groups = sbi->s_bitmap_pin_groups;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	old_opts.s_stripe = sbi->s_stripe;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	old_opts.s_inode_readahead_blks = sbi->s_inode_readahead_blks;
+#endif
 #ifdef CONFIG_QUOTA
 	old_opts.s_jquota_fmt = sbi->s_jquota_fmt;
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -2853,6 +4187,10 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 		err = -EINVAL;
 		goto restore_opts;
 	}
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	if (sbi->s_stripe != old_opts.s_stripe)
+		sbi->s_stripe = next3_get_stripe_size(sbi, sbi->s_stripe);
+#endif
 
 	if (test_opt(sb, ABORT))
 		next3_abort(sb, __func__, "Abort forced by user");
@@ -2862,6 +4200,15 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 
 	es = sbi->s_es;
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	if (!sbi->s_journal) {
+		/* snapshot image cannot be remounted read-write */
+		if (!(*flags & MS_RDONLY)) {
+			err = -EROFS;
+			goto restore_opts;
+		}
+	} else
+#endif
 	next3_init_journal_params(sb, sbi->s_journal);
 
 	if ((*flags & MS_RDONLY) != (sb->s_flags & MS_RDONLY) ||
@@ -2875,6 +4222,9 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 			err = dquot_suspend(sb, -1);
 			if (err < 0)
 				goto restore_opts;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+			next3_itable_stop(sb);
+#endif
 
 			/*
 			 * First of all, the unconditional stuff we have to do
@@ -2894,8 +4244,14 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 			next3_mark_recovery_complete(sb, es);
 		} else {
 			__le32 ret;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+			if ((ret = NEXT3_HAS_RO_COMPAT_FEATURE(sb,
+					~(NEXT3_FEATURE_RO_COMPAT_SUPP|
+					  NEXT3_FEATURE_RO_COMPAT_ITABLE_UNINIT)))) {
+#else
 			if ((ret = NEXT3_HAS_RO_COMPAT_FEATURE(sb,
 					~NEXT3_FEATURE_RO_COMPAT_SUPP))) {
+#endif
 				next3_msg(sb, KERN_WARNING,
 					"warning: couldn't remount RDWR "
 					"because of unsupported optional "
@@ -2917,6 +4273,21 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 				err = -EINVAL;
 				goto restore_opts;
 			}
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_ROLLBACK
+
+			/*
+			 * After rollback to snapshot, all in-memory state is
+			 * stale and the on-disk free counters are not accurate.
+			 */
+			if (sbi->s_snapshot_rollback) {
+				next3_msg(sb, KERN_WARNING, "warning: couldn't "
+				       "remount RDWR after rollback to "
+				       "snapshot.  Please umount and run "
+				       "fsck instead.");
+				err = -EROFS;
+				goto restore_opts;
+			}
+#endif
 
 			/*
 			 * Mounting a RDONLY partition read-write, so reread
@@ -2930,6 +4301,9 @@ static int next3_remount (struct super_block * sb, int * flags, char * data)
 				goto restore_opts;
 			if (!next3_setup_super (sb, es, 0))
 				sb->s_flags &= ~MS_RDONLY;
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+			next3_itable_start(sb);
+#endif
 			enable_quota = 1;
 		}
 	}
@@ -2952,6 +4326,25 @@ restore_opts:
 	sbi->s_resuid = old_opts.s_resuid;
 	sbi->s_resgid = old_opts.s_resgid;
 	sbi->s_commit_interval = old_opts.s_commit_interval;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+	sbi->s_min_commit_interval = old_opts.s_min_commit_interval;
+	sbi->s_max_commit_interval = old_opts.s_max_commit_interval;
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	sbi->s_async_unlink_blocks = old_opts.s_async_unlink_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_DX_CACHE
+	sbi->s_dx_cache_blocks = old_opts.s_dx_cache_blocks;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_BITMAP_PIN
+	sbi->s_bitmap_pin_groups = old_opts.s_bitmap_pin_groups;
+#endif
+#ifdef CONFIG_NEXT3_FS_BALLOC_STRIPE
+	sbi->s_stripe = old_opts.s_stripe;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_READAHEAD
+	sbi->s_inode_readahead_blks = old_opts.s_inode_readahead_blks;
+#endif
 #ifdef CONFIG_QUOTA
 	sbi->s_jquota_fmt = old_opts.s_jquota_fmt;
 	for (i = 0; i < MAXQUOTAS; i++) {
@@ -2966,6 +4359,34 @@ restore_opts:
 	return err;
 }
 
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+#ifdef CONFIG_SMP
+/* maximal error of percpu_counter_read() */
+#define NEXT3_COUNTER_MAX_ERROR	\
+	((s64)percpu_counter_batch * num_online_cpus())
+#else
+#define NEXT3_COUNTER_MAX_ERROR	0
+#endif
+
+/*
+ * next3_statfs_count() - read a counter for statfs
+ * With statfs_approx, the approximate counter value is returned, unless it
+ * is too close to @limit to tell if the exact value is above the limit.
+ */
+static s64 next3_statfs_count(struct super_block *sb,
+		struct percpu_counter *fbc, s64 limit)
+{
+	s64 count;
+
+	if (test_opt(sb, STATFS_APPROX)) {
+		count = percpu_counter_read_positive(fbc);
+		if (count > limit + NEXT3_COUNTER_MAX_ERROR)
+			return count;
+	}
+	return percpu_counter_sum_positive(fbc);
+}
+
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
 static int next3_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
@@ -2982,6 +4403,12 @@ static int next3_statfs (struct dentry * dentry, struct kstatfs * buf)
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	struct next3_super_block *es = sbi->s_es;
 	u64 fsid;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	struct inode *active_snapshot;
+#endif
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	s64 limit;
+#endif
 
 	if (test_opt(sb, MINIX_DF)) {
 		sbi->s_overhead_last = 0;
@@ -3026,7 +4453,18 @@ static int next3_statfs (struct dentry * dentry, struct kstatfs * buf)
 	buf->f_type = NEXT3_SUPER_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = le32_to_cpu(es->s_blocks_count) - sbi->s_overhead_last;
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	/* exact free blocks count is needed near the reserved blocks limit */
+	limit = le32_to_cpu(es->s_r_blocks_count);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
+	if (sbi->s_active_snapshot)
+		limit += le64_to_cpu(es->s_snapshot_r_blocks_count);
+#endif
+	buf->f_bfree = next3_statfs_count(sb, &sbi->s_freeblocks_counter,
+					  limit);
+#else
 	buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+#endif
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(es->s_r_blocks_count))
 		buf->f_bavail = 0;
@@ -3039,11 +4477,29 @@ static int next3_statfs (struct dentry * dentry, struct kstatfs * buf)
 			buf->f_bavail -=
 				le64_to_cpu(es->s_snapshot_r_blocks_count);
 	}
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	buf->f_spare[0] = next3_statfs_count(sb, &sbi->s_dirs_counter, 0);
+#else
 	buf->f_spare[0] = percpu_counter_sum_positive(&sbi->s_dirs_counter);
+#endif
 	buf->f_spare[1] = sbi->s_overhead_last;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_USAGE
+	/* blocks copied and moved to the active snapshot */
+	active_snapshot = sbi->s_active_snapshot;
+	if (active_snapshot) {
+		buf->f_spare[2] =
+			atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_copied);
+		buf->f_spare[3] =
+			atomic_read(&NEXT3_SNAP_I(active_snapshot)->i_snap_moved);
+	}
 #endif
 	buf->f_files = le32_to_cpu(es->s_inodes_count);
+#ifdef CONFIG_NEXT3_FS_FREE_COUNTERS
+	buf->f_ffree = next3_statfs_count(sb, &sbi->s_freeinodes_counter, 0);
+#else
 	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+#endif
 	buf->f_namelen = NEXT3_NAME_LEN;
 	fsid = le64_to_cpup((void *)es->s_uuid) ^
 	       le64_to_cpup((void *)es->s_uuid + sizeof(u64));
@@ -3122,12 +4578,61 @@ static int next3_release_dquot(struct dquot *dquot)
 	return ret;
 }
 
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+/*
+ * Queue a dirty dquot on the running handle of this file system, which
+ * writes it to the quota file before it is stopped or restarted, so in the
+ * same transaction as the change.  Many changes of the same dquot by one
+ * handle then cost one write.  Returns 0 if there is no such handle or the
+ * handle queue is full, and the dquot has to be written now.
+ */
+static int next3_queue_dquot(struct dquot *dquot)
+{
+	handle_t *handle = journal_current_handle();
+	unsigned int i;
+
+	if (!handle || handle->h_transaction->t_journal !=
+			NEXT3_SB(dquot->dq_sb)->s_journal)
+		return 0;
+
+	for (i = 0; i < handle->h_dquots_count; i++)
+		if (handle->h_dquots[i] == dquot)
+			return 1;
+	if (i == JBD_HANDLE_DQUOTS)
+		return 0;
+
+	/* the caller holds a reference, so we can take another one */
+	atomic_inc(&dquot->dq_count);
+	handle->h_dquots[handle->h_dquots_count++] = dquot;
+	return 1;
+}
+
+/*
+ * Write the dquots queued on the handle.  Like the direct writes of
+ * next3_mark_dquot_dirty(), the writes use the quota credits of the handle.
+ */
+void next3_flush_dquots(handle_t *handle)
+{
+	struct dquot *dquot;
+
+	while (handle->h_dquots_count) {
+		dquot = handle->h_dquots[--handle->h_dquots_count];
+		next3_write_dquot(dquot);
+		dqput(dquot);
+	}
+}
+
+#endif
 static int next3_mark_dquot_dirty(struct dquot *dquot)
 {
 	/* Are we journaling quotas? */
 	if (NEXT3_SB(dquot->dq_sb)->s_qf_names[USRQUOTA] ||
 	    NEXT3_SB(dquot->dq_sb)->s_qf_names[GRPQUOTA]) {
 		dquot_mark_dquot_dirty(dquot);
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+		if (next3_queue_dquot(dquot))
+			return 0;
+#endif
 		return next3_write_dquot(dquot);
 	} else {
 		return dquot_mark_dquot_dirty(dquot);
@@ -3328,6 +4833,13 @@ out:
 static int next3_get_sb(struct file_system_type *fs_type,
 	int flags, const char *dev_name, void *data, struct vfsmount *mnt)
 {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	__u32 snapshot_id;
+
+	if (next3_snapshot_mount_option(data, &snapshot_id))
+		return next3_snapshot_get_sb(fs_type, flags, dev_name, data,
+				snapshot_id, next3_fill_super, mnt);
+#endif
 	return get_sb_bdev(fs_type, flags, dev_name, data, next3_fill_super, mnt);
 }
 
@@ -3335,7 +4847,11 @@ static struct file_system_type next3_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "next3",
 	.get_sb		= next3_get_sb,
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_MOUNT
+	.kill_sb	= next3_snapshot_kill_sb,
+#else
 	.kill_sb	= kill_block_super,
+#endif
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
@@ -3344,25 +4860,56 @@ static int __init init_next3_fs(void)
 	int err = init_next3_xattr();
 	if (err)
 		return err;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	err = -ENOMEM;
+	next3_kset = kset_create_and_add("next3", NULL, fs_kobj);
+	if (!next3_kset)
+		goto out2;
+#endif
 	err = init_inodecache();
 	if (err)
 		goto out1;
         err = register_filesystem(&next3_fs_type);
 	if (err)
 		goto out;
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	err = init_next3_async_unlink();
+	if (err)
+		goto out_fs;
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	err = init_next3_itable();
+	if (err)
+		goto out_unlink;
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT
 	err = init_next3_snapshot();
 	if (err)
-		goto out_fs;
+		goto out_itable;
 #endif
 	return 0;
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT
+out_itable:
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	exit_next3_itable();
+out_unlink:
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	exit_next3_async_unlink();
 out_fs:
+#endif
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT) || defined(CONFIG_NEXT3_FS_ASYNC_UNLINK) || \
+	defined(CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE)
 	unregister_filesystem(&next3_fs_type);
 #endif
 out:
 	destroy_inodecache();
 out1:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	kset_unregister(next3_kset);
+out2:
+#endif
 	exit_next3_xattr();
 	return err;
 }
@@ -3371,9 +4918,18 @@ static void __exit exit_next3_fs(void)
 {
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT
 	exit_next3_snapshot();
+#endif
+#ifdef CONFIG_NEXT3_FS_RESIZE_LAZY_ITABLE
+	exit_next3_itable();
+#endif
+#ifdef CONFIG_NEXT3_FS_ASYNC_UNLINK
+	exit_next3_async_unlink();
 #endif
 	unregister_filesystem(&next3_fs_type);
 	destroy_inodecache();
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_STATS
+	kset_unregister(next3_kset);
+#endif
 	exit_next3_xattr();
 }
 
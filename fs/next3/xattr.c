@@ -58,6 +58,10 @@
 #include <linux/mbcache.h>
 #include <linux/quotaops.h>
 #include <linux/rwsem.h>
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#endif
 #include "xattr.h"
 #include "acl.h"
 
@@ -93,16 +97,60 @@
 # define ea_bdebug(f...)
 #endif
 
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+static void next3_xattr_cache_insert(struct super_block *,
+				    struct buffer_head *);
+static void next3_xattr_cache_remove(struct super_block *,
+				    struct buffer_head *);
+static int next3_xattr_cache_hashed(struct super_block *, __u32, sector_t);
+static struct buffer_head *next3_xattr_cache_find(struct inode *,
+						 struct next3_xattr_header *);
+#else
 static void next3_xattr_cache_insert(struct buffer_head *);
 static struct buffer_head *next3_xattr_cache_find(struct inode *,
 						 struct next3_xattr_header *,
 						 struct mb_cache_entry **);
+#endif
 static void next3_xattr_rehash(struct next3_xattr_header *,
 			      struct next3_xattr_entry *);
 static int next3_xattr_list(struct dentry *dentry, char *buffer,
 			   size_t buffer_size);
 
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+/*
+ * Per file system index of shareable xattr blocks, keyed by block hash.
+ * Lookups walk a hash chain under RCU only, insert and remove take the
+ * chain lock.  A chain holds at most NEXT3_XATTR_SHARE_CHAIN_MAX blocks;
+ * the oldest one is dropped from the index to make room for a new one.
+ *
+ * A block is unhashed under its buffer lock before it is freed or
+ * modified in place, so a sharer which finds the block still hashed
+ * after locking the buffer may safely take a reference to it.
+ */
+#define NEXT3_XATTR_SHARE_BITS		8
+#define NEXT3_XATTR_SHARE_CHAIN_MAX	16
+
+struct next3_xattr_share_entry {
+	struct hlist_node	e_node;
+	struct rcu_head		e_rcu;
+	sector_t		e_block;
+	__u32			e_hash;
+};
+
+struct next3_xattr_share_chain {
+	spinlock_t		c_lock;
+	struct hlist_head	c_head;
+	unsigned int		c_len;
+};
+
+struct next3_xattr_share {
+	struct next3_xattr_share_chain s_chain[1 << NEXT3_XATTR_SHARE_BITS];
+};
+
+static struct kmem_cache *next3_xattr_share_cachep;
+#else
 static struct mb_cache *next3_xattr_cache;
+#endif
 
 static const struct xattr_handler *next3_xattr_handler_map[] = {
 	[NEXT3_XATTR_INDEX_USER]		     = &next3_xattr_user_handler,
@@ -212,6 +260,139 @@ next3_xattr_find_entry(struct next3_xattr_entry **pentry, int name_index,
 	return cmp ? -ENODATA : 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+/*
+ * In-memory index of xattr names
+ *
+ * The hashes of the names of all the extended attributes of an inode, in
+ * the inode body and in the xattr block, are kept in a small array, which
+ * is built on first lookup.  A lookup of a name whose hash is not in the
+ * array fails with -ENODATA without reading and scanning the xattr entries.
+ * The array is built under down_read(xattr_sem) and published with
+ * cmpxchg(), and it is dropped under down_write(xattr_sem) on every change
+ * of the inode xattrs.
+ */
+struct next3_xattr_names {
+	unsigned int count;
+	__u32 hash[0];
+};
+
+static __u32
+next3_xattr_name_hash(int name_index, const char *name, size_t name_len)
+{
+	__u32 hash = name_index;
+
+	while (name_len--)
+		hash = (hash << 5) ^ (hash >> 27) ^ *name++;
+	return hash;
+}
+
+void
+next3_xattr_names_free(struct inode *inode)
+{
+	kfree(xchg(&NEXT3_I(inode)->i_xattr_names, NULL));
+}
+
+/*
+ * Add the hashes of all names starting at @entry to @names (if not NULL)
+ * and return the number of entries.
+ */
+static unsigned int
+next3_xattr_names_add(struct next3_xattr_names *names,
+		      struct next3_xattr_entry *entry)
+{
+	unsigned int count = 0;
+
+	for (; !IS_LAST_ENTRY(entry); entry = NEXT3_XATTR_NEXT(entry), count++)
+		if (names)
+			names->hash[names->count++] = next3_xattr_name_hash(
+				entry->e_name_index, entry->e_name,
+				entry->e_name_len);
+	return count;
+}
+
+/*
+ * Build the xattr names index of @inode.
+ * Returns NULL on error, in which case xattr lookups scan the entries.
+ */
+static struct next3_xattr_names *
+next3_xattr_names_build(struct inode *inode)
+{
+	struct next3_xattr_names *names = NULL;
+	struct next3_xattr_entry *ientry = NULL, *bentry = NULL;
+	struct next3_inode *raw_inode;
+	struct next3_iloc iloc;
+	struct buffer_head *bh = NULL;
+	unsigned int count = 0;
+
+	iloc.bh = NULL;
+	if (next3_test_inode_state(inode, NEXT3_STATE_XATTR)) {
+		if (next3_get_inode_loc(inode, &iloc))
+			goto out;
+		raw_inode = next3_raw_inode(&iloc);
+		ientry = IFIRST(IHDR(inode, raw_inode));
+		if (next3_xattr_check_names(ientry, (void *)raw_inode +
+				NEXT3_SB(inode->i_sb)->s_inode_size))
+			goto out;
+		count += next3_xattr_names_add(NULL, ientry);
+	}
+	if (NEXT3_I(inode)->i_file_acl) {
+		bh = sb_bread(inode->i_sb, NEXT3_I(inode)->i_file_acl);
+		if (!bh || next3_xattr_check_block(bh))
+			goto out;
+		bentry = BFIRST(bh);
+		count += next3_xattr_names_add(NULL, bentry);
+	}
+
+	names = kmalloc(sizeof(*names) + count * sizeof(__u32), GFP_NOFS);
+	if (!names)
+		goto out;
+	names->count = 0;
+	if (ientry)
+		next3_xattr_names_add(names, ientry);
+	if (bentry)
+		next3_xattr_names_add(names, bentry);
+out:
+	brelse(bh);
+	brelse(iloc.bh);
+	return names;
+}
+
+/*
+ * Returns 1 if xattr @name_index.@name surely does not exist and 0 if the
+ * xattr entries need to be searched.
+ * Called under down_read(xattr_sem).
+ */
+static int
+next3_xattr_names_miss(struct inode *inode, int name_index, const char *name)
+{
+	struct next3_xattr_names *names = NEXT3_I(inode)->i_xattr_names;
+	unsigned int i;
+	__u32 hash;
+
+	if (!next3_test_inode_state(inode, NEXT3_STATE_XATTR) &&
+	    !NEXT3_I(inode)->i_file_acl)
+		/* no xattrs at all - lookup is cheap enough */
+		return 0;
+	if (!names) {
+		names = next3_xattr_names_build(inode);
+		if (!names)
+			return 0;
+		if (cmpxchg(&NEXT3_I(inode)->i_xattr_names, NULL, names)) {
+			/* another reader built the same index */
+			kfree(names);
+			names = NEXT3_I(inode)->i_xattr_names;
+		}
+	}
+
+	hash = next3_xattr_name_hash(name_index, name, strlen(name));
+	for (i = 0; i < names->count; i++)
+		if (names->hash[i] == hash)
+			return 0;
+	return 1;
+}
+#endif
+
 static int
 next3_xattr_block_get(struct inode *inode, int name_index, const char *name,
 		     void *buffer, size_t buffer_size)
@@ -240,7 +421,11 @@ bad_block:	next3_error(inode->i_sb, __func__,
 		error = -EIO;
 		goto cleanup;
 	}
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	next3_xattr_cache_insert(inode->i_sb, bh);
+#else
 	next3_xattr_cache_insert(bh);
+#endif
 	entry = BFIRST(bh);
 	error = next3_xattr_find_entry(&entry, name_index, name, bh->b_size, 1);
 	if (error == -EIO)
@@ -322,11 +507,20 @@ next3_xattr_get(struct inode *inode, int name_index, const char *name,
 	int error;
 
 	down_read(&NEXT3_I(inode)->xattr_sem);
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	if (name && next3_xattr_names_miss(inode, name_index, name)) {
+		error = -ENODATA;
+		goto out;
+	}
+#endif
 	error = next3_xattr_ibody_get(inode, name_index, name, buffer,
 				     buffer_size);
 	if (error == -ENODATA)
 		error = next3_xattr_block_get(inode, name_index, name, buffer,
 					     buffer_size);
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+out:
+#endif
 	up_read(&NEXT3_I(inode)->xattr_sem);
 	return error;
 }
@@ -384,7 +578,11 @@ next3_xattr_block_list(struct dentry *dentry, char *buffer, size_t buffer_size)
 		error = -EIO;
 		goto cleanup;
 	}
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	next3_xattr_cache_insert(inode->i_sb, bh);
+#else
 	next3_xattr_cache_insert(bh);
+#endif
 	error = next3_xattr_list_entries(dentry, BFIRST(bh), buffer, buffer_size);
 
 cleanup:
@@ -478,10 +676,27 @@ static void
 next3_xattr_release_block(handle_t *handle, struct inode *inode,
 			 struct buffer_head *bh)
 {
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 	struct mb_cache_entry *ce = NULL;
+#endif
 	int error = 0;
 
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 	ce = mb_cache_entry_get(next3_xattr_cache, bh->b_bdev, bh->b_blocknr);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+	/*
+	 * The last reference to the block is not changed before the block
+	 * is freed, so free it, or move it to snapshot, without getting
+	 * write access to it, which would COW it to snapshot first.
+	 * New references are taken under the buffer lock, after checking
+	 * that the block is still hashed.
+	 */
+	lock_buffer(bh);
+	if (BHDR(bh)->h_refcount == cpu_to_le32(1))
+		goto free_block;
+	unlock_buffer(bh);
+#endif
 	error = next3_journal_get_write_access(handle, bh);
 	if (error)
 		 goto out;
@@ -489,9 +704,16 @@ next3_xattr_release_block(handle_t *handle, struct inode *inode,
 	lock_buffer(bh);
 
 	if (BHDR(bh)->h_refcount == cpu_to_le32(1)) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+free_block:
+#endif
 		ea_bdebug(bh, "refcount now=0; freeing");
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+		next3_xattr_cache_remove(inode->i_sb, bh);
+#else
 		if (ce)
 			mb_cache_entry_free(ce);
+#endif
 		next3_free_blocks(handle, inode, bh->b_blocknr, 1);
 		get_bh(bh);
 		next3_forget(handle, 1, inode, bh, bh->b_blocknr);
@@ -503,8 +725,10 @@ next3_xattr_release_block(handle_t *handle, struct inode *inode,
 		dquot_free_block(inode, 1);
 		ea_bdebug(bh, "refcount now=%d; releasing",
 			  le32_to_cpu(BHDR(bh)->h_refcount));
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 		if (ce)
 			mb_cache_entry_release(ce);
+#endif
 	}
 	unlock_buffer(bh);
 out:
@@ -684,7 +908,12 @@ next3_xattr_block_set(handle_t *handle, struct inode *inode,
 	struct super_block *sb = inode->i_sb;
 	struct buffer_head *new_bh = NULL;
 	struct next3_xattr_search *s = &bs->s;
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 	struct mb_cache_entry *ce = NULL;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+	int shared;
+#endif
 	int error = 0;
 
 #define header(x) ((struct next3_xattr_header *)(x))
@@ -692,25 +921,50 @@ next3_xattr_block_set(handle_t *handle, struct inode *inode,
 	if (i->value && i->value_len > sb->s_blocksize)
 		return -ENOSPC;
 	if (s->base) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+		/*
+		 * A shared block is cloned and not modified, so don't get
+		 * write access to it, which would COW it to snapshot.  It is
+		 * COWed later only if its reference count is changed, and not
+		 * at all if the clone turns out identical to it.  Cloning a
+		 * block whose last other reference is dropped meanwhile is
+		 * still correct.
+		 */
+		lock_buffer(bs->bh);
+		shared = header(s->base)->h_refcount != cpu_to_le32(1);
+		unlock_buffer(bs->bh);
+		if (shared)
+			goto clone_block;
+#endif
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 		ce = mb_cache_entry_get(next3_xattr_cache, bs->bh->b_bdev,
 					bs->bh->b_blocknr);
+#endif
 		error = next3_journal_get_write_access(handle, bs->bh);
 		if (error)
 			goto cleanup;
 		lock_buffer(bs->bh);
 
 		if (header(s->base)->h_refcount == cpu_to_le32(1)) {
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+			next3_xattr_cache_remove(sb, bs->bh);
+#else
 			if (ce) {
 				mb_cache_entry_free(ce);
 				ce = NULL;
 			}
+#endif
 			ea_bdebug(bs->bh, "modifying in-place");
 			error = next3_xattr_set_entry(i, s);
 			if (!error) {
 				if (!IS_LAST_ENTRY(s->first))
 					next3_xattr_rehash(header(s->base),
 							  s->here);
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+				next3_xattr_cache_insert(sb, bs->bh);
+#else
 				next3_xattr_cache_insert(bs->bh);
+#endif
 			}
 			unlock_buffer(bs->bh);
 			if (error == -EIO)
@@ -722,7 +976,11 @@ next3_xattr_block_set(handle_t *handle, struct inode *inode,
 				goto cleanup;
 			goto inserted;
 		} else {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+			int offset;
+#else
 			int offset = (char *)s->here - bs->bh->b_data;
+#endif
 
 			unlock_buffer(bs->bh);
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RELEASE
@@ -733,10 +991,16 @@ next3_xattr_block_set(handle_t *handle, struct inode *inode,
 			journal_release_buffer(handle, bs->bh);
 #endif
 
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 			if (ce) {
 				mb_cache_entry_release(ce);
 				ce = NULL;
 			}
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_HOOKS_XATTR
+clone_block:
+			offset = (char *)s->here - bs->bh->b_data;
+#endif
 			ea_bdebug(bs->bh, "cloning");
 			s->base = kmalloc(bs->bh->b_size, GFP_NOFS);
 			error = -ENOMEM;
@@ -773,7 +1037,11 @@ next3_xattr_block_set(handle_t *handle, struct inode *inode,
 
 inserted:
 	if (!IS_LAST_ENTRY(s->first)) {
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+		new_bh = next3_xattr_cache_find(inode, header(s->base));
+#else
 		new_bh = next3_xattr_cache_find(inode, header(s->base), &ce);
+#endif
 		if (new_bh) {
 			/* We found an identical block in the cache. */
 			if (new_bh == bs->bh)
@@ -789,6 +1057,26 @@ inserted:
 				if (error)
 					goto cleanup_dquot;
 				lock_buffer(new_bh);
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+				/*
+				 * The block may have been freed or modified
+				 * in place since we compared it.  Both are
+				 * done under the buffer lock after unhashing
+				 * the block, so check that it is still hashed
+				 * and look again if it is not.
+				 */
+				if (le32_to_cpu(BHDR(new_bh)->h_refcount) >=
+				    NEXT3_XATTR_REFCOUNT_MAX ||
+				    !next3_xattr_cache_hashed(sb,
+					le32_to_cpu(header(s->base)->h_hash),
+					new_bh->b_blocknr)) {
+					unlock_buffer(new_bh);
+					dquot_free_block(inode, 1);
+					brelse(new_bh);
+					new_bh = NULL;
+					goto inserted;
+				}
+#endif
 				le32_add_cpu(&BHDR(new_bh)->h_refcount, 1);
 				ea_bdebug(new_bh, "reusing; refcount now=%d",
 					le32_to_cpu(BHDR(new_bh)->h_refcount));
@@ -798,8 +1086,10 @@ inserted:
 				if (error)
 					goto cleanup_dquot;
 			}
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 			mb_cache_entry_release(ce);
 			ce = NULL;
+#endif
 		} else if (bs->bh && s->base == bs->bh->b_data) {
 			/* We were modifying this block in-place. */
 			ea_bdebug(bs->bh, "keeping this block");
@@ -831,7 +1121,11 @@ getblk_failed:
 			memcpy(new_bh->b_data, s->base, new_bh->b_size);
 			set_buffer_uptodate(new_bh);
 			unlock_buffer(new_bh);
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+			next3_xattr_cache_insert(sb, new_bh);
+#else
 			next3_xattr_cache_insert(new_bh);
+#endif
 			error = next3_journal_dirty_metadata(handle, new_bh);
 			if (error)
 				goto cleanup;
@@ -847,8 +1141,10 @@ getblk_failed:
 	error = 0;
 
 cleanup:
+#ifndef CONFIG_NEXT3_FS_XATTR_SHARE
 	if (ce)
 		mb_cache_entry_release(ce);
+#endif
 	brelse(new_bh);
 	if (!(bs->bh && s->base == bs->bh->b_data))
 		kfree(s->base);
@@ -965,6 +1261,10 @@ next3_xattr_set_handle(handle_t *handle, struct inode *inode, int name_index,
 	if (strlen(name) > 255)
 		return -ERANGE;
 	down_write(&NEXT3_I(inode)->xattr_sem);
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	/* xattr names may change - rebuild index on next lookup */
+	next3_xattr_names_free(inode);
+#endif
 	error = next3_get_inode_loc(inode, &is.iloc);
 	if (error)
 		goto cleanup;
@@ -1109,6 +1409,9 @@ next3_xattr_delete_inode(handle_t *handle, struct inode *inode)
 	}
 	next3_xattr_release_block(handle, inode, bh);
 	NEXT3_I(inode)->i_file_acl = 0;
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+	next3_xattr_names_free(inode);
+#endif
 
 cleanup:
 	brelse(bh);
@@ -1122,9 +1425,187 @@ cleanup:
 void
 next3_xattr_put_super(struct super_block *sb)
 {
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_xattr_share *share = sbi->s_xattr_share;
+	struct next3_xattr_share_entry *e;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (!share)
+		return;
+	sbi->s_xattr_share = NULL;
+	/* no lookups are possible anymore */
+	for (i = 0; i < (1 << NEXT3_XATTR_SHARE_BITS); i++)
+		hlist_for_each_entry_safe(e, pos, n,
+					  &share->s_chain[i].c_head, e_node)
+			kmem_cache_free(next3_xattr_share_cachep, e);
+	kfree(share);
+#else
 	mb_cache_shrink(sb->s_bdev);
+#endif
+}
+
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+static void
+next3_xattr_share_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(next3_xattr_share_cachep,
+			container_of(head, struct next3_xattr_share_entry,
+				     e_rcu));
+}
+
+static inline struct next3_xattr_share_chain *
+next3_xattr_share_chain(struct next3_xattr_share *share, __u32 hash)
+{
+	return &share->s_chain[hash_32(hash, NEXT3_XATTR_SHARE_BITS)];
+}
+
+/*
+ * Return the xattr share index of @sb, allocating it on first use.
+ */
+static struct next3_xattr_share *
+next3_xattr_share_get(struct super_block *sb)
+{
+	struct next3_sb_info *sbi = NEXT3_SB(sb);
+	struct next3_xattr_share *share, *old;
+	int i;
+
+	share = ACCESS_ONCE(sbi->s_xattr_share);
+	if (share) {
+		smp_read_barrier_depends();
+		return share;
+	}
+	share = kmalloc(sizeof(*share), GFP_NOFS);
+	if (!share)
+		return NULL;
+	for (i = 0; i < (1 << NEXT3_XATTR_SHARE_BITS); i++) {
+		spin_lock_init(&share->s_chain[i].c_lock);
+		INIT_HLIST_HEAD(&share->s_chain[i].c_head);
+		share->s_chain[i].c_len = 0;
+	}
+	old = cmpxchg(&sbi->s_xattr_share, NULL, share);
+	if (old) {
+		kfree(share);
+		return old;
+	}
+	return share;
+}
+
+/*
+ * next3_xattr_cache_hashed()
+ *
+ * Returns 1 if block @block is in the index with hash @hash.
+ */
+static int
+next3_xattr_cache_hashed(struct super_block *sb, __u32 hash, sector_t block)
+{
+	struct next3_xattr_share *share;
+	struct next3_xattr_share_entry *e;
+	struct hlist_node *pos;
+	int found = 0;
+
+	rcu_read_lock();
+	share = rcu_dereference(NEXT3_SB(sb)->s_xattr_share);
+	if (!share)
+		goto out;
+	hlist_for_each_entry_rcu(e, pos,
+			&next3_xattr_share_chain(share, hash)->c_head, e_node) {
+		if (e->e_block == block && e->e_hash == hash) {
+			found = 1;
+			break;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return found;
+}
+
+/*
+ * next3_xattr_cache_insert()
+ *
+ * Add xattr block @bh to the index unless it is already there.  Blocks
+ * which are already indexed are found without taking any locks.
+ */
+static void
+next3_xattr_cache_insert(struct super_block *sb, struct buffer_head *bh)
+{
+	__u32 hash = le32_to_cpu(BHDR(bh)->h_hash);
+	struct next3_xattr_share *share;
+	struct next3_xattr_share_chain *chain;
+	struct next3_xattr_share_entry *e, *new, *last = NULL;
+	struct hlist_node *pos;
+
+	if (!hash)
+		return;  /* never shared */
+	if (next3_xattr_cache_hashed(sb, hash, bh->b_blocknr))
+		return;
+	share = next3_xattr_share_get(sb);
+	if (!share)
+		return;
+	new = kmem_cache_alloc(next3_xattr_share_cachep, GFP_NOFS);
+	if (!new) {
+		ea_bdebug(bh, "out of memory");
+		return;
+	}
+	new->e_block = bh->b_blocknr;
+	new->e_hash = hash;
+
+	chain = next3_xattr_share_chain(share, hash);
+	spin_lock(&chain->c_lock);
+	hlist_for_each_entry(e, pos, &chain->c_head, e_node) {
+		if (e->e_block == new->e_block && e->e_hash == hash) {
+			spin_unlock(&chain->c_lock);
+			kmem_cache_free(next3_xattr_share_cachep, new);
+			ea_bdebug(bh, "already in cache");
+			return;
+		}
+		last = e;
+	}
+	if (chain->c_len >= NEXT3_XATTR_SHARE_CHAIN_MAX) {
+		/* drop the oldest block to keep the chain short */
+		hlist_del_rcu(&last->e_node);
+		call_rcu(&last->e_rcu, next3_xattr_share_free_rcu);
+	} else {
+		chain->c_len++;
+	}
+	hlist_add_head_rcu(&new->e_node, &chain->c_head);
+	spin_unlock(&chain->c_lock);
+	ea_bdebug(bh, "inserting [%x]", (int)hash);
 }
 
+/*
+ * next3_xattr_cache_remove()
+ *
+ * Remove xattr block @bh from the index.  Called with the buffer locked,
+ * before the block is freed or modified in place.
+ */
+static void
+next3_xattr_cache_remove(struct super_block *sb, struct buffer_head *bh)
+{
+	__u32 hash = le32_to_cpu(BHDR(bh)->h_hash);
+	struct next3_xattr_share *share;
+	struct next3_xattr_share_chain *chain;
+	struct next3_xattr_share_entry *e;
+	struct hlist_node *pos;
+
+	share = ACCESS_ONCE(NEXT3_SB(sb)->s_xattr_share);
+	if (!share)
+		return;
+	smp_read_barrier_depends();
+	chain = next3_xattr_share_chain(share, hash);
+	spin_lock(&chain->c_lock);
+	hlist_for_each_entry(e, pos, &chain->c_head, e_node) {
+		if (e->e_block == bh->b_blocknr && e->e_hash == hash) {
+			hlist_del_rcu(&e->e_node);
+			chain->c_len--;
+			call_rcu(&e->e_rcu, next3_xattr_share_free_rcu);
+			break;
+		}
+	}
+	spin_unlock(&chain->c_lock);
+}
+#else
 /*
  * next3_xattr_cache_insert()
  *
@@ -1157,6 +1638,7 @@ next3_xattr_cache_insert(struct buffer_head *bh)
 		mb_cache_entry_release(ce);
 	}
 }
+#endif
 
 /*
  * next3_xattr_cmp()
@@ -1198,6 +1680,65 @@ next3_xattr_cmp(struct next3_xattr_header *header1,
 	return 0;
 }
 
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+/*
+ * next3_xattr_cache_find()
+ *
+ * Find an identical extended attribute block.  The candidate blocks are
+ * collected under RCU and read and compared after leaving it.
+ *
+ * Returns a pointer to the block found, or NULL if such a block was
+ * not found or an error occurred.
+ */
+static struct buffer_head *
+next3_xattr_cache_find(struct inode *inode, struct next3_xattr_header *header)
+{
+	__u32 hash = le32_to_cpu(header->h_hash);
+	sector_t blocks[NEXT3_XATTR_SHARE_CHAIN_MAX];
+	struct next3_xattr_share *share;
+	struct next3_xattr_share_entry *e;
+	struct hlist_node *pos;
+	int i, n = 0;
+
+	if (!header->h_hash)
+		return NULL;  /* never share */
+	ea_idebug(inode, "looking for cached blocks [%x]", (int)hash);
+	rcu_read_lock();
+	share = rcu_dereference(NEXT3_SB(inode->i_sb)->s_xattr_share);
+	if (share) {
+		hlist_for_each_entry_rcu(e, pos,
+			&next3_xattr_share_chain(share, hash)->c_head, e_node) {
+			if (e->e_hash != hash)
+				continue;
+			blocks[n++] = e->e_block;
+			if (n == NEXT3_XATTR_SHARE_CHAIN_MAX)
+				break;
+		}
+	}
+	rcu_read_unlock();
+
+	for (i = 0; i < n; i++) {
+		struct buffer_head *bh;
+
+		bh = sb_bread(inode->i_sb, blocks[i]);
+		if (!bh) {
+			next3_error(inode->i_sb, __func__,
+				"inode %lu: block %lu read error",
+				inode->i_ino, (unsigned long) blocks[i]);
+		} else if (le32_to_cpu(BHDR(bh)->h_refcount) >=
+				NEXT3_XATTR_REFCOUNT_MAX) {
+			ea_idebug(inode, "block %lu refcount %d>=%d",
+				  (unsigned long) blocks[i],
+				  le32_to_cpu(BHDR(bh)->h_refcount),
+					  NEXT3_XATTR_REFCOUNT_MAX);
+		} else if (next3_xattr_cmp(header, BHDR(bh)) == 0) {
+			return bh;
+		}
+		brelse(bh);
+	}
+	return NULL;
+}
+#else
 /*
  * next3_xattr_cache_find()
  *
@@ -1247,6 +1788,7 @@ again:
 	}
 	return NULL;
 }
+#endif
 
 #define NAME_HASH_SHIFT 5
 #define VALUE_HASH_SHIFT 16
@@ -1319,18 +1861,36 @@ static void next3_xattr_rehash(struct next3_xattr_header *header,
 int __init
 init_next3_xattr(void)
 {
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	next3_xattr_share_cachep = kmem_cache_create("next3_xattr_share",
+				sizeof(struct next3_xattr_share_entry), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!next3_xattr_share_cachep)
+		return -ENOMEM;
+	return 0;
+#else
 	next3_xattr_cache = mb_cache_create("next3_xattr", NULL,
 		sizeof(struct mb_cache_entry) +
 		sizeof(((struct mb_cache_entry *) 0)->e_indexes[0]), 1, 6);
 	if (!next3_xattr_cache)
 		return -ENOMEM;
 	return 0;
+#endif
 }
 
 void
 exit_next3_xattr(void)
 {
+#ifdef CONFIG_NEXT3_FS_XATTR_SHARE
+	if (next3_xattr_share_cachep) {
+		/* wait for entries freed by call_rcu() */
+		rcu_barrier();
+		kmem_cache_destroy(next3_xattr_share_cachep);
+	}
+	next3_xattr_share_cachep = NULL;
+#else
 	if (next3_xattr_cache)
 		mb_cache_destroy(next3_xattr_cache);
 	next3_xattr_cache = NULL;
+#endif
 }
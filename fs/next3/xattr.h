@@ -72,6 +72,9 @@ extern int next3_xattr_set_handle(handle_t *, struct inode *, int, const char *,
 
 extern void next3_xattr_delete_inode(handle_t *, struct inode *);
 extern void next3_xattr_put_super(struct super_block *);
+#ifdef CONFIG_NEXT3_FS_XATTR_INDEX
+extern void next3_xattr_names_free(struct inode *);
+#endif
 
 extern int init_next3_xattr(void);
 extern void exit_next3_xattr(void);
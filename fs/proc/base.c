@@ -2530,14 +2530,20 @@ static int do_io_accounting(struct task_struct *task, char *buffer, int whole)
 			"syscw: %llu\n"
 			"read_bytes: %llu\n"
 			"write_bytes: %llu\n"
-			"cancelled_write_bytes: %llu\n",
+			"cancelled_write_bytes: %llu\n"
+			"snapshot_cow_blocks: %llu\n"
+			"snapshot_move_blocks: %llu\n"
+			"snapshot_write_bytes: %llu\n",
 			(unsigned long long)acct.rchar,
 			(unsigned long long)acct.wchar,
 			(unsigned long long)acct.syscr,
 			(unsigned long long)acct.syscw,
 			(unsigned long long)acct.read_bytes,
 			(unsigned long long)acct.write_bytes,
-			(unsigned long long)acct.cancelled_write_bytes);
+			(unsigned long long)acct.cancelled_write_bytes,
+			(unsigned long long)acct.snapshot_cow_blocks,
+			(unsigned long long)acct.snapshot_move_blocks,
+			(unsigned long long)acct.snapshot_write_bytes);
 }
 
 static int proc_tid_io_accounting(struct task_struct *task, char *buffer)
@@ -1,6 +1,8 @@
 #ifndef BLK_IOPOLL_H
 #define BLK_IOPOLL_H
 
+#include <linux/hrtimer.h>
+
 struct blk_iopoll;
 typedef int (blk_iopoll_fn)(struct blk_iopoll *, int);
 
@@ -11,6 +13,11 @@ struct blk_iopoll {
 	int weight;
 	int max;
 	blk_iopoll_fn *poll;
+	int weight_max;		/* weight passed to blk_iopoll_init() */
+	int avg_work;		/* completions per poll, fixed point << 4 */
+	u64 ns_per_work;	/* ns per completion in polled mode */
+	u64 last_poll_ns;	/* time of last poll in polled mode or 0 */
+	struct hrtimer timer;	/* hybrid mode poll delay */
 };
 
 enum {
@@ -44,5 +51,8 @@ extern void blk_iopoll_enable(struct blk_iopoll *);
 extern void blk_iopoll_disable(struct blk_iopoll *);
 
 extern int blk_iopoll_enabled;
+extern int blk_iopoll_budget;
+extern int blk_iopoll_adaptive;
+extern int blk_iopoll_hybrid_usecs;
 
 #endif
@@ -28,6 +28,8 @@ struct request_queue;
 struct elevator_queue;
 struct request_pm_state;
 struct blk_trace;
+struct blk_percpu_submit;
+struct blk_comp_map;
 struct request;
 struct sg_io_hdr;
 
@@ -368,6 +370,19 @@ struct request_queue
 	unsigned long		unplug_delay;	/* After this many jiffies */
 	struct work_struct	unplug_work;
 
+	/*
+	 * Per-cpu batching of async write bios
+	 */
+	struct blk_percpu_submit __percpu *percpu_submit;
+	unsigned int		percpu_submit_batch;
+	atomic_t		percpu_submit_pending;
+	struct work_struct	percpu_submit_work;
+
+	/*
+	 * Completion CPU steering map, RCU protected
+	 */
+	struct blk_comp_map	*comp_map;
+
 	struct backing_dev_info	backing_dev_info;
 
 	/*
@@ -467,6 +482,7 @@ struct request_queue
 #define QUEUE_FLAG_IO_STAT     15	/* do IO stats */
 #define QUEUE_FLAG_DISCARD     16	/* supports DISCARD */
 #define QUEUE_FLAG_NOXMERGES   17	/* No extended merges */
+#define QUEUE_FLAG_SAME_FORCE  18	/* force complete on submitting CPU */
 
 #define QUEUE_FLAG_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
 				 (1 << QUEUE_FLAG_CLUSTER) |		\
@@ -836,6 +852,9 @@ extern int blk_execute_rq(struct request_queue *, struct gendisk *,
 			  struct request *, int);
 extern void blk_execute_rq_nowait(struct request_queue *, struct gendisk *,
 				  struct request *, int, rq_end_io_fn *);
+extern void blk_execute_rq_list_nowait(struct request_queue *,
+				struct gendisk *, struct list_head *, int,
+				rq_end_io_fn *);
 extern void blk_unplug(struct request_queue *q);
 
 static inline struct request_queue *bdev_get_queue(struct block_device *bdev)
@@ -1015,6 +1034,18 @@ extern int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 		sector_t nr_sects, gfp_t gfp_mask, unsigned long flags);
 extern int blkdev_issue_zeroout(struct block_device *bdev, sector_t sector,
 			sector_t nr_sects, gfp_t gfp_mask, unsigned long flags);
+
+/* zeroouts of many ranges in flight at the same time */
+struct blk_zeroout_batch {
+	atomic_t		pending;
+	unsigned long		flags;
+	struct completion	done;
+};
+extern void blk_zeroout_batch_init(struct blk_zeroout_batch *zb);
+extern int blkdev_issue_zeroout_async(struct block_device *bdev,
+			sector_t sector, sector_t nr_sects, gfp_t gfp_mask,
+			struct blk_zeroout_batch *zb);
+extern int blk_zeroout_batch_wait(struct blk_zeroout_batch *zb);
 static inline int sb_issue_discard(struct super_block *sb,
 				   sector_t block, sector_t nr_blocks)
 {
@@ -85,6 +85,7 @@ struct disk_stats {
 	unsigned long ticks[2];
 	unsigned long io_ticks;
 	unsigned long time_in_queue;
+	int in_flight[2];		/* local delta, see part_in_flight() */
 };
 	
 struct hd_struct {
@@ -99,7 +100,6 @@ struct hd_struct {
 	int make_it_fail;
 #endif
 	unsigned long stamp;
-	int in_flight[2];
 #ifdef	CONFIG_SMP
 	struct disk_stats __percpu *dkstats;
 #else
@@ -323,23 +323,32 @@ static inline void free_part_stats(struct hd_struct *part)
 #define part_stat_sub(cpu, gendiskp, field, subnd)			\
 	part_stat_add(cpu, gendiskp, field, -subnd)
 
-static inline void part_inc_in_flight(struct hd_struct *part, int rw)
+/*
+ * The in flight counters are per-cpu like the other stats, so a request
+ * that completes on another cpu than it was started on leaves a negative
+ * count on the completion cpu.  Only the sum over all cpus is meaningful.
+ */
+static inline void part_inc_in_flight(int cpu, struct hd_struct *part, int rw)
+{
+	part_stat_inc(cpu, part, in_flight[rw]);
+}
+
+static inline void part_dec_in_flight(int cpu, struct hd_struct *part, int rw)
 {
-	part->in_flight[rw]++;
-	if (part->partno)
-		part_to_disk(part)->part0.in_flight[rw]++;
+	part_stat_dec(cpu, part, in_flight[rw]);
 }
 
-static inline void part_dec_in_flight(struct hd_struct *part, int rw)
+static inline int part_in_flight_rw(struct hd_struct *part, int rw)
 {
-	part->in_flight[rw]--;
-	if (part->partno)
-		part_to_disk(part)->part0.in_flight[rw]--;
+	int in_flight = part_stat_read(part, in_flight[rw]);
+
+	/* the sum is not atomic and may be off while requests move */
+	return in_flight > 0 ? in_flight : 0;
 }
 
 static inline int part_in_flight(struct hd_struct *part)
 {
-	return part->in_flight[0] + part->in_flight[1];
+	return part_in_flight_rw(part, READ) + part_in_flight_rw(part, WRITE);
 }
 
 /* block/blk-core.c */
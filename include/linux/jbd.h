@@ -32,6 +32,9 @@
 #include <linux/timer.h>
 #include <linux/lockdep.h>
 #include <linux/slab.h>
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+#include <linux/workqueue.h>
+#endif
 
 #define journal_oom_retry 1
 
@@ -147,6 +150,32 @@ typedef struct journal_header_s
 	__be32		h_sequence;
 } journal_header_t;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+/*
+ * Checksum types.
+ */
+#define JFS_CRC32_CHKSUM   1
+
+#define JFS_CRC32_CHKSUM_SIZE 4
+
+#define JFS_CHECKSUM_BYTES (32 / sizeof(u32))
+/*
+ * Commit block header for storing transactional checksums
+ * (same on-disk format as JBD2):
+ */
+struct commit_header {
+	__be32		h_magic;
+	__be32          h_blocktype;
+	__be32          h_sequence;
+	unsigned char   h_chksum_type;
+	unsigned char   h_chksum_size;
+	unsigned char 	h_padding[2];
+	__be32 		h_chksum[JFS_CHECKSUM_BYTES];
+	__be64		h_commit_sec;
+	__be32		h_commit_nsec;
+};
+#endif
+
 
 /*
  * The block tag: used to describe a single buffer in the journal
@@ -233,12 +262,26 @@ typedef struct journal_superblock_s
 	((j)->j_format_version >= 2 &&					\
 	 ((j)->j_superblock->s_feature_incompat & cpu_to_be32((mask))))
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#define JFS_FEATURE_COMPAT_CHECKSUM	0x00000001
+
+#endif
 #define JFS_FEATURE_INCOMPAT_REVOKE	0x00000001
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#define JFS_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
+#endif
 
 /* Features known to this kernel version: */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+#define JFS_KNOWN_COMPAT_FEATURES	JFS_FEATURE_COMPAT_CHECKSUM
+#define JFS_KNOWN_ROCOMPAT_FEATURES	0
+#define JFS_KNOWN_INCOMPAT_FEATURES	(JFS_FEATURE_INCOMPAT_REVOKE | \
+					 JFS_FEATURE_INCOMPAT_ASYNC_COMMIT)
+#else
 #define JFS_KNOWN_COMPAT_FEATURES	0
 #define JFS_KNOWN_ROCOMPAT_FEATURES	0
 #define JFS_KNOWN_INCOMPAT_FEATURES	JFS_FEATURE_INCOMPAT_REVOKE
+#endif
 
 #ifdef __KERNEL__
 
@@ -335,6 +378,47 @@ static inline void jbd_unlock_bh_journal_head(struct buffer_head *bh)
 
 struct jbd_revoke_table_s;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+/* Flags in jbd_inode->i_flags */
+#define __JI_COMMIT_RUNNING 0
+#define JI_COMMIT_RUNNING (1 << __JI_COMMIT_RUNNING)
+
+/**
+ * struct jbd_inode - an inode with ordered data in a transaction
+ * @i_transaction: transaction whose commit writes out the inode data
+ * @i_next_transaction: transaction to move the inode to, when the inode
+ *	is filed while @i_transaction is committing
+ * @i_list: entry in the inode list of @i_transaction
+ * @i_vfs_inode: the inode
+ * @i_flags: JI_COMMIT_RUNNING while commit writes out the inode data
+ * @i_dirty_start: first byte of the dirty range
+ * @i_dirty_end: end of the dirty range, 0 if there is no dirty range
+ *
+ * All fields but @i_vfs_inode are protected by j_list_lock.
+ */
+struct jbd_inode {
+	transaction_t *i_transaction;
+	transaction_t *i_next_transaction;
+	struct list_head i_list;
+	struct inode *i_vfs_inode;
+	unsigned long i_flags;
+	loff_t i_dirty_start;
+	loff_t i_dirty_end;
+};
+
+#endif
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+/* Maximum number of dirty dquots queued on a handle (e.g. chown of 2 owners) */
+#define JBD_HANDLE_DQUOTS	4
+
+struct dquot;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+/* Maximum number of dirty inodes queued on a handle (e.g. rename of 4) */
+#define JBD_HANDLE_INODES	4
+
+struct inode;
+#endif
 /**
  * struct handle_s - this is the concrete type associated with handle_t.
  * @h_transaction: Which compound transaction is this update a part of?
@@ -381,6 +465,25 @@ struct handle_s
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	struct lockdep_map	h_lockdep_map;
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+
+	/* Quota of blocks moved to snapshot, not yet freed: */
+	struct inode	*h_dquot_inode;	/* owner of moved blocks */
+	unsigned int	h_dquot_moved;	/* no. of moved blocks */
+#endif
+#ifdef CONFIG_NEXT3_FS_QUOTA_WRITE_BATCH
+
+	/* Dirty dquots to write to the quota file before the handle ends: */
+	struct dquot	*h_dquots[JBD_HANDLE_DQUOTS];
+	unsigned int	h_dquots_count;
+#endif
+#ifdef CONFIG_NEXT3_FS_INODE_UPDATE_BATCH
+
+	/* Dirty inodes to copy to the inode table before the handle ends: */
+	struct inode	*h_inodes[JBD_HANDLE_INODES];
+	unsigned int	h_inodes_count;
+	unsigned int	h_inodes_dirty;	/* h_inodes to copy (bitmap) */
+#endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
 
 #ifdef CONFIG_JBD_DEBUG
@@ -404,6 +507,60 @@ typedef struct handle_s		next3_handle_t;	/* Next3 COW handle */
 #endif
 #endif
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+#ifdef CONFIG_JBD_DEBUG
+/*
+ * Snapshot COW counters of all the handles of a transaction,
+ * summed from the handles h_cow_* fields on journal_stop().
+ */
+struct transaction_cow_stats_s {
+	unsigned long		cs_moved;
+	unsigned long		cs_copied;
+	unsigned long		cs_ok_jh;
+	unsigned long		cs_ok_bitmap;
+	unsigned long		cs_ok_mapped;
+	unsigned long		cs_bitmaps;
+	unsigned long		cs_excluded;
+};
+#endif
+#endif
+
+/*
+ * Some stats for the run phases of a transaction (in jiffies)
+ */
+struct transaction_run_stats_s {
+	unsigned long		rs_wait;
+	unsigned long		rs_running;
+	unsigned long		rs_locked;
+	unsigned long		rs_flushing;
+	unsigned long		rs_logging;
+
+	__u32			rs_handle_count;
+	__u32			rs_blocks;
+	__u32			rs_blocks_logged;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+#ifdef CONFIG_JBD_DEBUG
+	struct transaction_cow_stats_s rs_cow;
+#endif
+#endif
+};
+
+struct transaction_stats_s {
+	unsigned long		ts_tid;
+	struct transaction_run_stats_s run;
+};
+
+static inline unsigned long
+jbd_time_diff(unsigned long start, unsigned long end)
+{
+	if (end >= start)
+		return end - start;
+
+	return end + (MAX_JIFFY_OFFSET - start);
+}
+
+#endif
 /* The transaction_t type is the guts of the journaling mechanism.  It
  * tracks a compound transaction through its various states:
  *
@@ -497,6 +654,14 @@ struct transaction_s
 	 */
 	struct journal_head	*t_sync_datalist;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+	/*
+	 * List of inodes whose data has to be written out before this
+	 * transaction can be committed [j_list_lock]
+	 */
+	struct list_head	t_inode_list;
+#endif
+
 	/*
 	 * Doubly-linked circular list of all forget buffers (superseded
 	 * buffers which we can un-checkpoint once this transaction commits)
@@ -540,6 +705,19 @@ struct transaction_s
 	 */
 	spinlock_t		t_handle_lock;
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/*
+	 * Number of outstanding updates running on this transaction
+	 * [none]
+	 */
+	atomic_t		t_updates;
+
+	/*
+	 * Number of buffers reserved for use by all handles in this transaction
+	 * handle but not yet modified. [none]
+	 */
+	atomic_t		t_outstanding_credits;
+#else
 	/*
 	 * Number of outstanding updates running on this transaction
 	 * [t_handle_lock]
@@ -551,6 +729,16 @@ struct transaction_s
 	 * handle but not yet modified. [t_handle_lock]
 	 */
 	int			t_outstanding_credits;
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+
+	/*
+	 * Number of reserved buffers (included in t_outstanding_credits),
+	 * which are not owned by any handle and are shared by all handles
+	 * of this transaction for snapshot COW operations. [t_handle_lock]
+	 */
+	int			t_cow_credits;
+#endif
 
 	/*
 	 * Forward and backward links for the circular list of all transactions
@@ -568,11 +756,47 @@ struct transaction_s
 	 * When this transaction started, in nanoseconds [no locking]
 	 */
 	ktime_t			t_start_time;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+
+	/*
+	 * When this transaction started running, in jiffies.  Reused by
+	 * commit to time the logging phase. [no locking]
+	 */
+	unsigned long		t_start;
+
+	/*
+	 * Longest time a handle waited to join this transaction,
+	 * in jiffies [t_handle_lock]
+	 */
+	unsigned long		t_max_wait;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_TRACE
+#ifdef CONFIG_JBD_DEBUG
+
+	/*
+	 * Snapshot COW counters of the stopped handles [t_handle_lock]
+	 */
+	struct transaction_cow_stats_s t_cow_stats;
+#endif
+#endif
+#endif
+
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+	/*
+	 * How many handles used this transaction? [none]
+	 */
+	atomic_t t_handle_count;
 
+	/*
+	 * Handles start without j_state_lock, so a dropped transaction
+	 * is only freed after an RCU grace period.
+	 */
+	struct rcu_head		t_rcu;
+#else
 	/*
 	 * How many handles used this transaction? [t_handle_lock]
 	 */
 	int t_handle_count;
+#endif
 
 	/*
 	 * This transaction is being forced and some process is
@@ -604,6 +828,9 @@ struct transaction_s
  * @j_wait_commit: Wait queue to trigger commit
  * @j_wait_updates: Wait queue to wait for updates to complete
  * @j_checkpoint_mutex: Mutex for locking against concurrent checkpoints
+ * @j_chkpt_bhs: Buffers of the checkpoint write batch
+ * @j_chkpt_batch: Current size limit of the checkpoint write batch
+ * @j_checkpoint_work: Background checkpoint below the free space watermark
  * @j_head: Journal head - identifies the first unused block in the journal
  * @j_tail: Journal tail - identifies the oldest still-used block in the
  *  journal.
@@ -644,8 +871,29 @@ struct transaction_s
  * @j_average_commit_time: the average amount of time in nanoseconds it
  *	takes to commit a transaction to the disk.
  * @j_private: An opaque pointer to fs-private information.
+ * @j_submit_data_callback: called by commit before the data buffers of the
+ *	committing transaction are written out
+ * @j_devname: journal device name, used in the procfs statistics entry
+ * @j_proc_entry: procfs entry for the jbd statistics directory
+ * @j_stats: Overall statistics
+ * @j_history_lock: Protect the statistics
  */
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+/* Maximum number of buffers written by a single checkpoint batch */
+#define JBD_MAX_CHKPT_BATCH	256
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+/* Maximum number of journal_heads kept in the journal_head reserve */
+#define JBD_MAX_JH_RESERVE	256
+
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+/* Maximum number of free frozen buffers kept in the frozen buffer pool */
+#define JBD_MAX_FROZEN_POOL	64
+
+#endif
 struct journal_s
 {
 	/* General journaling state flags [j_state_lock] */
@@ -718,6 +966,22 @@ struct journal_s
 
 	/* Semaphore for locking against concurrent checkpoints */
 	struct mutex		j_checkpoint_mutex;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+
+	/*
+	 * Buffers of the checkpoint write batch and the current batch size
+	 * limit, which grows while a checkpoint makes progress.
+	 * [j_checkpoint_mutex]
+	 */
+	struct buffer_head	*j_chkpt_bhs[JBD_MAX_CHKPT_BATCH];
+	int			j_chkpt_batch;
+
+	/*
+	 * Checkpoint work, queued by kjournald when the free log space
+	 * drops below the low watermark.
+	 */
+	struct work_struct	j_checkpoint_work;
+#endif
 
 	/*
 	 * Journal head: identifies the first unused block in the journal.
@@ -765,6 +1029,26 @@ struct journal_s
 	 * Protects the buffer lists and internal buffer state.
 	 */
 	spinlock_t		j_list_lock;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+
+	/*
+	 * Reserve of free journal_heads, chained on b_tnext, and its size.
+	 * [j_jh_reserve_lock]
+	 */
+	spinlock_t		j_jh_reserve_lock;
+	struct journal_head	*j_jh_reserve;
+	int			j_jh_reserved;
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+
+	/*
+	 * Pool of free block sized buffers for frozen and committed data,
+	 * chained on their first word, and its size. [j_frozen_lock]
+	 */
+	spinlock_t		j_frozen_lock;
+	void			*j_frozen_pool;
+	int			j_frozen_count;
+#endif
 
 	/* Optional inode where we store the journal.  If present, all */
 	/* journal block numbers are mapped into this inode via */
@@ -843,12 +1127,51 @@ struct journal_s
 	 * transaction to the disk.  [j_state_lock]
 	 */
 	u64			j_average_commit_time;
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ADAPTIVE_COMMIT
+
+	/*
+	 * Bounds of the adaptive commit interval, in jiffies.  When
+	 * j_max_commit_interval is 0, j_commit_interval is fixed.
+	 * [j_state_lock]
+	 */
+	unsigned long		j_min_commit_interval;
+	unsigned long		j_max_commit_interval;
+#endif
 
 	/*
 	 * An opaque pointer to fs-private information.  ext3 puts its
 	 * superblock pointer here
 	 */
 	void *j_private;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_RACE_COW_BATCH
+
+	/*
+	 * Called by kjournald before the data buffers of the committing
+	 * transaction are written out, so the fs can submit data writes that
+	 * it deferred and that the commit is going to wait on.
+	 */
+	void (*j_submit_data_callback)(journal_t *journal,
+				       transaction_t *transaction);
+#endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_RUN_STATS
+
+	/*
+	 * Journal device name, followed by the journal inode number for an
+	 * internal journal.  Names the /proc/fs/jbd/ statistics directory.
+	 */
+	char			j_devname[BDEVNAME_SIZE+24];
+
+	/*
+	 * procfs statistics directory of this journal
+	 */
+	struct proc_dir_entry	*j_proc_entry;
+
+	/*
+	 * Overall statistics of the committed transactions [j_history_lock]
+	 */
+	struct transaction_stats_s j_stats;
+	spinlock_t		j_history_lock;
+#endif
 };
 
 /*
@@ -863,6 +1186,9 @@ struct journal_s
 #define JFS_ABORT_ON_SYNCDATA_ERR	0x040  /* Abort the journal on file
 						* data write error in ordered
 						* mode */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+#define JFS_PMEM	0x080	/* Write the log through direct_access */
+#endif
 
 /*
  * Function declarations for the journaling transaction and buffer
@@ -926,10 +1252,22 @@ static inline handle_t *journal_current_handle(void)
 extern handle_t *journal_start(journal_t *, int nblocks);
 extern int	 journal_restart (handle_t *, int nblocks);
 extern int	 journal_extend (handle_t *, int nblocks);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CREDITS_POOL
+extern int	 journal_draw_credits(handle_t *, int nblocks);
+extern void	 journal_fill_credits(handle_t *, int nblocks);
+#endif
 extern int	 journal_get_write_access(handle_t *, struct buffer_head *);
 extern int	 journal_get_create_access (handle_t *, struct buffer_head *);
 extern int	 journal_get_undo_access(handle_t *, struct buffer_head *);
 extern int	 journal_dirty_data (handle_t *, struct buffer_head *);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_ORDERED_INODE
+extern int	 journal_file_inode(handle_t *, struct jbd_inode *,
+				    loff_t start, loff_t len);
+extern int	 journal_begin_ordered_truncate(journal_t *, struct jbd_inode *,
+						loff_t new_size);
+extern void	 journal_init_jbd_inode(struct jbd_inode *, struct inode *);
+extern void	 journal_release_jbd_inode(journal_t *, struct jbd_inode *);
+#endif
 extern int	 journal_dirty_metadata (handle_t *, struct buffer_head *);
 extern void	 journal_release_buffer (handle_t *, struct buffer_head *);
 extern int	 journal_forget (handle_t *, struct buffer_head *);
@@ -946,6 +1284,9 @@ extern journal_t * journal_init_dev(struct block_device *bdev,
 				struct block_device *fs_dev,
 				int start, int len, int bsize);
 extern journal_t * journal_init_inode (struct inode *);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_PMEM
+extern int	   journal_pmem_write_bh(journal_t *, struct buffer_head *);
+#endif
 extern int	   journal_update_format (journal_t *);
 extern int	   journal_check_used_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
@@ -953,6 +1294,10 @@ extern int	   journal_check_available_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
 extern int	   journal_set_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKSUM
+extern void	   journal_clear_features
+		   (journal_t *, unsigned long, unsigned long, unsigned long);
+#endif
 extern int	   journal_create     (journal_t *);
 extern int	   journal_load       (journal_t *journal);
 extern int	   journal_destroy    (journal_t *);
@@ -970,7 +1315,23 @@ extern int	   journal_force_commit(journal_t *);
 /*
  * journal_head management
  */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_JH_RESERVE
+struct journal_head *__journal_add_journal_head(journal_t *journal,
+						struct buffer_head *bh);
+#define journal_add_journal_head(bh) __journal_add_journal_head(NULL, (bh))
+void journal_fill_jh_reserve(journal_t *journal, int nblocks);
+#else
 struct journal_head *journal_add_journal_head(struct buffer_head *bh);
+#endif
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FROZEN_POOL
+
+/*
+ * frozen buffer pool
+ */
+void *journal_get_frozen(journal_t *journal, size_t size);
+void *journal_alloc_frozen(journal_t *journal, size_t size, gfp_t flags);
+void journal_free_frozen(journal_t *journal, void *ptr, size_t size);
+#endif
 struct journal_head *journal_grab_journal_head(struct buffer_head *bh);
 void journal_remove_journal_head(struct buffer_head *bh);
 void journal_put_journal_head(struct journal_head *jh);
@@ -992,6 +1353,9 @@ static inline void jbd_free_handle(handle_t *handle)
 
 /* Primary revoke support */
 #define JOURNAL_REVOKE_DEFAULT_HASH 256
+#ifdef CONFIG_NEXT3_FS_JOURNAL_REVOKE_HASH
+#define JOURNAL_REVOKE_MAX_HASH (1 << 15)
+#endif
 extern int	   journal_init_revoke(journal_t *, int);
 extern void	   journal_destroy_revoke_caches(void);
 extern int	   journal_init_revoke_caches(void);
@@ -1017,6 +1381,9 @@ extern void	journal_switch_revoke_table(journal_t *journal);
  */
 
 int __log_space_left(journal_t *); /* Called with journal locked */
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+int log_space_left_nolock(journal_t *);
+#endif
 int log_start_commit(journal_t *journal, tid_t tid);
 int __log_start_commit(journal_t *journal, tid_t tid);
 int journal_start_commit(journal_t *journal, tid_t *tid);
@@ -1026,6 +1393,12 @@ int log_do_checkpoint(journal_t *journal);
 int journal_trans_will_send_data_barrier(journal_t *journal, tid_t tid);
 
 void __log_wait_for_space(journal_t *journal);
+#ifdef CONFIG_NEXT3_FS_JOURNAL_CHECKPOINT_BATCH
+void log_kick_checkpoint(journal_t *journal);
+extern void	journal_checkpoint_work(struct work_struct *work);
+extern int	journal_init_checkpoint_wq(void);
+extern void	journal_destroy_checkpoint_wq(void);
+#endif
 extern void	__journal_drop_transaction(journal_t *, transaction_t *);
 extern int	cleanup_journal_tail(journal_t *);
 
@@ -1084,6 +1457,22 @@ static inline int tid_geq(tid_t x, tid_t y)
 
 extern int journal_blocks_per_page(struct inode *inode);
 
+#ifdef CONFIG_NEXT3_FS_JOURNAL_FAST_HANDLES
+/*
+ * Return the minimum number of blocks which must be free in the journal
+ * before a new transaction may be started.  Must be called under
+ * j_state_lock, or under rcu_read_lock() for a hint that may be stale.
+ */
+static inline int jbd_space_needed(journal_t *journal)
+{
+	transaction_t *committing =
+		ACCESS_ONCE(journal->j_committing_transaction);
+	int nblocks = journal->j_max_transaction_buffers;
+	if (committing)
+		nblocks += atomic_read(&committing->t_outstanding_credits);
+	return nblocks;
+}
+#else
 /*
  * Return the minimum number of blocks which must be free in the journal
  * before a new transaction may be started.  Must be called under j_state_lock.
@@ -1096,6 +1485,7 @@ static inline int jbd_space_needed(journal_t *journal)
 					t_outstanding_credits;
 	return nblocks;
 }
+#endif
 
 /*
  * Definitions which augment the buffer_head layer
@@ -130,6 +130,7 @@ typedef struct journal_s	journal_t;	/* Journal control structure */
 #define JBD2_SUPERBLOCK_V1	3
 #define JBD2_SUPERBLOCK_V2	4
 #define JBD2_REVOKE_BLOCK	5
+#define JBD2_FC_BLOCK		6
 
 /*
  * Standard header for all descriptor blocks:
@@ -192,6 +193,21 @@ typedef struct jbd2_journal_revoke_header_s
 	__be32		 r_count;	/* Count of bytes used in the block */
 } jbd2_journal_revoke_header_t;
 
+/*
+ * The fast commit block: written to the fast commit area at the end of the
+ * journal to make fsync durable without committing the running transaction.
+ * h_sequence is the running transaction ID.  The payload is opaque to the
+ * journal and is replayed by the file system after the log is recovered,
+ * if the transaction did not commit.
+ */
+typedef struct jbd2_fc_header_s
+{
+	journal_header_t fc_header;
+	__be32		 fc_index;	/* Block index in fast commit area */
+	__be32		 fc_len;	/* Count of bytes used in the block */
+	__be32		 fc_checksum;	/* crc32_be of used bytes */
+} jbd2_fc_header_t;
+
 
 /* Definitions for the journal tag flags word: */
 #define JBD2_FLAG_ESCAPE		1	/* on-disk block is escaped */
@@ -241,7 +257,10 @@ typedef struct journal_superblock_s
 	__be32	s_max_trans_data;	/* Limit of data blocks per trans. */
 
 /* 0x0050 */
-	__u32	s_padding[44];
+	__u32	s_padding[42];
+/* 0x00F8 */
+	__be32	s_fc_blocks;		/* Number of fast commit blocks */
+	__u32	s_padding2;
 
 /* 0x0100 */
 	__u8	s_users[16*48];		/* ids of all fs'es sharing the log */
@@ -263,13 +282,21 @@ typedef struct journal_superblock_s
 #define JBD2_FEATURE_INCOMPAT_REVOKE		0x00000001
 #define JBD2_FEATURE_INCOMPAT_64BIT		0x00000002
 #define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
+/*
+ * The fast commit area format of this kernel is not the one of upstream
+ * jbd2 fast commits, so it has its own feature bit and superblock field,
+ * well clear of the upstream ones.  Tools that don't know the bit refuse
+ * to replay the journal, instead of misparsing the fast commit area.
+ */
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT	0x00010000
 
 /* Features known to this kernel version: */
 #define JBD2_KNOWN_COMPAT_FEATURES	JBD2_FEATURE_COMPAT_CHECKSUM
 #define JBD2_KNOWN_ROCOMPAT_FEATURES	0
 #define JBD2_KNOWN_INCOMPAT_FEATURES	(JBD2_FEATURE_INCOMPAT_REVOKE | \
 					JBD2_FEATURE_INCOMPAT_64BIT | \
-					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)
+					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT | \
+					JBD2_FEATURE_INCOMPAT_FAST_COMMIT)
 
 #ifdef __KERNEL__
 
@@ -435,6 +462,12 @@ struct handle_s
 	unsigned int	h_sync:		1;	/* sync-on-close */
 	unsigned int	h_jdata:	1;	/* force data journaling */
 	unsigned int	h_aborted:	1;	/* fatal error on handle */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT
+	unsigned int	h_cowing:	1;	/* COWing to ext4 snapshot */
+
+	/* Credits reserved for COW to ext4 snapshot */
+	int			h_cow_credits;
+#endif
 
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	struct lockdep_map	h_lockdep_map;
@@ -849,6 +882,17 @@ struct journal_s
 	unsigned long		j_first;
 	unsigned long		j_last;
 
+	/*
+	 * Fast commit area: the block numbers of the first and one beyond the
+	 * last block of the fast commit area, at the end of the journal, the
+	 * next block to use in the area and the transaction that uses it.
+	 * [j_state_lock]
+	 */
+	unsigned long		j_fc_first;
+	unsigned long		j_fc_last;
+	unsigned long		j_fc_off;
+	tid_t			j_fc_tid;
+
 	/*
 	 * Device, blocksize and starting block offset for the location where we
 	 * store the journal.
@@ -962,6 +1006,13 @@ struct journal_s
 	void			(*j_commit_callback)(journal_t *,
 						     transaction_t *);
 
+	/*
+	 * This function is called on recovery for each valid fast commit
+	 * block of the transaction that did not commit
+	 */
+	int			(*j_fc_replay)(journal_t *,
+					       struct buffer_head *);
+
 	/*
 	 * Journal statistics
 	 */
@@ -1114,6 +1165,10 @@ extern int	   jbd2_journal_set_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
 extern void	   jbd2_journal_clear_features
 		   (journal_t *, unsigned long, unsigned long, unsigned long);
+extern int	   jbd2_fc_init(journal_t *, unsigned int);
+extern struct buffer_head *jbd2_fc_get_buf(journal_t *, tid_t);
+extern int	   jbd2_fc_write_buf(journal_t *, struct buffer_head *,
+				     unsigned int);
 extern int	   jbd2_journal_load       (journal_t *journal);
 extern int	   jbd2_journal_destroy    (journal_t *);
 extern int	   jbd2_journal_recover    (journal_t *journal);
@@ -95,6 +95,15 @@ struct journal_head {
 
 	/* Trigger type for the committing transaction's frozen data */
 	struct jbd2_buffer_trigger_type *b_frozen_triggers;
+#if defined(CONFIG_NEXT3_FS_SNAPSHOT_JOURNAL_CACHE_FIELD) || \
+	defined(CONFIG_EXT4_FS_SNAPSHOT)
+
+	/*
+	 * Last transaction in which the buffer was COWed to next3 or ext4
+	 * snapshot [jbd_lock_bh_state()]
+	 */
+	tid_t b_cow_tid;
+#endif
 };
 
 #endif		/* JOURNAL_HEAD_H_INCLUDED */
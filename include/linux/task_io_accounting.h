@@ -41,5 +41,14 @@ struct task_io_accounting {
 	 * information loss in doing that.
 	 */
 	u64 cancelled_write_bytes;
+
+	/*
+	 * Snapshot overhead which this task has caused: blocks copied to a
+	 * snapshot before being overwritten, blocks moved to a snapshot
+	 * instead of being freed, and the bytes written by the copies.
+	 */
+	u64 snapshot_cow_blocks;
+	u64 snapshot_move_blocks;
+	u64 snapshot_write_bytes;
 #endif /* CONFIG_TASK_IO_ACCOUNTING */
 };
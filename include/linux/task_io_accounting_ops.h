@@ -40,6 +40,22 @@ static inline void task_io_account_cancelled_write(size_t bytes)
 	current->ioac.cancelled_write_bytes += bytes;
 }
 
+/*
+ * Snapshot COW copies and moves are charged to the task that modified or
+ * freed the blocks.  Moves don't write data, they only remap blocks.
+ */
+static inline void task_io_account_snapshot_cow(unsigned long blocks,
+						size_t bytes)
+{
+	current->ioac.snapshot_cow_blocks += blocks;
+	current->ioac.snapshot_write_bytes += bytes;
+}
+
+static inline void task_io_account_snapshot_move(unsigned long blocks)
+{
+	current->ioac.snapshot_move_blocks += blocks;
+}
+
 static inline void task_io_accounting_init(struct task_io_accounting *ioac)
 {
 	memset(ioac, 0, sizeof(*ioac));
@@ -51,6 +67,9 @@ static inline void task_blk_io_accounting_add(struct task_io_accounting *dst,
 	dst->read_bytes += src->read_bytes;
 	dst->write_bytes += src->write_bytes;
 	dst->cancelled_write_bytes += src->cancelled_write_bytes;
+	dst->snapshot_cow_blocks += src->snapshot_cow_blocks;
+	dst->snapshot_move_blocks += src->snapshot_move_blocks;
+	dst->snapshot_write_bytes += src->snapshot_write_bytes;
 }
 
 #else
@@ -77,6 +96,15 @@ static inline void task_io_account_cancelled_write(size_t bytes)
 {
 }
 
+static inline void task_io_account_snapshot_cow(unsigned long blocks,
+						size_t bytes)
+{
+}
+
+static inline void task_io_account_snapshot_move(unsigned long blocks)
+{
+}
+
 static inline void task_io_accounting_init(struct task_io_accounting *ioac)
 {
 }
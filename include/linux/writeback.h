@@ -137,6 +137,9 @@ balance_dirty_pages_ratelimited(struct address_space *mapping)
 	balance_dirty_pages_ratelimited_nr(mapping, 1);
 }
 
+void account_fs_write_start(struct backing_dev_info *bdi, struct page *page);
+void account_fs_write_end(struct backing_dev_info *bdi, struct page *page);
+
 typedef int (*writepage_t)(struct page *page, struct writeback_control *wbc,
 				void *data);
 
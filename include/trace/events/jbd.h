@@ -0,0 +1,230 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM jbd
+
+#if !defined(_TRACE_JBD_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_JBD_H
+
+#include <linux/jbd.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(jbd_checkpoint,
+
+	TP_PROTO(journal_t *journal, int result),
+
+	TP_ARGS(journal, result),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	int,	result			)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->result		= result;
+	),
+
+	TP_printk("dev %d,%d result %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->result)
+);
+
+DECLARE_EVENT_CLASS(jbd_commit,
+
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	char,	sync_commit		)
+		__field(	int,	transaction		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->sync_commit = commit_transaction->t_synchronous_commit;
+		__entry->transaction	= commit_transaction->t_tid;
+	),
+
+	TP_printk("dev %d,%d transaction %d sync %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->transaction, __entry->sync_commit)
+);
+
+DEFINE_EVENT(jbd_commit, jbd_start_commit,
+
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction)
+);
+
+DEFINE_EVENT(jbd_commit, jbd_commit_locking,
+
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction)
+);
+
+DEFINE_EVENT(jbd_commit, jbd_commit_flushing,
+
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction)
+);
+
+DEFINE_EVENT(jbd_commit, jbd_commit_logging,
+
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction)
+);
+
+TRACE_EVENT(jbd_end_commit,
+	TP_PROTO(journal_t *journal, transaction_t *commit_transaction),
+
+	TP_ARGS(journal, commit_transaction),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	char,	sync_commit		)
+		__field(	int,	transaction		)
+		__field(	int,	head			)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->sync_commit = commit_transaction->t_synchronous_commit;
+		__entry->transaction	= commit_transaction->t_tid;
+		__entry->head		= journal->j_tail_sequence;
+	),
+
+	TP_printk("dev %d,%d transaction %d sync %d head %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->transaction, __entry->sync_commit, __entry->head)
+);
+
+TRACE_EVENT(jbd_start_transaction,
+	TP_PROTO(journal_t *journal, transaction_t *transaction),
+
+	TP_ARGS(journal, transaction),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	int,	transaction		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->transaction	= transaction->t_tid;
+	),
+
+	TP_printk("dev %d,%d transaction %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->transaction)
+);
+
+/* handles waiting for log space to be checkpointed */
+DECLARE_EVENT_CLASS(jbd__wait_for_space,
+	TP_PROTO(journal_t *journal, int nblocks, int space_left),
+
+	TP_ARGS(journal, nblocks, space_left),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	int,	nblocks			)
+		__field(	int,	space_left		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->nblocks	= nblocks;
+		__entry->space_left	= space_left;
+	),
+
+	TP_printk("dev %d,%d needed %d space_left %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->nblocks, __entry->space_left)
+);
+
+DEFINE_EVENT(jbd__wait_for_space, jbd_wait_for_space,
+	TP_PROTO(journal_t *journal, int nblocks, int space_left),
+
+	TP_ARGS(journal, nblocks, space_left)
+);
+
+DEFINE_EVENT(jbd__wait_for_space, jbd_wait_for_space_done,
+	TP_PROTO(journal_t *journal, int nblocks, int space_left),
+
+	TP_ARGS(journal, nblocks, space_left)
+);
+
+DECLARE_EVENT_CLASS(jbd__handle,
+	TP_PROTO(journal_t *journal, tid_t tid, int credits, int sync),
+
+	TP_ARGS(journal, tid, credits, sync),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	int,	transaction		)
+		__field(	int,	credits			)
+		__field(	int,	sync			)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->transaction	= tid;
+		__entry->credits	= credits;
+		__entry->sync		= sync;
+	),
+
+	TP_printk("dev %d,%d transaction %d credits %d sync %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->transaction, __entry->credits, __entry->sync)
+);
+
+/* credits requested by a handle that waits to join a transaction */
+DEFINE_EVENT(jbd__handle, jbd_handle_enter,
+	TP_PROTO(journal_t *journal, tid_t tid, int credits, int sync),
+
+	TP_ARGS(journal, tid, credits, sync)
+);
+
+/* credits requested by the handle */
+DEFINE_EVENT(jbd__handle, jbd_handle_start,
+	TP_PROTO(journal_t *journal, tid_t tid, int credits, int sync),
+
+	TP_ARGS(journal, tid, credits, sync)
+);
+
+/* credits left unused by the handle */
+DEFINE_EVENT(jbd__handle, jbd_handle_stop,
+	TP_PROTO(journal_t *journal, tid_t tid, int credits, int sync),
+
+	TP_ARGS(journal, tid, credits, sync)
+);
+
+TRACE_EVENT(jbd_revoke,
+	TP_PROTO(journal_t *journal, tid_t tid, unsigned int blocknr),
+
+	TP_ARGS(journal, tid, blocknr),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	int,		transaction	)
+		__field(	unsigned int,	blocknr		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= journal->j_fs_dev->bd_dev;
+		__entry->transaction	= tid;
+		__entry->blocknr	= blocknr;
+	),
+
+	TP_printk("dev %d,%d transaction %d block %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->transaction, __entry->blocknr)
+);
+
+#endif /* _TRACE_JBD_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,492 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM next3
+
+#if !defined(_TRACE_NEXT3_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NEXT3_H
+
+#include <linux/buffer_head.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Snapshot block group of a block.  next3 snapshots require 4K blocks,
+ * so there are always 32K blocks per group (SNAPSHOT_BLOCKS_PER_GROUP).
+ */
+#define NEXT3_TRACE_GROUP(block)	((unsigned long)((block) >> 15))
+
+TRACE_EVENT(next3_snapshot_test_and_cow,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, sector_t block,
+		 int cow, sector_t blk, int ret),
+
+	TP_ARGS(sb, snapshot, block, cow, blk, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	sector_t,	block		)
+		__field(	sector_t,	blk		)
+		__field(	int,		cow		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->snapshot	= snapshot;
+		__entry->block		= block;
+		__entry->blk		= blk;
+		__entry->cow		= cow;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d snapshot %u block %llu group %lu cow %d "
+		  "mapped %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long long) __entry->block,
+		  NEXT3_TRACE_GROUP(__entry->block), __entry->cow,
+		  (unsigned long long) __entry->blk, __entry->ret)
+);
+
+TRACE_EVENT(next3_snapshot_test_and_move,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, ino_t ino,
+		 sector_t block, int count, int move, int ret),
+
+	TP_ARGS(sb, snapshot, ino, block, count, move, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	ino_t,		ino		)
+		__field(	sector_t,	block		)
+		__field(	int,		count		)
+		__field(	int,		move		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->snapshot	= snapshot;
+		__entry->ino		= ino;
+		__entry->block		= block;
+		__entry->count		= count;
+		__entry->move		= move;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d snapshot %u ino %lu block %llu group %lu "
+		  "count %d move %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long) __entry->ino,
+		  (unsigned long long) __entry->block,
+		  NEXT3_TRACE_GROUP(__entry->block), __entry->count,
+		  __entry->move, __entry->ret)
+);
+
+/* start of a COW or move, paired with the test_and_* event of the task */
+DECLARE_EVENT_CLASS(next3__snapshot_cow_enter,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, sector_t block),
+
+	TP_ARGS(sb, snapshot, block),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	sector_t,	block		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->snapshot	= snapshot;
+		__entry->block		= block;
+	),
+
+	TP_printk("dev %d,%d snapshot %u block %llu group %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long long) __entry->block,
+		  NEXT3_TRACE_GROUP(__entry->block))
+);
+
+DEFINE_EVENT(next3__snapshot_cow_enter, next3_snapshot_test_and_cow_enter,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, sector_t block),
+
+	TP_ARGS(sb, snapshot, block)
+);
+
+DEFINE_EVENT(next3__snapshot_cow_enter, next3_snapshot_test_and_move_enter,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, sector_t block),
+
+	TP_ARGS(sb, snapshot, block)
+);
+
+TRACE_EVENT(next3_snapshot_read_cow_bitmap,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, unsigned int group,
+		 sector_t cow_bitmap, int init),
+
+	TP_ARGS(sb, snapshot, group, cow_bitmap, init),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	unsigned int,	group		)
+		__field(	sector_t,	cow_bitmap	)
+		__field(	int,		init		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->snapshot	= snapshot;
+		__entry->group		= group;
+		__entry->cow_bitmap	= cow_bitmap;
+		__entry->init		= init;
+	),
+
+	TP_printk("dev %d,%d snapshot %u group %u cow_bitmap %llu init %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, __entry->group,
+		  (unsigned long long) __entry->cow_bitmap, __entry->init)
+);
+
+TRACE_EVENT(next3_snapshot_get_block,
+	TP_PROTO(struct super_block *sb, __u32 snapshot, sector_t iblock,
+		 sector_t block, int tracked, int ret),
+
+	TP_ARGS(sb, snapshot, iblock, block, tracked, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	sector_t,	iblock		)
+		__field(	sector_t,	block		)
+		__field(	int,		tracked		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->snapshot	= snapshot;
+		__entry->iblock		= iblock;
+		__entry->block		= block;
+		__entry->tracked	= tracked;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d snapshot %u block %llu group %lu mapped %llu "
+		  "read_through %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long long) __entry->iblock,
+		  NEXT3_TRACE_GROUP(__entry->iblock),
+		  (unsigned long long) __entry->block, __entry->tracked,
+		  __entry->ret)
+);
+
+/* waits for a pending COW or for tracked reads of a COWed block */
+DECLARE_EVENT_CLASS(next3__snapshot_wait,
+	TP_PROTO(struct super_block *sb, sector_t block, int waits),
+
+	TP_ARGS(sb, block, waits),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	block		)
+		__field(	int,		waits		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->block		= block;
+		__entry->waits		= waits;
+	),
+
+	TP_printk("dev %d,%d block %llu group %lu waits %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long) __entry->block,
+		  NEXT3_TRACE_GROUP(__entry->block), __entry->waits)
+);
+
+DEFINE_EVENT(next3__snapshot_wait, next3_snapshot_test_pending_cow,
+	TP_PROTO(struct super_block *sb, sector_t block, int waits),
+
+	TP_ARGS(sb, block, waits)
+);
+
+DEFINE_EVENT(next3__snapshot_wait, next3_snapshot_tracked_read_wait,
+	TP_PROTO(struct super_block *sb, sector_t block, int waits),
+
+	TP_ARGS(sb, block, waits)
+);
+
+DECLARE_EVENT_CLASS(next3__tracked_read,
+	TP_PROTO(struct buffer_head *bh),
+
+	TP_ARGS(bh),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	block		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= bh->b_bdev->bd_dev;
+		__entry->block		= bh->b_blocknr;
+	),
+
+	TP_printk("dev %d,%d block %llu group %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long) __entry->block,
+		  NEXT3_TRACE_GROUP(__entry->block))
+);
+
+DEFINE_EVENT(next3__tracked_read, next3_start_tracked_read,
+	TP_PROTO(struct buffer_head *bh),
+
+	TP_ARGS(bh)
+);
+
+DEFINE_EVENT(next3__tracked_read, next3_cancel_tracked_read,
+	TP_PROTO(struct buffer_head *bh),
+
+	TP_ARGS(bh)
+);
+
+DEFINE_EVENT(next3__tracked_read, next3_end_tracked_read,
+	TP_PROTO(struct buffer_head *bh),
+
+	TP_ARGS(bh)
+);
+
+TRACE_EVENT(next3_allocate_blocks,
+	TP_PROTO(struct inode *inode, sector_t goal, unsigned long count,
+		 sector_t block, int ret),
+
+	TP_ARGS(inode, goal, count, block, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	sector_t,	goal		)
+		__field(	unsigned long,	count		)
+		__field(	sector_t,	block		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->goal		= goal;
+		__entry->count		= count;
+		__entry->block		= block;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu goal %llu count %lu block %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino,
+		  (unsigned long long) __entry->goal, __entry->count,
+		  (unsigned long long) __entry->block, __entry->ret)
+);
+
+TRACE_EVENT(next3_free_blocks,
+	TP_PROTO(struct inode *inode, sector_t block, unsigned long count),
+
+	TP_ARGS(inode, block, count),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	sector_t,	block		)
+		__field(	unsigned long,	count		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->block		= block;
+		__entry->count		= count;
+	),
+
+	TP_printk("dev %d,%d ino %lu block %llu count %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino,
+		  (unsigned long long) __entry->block, __entry->count)
+);
+
+DECLARE_EVENT_CLASS(next3__truncate,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	loff_t,		size		)
+		__field(	blkcnt_t,	blocks		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->size		= inode->i_size;
+		__entry->blocks		= inode->i_blocks;
+	),
+
+	TP_printk("dev %d,%d ino %lu size %lld blocks %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, (long long) __entry->size,
+		  (unsigned long long) __entry->blocks)
+);
+
+DEFINE_EVENT(next3__truncate, next3_truncate_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+DEFINE_EVENT(next3__truncate, next3_truncate_exit,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+TRACE_EVENT(next3_sync_file_enter,
+	TP_PROTO(struct inode *inode, int datasync),
+
+	TP_ARGS(inode, datasync),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	int,		datasync	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->datasync	= datasync;
+	),
+
+	TP_printk("dev %d,%d ino %lu datasync %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->datasync)
+);
+
+TRACE_EVENT(next3_sync_file_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->ret)
+);
+
+/* snapshot control operations: enter records the snapshot */
+DECLARE_EVENT_CLASS(next3__snapshot_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	ino_t,		ino		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->snapshot	= inode->i_generation;
+		__entry->ino		= inode->i_ino;
+	),
+
+	TP_printk("dev %d,%d snapshot %u ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long) __entry->ino)
+);
+
+/* snapshot control operations: exit records the outcome */
+DECLARE_EVENT_CLASS(next3__snapshot_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		snapshot	)
+		__field(	ino_t,		ino		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->snapshot	= inode->i_generation;
+		__entry->ino		= inode->i_ino;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d snapshot %u ino %lu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->snapshot, (unsigned long) __entry->ino,
+		  __entry->ret)
+);
+
+DEFINE_EVENT(next3__snapshot_enter, next3_snapshot_take_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+DEFINE_EVENT(next3__snapshot_exit, next3_snapshot_take_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret)
+);
+
+DEFINE_EVENT(next3__snapshot_enter, next3_snapshot_remove_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+DEFINE_EVENT(next3__snapshot_exit, next3_snapshot_remove_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret)
+);
+
+DEFINE_EVENT(next3__snapshot_enter, next3_snapshot_shrink_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+DEFINE_EVENT(next3__snapshot_exit, next3_snapshot_shrink_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret)
+);
+
+DEFINE_EVENT(next3__snapshot_enter, next3_snapshot_merge_enter,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode)
+);
+
+DEFINE_EVENT(next3__snapshot_exit, next3_snapshot_merge_exit,
+	TP_PROTO(struct inode *inode, int ret),
+
+	TP_ARGS(inode, ret)
+);
+
+#endif /* _TRACE_NEXT3_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
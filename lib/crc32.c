@@ -47,24 +47,41 @@ MODULE_LICENSE("GPL");
 
 #if CRC_LE_BITS == 8 || CRC_BE_BITS == 8
 
+/*
+ * With CRC_SLICES == 8 (slicing-by-8), each round loads two 32 bit words and
+ * looks up all 8 bytes in 8 independent tables: tab[7..4] for the bytes of
+ * the first word, which is xored with the crc, and tab[3..0] for the bytes
+ * of the second word.  The 8 lookups don't depend on each other, so they
+ * overlap in the pipeline, and the crc dependency chain is half as long as
+ * with slicing-by-4.
+ */
 static inline u32
 crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 {
 # ifdef __LITTLE_ENDIAN
 #  define DO_CRC(x) crc = tab[0][(crc ^ (x)) & 255] ^ (crc >> 8)
-#  define DO_CRC4 crc = tab[3][(crc) & 255] ^ \
-		tab[2][(crc >> 8) & 255] ^ \
-		tab[1][(crc >> 16) & 255] ^ \
-		tab[0][(crc >> 24) & 255]
+#  define DO_CRC4(q) (tab[3][(q) & 255] ^ \
+		tab[2][((q) >> 8) & 255] ^ \
+		tab[1][((q) >> 16) & 255] ^ \
+		tab[0][((q) >> 24) & 255])
+#  define DO_CRC8(q) (tab[7][(q) & 255] ^ \
+		tab[6][((q) >> 8) & 255] ^ \
+		tab[5][((q) >> 16) & 255] ^ \
+		tab[4][((q) >> 24) & 255])
 # else
 #  define DO_CRC(x) crc = tab[0][((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
-#  define DO_CRC4 crc = tab[0][(crc) & 255] ^ \
-		tab[1][(crc >> 8) & 255] ^ \
-		tab[2][(crc >> 16) & 255] ^ \
-		tab[3][(crc >> 24) & 255]
+#  define DO_CRC4(q) (tab[0][(q) & 255] ^ \
+		tab[1][((q) >> 8) & 255] ^ \
+		tab[2][((q) >> 16) & 255] ^ \
+		tab[3][((q) >> 24) & 255])
+#  define DO_CRC8(q) (tab[4][(q) & 255] ^ \
+		tab[5][((q) >> 8) & 255] ^ \
+		tab[6][((q) >> 16) & 255] ^ \
+		tab[7][((q) >> 24) & 255])
 # endif
 	const u32 *b;
 	size_t    rem_len;
+	u32 q;
 
 	/* Align it */
 	if (unlikely((long)buf & 3 && len)) {
@@ -72,14 +89,27 @@ crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 			DO_CRC(*buf++);
 		} while ((--len) && ((long)buf)&3);
 	}
+# if CRC_SLICES == 8
+	rem_len = len & 7;
+	/* load data 64 bits wide, as two 32 bit words */
+	len = len >> 3;
+	b = (const u32 *)buf;
+	for (--b; len; --len) {
+		q = crc ^ *++b; /* use pre increment for speed */
+		crc = DO_CRC8(q);
+		q = *++b;
+		crc ^= DO_CRC4(q);
+	}
+# else
 	rem_len = len & 3;
 	/* load data 32 bits wide, xor data 32 bits wide. */
 	len = len >> 2;
 	b = (const u32 *)buf;
 	for (--b; len; --len) {
-		crc ^= *++b; /* use pre increment for speed */
-		DO_CRC4;
+		q = crc ^ *++b; /* use pre increment for speed */
+		crc = DO_CRC4(q);
 	}
+# endif
 	len = rem_len;
 	/* And the last few bytes */
 	if (len) {
@@ -91,6 +121,7 @@ crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 	return crc;
 #undef DO_CRC
 #undef DO_CRC4
+#undef DO_CRC8
 }
 #endif
 /**
@@ -339,6 +370,7 @@ EXPORT_SYMBOL(crc32_be);
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #if 0				/*Not used at present */
 static void
@@ -440,6 +472,32 @@ static u32 test_step(u32 init, unsigned char *buf, size_t len)
 #define INIT1 0
 #define INIT2 0
 
+/*
+ * Throughput of crc32_le() and crc32_be() over journal block sized buffers.
+ * Build once with -DCRC_SLICES=4 and once with -DCRC_SLICES=8 to compare
+ * slicing-by-4 with slicing-by-8.
+ */
+#define BENCH_SIZE 4096
+#define BENCH_LOOPS 100000
+
+static void bench(const char *name,
+		  u32 (*fn)(u32, unsigned char const *, size_t))
+{
+	static unsigned char buf[BENCH_SIZE];
+	u32 crc = 0;
+	clock_t start;
+	double secs;
+	int i;
+
+	random_garbage(buf, BENCH_SIZE);
+	start = clock();
+	for (i = 0; i < BENCH_LOOPS; i++)
+		crc = fn(crc, buf, BENCH_SIZE);
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("%s: %d slices, %.0f MB/s (crc 0x%08x)\n", name, CRC_SLICES,
+	       (double)BENCH_SIZE * BENCH_LOOPS / (1 << 20) / secs, crc);
+}
+
 int main(void)
 {
 	unsigned char buf1[SIZE + 4];
@@ -465,6 +523,9 @@ int main(void)
 			       crc3, crc1, crc2);
 	}
 	printf("\nAll test complete.  No failures expected.\n");
+
+	bench("crc32_le", crc32_le);
+	bench("crc32_be", crc32_be);
 	return 0;
 }
 
@@ -15,6 +15,14 @@
 # define CRC_BE_BITS 8
 #endif
 
+/*
+ * With 8 bits at a time, how many bytes to process per table lookup round:
+ * 4 (slicing-by-4, 4KB tables) or 8 (slicing-by-8, 8KB tables).
+ */
+#ifndef CRC_SLICES
+# define CRC_SLICES 8
+#endif
+
 /*
  * Little-endian CRC computation.  Used with serial bit streams sent
  * lsbit-first.  Be sure to use cpu_to_le32() to append the computed CRC.
@@ -30,3 +38,7 @@
 #if CRC_BE_BITS > 8 || CRC_BE_BITS < 1 || CRC_BE_BITS & CRC_BE_BITS-1
 # error CRC_BE_BITS must be a power of 2 between 1 and 8
 #endif
+
+#if CRC_SLICES != 4 && CRC_SLICES != 8
+# error CRC_SLICES must be 4 or 8
+#endif
@@ -653,6 +653,55 @@ void balance_dirty_pages_ratelimited_nr(struct address_space *mapping,
 }
 EXPORT_SYMBOL(balance_dirty_pages_ratelimited_nr);
 
+/**
+ * account_fs_write_start - account a write the filesystem submits itself
+ * @bdi: backing device the write goes to
+ * @page: page of the written buffer(s)
+ *
+ * Some writes are caused by the dirty pages of a task, but are submitted by
+ * the filesystem without dirtying a page, e.g. copy-on-write of snapshot
+ * blocks.  Account such a write as writeback of @bdi while it is in flight,
+ * and as a page dirtied by the current task, so balance_dirty_pages()
+ * throttles the task by the real write cost of its dirty pages.  The write
+ * also counts towards the ratelimit of balance_dirty_pages_ratelimited().
+ * Must be paired with account_fs_write_end() on I/O completion.
+ *
+ * The unit is one page, like that of the counters.  A filesystem that
+ * writes blocks smaller than a page must account each page only once
+ * while any of its writes is in flight, not once per block.
+ */
+void account_fs_write_start(struct backing_dev_info *bdi, struct page *page)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	__inc_zone_page_state(page, NR_WRITEBACK);
+	__inc_bdi_stat(bdi, BDI_WRITEBACK);
+	task_dirty_inc(current);
+	__get_cpu_var(bdp_ratelimits)++;
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(account_fs_write_start);
+
+/**
+ * account_fs_write_end - complete a write accounted by account_fs_write_start
+ * @bdi: backing device the write went to
+ * @page: page of the written buffer(s)
+ *
+ * Callable from I/O completion context.
+ */
+void account_fs_write_end(struct backing_dev_info *bdi, struct page *page)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	__dec_zone_page_state(page, NR_WRITEBACK);
+	__dec_bdi_stat(bdi, BDI_WRITEBACK);
+	__bdi_writeout_inc(bdi);
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(account_fs_write_end);
+
 void throttle_vm_writeout(gfp_t gfp_mask)
 {
 	unsigned long background_thresh;
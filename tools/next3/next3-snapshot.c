@@ -0,0 +1,157 @@
+/*
+ * next3-snapshot.c -- take and delete next3 snapshots for test scripts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Usage:
+ *	next3-snapshot take <snapshot dir>/<name>
+ *	next3-snapshot delete <snapshot dir>/<name>
+ *	next3-snapshot map <snapshot file> > <map file>
+ *
+ * 'take' marks the snapshot dir as snapshot dir (chattr +x), creates an
+ * empty snapshot file and adds it to the snapshot list (chattr +S), which
+ * takes the snapshot.  'delete' removes the snapshot from the list
+ * (chattr -S), so it is shrunk and merged by the snapshot cleanup.
+ * 'map' writes the blocks map of the snapshot file to stdout as an array
+ * of raw struct next3_snapshot_map_extent records for offline analysis.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o next3-snapshot next3-snapshot.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+
+/* from fs/next3/next3.h */
+#define NEXT3_SNAPFILE_LIST_FL		0x00000100 /* snapshot is on list */
+#define NEXT3_SNAPFILE_FL		0x01000000 /* snapshot file */
+
+struct next3_snapshot_map_extent {
+	uint64_t me_block;
+	uint64_t me_phys;
+	uint32_t me_count;
+	uint32_t me_flags;
+};
+
+struct next3_snapshot_map {
+	uint32_t sm_count;
+	uint32_t sm_reserved;
+	uint64_t sm_start;
+	struct next3_snapshot_map_extent sm_extents[0];
+};
+#define NEXT3_IOC_SNAPSHOT_MAP		_IOWR('f', 44, struct next3_snapshot_map)
+#define MAP_EXTENTS			170
+
+static int change_flags(const char *path, int oflags,
+			unsigned long set, unsigned long clear)
+{
+	unsigned long flags;
+	int fd, err = 0;
+
+	fd = open(path, oflags, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0) {
+		fprintf(stderr, "get flags of %s: %s\n", path, strerror(errno));
+		err = -1;
+		goto out;
+	}
+	flags = (flags & ~clear) | set;
+	if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0) {
+		fprintf(stderr, "set flags of %s: %s\n", path, strerror(errno));
+		err = -1;
+	}
+out:
+	close(fd);
+	return err;
+}
+
+static int snapshot_take(const char *path)
+{
+	char *copy = strdup(path);
+	int err;
+
+	if (!copy)
+		return -1;
+	/* new files in a snapshot dir are snapshot files */
+	err = change_flags(dirname(copy), O_RDONLY, NEXT3_SNAPFILE_FL, 0);
+	free(copy);
+	if (err)
+		return err;
+	return change_flags(path, O_RDONLY | O_CREAT | O_EXCL,
+			    NEXT3_SNAPFILE_LIST_FL, 0);
+}
+
+static int snapshot_delete(const char *path)
+{
+	return change_flags(path, O_RDONLY, 0, NEXT3_SNAPFILE_LIST_FL);
+}
+
+static int snapshot_map(const char *path)
+{
+	struct next3_snapshot_map *map;
+	size_t size = sizeof(*map) + MAP_EXTENTS * sizeof(map->sm_extents[0]);
+	uint64_t start = 0;
+	int fd, err = 0;
+
+	map = malloc(size);
+	if (!map)
+		return -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		free(map);
+		return -1;
+	}
+	do {
+		memset(map, 0, sizeof(*map));
+		map->sm_count = MAP_EXTENTS;
+		map->sm_start = start;
+		if (ioctl(fd, NEXT3_IOC_SNAPSHOT_MAP, map) < 0) {
+			fprintf(stderr, "map %s: %s\n", path, strerror(errno));
+			err = -1;
+			break;
+		}
+		if (map->sm_count && fwrite(map->sm_extents,
+				sizeof(map->sm_extents[0]), map->sm_count,
+				stdout) != map->sm_count) {
+			fprintf(stderr, "write map: %s\n", strerror(errno));
+			err = -1;
+			break;
+		}
+		/* scan is done when the next block did not move on */
+		if (map->sm_start == start)
+			break;
+		start = map->sm_start;
+	} while (map->sm_count);
+	close(fd);
+	free(map);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && !strcmp(argv[1], "take"))
+		return snapshot_take(argv[2]) ? 1 : 0;
+	if (argc == 3 && !strcmp(argv[1], "delete"))
+		return snapshot_delete(argv[2]) ? 1 : 0;
+	if (argc == 3 && !strcmp(argv[1], "map"))
+		return snapshot_map(argv[2]) ? 1 : 0;
+
+	fprintf(stderr, "usage: %s take|delete|map <snapshot file>\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,138 @@
+#!/bin/sh
+# Snapshot overhead regression test for next3
+#
+# Creates a next3 file system on a loop device, takes a snapshot, runs
+# fixed metadata and data workloads with 'perf bench fs' and compares the
+# throughput and the COW cache hit rate against a stored baseline.
+# Fails if a result drops more than <threshold> percent below its baseline.
+#
+# usage: snapshot-regress.sh [-b baseline] [-u] [-t threshold] [-s fs size MB]
+#	-b	baseline file (default: ./snapshot-regress.baseline)
+#	-u	update the baseline file with the results of this run
+#	-t	allowed drop in percent (default: 10)
+#	-s	file system size in MB (default: 1024)
+#
+# Needs root, losetup, mkfs.ext3 and perf (PERF=<path> to override).
+# The next3-snapshot helper is built from next3-snapshot.c on first use.
+
+BASELINE=./snapshot-regress.baseline
+UPDATE=0
+THRESHOLD=10
+FS_SIZE=1024
+PERF=${PERF:-perf}
+TOOLDIR=$(cd $(dirname $0) && pwd)
+SNAPSHOT=$TOOLDIR/next3-snapshot
+
+while getopts "b:ut:s:" opt ; do
+	case $opt in
+	b) BASELINE=$OPTARG ;;
+	u) UPDATE=1 ;;
+	t) THRESHOLD=$OPTARG ;;
+	s) FS_SIZE=$OPTARG ;;
+	*) sed -n '9,13s/^#//p' $0 ; exit 2 ;;
+	esac
+done
+
+die()
+{
+	echo "snapshot-regress: $*" >&2
+	cleanup
+	exit 2
+}
+
+cleanup()
+{
+	[ -n "$MNT" ] && umount $MNT 2>/dev/null && rmdir $MNT
+	[ -n "$LOOP" ] && losetup -d $LOOP
+	[ -n "$IMAGE" ] && rm -f $IMAGE
+	MNT= ; LOOP= ; IMAGE=
+}
+
+# snapshot_stat <name> - read a counter from the snapshot_stats sysfs file
+snapshot_stat()
+{
+	sed -n "s/^$1: //p" $SYSFS/snapshot_stats
+}
+
+# cow_hit_rate - COW cache hits in percent of all tested blocks since mount
+cow_hit_rate()
+{
+	hit=$(snapshot_stat cow_cache_hit)
+	total=$(( hit + $(snapshot_stat copied) + $(snapshot_stat cow_mapped) \
+		+ $(snapshot_stat cow_bitmap_clear) + $(snapshot_stat excluded) ))
+	[ $total -eq 0 ] && total=1
+	echo $(( hit * 100 / total ))
+}
+
+# bench <suite> <args> - print ops/sec of a 'perf bench fs' suite
+bench()
+{
+	suite=$1 ; shift
+	$PERF bench fs $suite -d $MNT "$@" | \
+		sed -n 's/^ *\([0-9]*\)\.[0-9]* ops\/sec$/\1/p'
+}
+
+[ $(id -u) -eq 0 ] || die "must be run as root"
+if [ ! -x $SNAPSHOT ] ; then
+	${CC:-cc} -Wall -O2 -o $SNAPSHOT $TOOLDIR/next3-snapshot.c || \
+		die "failed to build $SNAPSHOT"
+fi
+
+IMAGE=$(mktemp /tmp/next3-regress.XXXXXX)
+dd if=/dev/zero of=$IMAGE bs=1M count=0 seek=$FS_SIZE 2>/dev/null || \
+	die "failed to create $IMAGE"
+LOOP=$(losetup -f --show $IMAGE) || die "no free loop device"
+mkfs.ext3 -q -F -b 4096 $LOOP || die "mkfs failed"
+MNT=$(mktemp -d /tmp/next3-regress-mnt.XXXXXX)
+mount -t next3 $LOOP $MNT || die "failed to mount next3 on $LOOP"
+SYSFS=/sys/fs/next3/$(basename $LOOP)
+[ -f $SYSFS/snapshot_stats ] || die "no $SYSFS/snapshot_stats"
+mkdir $MNT/.snapshots
+
+RESULTS=$(mktemp /tmp/next3-regress-results.XXXXXX)
+SNAPSHOT_ARGS="-S 1 -c '$SNAPSHOT take $MNT/.snapshots/\$\$'"
+
+# fixed workloads: every run creates/overwrites blocks of a new snapshot
+for suite in metadata-create overwrite fsync-storm ; do
+	case $suite in
+	metadata-create) args="-n 20000" ;;
+	overwrite) args="-n 20000 -s 64MB" ;;
+	fsync-storm) args="-n 2000 -s 64MB" ;;
+	esac
+	ops=$(eval bench $suite $args $SNAPSHOT_ARGS)
+	[ -n "$ops" ] || die "perf bench fs $suite failed"
+	echo "$suite-ops $ops" >> $RESULTS
+done
+echo "cow-cache-hit-rate $(cow_hit_rate)" >> $RESULTS
+echo "copied $(snapshot_stat copied)" >> $RESULTS
+
+cleanup
+cat $RESULTS
+
+if [ $UPDATE -eq 1 ] ; then
+	cp $RESULTS $BASELINE
+	rm -f $RESULTS
+	echo "baseline updated: $BASELINE"
+	exit 0
+fi
+[ -f $BASELINE ] || { rm -f $RESULTS ; die "no baseline $BASELINE (use -u)" ; }
+
+# higher is better for all results, except for the no. of copied blocks
+FAIL=0
+while read name value ; do
+	base=$(sed -n "s/^$name //p" $BASELINE)
+	[ -n "$base" ] || continue
+	if [ $name = copied ] ; then
+		limit=$(( base + base * THRESHOLD / 100 ))
+		[ $value -le $limit ] && continue
+	else
+		limit=$(( base - base * THRESHOLD / 100 ))
+		[ $value -ge $limit ] && continue
+	fi
+	echo "REGRESSION: $name $value (baseline $base, limit $limit)"
+	FAIL=1
+done < $RESULTS
+rm -f $RESULTS
+
+[ $FAIL -eq 0 ] && echo "snapshot-regress: PASS" || echo "snapshot-regress: FAIL"
+exit $FAIL
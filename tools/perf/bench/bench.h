@@ -4,6 +4,11 @@
 extern int bench_sched_messaging(int argc, const char **argv, const char *prefix);
 extern int bench_sched_pipe(int argc, const char **argv, const char *prefix);
 extern int bench_mem_memcpy(int argc, const char **argv, const char *prefix __used);
+extern int bench_fs_metadata_create(int argc, const char **argv, const char *prefix);
+extern int bench_fs_overwrite(int argc, const char **argv, const char *prefix);
+extern int bench_fs_fsync_storm(int argc, const char **argv, const char *prefix);
+extern int bench_fs_large_delete(int argc, const char **argv, const char *prefix);
+extern int bench_fs_dirent_scan(int argc, const char **argv, const char *prefix);
 
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
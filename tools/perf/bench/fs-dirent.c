@@ -0,0 +1,251 @@
+/*
+ *
+ * fs-dirent.c
+ *
+ * dirent-scan: Linear scan of directory blocks for a missing name
+ *
+ * Compares the plain next3_match() scan of search_dirblock() with the
+ * 4 byte name prefilter of CONFIG_NEXT3_FS_DIRENT_PREFILTER, on in-memory
+ * directory blocks in the next3 on-disk format.  With --prefixed, all names
+ * share a common prefix, which is the worst case for the prefilter.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DIR_BLOCK_SIZE		4096
+#define DIR_NAME_LEN		255
+#define DIR_REC_LEN(name_len)	(((name_len) + 8 + 3) & ~3)
+
+static int		nr_blocks	= 256;
+static int		nr_loops	= 1000;
+static bool		prefixed	= false;
+
+static const struct option options[] = {
+	OPT_INTEGER('b', "blocks", &nr_blocks,
+		    "Specify number of directory blocks to scan"),
+	OPT_INTEGER('l', "loops", &nr_loops,
+		    "Specify number of scans of the whole directory"),
+	OPT_BOOLEAN('p', "prefixed", &prefixed,
+		    "Give all names a common prefix (\"file-<n>\")"),
+	OPT_END()
+};
+
+static const char * const bench_fs_dirent_usage[] = {
+	"perf bench fs dirent-scan <options>",
+	NULL
+};
+
+/* same layout as struct next3_dir_entry_2, in host byte order */
+struct dirent2 {
+	u32	inode;
+	u16	rec_len;
+	u8	name_len;
+	u8	file_type;
+	char	name[DIR_NAME_LEN];
+};
+
+struct name_filter {
+	u32	word;
+	u32	mask;
+};
+
+/* next3_match() */
+static inline int match(int len, const char *name, struct dirent2 *de)
+{
+	if (len != de->name_len)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return !memcmp(name, de->name, len);
+}
+
+/* next3_name_filter_init() */
+static void name_filter_init(struct name_filter *f, int len,
+			     const char *name)
+{
+	int n = len < 4 ? len : 4;
+
+	f->word = f->mask = 0;
+	memcpy(&f->word, name, n);
+	memset(&f->mask, 0xff, n);
+}
+
+/* next3_match_filter() */
+static inline int match_filter(int len, const char *name,
+			       const struct name_filter *f, struct dirent2 *de)
+{
+	u32 word;
+
+	if (len != de->name_len)
+		return 0;
+	memcpy(&word, de->name, sizeof(word));
+	if ((word & f->mask) != f->word)
+		return 0;
+	if (!de->inode)
+		return 0;
+	return len <= 4 || !memcmp(name + 4, de->name + 4, len - 4);
+}
+
+/* search_dirblock() without the prefilter */
+static int scan_block_memcmp(char *block, const char *name, int len)
+{
+	char *dlimit = block + DIR_BLOCK_SIZE;
+	struct dirent2 *de = (struct dirent2 *)block;
+
+	while ((char *)de < dlimit) {
+		if ((char *)de + len <= dlimit && match(len, name, de))
+			return 1;
+		de = (struct dirent2 *)((char *)de + de->rec_len);
+	}
+	return 0;
+}
+
+/* search_dirblock() with the prefilter */
+static int scan_block_prefilter(char *block, const char *name, int len)
+{
+	char *dlimit = block + DIR_BLOCK_SIZE;
+	struct dirent2 *de = (struct dirent2 *)block;
+	struct name_filter filter;
+
+	name_filter_init(&filter, len, name);
+	while ((char *)de < dlimit) {
+		if ((char *)de + DIR_REC_LEN(len) <= dlimit &&
+		    match_filter(len, name, &filter, de))
+			return 1;
+		de = (struct dirent2 *)((char *)de + de->rec_len);
+	}
+	return 0;
+}
+
+struct routine {
+	const char *name;
+	int (*fn)(char *block, const char *name, int len);
+};
+
+static struct routine routines[] = {
+	{ "memcmp",	scan_block_memcmp },
+	{ "prefilter",	scan_block_prefilter },
+	{ NULL,		NULL }
+};
+
+static int make_name(char *name, int n)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	int i, len;
+
+	if (prefixed)
+		return sprintf(name, "file-%d", n);
+	len = 4 + rand() % 29;
+	for (i = 0; i < len; i++)
+		name[i] = chars[rand() % (sizeof(chars) - 1)];
+	return len;
+}
+
+/* fill @blocks with directory entries, return no. of entries */
+static int make_dir(char *blocks, int nr)
+{
+	char name[DIR_NAME_LEN + 1];
+	struct dirent2 *de, *last;
+	int b, off, len, n = 0;
+
+	for (b = 0; b < nr; b++) {
+		off = 0;
+		last = NULL;
+		for (;;) {
+			len = make_name(name, n);
+			if (off + DIR_REC_LEN(len) > DIR_BLOCK_SIZE)
+				break;
+			de = (struct dirent2 *)(blocks + b * DIR_BLOCK_SIZE +
+						off);
+			de->inode = n + 12;
+			de->rec_len = DIR_REC_LEN(len);
+			de->name_len = len;
+			de->file_type = 1;
+			memcpy(de->name, name, len);
+			off += de->rec_len;
+			last = de;
+			n++;
+		}
+		/* the last entry covers the rest of the block */
+		if (last)
+			last->rec_len += DIR_BLOCK_SIZE - off;
+	}
+	return n;
+}
+
+static double timeval2double(struct timeval *ts)
+{
+	return (double)ts->tv_sec +
+		(double)ts->tv_usec / (double)1000000;
+}
+
+int bench_fs_dirent_scan(int argc, const char **argv,
+			 const char *prefix __used)
+{
+	char name[DIR_NAME_LEN + 1];
+	struct timeval tv_start, tv_end, tv_diff;
+	char *blocks;
+	int i, b, loop, len, nr_entries, found;
+	double ns;
+
+	argc = parse_options(argc, argv, options, bench_fs_dirent_usage, 0);
+	if (nr_blocks <= 0 || nr_loops <= 0) {
+		fprintf(stderr, "Invalid number of blocks or loops\n");
+		return 1;
+	}
+
+	blocks = zalloc((size_t)nr_blocks * DIR_BLOCK_SIZE);
+	if (!blocks)
+		die("memory allocation failed - maybe too many blocks?\n");
+	nr_entries = make_dir(blocks, nr_blocks);
+
+	/* a name that is not in the directory, like on create */
+	len = make_name(name, nr_entries);
+	if (!prefixed)
+		name[len - 1] = '.';
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# Scanning %d entries in %d blocks %d times for "
+		       "'%.*s' ...\n\n", nr_entries, nr_blocks, nr_loops,
+		       len, name);
+
+	for (i = 0; routines[i].name; i++) {
+		found = 0;
+		BUG_ON(gettimeofday(&tv_start, NULL));
+		for (loop = 0; loop < nr_loops; loop++)
+			for (b = 0; b < nr_blocks; b++)
+				found += routines[i].fn(blocks +
+						b * DIR_BLOCK_SIZE, name, len);
+		BUG_ON(gettimeofday(&tv_end, NULL));
+		BUG_ON(found);
+		timersub(&tv_end, &tv_start, &tv_diff);
+		ns = timeval2double(&tv_diff) * 1000000000.0 /
+			((double)nr_entries * nr_loops);
+
+		switch (bench_format) {
+		case BENCH_FORMAT_DEFAULT:
+			printf(" %-10s %14lf ns/entry\n",
+			       routines[i].name, ns);
+			break;
+		case BENCH_FORMAT_SIMPLE:
+			printf("%lf\n", ns);
+			break;
+		default:
+			/* reaching this means there's some disaster: */
+			die("unknown format: %d\n", bench_format);
+			break;
+		}
+	}
+
+	free(blocks);
+	return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ *
+ * fs.c
+ *
+ * fs: File system workloads for measuring snapshot overhead
+ *
+ * Each workload prepares its files, optionally takes snapshots with a user
+ * supplied command, then times every operation and reports throughput and
+ * latency percentiles.  Run each workload against a mount with 0, 1 and N
+ * snapshots to quantify the snapshot overhead, and with 1..N threads to
+ * get the scaling curve of the file system locks under snapshot load.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define K 1024
+#define FS_BLOCK_SIZE	(4 * K)
+#define FS_WRITE_SIZE	(64 * K)
+
+static const char	*directory	= ".";
+static const char	*size_str	= "64MB";
+static int		nr_ops;
+static int		nr_snapshots;
+static int		nr_threads	= 1;
+static const char	*snapshot_cmd;
+
+static const struct option options[] = {
+	OPT_STRING('d', "directory", &directory, "dir",
+		    "Specify directory on the file system to test"),
+	OPT_INTEGER('n', "nr", &nr_ops,
+		    "Specify number of operations (files for large-delete)"),
+	OPT_STRING('s', "size", &size_str, "64MB",
+		    "Specify file size for overwrite, fsync-storm and "
+		    "large-delete. available unit: B, MB, GB"),
+	OPT_INTEGER('S', "snapshots", &nr_snapshots,
+		    "Specify number of snapshots to take before the test"),
+	OPT_STRING('c', "snapshot-cmd", &snapshot_cmd, "cmd",
+		    "Specify shell command that takes one snapshot"),
+	OPT_INTEGER('t', "threads", &nr_threads,
+		    "Specify number of threads for metadata-create, overwrite "
+		    "and fsync-storm"),
+	OPT_END()
+};
+
+static const char * const bench_fs_usage[] = {
+	"perf bench fs <suite> <options>",
+	NULL
+};
+
+struct fs_result {
+	u64	*lat;		/* per operation latency in usec */
+	int	nr;		/* no. of timed operations */
+	u64	bytes;		/* no. of bytes written */
+	u64	total;		/* total time in usec, including final sync */
+};
+
+/* each thread works on its own files and fills its own latency slice */
+struct fs_worker {
+	pthread_t	thread;
+	int		id;
+	u64		*lat;		/* nr_ops latency slots */
+	u64		bytes;
+	u64		size;		/* overwrite: file size */
+	int		sync_every;	/* overwrite: fsync interval */
+};
+
+static char work_dir[PATH_MAX];
+
+static u64 now_usec(void)
+{
+	struct timeval tv;
+
+	BUG_ON(gettimeofday(&tv, NULL));
+	return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void fs_setup(int default_ops)
+{
+	if (nr_ops <= 0)
+		nr_ops = default_ops;
+	if (nr_snapshots > 0 && !snapshot_cmd)
+		die("--snapshots needs --snapshot-cmd\n");
+	if (nr_threads <= 0)
+		die("Invalid number of threads:%d\n", nr_threads);
+
+	snprintf(work_dir, sizeof(work_dir), "%s/perf-bench-fs.%d",
+		 directory, getpid());
+	if (mkdir(work_dir, 0755))
+		die("mkdir %s: %s\n", work_dir, strerror(errno));
+}
+
+static void fs_cleanup(void)
+{
+	if (rmdir(work_dir))
+		fprintf(stderr, "rmdir %s: %s\n", work_dir, strerror(errno));
+}
+
+/*
+ * Take the snapshots after the test files were created and synced, so the
+ * timed operations modify blocks that are in use by the snapshots.
+ */
+static void take_snapshots(void)
+{
+	int i;
+
+	sync();
+	for (i = 0; i < nr_snapshots; i++) {
+		if (system(snapshot_cmd))
+			die("snapshot command failed: %s\n", snapshot_cmd);
+	}
+	sync();
+}
+
+static void file_name(char *name, size_t len, int i)
+{
+	snprintf(name, len, "%s/f%d", work_dir, i);
+}
+
+static void create_file(const char *name, u64 size)
+{
+	char *buf;
+	u64 pos;
+	int fd;
+
+	buf = zalloc(FS_WRITE_SIZE);
+	if (!buf)
+		die("memory allocation failed\n");
+	memset(buf, 0x5a, FS_WRITE_SIZE);
+
+	fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		die("open %s: %s\n", name, strerror(errno));
+	for (pos = 0; pos < size; pos += FS_WRITE_SIZE) {
+		if (write(fd, buf, FS_WRITE_SIZE) != FS_WRITE_SIZE)
+			die("write %s: %s\n", name, strerror(errno));
+	}
+	if (fsync(fd))
+		die("fsync %s: %s\n", name, strerror(errno));
+	close(fd);
+	free(buf);
+}
+
+static u64 parse_size(void)
+{
+	s64 size = perf_atoll((char *)size_str);
+
+	if (size < FS_WRITE_SIZE)
+		die("Invalid size:%s\n", size_str);
+	return size;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static u64 percentile(struct fs_result *res, double p)
+{
+	int i = (int)(p * res->nr / 100.0);
+
+	if (i >= res->nr)
+		i = res->nr - 1;
+	return res->lat[i];
+}
+
+static void fs_report(const char *op, struct fs_result *res)
+{
+	double sec = (double)res->total / 1000000.0;
+
+	if (!res->nr)
+		die("no operations were run\n");
+	qsort(res->lat, res->nr, sizeof(u64), u64_cmp);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# Executed %d %s operations with %d snapshots "
+		       "and %d threads\n\n", res->nr, op, nr_snapshots,
+		       nr_threads);
+		printf(" %14s: %llu.%03llu [sec]\n\n", "Total time",
+		       res->total / 1000000,
+		       (res->total % 1000000) / 1000);
+		printf(" %14lf ops/sec\n", (double)res->nr / sec);
+		if (res->bytes)
+			printf(" %14lf MB/sec\n",
+			       (double)res->bytes / K / K / sec);
+		printf("\n %14s: %llu [usec]\n", "min latency", res->lat[0]);
+		printf(" %14s: %llu [usec]\n", "50%", percentile(res, 50));
+		printf(" %14s: %llu [usec]\n", "90%", percentile(res, 90));
+		printf(" %14s: %llu [usec]\n", "99%", percentile(res, 99));
+		printf(" %14s: %llu [usec]\n", "99.9%", percentile(res, 99.9));
+		printf(" %14s: %llu [usec]\n", "max latency",
+		       res->lat[res->nr - 1]);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%llu.%03llu\n", res->total / 1000000,
+		       (res->total % 1000000) / 1000);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+	free(res->lat);
+}
+
+static void fs_result_init(struct fs_result *res, int nr)
+{
+	memset(res, 0, sizeof(*res));
+	res->lat = zalloc(nr * sizeof(u64));
+	if (!res->lat)
+		die("memory allocation failed\n");
+}
+
+/*
+ * Run @fn in nr_threads threads, each with its own slice of @res->lat.
+ * Returns the total time in usec, not including the final sync.
+ */
+static u64 fs_run_workers(struct fs_result *res, void *(*fn)(void *),
+			  u64 size, int sync_every)
+{
+	struct fs_worker *workers;
+	u64 start;
+	int i;
+
+	workers = zalloc(nr_threads * sizeof(*workers));
+	if (!workers)
+		die("memory allocation failed\n");
+
+	start = now_usec();
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].lat = res->lat + (u64)i * nr_ops;
+		workers[i].size = size;
+		workers[i].sync_every = sync_every;
+		if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]))
+			die("pthread_create failed\n");
+	}
+	for (i = 0; i < nr_threads; i++) {
+		BUG_ON(pthread_join(workers[i].thread, NULL));
+		res->bytes += workers[i].bytes;
+	}
+	res->nr = nr_ops * nr_threads;
+
+	free(workers);
+	return now_usec() - start;
+}
+
+static void worker_file_name(char *name, size_t len, int id, int i)
+{
+	snprintf(name, len, "%s/t%d.f%d", work_dir, id, i);
+}
+
+static void *metadata_create_worker(void *arg)
+{
+	struct fs_worker *w = arg;
+	char name[PATH_MAX];
+	u64 t;
+	int i, fd;
+
+	for (i = 0; i < nr_ops; i++) {
+		worker_file_name(name, sizeof(name), w->id, i);
+		t = now_usec();
+		fd = open(name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+			die("open %s: %s\n", name, strerror(errno));
+		close(fd);
+		w->lat[i] = now_usec() - t;
+	}
+	return NULL;
+}
+
+int bench_fs_metadata_create(int argc, const char **argv,
+			     const char *prefix __used)
+{
+	struct fs_result res;
+	char name[PATH_MAX];
+	u64 start;
+	int i, j;
+
+	argc = parse_options(argc, argv, options, bench_fs_usage, 0);
+	fs_setup(10000);
+	take_snapshots();
+	fs_result_init(&res, nr_ops * nr_threads);
+
+	start = now_usec();
+	fs_run_workers(&res, metadata_create_worker, 0, 0);
+	sync();
+	res.total = now_usec() - start;
+
+	for (i = 0; i < nr_threads; i++) {
+		for (j = 0; j < nr_ops; j++) {
+			worker_file_name(name, sizeof(name), i, j);
+			unlink(name);
+		}
+	}
+	fs_cleanup();
+	fs_report("file create", &res);
+	return 0;
+}
+
+/* pwrite @nr_ops random blocks of a file and fsync every @sync_every writes */
+static void *overwrite_worker(void *arg)
+{
+	struct fs_worker *w = arg;
+	char name[PATH_MAX];
+	char buf[FS_BLOCK_SIZE];
+	u64 nblocks = w->size / FS_BLOCK_SIZE, t;
+	unsigned int seed = w->id + 1;
+	off_t pos;
+	int i, fd;
+
+	worker_file_name(name, sizeof(name), w->id, 0);
+	fd = open(name, O_WRONLY);
+	if (fd < 0)
+		die("open %s: %s\n", name, strerror(errno));
+	memset(buf, 0xa5, sizeof(buf));
+
+	for (i = 0; i < nr_ops; i++) {
+		/* same block sequence on every run */
+		pos = (off_t)(rand_r(&seed) % nblocks) * FS_BLOCK_SIZE;
+		t = now_usec();
+		if (pwrite(fd, buf, sizeof(buf), pos) != sizeof(buf))
+			die("pwrite %s: %s\n", name, strerror(errno));
+		if (w->sync_every && !((i + 1) % w->sync_every) && fsync(fd))
+			die("fsync %s: %s\n", name, strerror(errno));
+		w->lat[i] = now_usec() - t;
+		w->bytes += sizeof(buf);
+	}
+	if (fsync(fd))
+		die("fsync %s: %s\n", name, strerror(errno));
+	close(fd);
+	return NULL;
+}
+
+static int fs_overwrite(const char *op, int default_ops, int sync_every)
+{
+	struct fs_result res;
+	char name[PATH_MAX];
+	u64 size;
+	int i;
+
+	size = parse_size();
+	fs_setup(default_ops);
+	for (i = 0; i < nr_threads; i++) {
+		worker_file_name(name, sizeof(name), i, 0);
+		create_file(name, size);
+	}
+	take_snapshots();
+	fs_result_init(&res, nr_ops * nr_threads);
+
+	res.total = fs_run_workers(&res, overwrite_worker, size, sync_every);
+
+	for (i = 0; i < nr_threads; i++) {
+		worker_file_name(name, sizeof(name), i, 0);
+		unlink(name);
+	}
+	fs_cleanup();
+	fs_report(op, &res);
+	return 0;
+}
+
+int bench_fs_overwrite(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	argc = parse_options(argc, argv, options, bench_fs_usage, 0);
+	return fs_overwrite("block overwrite", 10000, 0);
+}
+
+int bench_fs_fsync_storm(int argc, const char **argv,
+			 const char *prefix __used)
+{
+	argc = parse_options(argc, argv, options, bench_fs_usage, 0);
+	return fs_overwrite("block overwrite + fsync", 1000, 1);
+}
+
+int bench_fs_large_delete(int argc, const char **argv,
+			  const char *prefix __used)
+{
+	struct fs_result res;
+	char name[PATH_MAX];
+	u64 size, start, t;
+	int i;
+
+	argc = parse_options(argc, argv, options, bench_fs_usage, 0);
+	size = parse_size();
+	fs_setup(8);
+	for (i = 0; i < nr_ops; i++) {
+		file_name(name, sizeof(name), i);
+		create_file(name, size);
+	}
+	take_snapshots();
+	fs_result_init(&res, nr_ops);
+
+	start = now_usec();
+	for (i = 0; i < nr_ops; i++) {
+		file_name(name, sizeof(name), i);
+		t = now_usec();
+		if (unlink(name))
+			die("unlink %s: %s\n", name, strerror(errno));
+		res.lat[res.nr++] = now_usec() - t;
+	}
+	sync();
+	res.total = now_usec() - start;
+
+	fs_cleanup();
+	fs_report("large file delete", &res);
+	return 0;
+}
@@ -13,6 +13,7 @@
  * Available subsystem list:
  *  sched ... scheduler and IPC mechanism
  *  mem   ... memory access performance
+ *  fs    ... file system workloads (e.g. snapshot overhead)
  *
  */
 
@@ -58,6 +59,28 @@ static struct bench_suite mem_suites[] = {
 	  NULL             }
 };
 
+static struct bench_suite fs_suites[] = {
+	{ "metadata-create",
+	  "Create empty files in a new directory",
+	  bench_fs_metadata_create },
+	{ "overwrite",
+	  "Overwrite random blocks of a file",
+	  bench_fs_overwrite },
+	{ "fsync-storm",
+	  "Overwrite random blocks of a file with fsync() after each write",
+	  bench_fs_fsync_storm },
+	{ "large-delete",
+	  "Delete large files",
+	  bench_fs_large_delete },
+	{ "dirent-scan",
+	  "Scan directory blocks with and without the name prefilter",
+	  bench_fs_dirent_scan },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL                     }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +94,9 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "fs",
+	  "file system workloads",
+	  fs_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },
@@ -0,0 +1,190 @@
+# jbd transaction commit timeline and handle waits, by pid
+# Licensed under the terms of the GNU GPL License version 2
+#
+# Displays the timeline of each committed jbd transaction: how long it
+# was open (running) and how long the commit spent locking out handles,
+# flushing data, and writing the log, followed by the handle wait and
+# hold times, and the waits for log space, broken down by comm/pid.
+# If a [comm] arg is specified, only handles of [comm] are displayed.
+
+import os
+import sys
+
+sys.path.append(os.environ['PERF_EXEC_PATH'] + \
+	'/scripts/python/Perf-Trace-Util/lib/Perf/Trace')
+
+from perf_trace_context import *
+from Core import *
+from Util import *
+
+usage = "perf trace -s journal-latency.py [comm]\n";
+
+for_comm = None
+
+if len(sys.argv) > 2:
+	sys.exit(usage)
+
+if len(sys.argv) > 1:
+	for_comm = sys.argv[1]
+
+# (dev, tid) -> event times of the transaction
+transactions = {}
+# (dev, tid) in order of commit end
+committed = []
+
+# pid -> start time of the handle wait, of the handle and of the space wait
+handle_enter = {}
+handle_start = {}
+space_wait = {}
+
+# latency stats by (comm, pid) of handle waits, holds and space waits
+handle_waits = {}
+handle_holds = {}
+space_waits = {}
+
+phases = ("start", "locking", "flushing", "logging", "end")
+
+def trace_begin():
+	pass
+
+def trace_end():
+	print_commit_timeline()
+	print_handle_totals()
+
+def dev_str(dev):
+	return "%d,%d" % (dev >> 20, dev & 0xfffff)
+
+def add_latency(stats, key, delta):
+	s = stats.get(key)
+	if s is None:
+		s = stats[key] = [0, 0, delta, delta]
+	s[0] += 1
+	s[1] += delta
+	s[2] = min(s[2], delta)
+	s[3] = max(s[3], delta)
+
+def commit_event(phase, dev, tid, common_secs, common_nsecs):
+	t = transactions.setdefault((dev, tid), {})
+	t[phase] = nsecs(common_secs, common_nsecs)
+	if phase == "end":
+		committed.append((dev, tid))
+
+def for_pid(common_comm):
+	return for_comm is None or common_comm == for_comm
+
+def jbd__jbd_start_transaction(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, transaction):
+	commit_event("open", dev, transaction, common_secs, common_nsecs)
+
+def jbd__jbd_start_commit(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, sync_commit, transaction):
+	commit_event("start", dev, transaction, common_secs, common_nsecs)
+	transactions[(dev, transaction)]["sync"] = sync_commit
+
+def jbd__jbd_commit_locking(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, sync_commit, transaction):
+	commit_event("locking", dev, transaction, common_secs, common_nsecs)
+
+def jbd__jbd_commit_flushing(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, sync_commit, transaction):
+	commit_event("flushing", dev, transaction, common_secs, common_nsecs)
+
+def jbd__jbd_commit_logging(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, sync_commit, transaction):
+	commit_event("logging", dev, transaction, common_secs, common_nsecs)
+
+def jbd__jbd_end_commit(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, sync_commit, transaction, head):
+	commit_event("end", dev, transaction, common_secs, common_nsecs)
+
+def jbd__jbd_handle_enter(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, transaction, credits, sync):
+	if for_pid(common_comm):
+		handle_enter[common_pid] = nsecs(common_secs, common_nsecs)
+
+def jbd__jbd_handle_start(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, transaction, credits, sync):
+	if not for_pid(common_comm):
+		return
+	now = nsecs(common_secs, common_nsecs)
+	start = handle_enter.pop(common_pid, None)
+	if start is not None:
+		add_latency(handle_waits, (common_comm, common_pid), now - start)
+	handle_start[common_pid] = now
+
+def jbd__jbd_handle_stop(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, transaction, credits, sync):
+	if not for_pid(common_comm):
+		return
+	start = handle_start.pop(common_pid, None)
+	if start is not None:
+		add_latency(handle_holds, (common_comm, common_pid),
+			    nsecs(common_secs, common_nsecs) - start)
+
+def jbd__jbd_wait_for_space(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, nblocks, space_left):
+	if for_pid(common_comm):
+		space_wait[common_pid] = nsecs(common_secs, common_nsecs)
+
+def jbd__jbd_wait_for_space_done(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, nblocks, space_left):
+	if not for_pid(common_comm):
+		return
+	start = space_wait.pop(common_pid, None)
+	if start is not None:
+		add_latency(space_waits, (common_comm, common_pid),
+			    nsecs(common_secs, common_nsecs) - start)
+
+def msecs_str(t, start, end):
+	if start not in t or end not in t:
+		return "%10s" % "-"
+	return "%10.3f" % ((t[end] - t[start]) / 1000000.0)
+
+def print_commit_timeline():
+	print "\njbd transaction commit timeline (ms):\n\n",
+	print "%-10s %10s %4s %10s %10s %10s %10s %10s\n" % ("dev",
+		"tid", "sync", "running", "locking", "flushing",
+		"logging", "commit"),
+	print "%-10s %10s %4s %10s %10s %10s %10s %10s\n" % ("-" * 10,
+		"-" * 10, "-" * 4, "-" * 10, "-" * 10, "-" * 10, "-" * 10,
+		"-" * 10),
+	for key in committed:
+		t = transactions[key]
+		(dev, tid) = key
+		print "%-10s %10d %4d" % (dev_str(dev), tid, t.get("sync", 0)),
+		print "%s %s %s %s %s\n" % (msecs_str(t, "open", "start"),
+			msecs_str(t, "start", "locking"),
+			msecs_str(t, "locking", "flushing"),
+			msecs_str(t, "flushing", "logging"),
+			msecs_str(t, "logging", "end")),
+
+def print_stats(title, stats):
+	print "\n%-30s %10s %12s %12s %12s\n" % (title, "count", "avg(us)",
+		"min(us)", "max(us)"),
+	print "%-30s %10s %12s %12s %12s\n" % ("-" * 30, "-" * 10, "-" * 12,
+		"-" * 12, "-" * 12),
+	for key, s in sorted(stats.iteritems(), \
+			key = lambda(k, v): (v[1], k), reverse = True):
+		print "%-30s %10d %12d %12d %12d\n" % ("%s [%d]" % key, s[0],
+			avg(s[1], s[0]) / 1000, s[2] / 1000, s[3] / 1000),
+
+def print_handle_totals():
+	if for_comm is not None:
+		print "\njbd handles of %s:\n" % (for_comm),
+	else:
+		print "\njbd handles:\n",
+	print_stats("handle wait, comm [pid]", handle_waits)
+	print_stats("handle hold, comm [pid]", handle_holds)
+	if len(space_waits):
+		print_stats("log space wait, comm [pid]", space_waits)
@@ -0,0 +1,141 @@
+# next3 snapshot COW and move latency, by snapshot and by pid
+# Licensed under the terms of the GNU GPL License version 2
+#
+# Displays the latency of the snapshot COW (metadata copy-on-write) and
+# move (data move-on-write) operations, from the test_and_* enter event
+# to the test_and_* event of the same task, broken down by snapshot and
+# by comm/pid, along with the waits for pending COWs.
+# If a [comm] arg is specified, only operations of [comm] are displayed.
+
+import os
+import sys
+
+sys.path.append(os.environ['PERF_EXEC_PATH'] + \
+	'/scripts/python/Perf-Trace-Util/lib/Perf/Trace')
+
+from perf_trace_context import *
+from Core import *
+from Util import *
+
+usage = "perf trace -s snapshot-latency.py [comm]\n";
+
+for_comm = None
+
+if len(sys.argv) > 2:
+	sys.exit(usage)
+
+if len(sys.argv) > 1:
+	for_comm = sys.argv[1]
+
+# pid -> (operation, start time) of the COW or move in progress
+pending = {}
+
+# latency stats by (dev, snapshot, operation) and by (comm, pid, operation)
+by_snapshot = {}
+by_pid = {}
+
+# pending COW waits by (comm, pid)
+cow_waits = {}
+
+def trace_begin():
+	pass
+
+def trace_end():
+	print_latency_totals()
+
+def dev_str(dev):
+	return "%d,%d" % (dev >> 20, dev & 0xfffff)
+
+def add_latency(stats, key, delta, failed):
+	s = stats.get(key)
+	if s is None:
+		s = stats[key] = [0, 0, 0, delta, delta]
+	s[0] += 1
+	if failed:
+		s[1] += 1
+	s[2] += delta
+	s[3] = min(s[3], delta)
+	s[4] = max(s[4], delta)
+
+def op_enter(op, common_secs, common_nsecs, common_pid, common_comm):
+	if for_comm is not None and common_comm != for_comm:
+		return
+	pending[common_pid] = (op, nsecs(common_secs, common_nsecs))
+
+def op_exit(op, common_secs, common_nsecs, common_pid, common_comm,
+	    dev, snapshot, ret):
+	if for_comm is not None and common_comm != for_comm:
+		return
+	start = pending.pop(common_pid, None)
+	if start is None or start[0] != op:
+		return
+	delta = nsecs(common_secs, common_nsecs) - start[1]
+	add_latency(by_snapshot, (dev, snapshot, op), delta, ret < 0)
+	add_latency(by_pid, (common_comm, common_pid, op), delta, ret < 0)
+
+def next3__next3_snapshot_test_and_cow_enter(event_name, context,
+	common_cpu, common_secs, common_nsecs, common_pid, common_comm,
+	dev, snapshot, block):
+	op_enter("cow", common_secs, common_nsecs, common_pid, common_comm)
+
+def next3__next3_snapshot_test_and_move_enter(event_name, context,
+	common_cpu, common_secs, common_nsecs, common_pid, common_comm,
+	dev, snapshot, block):
+	op_enter("move", common_secs, common_nsecs, common_pid, common_comm)
+
+def next3__next3_snapshot_test_and_cow(event_name, context,
+	common_cpu, common_secs, common_nsecs, common_pid, common_comm,
+	dev, snapshot, block, blk, cow, ret):
+	op_exit("cow", common_secs, common_nsecs, common_pid, common_comm,
+		dev, snapshot, ret)
+
+def next3__next3_snapshot_test_and_move(event_name, context,
+	common_cpu, common_secs, common_nsecs, common_pid, common_comm,
+	dev, snapshot, ino, block, count, move, ret):
+	op_exit("move", common_secs, common_nsecs, common_pid, common_comm,
+		dev, snapshot, ret)
+
+def next3__next3_snapshot_test_pending_cow(event_name, context,
+	common_cpu, common_secs, common_nsecs, common_pid, common_comm,
+	dev, block, waits):
+	if for_comm is not None and common_comm != for_comm:
+		return
+	key = (common_comm, common_pid)
+	cow_waits[key] = cow_waits.get(key, 0) + waits
+
+def print_stats(s):
+	print "%10d %10d %12d %12d %12d\n" % (s[0], s[1],
+		avg(s[2], s[0]) / 1000, s[3] / 1000, s[4] / 1000),
+
+def print_header(title):
+	print "%-30s %10s %10s %12s %12s %12s\n" % (title, "count", "errors",
+		"avg(us)", "min(us)", "max(us)"),
+	print "%-30s %10s %10s %12s %12s %12s\n" % ("-" * 30, "-" * 10,
+		"-" * 10, "-" * 12, "-" * 12, "-" * 12),
+
+def print_latency_totals():
+	if for_comm is not None:
+		print "\nsnapshot COW/move latency for %s:\n\n" % (for_comm),
+	else:
+		print "\nsnapshot COW/move latency:\n\n",
+
+	print_header("dev snapshot/op")
+	for key in sorted(by_snapshot.keys()):
+		(dev, snapshot, op) = key
+		print "%-30s" % ("%s %u/%s" % (dev_str(dev), snapshot, op)),
+		print_stats(by_snapshot[key])
+
+	print "\n",
+	print_header("comm [pid]/op")
+	for key, s in sorted(by_pid.iteritems(), \
+			key = lambda(k, v): (v[2], k), reverse = True):
+		(comm, pid, op) = key
+		print "%-30s" % ("%s [%d]/%s" % (comm, pid, op)),
+		print_stats(s)
+
+	if len(cow_waits):
+		print "\n%-30s %10s\n" % ("comm [pid]", "COW waits"),
+		print "%-30s %10s\n" % ("-" * 30, "-" * 10),
+		for key, waits in sorted(cow_waits.iteritems(), \
+				key = lambda(k, v): (v, k), reverse = True):
+			print "%-30s %10d\n" % ("%s [%d]" % key, waits),